@@ -0,0 +1,110 @@
+/*
+ * Benchmark (and sanity check) for ircsnprintf()/ircvsnprintf().
+ * Formats the typical line patterns from the send path and reports
+ * lines/sec, so changes to src/ircsprintf.c can be verified to
+ * actually help the path that dominates CPU profiles.
+ *
+ * Build and run: make && ./ircsprintf_bench
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ircsprintf.h"
+
+#define ITERATIONS 5000000
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* One benchmark case: a format plus representative arguments. */
+static int check_failed = 0;
+
+static void verify(const char *name, const char *got, const char *expected)
+{
+	if (strcmp(got, expected))
+	{
+		fprintf(stderr, "MISMATCH in %s:\n  got     : %s\n  expected: %s\n", name, got, expected);
+		check_failed = 1;
+	}
+}
+
+static void bench_privmsg(void)
+{
+	char buf[512], ref[512];
+	double t;
+	long i;
+
+	ircsnprintf(buf, sizeof(buf), ":%s!%s@%s PRIVMSG %s :%s",
+	            "longernickname", "ident", "host.isp.example.net", "#channel", "the quick brown fox jumps over the lazy dog");
+	snprintf(ref, sizeof(ref), ":%s!%s@%s PRIVMSG %s :%s",
+	            "longernickname", "ident", "host.isp.example.net", "#channel", "the quick brown fox jumps over the lazy dog");
+	verify("privmsg", buf, ref);
+
+	t = now_sec();
+	for (i = 0; i < ITERATIONS; i++)
+		ircsnprintf(buf, sizeof(buf), ":%s!%s@%s PRIVMSG %s :%s",
+		            "longernickname", "ident", "host.isp.example.net", "#channel", "the quick brown fox jumps over the lazy dog");
+	t = now_sec() - t;
+	printf("%-24s %12.0f lines/sec\n", "PRIVMSG fanout line:", ITERATIONS / t);
+}
+
+static void bench_numeric(void)
+{
+	char buf[512], ref[512];
+	double t;
+	long i;
+
+	ircsnprintf(buf, sizeof(buf), ":%s %.3d %s %s", "irc.example.org", 372, "nickname", ":- This is a MOTD line of typical length for such files");
+	snprintf(ref, sizeof(ref), ":%s %.3d %s %s", "irc.example.org", 372, "nickname", ":- This is a MOTD line of typical length for such files");
+	verify("numeric", buf, ref);
+
+	t = now_sec();
+	for (i = 0; i < ITERATIONS; i++)
+		ircsnprintf(buf, sizeof(buf), ":%s %.3d %s %s", "irc.example.org", 372, "nickname", ":- This is a MOTD line of typical length for such files");
+	t = now_sec() - t;
+	printf("%-24s %12.0f lines/sec\n", "numeric reply line:", ITERATIONS / t);
+}
+
+static void bench_integers(void)
+{
+	char buf[512], ref[512];
+	double t;
+	long i;
+
+	ircsnprintf(buf, sizeof(buf), ":%s UID %s %d %lld %s :%s", "001", "nick", 2, (long long)1598017312, "ident", "realname");
+	snprintf(ref, sizeof(ref), ":%s UID %s %d %lld %s :%s", "001", "nick", 2, (long long)1598017312, "ident", "realname");
+	verify("integers", buf, ref);
+
+	t = now_sec();
+	for (i = 0; i < ITERATIONS; i++)
+		ircsnprintf(buf, sizeof(buf), ":%s UID %s %d %lld %s :%s", "001", "nick", 2, (long long)1598017312, "ident", "realname");
+	t = now_sec() - t;
+	printf("%-24s %12.0f lines/sec\n", "server burst line:", ITERATIONS / t);
+}
+
+int main(void)
+{
+	char buf[64];
+
+	/* A few edge cases first */
+	ircsnprintf(buf, sizeof(buf), "%d %d %u %.3d %03d %%", 0, -12345, 0U, 5, 7);
+	verify("edge cases", buf, "0 -12345 0 005 007 %");
+	ircsnprintf(buf, 8, "%s", "truncate-me");
+	verify("truncation", buf, "truncat");
+
+	bench_privmsg();
+	bench_numeric();
+	bench_integers();
+
+	if (check_failed)
+	{
+		fprintf(stderr, "Output verification FAILED\n");
+		return 1;
+	}
+	return 0;
+}
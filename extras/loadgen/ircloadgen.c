@@ -0,0 +1,793 @@
+/* ircloadgen - protocol-level load generator and fanout benchmark.
+ *
+ * Opens N client connections (plaintext, TLS or websocket), joins them
+ * to a set of channels and drives a PRIVMSG workload - either the
+ * built-in one or a recorded trace - while measuring end-to-end
+ * delivery latency: every generated PRIVMSG embeds a monotonic
+ * timestamp ("LAT <ns>") and every receiving connection samples the
+ * delta on arrival, so both the echo path and the channel fanout path
+ * are covered. At the end the tool prints throughput plus latency
+ * percentiles (p50/p90/p99/p99.9/max) in a stable one-line-per-metric
+ * format suitable for diffing between builds.
+ *
+ * Examples:
+ *   ./ircloadgen -s 127.0.0.1 -p 6667 -n 500 -c 10 -r 5 -t 30
+ *   ./ircloadgen -s 127.0.0.1 -p 6697 -T -n 100 -t 30
+ *   ./ircloadgen -s 127.0.0.1 -p 6667 -W -n 100 -t 30
+ *   ./ircloadgen -s 127.0.0.1 -p 6667 -n 100 -f trace.txt -t 60
+ *
+ * Trace files contain one raw IRC line per entry ('#' comments and
+ * blank lines are skipped). "%i" expands to the connection index and
+ * "%lat%" to a fresh "LAT <ns>" token, e.g.:
+ *   JOIN #trace%i
+ *   PRIVMSG #trace%i :%lat% replayed payload
+ *
+ * This is a testing aid, standalone on purpose: it shares no code with
+ * the daemon so it keeps building while the tree under test is broken.
+ */
+
+#define _GNU_SOURCE /* memmem */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+
+#define MAXCONNS 10000
+#define READBUFSZ 16384
+#define WRITEBUFSZ 65536
+#define LINESZ 512
+#define MAXTRACE 4096
+#define MAXSAMPLES (4*1024*1024)
+
+enum connstate {
+	STATE_CONNECTING,
+	STATE_TLS_HANDSHAKE,
+	STATE_WS_HANDSHAKE,
+	STATE_REGISTERING,
+	STATE_RUNNING,
+	STATE_DEAD
+};
+
+typedef struct Conn {
+	int fd;
+	int idx;
+	enum connstate state;
+	SSL *ssl;
+	int ws;				/* websocket framing active */
+	int ws_got_upgrade;
+	char readbuf[READBUFSZ];
+	int readlen;
+	char writebuf[WRITEBUFSZ];
+	int writelen;
+	int tracepos;
+	double send_credit;		/* rate limiter, in messages */
+	long long sent, received;
+} Conn;
+
+static const char *opt_server = "127.0.0.1";
+static int opt_port = 6667;
+static int opt_nconns = 100;
+static int opt_nchans = 10;
+static double opt_rate = 1.0;		/* messages per second per client */
+static int opt_secs = 30;
+static int opt_tls = 0;
+static int opt_websocket = 0;
+static const char *opt_tracefile = NULL;
+static const char *opt_password = NULL;
+
+static Conn *conns;
+static struct pollfd *pfds;
+static SSL_CTX *ssl_ctx;
+static char *tracelines[MAXTRACE];
+static int ntracelines = 0;
+
+static uint64_t *samples;
+static int nsamples = 0;
+static long long total_sent = 0, total_received = 0, total_lines_in = 0;
+static int connected_peak = 0;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+/* == Buffered, transport-agnostic I/O == */
+
+static int transport_write(Conn *c, const char *data, int len)
+{
+	int r;
+
+	if (c->ssl)
+	{
+		r = SSL_write(c->ssl, data, len);
+		if (r <= 0)
+		{
+			int err = SSL_get_error(c->ssl, r);
+			if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+				return 0;
+			return -1;
+		}
+		return r;
+	}
+	r = send(c->fd, data, len, 0);
+	if (r < 0)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		return -1;
+	}
+	return r;
+}
+
+static int transport_read(Conn *c, char *data, int len)
+{
+	int r;
+
+	if (c->ssl)
+	{
+		r = SSL_read(c->ssl, data, len);
+		if (r <= 0)
+		{
+			int err = SSL_get_error(c->ssl, r);
+			if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+				return 0;
+			return -1;
+		}
+		return r;
+	}
+	r = recv(c->fd, data, len, 0);
+	if (r < 0)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		return -1;
+	}
+	if (r == 0)
+		return -1;
+	return r;
+}
+
+static void conn_kill(Conn *c)
+{
+	if (c->state == STATE_DEAD)
+		return;
+	if (c->ssl)
+	{
+		SSL_free(c->ssl);
+		c->ssl = NULL;
+	}
+	if (c->fd >= 0)
+		close(c->fd);
+	c->fd = -1;
+	c->state = STATE_DEAD;
+}
+
+/** Queues raw bytes on the connection's write buffer */
+static void conn_queue_raw(Conn *c, const char *data, int len)
+{
+	if (c->writelen + len > WRITEBUFSZ)
+	{
+		/* Sendq full: the server is not keeping up with this
+		 * connection; drop it rather than stall the whole run.
+		 */
+		conn_kill(c);
+		return;
+	}
+	memcpy(c->writebuf + c->writelen, data, len);
+	c->writelen += len;
+}
+
+/** Queues one IRC protocol line, applying websocket framing if needed */
+static void conn_queue_line(Conn *c, const char *line)
+{
+	int len = strlen(line);
+	unsigned char hdr[8];
+	unsigned char mask[4];
+	char masked[LINESZ];
+	int hlen, i;
+
+	if (len > LINESZ - 2)
+		len = LINESZ - 2;
+
+	if (!c->ws)
+	{
+		conn_queue_raw(c, line, len);
+		conn_queue_raw(c, "\r\n", 2);
+		return;
+	}
+
+	/* One masked websocket text frame per line, without CRLF */
+	hdr[0] = 0x81; /* FIN + text */
+	if (len < 126)
+	{
+		hdr[1] = 0x80 | len;
+		hlen = 2;
+	} else {
+		hdr[1] = 0x80 | 126;
+		hdr[2] = len >> 8;
+		hdr[3] = len & 0xff;
+		hlen = 4;
+	}
+	RAND_bytes(mask, 4);
+	for (i = 0; i < len; i++)
+		masked[i] = line[i] ^ mask[i & 3];
+	conn_queue_raw(c, (char *)hdr, hlen);
+	conn_queue_raw(c, (char *)mask, 4);
+	conn_queue_raw(c, masked, len);
+}
+
+static void conn_flush(Conn *c)
+{
+	int r;
+
+	while (c->writelen > 0)
+	{
+		r = transport_write(c, c->writebuf, c->writelen);
+		if (r < 0)
+		{
+			conn_kill(c);
+			return;
+		}
+		if (r == 0)
+			return; /* would block, poll will retry */
+		memmove(c->writebuf, c->writebuf + r, c->writelen - r);
+		c->writelen -= r;
+	}
+}
+
+/* == Protocol == */
+
+static void conn_start_registration(Conn *c)
+{
+	char line[LINESZ];
+
+	c->state = STATE_REGISTERING;
+	if (opt_password)
+	{
+		snprintf(line, sizeof(line), "PASS :%s", opt_password);
+		conn_queue_line(c, line);
+	}
+	snprintf(line, sizeof(line), "NICK load%d", c->idx);
+	conn_queue_line(c, line);
+	snprintf(line, sizeof(line), "USER load%d 0 * :load generator", c->idx);
+	conn_queue_line(c, line);
+}
+
+static void conn_send_ws_handshake(Conn *c)
+{
+	unsigned char keybytes[16];
+	char key[32];
+	char req[512];
+	static const char b64tab[] =
+	    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	int i, o = 0;
+
+	RAND_bytes(keybytes, sizeof(keybytes));
+	for (i = 0; i < 15; i += 3)
+	{
+		key[o++] = b64tab[keybytes[i] >> 2];
+		key[o++] = b64tab[((keybytes[i] & 0x3) << 4) | (keybytes[i+1] >> 4)];
+		key[o++] = b64tab[((keybytes[i+1] & 0xf) << 2) | (keybytes[i+2] >> 6)];
+		key[o++] = b64tab[keybytes[i+2] & 0x3f];
+	}
+	key[o++] = b64tab[keybytes[15] >> 2];
+	key[o++] = b64tab[(keybytes[15] & 0x3) << 4];
+	key[o++] = '=';
+	key[o++] = '=';
+	key[o] = '\0';
+
+	snprintf(req, sizeof(req),
+	    "GET / HTTP/1.1\r\n"
+	    "Host: %s:%d\r\n"
+	    "Upgrade: websocket\r\n"
+	    "Connection: Upgrade\r\n"
+	    "Sec-WebSocket-Key: %s\r\n"
+	    "Sec-WebSocket-Version: 13\r\n"
+	    "\r\n",
+	    opt_server, opt_port, key);
+	conn_queue_raw(c, req, strlen(req));
+	c->state = STATE_WS_HANDSHAKE;
+}
+
+static void record_latency(uint64_t delta)
+{
+	if (nsamples < MAXSAMPLES)
+		samples[nsamples++] = delta;
+	else
+		samples[rand() % MAXSAMPLES] = delta; /* reservoir-ish */
+	total_received++;
+}
+
+/** Handles one inbound IRC line */
+static void conn_handle_line(Conn *c, char *line)
+{
+	char *p;
+
+	total_lines_in++;
+	c->received++;
+
+	if (!strncmp(line, "PING", 4) && (!line[4] || line[4] == ' ' || line[4] == ':'))
+	{
+		char pong[LINESZ];
+		snprintf(pong, sizeof(pong), "PONG%s", line + 4);
+		conn_queue_line(c, pong);
+		return;
+	}
+
+	/* Latency sample: any PRIVMSG whose payload starts "LAT <ns>" */
+	if ((p = strstr(line, " :LAT ")))
+	{
+		uint64_t sent_at = strtoull(p + 6, NULL, 10);
+		uint64_t now = now_ns();
+		if (sent_at && sent_at <= now)
+			record_latency(now - sent_at);
+		return;
+	}
+
+	if (c->state == STATE_REGISTERING)
+	{
+		/* ":server 001 nick :Welcome..." */
+		p = strchr(line, ' ');
+		if (p && !strncmp(p + 1, "001 ", 4))
+		{
+			char join[LINESZ];
+			c->state = STATE_RUNNING;
+			if (!ntracelines)
+			{
+				snprintf(join, sizeof(join), "JOIN #load%d",
+				    c->idx % opt_nchans);
+				conn_queue_line(c, join);
+			}
+		}
+	}
+}
+
+/** Splits buffered input into lines (or websocket frames) */
+static void conn_handle_input(Conn *c)
+{
+	char *eol;
+
+	if (c->state == STATE_WS_HANDSHAKE)
+	{
+		char *end = memmem(c->readbuf, c->readlen, "\r\n\r\n", 4);
+		if (!end)
+			return;
+		if (c->readlen < 12 || strncmp(c->readbuf + 9, "101", 3))
+		{
+			conn_kill(c);
+			return;
+		}
+		c->readlen -= (end + 4) - c->readbuf;
+		memmove(c->readbuf, end + 4, c->readlen);
+		conn_start_registration(c);
+	}
+
+	if (c->ws && c->state != STATE_WS_HANDSHAKE)
+	{
+		/* Unmasked server frames: opcode, 7-bit/16-bit length */
+		for (;;)
+		{
+			unsigned char *b = (unsigned char *)c->readbuf;
+			int len, hlen, opcode;
+			char save;
+
+			if (c->readlen < 2)
+				return;
+			opcode = b[0] & 0x0f;
+			len = b[1] & 0x7f;
+			hlen = 2;
+			if (len == 126)
+			{
+				if (c->readlen < 4)
+					return;
+				len = (b[2] << 8) | b[3];
+				hlen = 4;
+			}
+			else if (len == 127)
+			{
+				conn_kill(c); /* >64KB frames not expected */
+				return;
+			}
+			if (c->readlen < hlen + len)
+				return;
+			if (opcode == 1 || opcode == 2)
+			{
+				save = c->readbuf[hlen + len];
+				c->readbuf[hlen + len] = '\0';
+				conn_handle_line(c, c->readbuf + hlen);
+				c->readbuf[hlen + len] = save;
+			}
+			else if (opcode == 8)
+			{
+				conn_kill(c);
+				return;
+			}
+			c->readlen -= hlen + len;
+			memmove(c->readbuf, c->readbuf + hlen + len, c->readlen);
+		}
+	}
+
+	while ((eol = memchr(c->readbuf, '\n', c->readlen)))
+	{
+		int linelen = eol - c->readbuf;
+		*eol = '\0';
+		if (linelen && eol[-1] == '\r')
+			eol[-1] = '\0';
+		conn_handle_line(c, c->readbuf);
+		if (c->state == STATE_DEAD)
+			return;
+		c->readlen -= linelen + 1;
+		memmove(c->readbuf, eol + 1, c->readlen);
+	}
+	if (c->readlen >= READBUFSZ)
+		conn_kill(c); /* oversized line */
+}
+
+/* == Workload generation == */
+
+/** Expands %i and %lat% in a trace line */
+static void expand_trace_line(Conn *c, const char *in, char *out, int outsz)
+{
+	int o = 0;
+
+	while (*in && o < outsz - 1)
+	{
+		if (in[0] == '%' && in[1] == 'i')
+		{
+			o += snprintf(out + o, outsz - o, "%d", c->idx);
+			in += 2;
+		}
+		else if (!strncmp(in, "%lat%", 5))
+		{
+			o += snprintf(out + o, outsz - o, "LAT %llu",
+			    (unsigned long long)now_ns());
+			in += 5;
+		}
+		else
+			out[o++] = *in++;
+	}
+	out[o] = '\0';
+}
+
+static void conn_generate(Conn *c, double credit)
+{
+	char line[LINESZ];
+
+	if (c->state != STATE_RUNNING)
+		return;
+
+	c->send_credit += credit;
+	while (c->send_credit >= 1.0)
+	{
+		c->send_credit -= 1.0;
+		if (ntracelines)
+		{
+			expand_trace_line(c, tracelines[c->tracepos], line, sizeof(line));
+			c->tracepos = (c->tracepos + 1) % ntracelines;
+		}
+		else
+		{
+			snprintf(line, sizeof(line),
+			    "PRIVMSG #load%d :LAT %llu abcdefghijklmnopqrstuvwxyz0123456789",
+			    c->idx % opt_nchans, (unsigned long long)now_ns());
+		}
+		conn_queue_line(c, line);
+		c->sent++;
+		total_sent++;
+		if (c->state == STATE_DEAD)
+			return;
+	}
+}
+
+/* == Setup == */
+
+static void conn_open(Conn *c, int idx)
+{
+	struct sockaddr_in sin;
+	int fd, flags, on = 1;
+
+	memset(c, 0, sizeof(*c));
+	c->idx = idx;
+	c->fd = -1;
+	c->state = STATE_DEAD;
+	c->ws = opt_websocket;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		die("socket");
+	flags = fcntl(fd, F_GETFL, 0);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(opt_port);
+	if (inet_pton(AF_INET, opt_server, &sin.sin_addr) != 1)
+	{
+		fprintf(stderr, "Invalid server address '%s' (use an IPv4 address)\n", opt_server);
+		exit(1);
+	}
+
+	if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 &&
+	    errno != EINPROGRESS)
+	{
+		close(fd);
+		return;
+	}
+	c->fd = fd;
+	c->state = STATE_CONNECTING;
+}
+
+static void conn_connected(Conn *c)
+{
+	if (opt_tls)
+	{
+		c->ssl = SSL_new(ssl_ctx);
+		SSL_set_fd(c->ssl, c->fd);
+		SSL_set_connect_state(c->ssl);
+		c->state = STATE_TLS_HANDSHAKE;
+		return;
+	}
+	if (c->ws)
+		conn_send_ws_handshake(c);
+	else
+		conn_start_registration(c);
+}
+
+static void load_trace(const char *filename)
+{
+	FILE *fd = fopen(filename, "r");
+	char line[LINESZ];
+
+	if (!fd)
+		die("trace file");
+	while (fgets(line, sizeof(line), fd) && ntracelines < MAXTRACE)
+	{
+		char *p = strchr(line, '\n');
+		if (p)
+			*p = '\0';
+		p = strchr(line, '\r');
+		if (p)
+			*p = '\0';
+		if (!*line || *line == '#')
+			continue;
+		tracelines[ntracelines++] = strdup(line);
+	}
+	fclose(fd);
+	if (!ntracelines)
+	{
+		fprintf(stderr, "Trace file '%s' contains no usable lines\n", filename);
+		exit(1);
+	}
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void print_percentile(const char *name, double pct)
+{
+	int i = (int)((nsamples - 1) * pct);
+	printf("LOADGEN latency_%-8s %12.3f ms\n", name, samples[i] / 1e6);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+	    "Usage: %s [options]\n"
+	    "  -s <addr>    server IPv4 address (default 127.0.0.1)\n"
+	    "  -p <port>    port (default 6667)\n"
+	    "  -n <conns>   number of connections (default 100, max %d)\n"
+	    "  -c <chans>   number of channels for the built-in workload (default 10)\n"
+	    "  -r <rate>    messages/second per connection (default 1.0)\n"
+	    "  -t <secs>    test duration (default 30)\n"
+	    "  -T           connect with TLS\n"
+	    "  -W           connect with websocket framing\n"
+	    "  -f <file>    replay a trace file instead of the built-in workload\n"
+	    "  -P <pass>    send PASS <pass> on registration\n",
+	    argv0, MAXCONNS);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, i, alive;
+	uint64_t start, deadline, last_tick;
+
+	while ((opt = getopt(argc, argv, "s:p:n:c:r:t:TWf:P:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 's': opt_server = optarg; break;
+			case 'p': opt_port = atoi(optarg); break;
+			case 'n': opt_nconns = atoi(optarg); break;
+			case 'c': opt_nchans = atoi(optarg); break;
+			case 'r': opt_rate = atof(optarg); break;
+			case 't': opt_secs = atoi(optarg); break;
+			case 'T': opt_tls = 1; break;
+			case 'W': opt_websocket = 1; break;
+			case 'f': opt_tracefile = optarg; break;
+			case 'P': opt_password = optarg; break;
+			default: usage(argv[0]);
+		}
+	}
+	if (opt_nconns < 1 || opt_nconns > MAXCONNS || opt_nchans < 1 || opt_secs < 1)
+		usage(argv[0]);
+
+	if (opt_tracefile)
+		load_trace(opt_tracefile);
+
+	if (opt_tls)
+	{
+		SSL_library_init();
+		ssl_ctx = SSL_CTX_new(TLS_client_method());
+		if (!ssl_ctx)
+			die("SSL_CTX_new");
+		SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_NONE, NULL);
+	}
+
+	conns = calloc(opt_nconns, sizeof(Conn));
+	pfds = calloc(opt_nconns, sizeof(struct pollfd));
+	samples = calloc(MAXSAMPLES, sizeof(uint64_t));
+	if (!conns || !pfds || !samples)
+		die("calloc");
+
+	for (i = 0; i < opt_nconns; i++)
+		conn_open(&conns[i], i);
+
+	start = last_tick = now_ns();
+	deadline = start + (uint64_t)opt_secs * 1000000000ULL;
+
+	for (;;)
+	{
+		uint64_t now = now_ns();
+		double elapsed;
+		int nfds = 0, running = 0;
+
+		if (now >= deadline)
+			break;
+
+		/* Rate-limited workload generation, once per tick */
+		elapsed = (now - last_tick) / 1e9;
+		last_tick = now;
+		for (i = 0; i < opt_nconns; i++)
+		{
+			conn_generate(&conns[i], elapsed * opt_rate);
+			if (conns[i].state == STATE_RUNNING)
+				running++;
+		}
+		if (running > connected_peak)
+			connected_peak = running;
+
+		alive = 0;
+		for (i = 0; i < opt_nconns; i++)
+		{
+			Conn *c = &conns[i];
+			if (c->state == STATE_DEAD)
+				continue;
+			pfds[nfds].fd = c->fd;
+			pfds[nfds].events = POLLIN;
+			if (c->writelen || c->state == STATE_CONNECTING ||
+			    c->state == STATE_TLS_HANDSHAKE)
+				pfds[nfds].events |= POLLOUT;
+			pfds[nfds].revents = 0;
+			nfds++;
+			alive++;
+		}
+		if (!alive)
+			break;
+
+		if (poll(pfds, nfds, 10) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			die("poll");
+		}
+
+		nfds = 0;
+		for (i = 0; i < opt_nconns; i++)
+		{
+			Conn *c = &conns[i];
+			short re;
+
+			if (c->state == STATE_DEAD)
+				continue;
+			re = pfds[nfds++].revents;
+			if (re & (POLLERR | POLLHUP))
+			{
+				conn_kill(c);
+				continue;
+			}
+
+			if (c->state == STATE_CONNECTING && (re & POLLOUT))
+				conn_connected(c);
+
+			if (c->state == STATE_TLS_HANDSHAKE && re)
+			{
+				int r = SSL_do_handshake(c->ssl);
+				if (r == 1)
+				{
+					if (c->ws)
+						conn_send_ws_handshake(c);
+					else
+						conn_start_registration(c);
+				}
+				else
+				{
+					int err = SSL_get_error(c->ssl, r);
+					if (err != SSL_ERROR_WANT_READ &&
+					    err != SSL_ERROR_WANT_WRITE)
+					{
+						conn_kill(c);
+						continue;
+					}
+				}
+			}
+
+			if (c->state != STATE_CONNECTING &&
+			    c->state != STATE_TLS_HANDSHAKE && (re & POLLIN))
+			{
+				int r = transport_read(c, c->readbuf + c->readlen,
+				    READBUFSZ - c->readlen);
+				if (r < 0)
+				{
+					conn_kill(c);
+					continue;
+				}
+				c->readlen += r;
+				if (r)
+					conn_handle_input(c);
+			}
+
+			if (c->state != STATE_DEAD && c->writelen)
+				conn_flush(c);
+		}
+	}
+
+	/* == Report == */
+	{
+		double secs = (now_ns() - start) / 1e9;
+
+		printf("LOADGEN conns_requested   %12d\n", opt_nconns);
+		printf("LOADGEN conns_peak        %12d\n", connected_peak);
+		printf("LOADGEN duration          %12.1f s\n", secs);
+		printf("LOADGEN messages_sent     %12lld (%.0f/sec)\n",
+		    total_sent, total_sent / secs);
+		printf("LOADGEN lines_received    %12lld (%.0f/sec)\n",
+		    total_lines_in, total_lines_in / secs);
+		printf("LOADGEN latency_samples   %12d\n", nsamples);
+		if (nsamples)
+		{
+			qsort(samples, nsamples, sizeof(uint64_t), cmp_u64);
+			print_percentile("p50", 0.50);
+			print_percentile("p90", 0.90);
+			print_percentile("p99", 0.99);
+			print_percentile("p999", 0.999);
+			print_percentile("max", 1.0);
+		}
+	}
+
+	return 0;
+}
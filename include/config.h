@@ -42,9 +42,19 @@
  * followed by kqueue, followed by poll, and then finally select.
  * Kind of ugly, but it gets the job done.  You can also fiddle with
  * this to determine what backend is used.
+ * On Linux 5.11+ you can additionally define USE_IOURING to get the
+ * io_uring engine, which batches all readiness (un)registrations and
+ * the event wait into a single syscall per main loop iteration.
+ * With the epoll engine you can define USE_EPOLLET to use epoll in
+ * edge-triggered mode: interest changes are then tracked in userspace
+ * instead of through an epoll_ctl() call per change.
+ * On Windows an I/O completion port engine is used, see the IOCP
+ * section in src/dispatch.c for how that maps onto readiness.
  */
 #ifndef _WIN32
-# ifdef HAVE_EPOLL
+# if defined(USE_IOURING) && defined(__linux__)
+#  define BACKEND_IOURING
+# elif defined(HAVE_EPOLL)
 #  define BACKEND_EPOLL
 # else
 #  ifdef HAVE_KQUEUE
@@ -58,7 +68,15 @@
 #  endif
 # endif
 #else
-# define BACKEND_SELECT
+/* On Windows the I/O completion port engine is the default: it scales
+ * far beyond the old select() backend. Define USE_SELECT to get the
+ * old behaviour back.
+ */
+# ifdef USE_SELECT
+#  define BACKEND_SELECT
+# else
+#  define BACKEND_IOCP
+# endif
 #endif
 
 /* Define the ircd module suffix, should be .so on UNIX, and .dll on Windows. */
@@ -101,6 +119,16 @@
 /* Similarly, DEBUG_IOENGINE can be used to debug the I/O engine. */
 /* #undef	DEBUG_IOENGINE */
 
+/* MEMPOOL_DEBUG: makes the memory pools (src/mempool.c) poison items on
+ * release and keep a per-slot generation counter, so write-after-free,
+ * double free and releases of rogue pointers are caught on the spot
+ * instead of corrupting another item. Costs roughly one memset per
+ * release - far cheaper than valgrind, so this can run on a canary
+ * server at near-production speed. Everything is compiled out when
+ * this is not defined.
+ */
+/* #undef	MEMPOOL_DEBUG */
+
 /*
  * Full pathnames and defaults of irc system's support files.
  */
@@ -113,6 +141,8 @@
 #define VPATH		CONFDIR"/ircd.svsmotd"	/* Services MOTD append. */
 #define BPATH		CONFDIR"/bot.motd"	/* Bot MOTD */
 #define IRCDTUNE 	PERMDATADIR"/ircd.tune"	/* tuning .. */
+#define TLSTICKETKEYFILE PERMDATADIR"/tls-ticket.keys"	/* TLS session ticket keys */
+#define DNSCACHEFILE	PERMDATADIR"/dns.cache"	/* DNS cache snapshot, reloaded on boot */
 
 /** FAKELAG_CONFIGURABLE makes it possible to make certain classes exempted
  * from 'fake lag' (that is, the artificial delay that is added by the ircd
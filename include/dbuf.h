@@ -28,6 +28,13 @@
 /* 512 bytes -- 510 character bytes + \r\n, per rfc1459 */
 #define DBUF_BLOCK_SIZE		(512)
 
+/* Large blocks, used for the sendq of connections whose class has
+ * options { large-sendq-blocks; } set -- typically server links,
+ * which queue many megabytes during (net)bursts and would otherwise
+ * pay allocation, list linkage and flush overhead per 512 bytes.
+ */
+#define DBUF_LARGE_BLOCK_SIZE	(16384)
+
 /*
 ** dbuf is a collection of functions which can be used to
 ** maintain a dynamic buffering of a byte stream.
@@ -46,9 +53,22 @@
 typedef struct dbuf {
 	u_int length;		/* Current number of bytes stored */
 //	u_int offset;		/* Offset to the first byte */
+	unsigned int large;	/* Allocate large blocks from now on? */
 	struct list_head dbuf_list;
 } dbuf;
 
+/*
+** Refcounted immutable message buffer. Used for channel fanout:
+** the line is serialized once and then linked into the sendq of
+** each recipient by reference, instead of copying the same bytes
+** into every single sendq.
+*/
+typedef struct dbufshared {
+	int ref;		/* Reference count */
+	size_t size;		/* Number of bytes in data[] */
+	char data[];		/* The message bytes (including CR+LF) */
+} dbufshared;
+
 /*
 ** And this 'dbufbuf' should never be referenced outside the
 ** implementation of 'dbuf'--would be "hidden" if C had such
@@ -57,13 +77,27 @@ typedef struct dbuf {
 ** page in size. 2048 bytes seems to be the most common size, so
 ** as long as a pointer is 4 bytes, we get 2032 bytes for buffer
 ** data after we take away a bit for malloc to play with. -avalon
+**
+** If 'shared' is non-NULL then the bytes live in the refcounted
+** shared buffer (at shared->data + offset) and data[] is unused.
 */
 typedef struct dbufbuf {
 	struct list_head dbuf_node;
 	size_t size;
-	char data[DBUF_BLOCK_SIZE];
+	size_t capacity;	/* Usable bytes in data[]: DBUF_BLOCK_SIZE or DBUF_LARGE_BLOCK_SIZE */
+	dbufshared *shared;	/* Shared buffer we reference, or NULL */
+	size_t offset;		/* Offset into shared->data (shared blocks only) */
+	char data[DBUF_BLOCK_SIZE];	/* Large blocks extend beyond this (see dbuf_alloc) */
 } dbufbuf;
 
+/*
+** DBufBlockData
+**	Pointer to the first unconsumed byte of a dbufbuf, regardless
+**	of whether the block carries its own bytes or references a
+**	shared buffer.
+*/
+#define DBufBlockData(block) ((block)->shared ? (block)->shared->data + (block)->offset : (block)->data)
+
 /*
 ** dbuf_put
 **	Append the number of bytes to the buffer, allocating more
@@ -96,6 +130,11 @@ void dbuf_delete(dbuf *, size_t);
 
 extern int dbuf_getmsg(dbuf *, char *);
 extern void dbuf_queue_init(dbuf *dyn);
+extern void dbuf_queue_set_large(dbuf *dyn, int large);
 extern void dbuf_init(void);
 
+extern dbufshared *dbuf_shared_create(char *buf, size_t length);
+extern void dbuf_shared_release(dbufshared *ptr);
+extern void dbuf_put_shared(dbuf *dyn, dbufshared *shared);
+
 #endif /* __dbuf_include__ */
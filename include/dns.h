@@ -27,9 +27,9 @@ struct DNSReq {
 typedef struct DNSCache DNSCache;
 
 struct DNSCache {
-	DNSCache *prev, *next;		/**< Previous and next in linked list */
+	DNSCache *prev, *next;		/**< Previous and next in linked list (LRU order, head = most recently used) */
 	DNSCache *hprev, *hnext;	/**< Previous and next in hash list */
-	char *name;					/**< The hostname */
+	char *name;					/**< The hostname, or NULL for a negative entry (IP failed to resolve) */
 	char *ip;					/**< The IP address */
 	time_t expires;				/**< When record expires */
 };
@@ -40,11 +40,19 @@ struct DNSStats {
 	unsigned int cache_hits;
 	unsigned int cache_misses;
 	unsigned int cache_adds;
+	unsigned int cache_hits_negative; /**< Hits on negative entries (saved a doomed lookup) */
+	unsigned int cache_adds_negative;
 };
 
 /** Time to keep cache records. */
 #define DNSCACHE_TTL			600
 
+/** Time to keep negative cache records (failed lookups).
+ * Kept much shorter than DNSCACHE_TTL so a resolver hiccup does not
+ * leave clients without their hostname for ten minutes.
+ */
+#define DNSCACHE_TTL_NEGATIVE	60
+
 /** Size of the hash table (prime!).
  * Consumes <this>*4 on ia32 and <this>*4 on 64 bit
  * 241 seems a good bet.. which ~1k on ia32 and ~2k on ia64.
@@ -66,7 +74,10 @@ extern ares_channel resolver_channel;
 
 extern void init_resolver(int);
 
-struct hostent *unrealdns_doclient(Client *cptr);
+struct hostent *unrealdns_doclient(Client *cptr, int *negcache);
+
+void unrealdns_savecache(void);
+void unrealdns_loadcache(void);
 
 extern void unreal_gethostbyname(const char *name, int family, ares_host_callback callback, void *arg);
 
@@ -78,6 +78,7 @@ struct Configuration {
 	unsigned check_target_nick_bans:1;
 	unsigned use_egd : 1;
 	char *dns_bindip;
+	int dns_cache_size;
 	char *link_bindip;
 	long throttle_period;
 	char throttle_count;
@@ -146,6 +147,7 @@ struct Configuration {
 	int maxbanlength;
 	int watch_away_notification;
 	int uhnames;
+	int hugepage_pools;
 	NetworkConfiguration network;
 	unsigned short default_ipv6_clone_mask;
 	int ping_cookie;
@@ -160,6 +162,11 @@ struct Configuration {
 	long handshake_timeout;
 	long sasl_timeout;
 	long handshake_delay;
+	long loop_stall_warning_time;
+	long slow_command_trace_time;
+	int log_fsync;
+	char *replay_record_file;
+	int replay_record_strip_payload;
 	BanTarget automatic_ban_target;
 	BanTarget manual_ban_target;
 	char *reject_message_too_many_connections;
@@ -190,12 +197,18 @@ extern MODVAR int ipv6_disabled;
 #define FLAT_MAP			iConf.flat_map
 #define ALLOW_CHATOPS			iConf.allow_chatops
 #define PINGWARNING			iConf.ping_warning
+#define LOOP_STALL_WARNING_TIME		iConf.loop_stall_warning_time
+#define SLOW_COMMAND_TRACE_TIME		iConf.slow_command_trace_time
+#define LOG_FSYNC			iConf.log_fsync
+#define REPLAY_RECORD_FILE		iConf.replay_record_file
+#define REPLAY_RECORD_STRIP_PAYLOAD	iConf.replay_record_strip_payload
 #define MAXCHANNELSPERUSER		iConf.maxchannelsperuser
 #define MAXDCCALLOW			iConf.maxdccallow
 #define DONT_RESOLVE			iConf.dont_resolve
 #define AUTO_JOIN_CHANS			iConf.auto_join_chans
 #define OPER_AUTO_JOIN_CHANS		iConf.oper_auto_join_chans
 #define DNS_BINDIP			iConf.dns_bindip
+#define DNS_CACHE_SIZE			iConf.dns_cache_size
 #define LINK_BINDIP			iConf.link_bindip
 #define IDENT_CHECK			iConf.ident_check
 #define FAILOPER_WARN			iConf.fail_oper_warn
@@ -282,6 +295,9 @@ extern MODVAR int ipv6_disabled;
 
 #define UHNAMES_ENABLED	iConf.uhnames
 
+/** Back large mempool chunks with (transparent) huge pages - set::hugepage-pools */
+#define HUGEPAGE_POOLS	iConf.hugepage_pools
+
 /** Used for testing the set { } block configuration.
  * It tests if a setting is present and is also used for duplicate checking.
  */
@@ -299,6 +315,7 @@ struct SetCheck {
 	unsigned has_tls_server_cipher_list :1;
 	unsigned has_tls_protocols :1;
 	unsigned has_dns_bind_ip:1;
+	unsigned has_dns_cache_size:1;
 	unsigned has_link_bind_ip:1;
 	unsigned has_throttle_period:1;
 	unsigned has_throttle_connections:1;
@@ -313,6 +330,7 @@ struct SetCheck {
 	unsigned has_check_target_nick_bans:1;
 	unsigned has_watch_away_notification:1;
 	unsigned has_uhnames:1;
+	unsigned has_hugepage_pools:1;
 	unsigned has_allow_user_stats:1;
 	unsigned has_ping_warning:1;
 	unsigned has_maxchannelsperuser:1;
@@ -16,9 +16,29 @@ typedef struct fd_entry {
 	time_t deadline;
 	unsigned char is_open;
 	unsigned int backend_flags;
+	int prev_open;		/**< Previous fd on the open fd list, -1 if first (only valid while is_open) */
+	int next_open;		/**< Next fd on the open fd list, -1 if last (only valid while is_open) */
 } FDEntry;
 
-extern MODVAR FDEntry fd_table[MAXCONNECTIONS + 1];
+/* The FD table is allocated in chunks on demand, so a very high
+ * maxconnections setting does not cost many megabytes of memory up
+ * front. Chunks are never freed or reallocated, so an FDEntry pointer
+ * stays valid for as long as the fd table exists (the kqueue backend
+ * relies on this: it hands FDEntry pointers to the kernel as udata).
+ */
+#define FD_TABLE_CHUNK_SHIFT	10
+#define FD_TABLE_CHUNK_SIZE	(1 << FD_TABLE_CHUNK_SHIFT)
+#define FD_TABLE_CHUNKS		((MAXCONNECTIONS / FD_TABLE_CHUNK_SIZE) + 1)
+
+extern MODVAR FDEntry *fd_table_chunk[FD_TABLE_CHUNKS];
+extern MODVAR int fd_first_open;
+
+extern FDEntry *fd_entry(int fd);
+
+/** Walk all open file descriptors, in no particular order.
+ * Do not open or close fd's while iterating.
+ */
+#define for_each_open_fd(fd)	for ((fd) = fd_first_open; (fd) >= 0; (fd) = fd_entry(fd)->next_open)
 
 extern int fd_open(int fd, const char *desc);
 extern void fd_close(int fd);
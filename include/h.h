@@ -34,8 +34,7 @@ extern MODVAR int tainted;
 extern char *getreply(int);
 #define rpl_str(x) getreply(x)
 #define err_str(x) getreply(x)
-extern MODVAR Member *freemember;
-extern MODVAR Membership *freemembership;
+extern MODVAR struct mp_pool_t *membership_pool;
 extern MODVAR Client me;
 extern MODVAR Channel *channels;
 extern MODVAR ModData local_variable_moddata[MODDATA_MAX_LOCAL_VARIABLE];
@@ -44,6 +43,10 @@ extern MODVAR IRCStatistics ircstats;
 extern MODVAR int bootopt;
 extern MODVAR time_t timeofday;
 extern MODVAR struct timeval timeofday_tv;
+extern MODVAR long long monotime_ms;
+extern MODVAR long long mono_clock_reads;
+extern long long mono_time_usec(void);
+extern long long mono_time_coarse_ms(void);
 extern MODVAR char cmodestring[512];
 extern MODVAR char umodestring[UMODETABLESZ+1];
 /* newconf */
@@ -156,11 +159,18 @@ extern int del_exbanid(Channel *channel, char *banid);
 extern MODVAR int R_do_dns, R_fin_dns, R_fin_dnsc, R_fail_dns, R_do_id, R_fin_id, R_fail_id;
 extern MODVAR struct list_head client_list;
 extern MODVAR struct list_head lclient_list;
+extern MODVAR ClientArray client_array;		/**< Dense mirror of client_list (see src/list.c) */
+extern MODVAR ClientArray lclient_array;	/**< Dense mirror of lclient_list (see src/list.c) */
+extern void client_array_del(Client *client);
+extern void lclient_array_add(Client *client);
+extern void lclient_array_del(Client *client);
 extern MODVAR struct list_head server_list;
 extern MODVAR struct list_head oper_list;
 extern MODVAR struct list_head unknown_list;
 extern MODVAR struct list_head global_server_list;
 extern MODVAR struct list_head dead_list;
+extern MODVAR struct list_head pending_write_list;
+extern void mark_data_to_send(Client *to);
 extern RealCommand *find_command(char *cmd, int flags);
 extern RealCommand *find_command_simple(char *cmd);
 extern Channel *find_channel(char *, Channel *);
@@ -186,14 +196,18 @@ extern Ban *is_banned(Client *, Channel *, int, char **, char **);
 extern Ban *is_banned_with_nick(Client *, Channel *, int, char *, char **, char **);
 
 extern void ircd_log(int, FORMAT_STRING(const char *), ...) __attribute__((format(printf,2,3)));
+extern void ircd_log_flush(void);
 extern Client *find_client(char *, Client *);
 extern Client *find_name(char *, Client *);
 extern Client *find_nickserv(char *, Client *);
 extern Client *find_person(char *, Client *);
+extern void find_persons(int count, char **names, Client **results);
 extern Client *find_server(char *, Client *);
 extern Client *find_service(char *, Client *);
 #define find_server_quick(x) find_server(x, NULL)
 extern char *find_or_add(char *);
+extern char *intern_string(const char *str);
+extern void unintern_string(char *str);
 extern void inittoken();
 extern void reset_help();
 
@@ -276,8 +290,10 @@ extern void sendto_ops_and_log(FORMAT_STRING(const char *pattern), ...) __attrib
 
 extern MODVAR int writecalls, writeb[];
 extern int deliver_it(Client *cptr, char *str, int len, int *want_read);
+extern int deliver_itv(Client *cptr, struct iovec *iov, int iovcnt, int *want_read);
 extern int target_limit_exceeded(Client *client, void *target, const char *name);
 extern char *canonize(char *buffer);
+extern char *parse_scratch_copy(const char *arg);
 extern int check_registered(Client *);
 extern int check_registered_user(Client *);
 extern char *get_client_name(Client *, int);
@@ -286,6 +302,11 @@ extern char *myctime(time_t);
 extern char *short_date(time_t, char *buf);
 extern char *long_date(time_t);
 extern void exit_client(Client *client, MessageTag *recv_mtags, char *comment);
+extern void process_pending_exits(void);
+extern int pending_exits_queued(void);
+extern void process_pending_handshakes(void);
+extern int pending_handshakes_queued(void);
+extern void tls_handshake_dequeue(Client *client);
 extern void initstats(), tstats(Client *, char *);
 extern char *check_string(char *);
 extern char *make_nick_user_host(char *, char *, char *);
@@ -331,11 +352,15 @@ extern time_t expire_cache(time_t);
 extern void del_queries(char *);
 
 /* Hash stuff */
-#define NICK_HASH_TABLE_SIZE 32768
+/* Initial and minimum size of the nick and UID/SID tables; these grow
+ * and shrink at runtime by incremental rehashing, see src/hash.c.
+ */
+#define NICK_HASH_TABLE_SIZE 1024
 #define CHAN_HASH_TABLE_SIZE 32768
 #define WATCH_HASH_TABLE_SIZE 32768
 #define WHOWAS_HASH_TABLE_SIZE 32768
-#define THROTTLING_HASH_TABLE_SIZE 8192
+#define IPSTATE_HASH_TABLE_SIZE 8192
+#define LIST_SIZE_INDEX_BUCKETS 1024
 #define find_channel hash_find_channel
 extern uint64_t siphash(const char *in, const char *k);
 extern uint64_t siphash_raw(const char *in, size_t len, const char *k);
@@ -343,25 +368,56 @@ extern uint64_t siphash_nocase(const char *in, const char *k);
 extern void siphash_generate_key(char *k);
 extern void init_hash(void);
 uint64_t hash_whowas_name(const char *name);
+uint64_t hash_whowas_ip(const char *ip);
+uint64_t hash_whowas_account(const char *account);
 extern int add_to_client_hash_table(char *, Client *);
 extern int del_from_client_hash_table(char *, Client *);
 extern int add_to_id_hash_table(char *, Client *);
 extern int del_from_id_hash_table(char *, Client *);
 extern int add_to_channel_hash_table(char *, Channel *);
 extern void del_from_channel_hash_table(char *, Channel *);
-extern int add_to_watch_hash_table(char *, Client *, int);
-extern int del_from_watch_hash_table(char *, Client *);
+extern int add_to_watch_hash_table(char *, Client *, int, int);
+extern int del_from_watch_hash_table(char *, Client *, int);
 extern int hash_check_watch(Client *, int);
+extern void flush_watch_notifications(void);
+extern int hash_del_watch_subscriptions(Client *, int);
 extern int hash_del_watch_list(Client *);
 extern void count_watch_memory(int *, u_long *);
 extern Watch *hash_get_watch(char *);
+extern void whoindex_update(Client *client);
+extern void whoindex_remove(Client *client);
+extern WhoIndexEntry *whoindex_fetch(int type, const char *key);
 extern Channel *hash_get_chan_bucket(uint64_t);
+extern void channel_sizeindex_add(Channel *channel);
+extern void channel_sizeindex_update(Channel *channel);
+extern void channel_sizeindex_del(Channel *channel);
+extern Channel *channel_sizeindex_bucket(unsigned int bucket);
 extern Client *hash_find_client(const char *, Client *);
 extern Client *hash_find_id(const char *, Client *);
 extern Client *hash_find_nickatserver(const char *, Client *);
 extern Channel *hash_find_channel(char *name, Channel *channel);
 extern Client *hash_find_server(const char *, Client *);
-extern struct MODVAR ThrottlingBucket *ThrottlingHash[THROTTLING_HASH_TABLE_SIZE];
+extern int ipstate_slot_request(char *name, void (*free_data)(void *data));
+extern IpStateEntry *find_ipstate(char *ip);
+extern void *ipstate_get(char *ip, int slot);
+extern void ipstate_set(char *ip, int slot, void *data);
+extern void ipstate_iterate(int slot, int (*cb)(char *ip, void *data, void *arg), void *arg);
+extern void ipstate_iterate_range(int slot, int first, int last, int (*cb)(char *ip, void *data, void *arg), void *arg);
+
+/* Handshake phase instrumentation (socket.c), see /STATS handshake */
+#define HANDSHAKE_PHASE_DNS	0
+#define HANDSHAKE_PHASE_IDENT	1
+#define HANDSHAKE_PHASE_DNSBL	2
+#define HANDSHAKE_PHASE_TLS	3
+#define HANDSHAKE_PHASE_TOTAL	4
+#define HANDSHAKE_NPHASES	5
+#define HANDSHAKE_NBUCKETS	8
+extern MODVAR HandshakePhaseStats handshake_phase_stats[HANDSHAKE_NPHASES];
+extern MODVAR const int handshake_bucket_ms[HANDSHAKE_NBUCKETS-1];
+extern void handshake_phase_mark(struct timeval *tv);
+extern int handshake_phase_done(int phase, struct timeval *started);
+
+extern MODVAR const int sendq_hist_pct[SENDQ_HIST_NBUCKETS-1];
 
 extern char *find_by_aln(char *);
 extern char *convert2aln(int);
@@ -426,11 +482,17 @@ extern char *inetntop(int af, const void *in, char *local_dummy, size_t the_size
 extern MODVAR RealCommand *CommandHash[256];
 extern void init_CommandHash(void);
 
+/** Command currently being executed by parse2() (NULL when none),
+ * sampled by the SIGPROF sampling profiler - see src/ircd.c.
+ */
+extern MODVAR RealCommand * volatile profiling_current_command;
+
 /* CRULE */
 char *crule_parse(char *);
 int crule_test(char *);
 char *crule_errstring(int);
 int crule_eval(char *);
+void crule_eval_begin_round(void);
 void crule_free(char **);
 
 /*
@@ -462,7 +524,16 @@ extern char *oflagstr(long oflag);
 extern int rehash(Client *client, int sig);
 extern int match_simple(const char *mask, const char *name);
 extern int match_esc(const char *mask, const char *name);
+extern CompiledMask *compile_simple_mask(const char *mask);
+extern int compiled_mask_match(CompiledMask *cm, const char *name);
+extern void free_compiled_mask(CompiledMask *cm);
 extern int add_listener(ConfigItem_listen *conf);
+#ifndef _WIN32
+extern void prepare_listener_handover(void);
+extern int is_handover_listener_fd(int fd);
+extern void listener_handover_read(void);
+extern void listener_handover_finish(void);
+#endif
 extern void link_cleanup(ConfigItem_link *link_ptr);
 extern void       listen_cleanup();
 extern int  numeric_collides(long numeric);
@@ -480,6 +551,8 @@ extern void read_motd(const char *filename, MOTDFile *motd); /* s_serv.c */
 extern void send_proto(Client *, ConfigItem_link *);
 extern void unload_all_modules(void);
 extern void set_sock_opts(int fd, Client *cptr, int ipv6);
+extern void sock_set_cork(Client *client, int enable);
+extern void client_check_start(Client *client);
 extern void stripcrlf(char *line);
 extern time_t rfc2time(char *s);
 extern char *rfctime(time_t t, char *buf);
@@ -555,6 +628,7 @@ extern void init_random();
 extern u_char getrandom8();
 extern uint16_t getrandom16();
 extern uint32_t getrandom32();
+extern void getrandom_buf(void *buf, size_t len);
 extern void gen_random_alnum(char *buf, int numbytes);
 
 extern MODVAR char extchmstr[4][64];
@@ -562,6 +636,7 @@ extern MODVAR char extchmstr[4][64];
 extern int extcmode_default_requirechop(Client *, Channel *, char, char *, int, int);
 extern int extcmode_default_requirehalfop(Client *, Channel *, char, char *, int, int);
 extern Cmode_t extcmode_get(Cmode *);
+extern Cmode *extcmode_find(char flag);
 extern void extcmode_init(void);
 extern void make_extcmodestr();
 extern void extcmode_duplicate_paramlist(void **xi, void **xo);
@@ -617,6 +692,52 @@ extern void remove_oper_modes(Client *client);
 extern char *spamfilter_inttostring_long(int v);
 extern Channel *get_channel(Client *cptr, char *chname, int flag);
 extern MODVAR char backupbuf[];
+/** Number of buckets in the main loop latency histogram (powers of two in msec) */
+#define LOOP_LATENCY_BUCKETS 12
+extern MODVAR long long loop_latency_hist[LOOP_LATENCY_BUCKETS];
+extern MODVAR long long loop_latency_total_msec;
+extern MODVAR long long loop_latency_max_msec;
+extern MODVAR long long loop_latency_stalls;
+extern MODVAR long long fd_select_sleep_usec;
+/** Record a slow command/hook in the trace ring, see src/ircd.c */
+extern void slowtrace_record(const char *what, Client *source, int parc, char *parv[], long long usec);
+/** Crash flight recorder (see src/ircd.c): recent events kept in a global
+ * ring so crashreport.c can decode them from a core file post-mortem.
+ */
+#define FLIGHT_RECORDER_ENTRIES 256
+#define FLIGHT_RECORDER_LINELEN 160
+extern MODVAR char flight_recorder[FLIGHT_RECORDER_ENTRIES][FLIGHT_RECORDER_LINELEN];
+extern MODVAR unsigned int flight_recorder_pos;
+extern void flight_record(FORMAT_STRING(const char *), ...) __attribute__((format(printf,1,2)));
+
+/** A named tracepoint (see src/trace.c). Statically declared next to the
+ * code it instruments, toggled at runtime per tracepoint with the
+ * /TRACEPOINT command. While disabled the cost at the instrumented site
+ * is one load of the enable byte and a predicted jump; while enabled
+ * each hit renders its payload into the trace ring.
+ */
+typedef struct Tracepoint Tracepoint;
+struct Tracepoint {
+	Tracepoint *next;
+	const char *name;		/**< Name used for runtime toggling (eg: "send_queued") */
+	unsigned char enabled;		/**< The enable byte that TRACEPOINT() tests */
+	unsigned long long hits;	/**< Events recorded while enabled */
+};
+/** Emit a trace event if (and only if) the tracepoint is enabled */
+#define TRACEPOINT(tp, ...) do { if ((tp).enabled) tracepoint_emit(&(tp), __VA_ARGS__); } while(0)
+#define TRACE_RING_ENTRIES 1024
+#define TRACE_RING_LINELEN 160
+extern MODVAR char trace_ring[TRACE_RING_ENTRIES][TRACE_RING_LINELEN];
+extern MODVAR unsigned int trace_ring_pos;
+extern MODVAR Tracepoint *tracepoints;
+extern void tracepoints_init(void);
+extern void tracepoint_register(Tracepoint *tp);
+extern Tracepoint *tracepoint_find(const char *name);
+extern void tracepoint_emit(Tracepoint *tp, FORMAT_STRING(const char *), ...) __attribute__((format(printf,2,3)));
+/* Core tracepoints, defined next to the code they instrument */
+extern MODVAR Tracepoint tp_send_queued;	/* src/send.c */
+extern MODVAR Tracepoint tp_parse2;		/* src/parse.c */
+extern MODVAR Tracepoint tp_hash_find_client;	/* src/hash.c */
 extern void add_invite(Client *, Client *, Channel *, MessageTag *);
 extern void del_invite(Client *, Channel *);
 extern int is_invited(Client *client, Channel *channel);
@@ -644,6 +765,8 @@ extern char *encode_ip(char *);
 extern char *decode_ip(char *);
 extern void sendto_fconnectnotice(Client *client, int disconnect, char *comment);
 extern void sendto_one_nickcmd(Client *server, Client *client, char *umodes);
+extern uint64_t list_bloom_mask(Client *client);
+extern void dccallow_bloom_rebuild(Client *client);
 extern int on_dccallow_list(Client *to, Client *from);
 extern int add_dccallow(Client *client, Client *optr);
 extern int del_dccallow(Client *client, Client *optr);
@@ -653,6 +776,7 @@ extern void del_async_connects(void);
 extern void isupport_init(void);
 extern void clicap_init(void);
 extern void efunctions_init(void);
+extern void memory_counters_init(void);
 extern void do_cmd(Client *client, MessageTag *mtags, char *cmd, int parc, char *parv[]);
 extern MODVAR char *me_hash;
 extern MODVAR int dontspread;
@@ -789,6 +913,10 @@ extern void DoMD5(char *mdout, const char *src, unsigned long n);
 extern char *md5hash(char *dst, const char *src, unsigned long n);
 extern MODVAR TKL *tklines[TKLISTLEN];
 extern MODVAR TKL *tklines_ip_hash[TKLIPHASHLEN1][TKLIPHASHLEN2];
+extern MODVAR unsigned int tkl_id_sequence;
+extern MODVAR TKL **tkl_expiry_heap;
+extern MODVAR int tkl_expiry_heap_count;
+extern MODVAR int tkl_expiry_heap_capacity;
 extern char *cmdname_by_spamftarget(int target);
 extern void unrealdns_delreq_bycptr(Client *cptr);
 extern void sendtxtnumeric(Client *to, FORMAT_STRING(const char *pattern), ...) __attribute__((format(printf,2,3)));
@@ -819,12 +947,33 @@ extern PendingNet *find_pending_net_by_sid_butone(char *sid, Client *exempt);
 extern Client *find_pending_net_duplicates(Client *cptr, Client **srv, char **sid);
 extern MODVAR char serveropts[];
 extern MODVAR char *ISupportStrings[];
+extern MODVAR int isupport_generation;
 extern void read_packet(int fd, int revents, void *data);
 extern int process_packet(Client *cptr, char *readbuf, int length, int killsafely);
 extern void sendto_realops_and_log(FORMAT_STRING(const char *fmt), ...) __attribute__((format(printf,1,2)));
 extern int parse_chanmode(ParseMode *pm, char *modebuf_in, char *parabuf_in);
 extern void config_report_ssl_error(void);
 extern int dead_socket(Client *to, char *notice);
+/* Post-EOS sync scheduler (src/serv.c) */
+extern MODVAR SyncSchedGenerator *syncschedgenerators;
+extern int syncsched_register(char *name, int priority, int (*generate)(Client *to, int budget));
+extern void syncsched_unregister(char *name);
+extern void syncsched_start(Client *client);
+extern void syncsched_run(void);
+extern int syncsched_pending(void);
+/* zlib link compression (src/zip.c) */
+extern int zip_start_out(Client *client);
+extern int zip_start_in(Client *client);
+extern int zip_is_out_active(Client *client);
+extern int zip_is_in_active(Client *client);
+extern int zip_in_handoff_pending(Client *client);
+extern void zip_free_link(Client *client);
+extern int zip_out_data(Client *client, char *data, int len);
+extern int zip_out_flush(Client *client);
+extern int zip_in_data(Client *client, char *data, int len);
+extern int zip_in_handoff(Client *client, char *rest, int restlen);
+extern int zip_in_handoff_recvq(Client *client);
+extern void zip_stats(Client *to);
 extern Match *unreal_create_match(MatchType type, char *str, char **error);
 extern void unreal_delete_match(Match *m);
 extern int unreal_match(Match *m, char *str);
@@ -859,12 +1008,14 @@ extern int unreal_connect(int fd, char *ip, int port, int ipv6);
 extern int is_valid_ip(char *str);
 extern int ipv6_capable(void);
 extern MODVAR Client *remote_rehash_client;
+extern MODVAR Client *numeric_target_cache;
 extern MODVAR int debugfd;
 extern void convert_to_absolute_path(char **path, char *reldir);
 extern int has_user_mode(Client *acptr, char mode);
 extern int has_channel_mode(Channel *channel, char mode);
 extern Cmode_t get_extmode_bitbychar(char m);
 extern long get_mode_bitbychar(char m);
+extern Umode *find_usermode(char mode);
 extern long find_user_mode(char mode);
 extern void start_listeners(void);
 extern void buildvarstring(const char *inbuf, char *outbuf, size_t len, const char *name[], const char *value[]);
@@ -903,6 +1054,11 @@ extern void clicap_post_rehash(void);
 extern void unload_all_unused_mtag_handlers(void);
 extern void send_cap_notify(int add, char *token);
 extern void sendbufto_one(Client *to, char *msg, unsigned int quick);
+extern void sendbufto_one_shared(Client *to, dbufshared *msg);
+extern void sendbufto_one_batch(Client *to, char *msg, int len, int lines);
+extern int sendbufto_one_echo(Client *to, MessageTag *mtags);
+extern void invalidate_snomask_subscribers(void);
+extern void flush_pending_writes(void);
 extern MODVAR int current_serial;
 extern char *spki_fingerprint(Client *acptr);
 extern char *spki_fingerprint_ex(X509 *x509_cert);
@@ -923,6 +1079,7 @@ extern int maxclients;
 extern int fast_badword_match(ConfigItem_badword *badword, char *line);
 extern int fast_badword_replace(ConfigItem_badword *badword, char *line, char *buf, int max);
 extern char *stripbadwords(char *str, ConfigItem_badword *start_bw, int *blocked);
+extern char *stripbadwords_prestripped(char *str, ConfigItem_badword *start_bw, int *blocked);
 extern int badword_config_process(ConfigItem_badword *ca, char *str);
 extern void badword_config_free(ConfigItem_badword *ca);
 extern char *badword_config_check_regex(char *s, int fastsupport, int check_broadness);
@@ -939,7 +1096,13 @@ extern void new_message_special(Client *sender, MessageTag *recv_mtags, MessageT
 extern void generate_batch_id(char *str);
 extern MessageTag *find_mtag(MessageTag *mtags, const char *token);
 extern MessageTag *duplicate_mtag(MessageTag *mtag);
+extern MessageTag *duplicate_mtag_shared(MessageTag *mtag);
 extern void free_message_tags(MessageTag *m);
+extern MessageTag *new_mtag_arena(const char *name, const char *value);
+extern MessageTag *new_mtag_arena_shared(char *name, char *value);
+extern void mtag_arena_reset(void);
+extern void *parse_arena_alloc(size_t size);
+extern char *parse_arena_strdup(const char *str);
 extern time_t server_time_to_unix_time(const char *tbuf);
 extern int history_set_limit(char *object, int max_lines, long max_t);
 extern int history_add(char *object, MessageTag *mtags, char *line);
@@ -954,6 +1117,16 @@ extern int read_data(FILE *fd, void *buf, size_t len);
 extern int write_data(FILE *fd, const void *buf, size_t len);
 extern int write_str(FILE *fd, char *x);
 extern int read_str(FILE *fd, char **x);
+extern FILE *dbwrite_open(void);
+extern int dbwrite_submit(FILE *fd, const char *filename, int do_fsync);
+extern void dbwrite_discard(FILE *fd);
+extern void dbwrite_run(void);
+extern void dbwrite_flush(void);
+/* workers.c */
+extern int workers_available(void);
+extern int worker_submit(void (*work)(void *data), void (*completion)(void *data), void *data);
+extern void workers_run(void);
+extern void workers_flush(void);
 extern int char_to_channelflag(char c);
 extern void _free_entire_name_list(NameList *n);
 extern void _add_name_list(NameList **list, char *name);
@@ -961,11 +1134,27 @@ extern void _del_name_list(NameList **list, char *name);
 extern NameList *find_name_list(NameList *list, char *name);
 extern NameList *find_name_list_match(NameList *list, char *name);
 extern int minimum_msec_since_last_run(struct timeval *tv_old, long minimum);
+extern void boot_phase(const char *name);
+extern void boot_phase_credit(const char *name, long long wall_usec, long long cpu_usec);
+extern long long boot_phase_cpu_now(void);
+extern void boot_phase_report(Client *client);
 extern int unrl_utf8_validate(const char *str, const char **end);
 extern char *unrl_utf8_make_valid(const char *str);
+extern int unrl_utf8_charlen(const char *str);
+extern int unrl_utf8_script(const char *str);
 extern void utf8_test(void);
+/* Script classes as returned by unrl_utf8_script() */
+#define UTF8_SCRIPT_UNDEFINED	0
+#define UTF8_SCRIPT_LATIN	1
+#define UTF8_SCRIPT_CYRILLIC	2
+#define UTF8_SCRIPT_CJK		3
+#define UTF8_SCRIPT_HANGUL	4
+#define UTF8_SCRIPT_CANADIAN	5
+#define UTF8_SCRIPT_TELUGU	6
 extern MODVAR int non_utf8_nick_chars_in_use;
 extern void short_motd(Client *client);
+extern int send_motd_cache(Client *client, MOTDFile *themotd, int numeric);
+extern void motd_cache_free(MOTDCache *cache);
 extern int should_show_connect_info(Client *client);
 extern void send_invalid_channelname(Client *client, char *channelname);
 extern int is_extended_ban(const char *str);
@@ -989,3 +1178,4 @@ extern int hide_idle_time(Client *client, Client *target);
 extern void lost_server_link(Client *serv, FORMAT_STRING(const char *fmt), ...);
 extern char *sendtype_to_cmd(SendType sendtype);
 extern MODVAR MessageTagHandler *mtaghandlers;
+extern MODVAR unsigned int mtag_handler_generation;
@@ -17,7 +17,10 @@
 # define FORMAT_STRING(p) p
 #endif
 
-extern char *ircvsnprintf(char *str, size_t size, const char *format, va_list);
-extern char *ircsnprintf(char *str, size_t size, FORMAT_STRING(const char *format), ...) __attribute__((format(printf,3,4)));
+/* Both return the length of the formatted result (excluding the
+ * terminating NUL byte), which is never more than size-1.
+ */
+extern int ircvsnprintf(char *str, size_t size, const char *format, va_list);
+extern int ircsnprintf(char *str, size_t size, FORMAT_STRING(const char *format), ...) __attribute__((format(printf,3,4)));
 
 #endif
@@ -51,12 +51,31 @@ typedef struct mp_pool_t mp_pool_t;
 extern void mp_pool_init(void);
 extern void *mp_pool_get(mp_pool_t *);
 extern void mp_pool_release(void *);
-extern mp_pool_t *mp_pool_new(size_t, size_t);
+extern mp_pool_t *mp_pool_new(size_t, size_t, const char *);
 extern void mp_pool_clean(mp_pool_t *, int, int);
 extern void mp_pool_destroy(mp_pool_t *);
 extern void mp_pool_assert_ok(mp_pool_t *);
 extern void mp_pool_log_status(mp_pool_t *);
 extern void mp_pool_garbage_collect(void *);
+extern mp_pool_t *mp_pools(void);
+
+/** Telemetry snapshot of one pool, filled in by mp_pool_usage() */
+typedef struct mp_pool_usage_t {
+  const char *name;		/**< Short pool name (see mp_pool_new) */
+  size_t item_size;		/**< Allocation size per item, including overhead */
+  long long items_in_use;	/**< Items currently handed out */
+  long long items_peak;		/**< Highest items_in_use ever seen */
+  long long items_capacity;	/**< Items that fit in the committed chunks */
+  int chunks;			/**< Total chunks (empty + used + full) */
+  int empty_chunks;		/**< Chunks with no items in use */
+  unsigned long long bytes_committed;	/**< Chunk memory allocated from the heap */
+  unsigned long long bytes_decommitted;	/**< Part thereof returned to the OS via madvise() */
+  unsigned long long total_items_allocated;	/**< Lifetime item allocations */
+  unsigned long long total_chunks_allocated;	/**< Lifetime chunk allocations */
+  unsigned long long total_chunks_freed;	/**< Lifetime chunk frees */
+} mp_pool_usage_t;
+
+extern void mp_pool_usage(mp_pool_t *, mp_pool_usage_t *);
 
 #define MEMPOOL_STATS
 
@@ -64,6 +83,13 @@ struct mp_pool_t {
   /** Next pool. A pool is usually linked into the mp_allocated_pools list. */
   mp_pool_t *next;
 
+  /** Short name of what the pool holds, for occupancy reporting. */
+  const char *name;
+
+  /** Number of items currently handed out, and the highest that has been. */
+  long long items_in_use;
+  long long items_peak;
+
   /** Doubly-linked list of chunks in which no items have been allocated.
    * The front of the list is the most recently emptied chunk. */
   struct mp_chunk_t *empty_chunks;
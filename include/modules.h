@@ -108,6 +108,7 @@ typedef enum ModuleObjectType {
 	MOBJ_CLICAP = 16,
 	MOBJ_MTAG = 17,
 	MOBJ_HISTORY_BACKEND = 18,
+	MOBJ_MEMORYCOUNTER = 19,
 } ModuleObjectType;
 
 typedef struct {
@@ -147,6 +148,7 @@ struct ModDataInfo {
 	ModDataType type; /**< Type of module data (eg: for client, channel, etc..) */
 	int slot; /**< Assigned slot */
 	char unloaded; /**< Module being unloaded? */
+	char hot; /**< Set in the ModDataAdd() request to get a low slot index: hot data then sits at the start of the inline moddata arrays (first cache line). For data read on every message, not for bookkeeping. */
 	void (*free)(ModData *m); /**< Function will be called when the data needs to be freed (may be NULL if not using dynamic storage) */
 	char *(*serialize)(ModData *m); /**< Function which converts the data to a string. May return NULL if 'm' contains no data (since for example m->ptr may be NULL). */
 	void (*unserialize)(char *str, ModData *m); /**< Function which converts the string back to data */
@@ -358,7 +360,8 @@ typedef enum ExtbanOptions {
         EXTBOPT_ACTMODIFIER=0x2,	/**< Action modifier (not a matcher). These are extended bans like ~q/~n/~j. */
         EXTBOPT_NOSTACKCHILD=0x4,	/**< Disallow prefixing with another extban. Eg disallow ~n:~T:censor:xyz */
         EXTBOPT_INVEX=0x8,		/**< Available for use with +I too */
-        EXTBOPT_TKL=0x10		/**< Available for use in TKL's too (eg: /GLINE ~a:account) */
+        EXTBOPT_TKL=0x10,		/**< Available for use in TKL's too (eg: /GLINE ~a:account) */
+        EXTBOPT_MSGCONTENT=0x20		/**< is_banned() verdict depends on the message contents, so it may never be cached */
 } ExtbanOptions;
 
 typedef struct {
@@ -443,6 +446,7 @@ struct ClientCapability {
 	MessageTagHandler *mtag_handler;         /**< For reverse dependency */
 	Module *owner;                           /**< Module introducing this CAP. */
 	char unloaded;                           /**< Internal flag to indicate module is being unloaded */
+	ClientCapability *hnext;                 /**< Next entry in the same name hash bucket (internal use) */
 };
 
 typedef struct {
@@ -465,6 +469,7 @@ typedef struct {
 struct MessageTagHandler {
 	MessageTagHandler *prev, *next;
 	char *name;                                 /**< The name of the message-tag */
+	long bit;                                   /**< Unique bit assigned at registration, for bitmap filtering (0 if we ran out of bits) */
 	int flags;                                  /**< A flag of MTAG_HANDLER_FLAGS_* */
 	int (*is_ok)(Client *, char *, char *);     /**< Verify syntax and access rights */
 	int (*can_send)(Client *);                  /**< Tag may be sent to this client (normally NULL!) */
@@ -517,6 +522,23 @@ typedef struct {
 	int (*history_destroy)(char *object);
 } HistoryBackendInfo;
 
+/** Memory counter: one subsystem reporting its memory usage.
+ * Each registered counter answers "how many objects and how many bytes
+ * does your subsystem currently use?" through a standard callback; the
+ * consolidated report is rendered by /STATS Z (see src/modules/stats.c).
+ * Core subsystems are registered by memory_counters_init(), modules
+ * register theirs with MemoryCounterAdd() in MOD_INIT.
+ */
+typedef struct MemoryCounter MemoryCounter;
+struct MemoryCounter {
+	MemoryCounter *prev, *next;
+	char *name;                                   /**< Subsystem name as shown in the report (eg: "channels") */
+	void (*count)(long long *objects, long long *bytes); /**< Adds this subsystem's current usage to the totals */
+	Module *owner;                                /**< Module introducing this (NULL for core subsystems) */
+	char unloaded;                                /**< Internal flag to indicate module is being unloaded */
+};
+extern MODVAR MemoryCounter *memorycounters; /**< List of registered memory counters */
+
 struct Hook {
 	Hook *prev, *next;
 	int priority;
@@ -598,6 +620,7 @@ typedef struct ModuleObject {
 		ClientCapability *clicap;
 		MessageTagHandler *mtag;
 		HistoryBackend *history_backend;
+		MemoryCounter *memorycounter;
 	} object;
 } ModuleObject;
 
@@ -658,6 +681,10 @@ struct Event {
 	struct timeval	last_run;	/**< Last time this event ran */
 	char		deleted;	/**< Set to 1 if this event is marked for deletion */
 	Module		*owner;		/**< To which module this event belongs */
+	long long	expiry;		/**< Next time this event should run (absolute time in msec) */
+	Event		*wheel_prev;	/**< Previous event in the timer wheel bucket - internal to api-event.c */
+	Event		*wheel_next;	/**< Next event in the timer wheel bucket - internal to api-event.c */
+	Event		**wheel_bucket;	/**< Timer wheel bucket we are queued in (NULL = not queued) - internal to api-event.c */
 };
 
 #define EMOD_EVERY 0x0001
@@ -677,10 +704,25 @@ struct EventInfo {
 };
 
 
+/** Flattened dispatch table for one hook type, kept in sync with the
+ * Hooks[] lists by HookAddMain()/HookDel() - see hook_flatten() in
+ * src/modules.c. The RunHook* macros iterate this contiguous,
+ * priority-ordered array instead of chasing Hook list pointers for
+ * every dispatch.
+ */
+typedef struct HookDispatch HookDispatch;
+struct HookDispatch {
+	int count;		/**< Number of entries in funcs[] */
+	int allocated;		/**< Slots allocated for funcs[] (grow-only) */
+	int (**funcs)();	/**< Hook functions, in priority order */
+};
+
 extern MODVAR Hook		*Hooks[MAXHOOKTYPES];
+extern MODVAR HookDispatch	HookTable[MAXHOOKTYPES];
 extern MODVAR Hooktype		Hooktypes[MAXCUSTOMHOOKS];
 extern MODVAR Callback *Callbacks[MAXCALLBACKS], *RCallbacks[MAXCALLBACKS];
 extern MODVAR ClientCapability *clicaps;
+extern MODVAR int clicap_generation;
 
 extern Event *EventAdd(Module *module, char *name, vFP event, void *data, long every_msec, int count);
 extern void   EventDel(Event *event);
@@ -690,6 +732,8 @@ extern int EventMod(Event *event, EventInfo *mods);
 extern void DoEvents(void);
 extern void EventStatus(Client *client);
 extern void SetupEvents(void);
+extern long EventNextDelay(long max_msec);
+extern void EventFixTimers(void);
 
 
 extern void    Module_Init(void);
@@ -735,6 +779,10 @@ extern HistoryBackend *HistoryBackendFind(const char *name);
 extern HistoryBackend *HistoryBackendAdd(Module *module, HistoryBackendInfo *mreq);
 extern void HistoryBackendDel(HistoryBackend *m);
 
+extern MemoryCounter *MemoryCounterFind(const char *name);
+extern MemoryCounter *MemoryCounterAdd(Module *module, const char *name, void (*count)(long long *objects, long long *bytes));
+extern void MemoryCounterDel(MemoryCounter *m);
+
 #ifndef GCC_TYPECHECKING
 #define HookAdd(module, hooktype, priority, func) HookAddMain(module, hooktype, priority, func, NULL, NULL)
 #define HookAddVoid(module, hooktype, priority, func) HookAddMain(module, hooktype, priority, NULL, func, NULL)
@@ -765,97 +813,157 @@ extern Hook	*HookDel(Hook *hook);
 extern Hooktype *HooktypeAdd(Module *module, char *string, int *type);
 extern void HooktypeDel(Hooktype *hooktype, Module *module);
 
-#define RunHook0(hooktype) do { Hook *h; for (h = Hooks[hooktype]; h; h = h->next)(*(h->func.intfunc))(); } while(0)
-#define RunHook(hooktype,x) do { Hook *h; for (h = Hooks[hooktype]; h; h = h->next) (*(h->func.intfunc))(x); } while(0)
+/** Hooktype currently being dispatched (-1 when none). Sampled by the
+ * SIGPROF sampling profiler (see src/ircd.c) to attribute CPU time to
+ * hooks. Maintained by the RunHook* macros below; the RunHookReturn*
+ * variants can leave it set on an early return, which parse2()
+ * corrects by re-clearing it after every command.
+ */
+extern MODVAR volatile int profiling_current_hooktype;
+
+/** Slow-command tracer helpers, see src/ircd.c. The RunHook* macros
+ * time every dispatch with these: begin returns 0 (and end is then a
+ * no-op) when tracing is disabled or no hooks are registered for the
+ * type, so the common case costs one call and a branch. The
+ * RunHookReturn* variants skip the end call when a hook makes them
+ * return early - such a dispatch is simply not traced.
+ */
+extern long long slowtrace_hook_begin(int hooktype);
+extern void slowtrace_hook_end(int hooktype, long long started);
+
+/** Per-hook dispatch statistics, see slowtrace_hook_begin()/_end() in
+ * src/ircd.c. Dispatches are counted whenever hooks are registered for
+ * the type; cumulative time is only measured while
+ * set::slow-command-trace-time is active (timing every dispatch would
+ * cost two clock reads otherwise). Both show up in the sampling
+ * profiler report.
+ */
+extern MODVAR long long hook_dispatch_calls[MAXHOOKTYPES];
+extern MODVAR long long hook_dispatch_usec[MAXHOOKTYPES];
+
+#define RunHook0(hooktype) do { int hfi_; long long sct_ = slowtrace_hook_begin(hooktype); profiling_current_hooktype = (hooktype); for (hfi_ = 0; hfi_ < HookTable[hooktype].count; hfi_++)(*(HookTable[hooktype].funcs[hfi_]))(); profiling_current_hooktype = -1; slowtrace_hook_end(hooktype, sct_); } while(0)
+#define RunHook(hooktype,x) do { int hfi_; long long sct_ = slowtrace_hook_begin(hooktype); profiling_current_hooktype = (hooktype); for (hfi_ = 0; hfi_ < HookTable[hooktype].count; hfi_++) (*(HookTable[hooktype].funcs[hfi_]))(x); profiling_current_hooktype = -1; slowtrace_hook_end(hooktype, sct_); } while(0)
 #define RunHookReturn(hooktype,x,retchk) \
 { \
  int retval; \
- Hook *h; \
- for (h = Hooks[hooktype]; h; h = h->next) \
+ int hfi_; \
+ long long sct_ = slowtrace_hook_begin(hooktype); \
+ profiling_current_hooktype = (hooktype); \
+ for (hfi_ = 0; hfi_ < HookTable[hooktype].count; hfi_++) \
  { \
-  retval = (*(h->func.intfunc))(x); \
+  retval = (*(HookTable[hooktype].funcs[hfi_]))(x); \
   if (retval retchk) return; \
  } \
+ profiling_current_hooktype = -1; \
+ slowtrace_hook_end(hooktype, sct_); \
 }
 #define RunHookReturn2(hooktype,x,y,retchk) \
 { \
  int retval; \
- Hook *h; \
- for (h = Hooks[hooktype]; h; h = h->next) \
+ int hfi_; \
+ long long sct_ = slowtrace_hook_begin(hooktype); \
+ profiling_current_hooktype = (hooktype); \
+ for (hfi_ = 0; hfi_ < HookTable[hooktype].count; hfi_++) \
  { \
-  retval = (*(h->func.intfunc))(x,y); \
+  retval = (*(HookTable[hooktype].funcs[hfi_]))(x,y); \
   if (retval retchk) return; \
  } \
+ profiling_current_hooktype = -1; \
+ slowtrace_hook_end(hooktype, sct_); \
 }
 #define RunHookReturn3(hooktype,x,y,z,retchk) \
 { \
  int retval; \
- Hook *h; \
- for (h = Hooks[hooktype]; h; h = h->next) \
+ int hfi_; \
+ long long sct_ = slowtrace_hook_begin(hooktype); \
+ profiling_current_hooktype = (hooktype); \
+ for (hfi_ = 0; hfi_ < HookTable[hooktype].count; hfi_++) \
  { \
-  retval = (*(h->func.intfunc))(x,y,z); \
+  retval = (*(HookTable[hooktype].funcs[hfi_]))(x,y,z); \
   if (retval retchk) return; \
  } \
+ profiling_current_hooktype = -1; \
+ slowtrace_hook_end(hooktype, sct_); \
 }
 #define RunHookReturn4(hooktype,a,b,c,d,retchk) \
 { \
  int retval; \
- Hook *h; \
- for (h = Hooks[hooktype]; h; h = h->next) \
+ int hfi_; \
+ long long sct_ = slowtrace_hook_begin(hooktype); \
+ profiling_current_hooktype = (hooktype); \
+ for (hfi_ = 0; hfi_ < HookTable[hooktype].count; hfi_++) \
  { \
-  retval = (*(h->func.intfunc))(a,b,c,d); \
+  retval = (*(HookTable[hooktype].funcs[hfi_]))(a,b,c,d); \
   if (retval retchk) return; \
  } \
+ profiling_current_hooktype = -1; \
+ slowtrace_hook_end(hooktype, sct_); \
 }
 #define RunHookReturnInt(hooktype,x,retchk) \
 { \
  int retval; \
- Hook *h; \
- for (h = Hooks[hooktype]; h; h = h->next) \
+ int hfi_; \
+ long long sct_ = slowtrace_hook_begin(hooktype); \
+ profiling_current_hooktype = (hooktype); \
+ for (hfi_ = 0; hfi_ < HookTable[hooktype].count; hfi_++) \
  { \
-  retval = (*(h->func.intfunc))(x); \
+  retval = (*(HookTable[hooktype].funcs[hfi_]))(x); \
   if (retval retchk) return retval; \
  } \
+ profiling_current_hooktype = -1; \
+ slowtrace_hook_end(hooktype, sct_); \
 }
 #define RunHookReturnInt2(hooktype,x,y,retchk) \
 { \
  int retval; \
- Hook *h; \
- for (h = Hooks[hooktype]; h; h = h->next) \
+ int hfi_; \
+ long long sct_ = slowtrace_hook_begin(hooktype); \
+ profiling_current_hooktype = (hooktype); \
+ for (hfi_ = 0; hfi_ < HookTable[hooktype].count; hfi_++) \
  { \
-  retval = (*(h->func.intfunc))(x,y); \
+  retval = (*(HookTable[hooktype].funcs[hfi_]))(x,y); \
   if (retval retchk) return retval; \
  } \
+ profiling_current_hooktype = -1; \
+ slowtrace_hook_end(hooktype, sct_); \
 }
 #define RunHookReturnInt3(hooktype,x,y,z,retchk) \
 { \
  int retval; \
- Hook *h; \
- for (h = Hooks[hooktype]; h; h = h->next) \
+ int hfi_; \
+ long long sct_ = slowtrace_hook_begin(hooktype); \
+ profiling_current_hooktype = (hooktype); \
+ for (hfi_ = 0; hfi_ < HookTable[hooktype].count; hfi_++) \
  { \
-  retval = (*(h->func.intfunc))(x,y,z); \
+  retval = (*(HookTable[hooktype].funcs[hfi_]))(x,y,z); \
   if (retval retchk) return retval; \
  } \
+ profiling_current_hooktype = -1; \
+ slowtrace_hook_end(hooktype, sct_); \
 }
 #define RunHookReturnInt4(hooktype,a,b,c,d,retchk) \
 { \
  int retval; \
- Hook *h; \
- for (h = Hooks[hooktype]; h; h = h->next) \
+ int hfi_; \
+ long long sct_ = slowtrace_hook_begin(hooktype); \
+ profiling_current_hooktype = (hooktype); \
+ for (hfi_ = 0; hfi_ < HookTable[hooktype].count; hfi_++) \
  { \
-  retval = (*(h->func.intfunc))(a,b,c,d); \
+  retval = (*(HookTable[hooktype].funcs[hfi_]))(a,b,c,d); \
   if (retval retchk) return retval; \
  } \
+ profiling_current_hooktype = -1; \
+ slowtrace_hook_end(hooktype, sct_); \
 }
 
-#define RunHookReturnVoid(hooktype,x,ret) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) if((*(hook->func.intfunc))(x) ret) return; } while(0)
-#define RunHook2(hooktype,x,y) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) (*(hook->func.intfunc))(x,y); } while(0)
-#define RunHook3(hooktype,a,b,c) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) (*(hook->func.intfunc))(a,b,c); } while(0)
-#define RunHook4(hooktype,a,b,c,d) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) (*(hook->func.intfunc))(a,b,c,d); } while(0)
-#define RunHook5(hooktype,a,b,c,d,e) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) (*(hook->func.intfunc))(a,b,c,d,e); } while(0)
-#define RunHook6(hooktype,a,b,c,d,e,f) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) (*(hook->func.intfunc))(a,b,c,d,e,f); } while(0)
-#define RunHook7(hooktype,a,b,c,d,e,f,g) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) (*(hook->func.intfunc))(a,b,c,d,e,f,g); } while(0)
-#define RunHook8(hooktype,a,b,c,d,e,f,g,h) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) (*(hook->func.intfunc))(a,b,c,d,e,f,g,h); } while(0)
+#define RunHookReturnVoid(hooktype,x,ret) do { int hfi_; long long sct_ = slowtrace_hook_begin(hooktype); profiling_current_hooktype = (hooktype); for (hfi_ = 0; hfi_ < HookTable[hooktype].count; hfi_++) if((*(HookTable[hooktype].funcs[hfi_]))(x) ret) return; profiling_current_hooktype = -1; slowtrace_hook_end(hooktype, sct_); } while(0)
+#define RunHook2(hooktype,x,y) do { int hfi_; long long sct_ = slowtrace_hook_begin(hooktype); profiling_current_hooktype = (hooktype); for (hfi_ = 0; hfi_ < HookTable[hooktype].count; hfi_++) (*(HookTable[hooktype].funcs[hfi_]))(x,y); profiling_current_hooktype = -1; slowtrace_hook_end(hooktype, sct_); } while(0)
+#define RunHook3(hooktype,a,b,c) do { int hfi_; long long sct_ = slowtrace_hook_begin(hooktype); profiling_current_hooktype = (hooktype); for (hfi_ = 0; hfi_ < HookTable[hooktype].count; hfi_++) (*(HookTable[hooktype].funcs[hfi_]))(a,b,c); profiling_current_hooktype = -1; slowtrace_hook_end(hooktype, sct_); } while(0)
+#define RunHook4(hooktype,a,b,c,d) do { int hfi_; long long sct_ = slowtrace_hook_begin(hooktype); profiling_current_hooktype = (hooktype); for (hfi_ = 0; hfi_ < HookTable[hooktype].count; hfi_++) (*(HookTable[hooktype].funcs[hfi_]))(a,b,c,d); profiling_current_hooktype = -1; slowtrace_hook_end(hooktype, sct_); } while(0)
+#define RunHook5(hooktype,a,b,c,d,e) do { int hfi_; long long sct_ = slowtrace_hook_begin(hooktype); profiling_current_hooktype = (hooktype); for (hfi_ = 0; hfi_ < HookTable[hooktype].count; hfi_++) (*(HookTable[hooktype].funcs[hfi_]))(a,b,c,d,e); profiling_current_hooktype = -1; slowtrace_hook_end(hooktype, sct_); } while(0)
+#define RunHook6(hooktype,a,b,c,d,e,f) do { int hfi_; long long sct_ = slowtrace_hook_begin(hooktype); profiling_current_hooktype = (hooktype); for (hfi_ = 0; hfi_ < HookTable[hooktype].count; hfi_++) (*(HookTable[hooktype].funcs[hfi_]))(a,b,c,d,e,f); profiling_current_hooktype = -1; slowtrace_hook_end(hooktype, sct_); } while(0)
+#define RunHook7(hooktype,a,b,c,d,e,f,g) do { int hfi_; long long sct_ = slowtrace_hook_begin(hooktype); profiling_current_hooktype = (hooktype); for (hfi_ = 0; hfi_ < HookTable[hooktype].count; hfi_++) (*(HookTable[hooktype].funcs[hfi_]))(a,b,c,d,e,f,g); profiling_current_hooktype = -1; slowtrace_hook_end(hooktype, sct_); } while(0)
+#define RunHook8(hooktype,a,b,c,d,e,f,g,h) do { int hfi_; long long sct_ = slowtrace_hook_begin(hooktype); profiling_current_hooktype = (hooktype); for (hfi_ = 0; hfi_ < HookTable[hooktype].count; hfi_++) (*(HookTable[hooktype].funcs[hfi_]))(a,b,c,d,e,f,g,h); profiling_current_hooktype = -1; slowtrace_hook_end(hooktype, sct_); } while(0)
 
 #define CallbackAdd(cbtype, func) CallbackAddMain(NULL, cbtype, func, NULL, NULL)
 #define CallbackAddEx(module, cbtype, func) CallbackAddMain(module, cbtype, func, NULL, NULL)
@@ -890,6 +998,7 @@ extern void moddata_free_local_client(Client *acptr);
 extern void moddata_free_channel(Channel *channel);
 extern void moddata_free_member(Member *m);
 extern void moddata_free_membership(Membership *m);
+extern MODVAR ModDataInfo *MDInfo;
 extern ModDataInfo *findmoddata_byname(char *name, ModDataType type);
 extern int moddata_client_set(Client *acptr, char *varname, char *value);
 extern char *moddata_client_get(Client *acptr, char *varname);
@@ -1016,6 +1125,8 @@ extern void SavePersistentLongX(ModuleInfo *modinfo, char *varshortname, long va
 #define HOOKTYPE_SERVER_SYNC 106
 #define HOOKTYPE_ACCOUNT_LOGIN 107
 #define HOOKTYPE_CLOSE_CONNECTION 108
+#define HOOKTYPE_TEXT_TRANSFORM 109
+#define HOOKTYPE_PRE_SEND_QUEUED 110
 
 /* Adding a new hook here?
  * 1) Add the #define HOOKTYPE_.... with a new number
@@ -1024,6 +1135,17 @@ extern void SavePersistentLongX(ModuleInfo *modinfo, char *varshortname, long va
  * 4) Document the hook at https://www.unrealircd.org/docs/Dev:Hook_API
  */
 
+/** Shared stripped views of a channel message, produced in a single
+ * pass by can_send_to_channel() and handed to every
+ * HOOKTYPE_TEXT_TRANSFORM hook, so that text transformation modules
+ * (+S, +G, ..) do not each rescan and recopy the message.
+ */
+typedef struct TextPipe TextPipe;
+struct TextPipe {
+	char *text_colorstripped; /**< Message with color/reverse removed, as per StripColors() */
+	char *text_stripped;      /**< Message with all control codes removed, as per StripControlCodes() */
+};
+
 /* Hook prototypes */
 int hooktype_local_connect(Client *client);
 int hooktype_remote_connect(Client *client);
@@ -1094,6 +1216,7 @@ int hooktype_local_spamfilter(Client *acptr, char *str, char *str_in, int type,
 int hooktype_silenced(Client *client, Client *to, SendType sendtype);
 int hooktype_rawpacket_in(Client *client, char *readbuf, int *length);
 int hooktype_packet(Client *from, Client *to, Client *intended_to, char **msg, int *length);
+int hooktype_pre_send_queued(Client *client);
 int hooktype_handshake(Client *client);
 int hooktype_free_client(Client *acptr);
 int hooktype_free_user(Client *acptr);
@@ -1129,6 +1252,7 @@ char *hooktype_pre_local_quit_chan(Client *client, Channel *channel, char *comme
 int hooktype_ident_lookup(Client *acptr);
 int hooktype_account_login(Client *client, MessageTag *mtags);
 int hooktype_close_connection(Client *client);
+int hooktype_text_transform(Client *client, Channel *channel, Membership *member, char **text, TextPipe *pipe, char **errmsg, SendType sendtype);
 
 #ifdef GCC_TYPECHECKING
 #define ValidateHook(validatefunc, func) __builtin_types_compatible_p(__typeof__(func), __typeof__(validatefunc))
@@ -1186,6 +1310,7 @@ _UNREAL_ERROR(_hook_error_incompatible, "Incompatible hook function. Check argum
         ((hooktype == HOOKTYPE_POST_SERVER_CONNECT) && !ValidateHook(hooktype_post_server_connect, func)) || \
         ((hooktype == HOOKTYPE_RAWPACKET_IN) && !ValidateHook(hooktype_rawpacket_in, func)) || \
         ((hooktype == HOOKTYPE_PACKET) && !ValidateHook(hooktype_packet, func)) || \
+        ((hooktype == HOOKTYPE_PRE_SEND_QUEUED) && !ValidateHook(hooktype_pre_send_queued, func)) || \
         ((hooktype == HOOKTYPE_HANDSHAKE) && !ValidateHook(hooktype_handshake, func)) || \
         ((hooktype == HOOKTYPE_AWAY) && !ValidateHook(hooktype_away, func)) || \
         ((hooktype == HOOKTYPE_INVITE) && !ValidateHook(hooktype_invite, func)) || \
@@ -1238,7 +1363,8 @@ _UNREAL_ERROR(_hook_error_incompatible, "Incompatible hook function. Check argum
         ((hooktype == HOOKTYPE_IDENT_LOOKUP) && !ValidateHook(hooktype_ident_lookup, func)) || \
         ((hooktype == HOOKTYPE_CONFIGRUN_EX) && !ValidateHook(hooktype_configrun_ex, func)) || \
         ((hooktype == HOOKTYPE_ACCOUNT_LOGIN) && !ValidateHook(hooktype_account_login, func)) || \
-        ((hooktype == HOOKTYPE_CLOSE_CONNECTION) && !ValidateHook(hooktype_close_connection, func)) ) \
+        ((hooktype == HOOKTYPE_CLOSE_CONNECTION) && !ValidateHook(hooktype_close_connection, func)) || \
+        ((hooktype == HOOKTYPE_TEXT_TRANSFORM) && !ValidateHook(hooktype_text_transform, func)) ) \
         _hook_error_incompatible();
 #endif /* GCC_TYPECHECKING */
 
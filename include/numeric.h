@@ -375,6 +375,12 @@
 
 #define RPL_WHOISSECURE      671
 
+#define RPL_MONONLINE        730
+#define RPL_MONOFFLINE       731
+#define RPL_MONLIST          732
+#define RPL_ENDOFMONLIST     733
+#define ERR_MONLISTFULL      734
+
 #define ERR_MLOCKRESTRICTED	742
 
 #define ERR_CANNOTDOCOMMAND 972
@@ -39,7 +39,6 @@ extern void sendto_realops(FORMAT_STRING(const char *pattern), ...) __attribute_
 extern EVENT(garbage_collect);
 extern EVENT(loop_event);
 extern EVENT(check_pings);
-extern EVENT(handshake_timeout);
 extern EVENT(check_deadsockets);
 extern EVENT(try_connections);
 /* support.c */
@@ -57,6 +56,7 @@ extern char *get_usermode_string(Client *acptr);
 
 /* s_misc.c */
 extern char *convert_time(time_t ltime);
+extern EVENT(log_flush);
 
 /* whowas.c */
 extern void initwhowas(void);
@@ -69,6 +69,7 @@ typedef struct NameBan NameBan;
 typedef struct SpamExcept SpamExcept;
 typedef struct ConditionalConfig ConditionalConfig;
 typedef struct ConfigEntry ConfigEntry;
+typedef struct ConfigArena ConfigArena;
 typedef struct ConfigFile ConfigFile;
 typedef struct ConfigFlag ConfigFlag;
 typedef struct ConfigFlag_except ConfigFlag_except;
@@ -116,17 +117,22 @@ typedef struct ListStructPrio ListStructPrio;
 #define CFG_YESNO 0x0004
 
 typedef struct Watch Watch;
+typedef struct WatchLink WatchLink;
 typedef struct Client Client;
 typedef struct LocalClient LocalClient;
+typedef struct ZipLink ZipLink;
+typedef struct SyncSchedGenerator SyncSchedGenerator;
 typedef struct Channel Channel;
 typedef struct User ClientUser;
 typedef struct Server Server;
 typedef struct Link Link;
 typedef struct Ban Ban;
+typedef struct CompiledMask CompiledMask;
 typedef struct Mode Mode;
 typedef struct MessageTag MessageTag;
 typedef struct MOTDFile MOTDFile; /* represents a whole MOTD, including remote MOTD support info */
 typedef struct MOTDLine MOTDLine; /* one line of a MOTD stored as a linked list */
+typedef struct MOTDCache MOTDCache; /* pre-rendered numeric reply blob for a MOTD-like file */
 #ifdef USE_LIBCURL
 typedef struct MOTDDownload MOTDDownload; /* used to coordinate download of a remote MOTD */
 #endif
@@ -134,6 +140,7 @@ typedef struct MOTDDownload MOTDDownload; /* used to coordinate download of a re
 typedef struct RealCommand RealCommand;
 typedef struct CommandOverride CommandOverride;
 typedef struct Member Member;
+typedef struct MemberChunk MemberChunk;
 typedef struct Membership Membership;
 
 typedef enum OperClassEntryType { OPERCLASSENTRY_ALLOW=1, OPERCLASSENTRY_DENY=2} OperClassEntryType;
@@ -320,6 +327,8 @@ typedef enum ClientStatus {
 #define CLIENT_FLAG_DCCBLOCK		0x04000000	/**< Block all DCC send requests */
 #define CLIENT_FLAG_MAP			0x08000000	/**< Show this entry in /MAP (only used in map module) */
 #define CLIENT_FLAG_PINGWARN		0x10000000	/**< Server ping warning (remote server slow with responding to PINGs) */
+#define CLIENT_FLAG_DEFERREDEXIT	0x20000000	/**< Queued for deferred (batched) exit after a netsplit -- see process_pending_exits() */
+#define CLIENT_FLAG_TLSQUEUED		0x40000000	/**< Parked in the budgeted TLS handshake queue -- see process_pending_handshakes() */
 /** @} */
 
 #define SNO_DEFOPER "+kscfvGqobS"
@@ -342,6 +351,8 @@ typedef enum ClientStatus {
 #define PROTO_EXTSWHOIS 0x004000	/* extended SWHOIS support */
 #define PROTO_SJSBY	0x008000	/* SJOIN setby information (TS and nick) */
 #define PROTO_MTAGS	0x010000	/* Support message tags and big buffers */
+#define PROTO_COMPRESSION 0x020000	/* Supports zlib link compression (COMPRESSION=zlib) */
+#define PROTO_TKLDSYNC	0x040000	/* Supports differential TKL sync (TKLSYNC digest exchange) */
 
 /* For client capabilities: */
 #define CAP_INVERT	1L
@@ -405,6 +416,8 @@ typedef enum ClientStatus {
 #define IsDCCNotice(x)			((x)->flags & CLIENT_FLAG_DCCNOTICE)
 #define IsDead(x)			((x)->flags & CLIENT_FLAG_DEAD)
 #define IsDeadSocket(x)			((x)->flags & CLIENT_FLAG_DEADSOCKET)
+#define IsDeferredExit(x)		((x)->flags & CLIENT_FLAG_DEFERREDEXIT)
+#define IsTLSQueued(x)			((x)->flags & CLIENT_FLAG_TLSQUEUED)
 #define IsUseIdent(x)			((x)->flags & CLIENT_FLAG_USEIDENT)
 #define IsDNSLookup(x)			((x)->flags & CLIENT_FLAG_DNSLOOKUP)
 #define IsEAuth(x)			((x)->flags & CLIENT_FLAG_EAUTH)
@@ -435,6 +448,8 @@ typedef enum ClientStatus {
 #define SetDCCNotice(x)			do { (x)->flags |= CLIENT_FLAG_DCCNOTICE; } while(0)
 #define SetDead(x)			do { (x)->flags |= CLIENT_FLAG_DEAD; } while(0)
 #define SetDeadSocket(x)		do { (x)->flags |= CLIENT_FLAG_DEADSOCKET; } while(0)
+#define SetDeferredExit(x)		do { (x)->flags |= CLIENT_FLAG_DEFERREDEXIT; } while(0)
+#define SetTLSQueued(x)			do { (x)->flags |= CLIENT_FLAG_TLSQUEUED; } while(0)
 #define SetUseIdent(x)			do { (x)->flags |= CLIENT_FLAG_USEIDENT; } while(0)
 #define SetDNSLookup(x)			do { (x)->flags |= CLIENT_FLAG_DNSLOOKUP; } while(0)
 #define SetEAuth(x)			do { (x)->flags |= CLIENT_FLAG_EAUTH; } while(0)
@@ -464,6 +479,8 @@ typedef enum ClientStatus {
 #define ClearDCCNotice(x)		do { (x)->flags &= ~CLIENT_FLAG_DCCNOTICE; } while(0)
 #define ClearDead(x)			do { (x)->flags &= ~CLIENT_FLAG_DEAD; } while(0)
 #define ClearDeadSocket(x)		do { (x)->flags &= ~CLIENT_FLAG_DEADSOCKET; } while(0)
+#define ClearDeferredExit(x)		do { (x)->flags &= ~CLIENT_FLAG_DEFERREDEXIT; } while(0)
+#define ClearTLSQueued(x)		do { (x)->flags &= ~CLIENT_FLAG_TLSQUEUED; } while(0)
 #define ClearUseIdent(x)		do { (x)->flags &= ~CLIENT_FLAG_USEIDENT; } while(0)
 #define ClearDNSLookup(x)		do { (x)->flags &= ~CLIENT_FLAG_DNSLOOKUP; } while(0)
 #define ClearEAuth(x)			do { (x)->flags &= ~CLIENT_FLAG_EAUTH; } while(0)
@@ -510,12 +527,16 @@ typedef enum ClientStatus {
 #define SupportVHP(x)		(CHECKSERVERPROTO(x, PROTO_VHP))
 #define SupportCLK(x)		(CHECKSERVERPROTO(x, PROTO_CLK))
 #define SupportMTAGS(x)		(CHECKSERVERPROTO(x, PROTO_MTAGS))
+#define SupportCOMPRESSION(x)	(CHECKSERVERPROTO(x, PROTO_COMPRESSION))
+#define SupportTKLDSYNC(x)	(CHECKSERVERPROTO(x, PROTO_TKLDSYNC))
 
 #define SetVL(x)		((x)->local->proto |= PROTO_VL)
 #define SetSJSBY(x)		((x)->local->proto |= PROTO_SJSBY)
 #define SetVHP(x)		((x)->local->proto |= PROTO_VHP)
 #define SetCLK(x)		((x)->local->proto |= PROTO_CLK)
 #define SetMTAGS(x)		((x)->local->proto |= PROTO_MTAGS)
+#define SetCOMPRESSION(x)	((x)->local->proto |= PROTO_COMPRESSION)
+#define SetTKLDSYNC(x)		((x)->local->proto |= PROTO_TKLDSYNC)
 
 /*
  * defined debugging levels
@@ -700,10 +721,11 @@ struct MOTDDownload
 };
 #endif /* USE_LIBCURL */
 
-struct MOTDFile 
+struct MOTDFile
 {
 	struct MOTDLine *lines;
 	struct tm last_modified; /* store the last modification time */
+	struct MOTDCache *cache; /* pre-rendered reply blob, see send_motd_cache() */
 
 #ifdef USE_LIBCURL
 	/*
@@ -737,6 +759,21 @@ struct MOTDLine {
 	struct MOTDLine *next;
 };
 
+/** Pre-rendered reply body of a MOTD-like file: the full numeric line
+ * sequence serialized once, stored as literal byte segments with nick
+ * splice points, so delivery to a client is a few memcpy's and a
+ * single sendq append instead of two format calls per line.
+ * Built lazily by send_motd_cache() and freed by free_motd().
+ */
+struct MOTDCache {
+	char servername[HOSTLEN + 1];	/**< me.name the cache was rendered for */
+	int numeric;			/**< The per-line numeric it was rendered with (eg RPL_MOTD) */
+	int numlines;			/**< Number of lines (for the message statistics) */
+	int numsegs;			/**< Number of entries in seg[] / seglen[] */
+	char **seg;			/**< Literal segments; a NULL segment means: splice in the recipient's nick */
+	int *seglen;			/**< Length of each literal segment */
+};
+
 struct LoopStruct {
 	unsigned do_garbage_collect : 1;
 	unsigned config_test : 1;
@@ -769,12 +806,16 @@ typedef struct Match {
 
 typedef struct Whowas {
 	int  hashv;
+	int  ip_hashv;		/* hash by IP, or -1 if not indexed */
+	int  account_hashv;	/* hash by account name, or -1 if not indexed */
 	char *name;
 	char *username;
 	char *hostname;
 	char *virthost;
 	char *servername;
 	char *realname;
+	char *ip;		/* IP address the user came from (or NULL) */
+	char *account;		/* services account the user was logged into (or NULL) */
 	long umodes;
 	time_t   logoff;
 	struct Client *online;	/* Pointer to new nickname for chasing or NULL */
@@ -782,6 +823,10 @@ typedef struct Whowas {
 	struct Whowas *prev;	/* for hash table... */
 	struct Whowas *cnext;	/* for client struct linked list */
 	struct Whowas *cprev;	/* for client struct linked list */
+	struct Whowas *ip_next;	/* for the by-IP hash table */
+	struct Whowas *ip_prev;	/* for the by-IP hash table */
+	struct Whowas *account_next;	/* for the by-account hash table */
+	struct Whowas *account_prev;	/* for the by-account hash table */
 } aWhowas;
 
 typedef struct SWhois SWhois;
@@ -827,6 +872,14 @@ struct SWhois {
  *        and parv[2] will be NULL.
  *        Note that reading parv[parc] and beyond is OUT OF BOUNDS and will cause a crash.
  *        E.g. parv[3] in the above example is out of bounds.
+ * @note  All parv[] elements are BORROWED from the shared parse buffer:
+ *        they are only valid for the duration of the command. If you need
+ *        to store an argument beyond that, copy it (eg: safe_strdup).
+ *        If you only need a modifiable copy while the command runs, for
+ *        example to chop it up with strtoken(), use parse_scratch_copy()
+ *        which does not allocate. In DEBUGMODE the parse buffer is
+ *        poisoned after every command so stored pointers show up as
+ *        garbage instead of silently reading stale data.
  */
 #define CMD_FUNC(x) void (x) (Client *client, MessageTag *recv_mtags, int parc, char *parv[])
 /* @} */
@@ -936,6 +989,8 @@ struct ServerBan {
 	char *hostmask; /**< Host mask */
 	unsigned short subtype; /**< See TKL_SUBTYPE_* */
 	char *reason; /**< Reason */
+	CompiledMask *cmask_user; /**< 'usermask' compiled to segments, or NULL (see tkl_serverban_compile) */
+	CompiledMask *cmask_host; /**< 'hostmask' compiled to segments, or NULL (see tkl_serverban_compile) */
 };
 
 /* Name ban sub-struct of TKL entry (QLINE) */
@@ -952,6 +1007,11 @@ struct Spamfilter {
 	Match *match; /**< Spamfilter matcher */
 	char *tkl_reason; /**< Reason to use for bans placed by this spamfilter, escaped by unreal_encodespace(). */
 	time_t tkl_duration; /**< Duration of bans placed by this spamfilter */
+	char *prefilter; /**< Required literal factor of the pattern (folded), or NULL if none could be derived */
+	unsigned int prefilter_gen; /**< Internal marker used by the literal pre-filter scan */
+	unsigned long long stats_scans; /**< How often the matcher was executed */
+	unsigned long long stats_hits; /**< How often the matcher matched */
+	unsigned long long stats_usec; /**< Cumulative matcher execution time in microseconds */
 };
 
 /** Ban exception sub-struct of TKL entry (ELINE) */
@@ -968,15 +1028,19 @@ struct BanException {
 #define TKL_SUBTYPE_SOFT	0x0001 /* (require SASL) */
 
 #define TKL_FLAG_CONFIG		0x0001 /* Entry from configuration file. Cannot be removed by using commands. */
+#define TKL_FLAG_IP_INDEXED	0x0002 /* Entry is also indexed in the CIDR radix tree (tkl.c), skip it in linear ban scans */
+#define TKL_FLAG_NAME_INDEXED	0x0004 /* Entry is also in the exact-name Q-Line hash (tkl.c), skip it in linear name scans */
 
 /** A TKL entry, such as a KLINE, GLINE, Spamfilter, QLINE, Exception, .. */
 struct TKL {
 	TKL *prev, *next;
 	unsigned int type; /**< TKL type. One of TKL_*, such as TKL_KILL|TKL_GLOBAL for gline */
 	unsigned short flags; /**< One of TKL_FLAG_*, such as TKL_FLAG_CONFIG */
+	unsigned int id; /**< Unique id of this entry, never reused (used by the per-client verdict cache, 0 = no id) */
 	char *set_by; /**< By who was this entry added */
 	time_t set_at; /**< When this entry was added */
 	time_t expire_at; /**< When this entry will expire */
+	unsigned int expiry_slot; /**< Position+1 in the expiry heap, 0 = not queued (no expiry time) */
 	union {
 		Spamfilter *spamfilter;
 		ServerBan *serverban;
@@ -985,6 +1049,19 @@ struct TKL {
 	} ptr;
 };
 
+/** One cached server ban mask-match verdict, see tkl_verdict_cache_slot()
+ * in src/modules/tkl.c. A small direct-mapped table of these hangs off
+ * every local client so that ban sweeps do not re-match masks against
+ * clients whose relevant state (user->acl_generation) did not change.
+ */
+typedef struct TKLVerdictCache TKLVerdictCache;
+struct TKLVerdictCache {
+	unsigned int tkl_id;		/**< TKL id the verdict is for (0 = empty slot) */
+	unsigned int acl_generation;	/**< user->acl_generation the verdict was computed at */
+	unsigned char verdict;		/**< 1 = the user@host masks matched, 0 = they did not */
+};
+#define TKLVERDICTCACHELEN 32		/* Number of slots (direct-mapped by TKL id) */
+
 /** A spamfilter except entry */
 struct SpamExcept {
 	SpamExcept *prev, *next;
@@ -1024,6 +1101,10 @@ struct RealCommand {
 	Module 			*owner;
 	RealCommand		*friend; /* cmd if token, token if cmd */
 	CommandOverride		*overriders;
+	int			fakelag_cost; /**< Base fake lag cost in seconds, precomputed at CommandAdd (0 for CMD_NOLAG) */
+	long long		time_usec; /**< Total wall clock time spent in this command handler (microseconds) */
+	long long		time_max_usec; /**< Slowest single invocation of this command handler (microseconds) */
+	long long		profiling_samples; /**< CPU samples attributed to this command by the sampling profiler (SIGUSR2, see src/ircd.c) */
 #ifdef DEBUGMODE
 	unsigned long 		lticks;
 	unsigned long 		rticks;
@@ -1068,11 +1149,12 @@ extern void unload_all_unused_moddata(void);
 #define LISTENER_TLS		0x000010
 #define LISTENER_BOUND		0x000020
 #define LISTENER_DEFER_ACCEPT	0x000040
+#define LISTENER_METRICS	0x000080	/* Serves OpenMetrics scrapes, not IRC (see src/modules/metrics.c) */
 
 #define IsServersOnlyListener(x)	((x) && ((x)->options & LISTENER_SERVERSONLY))
 
 #define CONNECT_TLS		0x000001
-//0x000002 unused (was ziplinks)
+#define CONNECT_COMPRESSED	0x000002 /* zlib link compression (was ziplinks) */
 #define CONNECT_AUTO		0x000004
 #define CONNECT_QUARANTINE	0x000008
 #define CONNECT_NODNSCACHE	0x000010
@@ -1082,44 +1164,104 @@ extern void unload_all_unused_moddata(void);
 #define TLSFLAG_FAILIFNOCERT 	0x1
 #define TLSFLAG_NOSTARTTLS	0x8
 #define TLSFLAG_DISABLECLIENTCERT 0x10
+#define TLSFLAG_NOKTLS		0x20
+#define TLSFLAG_TICKETS		0x40
 
 /** This shows the Client struct (any client), the User struct (a user), Server (a server) that are commonly accessed both in the core and by 3rd party coders.
  * @defgroup CommonStructs Common structs
  * @{
  */
 
+/** Dense array of client pointers, mirroring one of the client lists
+ * (see the dense mirror section in src/list.c). Full-population sweeps
+ * iterate this as a linear read instead of chasing list pointers all
+ * over the heap. Deletion swap-removes, so iteration order is
+ * arbitrary; 'generation' is bumped on every mutation so an iterator
+ * can tell the array shifted under it.
+ */
+typedef struct ClientArray ClientArray;
+struct ClientArray {
+	Client **items;			/**< The clients; valid slots are 0..count-1 */
+	int count;			/**< Number of clients in items[] */
+	int allocated;			/**< Slots allocated (grow-only) */
+	unsigned int generation;	/**< Bumped on every add/remove */
+};
+
 /** A client on this or a remote server - can be a user, server, unknown, etc..
  */
 struct Client {
-	struct list_head client_node;		/**< For global client list (client_list) */
-	struct list_head lclient_node;		/**< For local client list (lclient_list) */
-	struct list_head special_node;		/**< For special lists (server || unknown || oper) */
+	/* LAYOUT CONTRACT: the fields from here up to the 'end of hot
+	 * header' marker are the ones that the sendto_*() fanout and the
+	 * can-send checks read for every recipient, and they must stay
+	 * packed together at the top of the struct so that delivering to
+	 * a client touches only the first two cache lines. Add new
+	 * fields here ONLY if they are read per-message for arbitrary
+	 * recipients; everything else goes below the marker (or in
+	 * LocalClient/ClientUser/Server, which already keep the bulk of
+	 * the rarely-read data behind a pointer).
+	 */
+	Client *direction;			/**< Direction from which this client originated.
+	                                             This always points to a directly connected server or &me.
+	                                             It is never NULL */
 	LocalClient *local;			/**< Additional information regarding locally connected clients */
 	ClientUser *user;			/**< Additional information, if this client is a user */
-	Server *serv;				/**< Additional information, if this is a server */
 	ClientStatus status;			/**< Client status, one of CLIENT_STATUS_* */
-	struct list_head client_hash;		/**< For name hash table (clientTable) */
-	char name[HOSTLEN + 1];			/**< Unique name of the client: nickname for users, hostname for servers */
-	time_t lastnick;			/**< Timestamp on nick */
 	long flags;				/**< Client flags (one or more of CLIENT_FLAG_*) */
 	long umodes;				/**< Client usermodes (if user) */
-	Client *direction;			/**< Direction from which this client originated.
-	                                             This always points to a directly connected server or &me.
-	                                             It is never NULL */
+	char name[HOSTLEN + 1];			/**< Unique name of the client: nickname for users, hostname for servers */
+	/* === End of hot header, cold / bookkeeping fields below. === */
+	struct list_head client_node;		/**< For global client list (client_list) */
+	struct list_head lclient_node;		/**< For local client list (lclient_list) */
+	int client_array_pos;			/**< Slot in the dense client_array mirror (-1 = not listed) - internal to list.c */
+	struct list_head special_node;		/**< For special lists (server || unknown || oper) */
+	struct list_head pend_write_node;	/**< For pending_write_list: local clients with data to flush this loop iteration */
+	Server *serv;				/**< Additional information, if this is a server */
+	Client *srvptr;				/**< Server on where this client is connected to (can be &me) */
+	time_t lastnick;			/**< Timestamp on nick */
 	unsigned char hopcount;			/**< Number of servers to this, 0 means local client */
+	unsigned char in_client_hash;		/**< In the name hash table (clientTable)? */
+	unsigned char in_id_hash;		/**< In the UID/SID hash table (idTable)? */
 	char ident[USERLEN + 1];		/**< Ident of the user, if available. Otherwise set to "unknown". */
-	char info[REALLEN + 1];			/**< Additional client information text. For users this is gecos/realname */
 	char id[IDLEN + 1];			/**< Unique ID: SID or UID */
-	struct list_head id_hash;		/**< For UID/SID hash table (idTable) */
-	Client *srvptr;				/**< Server on where this client is connected to (can be &me) */
+	char info[REALLEN + 1];			/**< Additional client information text. For users this is gecos/realname */
 	char *ip;				/**< IP address of user or server (never NULL) */
 	ModData moddata[MODDATA_MAX_CLIENT];	/**< Client attached module data, used by the ModData system */
 };
 
+/** Handshake phase timings of a local connection.
+ * Phases that did not run (or have not finished) have their _ms field
+ * at -1. Completed phases are also aggregated into the server-wide
+ * histograms (see handshake_phase_done() in socket.c and
+ * /STATS handshake), so "connecting is slow" can be attributed to
+ * DNS, ident, DNSBL or the TLS handshake instead of guessed at.
+ */
+typedef struct HandshakeTimings HandshakeTimings;
+struct HandshakeTimings {
+	struct timeval accepted;	/**< When the connection was accepted */
+	struct timeval dns_start;	/**< When the DNS lookup was started */
+	struct timeval ident_start;	/**< When the ident lookup was started */
+	struct timeval dnsbl_start;	/**< When the DNSBL checks were started */
+	struct timeval tls_start;	/**< When the TLS accept handshake was started */
+	int dns_ms;			/**< Duration of the DNS lookup, -1 if it did not run */
+	int ident_ms;			/**< Duration of the ident lookup, -1 if it did not run */
+	int dnsbl_ms;			/**< Duration of the DNSBL checks, -1 if they did not run */
+	int tls_ms;			/**< Duration of the TLS handshake, -1 if it did not run */
+	int total_ms;			/**< Accept to welcome, -1 while still registering */
+};
+
+/** Server-wide latency histogram for one handshake phase */
+typedef struct HandshakePhaseStats HandshakePhaseStats;
+struct HandshakePhaseStats {
+	unsigned int buckets[8];	/**< Bounds in handshake_bucket_ms[], last bucket = rest */
+	unsigned long long total_ms;	/**< Sum of all samples, for the average */
+	unsigned int samples;		/**< Number of completed phases recorded */
+};
+
 /** Local client information, use client->local to access these (see also @link Client @endlink).
  */
 struct LocalClient {
 	int fd;				/**< File descriptor, can be <0 if socket has been closed already. */
+	int lclient_array_pos;		/**< Slot in the dense lclient_array mirror (-1 = not listed) - internal to list.c */
 	SSL *ssl;			/**< OpenSSL/LibreSSL struct for SSL/TLS connection */
 	time_t since;			/**< Time when user will next be allowed to send something (actually since<currenttime+10) */
 	time_t firsttime;		/**< Time user was created (connected on IRC) */
@@ -1129,6 +1271,9 @@ struct LocalClient {
 	ConfigItem_class *class;	/**< The class { } block associated to this client */
 	int proto;			/**< PROTOCTL options */
 	long caps;			/**< User: enabled capabilities (via CAP command) */
+	long mtag_accept;		/**< User: bitmap of message tags we accept, derived from ->caps (see mtag_accept_bitmap) */
+	long mtag_accept_caps;		/**< ->caps value that mtag_accept was derived from */
+	unsigned int mtag_accept_gen;	/**< mtag_handler_generation that mtag_accept was derived from */
 	time_t nexttarget;		/**< Next time that a new target will be allowed (msg/notice/invite) */
 	u_char targets[MAXCCUSERS];	/**< Hash values of targets for target limiting */
 	ConfigItem_listen *listener;	/**< If this client IsListening() then this is the listener configuration attached to it */
@@ -1142,8 +1287,11 @@ struct LocalClient {
 	u_short sendB;			/**< Statistics: counters to count upto 1-k lots of bytes */
 	u_short receiveB;		/**< Statistics: sent and received (???) */
 	short lastsq;			/**< # of 2k blocks when sendqueued called last */
-	Link *watch;			/**< Watch notification list (WATCH) for this user */
-	u_short watches;		/**< Number of entries in the watch list */
+	time_t sendq_above_since;	/**< Time the sendq rose above the 50%% class watermark, 0 while below (see sendq_pressure_account) */
+	unsigned char sendq_alerted;	/**< Early warning already sent for the current above-watermark episode */
+	WatchLink *watch;		/**< Watch notification list (WATCH and MONITOR) for this user */
+	u_short watches;		/**< Number of WATCH entries in the watch list */
+	u_short monitors;		/**< Number of MONITOR entries in the watch list */
 	ModData moddata[MODDATA_MAX_LOCAL_CLIENT];	/**< LocalClient attached module data, used by the ModData system */
 #ifdef DEBUGMODE
 	time_t cputime;			/**< Something with debugging (why is this a time_t? TODO) */
@@ -1162,14 +1310,38 @@ struct LocalClient {
 	struct hostent *hostp;		/**< Host record for this client (used by DNS code) */
 	char sockhost[HOSTLEN + 1];	/**< Hostname from the socket */
 	u_short port;			/**< Remote TCP port of client */
+	unsigned char corked;		/**< TCP_CORK/TCP_NOPUSH currently enabled on the socket (see sock_set_cork) */
+	struct Event *check_event;	/**< Per-client ping / timeout check timer (see client_check in ircd.c) */
+	unsigned char lag_immune;	/**< Cached ValidatePermissionsForPath("immune:lag") verdict */
+	time_t lag_immune_time;		/**< When the lag_immune verdict was cached (valid for that second only) */
+	TKLVerdictCache tkl_verdicts[TKLVERDICTCACHELEN];	/**< Cached server ban mask-match verdicts (see tkl.c) */
+	HandshakeTimings handshake;	/**< Handshake phase timings (see /STATS handshake) */
+	ZipLink *zip;			/**< zlib link compression state, only for server links with link::options::compressed (see src/zip.c) */
 };
 
 /** User information (persons, not servers), you use client->user to access these (see also @link Client @endlink).
  */
+/* WHO index: secondary indexes over online users so that WHO with an
+ * exact account/IP/host term only visits candidates (see src/hash.c).
+ */
+#define WHOINDEX_ACCOUNT	0
+#define WHOINDEX_IP		1
+#define WHOINDEX_HOST		2	/**< The visible host (GetHost) */
+#define WHOINDEX_REALHOST	3
+#define WHOINDEX_MAX		4
+
+typedef struct WhoIndexEntry WhoIndexEntry;
+struct WhoIndexEntry {
+	WhoIndexEntry *prev, *next;	/**< Bucket neighbours (may hold other keys) */
+	Client *client;
+	char *key;			/**< The key this entry is filed under */
+};
+
 struct User {
 	Membership *channel;		/**< Channels that the user is in (linked list) */
 	Link *invited;			/**< Channels has the user been invited to (linked list) */
 	Link *dccallow;			/**< DCCALLOW list (linked list) */
+	uint64_t dccallow_bloom;	/**< Bloom word over the DCC_LINK_ME entries above, see list_bloom_mask() */
 	char *away;			/**< AWAY message, or NULL if not away */
 	char svid[SVIDLEN + 1];		/**< Unique value assigned by services (SVID) */
 	unsigned short joined;		/**< Number of channels joined */
@@ -1193,10 +1365,37 @@ struct User {
 		unsigned char invite_c;	/**< For set::anti-flood::invite-flood: counter */
 	} flood;			/**< Anti-flood counters */
 	time_t lastaway;		/**< Last time the user went AWAY */
+	struct {
+		char nick[NICKLEN + 1];	/**< Nick that 'buf' below was built for */
+		char buf[NICKLEN + USERLEN + HOSTLEN + 4];	/**< The formatted ":nick!user@host" prefix */
+		unsigned short len;	/**< Length of 'buf', 0 means not built yet / invalidated */
+	} prefix;			/**< Cached sender prefix for local message delivery - built lazily by send.c, invalidated by userhost_changed() */
+	struct {
+		char buf[USERLEN + HOSTLEN + 2];	/**< The formatted "user@realhost" value */
+		unsigned short len;	/**< Length of 'buf', 0 means not built yet / invalidated */
+	} userhost_tag;			/**< Cached value of the unrealircd.org/userhost message tag - built lazily by the userhost-tag module, invalidated by userhost_changed() */
+	struct {
+		char buf[USERLEN + HOSTLEN + 2];	/**< The formatted "user@ip" value */
+		unsigned short len;	/**< Length of 'buf', 0 means not built yet / invalidated */
+	} userip_tag;			/**< Cached value of the unrealircd.org/userip message tag - built lazily by the userip-tag module, invalidated by userhost_changed() */
+	unsigned int acl_generation;	/**< Bumped when anything ban masks can match on changes (nick, user@host, account, umodes, channel membership) */
+	WhoIndexEntry *who_index[WHOINDEX_MAX];	/**< WHO index entries this user is filed under (see src/hash.c) */
 };
 
 /** Server information (local servers and remote servers), you use client->serv to access these (see also @link Client @endlink).
  */
+/** A registered post-EOS sync generator (see syncsched_register in src/serv.c).
+ * The generate function sends up to 'budget' lines of its state to 'to',
+ * using to->serv->syncsched.cursor[] to remember where it left off, and
+ * returns 0 once everything has been sent (non-zero: call again).
+ */
+struct SyncSchedGenerator {
+	SyncSchedGenerator *prev, *next;
+	char *name;			/**< Name (eg "tkl") */
+	int priority;			/**< Lower value runs earlier */
+	int (*generate)(Client *to, int budget);
+};
+
 struct Server {
 	char *up;			/**< Name of uplink for this server */
 	char by[NICKLEN + 1];		/**< Uhhhh - who activated this connection - AGAIN? */
@@ -1208,6 +1407,11 @@ struct Server {
 		unsigned synced:1;	/**< Server synchronization finished? (3.2beta18+) */
 		unsigned server_sent:1;	/**< SERVER message sent to this link? (for outgoing links) */
 	} flags;
+	struct {
+		SyncSchedGenerator *gen;	/**< Generator currently feeding this (local) link, or NULL (see syncsched_start) */
+		int cursor[2];			/**< Scratch resume position for that generator (eg hash bucket indexes) */
+		unsigned long long scratch;	/**< More generator scratch (eg the TKL digest-bucket bitmask) */
+	} syncsched;
 	struct {
 		char *usermodes;	/**< Usermodes that this server knows about */
 		char *chanmodes[4];	/**< Channel modes that this server knows (in 4 groups, like CHANMODES= in ISUPPORT/005) */
@@ -1219,10 +1423,30 @@ struct Server {
 
 /* @} */
 
+/** Number of serialization memo slots on a message tag list head.
+ * Only a handful of distinct cap combinations occur among the
+ * recipients of one message.
+ */
+#define MTAG_MEMO_SLOTS	4
+
+/** Serialization memo for a message tag list (see mtags_to_string):
+ * remembers the rendered tag string per cap-filter bitmask so fanout
+ * to many recipients renders each cap-variant only once.
+ */
+typedef struct MessageTagMemo MessageTagMemo;
+struct MessageTagMemo {
+	int n;				/**< Slots in use */
+	long caps[MTAG_MEMO_SLOTS];	/**< Cap bitmask per slot */
+	char *str[MTAG_MEMO_SLOTS];	/**< Serialized tags for that cap set (empty string: no visible tags) */
+};
+
 struct MessageTag {
 	MessageTag *prev, *next;
 	char *name;
 	char *value;
+	MessageTagHandler *handler;	/**< Handler for ->name, cached lazily on first serialization */
+	MessageTagMemo *memo;		/**< Serialization memo, only ever set on the list head */
+	unsigned char arena;		/**< Carved out of the per-message arena, not heap-allocated (see new_mtag_arena) */
 };
 
 typedef struct NameValueList NameValueList;
@@ -1286,11 +1510,21 @@ struct ConditionalConfig
 	char *opt; /**< Only for IF_VALUE */
 };
 
+/** A bump-allocated memory block, see config_file_arena_alloc() */
+struct ConfigArena
+{
+	ConfigArena	*next;
+	size_t		size;	/**< Capacity of data[] */
+	size_t		used;	/**< Bytes of data[] handed out so far */
+	char		data[1];
+};
+
 struct ConfigFile
 {
         char            *cf_filename;
         ConfigEntry     *cf_entries;
         ConfigFile     *cf_next;
+        ConfigArena    *cf_arena;	/**< Storage for cf_entries nodes and their ce_vardata */
 };
 
 struct ConfigEntry
@@ -1363,6 +1597,13 @@ struct ConfigItem_admin {
 };
 
 #define CLASS_OPT_NOFAKELAG		0x1
+#define CLASS_OPT_LARGE_SENDQ_BLOCKS	0x2
+
+/** Number of buckets in the per-class flush-time sendq depth histogram,
+ * bucket bounds (in %% of the class sendq limit) are in sendq_hist_pct[],
+ * the last bucket catches the rest. See sendq_pressure_account() in send.c.
+ */
+#define SENDQ_HIST_NBUCKETS	8
 
 struct ConfigItem_class {
 	ConfigItem_class *prev, *next;
@@ -1373,6 +1614,11 @@ struct ConfigItem_class {
 	                * link blocks also refer to classes so a 2nd ref. count was needed.
 	                */
 	unsigned int options;
+	unsigned int sendq_peak; /**< Highest sendq seen for any client in this class (STATS Y) */
+	unsigned int sendq_overflows; /**< Number of clients killed for exceeding this class' sendq */
+	unsigned int sendq_hist[SENDQ_HIST_NBUCKETS]; /**< Sendq depth at flush time, bucketed by %% of the sendq limit (STATS Y) */
+	long long sendq_above_time; /**< Total seconds clients of this class spent above the 50%% sendq watermark */
+	unsigned int sendq_alerts; /**< Early warnings sent for server links stuck above the watermark */
 };
 
 struct ConfigFlag_allow {
@@ -1392,6 +1638,7 @@ struct ConfigItem_allow {
 	ConfigItem_class	*class;
 	ConfigFlag_allow	flags;
 	unsigned short ipv6_clone_mask;
+	long long hits; /**< Number of times a connecting client matched this block (for auditing) */
 };
 
 struct OperClassACLPath
@@ -1427,6 +1674,7 @@ struct OperClass
         char *ISA;
         char *name;
         OperClassACL *acls;
+        struct OperPermCache *permcache; /**< Cached permission verdicts, see src/operclass.c */
 };
 
 struct OperClassCheckParams
@@ -1521,6 +1769,9 @@ struct ConfigItem_listen {
 	SSL_CTX *ssl_ctx;
 	TLSOptions *tls_options;
 	int websocket_options; /* should be in module, but lazy */
+	int reuseport; /* listen::reuse-port: total number of SO_REUSEPORT listening sockets */
+	int shards; /* how many extra (SO_REUSEPORT) sockets are actually open */
+	int *shard_fd; /* the extra listening sockets, 'shards' entries */
 };
 
 struct ConfigItem_sni {
@@ -1529,6 +1780,7 @@ struct ConfigItem_sni {
 	char *name;
 	SSL_CTX *ssl_ctx;
 	TLSOptions *tls_options;
+	ConfigItem_sni *hnext;		/**< Next entry in the SNI name index (see find_sni) */
 };
 
 struct ConfigItem_vhost {
@@ -1629,6 +1881,9 @@ struct ConfigItem_log {
 	long maxsize;
 	int  flags;
 	int  logfd;
+	char *buffer; /**< Pending log data, written out by ircd_log_flush() */
+	int bufferlen; /**< Amount of pending data in 'buffer' */
+	long long dropped; /**< Number of log lines dropped because 'buffer' was full */
 };
 
 struct ConfigItem_unknown {
@@ -1653,6 +1908,7 @@ typedef enum {
 
 struct ConfigItem_alias {
 	ConfigItem_alias *prev, *next;
+	ConfigItem_alias *hnext; /**< Next entry in the same find_alias() hash bucket */
 	ConfigFlag flag;
 	ConfigItem_alias_format *format;
 	char *alias, *nick;
@@ -1784,10 +2040,29 @@ struct Mode {
 
 /* Used for notify-hash buckets... -Donwulff */
 
+/** One (watcher, watched nick) relationship. A single node is linked
+ * both into the watched nick's watcher list and into the watching
+ * client's own list, replacing the two Link allocations that used to
+ * back each WATCH entry. The watcher side is doubly linked so a
+ * quitting client can unlink itself from every watcher list in O(1),
+ * which matters when a netsplit takes thousands of watchers down at
+ * once.
+ */
+struct WatchLink {
+	WatchLink *next_watcher;	/**< Next watcher of the same nick */
+	WatchLink *prev_watcher;	/**< Previous watcher of the same nick */
+	WatchLink *next_entry;		/**< Next nick watched by the same client */
+	Watch *entry;			/**< The watched nick */
+	Client *watcher;		/**< The watching client */
+	unsigned char awaynotify;	/**< Watcher also wants away notifications (WATCH nick!) */
+	unsigned char watched;		/**< Subscribed via classic WATCH (600-series numerics) */
+	unsigned char monitor;		/**< Subscribed via MONITOR (730/731 numerics) */
+};
+
 struct Watch {
 	Watch *hnext;
 	time_t lasttime;
-	Link *watch;
+	WatchLink *watchers;
 	char nick[1];
 };
 
@@ -1819,19 +2094,28 @@ struct Channel {
 	struct Channel *nextch;			/**< Next channel in linked list (channel) */
 	struct Channel *prevch;			/**< Previous channel in linked list (channel) */
 	struct Channel *hnextch;		/**< Next channel in hash table */
+	struct Channel *lidx_prev;		/**< Previous channel in our size index bucket, see channel_sizeindex_update() */
+	struct Channel *lidx_next;		/**< Next channel in our size index bucket */
+	unsigned int lidx_bucket;		/**< Size index bucket this channel is currently filed in */
 	Mode mode;				/**< Channel Mode set on this channel */
 	time_t creationtime;			/**< When the channel was first created */
 	char *topic;				/**< Channel TOPIC */
 	char *topic_nick;			/**< Person (or server) who set the TOPIC */
 	time_t topic_time;			/**< Time at which the topic was last set */
 	int users;				/**< Number of users in the channel */
+	int local_members;			/**< Number of members that are local users (QUIT/NICK fanout skips channels where this is 0) */
 	Member *members;			/**< List of channel members (users in the channel) */
+	MemberChunk *memberchunks;		/**< Chunks holding the Member records of this channel */
 	Link *invites;				/**< List of outstanding /INVITE's from ops */
 	Ban *banlist;				/**< List of bans (+b) */
 	Ban *exlist;				/**< List of ban exceptions (+e) */
 	Ban *invexlist;				/**< List of invite exceptions (+I) */
 	char *mode_lock;			/**< Mode lock (MLOCK) applied to channel - usually by Services */
 	ModData moddata[MODDATA_MAX_CHANNEL];	/**< Channel attached module data, used by the ModData system */
+	unsigned int acl_generation;		/**< Bumped on every mode, ban list or membership change - invalidates cached can-send verdicts */
+	unsigned int acl_cacheable_gen;		/**< acl_generation that acl_cacheable below was computed for */
+	char acl_cacheable;			/**< May ban verdicts be cached for this channel? 0=not computed yet, 1=no, 2=yes */
+	int chnamelen;				/**< Cached strlen() of chname (set once at creation, chname never changes) */
 	char chname[1];				/**< Channel name */
 };
 
@@ -1848,6 +2132,35 @@ struct Member
 	ModData moddata[MODDATA_MAX_MEMBER];		/** Member attached module data, used by the ModData system */
 };
 
+/** Number of Member slots per chunk (must match the usedmap width) */
+#define MEMBER_CHUNK_SIZE	32
+
+/** Per-channel chunk of Member records.
+ * The Member structs of a channel live inside these chunks instead of
+ * being scattered over the heap, so fanning a message out to the
+ * channel walks mostly linear memory. The channel->members linked
+ * list still threads through the records unchanged, which is what
+ * modules iterate; records never move (a part just clears the slot)
+ * so Member pointers stay valid exactly as long as they used to.
+ */
+struct MemberChunk
+{
+	struct MemberChunk *next;			/**< Next chunk of this channel */
+	struct MemberChunk *prev;			/**< Previous chunk of this channel */
+	unsigned int usedmap;				/**< Bitmap of occupied slots */
+	Member slot[MEMBER_CHUNK_SIZE];			/**< The member records */
+};
+
+/** Iterate over all members of a channel in memory (chunk) order.
+ * This is the cache-friendly equivalent of walking channel->members
+ * and is what the fanout paths use. 'chunk' is a MemberChunk *,
+ * 'member' a Member * and 'i' an int, all just iteration variables.
+ */
+#define for_each_channel_member_chunked(channel, chunk, member, i) \
+	for ((chunk) = (channel)->memberchunks; (chunk); (chunk) = (chunk)->next) \
+		for ((i) = 0, (member) = (chunk)->slot; (i) < MEMBER_CHUNK_SIZE; (i)++, (member)++) \
+			if ((chunk)->usedmap & (1U << (i)))
+
 /** user/channel membership struct (client->user->channels).
  * This is Membership which is used in the linked list client->user->channels for each user.
  * There is also Member which is used in channel->members (see Member for that).
@@ -1858,18 +2171,55 @@ struct Membership
 	struct Membership 	*next;			/**< Next entry in list */
 	struct Channel		*channel;			/**< The channel */
 	int			flags;			/**< The access of the user on this channel (one or more of CHFL_*) */
+	unsigned int		acl_generation;		/**< channel->acl_generation that acl_not_banned was computed at */
+	unsigned int		acl_client_generation;	/**< user->acl_generation that acl_not_banned was computed at */
+	char			acl_not_banned;		/**< 1 = cached verdict "user passes the message ban check" (a deny is never cached) */
 	ModData moddata[MODDATA_MAX_MEMBERSHIP];	/**< Membership attached module data, used by the ModData system */
 };
 
 /** @} */
 
+/** A wildcard mask, compiled for repeated evaluation.
+ * Produced by compile_simple_mask() in src/match.c: the mask is split
+ * on its '*'s into lowercased literal segments once, so evaluating it
+ * is a single left-to-right walk over the string, with none of the
+ * per-call re-interpretation and backtracking of match_simple().
+ * Matching semantics are identical to match_simple().
+ */
+struct CompiledMask {
+	char *buf;	/**< Lowercased mask text, '*' runs replaced by '\0' (segment storage) */
+	char **seg;	/**< The literal segments (pointers into 'buf', may contain '?') */
+	int *seglen;	/**< Length of each segment */
+	int numseg;	/**< Number of segments */
+	char anchor_l;	/**< 1 = mask did not start with '*': segment 0 must match at the start */
+	char anchor_r;	/**< 1 = mask did not end with '*': the last segment must match at the end */
+};
+
 /** A ban, exempt or invite exception entry */
 struct Ban {
 	struct Ban *next;	/**< Next entry in list */
 	char *banstr;		/**< The string (eg: *!*@*.example.org) */
 	char *who;		/**< Person or server who set the entry (eg: Nick) */
 	time_t when;		/**< When the entry was added */
-};
+	unsigned char banclass;	/**< Fast matcher class (BANCLASS_*), cached, derived from 'banstr' only */
+	unsigned char cidrfamily;	/**< BANCLASS_CIDR: address family (AF_INET / AF_INET6) */
+	unsigned char cidrbits;	/**< BANCLASS_CIDR: prefix length of the mask */
+	uint64_t banhash;	/**< BANCLASS_EXACT: siphash_nocase() of 'banstr' */
+	unsigned char cidraddr[16];	/**< BANCLASS_CIDR: the address portion of the mask */
+	CompiledMask *cmask;	/**< BANCLASS_WILD: 'banstr' compiled to segments */
+};
+
+/* Ban matcher classes, see ban_classify() in src/channel.c.
+ * These are a pure cache over 'banstr': entries start out as
+ * BANCLASS_UNCLASSIFIED (make_ban() zeroes the struct) and are
+ * classified on first use, so code that builds ban lists directly
+ * (channeldb, sjoin, ..) does not need to do anything special.
+ */
+#define BANCLASS_UNCLASSIFIED	0	/**< Not looked at yet */
+#define BANCLASS_GENERIC	1	/**< Needs the full matcher (wildcards, extbans, ..) */
+#define BANCLASS_EXACT		2	/**< Literal nick!user@host: hash plus string compare */
+#define BANCLASS_CIDR		3	/**< nick!user@ip/prefix host: binary prefix compare */
+#define BANCLASS_WILD		4	/**< Plain wildcard nick!user@host: compiled segment match */
 
 /*
 ** Channel Related macros follow
@@ -1978,6 +2328,11 @@ struct Ban {
 
 
 #define TStime() (timeofday)
+/** Cached monotonic clock in milliseconds, refreshed once per main loop
+ * iteration. Use for duration arithmetic that must survive wall clock
+ * steps; for a fresh read see mono_time_usec().
+ */
+#define MonoTime() (monotime_ms)
 
 /* used in SetMode() in channel.c and cmd_umode() in s_msg.c */
 
@@ -2020,12 +2375,26 @@ extern MODVAR SSL_CTX *ctx_client;
 
 struct ThrottlingBucket
 {
-	struct ThrottlingBucket *prev, *next;
-	char *ip;
 	time_t since;
 	char count;
 };
 
+/** Unified per-IP state table (see src/hash.c).
+ * A single connecting IP used to be looked up in several separately
+ * hashed IP-keyed tables (connect-flood throttling, reputation, ..).
+ * Instead, subsystems now request a slot and attach their record to
+ * the one shared entry for that IP, moddata-style, so the registration
+ * hot path hashes the address once.
+ */
+#define IPSTATE_MAX_SLOTS 8
+
+typedef struct IpStateEntry IpStateEntry;
+struct IpStateEntry {
+	IpStateEntry *prev, *next;	/**< Previous and next in hash list */
+	char *ip;			/**< The IP address this entry is for */
+	void *data[IPSTATE_MAX_SLOTS];	/**< Per-subsystem records (or NULL) */
+};
+
 typedef struct CoreChannelModeTable CoreChannelModeTable;
 struct CoreChannelModeTable {
 	long mode;			/**< Mode value (which bit will be set) */
@@ -2139,6 +2508,7 @@ struct ConfigItem_badword {
 	unsigned short	type;
 	char		action;
 	pcre2_code	*pcre2_expr;
+	unsigned int	scan_id; /**< Aho-Corasick scan marker, see src/match.c */
 };
 
 /*-- end of badwords --*/
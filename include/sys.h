@@ -61,12 +61,26 @@
 #ifndef _WIN32
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #else
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #endif
 
+#ifdef _WIN32
+/* Windows has no writev() / struct iovec. deliver_itv() falls back
+ * to per-buffer send() there, but needs the iovec shape to exist.
+ */
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+#endif
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 #ifndef _WIN32
 #include <sys/time.h>
 #endif
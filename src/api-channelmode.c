@@ -48,6 +48,11 @@ static void make_cmodestr(void);
 static char previous_chanmodes[256];
 static Cmode *ParamTable[MAXPARAMMODES+1];
 static void unload_extcmode_commit(Cmode *cmode);
+/** Direct mode letter to Channelmode_Table slot mapping (-1: not registered),
+ * kept in sync by CmodeAdd() and unload_extcmode_commit() so MODE parsing
+ * can resolve a letter without scanning the table - see extcmode_find().
+ */
+static short extcmode_index[256];
 
 /** Create the strings that are used for CHANMODES=a,b,c,d in numeric 005 */
 void make_extcmodestr()
@@ -159,6 +164,8 @@ void extcmode_init(void)
 		Channelmode_Table[i].mode = val;
 		val *= 2;
 	}
+	for (i = 0; i < 256; i++)
+		extcmode_index[i] = -1;
 	Channelmode_highest = 0;
 	memset(&extchmstr, 0, sizeof(extchmstr));
 	memset(&param_to_slot_mapping, 0, sizeof(param_to_slot_mapping));
@@ -265,7 +272,8 @@ Cmode *CmodeAdd(Module *module, CmodeInfo req, Cmode_t *mode)
 	Channelmode_Table[i].unset_with_param = req.unset_with_param;
 	Channelmode_Table[i].owner = module;
 	Channelmode_Table[i].unloaded = 0;
-	
+	extcmode_index[(unsigned char)req.flag] = i;
+
 	for (j = 0; j < EXTCMODETABLESZ; j++)
 		if (Channelmode_Table[j].flag)
 			if (j > Channelmode_highest)
@@ -381,9 +389,21 @@ static void unload_extcmode_commit(Cmode *cmode)
 		extcmode_para_delslot(cmode, cmode->slot);
 	}
 
+	extcmode_index[(unsigned char)cmode->flag] = -1;
 	cmode->flag = '\0';
 }
 
+/** Find an extended channel mode by letter - a direct lookup, no scan.
+ * @param flag	The mode letter (eg: 'f')
+ * @returns The Cmode table entry, or NULL if no such mode is registered.
+ */
+Cmode *extcmode_find(char flag)
+{
+	short i = extcmode_index[(unsigned char)flag];
+
+	return (i >= 0) ? &Channelmode_Table[i] : NULL;
+}
+
 /** Unload all unused channel modes after a REHASH */
 void unload_all_unused_extcmodes(void)
 {
@@ -23,6 +23,53 @@
 #include "unrealircd.h"
 
 MODVAR ClientCapability *clicaps = NULL; /* List of client capabilities */
+MODVAR int clicap_generation = 0; /**< Bumped when 'clicaps' changes, so cached CAP LS renderings can be invalidated */
+
+/* Hash table over capability names. By-name lookups happen a lot more
+ * often than the size of the registry suggests: ClientCapabilityBit()
+ * and HasCapability() resolve tokens per command - sometimes per
+ * recipient - in the send paths, and CAP REQ resolves one per token.
+ * With ~64 buckets for a few dozen caps a lookup is one hash plus
+ * (almost always) a single compare, instead of a strcasecmp() walk.
+ */
+#define CLICAP_HASH_TABLE_SIZE 64
+static ClientCapability *clicap_hash_table[CLICAP_HASH_TABLE_SIZE];
+static char siphashkey_clicap[SIPHASH_KEY_LENGTH];
+
+static unsigned int clicap_hash(const char *name)
+{
+	static int siphashkey_initialized = 0;
+
+	if (!siphashkey_initialized)
+	{
+		siphash_generate_key(siphashkey_clicap);
+		siphashkey_initialized = 1;
+	}
+	return siphash_nocase(name, siphashkey_clicap) % CLICAP_HASH_TABLE_SIZE;
+}
+
+static void clicap_hash_add(ClientCapability *clicap)
+{
+	unsigned int b = clicap_hash(clicap->name);
+
+	clicap->hnext = clicap_hash_table[b];
+	clicap_hash_table[b] = clicap;
+}
+
+static void clicap_hash_del(ClientCapability *clicap)
+{
+	ClientCapability **p;
+
+	for (p = &clicap_hash_table[clicap_hash(clicap->name)]; *p; p = &(*p)->hnext)
+	{
+		if (*p == clicap)
+		{
+			*p = clicap->hnext;
+			clicap->hnext = NULL;
+			return;
+		}
+	}
+}
 
 void clicap_init(void)
 {
@@ -39,7 +86,7 @@ ClientCapability *ClientCapabilityFindReal(const char *token)
 {
 	ClientCapability *clicap;
 
-	for (clicap = clicaps; clicap; clicap = clicap->next)
+	for (clicap = clicap_hash_table[clicap_hash(token)]; clicap; clicap = clicap->hnext)
 	{
 		if (!strcasecmp(token, clicap->name))
 			return clicap;
@@ -57,16 +104,13 @@ ClientCapability *ClientCapabilityFindReal(const char *token)
  */
 ClientCapability *ClientCapabilityFind(const char *token, Client *client)
 {
-	ClientCapability *clicap;
+	ClientCapability *clicap = ClientCapabilityFindReal(token);
 
-	for (clicap = clicaps; clicap; clicap = clicap->next)
+	if (clicap)
 	{
-		if (!strcasecmp(token, clicap->name))
-		{
-			if (clicap->visible && !clicap->visible(client))
-				return NULL; /* hidden */
-			return clicap;
-		}
+		if (clicap->visible && !clicap->visible(client))
+			return NULL; /* hidden */
+		return clicap;
 	}
 	return NULL;
 }
@@ -181,7 +225,11 @@ ClientCapability *ClientCapabilityAdd(Module *module, ClientCapabilityInfo *clic
 	clicap->parameter = clicap_request->parameter;
 
 	if (!exists)
+	{
 		AddListItem(clicap, clicaps);
+		clicap_hash_add(clicap);
+	}
+	clicap_generation++;
 
 	if (clicap->cap && !cap)
 		abort(); /* module API call error */
@@ -221,9 +269,11 @@ void unload_clicap_commit(ClientCapability *clicap)
 		clicap->mtag_handler->clicap_handler = NULL;
 
 	/* Destroy the capability */
+	clicap_hash_del(clicap);
 	DelListItem(clicap, clicaps);
 	safe_free(clicap->name);
 	safe_free(clicap);
+	clicap_generation++;
 }
 /**
  * Removes the specified clicap token.
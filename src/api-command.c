@@ -26,6 +26,70 @@
 static Command *CommandAddInternal(Module *module, char *cmd, CmdFunc func, AliasCmdFunc aliasfunc, unsigned char params, int flags);
 static RealCommand *add_Command_backend(char *cmd);
 
+/** Single-entry dispatch cache for command lookups, indexed by the
+ * (upper cased) first byte and the length of the command name.
+ * PRIVMSG, PING, PONG, MODE and JOIN make up nearly all traffic, so
+ * resolving them costs one table read and one string compare instead
+ * of a walk along the hash chain with per-entry flag checks.
+ * The cache is only used for unrestricted lookups: flag-restricted
+ * lookups like CMD_UNREGISTERED or CMD_ALIAS may legitimately resolve
+ * the same name to a different command, or to none at all.
+ * The cache is wiped whenever a command is added or removed.
+ */
+#define CMD_FASTPATH_MAXLEN	16
+#define CMD_FASTPATH_RESTRICTED	(CMD_UNREGISTERED|CMD_SHUN|CMD_VIRUS|CMD_ALIAS)
+static RealCommand *cmd_fastpath[256][CMD_FASTPATH_MAXLEN];
+
+/** Pre-registration dispatch table. Unregistered connections may only
+ * run a dozen or so commands (NICK, USER, CAP, PASS, PONG, ..), yet
+ * under a connect flood their handshake chatter - and whatever garbage
+ * bots send along with it - dominates parse volume, and each line used
+ * to walk a hash chain with per-entry flag checks. The table below is
+ * built lazily from the commands carrying CMD_UNREGISTERED: legal
+ * commands resolve with one table read plus one string compare, and
+ * anything whose first byte cannot start a legal command is rejected
+ * with a single array read before any chain is touched.
+ */
+static RealCommand *cmd_prereg_fastpath[256][CMD_FASTPATH_MAXLEN];
+static char cmd_prereg_present[256]; /**< 1 if any CMD_UNREGISTERED command lives in CommandHash[byte] */
+static int cmd_prereg_built = 0;
+
+static void invalidate_cmd_fastpath(void)
+{
+	memset(cmd_fastpath, 0, sizeof(cmd_fastpath));
+	cmd_prereg_built = 0;
+}
+
+/** (Re)build the pre-registration dispatch table, see above.
+ * Slots are only filled when empty so that on a [first byte][length]
+ * collision the entry earliest in the hash chain wins, matching the
+ * chain walk in find_command() - the loser simply falls through to
+ * that walk.
+ */
+static void build_cmd_prereg_table(void)
+{
+	int i, len;
+	RealCommand *p;
+
+	memset(cmd_prereg_fastpath, 0, sizeof(cmd_prereg_fastpath));
+	memset(cmd_prereg_present, 0, sizeof(cmd_prereg_present));
+
+	for (i = 0; i < 256; i++)
+	{
+		for (p = CommandHash[i]; p; p = p->next)
+		{
+			if (!(p->flags & CMD_UNREGISTERED))
+				continue;
+			cmd_prereg_present[i] = 1;
+			len = strlen(p->cmd);
+			if ((len < CMD_FASTPATH_MAXLEN) && !cmd_prereg_fastpath[i][len])
+				cmd_prereg_fastpath[i][len] = p;
+		}
+	}
+
+	cmd_prereg_built = 1;
+}
+
 /** @defgroup CommandAPI Command API
  * @{
  */
@@ -38,7 +102,7 @@ int CommandExists(char *name)
 	
 	for (p = CommandHash[toupper(*name)]; p; p = p->next)
 	{
-		if (!strcasecmp(p->cmd, name))
+		if (!smycmp(p->cmd, name))
 			return 1;
 	}
 
@@ -107,6 +171,10 @@ static Command *CommandAddInternal(Module *module, char *cmd, CmdFunc func, Alia
 	c = add_Command_backend(cmd);
 	c->parameters = (params > MAXPARA) ? MAXPARA : params;
 	c->flags = flags;
+	/* Precompute the base fake lag cost that parse_addlag() charges
+	 * for this command (a per-byte component is added on top).
+	 */
+	c->fakelag_cost = (flags & CMD_NOLAG) ? 0 : 1;
 	c->func = func;
 	c->aliasfunc = aliasfunc;
 
@@ -135,6 +203,7 @@ void CommandDelX(Command *command, RealCommand *cmd)
 	CommandOverride *ovr, *ovrnext;
 
 	DelListItem(cmd, CommandHash[toupper(*cmd->cmd)]);
+	invalidate_cmd_fastpath();
 	if (command && cmd->owner)
 	{
 		ModuleObject *cmdobj;
@@ -242,6 +311,8 @@ static RealCommand *add_Command_backend(char *cmd)
 	/* Add in hash with hash value = first byte */
 	AddListItem(c, CommandHash[toupper(*cmd)]);
 
+	invalidate_cmd_fastpath();
+
 	return c;
 }
 
@@ -253,6 +324,37 @@ static RealCommand *add_Command_backend(char *cmd)
 RealCommand *find_command(char *cmd, int flags)
 {
 	RealCommand *p;
+	int fastpath = !(flags & CMD_FASTPATH_RESTRICTED);
+	int len = 0;
+
+	if ((flags & CMD_UNREGISTERED) && !(flags & (CMD_SHUN|CMD_VIRUS|CMD_ALIAS)))
+	{
+		/* Pre-registration lookup: use the restricted dispatch table */
+		if (!cmd_prereg_built)
+			build_cmd_prereg_table();
+		if (!cmd_prereg_present[toupper(*cmd)])
+			return NULL; /* no legal pre-registration command starts with this byte */
+		len = strlen(cmd);
+		if (len < CMD_FASTPATH_MAXLEN)
+		{
+			p = cmd_prereg_fastpath[toupper(*cmd)][len];
+			if (p && !smycmp(p->cmd, cmd))
+				return p;
+		}
+		/* Slot collision or oversized name: fall through to the chain walk */
+	}
+
+	if (fastpath)
+	{
+		len = strlen(cmd);
+		if (len < CMD_FASTPATH_MAXLEN)
+		{
+			p = cmd_fastpath[toupper(*cmd)][len];
+			if (p && !smycmp(p->cmd, cmd))
+				return p;
+		}
+	}
+
 	for (p = CommandHash[toupper(*cmd)]; p; p = p->next) {
 		if ((flags & CMD_UNREGISTERED) && !(p->flags & CMD_UNREGISTERED))
 			continue;
@@ -262,8 +364,12 @@ RealCommand *find_command(char *cmd, int flags)
 			continue;
 		if ((flags & CMD_ALIAS) && !(p->flags & CMD_ALIAS))
 			continue;
-		if (!strcasecmp(p->cmd, cmd))
+		if (!smycmp(p->cmd, cmd))
+		{
+			if (fastpath && (len < CMD_FASTPATH_MAXLEN))
+				cmd_fastpath[toupper(*cmd)][len] = p;
 			return p;
+		}
 	}
 	return NULL;
 }
@@ -275,7 +381,7 @@ RealCommand *find_command_simple(char *cmd)
 
 	for (c = CommandHash[toupper(*cmd)]; c; c = c->next)
 	{
-		if (!strcasecmp(c->cmd, cmd))
+		if (!smycmp(c->cmd, cmd))
 				return c;
 	}
 
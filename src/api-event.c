@@ -27,7 +27,103 @@ ID_Copyright("(C) Carsten Munk 2001");
 
 MODVAR Event *events = NULL;
 
-extern EVENT(unrealdns_removeoldrecords);
+/* The events are scheduled on a hashed hierarchical timer wheel:
+ * each event sits in the bucket corresponding to its next expiry, so
+ * adding, cancelling and expiry processing are all O(1) - DoEvents()
+ * only ever touches events that are actually due, instead of walking
+ * the full 'events' list every main loop iteration. The 'events'
+ * linked list is kept purely as the registry (EventFind, EventStatus,
+ * module cleanup).
+ *
+ * Level 0 holds timers expiring within the next 64 ticks (about one
+ * second), each higher level covers 64 times the span of the one
+ * below it; when a lower level wraps, one bucket of the level above
+ * is cascaded down. Classic design, see Varghese & Lauck.
+ */
+
+#define TIMER_WHEEL_BITS	6
+#define TIMER_WHEEL_SLOTS	(1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK	(TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS	4
+#define TIMER_TICK_MSEC		16
+
+static Event *timer_wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+static long long wheel_tick = 0; /**< The wheel's idea of "now", in ticks. 0 = not initialized yet. */
+
+/** Current time in milliseconds, same clock as timeofday_tv */
+static long long event_now_msec(void)
+{
+	return (long long)timeofday_tv.tv_sec * 1000 + timeofday_tv.tv_usec / 1000;
+}
+
+/** Remove an event from its timer wheel bucket (if queued at all) */
+static void wheel_unlink(Event *e)
+{
+	if (!e->wheel_bucket)
+		return;
+	if (e->wheel_prev)
+		e->wheel_prev->wheel_next = e->wheel_next;
+	else
+		*e->wheel_bucket = e->wheel_next;
+	if (e->wheel_next)
+		e->wheel_next->wheel_prev = e->wheel_prev;
+	e->wheel_prev = e->wheel_next = NULL;
+	e->wheel_bucket = NULL;
+}
+
+/** Queue an event on the wheel according to e->expiry */
+static void wheel_link(Event *e)
+{
+	long long expires_tick = e->expiry / TIMER_TICK_MSEC;
+	long long delta, max;
+	Event **bucket;
+	int level;
+
+	if (!wheel_tick)
+		wheel_tick = event_now_msec() / TIMER_TICK_MSEC;
+
+	/* Anything due now (or overdue) goes into the next tick */
+	if (expires_tick <= wheel_tick)
+		expires_tick = wheel_tick + 1;
+
+	/* Beyond the wheel's horizon: park it as far away as we can,
+	 * it will simply be cascaded and re-examined from there.
+	 */
+	max = 1LL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS);
+	if (expires_tick - wheel_tick >= max)
+		expires_tick = wheel_tick + max - 1;
+
+	delta = expires_tick - wheel_tick;
+	for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++)
+		if (delta < (1LL << (TIMER_WHEEL_BITS * (level + 1))))
+			break;
+
+	bucket = &timer_wheel[level][(expires_tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+	e->wheel_prev = NULL;
+	e->wheel_next = *bucket;
+	if (*bucket)
+		(*bucket)->wheel_prev = e;
+	*bucket = e;
+	e->wheel_bucket = bucket;
+}
+
+/** Move all events from a higher-level bucket down to their proper
+ * (more precise) spot, now that time has advanced into their range.
+ */
+static void wheel_cascade(int level, int slot)
+{
+	Event *e, *e_next;
+
+	e = timer_wheel[level][slot];
+	timer_wheel[level][slot] = NULL;
+	for (; e; e = e_next)
+	{
+		e_next = e->wheel_next;
+		e->wheel_prev = e->wheel_next = NULL;
+		e->wheel_bucket = NULL;
+		wheel_link(e);
+	}
+}
 
 /** Add an event, a function that will run at regular intervals.
  * @param module	Module that this event belongs to
@@ -74,6 +170,8 @@ Event *EventAdd(Module *module, char *name, vFP event, void *data, long every_ms
 	newevent->last_run.tv_sec = timeofday_tv.tv_sec;
 	newevent->last_run.tv_usec = timeofday_tv.tv_usec;
 	newevent->owner = module;
+	newevent->expiry = event_now_msec() + every_msec;
+	wheel_link(newevent);
 	AddListItem(newevent,events);
 	if (module)
 	{
@@ -95,8 +193,11 @@ void EventDel(Event *e)
 {
 	char buf[128];
 
-	/* Mark for deletion */
+	/* Mark for deletion and take it off the timer wheel right away
+	 * (cancellation is O(1), the struct itself is freed later).
+	 */
 	e->deleted = 1;
+	wheel_unlink(e);
 
 	/* Replace the name so deleted events are clearly labeled */
 	if (e->name)
@@ -136,6 +237,7 @@ static void EventDelReal(Event *e)
 		abort();
 	}
 	safe_free(e->name);
+	wheel_unlink(e); /* already done by EventDel(), but better safe */
 	DelListItem(e, events);
 	safe_free(e);
 }
@@ -184,6 +286,17 @@ int EventMod(Event *event, EventInfo *mods)
 		}
 
 		event->every_msec = mods->every_msec;
+
+		/* Reschedule according to the new interval */
+		if (!event->deleted)
+		{
+			long long next = ((long long)event->last_run.tv_sec * 1000 + event->last_run.tv_usec / 1000) + event->every_msec;
+			long long now = event_now_msec();
+
+			event->expiry = (next < now) ? now : next;
+			wheel_unlink(event);
+			wheel_link(event);
+		}
 	}
 	if (mods->flags & EMOD_HOWMANY)
 		event->count = mods->count;
@@ -198,47 +311,162 @@ int EventMod(Event *event, EventInfo *mods)
 	return 0;
 }
 
-void DoEvents(void)
+/** Run one expired event and put it back on the wheel for its next
+ * interval (the caller has already taken it off).
+ */
+static void RunEvent(Event *e)
 {
-	Event *e;
+	if (e->deleted)
+		return;
+	if (e->count == -1)
+	{
+		EventDel(e);
+		return;
+	}
 
-	for (e = events; e; e = e->next)
+	(*e->event)(e->data);
+	e->last_run.tv_sec = timeofday_tv.tv_sec;
+	e->last_run.tv_usec = timeofday_tv.tv_usec;
+
+	/* The handler may have deleted its own event (eg: a per-client
+	 * timer whose client got exited) or rescheduled it already.
+	 */
+	if (e->deleted || e->wheel_bucket)
+		return;
+
+	if (e->count > 0)
 	{
-		if (e->deleted)
-			continue;
-		if (e->count == -1)
+		e->count--;
+		if (e->count == 0)
 		{
 			EventDel(e);
-			continue;
+			return;
 		}
-		if ((e->every_msec == 0) || minimum_msec_since_last_run(&e->last_run, e->every_msec))
+	}
+
+	/* Next run is measured from now, we don't try to "catch up"
+	 * on intervals missed under load (matching the old behavior).
+	 */
+	e->expiry = event_now_msec() + e->every_msec;
+	wheel_link(e);
+}
+
+void DoEvents(void)
+{
+	long long now_tick = event_now_msec() / TIMER_TICK_MSEC;
+	Event *e;
+
+	if (!wheel_tick)
+		wheel_tick = now_tick; /* first call */
+
+	/* On a huge forward clock jump, don't replay every tick in
+	 * between: jump the wheel and reschedule everything.
+	 */
+	if (now_tick - wheel_tick > (3600 * 1000 / TIMER_TICK_MSEC))
+	{
+		EventFixTimers();
+		now_tick = event_now_msec() / TIMER_TICK_MSEC;
+	}
+
+	while (wheel_tick < now_tick)
+	{
+		int slot;
+
+		wheel_tick++;
+		slot = wheel_tick & TIMER_WHEEL_MASK;
+		if (slot == 0)
 		{
-			(*e->event)(e->data);
-			if (e->count > 0)
+			/* A level wrapped: cascade bucket(s) from above */
+			long long t = wheel_tick >> TIMER_WHEEL_BITS;
+			int level = 1;
+
+			while (level < TIMER_WHEEL_LEVELS)
 			{
-				e->count--;
-				if (e->count == 0)
-				{
-					EventDel(e);
-					continue;
-				}
+				wheel_cascade(level, t & TIMER_WHEEL_MASK);
+				if (t & TIMER_WHEEL_MASK)
+					break;
+				t >>= TIMER_WHEEL_BITS;
+				level++;
 			}
 		}
+
+		while ((e = timer_wheel[0][slot]))
+		{
+			wheel_unlink(e);
+			RunEvent(e);
+		}
 	}
 
 	CleanupEvents();
 }
 
+/** How long may the main loop sleep in the I/O engine before the next
+ * timer is due? Returns a value in milliseconds, in [1, max_msec].
+ */
+long EventNextDelay(long max_msec)
+{
+	long long now = event_now_msec();
+	long long tick, last;
+	long delay = max_msec;
+
+	if (!wheel_tick)
+		return max_msec;
+
+	/* Within the sleep window every due timer is either already in
+	 * a level-0 bucket, or still at a higher level with its cascade
+	 * point at the next level-0 wrap. So: scan level 0 up to the
+	 * wrap (at most 64 buckets) and never sleep across the wrap
+	 * itself.
+	 */
+	last = (wheel_tick | TIMER_WHEEL_MASK) + 1; /* first tick of the next wrap */
+	for (tick = wheel_tick + 1; tick <= last; tick++)
+	{
+		if ((tick == last) || timer_wheel[0][tick & TIMER_WHEEL_MASK])
+		{
+			long long ms = tick * TIMER_TICK_MSEC - now;
+
+			if (ms < delay)
+				delay = (ms < 1) ? 1 : (long)ms;
+			break;
+		}
+		if ((tick - wheel_tick) * TIMER_TICK_MSEC > max_msec)
+			break; /* nothing due within the cap */
+	}
+
+	return delay;
+}
+
+/** Re-derive the timer wheel after the clock made a jump (called from
+ * fix_timers() on backward shifts and from DoEvents() on huge forward
+ * ones). Without this a backward jump would stall all timers until
+ * the clock catches up with the old time again.
+ */
+void EventFixTimers(void)
+{
+	long long now = event_now_msec();
+	Event *e;
+
+	wheel_tick = now / TIMER_TICK_MSEC;
+	for (e = events; e; e = e->next)
+	{
+		wheel_unlink(e);
+		if (e->deleted)
+			continue;
+		if (e->expiry > now + e->every_msec)
+			e->expiry = now + e->every_msec;
+		wheel_link(e);
+	}
+}
+
 void SetupEvents(void)
 {
 	/* Start events */
 	EventAdd(NULL, "tunefile", save_tunefile, NULL, 300*1000, 0);
 	EventAdd(NULL, "garbage", garbage_collect, NULL, GARBAGE_COLLECT_EVERY*1000, 0);
 	EventAdd(NULL, "loop", loop_event, NULL, 1000, 0);
-	EventAdd(NULL, "unrealdns_removeoldrecords", unrealdns_removeoldrecords, NULL, 15000, 0);
 	EventAdd(NULL, "check_pings", check_pings, NULL, 1000, 0);
 	EventAdd(NULL, "check_deadsockets", check_deadsockets, NULL, 1000, 0);
-	EventAdd(NULL, "handshake_timeout", handshake_timeout, NULL, 1000, 0);
 	EventAdd(NULL, "try_connections", try_connections, NULL, 2000, 0);
 	EventAdd(NULL, "tls_check_expiry", tls_check_expiry, NULL, 86400/2, 0);
+	EventAdd(NULL, "log_flush", log_flush, NULL, 1000, 0);
 }
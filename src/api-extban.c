@@ -25,6 +25,13 @@
 Extban MODVAR ExtBan_Table[EXTBANTABLESZ]; /* this should be fastest */
 unsigned MODVAR short ExtBan_highest = 0;
 
+/** Direct ban letter to Extban mapping (NULL: not registered), kept in
+ * sync by ExtbanAdd()/ExtbanDel(). Extban handlers are resolved on every
+ * single ban check (is_banned and friends walk each ban of the channel),
+ * so findmod_by_bantype() must be a plain load, not a table scan.
+ */
+static Extban *extban_index[256];
+
 void set_isupport_extban(void)
 {
 	int i;
@@ -42,13 +49,7 @@ void set_isupport_extban(void)
 
 Extban *findmod_by_bantype(char c)
 {
-int i;
-
-	for (i=0; i <= ExtBan_highest; i++)
-		if (ExtBan_Table[i].flag == c)
-			return &ExtBan_Table[i];
-
-	 return NULL;
+	return extban_index[(unsigned char)c];
 }
 
 Extban *ExtbanAdd(Module *module, ExtbanInfo req)
@@ -78,6 +79,7 @@ Extban *ExtbanAdd(Module *module, ExtbanInfo req)
 	ExtBan_Table[slot].is_banned = req.is_banned;
 	ExtBan_Table[slot].owner = module;
 	ExtBan_Table[slot].options = req.options;
+	extban_index[(unsigned char)req.flag] = &ExtBan_Table[slot];
 	if (module)
 	{
 		ModuleObject *banobj = safe_alloc(sizeof(ModuleObject));
@@ -108,6 +110,7 @@ void ExtbanDel(Extban *eb)
 			}
 		}
 	}
+	extban_index[(unsigned char)eb->flag] = NULL;
 	memset(eb, 0, sizeof(Extban));
 	set_isupport_extban();
 	/* Hmm do we want to go trough all chans and remove the bans?
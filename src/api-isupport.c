@@ -26,6 +26,7 @@ ISupport *ISupports; /* List of ISUPPORT (005) tokens */
 #define MAXISUPPORTLINES 10
 
 MODVAR char *ISupportStrings[MAXISUPPORTLINES+1];
+MODVAR int isupport_generation = 0; /**< Bumped when ISupportStrings[] changes, so cached renderings can be invalidated */
 
 void isupport_add_sorted(ISupport *is);
 void make_isupportstrings(void);
@@ -269,6 +270,8 @@ void make_isupportstrings(void)
 	ISupport *isupport;
 	char tmp[ISUPPORTLEN];
 
+	isupport_generation++;
+
 	/* Free any previous strings */
 	for (i = 0; ISupportStrings[i]; i++)
 		safe_free(ISupportStrings[i]);
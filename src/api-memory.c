@@ -0,0 +1,297 @@
+/************************************************************************
+ * UnrealIRCd - Unreal Internet Relay Chat Daemon - src/api-memory.c
+ * (c) 2021- Bram Matthys and The UnrealIRCd team
+ *
+ * See file AUTHORS in IRC package for additional names of
+ * the programmers.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 1, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** @file
+ * @brief Memory accounting registry.
+ * Every subsystem that owns a significant amount of memory registers a
+ * MemoryCounter which reports its current object count and byte usage
+ * through a standard callback. The consolidated report is rendered by
+ * /STATS Z (stats_memory in src/modules/stats.c). The numbers are
+ * approximations: struct sizes plus the large variable parts, not every
+ * last string - the point is to see which subsystem grew, not to match
+ * the allocator byte for byte.
+ */
+
+#include "unrealircd.h"
+
+MODVAR MemoryCounter *memorycounters = NULL; /**< List of registered memory counters */
+
+/**
+ * Returns a memory counter based on the given subsystem name.
+ *
+ * @param name The name of the memory counter.
+ * @return Returns the handle to the memory counter,
+ *         or NULL if not found.
+ */
+MemoryCounter *MemoryCounterFind(const char *name)
+{
+	MemoryCounter *m;
+
+	for (m = memorycounters; m; m = m->next)
+	{
+		if (!strcasecmp(name, m->name))
+			return m;
+	}
+	return NULL;
+}
+
+/**
+ * Adds a new memory counter.
+ *
+ * @param module The module which provides this memory counter
+ *               (NULL for core subsystems).
+ * @param name   The subsystem name as shown in the /STATS Z report.
+ * @param count  Callback which adds the subsystem's current usage to
+ *               *objects and *bytes (both already initialized by the caller).
+ * @return Returns the handle to the new counter if successful, otherwise NULL.
+ *         The module's error code contains specific information about the
+ *         error.
+ */
+MemoryCounter *MemoryCounterAdd(Module *module, const char *name, void (*count)(long long *objects, long long *bytes))
+{
+	MemoryCounter *m;
+	int exists = 0;
+
+	if (!count)
+	{
+		if (module)
+			module->errorcode = MODERR_INVALID;
+		ircd_log(LOG_ERROR, "MemoryCounterAdd(): missing count handler");
+		return NULL;
+	}
+	m = MemoryCounterFind(name);
+	if (m)
+	{
+		exists = 1;
+		if (m->unloaded)
+		{
+			m->unloaded = 0;
+		} else {
+			if (module)
+				module->errorcode = MODERR_EXISTS;
+			return NULL;
+		}
+	} else {
+		/* New memory counter */
+		m = safe_alloc(sizeof(MemoryCounter));
+		safe_strdup(m->name, name);
+	}
+
+	/* Add or update the following fields: */
+	m->owner = module;
+	m->count = count;
+
+	if (!exists)
+		AddListItem(m, memorycounters);
+
+	if (module)
+	{
+		ModuleObject *mobj = safe_alloc(sizeof(ModuleObject));
+		mobj->type = MOBJ_MEMORYCOUNTER;
+		mobj->object.memorycounter = m;
+		AddListItem(mobj, module->objects);
+		module->errorcode = MODERR_NOERROR;
+	}
+
+	return m;
+}
+
+void unload_memory_counter_commit(MemoryCounter *m)
+{
+	/* Destroy the object */
+	DelListItem(m, memorycounters);
+	safe_free(m->name);
+	safe_free(m);
+}
+
+/**
+ * Removes the specified memory counter.
+ *
+ * @param m The memory counter to remove.
+ */
+void MemoryCounterDel(MemoryCounter *m)
+{
+	if (m->owner)
+	{
+		ModuleObject *mobj;
+		for (mobj = m->owner->objects; mobj; mobj = mobj->next) {
+			if (mobj->type == MOBJ_MEMORYCOUNTER && mobj->object.memorycounter == m)
+			{
+				DelListItem(mobj, m->owner->objects);
+				safe_free(mobj);
+				break;
+			}
+		}
+		m->owner = NULL;
+	}
+
+	if (loop.ircd_rehashing)
+		m->unloaded = 1;
+	else
+		unload_memory_counter_commit(m);
+}
+
+void unload_all_unused_memory_counters(void)
+{
+	MemoryCounter *m, *m_next;
+
+	for (m = memorycounters; m; m = m_next)
+	{
+		m_next = m->next;
+		if (m->unloaded)
+			unload_memory_counter_commit(m);
+	}
+}
+
+/* The core counters below cover the subsystems that live in the main
+ * binary. Modules that own serious amounts of memory (such as
+ * history_backend_mem) register their own counter from MOD_INIT.
+ */
+
+static void memory_count_clients(long long *objects, long long *bytes)
+{
+	Client *acptr;
+
+	list_for_each_entry(acptr, &client_list, client_node)
+	{
+		*objects += 1;
+		*bytes += sizeof(Client);
+		if (acptr->user)
+			*bytes += sizeof(ClientUser);
+		if (acptr->local)
+		{
+			*bytes += sizeof(LocalClient);
+			*bytes += DBufLength(&acptr->local->sendQ);
+			*bytes += DBufLength(&acptr->local->recvQ);
+		}
+	}
+	list_for_each_entry(acptr, &unknown_list, lclient_node)
+	{
+		*objects += 1;
+		*bytes += sizeof(Client) + sizeof(LocalClient);
+		if (acptr->local)
+		{
+			*bytes += DBufLength(&acptr->local->sendQ);
+			*bytes += DBufLength(&acptr->local->recvQ);
+		}
+	}
+}
+
+static void memory_count_channels(long long *objects, long long *bytes)
+{
+	Channel *channel;
+	MemberChunk *chunk;
+	Ban *ban;
+	Link *lp;
+
+	for (channel = channels; channel; channel = channel->nextch)
+	{
+		*objects += 1;
+		*bytes += sizeof(Channel) + channel->chnamelen;
+		if (channel->topic)
+			*bytes += strlen(channel->topic) + 1;
+		if (channel->topic_nick)
+			*bytes += strlen(channel->topic_nick) + 1;
+		if (channel->mode_lock)
+			*bytes += strlen(channel->mode_lock) + 1;
+		for (chunk = channel->memberchunks; chunk; chunk = chunk->next)
+			*bytes += sizeof(MemberChunk);
+		for (lp = channel->invites; lp; lp = lp->next)
+			*bytes += sizeof(Link);
+		for (ban = channel->banlist; ban; ban = ban->next)
+			*bytes += sizeof(Ban) + strlen(ban->banstr) + strlen(ban->who) + 2;
+		for (ban = channel->exlist; ban; ban = ban->next)
+			*bytes += sizeof(Ban) + strlen(ban->banstr) + strlen(ban->who) + 2;
+		for (ban = channel->invexlist; ban; ban = ban->next)
+			*bytes += sizeof(Ban) + strlen(ban->banstr) + strlen(ban->who) + 2;
+	}
+}
+
+static void memory_count_watch(long long *objects, long long *bytes)
+{
+	int count = 0;
+	u_long memory = 0;
+
+	count_watch_memory(&count, &memory);
+	*objects += count;
+	*bytes += memory;
+}
+
+static void memory_count_whowas(long long *objects, long long *bytes)
+{
+	int count = 0;
+	u_long memory = 0;
+
+	count_whowas_memory(&count, &memory);
+	*objects += count;
+	*bytes += memory;
+}
+
+static void memory_count_tkl(long long *objects, long long *bytes)
+{
+	TKL *tkl;
+	int index, index2;
+
+	for (index = 0; index < TKLIPHASHLEN1; index++)
+	{
+		for (index2 = 0; index2 < TKLIPHASHLEN2; index2++)
+		{
+			for (tkl = tklines_ip_hash[index][index2]; tkl; tkl = tkl->next)
+			{
+				*objects += 1;
+				*bytes += sizeof(TKL) + (tkl->set_by ? strlen(tkl->set_by) + 1 : 0);
+			}
+		}
+	}
+	for (index = 0; index < TKLISTLEN; index++)
+	{
+		for (tkl = tklines[index]; tkl; tkl = tkl->next)
+		{
+			*objects += 1;
+			*bytes += sizeof(TKL) + (tkl->set_by ? strlen(tkl->set_by) + 1 : 0);
+		}
+	}
+}
+
+static void memory_count_mempools(long long *objects, long long *bytes)
+{
+	mp_pool_t *pool;
+	mp_pool_usage_t usage;
+
+	for (pool = mp_pools(); pool; pool = pool->next)
+	{
+		mp_pool_usage(pool, &usage);
+		*objects += usage.items_in_use;
+		*bytes += usage.bytes_committed - usage.bytes_decommitted;
+	}
+}
+
+/** Called from the init code to register the core memory counters. */
+void memory_counters_init(void)
+{
+	MemoryCounterAdd(NULL, "clients", memory_count_clients);
+	MemoryCounterAdd(NULL, "channels", memory_count_channels);
+	MemoryCounterAdd(NULL, "watch", memory_count_watch);
+	MemoryCounterAdd(NULL, "whowas", memory_count_whowas);
+	MemoryCounterAdd(NULL, "tkl", memory_count_tkl);
+	MemoryCounterAdd(NULL, "mempools", memory_count_mempools);
+}
@@ -33,9 +33,34 @@
 /** List of message tag handlers */
 MODVAR MessageTagHandler *mtaghandlers = NULL;
 
+/** Bumped whenever a message tag handler is (un)registered, so cached
+ * per-client accept bitmaps (see message-tags) know to recompute.
+ */
+MODVAR unsigned int mtag_handler_generation = 1;
+
 /* Forward declarations */
 static void unload_mtag_handler_commit(MessageTagHandler *m);
 
+/** Returns the lowest bit not yet claimed by a message tag handler,
+ * or 0 if all bits are taken (such a handler then goes through the
+ * slower non-bitmap filter path in message-tags).
+ */
+static long mtag_handler_free_bit(void)
+{
+	MessageTagHandler *m;
+	long bit;
+
+	for (bit = 1; bit; bit <<= 1)
+	{
+		for (m = mtaghandlers; m; m = m->next)
+			if (m->bit == bit)
+				break;
+		if (!m)
+			return bit;
+	}
+	return 0;
+}
+
 /** Adds a new message tag handler.
  * @param module The module which owns this message-tag handler.
  * @param mreq   The details of the request such as which message tag, the handler, etc.
@@ -77,8 +102,10 @@ MessageTagHandler *MessageTagHandlerAdd(Module *module, MessageTagHandlerInfo *m
 		/* New message tag handler */
 		m = safe_alloc(sizeof(MessageTagHandler));
 		safe_strdup(m->name, mreq->name);
+		m->bit = mtag_handler_free_bit();
 		AddListItem(m, mtaghandlers);
 	}
+	mtag_handler_generation++;
 	/* Add or update the following fields: */
 	m->owner = module;
 	m->flags = mreq->flags;
@@ -157,6 +184,8 @@ static void unload_mtag_handler_commit(MessageTagHandler *m)
 	if (m->clicap_handler)
 		m->clicap_handler->mtag_handler = NULL;
 
+	mtag_handler_generation++; /* the ->bit becomes available again */
+
 	/* Destroy the object */
 	DelListItem(m, mtaghandlers);
 	safe_free(m->name);
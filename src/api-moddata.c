@@ -27,13 +27,45 @@ MODVAR ModDataInfo *MDInfo = NULL;
 MODVAR ModData local_variable_moddata[MODDATA_MAX_LOCAL_VARIABLE];
 MODVAR ModData global_variable_moddata[MODDATA_MAX_GLOBAL_VARIABLE];
 
+/** Return the number of moddata slots available for the given type */
+static int moddata_max_slots(ModDataType type)
+{
+	switch (type)
+	{
+		case MODDATATYPE_LOCAL_VARIABLE:
+			return MODDATA_MAX_LOCAL_VARIABLE;
+		case MODDATATYPE_GLOBAL_VARIABLE:
+			return MODDATA_MAX_GLOBAL_VARIABLE;
+		case MODDATATYPE_CLIENT:
+			return MODDATA_MAX_CLIENT;
+		case MODDATATYPE_LOCAL_CLIENT:
+			return MODDATA_MAX_LOCAL_CLIENT;
+		case MODDATATYPE_CHANNEL:
+			return MODDATA_MAX_CHANNEL;
+		case MODDATATYPE_MEMBER:
+			return MODDATA_MAX_MEMBER;
+		case MODDATATYPE_MEMBERSHIP:
+			return MODDATA_MAX_MEMBERSHIP;
+	}
+	return 0;
+}
+
 ModDataInfo *ModDataAdd(Module *module, ModDataInfo req)
 {
-	int slotav = 0; /* highest available slot */
+	int slotav = -1; /* slot to use, -1 = none free */
+	int maxslots, i;
+	char *used;
 	ModDataInfo *m;
 	int new_struct = 0;
-	
-	/* Hunt for highest available slot */
+
+	/* Hunt for a free slot. Requests flagged as 'hot' get the lowest
+	 * free slot, so frequently accessed data clusters at the start of
+	 * the inline moddata arrays (ideally the first cache line of the
+	 * block); everything else is assigned from the top end. Slots of
+	 * removed moddata are re-used.
+	 */
+	maxslots = moddata_max_slots(req.type);
+	used = safe_alloc(maxslots);
 	for (m = MDInfo; m ; m = m->next)
 		if (m->type == req.type)
 		{
@@ -43,27 +75,40 @@ ModDataInfo *ModDataAdd(Module *module, ModDataInfo req)
 				/* If old module is unloading (so reloading), then OK to take this slot */
 				if (m->unloaded)
 				{
-					slotav = m->slot;
+					safe_free(used);
 					m->unloaded = 0;
 					goto moddataadd_isok;
 				}
 				/* Otherwise, name collision */
+				safe_free(used);
 				if (module)
 					module->errorcode = MODERR_EXISTS;
 				return NULL;
 			}
-			/* Update next available slot */
-			slotav = MAX(slotav, m->slot+1);
+			/* Mark the slot as taken */
+			if (m->slot < maxslots)
+				used[m->slot] = 1;
 		}
 
-	/* Now check if we are within bounds (if we really have a free slot available) */
-	if (((req.type == MODDATATYPE_LOCAL_VARIABLE) && (slotav >= MODDATA_MAX_LOCAL_VARIABLE)) ||
-	    ((req.type == MODDATATYPE_GLOBAL_VARIABLE) && (slotav >= MODDATA_MAX_GLOBAL_VARIABLE)) ||
-	    ((req.type == MODDATATYPE_CLIENT) && (slotav >= MODDATA_MAX_CLIENT)) ||
-	    ((req.type == MODDATATYPE_LOCAL_CLIENT) && (slotav >= MODDATA_MAX_LOCAL_CLIENT)) ||
-	    ((req.type == MODDATATYPE_CHANNEL) && (slotav >= MODDATA_MAX_CHANNEL)) ||
-	    ((req.type == MODDATATYPE_MEMBER) && (slotav >= MODDATA_MAX_MEMBER)) ||
-	    ((req.type == MODDATATYPE_MEMBERSHIP) && (slotav >= MODDATA_MAX_MEMBERSHIP)))
+	if (req.hot)
+	{
+		for (i = 0; i < maxslots; i++)
+			if (!used[i])
+			{
+				slotav = i;
+				break;
+			}
+	} else {
+		for (i = maxslots-1; i >= 0; i--)
+			if (!used[i])
+			{
+				slotav = i;
+				break;
+			}
+	}
+	safe_free(used);
+
+	if (slotav < 0)
 	{
 		if (module)
 			module->errorcode = MODERR_NOSPACE;
@@ -76,6 +121,7 @@ ModDataInfo *ModDataAdd(Module *module, ModDataInfo req)
 	m->slot = slotav;
 	m->type = req.type;
 moddataadd_isok:
+	m->hot = req.hot;
 	m->free = req.free;
 	m->serialize = req.serialize;
 	m->unserialize = req.unserialize;
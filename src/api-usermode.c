@@ -30,6 +30,12 @@ short	 Usermode_highest = 0;
 Snomask *Snomask_Table = NULL;
 short	 Snomask_highest = 0;
 
+/** Direct mode letter to Usermode_Table slot mapping (-1: not registered),
+ * kept in sync by UmodeAdd() and the unload paths, so user mode parsing
+ * can resolve a letter without scanning the table - see find_usermode().
+ */
+static short usermode_index[256];
+
 /* client->umodes (32 bits): 26 used, 6 free */
 long UMODE_INVISIBLE = 0L;     /* makes user invisible */
 long UMODE_OPER = 0L;          /* Operator */
@@ -75,6 +81,8 @@ void	umode_init(void)
 		val *= 2;
 	}
 	Usermode_highest = 0;
+	for (i = 0; i < 256; i++)
+		usermode_index[i] = -1;
 
 	Snomask_Table = safe_alloc(sizeof(Snomask) * UMODETABLESZ);
 	val = 1;
@@ -189,6 +197,7 @@ Umode *UmodeAdd(Module *module, char ch, int global, int unset_on_deoper, int (*
 		Usermode_Table[i].flag = ch;
 		Usermode_Table[i].allowed = allowed;
 		Usermode_Table[i].unset_on_deoper = unset_on_deoper;
+		usermode_index[(unsigned char)ch] = i;
 		Debug((DEBUG_DEBUG, "UmodeAdd(%c) returning %04lx",
 			ch, Usermode_Table[i].mode));
 		/* Update usermode table highest */
@@ -239,6 +248,7 @@ void UmodeDel(Umode *umode)
 			if (MyUser(client))
 				send_umode_out(client, 1, oldumode);
 		}
+		usermode_index[(unsigned char)umode->flag] = -1;
 		umode->flag = '\0';
 		AllUmodes &= ~(umode->mode);
 		SendUmodes &= ~(umode->mode);
@@ -335,6 +345,7 @@ void SnomaskDel(Snomask *sno)
 			if (oldsno != client->user->snomask)
 				sendnumeric(client, RPL_SNOMASK, get_snomask_string_raw(client->user->snomask));
 		}
+		invalidate_snomask_subscribers();
 
 		sno->flag = '\0';
 	}
@@ -420,6 +431,7 @@ void unload_all_unused_umodes(void)
 		{
 			AllUmodes &= ~(Usermode_Table[i].mode);
 			SendUmodes &= ~(Usermode_Table[i].mode);
+			usermode_index[(unsigned char)Usermode_Table[i].flag] = -1;
 			Usermode_Table[i].flag = '\0';
 			Usermode_Table[i].unloaded = 0;
 		}
@@ -455,6 +467,7 @@ void unload_all_unused_snomasks(void)
 		if (oldsno != client->user->snomask)
 			sendnumeric(client, RPL_SNOMASK, get_snomask_string_raw(client->user->snomask));
 	}
+	invalidate_snomask_subscribers();
 }
 
 /**
@@ -466,6 +479,7 @@ void unload_all_unused_snomasks(void)
 void remove_oper_snomasks(Client *client)
 {
 	client->user->snomask = 0;
+	invalidate_snomask_subscribers();
 }
 
 /*
@@ -500,17 +514,25 @@ void remove_oper_privileges(Client *client, int broadcast_mode_change)
 		swhois_delete(client, "oper", "*", &me, NULL);
 }
 
+/** Find a user mode by letter - a direct lookup, no scan.
+ * @param flag	The mode letter (eg: 'x')
+ * @returns The Umode table entry, or NULL if no such mode is registered.
+ */
+Umode *find_usermode(char flag)
+{
+	short i = usermode_index[(unsigned char)flag];
+
+	if ((i >= 0) && !Usermode_Table[i].unloaded)
+		return &Usermode_Table[i];
+	return NULL;
+}
+
 /** Return long integer mode for a user mode character (eg: 'x' -> 0x10) */
 long find_user_mode(char flag)
 {
-	int i;
+	Umode *um = find_usermode(flag);
 
-	for (i = 0; i < UMODETABLESZ; i++)
-	{
-		if ((Usermode_Table[i].flag == flag) && !(Usermode_Table[i].unloaded))
-			return Usermode_Table[i].mode;
-	}
-	return 0;
+	return um ? um->mode : 0;
 }
 
 /** Returns 1 if user has this user mode set and 0 if not */
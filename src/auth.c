@@ -404,10 +404,68 @@ static int authcheck_spkifp(Client *client, AuthConfig *as, char *para)
 }
 
 
+/* Cache of recent successful slow-hash verifications.
+ *
+ * Argon2 and bcrypt are expensive on purpose, and they run inline on
+ * the event loop. During a services/link reconnect storm the SAME
+ * password gets re-verified against the SAME stored hash over and
+ * over, freezing the server for the full hash cost each time. We
+ * therefore remember the last few successful verifications - as a
+ * SHA256 digest over (stored hash, password), never the password
+ * itself - for a few minutes, so only the first check in a storm pays
+ * the full price. Failed attempts are never cached and always run the
+ * complete verification, so this gives an attacker nothing.
+ */
+#define AUTHCACHE_SIZE 16
+#define AUTHCACHE_TTL 300
+
+typedef struct AuthCacheEntry AuthCacheEntry;
+struct AuthCacheEntry {
+	char digest[SHA256_DIGEST_LENGTH];	/**< SHA256 over stored hash + NUL + password */
+	long long set_at;			/**< When this verification succeeded (0: slot unused) */
+};
+
+static AuthCacheEntry authcache[AUTHCACHE_SIZE];
+static int authcache_next = 0;
+
+/** Compute the cache digest for this (stored hash, password) pair */
+static void authcache_digest(const char *hash, const char *para, char *digest)
+{
+	SHA256_CTX c;
+
+	SHA256_Init(&c);
+	SHA256_Update(&c, hash, strlen(hash) + 1); /* include the NUL as separator */
+	SHA256_Update(&c, para, strlen(para));
+	SHA256_Final((unsigned char *)digest, &c);
+}
+
+/** Did this exact verification succeed recently? */
+static int authcache_find(const char *digest)
+{
+	int i;
+
+	for (i = 0; i < AUTHCACHE_SIZE; i++)
+	{
+		if (authcache[i].set_at &&
+		    (TStime() - authcache[i].set_at <= AUTHCACHE_TTL) &&
+		    !memcmp(authcache[i].digest, digest, SHA256_DIGEST_LENGTH))
+			return 1;
+	}
+	return 0;
+}
+
+/** Record a successful verification (round-robin eviction) */
+static void authcache_add(const char *digest)
+{
+	memcpy(authcache[authcache_next].digest, digest, SHA256_DIGEST_LENGTH);
+	authcache[authcache_next].set_at = TStime();
+	authcache_next = (authcache_next + 1) % AUTHCACHE_SIZE;
+}
+
 /*
  * client MUST be a local client
  * as is what it will be compared with
- * para will used in coordination with the auth type	
+ * para will used in coordination with the auth type
 */
 
 /** Check authentication, such as a password against the
@@ -446,10 +504,24 @@ int Auth_Check(Client *client, AuthConfig *as, char *para)
 			return 0;
 
 		case AUTHTYPE_ARGON2:
-			return authcheck_argon2(client, as, para);
-
 		case AUTHTYPE_BCRYPT:
-			return authcheck_bcrypt(client, as, para);
+		{
+			char digest[SHA256_DIGEST_LENGTH];
+			int ret;
+
+			if (!para)
+				return 0;
+			authcache_digest(as->data, para, digest);
+			if (authcache_find(digest))
+				return 1; /* verified the slow way only recently */
+			if (as->type == AUTHTYPE_ARGON2)
+				ret = authcheck_argon2(client, as, para);
+			else
+				ret = authcheck_bcrypt(client, as, para);
+			if (ret == 1)
+				authcache_add(digest);
+			return ret;
+		}
 
 		case AUTHTYPE_UNIXCRYPT:
 			if (!para)
@@ -484,14 +556,13 @@ static char *mkpass_argon2(char *para)
 {
 	static char buf[512];
 	char salt[UNREALIRCD_ARGON2_DEFAULT_SALT_LENGTH];
-	int ret, i;
+	int ret;
 
 	if (!para)
 		return NULL;
 
 	/* Initialize salt */
-	for (i=0; i < sizeof(salt); i++)
-		salt[i] = getrandom8();
+	getrandom_buf(salt, sizeof(salt));
 
 	*buf = '\0';
 
@@ -520,15 +591,13 @@ static char *mkpass_bcrypt(char *para)
 	char random_data[32];
 	char *str;
 	char *saltstr;
-	int i;
 
 	if (!para)
 		return NULL;
 
 	memset(data, 0, sizeof(data));
 
-	for (i=0; i<sizeof(random_data); i++)
-		random_data[i] = getrandom8();
+	getrandom_buf(random_data, sizeof(random_data));
 
 	saltstr = _crypt_gensalt_blowfish_rn("$2y", 9, random_data, sizeof(random_data), salt, sizeof(salt));
 	if (!saltstr)
@@ -136,64 +136,76 @@ Membership *find_membership_link(Membership *lp, Channel *ptr)
 	return NULL;
 }
 
-/** Allocate and return an empty Member struct */
-static Member *make_member(void)
+/** Allocate an empty Member struct in one of the channel's chunks.
+ * Member records live in per-channel chunks (see struct MemberChunk)
+ * so that fanout iterates mostly linear memory instead of chasing one
+ * cold pointer per member.
+ */
+static Member *make_member(Channel *channel)
 {
-	Member *lp;
-	unsigned int	i;
+	MemberChunk *chunk;
+	unsigned int i;
 
-	if (freemember == NULL)
+	for (chunk = channel->memberchunks; chunk; chunk = chunk->next)
+		if (chunk->usedmap != 0xFFFFFFFF)
+			break;
+	if (!chunk)
 	{
-		for (i = 1; i <= (4072/sizeof(Member)); ++i)
-		{
-			lp = safe_alloc(sizeof(Member));
-			lp->client = NULL;
-			lp->flags = 0;
-			lp->next = freemember;
-			freemember = lp;
-		}
+		chunk = safe_alloc(sizeof(MemberChunk));
+		chunk->next = channel->memberchunks;
+		if (chunk->next)
+			chunk->next->prev = chunk;
+		channel->memberchunks = chunk;
 	}
-	lp = freemember;
-	freemember = freemember->next;
-	lp->next = NULL;
-	return lp;
+
+	for (i = 0; i < MEMBER_CHUNK_SIZE; i++)
+		if (!(chunk->usedmap & (1U << i)))
+			break;
+	chunk->usedmap |= (1U << i);
+	return &chunk->slot[i];
 }
 
-/** Free a Member struct */
-static void free_member(Member *lp)
+/** Free a Member struct (clears the chunk slot, frees an empty chunk) */
+static void free_member(Channel *channel, Member *lp)
 {
+	MemberChunk *chunk;
+
 	if (!lp)
 		return;
+
+	for (chunk = channel->memberchunks; chunk; chunk = chunk->next)
+		if ((lp >= chunk->slot) && (lp < chunk->slot + MEMBER_CHUNK_SIZE))
+			break;
+	if (!chunk)
+	{
+		ircd_log(LOG_ERROR, "[BUG] free_member(): member %p not in any chunk of channel %s",
+			(void *)lp, channel->chname);
+#ifdef DEBUGMODE
+		abort();
+#endif
+		return;
+	}
+
 	moddata_free_member(lp);
+	chunk->usedmap &= ~(1U << (unsigned int)(lp - chunk->slot));
 	memset(lp, 0, sizeof(Member));
-	lp->next = freemember;
-	lp->client = NULL;
-	lp->flags = 0;
-	freemember = lp;
+
+	if (!chunk->usedmap)
+	{
+		if (chunk->prev)
+			chunk->prev->next = chunk->next;
+		else
+			channel->memberchunks = chunk->next;
+		if (chunk->next)
+			chunk->next->prev = chunk->prev;
+		safe_free(chunk);
+	}
 }
 
 /** Allocate and return an empty Membership struct */
 static Membership *make_membership(void)
 {
-	Membership *m = NULL;
-	unsigned int	i;
-
-	if (freemembership == NULL)
-	{
-		for (i = 1; i <= (4072/sizeof(Membership)); i++)
-		{
-			m = safe_alloc(sizeof(Membership));
-			m->next = freemembership;
-			freemembership = m;
-		}
-		m = freemembership;
-		freemembership = m->next;
-	}
-	else
-	{
-		m = freemembership;
-		freemembership = freemembership->next;
-	}
+	Membership *m = mp_pool_get(membership_pool);
 	memset(m, 0, sizeof(Membership));
 	return m;
 }
@@ -204,9 +216,7 @@ static void free_membership(Membership *m)
 	if (m)
 	{
 		moddata_free_membership(m);
-		memset(m, 0, sizeof(Membership));
-		m->next = freemembership;
-		freemembership = m;
+		mp_pool_release(m);
 	}
 }
 
@@ -328,8 +338,15 @@ int add_listmode_ex(Ban **list, Client *client, Channel *channel, char *banid, c
 
 	/* Update/set if this ban is new or older than existing one */
 	safe_strdup(ban->banstr, banid); /* cAsE may differ, use oldest version of it */
+	ban->banclass = BANCLASS_UNCLASSIFIED; /* banstr (possibly) changed, reclassify on next use */
+	if (ban->cmask)
+	{
+		free_compiled_mask(ban->cmask);
+		ban->cmask = NULL;
+	}
 	safe_strdup(ban->who, setby);
 	ban->when = seton;
+	channel->acl_generation++;
 	return 0;
 }
 
@@ -365,6 +382,7 @@ int del_listmode(Ban **list, Channel *channel, char *banid)
 			safe_free(tmp->banstr);
 			safe_free(tmp->who);
 			free_ban(tmp);
+			channel->acl_generation++;
 			return 0;
 		}
 	}
@@ -421,6 +439,316 @@ inline int ban_check_mask(Client *client, Channel *channel, char *banstr, int ty
 	}
 }
 
+/** CIDR function to compare the first 'mask' bits.
+ * @author Taken from atheme
+ * @returns 1 if equal, 0 if not.
+ */
+static int ban_comp_with_mask(void *addr, void *dest, u_int mask)
+{
+	if (memcmp(addr, dest, mask / 8) == 0)
+	{
+		int n = mask / 8;
+		int m = (0xffff << (8 - (mask % 8)));
+		if (mask % 8 == 0 || (((u_char *) addr)[n] & m) == (((u_char *) dest)[n] & m))
+		{
+			return (1);
+		}
+	}
+	return (0);
+}
+
+/** Hash a ban mask (or candidate string) for the fast ban matcher. */
+static uint64_t ban_fastmatch_hash(const char *str)
+{
+	static char siphashkey_ban[SIPHASH_KEY_LENGTH];
+	static int siphashkey_ban_initialized = 0;
+
+	if (!siphashkey_ban_initialized)
+	{
+		siphash_generate_key(siphashkey_ban);
+		siphashkey_ban_initialized = 1;
+	}
+	return siphash_nocase(str, siphashkey_ban);
+}
+
+/** Is a literal (wildcard-free) host portion safe for plain text
+ * comparison? If it is an IP then it must be in canonical form,
+ * otherwise a string compare could miss where match_user() would
+ * hit (eg '2001:0db8::1').
+ */
+static int ban_host_canonical(char *host)
+{
+	char addr[16], iptxt[64];
+
+	if (strchr(host, ':'))
+	{
+		if (!inet_pton(AF_INET6, host, addr) ||
+		    !inet_ntop(AF_INET6, addr, iptxt, sizeof(iptxt)) ||
+		    mycmp(host, iptxt))
+			return 0;
+	}
+	else if (inet_pton(AF_INET, host, addr))
+	{
+		if (!inet_ntop(AF_INET, addr, iptxt, sizeof(iptxt)) ||
+		    strcmp(host, iptxt))
+			return 0;
+	}
+	return 1;
+}
+
+/** Classify a ban entry for the fast ban matcher, see ban_list_find().
+ * The result is cached in ban->banclass (plus the banhash/cidr fields).
+ * It is derived from ban->banstr alone, so it can never go stale due to
+ * list manipulation elsewhere; it only needs recomputing if the banstr
+ * itself is replaced (the update path in add_listmode_ex).
+ */
+static void ban_classify(Ban *ban)
+{
+	char buf[NICKLEN+USERLEN+HOSTLEN+8];
+	char addr[16];
+	char *nick, *user, *host, *p;
+	int bits;
+
+	ban->banclass = BANCLASS_GENERIC;
+
+	if (is_extended_ban(ban->banstr))
+		return; /* extbans always take the full matcher */
+
+	if (strlen(ban->banstr) >= sizeof(buf))
+		return; /* oversized, don't bother */
+
+	strlcpy(buf, ban->banstr, sizeof(buf));
+	nick = buf;
+	if (!(p = strchr(buf, '!')))
+		return;
+	*p++ = '\0';
+	user = p;
+	if (!(p = strchr(p, '@')))
+		return;
+	*p++ = '\0';
+	host = p;
+
+	if (!*nick || !*user || !*host)
+		return;
+
+	if ((p = strchr(host, '/')))
+	{
+		/* Possibly ip/prefixlen: the host portion of those can be
+		 * matched by a binary prefix compare. The nick and user
+		 * portion may still contain wildcards (eg *!*@1.2.3.0/24),
+		 * they are verified by the full matcher on a prefix hit.
+		 */
+		char *s;
+		*p++ = '\0';
+		if (!*p)
+			return;
+		for (s = p; *s; s++)
+			if (!isdigit(*s))
+				return;
+		bits = atoi(p);
+		if (strchr(host, ':'))
+		{
+			if ((bits < 1) || (bits > 128) || !inet_pton(AF_INET6, host, addr))
+				return;
+			ban->cidrfamily = AF_INET6;
+		} else {
+			if ((bits < 1) || (bits > 32) || !inet_pton(AF_INET, host, addr))
+				return;
+			ban->cidrfamily = AF_INET;
+		}
+		ban->cidrbits = bits;
+		memset(ban->cidraddr, 0, sizeof(ban->cidraddr));
+		memcpy(ban->cidraddr, addr, (ban->cidrfamily == AF_INET6) ? 16 : 4);
+		ban->banclass = BANCLASS_CIDR;
+		return;
+	}
+
+	if (strpbrk(ban->banstr, "*?"))
+	{
+		/* Wildcard mask: compile it into segments so evaluating it
+		 * against the candidate strings needs no backtracking.
+		 * Exception: if the host portion is itself wildcard-free and
+		 * a non-canonical IP (eg *!*@2001:0db8::1), match_user()
+		 * would compare it in binary where the candidate strings
+		 * would miss it: leave those to the full matcher.
+		 */
+		if (!strpbrk(host, "*?") && !ban_host_canonical(host))
+			return;
+		ban->cmask = compile_simple_mask(ban->banstr);
+		ban->banclass = BANCLASS_WILD;
+		return;
+	}
+
+	/* Literal nick!user@host */
+	if (!ban_host_canonical(host))
+		return;
+
+	ban->banhash = ban_fastmatch_hash(ban->banstr);
+	ban->banclass = BANCLASS_EXACT;
+}
+
+/** State of one is_banned()/find_invex() scan. The candidate strings and
+ * the parsed client IP are built lazily, at most once per scan, no matter
+ * how many list entries there are (or in the case of is_banned: shared
+ * between the +b and +e scan).
+ */
+typedef struct BanScan BanScan;
+struct BanScan {
+	Client *client;		/**< The client being checked */
+	int built;		/**< Candidates: 0=not yet, 1=usable, -1=unavailable */
+	int numcandidates;	/**< Number of valid entries in candidate[] */
+	uint64_t candidatehash[4];	/**< ban_fastmatch_hash() of each candidate */
+	char candidate[4][NICKLEN+USERLEN+HOSTLEN+4];	/**< nick!user@host per host variant */
+	int ipstate;		/**< Parsed IP: 0=not yet, 1=usable, -1=unavailable */
+	int ipfamily;		/**< AF_INET or AF_INET6 */
+	char ipaddr[16];	/**< Binary client IP address */
+};
+
+/** Build the nick!user@host candidate strings that a BANCLASS_EXACT
+ * entry could possibly match: one for each distinct host view of the
+ * client (visible host, cloaked host, IP, real host), mirroring the
+ * host checks of match_user().
+ */
+static void ban_scan_build_candidates(BanScan *scan)
+{
+	Client *client = scan->client;
+	char *username;
+	char *hosts[4];
+	int i, j, n = 0;
+
+	scan->built = -1;
+	if (!client->user)
+		return; /* unregistered connection: take the full matcher route */
+
+	username = *client->user->username ? client->user->username : client->ident;
+
+	hosts[n++] = GetHost(client);
+	hosts[n++] = client->user->cloakedhost;
+	hosts[n++] = client->ip;
+	hosts[n++] = client->user->realhost;
+
+	scan->numcandidates = 0;
+	for (i = 0; i < n; i++)
+	{
+		if (!hosts[i] || !*hosts[i])
+			continue;
+		for (j = 0; j < i; j++)
+			if (hosts[j] && !strcmp(hosts[i], hosts[j]))
+				break;
+		if (j < i)
+			continue; /* duplicate host view */
+		make_nick_user_host_r(scan->candidate[scan->numcandidates],
+		                      client->name, username, hosts[i]);
+		scan->candidatehash[scan->numcandidates] =
+			ban_fastmatch_hash(scan->candidate[scan->numcandidates]);
+		scan->numcandidates++;
+	}
+	scan->built = 1;
+}
+
+/** Parse the client IP for prefix-comparing against BANCLASS_CIDR entries. */
+static void ban_scan_parse_ip(BanScan *scan)
+{
+	Client *client = scan->client;
+
+	scan->ipstate = -1;
+	if (!client->user || !client->ip)
+		return; /* no IP to compare: take the full matcher route */
+
+	/* A vhost may contain a '/' (see valid_host), in which case a
+	 * CIDR-looking ban could match it as a plain string and the prefix
+	 * compare would not be authoritative. Extremely rare, full matcher.
+	 */
+	if (strchr(GetHost(client), '/') ||
+	    (client->user->cloakedhost && strchr(client->user->cloakedhost, '/')))
+		return;
+
+	if (strchr(client->ip, ':'))
+	{
+		if (!inet_pton(AF_INET6, client->ip, scan->ipaddr))
+			return;
+		scan->ipfamily = AF_INET6;
+	} else {
+		if (!inet_pton(AF_INET, client->ip, scan->ipaddr))
+			return;
+		scan->ipfamily = AF_INET;
+	}
+	scan->ipstate = 1;
+}
+
+/** Scan a ban list (+b/+e/+I) for an entry that matches the client.
+ * Literal nick!user@host entries are matched by a hash plus string
+ * compare against the (few) candidate strings, wildcard masks by their
+ * compiled segment matcher against those same candidates, ip/prefixlen
+ * entries by a binary prefix compare; only extbans and odd cases still
+ * go through ban_check_mask() unconditionally. The fast paths never
+ * declare a match on their own authority where the semantics are not
+ * exactly those of ban_check_mask(): a CIDR prefix hit is re-verified
+ * by the full matcher (for the nick/user portion of the mask).
+ * @returns The first matching Ban entry, or NULL if none matched.
+ */
+static Ban *ban_list_find(BanScan *scan, Channel *channel, Ban *list, int type, char **msg, char **errmsg)
+{
+	Ban *ban;
+	int i;
+
+	for (ban = list; ban; ban = ban->next)
+	{
+		if (ban->banclass == BANCLASS_UNCLASSIFIED)
+			ban_classify(ban);
+
+		if (ban->banclass == BANCLASS_EXACT)
+		{
+			if (!scan->built)
+				ban_scan_build_candidates(scan);
+			if (scan->built > 0)
+			{
+				for (i = 0; i < scan->numcandidates; i++)
+				{
+					if ((ban->banhash == scan->candidatehash[i]) &&
+					    !mycmp(ban->banstr, scan->candidate[i]))
+					{
+						return ban;
+					}
+				}
+				continue; /* literal mask and no candidate matched */
+			}
+		}
+		else if (ban->banclass == BANCLASS_WILD)
+		{
+			if (!scan->built)
+				ban_scan_build_candidates(scan);
+			if (scan->built > 0)
+			{
+				for (i = 0; i < scan->numcandidates; i++)
+				{
+					if (compiled_mask_match(ban->cmask, scan->candidate[i]))
+						return ban;
+				}
+				continue; /* wildcard mask and no candidate matched */
+			}
+		}
+		else if (ban->banclass == BANCLASS_CIDR)
+		{
+			if (!scan->ipstate)
+				ban_scan_parse_ip(scan);
+			if (scan->ipstate > 0)
+			{
+				if ((scan->ipfamily != ban->cidrfamily) ||
+				    !ban_comp_with_mask(scan->ipaddr, ban->cidraddr, ban->cidrbits))
+					continue; /* client IP not within the banned prefix */
+				/* Prefix hit: fall through to the full check, which
+				 * still verifies the nick!user portion of the mask.
+				 */
+			}
+		}
+
+		if (ban_check_mask(scan->client, channel, ban->banstr, type, msg, errmsg, 0))
+			return ban;
+	}
+	return NULL;
+}
+
 /** is_banned_with_nick - Check if a user is banned on a channel.
  * @param client   Client to check (can be remote client)
  * @param channel  Channel to check
@@ -431,7 +759,8 @@ inline int ban_check_mask(Client *client, Channel *channel, char *banstr, int ty
  */
 Ban *is_banned_with_nick(Client *client, Channel *channel, int type, char *nick, char **msg, char **errmsg)
 {
-	Ban *ban, *ex;
+	Ban *ban;
+	BanScan scan;
 	char savednick[NICKLEN+1];
 
 	/* It's not really doable to pass 'nick' to all the ban layers,
@@ -453,26 +782,21 @@ Ban *is_banned_with_nick(Client *client, Channel *channel, int type, char *nick,
 
 	/* We check +b first, if a +b is found we then see if there is a +e.
 	 * If a +e was found we return NULL, if not, we return the ban.
+	 * The scan state (candidate strings, parsed IP) is shared between
+	 * the two list walks.
 	 */
 
-	for (ban = channel->banlist; ban; ban = ban->next)
-	{
-		if (ban_check_mask(client, channel, ban->banstr, type, msg, errmsg, 0))
-			break;
-	}
+	scan.client = client;
+	scan.built = 0;
+	scan.ipstate = 0;
+
+	ban = ban_list_find(&scan, channel, channel->banlist, type, msg, errmsg);
 
 	if (ban)
 	{
 		/* Ban found, now check for +e */
-		for (ex = channel->exlist; ex; ex = ex->next)
-		{
-			if (ban_check_mask(client, channel, ex->banstr, type, msg, errmsg, 0))
-			{
-				/* except matched */
-				ban = NULL;
-				break;
-			}
-		}
+		if (ban_list_find(&scan, channel, channel->exlist, type, msg, errmsg))
+			ban = NULL; /* except matched */
 		/* user is not on except, 'ban' stays non-NULL. */
 	}
 
@@ -497,12 +821,15 @@ void add_user_to_channel(Channel *channel, Client *who, int flags)
 
 	if (who->user)
 	{
-		m = make_member();
+		m = make_member(channel);
 		m->client = who;
 		m->flags = flags;
 		m->next = channel->members;
 		channel->members = m;
 		channel->users++;
+		channel_sizeindex_update(channel);
+		if (MyUser(who))
+			channel->local_members++;
 
 		mb = make_membership();
 		mb->channel = channel;
@@ -510,6 +837,8 @@ void add_user_to_channel(Channel *channel, Client *who, int flags)
 		mb->flags = flags;
 		who->user->channel = mb;
 		who->user->joined++;
+		channel->acl_generation++;
+		who->user->acl_generation++; /* for ~c (inchannel) bans elsewhere */
 		RunHook2(HOOKTYPE_JOIN_DATA, who, channel);
 	}
 }
@@ -533,7 +862,7 @@ int remove_user_from_channel(Client *client, Channel *channel)
 		if (m2->client == client)
 		{
 			*m = m2->next;
-			free_member(m2);
+			free_member(channel, m2);
 			break;
 		}
 	}
@@ -549,8 +878,13 @@ int remove_user_from_channel(Client *client, Channel *channel)
 		}
 	}
 
+	channel->acl_generation++;
+	client->user->acl_generation++; /* for ~c (inchannel) bans elsewhere */
+
 	/* Update user record to reflect 1 less joined */
 	client->user->joined--;
+	if (MyUser(client) && (channel->local_members > 0))
+		channel->local_members--;
 
 	/* Now sub1_from_channel() will deal with the channel record
 	 * and destroy the channel if needed.
@@ -854,13 +1188,13 @@ char *clean_ban_mask(char *mask, int what, Client *client)
 /** Check if 'client' matches an invite exception (+I) on 'channel' */
 int find_invex(Channel *channel, Client *client)
 {
-	Ban *inv;
+	BanScan scan;
 
-	for (inv = channel->invexlist; inv; inv = inv->next)
-		if (ban_check_mask(client, channel, inv->banstr, BANCHK_JOIN, NULL, NULL, 0))
-			return 1;
+	scan.client = client;
+	scan.built = 0;
+	scan.ipstate = 0;
 
-	return 0;
+	return ban_list_find(&scan, channel, channel->invexlist, BANCHK_JOIN, NULL, NULL) ? 1 : 0;
 }
 
 /** Remove unwanted characters from channel name.
@@ -944,6 +1278,7 @@ Channel *get_channel(Client *client, char *chname, int flag)
 	{
 		channel = safe_alloc(sizeof(Channel) + len);
 		strlcpy(channel->chname, chname, len + 1);
+		channel->chnamelen = len;
 		if (channels)
 			channels->prevch = channel;
 		channel->topic = NULL;
@@ -953,6 +1288,7 @@ Channel *get_channel(Client *client, char *chname, int flag)
 		channel->creationtime = MyUser(client) ? TStime() : 0;
 		channels = channel;
 		add_to_channel_hash_table(chname, channel);
+		channel_sizeindex_add(channel);
 		irccounts.channels++;
 		RunHook2(HOOKTYPE_CHANNEL_CREATE, client, channel);
 	}
@@ -967,27 +1303,32 @@ Channel *get_channel(Client *client, char *chname, int flag)
  */
 void add_invite(Client *from, Client *to, Channel *channel, MessageTag *mtags)
 {
-	Link *inv, *tmp;
+	Link *inv, *tmp, *tail;
+	int len;
 
 	del_invite(to, channel);
-	/* If too many invite entries then delete the oldest one */
-	if (list_length(to->user->invited) >= MAXCHANNELSPERUSER)
+	/* If too many invite entries then delete the oldest one.
+	 * One walk finds both the length and the tail.
+	 */
+	for (len = 0, tail = NULL, tmp = to->user->invited; tmp; tmp = tmp->next)
 	{
-		for (tmp = to->user->invited; tmp->next; tmp = tmp->next)
-			;
-		del_invite(to, tmp->value.channel);
-
+		len++;
+		tail = tmp;
 	}
+	if (len >= MAXCHANNELSPERUSER)
+		del_invite(to, tail->value.channel);
+
 	/* We get pissy over too many invites per channel as well now,
 	 * since otherwise mass-inviters could take up some major
 	 * resources -Donwulff
 	 */
-	if (list_length(channel->invites) >= MAXCHANNELSPERUSER)
+	for (len = 0, tail = NULL, tmp = channel->invites; tmp; tmp = tmp->next)
 	{
-		for (tmp = channel->invites; tmp->next; tmp = tmp->next)
-			;
-		del_invite(tmp->value.client, channel);
+		len++;
+		tail = tmp;
 	}
+	if (len >= MAXCHANNELSPERUSER)
+		del_invite(tail->value.client, channel);
 	/*
 	 * add client to the beginning of the channel invite list
 	 */
@@ -1053,9 +1394,11 @@ int sub1_from_channel(Channel *channel)
 {
 	Ban *ban;
 	Link *lp;
+	MemberChunk *chunk;
 	int should_destroy = 1;
 
 	--channel->users;
+	channel_sizeindex_update(channel);
 	if (channel->users > 0)
 		return 0;
 
@@ -1101,6 +1444,15 @@ int sub1_from_channel(Channel *channel)
 		free_ban(ban);
 	}
 
+	/* All members are gone at this point, but be sure not to leak
+	 * any member chunks.
+	 */
+	while ((chunk = channel->memberchunks))
+	{
+		channel->memberchunks = chunk->next;
+		safe_free(chunk);
+	}
+
 	/* free extcmode params */
 	extcmode_free_paramlist(channel->mode.extmodeparams);
 
@@ -1116,6 +1468,7 @@ int sub1_from_channel(Channel *channel)
 	if (channel->nextch)
 		channel->nextch->prevch = channel->prevch;
 	del_from_channel_hash_table(channel->chname, channel);
+	channel_sizeindex_del(channel);
 
 	irccounts.channels--;
 	safe_free(channel);
@@ -103,6 +103,8 @@ static int	_test_help		(ConfigFile *conf, ConfigEntry *ce);
 static int	_test_offchans		(ConfigFile *conf, ConfigEntry *ce);
 static int	_test_sni			(ConfigFile *conf, ConfigEntry *ce);
 
+static void	invalidate_sni_index	(void);
+
 /* This MUST be alphabetized */
 static ConfigCommand _ConfigCommands[] = {
 	{ "admin", 		_conf_admin,		_test_admin 	},
@@ -137,6 +139,7 @@ static ConfigCommand _ConfigCommands[] = {
 static NameValue _ListenerFlags[] = {
 	{ LISTENER_CLIENTSONLY,  "clientsonly"},
 	{ LISTENER_DEFER_ACCEPT, "defer-accept"},
+	{ LISTENER_METRICS,	 "metrics"},
 	{ LISTENER_SERVERSONLY,  "serversonly"},
 	{ LISTENER_TLS, 	 "ssl"},
 	{ LISTENER_NORMAL, 	 "standard"},
@@ -146,6 +149,7 @@ static NameValue _ListenerFlags[] = {
 /* This MUST be alphabetized */
 static NameValue _LinkFlags[] = {
 	{ CONNECT_AUTO,	"autoconnect" },
+	{ CONNECT_COMPRESSED,	"compressed" },
 	{ CONNECT_INSECURE,	"insecure" },
 	{ CONNECT_QUARANTINE, "quarantine"},
 	{ CONNECT_TLS, "ssl" },
@@ -171,7 +175,9 @@ static NameValue _LogFlags[] = {
 static NameValue _TLSFlags[] = {
 	{ TLSFLAG_FAILIFNOCERT, "fail-if-no-clientcert" },
 	{ TLSFLAG_DISABLECLIENTCERT, "no-client-certificate" },
+	{ TLSFLAG_NOKTLS, "no-ktls" },
 	{ TLSFLAG_NOSTARTTLS, "no-starttls" },
+	{ TLSFLAG_TICKETS, "session-tickets" },
 };
 
 struct {
@@ -206,6 +212,7 @@ extern void unload_all_unused_umodes(void);
 extern void unload_all_unused_extcmodes(void);
 extern void unload_all_unused_caps(void);
 extern void unload_all_unused_history_backends(void);
+extern void unload_all_unused_memory_counters(void);
 
 int reloadable_perm_module_unloaded(void);
 
@@ -275,8 +282,11 @@ void add_include(const char *filename, const char *included_from, int included_f
 void add_remote_include(const char *, const char *, int, const char *, const char *included_from, int included_from_line);
 void update_remote_include(ConfigItem_include *inc, const char *file, int, const char *errorbuf);
 int remote_include(ConfigEntry *ce);
+char *find_remote_include(char *url, char **errorbuf);
 #endif
 void unload_notloaded_includes(void);
+static void alias_hash_add(ConfigItem_alias *alias);
+static void alias_hash_del(ConfigItem_alias *alias);
 void load_includes(void);
 void unload_loaded_includes(void);
 int rehash_internal(Client *client, int sig);
@@ -817,12 +827,258 @@ char *hideidletime_valtostr(HideIdleTimePolicy v)
 	}
 }
 
+/* == ConfigEntry storage ==
+ * ConfigEntry nodes and their ce_vardata strings are carved out of
+ * per-ConfigFile arena blocks instead of being individually allocated,
+ * and the blocks are released wholesale in config_free(). That shrinks
+ * both the per-node overhead and the free() storm at rehash: a big
+ * network config easily has 100k+ entries. Entry names (ce_varname) go
+ * through intern_string() since the vocabulary of directive names is
+ * tiny compared to the number of entries, so identical names share one
+ * refcounted allocation. The rules that follow from this: never
+ * safe_free() or safe_strdup() over the ce_varname/ce_vardata of a
+ * parsed entry; editing ce_vardata in place (same length) is fine.
+ */
+#define CONFIG_ARENA_BLOCK_SIZE 8192
+
+static void *config_file_arena_alloc(ConfigFile *cf, size_t len)
+{
+	ConfigArena *a = cf->cf_arena;
+	void *p;
+
+	len = (len + 7) & ~(size_t)7; /* keep chunks 8 byte aligned */
+	if (!a || (a->used + len > a->size))
+	{
+		size_t size = (len > CONFIG_ARENA_BLOCK_SIZE) ? len : CONFIG_ARENA_BLOCK_SIZE;
+		a = safe_alloc(sizeof(ConfigArena) + size);
+		a->size = size;
+		a->next = cf->cf_arena;
+		cf->cf_arena = a;
+	}
+	/* safe_alloc() zeroed the whole block and nothing has written
+	 * past 'used' yet, so the chunk is handed out zeroed.
+	 */
+	p = a->data + a->used;
+	a->used += len;
+	return p;
+}
+
+static char *config_file_arena_strdup(ConfigFile *cf, const char *str)
+{
+	char *p = config_file_arena_alloc(cf, strlen(str)+1);
+	strcpy(p, str); /* safe, allocated above */
+	return p;
+}
+
+/** Replaces a safe_alloc'ed string with its interned equivalent */
+static void config_string_intern(char **str)
+{
+	char *interned = intern_string(*str);
+	safe_free(*str);
+	*str = interned;
+}
+
+/** Moves a safe_alloc'ed string into the arena of 'cf' */
+static void config_string_to_arena(ConfigFile *cf, char **str)
+{
+	char *moved = config_file_arena_strdup(cf, *str);
+	safe_free(*str);
+	*str = moved;
+}
+
+/* == Parsed include cache ==
+ * Most includes never change between rehashes, yet every rehash
+ * re-read and re-tokenized all of them. config_load() keeps the
+ * pristine parse tree of every file, keyed by path, mtime, size and
+ * the @define environment the file was parsed under (@defines from
+ * earlier files influence variable expansion). The file's own @defines
+ * are recorded and replayed on reuse, and @if pruning is no problem
+ * because that happens later, on the deep copy we hand out, never on
+ * the cached tree. Unchanged remote includes benefit as well: the
+ * downloader already skips unmodified fetches (If-Modified-Since),
+ * which leaves the cached copy on disk with an unchanged mtime.
+ */
+static void config_serialize_append(char **buf, int *len, int *size, const char *s);
+
+typedef struct ConfigFileCache ConfigFileCache;
+struct ConfigFileCache {
+	ConfigFileCache *prev, *next;
+	char *filename;			/**< Path the file was read from */
+	char *displayname;		/**< Name used in the parse tree (URL for remote includes) */
+	time_t mtime;			/**< File modification time at parse */
+	off_t size;			/**< File size at parse */
+	char *defines;			/**< Serialized @define environment at parse, see config_defines_serialize() */
+	NameValueList *added_defines;	/**< @defines the file itself added, chronological, replayed on reuse */
+	ConfigFile *cf;			/**< The pristine parse tree */
+	int used;			/**< Used during this or the previous config read (for expiry) */
+};
+
+static ConfigFileCache *config_file_cache = NULL;
+
+/** Serializes the current config_defines list for cache key comparison */
+static char *config_defines_serialize(void)
+{
+	NameValueList *e;
+	char *buf = NULL;
+	int len = 0, size = 0;
+
+	config_serialize_append(&buf, &len, &size, "");
+	for (e = config_defines; e; e = e->next)
+	{
+		config_serialize_append(&buf, &len, &size, e->name);
+		config_serialize_append(&buf, &len, &size, e->value);
+	}
+	return buf;
+}
+
+/** Returns a copy of the config_defines entries added since 'old_head',
+ * in chronological order (AddListItem prepends, so the segment from the
+ * current head up to 'old_head' is the delta, newest first).
+ */
+static NameValueList *config_defines_delta(NameValueList *old_head)
+{
+	NameValueList *e, *d, *delta = NULL;
+
+	for (e = config_defines; e && (e != old_head); e = e->next)
+	{
+		d = safe_alloc(sizeof(NameValueList));
+		safe_strdup(d->name, e->name);
+		safe_strdup(d->value, e->value);
+		AddListItem(d, delta); /* reverses the segment, so 'delta' comes out chronological */
+	}
+	return delta;
+}
+
+static void config_defines_replay(NameValueList *delta)
+{
+	NameValueList *e, *d;
+
+	for (e = delta; e; e = e->next)
+	{
+		d = safe_alloc(sizeof(NameValueList));
+		safe_strdup(d->name, e->name);
+		safe_strdup(d->value, e->value);
+		AddListItem(d, config_defines);
+	}
+}
+
+static void free_namevaluelist(NameValueList *e)
+{
+	NameValueList *e_next;
+
+	for (; e; e = e_next)
+	{
+		e_next = e->next;
+		safe_free(e->name);
+		safe_free(e->value);
+		safe_free(e);
+	}
+}
+
+static ConditionalConfig *config_cond_duplicate(ConditionalConfig *cc)
+{
+	ConditionalConfig *n, *tail = NULL, *ret = NULL;
+
+	for (; cc; cc = cc->next)
+	{
+		n = safe_alloc(sizeof(ConditionalConfig));
+		n->priority = cc->priority;
+		n->condition = cc->condition;
+		n->negative = cc->negative;
+		safe_strdup(n->name, cc->name);
+		safe_strdup(n->opt, cc->opt);
+		n->prev = tail;
+		if (tail)
+			tail->next = n;
+		else
+			ret = n;
+		tail = n;
+	}
+	return ret;
+}
+
+static ConfigEntry *config_entry_duplicate(ConfigFile *cf, ConfigEntry *ce, ConfigEntry *prevlevel)
+{
+	ConfigEntry *n, *ret = NULL, **last = &ret;
+
+	for (; ce; ce = ce->ce_next)
+	{
+		n = config_file_arena_alloc(cf, sizeof(ConfigEntry));
+		n->ce_fileptr = cf;
+		n->ce_varlinenum = ce->ce_varlinenum;
+		n->ce_fileposstart = ce->ce_fileposstart;
+		n->ce_fileposend = ce->ce_fileposend;
+		n->ce_sectlinenum = ce->ce_sectlinenum;
+		if (ce->ce_varname)
+			n->ce_varname = intern_string(ce->ce_varname);
+		if (ce->ce_vardata)
+			n->ce_vardata = config_file_arena_strdup(cf, ce->ce_vardata);
+		n->ce_cond = config_cond_duplicate(ce->ce_cond);
+		n->ce_prevlevel = prevlevel;
+		n->ce_entries = config_entry_duplicate(cf, ce->ce_entries, n);
+		*last = n;
+		last = &n->ce_next;
+	}
+	return ret;
+}
+
+/** Deep copies a (single) parsed config file */
+static ConfigFile *config_file_duplicate(ConfigFile *cf)
+{
+	ConfigFile *n = safe_alloc(sizeof(ConfigFile));
+
+	safe_strdup(n->cf_filename, cf->cf_filename);
+	n->cf_entries = config_entry_duplicate(n, cf->cf_entries, NULL);
+	return n;
+}
+
+static ConfigFileCache *config_file_cache_find(const char *filename, const char *displayname)
+{
+	ConfigFileCache *fc;
+
+	for (fc = config_file_cache; fc; fc = fc->next)
+		if (!strcmp(fc->filename, filename) && !strcmp(fc->displayname, displayname))
+			return fc;
+	return NULL;
+}
+
+static void config_file_cache_delete(ConfigFileCache *fc)
+{
+	DelListItem(fc, config_file_cache);
+	safe_free(fc->filename);
+	safe_free(fc->displayname);
+	safe_free(fc->defines);
+	free_namevaluelist(fc->added_defines);
+	config_free(fc->cf);
+	safe_free(fc);
+}
+
+/** Drops cache entries that were not used during the previous config
+ * read (includes that were removed). Called at the start of init_conf().
+ */
+static void config_file_cache_expire(void)
+{
+	ConfigFileCache *fc, *next;
+
+	for (fc = config_file_cache; fc; fc = next)
+	{
+		next = fc->next;
+		if (!fc->used)
+			config_file_cache_delete(fc);
+		else
+			fc->used = 0;
+	}
+}
+
 ConfigFile *config_load(char *filename, char *displayname)
 {
 	struct stat sb;
 	int			fd;
 	int			ret;
 	char		*buf = NULL;
+	char		*defines_key = NULL;
+	NameValueList	*old_defines;
+	ConfigFileCache	*fc;
 	ConfigFile	*cfptr;
 
 	if (!displayname)
@@ -851,6 +1107,25 @@ ConfigFile *config_load(char *filename, char *displayname)
 		close(fd);
 		return cfptr;
 	}
+	/* Reuse the tree from the previous run if the file and the
+	 * @define environment it was parsed under are both unchanged.
+	 */
+	fc = config_file_cache_find(filename, displayname);
+	if (fc && (fc->mtime == sb.st_mtime) && (fc->size == sb.st_size))
+	{
+		int unchanged;
+
+		defines_key = config_defines_serialize();
+		unchanged = !strcmp(fc->defines, defines_key);
+		safe_free(defines_key);
+		if (unchanged)
+		{
+			close(fd);
+			config_defines_replay(fc->added_defines);
+			fc->used = 1;
+			return config_file_duplicate(fc->cf);
+		}
+	}
 	buf = safe_alloc(sb.st_size+1);
 	if (buf == NULL)
 	{
@@ -871,20 +1146,47 @@ ConfigFile *config_load(char *filename, char *displayname)
 	buf[ret] = '\0';
 	close(fd);
 	add_entropy_configfile(&sb, buf);
+	defines_key = config_defines_serialize();
+	old_defines = config_defines;
 	cfptr = config_parse(displayname, buf);
 	safe_free(buf);
+	if (cfptr)
+	{
+		/* Cache the pristine tree for the next rehash */
+		if (fc)
+			config_file_cache_delete(fc);
+		fc = safe_alloc(sizeof(ConfigFileCache));
+		safe_strdup(fc->filename, filename);
+		safe_strdup(fc->displayname, displayname);
+		fc->mtime = sb.st_mtime;
+		fc->size = sb.st_size;
+		fc->defines = defines_key;
+		fc->added_defines = config_defines_delta(old_defines);
+		fc->cf = config_file_duplicate(cfptr);
+		fc->used = 1;
+		AddListItem(fc, config_file_cache);
+	} else
+	{
+		safe_free(defines_key);
+	}
 	return cfptr;
 }
 
 void config_free(ConfigFile *cfptr)
 {
 	ConfigFile	*nptr;
+	ConfigArena	*a, *a_next;
 
 	for(;cfptr;cfptr=nptr)
 	{
 		nptr = cfptr->cf_next;
 		if (cfptr->cf_entries)
 			config_entry_free_all(cfptr->cf_entries);
+		for (a = cfptr->cf_arena; a; a = a_next)
+		{
+			a_next = a->next;
+			safe_free(a);
+		}
 		safe_free(cfptr->cf_filename);
 		safe_free(cfptr);
 	}
@@ -1159,11 +1461,12 @@ ConfigFile *config_parse_with_offset(char *filename, char *confdata, unsigned in
 						safe_strldup(curce->ce_vardata, start, ptr-start+1);
 						preprocessor_replace_defines(&curce->ce_vardata, curce);
 						unreal_del_quotes(curce->ce_vardata);
+						config_string_to_arena(curcf, &curce->ce_vardata);
 					}
 				}
 				else
 				{
-					curce = safe_alloc(sizeof(ConfigEntry));
+					curce = config_file_arena_alloc(curcf, sizeof(ConfigEntry));
 					curce->ce_varlinenum = linenumber;
 					curce->ce_fileptr = curcf;
 					curce->ce_prevlevel = cursection;
@@ -1171,6 +1474,7 @@ ConfigFile *config_parse_with_offset(char *filename, char *confdata, unsigned in
 					safe_strldup(curce->ce_varname, start, ptr-start+1);
 					preprocessor_replace_defines(&curce->ce_varname, curce);
 					unreal_del_quotes(curce->ce_varname);
+					config_string_intern(&curce->ce_varname);
 					preprocessor_cc_duplicate_list(cc_list, &curce->ce_cond);
 				}
 				break;
@@ -1266,18 +1570,19 @@ ConfigFile *config_parse_with_offset(char *filename, char *confdata, unsigned in
 					{
 						safe_strldup(curce->ce_vardata, start, ptr-start+1);
 						preprocessor_replace_defines(&curce->ce_vardata, curce);
+						config_string_to_arena(curcf, &curce->ce_vardata);
 					}
 				}
 				else
 				{
-					curce = safe_alloc(sizeof(ConfigEntry));
-					memset(curce, 0, sizeof(ConfigEntry));
+					curce = config_file_arena_alloc(curcf, sizeof(ConfigEntry));
 					curce->ce_varlinenum = linenumber;
 					curce->ce_fileptr = curcf;
 					curce->ce_prevlevel = cursection;
 					curce->ce_fileposstart = (start - confdata);
 					safe_strldup(curce->ce_varname, start, ptr-start+1);
 					preprocessor_replace_defines(&curce->ce_varname, curce);
+					config_string_intern(&curce->ce_varname);
 					if (curce->ce_cond)
 						abort(); // hmm this can be reached? FIXME!
 					preprocessor_cc_duplicate_list(cc_list, &curce->ce_cond);
@@ -1317,6 +1622,9 @@ breakout:
 /** Free a ConfigEntry struct, all it's children, and all it's next entries.
  * Consider calling config_entry_free() instead of this one.. or at least
  * check which one of the two you actually need ;)
+ * Note that ce_vardata and the nodes themselves live in the ConfigFile
+ * arena (released in config_free), so "freeing" an entry means dropping
+ * the interned ce_varname reference and any conditionals.
  */
 void config_entry_free_all(ConfigEntry *ce)
 {
@@ -1327,11 +1635,9 @@ void config_entry_free_all(ConfigEntry *ce)
 		nptr = ce->ce_next;
 		if (ce->ce_entries)
 			config_entry_free_all(ce->ce_entries);
-		safe_free(ce->ce_varname);
-		safe_free(ce->ce_vardata);
+		unintern_string(ce->ce_varname);
 		if (ce->ce_cond)
 			preprocessor_cc_free_list(ce->ce_cond);
-		safe_free(ce);
 	}
 }
 
@@ -1342,11 +1648,9 @@ void config_entry_free(ConfigEntry *ce)
 {
 	if (ce->ce_entries)
 		config_entry_free_all(ce->ce_entries);
-	safe_free(ce->ce_varname);
-	safe_free(ce->ce_vardata);
+	unintern_string(ce->ce_varname);
 	if (ce->ce_cond)
 		preprocessor_cc_free_list(ce->ce_cond);
-	safe_free(ce);
 }
 
 ConfigEntry *config_find_entry(ConfigEntry *ce, char *name)
@@ -1620,6 +1924,7 @@ void	free_iConf(Configuration *i)
 	safe_free_multiline(i->plaintext_policy_oper_message);
 	safe_free(i->outdated_tls_policy_user_message);
 	safe_free(i->outdated_tls_policy_oper_message);
+	safe_free(i->replay_record_file);
 	safe_free(i->restrict_usermodes);
 	safe_free(i->restrict_channelmodes);
 	safe_free(i->restrict_extendedbans);
@@ -1661,6 +1966,7 @@ void config_setdefaultsettings(Configuration *i)
 	i->invite_count = 4; i->invite_period = 60; /* INVITE flood protection: max 4 per 60s */
 	i->knock_count = 4; i->knock_period = 120; /* KNOCK protection: max 4 per 120s */
 	i->throttle_count = 3; i->throttle_period = 60; /* throttle protection: max 3 per 60s */
+	i->dns_cache_size = 241; /* DNS cache: matches the old fixed DNS_MAX_ENTRIES */
 	i->ban_version_tkl_time = 86400; /* 1d */
 	i->spamfilter_ban_time = 86400; /* 1d */
 	safe_strdup(i->spamfilter_ban_reason, "Spam/advertising");
@@ -1695,6 +2001,9 @@ void config_setdefaultsettings(Configuration *i)
 	safe_strdup(i->network.x_prefix_quit, "Quit");
 	i->max_unknown_connections_per_ip = 3;
 	i->handshake_timeout = 30;
+	i->loop_stall_warning_time = 2;
+	i->slow_command_trace_time = 250000; /* 250 msec */
+	i->replay_record_strip_payload = 1; /* privacy first: see set::replay-record-file */
 	i->sasl_timeout = 15;
 	i->handshake_delay = -1;
 	i->broadcast_channel_messages = BROADCAST_CHANNEL_MESSAGES_AUTO;
@@ -2043,6 +2352,7 @@ int	init_conf(char *rootconf, int rehash)
 	config_setdefaultsettings(&tempiConf);
 	clicap_pre_rehash();
 	free_config_defines();
+	config_file_cache_expire();
 	/*
 	 * the rootconf must be listed in the conf_include for include
 	 * recursion prevention code and sanity checking code to be
@@ -2258,6 +2568,51 @@ int	load_conf(char *filename, const char *original_path)
 		/* Load includes */
 		if (config_verbose > 1)
 			config_status("Searching through %s for include files..", filename);
+#ifdef USE_LIBCURL
+		/* Fetch all remote includes of this file in parallel first, so
+		 * their download latency overlaps rather than adds up. The
+		 * remote_include() -> download_file() calls in the loop below
+		 * then find the results already waiting for them. Known remote
+		 * includes during a rehash are not affected: those go through
+		 * download_file_async() instead, see rehash().
+		 */
+		{
+			int numurls = 0;
+
+			for (ce = cfptr->cf_entries; ce; ce = ce->ce_next)
+				if (!strcmp(ce->ce_varname, "include") && ce->ce_vardata &&
+				    !ce->ce_cond && url_is_valid(ce->ce_vardata))
+				{
+					numurls++;
+				}
+			if (numurls > 1)
+			{
+				char **urls = safe_alloc(sizeof(char *) * numurls);
+
+				numurls = 0;
+				for (ce = cfptr->cf_entries; ce; ce = ce->ce_next)
+				{
+					char *errorbuf = NULL;
+
+					if (strcmp(ce->ce_varname, "include") || !ce->ce_vardata ||
+					    ce->ce_cond || !url_is_valid(ce->ce_vardata))
+					{
+						continue;
+					}
+					/* Same condition under which remote_include() will
+					 * call download_file() for this URL.
+					 */
+					if (!loop.ircd_rehashing ||
+					    (!find_remote_include(ce->ce_vardata, &errorbuf) && !errorbuf))
+					{
+						urls[numurls++] = ce->ce_vardata;
+					}
+				}
+				download_files_prefetch(urls, numurls);
+				safe_free(urls);
+			}
+		}
+#endif
 		for (ce = cfptr->cf_entries; ce; ce = ce->ce_next)
 			if (!strcmp(ce->ce_varname, "include"))
 			{
@@ -2331,6 +2686,133 @@ void remove_config_tkls(void)
 	}
 }
 
+/* == Incremental rehash ==
+ * A rehash tears down and rebuilds every runtime config list, even
+ * when most blocks did not change, which churns memory and stalls the
+ * server on large configs. For self contained block types (items with
+ * no pointers into classes, modules or clients) we keep a serialized
+ * snapshot of the parsed blocks of the active config; when a rehash
+ * presents exactly the same blocks for such a type, both the teardown
+ * in config_rehash() and the rebuild in config_run() are skipped and
+ * the existing items stay untouched. Block types whose items cross
+ * reference other config (class, oper, listen, allow, ..) always
+ * rebuild - only add a type here after checking _conf_* for such
+ * references and for side effects beyond building the item list.
+ */
+typedef struct ConfigBlockSnapshot ConfigBlockSnapshot;
+struct ConfigBlockSnapshot {
+	char *block;	/**< Top level block name */
+	char *data;	/**< Serialized blocks of the active config (NULL = none taken) */
+	int unchanged;	/**< Set by config_snapshot_compare() for the rehash in progress */
+};
+
+static ConfigBlockSnapshot config_snapshots[] = {
+	{ "ulines", NULL, 0 },
+	{ "except", NULL, 0 },
+	{ "vhost",  NULL, 0 },
+};
+
+/** Appends string 's' plus a separator to a growing buffer */
+static void config_serialize_append(char **buf, int *len, int *size, const char *s)
+{
+	int slen = strlen(s) + 1; /* +1 for the separator */
+
+	if (*len + slen + 1 > *size)
+	{
+		char *newbuf;
+
+		*size = (*size + slen + 1) * 2;
+		newbuf = safe_alloc(*size);
+		if (*buf)
+		{
+			memcpy(newbuf, *buf, *len);
+			safe_free(*buf);
+		}
+		*buf = newbuf;
+	}
+	memcpy(*buf + *len, s, slen - 1);
+	(*buf)[*len + slen - 1] = '\1';
+	*len += slen;
+	(*buf)[*len] = '\0';
+}
+
+/** Serializes a config entry (and its sub entries, recursively) */
+static void config_serialize_entry(ConfigEntry *ce, char **buf, int *len, int *size)
+{
+	ConfigEntry *cep;
+
+	config_serialize_append(buf, len, size, ce->ce_varname ? ce->ce_varname : "");
+	config_serialize_append(buf, len, size, ce->ce_vardata ? ce->ce_vardata : "");
+	if (ce->ce_entries)
+	{
+		config_serialize_append(buf, len, size, "{");
+		for (cep = ce->ce_entries; cep; cep = cep->ce_next)
+			config_serialize_entry(cep, buf, len, size);
+		config_serialize_append(buf, len, size, "}");
+	}
+}
+
+/** Returns all top level blocks named 'block' from 'conf' in serialized
+ * form (for exact comparison), or NULL if there are none.
+ */
+static char *config_serialize_blocks(const char *block)
+{
+	ConfigFile *cfptr;
+	ConfigEntry *ce;
+	char *buf = NULL;
+	int len = 0, size = 0;
+
+	for (cfptr = conf; cfptr; cfptr = cfptr->cf_next)
+		for (ce = cfptr->cf_entries; ce; ce = ce->ce_next)
+			if (ce->ce_varname && !strcmp(ce->ce_varname, block))
+				config_serialize_entry(ce, &buf, &len, &size);
+
+	return buf;
+}
+
+/** Marks the block types that the (already tested) new config leaves
+ * unchanged. Called at the start of config_rehash().
+ */
+static void config_snapshot_compare(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZEOF(config_snapshots); i++)
+	{
+		char *new = config_serialize_blocks(config_snapshots[i].block);
+
+		config_snapshots[i].unchanged = config_snapshots[i].data && new &&
+		                                !strcmp(config_snapshots[i].data, new);
+		safe_free(new);
+	}
+}
+
+/** Returns 1 if the rehash in progress does not touch this block type */
+static int config_block_unchanged(const char *block)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZEOF(config_snapshots); i++)
+		if (!strcmp(config_snapshots[i].block, block))
+			return config_snapshots[i].unchanged;
+	return 0;
+}
+
+/** Stores serialized snapshots of the now active config and resets the
+ * unchanged markers. Called at the end of a successful config_run().
+ */
+static void config_snapshot_store(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZEOF(config_snapshots); i++)
+	{
+		safe_free(config_snapshots[i].data);
+		config_snapshots[i].data = config_serialize_blocks(config_snapshots[i].block);
+		config_snapshots[i].unchanged = 0;
+	}
+}
+
 void	config_rehash()
 {
 	ConfigItem_oper			*oper_ptr;
@@ -2357,6 +2839,8 @@ void	config_rehash()
 	ListStruct 	*next, *next2;
 	SpamExcept *spamex_ptr;
 
+	config_snapshot_compare();
+
 	USE_BAN_VERSION = 0;
 
 	for (admin_ptr = conf_admin; admin_ptr; admin_ptr = (ConfigItem_admin *)next)
@@ -2415,13 +2899,16 @@ void	config_rehash()
 			delete_classblock(class_ptr);
 		}
 	}
-	for (uline_ptr = conf_ulines; uline_ptr; uline_ptr = (ConfigItem_ulines *) next)
+	if (!config_block_unchanged("ulines"))
 	{
-		next = (ListStruct *)uline_ptr->next;
-		/* We'll wipe it out when it has no clients */
-		safe_free(uline_ptr->servername);
-		DelListItem(uline_ptr, conf_ulines);
-		safe_free(uline_ptr);
+		for (uline_ptr = conf_ulines; uline_ptr; uline_ptr = (ConfigItem_ulines *) next)
+		{
+			next = (ListStruct *)uline_ptr->next;
+			/* We'll wipe it out when it has no clients */
+			safe_free(uline_ptr->servername);
+			DelListItem(uline_ptr, conf_ulines);
+			safe_free(uline_ptr);
+		}
 	}
 	for (allow_ptr = conf_allow; allow_ptr; allow_ptr = (ConfigItem_allow *) next)
 	{
@@ -2432,12 +2919,15 @@ void	config_rehash()
 		DelListItem(allow_ptr, conf_allow);
 		safe_free(allow_ptr);
 	}
-	for (except_ptr = conf_except; except_ptr; except_ptr = (ConfigItem_except *) next)
+	if (!config_block_unchanged("except"))
 	{
-		next = (ListStruct *)except_ptr->next;
-		safe_free(except_ptr->mask);
-		DelListItem(except_ptr, conf_except);
-		safe_free(except_ptr);
+		for (except_ptr = conf_except; except_ptr; except_ptr = (ConfigItem_except *) next)
+		{
+			next = (ListStruct *)except_ptr->next;
+			safe_free(except_ptr->mask);
+			DelListItem(except_ptr, conf_except);
+			safe_free(except_ptr);
+		}
 	}
 	/* Free ban realname { }, ban server { } and ban version { } */
 	for (ban_ptr = conf_ban; ban_ptr; ban_ptr = (ConfigItem_ban *) next)
@@ -2473,26 +2963,29 @@ void	config_rehash()
 		DelListItem(tld_ptr, conf_tld);
 		safe_free(tld_ptr);
 	}
-	for (vhost_ptr = conf_vhost; vhost_ptr; vhost_ptr = (ConfigItem_vhost *) next)
+	if (!config_block_unchanged("vhost"))
 	{
-		SWhois *s, *s_next;
+		for (vhost_ptr = conf_vhost; vhost_ptr; vhost_ptr = (ConfigItem_vhost *) next)
+		{
+			SWhois *s, *s_next;
 
-		next = (ListStruct *)vhost_ptr->next;
+			next = (ListStruct *)vhost_ptr->next;
 
-		safe_free(vhost_ptr->login);
-		Auth_FreeAuthConfig(vhost_ptr->auth);
-		safe_free(vhost_ptr->virthost);
-		safe_free(vhost_ptr->virtuser);
-		unreal_delete_masks(vhost_ptr->mask);
-		for (s = vhost_ptr->swhois; s; s = s_next)
-		{
-			s_next = s->next;
-			safe_free(s->line);
-			safe_free(s->setby);
-			safe_free(s);
+			safe_free(vhost_ptr->login);
+			Auth_FreeAuthConfig(vhost_ptr->auth);
+			safe_free(vhost_ptr->virthost);
+			safe_free(vhost_ptr->virtuser);
+			unreal_delete_masks(vhost_ptr->mask);
+			for (s = vhost_ptr->swhois; s; s = s_next)
+			{
+				s_next = s->next;
+				safe_free(s->line);
+				safe_free(s->setby);
+				safe_free(s);
+			}
+			DelListItem(vhost_ptr, conf_vhost);
+			safe_free(vhost_ptr);
 		}
-		DelListItem(vhost_ptr, conf_vhost);
-		safe_free(vhost_ptr);
 	}
 
 	remove_config_tkls();
@@ -2543,11 +3036,13 @@ void	config_rehash()
 		conf_drpass->dieauth = NULL;
 		safe_free(conf_drpass);
 	}
+	ircd_log_flush(); /* don't lose buffered log data of log blocks we free below */
 	for (log_ptr = conf_log; log_ptr; log_ptr = (ConfigItem_log *)next) {
 		next = (ListStruct *)log_ptr->next;
 		if (log_ptr->logfd != -1)
 			fd_close(log_ptr->logfd);
 		safe_free(log_ptr->file);
+		safe_free(log_ptr->buffer);
 		DelListItem(log_ptr, conf_log);
 		safe_free(log_ptr);
 	}
@@ -2555,6 +3050,7 @@ void	config_rehash()
 		RealCommand *cmptr = find_command(alias_ptr->alias, 0);
 		ConfigItem_alias_format *fmt;
 		next = (ListStruct *)alias_ptr->next;
+		alias_hash_del(alias_ptr);
 		safe_free(alias_ptr->nick);
 		if (cmptr)
 			CommandDelX(NULL, cmptr);
@@ -2618,6 +3114,7 @@ void	config_rehash()
 	    safe_free(sni);
 	}
 	conf_sni = NULL;
+	invalidate_sni_index();
 
 	free_conf_channelmodes(&iConf.modes_on_join);
 
@@ -2732,6 +3229,9 @@ int	config_run()
 			if (!strcmp(ce->ce_varname, "set") || !strcmp(ce->ce_varname, "class"))
 				continue; // already processed
 
+			if (config_block_unchanged(ce->ce_varname))
+				continue; // unchanged since the previous rehash, existing items kept
+
 			if ((cc = config_binary_search(ce->ce_varname))) {
 				if ((cc->conffunc) && (cc->conffunc(cfptr, ce) < 0))
 					errors++;
@@ -2779,6 +3279,9 @@ int	config_run()
 	if (errors > 0)
 	{
 		config_error("%i fatal errors encountered", errors);
+	} else
+	{
+		config_snapshot_store();
 	}
 	return (errors > 0 ? -1 : 1);
 }
@@ -2803,6 +3306,92 @@ NameValue *config_binary_flags_search(NameValue *table, char *cmd, int size) {
 	return NULL;
 }
 
+/* Per test-run memo of which HOOKTYPE_CONFIGTEST hooks claimed a
+ * directive name. Module directives are dispatched by name, so when a
+ * config carries many blocks of the same name (spamfilter, blacklist,
+ * webirc, ..) only the first one needs to ask every module; the
+ * 2nd..nth go straight to the hook(s) that cared. The memo only lives
+ * for the duration of one config_test(): modules - and thus the hook
+ * pointers - change on every rehash.
+ */
+#define CONFIGTEST_MEMO_HOOKS 8
+
+typedef struct ConfigTestMemo ConfigTestMemo;
+struct ConfigTestMemo {
+	ConfigTestMemo *prev, *next;
+	char *name;				/**< directive name */
+	Hook *hooks[CONFIGTEST_MEMO_HOOKS];	/**< hooks that returned non-zero, in order */
+	int count;				/**< number of hooks above, -1 = overflowed: always ask everyone */
+};
+
+static ConfigTestMemo *configtest_memo = NULL;
+
+static ConfigTestMemo *configtest_memo_find(const char *name)
+{
+	ConfigTestMemo *memo;
+
+	for (memo = configtest_memo; memo; memo = memo->next)
+		if (!strcmp(memo->name, name))
+			return memo;
+	return NULL;
+}
+
+static ConfigTestMemo *configtest_memo_add(const char *name)
+{
+	ConfigTestMemo *memo = safe_alloc(sizeof(ConfigTestMemo));
+
+	safe_strdup(memo->name, name);
+	AddListItem(memo, configtest_memo);
+	return memo;
+}
+
+static void configtest_memo_record(ConfigTestMemo *memo, Hook *h)
+{
+	if (memo->count < 0)
+		return;
+	if (memo->count == CONFIGTEST_MEMO_HOOKS)
+		memo->count = -1; /* too many consumers, always do the full walk */
+	else
+		memo->hooks[memo->count++] = h;
+}
+
+static void configtest_memo_free_all(void)
+{
+	ConfigTestMemo *memo, *next;
+
+	for (memo = configtest_memo; memo; memo = next)
+	{
+		next = memo->next;
+		safe_free(memo->name);
+		safe_free(memo);
+	}
+	configtest_memo = NULL;
+}
+
+/** Handles one CONFIGTEST hook result, returns 1 to stop asking further hooks */
+static int config_test_hook_result(int value, int errs, int *used, int *errors)
+{
+	if (value == 2)
+		*used = 1;
+	if (value == 1)
+	{
+		*used = 1;
+		return 1;
+	}
+	if (value == -1)
+	{
+		*used = 1;
+		*errors += errs;
+		return 1;
+	}
+	if (value == -2)
+	{
+		*used = 1;
+		*errors += errs;
+	}
+	return 0;
+}
+
 int	config_test()
 {
 	ConfigEntry 	*ce;
@@ -2836,34 +3425,37 @@ int	config_test()
 			else
 			{
 				int used = 0;
-				for (h = Hooks[HOOKTYPE_CONFIGTEST]; h; h = h->next)
-				{
-					int value, errs = 0;
-					if (h->owner && !(h->owner->flags & MODFLAG_TESTING)
-					    && !(h->owner->options & MOD_OPT_PERM))
-
+				ConfigTestMemo *memo = configtest_memo_find(ce->ce_varname);
 
-						continue;
-					value = (*(h->func.intfunc))(cfptr,ce,CONFIG_MAIN,&errs);
-					if (value == 2)
-						used = 1;
-					if (value == 1)
-					{
-						used = 1;
-						break;
-					}
-					if (value == -1)
+				if (memo && (memo->count >= 0))
+				{
+					/* Seen this directive before: only ask the modules that claimed it */
+					int i;
+					for (i = 0; i < memo->count; i++)
 					{
-						used = 1;
-						errors += errs;
-						break;
+						int errs = 0;
+						int value = (*(memo->hooks[i]->func.intfunc))(cfptr,ce,CONFIG_MAIN,&errs);
+						if (config_test_hook_result(value, errs, &used, &errors))
+							break;
 					}
-					if (value == -2)
+				} else
+				{
+					if (!memo)
+						memo = configtest_memo_add(ce->ce_varname);
+					for (h = Hooks[HOOKTYPE_CONFIGTEST]; h; h = h->next)
 					{
-						used = 1;
-						errors += errs;
-					}
+						int value, errs = 0;
+						if (h->owner && !(h->owner->flags & MODFLAG_TESTING)
+						    && !(h->owner->options & MOD_OPT_PERM))
 
+
+							continue;
+						value = (*(h->func.intfunc))(cfptr,ce,CONFIG_MAIN,&errs);
+						if (value != 0)
+							configtest_memo_record(memo, h);
+						if (config_test_hook_result(value, errs, &used, &errors))
+							break;
+					}
 				}
 				if (!used)
 				{
@@ -2882,6 +3474,7 @@ int	config_test()
 			}
 		}
 	}
+	configtest_memo_free_all();
 	errors += config_post_test();
 	if (errors > 0)
 	{
@@ -2899,6 +3492,50 @@ int	config_test()
  * Service functions
 */
 
+/* Aliases are resolved on every aliased command (each PRIVMSG to
+ * NickServ goes through find_alias()), so besides the conf_alias list
+ * the aliases hang in a small hash table by alias name. _conf_alias()
+ * and the rehash teardown keep the two in sync.
+ */
+#define ALIAS_HASH_TABLE_SIZE 64
+static ConfigItem_alias *alias_hash_table[ALIAS_HASH_TABLE_SIZE];
+
+static unsigned int alias_hash(const char *name)
+{
+	static char siphashkey_alias[SIPHASH_KEY_LENGTH];
+	static int keyed = 0;
+
+	if (!keyed)
+	{
+		siphash_generate_key(siphashkey_alias);
+		keyed = 1;
+	}
+	return siphash_nocase(name, siphashkey_alias) % ALIAS_HASH_TABLE_SIZE;
+}
+
+static void alias_hash_add(ConfigItem_alias *alias)
+{
+	unsigned int b = alias_hash(alias->alias);
+
+	alias->hnext = alias_hash_table[b];
+	alias_hash_table[b] = alias;
+}
+
+static void alias_hash_del(ConfigItem_alias *alias)
+{
+	ConfigItem_alias **h;
+
+	for (h = &alias_hash_table[alias_hash(alias->alias)]; *h; h = &(*h)->hnext)
+	{
+		if (*h == alias)
+		{
+			*h = alias->hnext;
+			alias->hnext = NULL;
+			return;
+		}
+	}
+}
+
 ConfigItem_alias *find_alias(char *name)
 {
 	ConfigItem_alias *e;
@@ -2906,7 +3543,7 @@ ConfigItem_alias *find_alias(char *name)
 	if (!name)
 		return NULL;
 
-	for (e = conf_alias; e; e = e->next)
+	for (e = alias_hash_table[alias_hash(name)]; e; e = e->hnext)
 	{
 		if (!strcasecmp(e->alias, name))
 			return e;
@@ -2988,21 +3625,109 @@ ConfigItem_listen *find_listen(char *ipmask, int port, int ipv6)
 	return NULL;
 }
 
+/* The sni { } blocks are indexed by name so the TLS servername callback
+ * does not have to walk and wildcard-match the whole list on every
+ * handshake: exact names go into a small case-insensitive hash table and
+ * wildcard patterns (which are rare) onto a separate chain that is only
+ * walked after an exact-name miss. Unknown names, which bots probe
+ * constantly, are remembered in a small negative cache.
+ * The index is (re)built lazily on first lookup and torn down whenever
+ * the sni { } configuration changes (see invalidate_sni_index).
+ */
+#define SNI_HASH_TABLE_SIZE 64
+#define SNI_NEGCACHE_SIZE 64
+
+static ConfigItem_sni *sni_hash_table[SNI_HASH_TABLE_SIZE];
+static ConfigItem_sni *sni_wildcard_list = NULL;
+static int sni_index_built = 0;
+static char siphashkey_sni[SIPHASH_KEY_LENGTH];
+static int siphashkey_sni_set = 0;
+
+typedef struct SniNegCacheEntry SniNegCacheEntry;
+struct SniNegCacheEntry {
+	char valid; /**< Slot in use? */
+	char name[HOSTLEN+1]; /**< Probed name with no sni { } match */
+};
+
+static SniNegCacheEntry sni_negcache[SNI_NEGCACHE_SIZE];
+
+/** Throw away the SNI name index, it will be rebuilt on next lookup. */
+static void invalidate_sni_index(void)
+{
+	memset(sni_hash_table, 0, sizeof(sni_hash_table));
+	memset(sni_negcache, 0, sizeof(sni_negcache));
+	sni_wildcard_list = NULL;
+	sni_index_built = 0;
+}
+
+/** Build the SNI name index from the conf_sni list. */
+static void build_sni_index(void)
+{
+	ConfigItem_sni *e;
+	int b;
+
+	if (!siphashkey_sni_set)
+	{
+		siphash_generate_key(siphashkey_sni);
+		siphashkey_sni_set = 1;
+	}
+
+	invalidate_sni_index();
+
+	for (e = conf_sni; e; e = e->next)
+	{
+		if (strchr(e->name, '*') || strchr(e->name, '?'))
+		{
+			e->hnext = sni_wildcard_list;
+			sni_wildcard_list = e;
+		} else
+		{
+			b = siphash_nocase(e->name, siphashkey_sni) % SNI_HASH_TABLE_SIZE;
+			e->hnext = sni_hash_table[b];
+			sni_hash_table[b] = e;
+		}
+	}
+
+	sni_index_built = 1;
+}
+
 /** Find an SNI match.
  * @param name The hostname to look for (eg: irc.xyz.com).
  */
 ConfigItem_sni *find_sni(char *name)
 {
 	ConfigItem_sni *e;
+	SniNegCacheEntry *neg;
 
 	if (!name)
 		return NULL;
 
-	for (e = conf_sni; e; e = e->next)
+	if (!sni_index_built)
+		build_sni_index();
+
+	for (e = sni_hash_table[siphash_nocase(name, siphashkey_sni) % SNI_HASH_TABLE_SIZE]; e; e = e->hnext)
+	{
+		if (!strcasecmp(e->name, name))
+			return e;
+	}
+
+	neg = &sni_negcache[siphash_nocase(name, siphashkey_sni) % SNI_NEGCACHE_SIZE];
+	if (neg->valid && !strcasecmp(neg->name, name))
+		return NULL; /* known non-match, don't bother with the wildcards again */
+
+	for (e = sni_wildcard_list; e; e = e->hnext)
+	{
+		if (match_simple(e->name, name))
+			return e;
+	}
+
+	/* No match: remember that, bots tend to probe the same names over and over */
+	if (strlen(name) <= HOSTLEN)
 	{
-        if (match_simple(e->name, name))
-            return e;
+		strlcpy(neg->name, name, sizeof(neg->name));
+		neg->valid = 1;
 	}
+
 	return NULL;
 }
 
@@ -4308,8 +5033,12 @@ int	_conf_class(ConfigFile *conf, ConfigEntry *ce)
 		else if (!strcmp(cep->ce_varname, "options"))
 		{
 			for (cep2 = cep->ce_entries; cep2; cep2 = cep2->ce_next)
+			{
 				if (!strcmp(cep2->ce_varname, "nofakelag"))
 					class->options |= CLASS_OPT_NOFAKELAG;
+				else if (!strcmp(cep2->ce_varname, "large-sendq-blocks"))
+					class->options |= CLASS_OPT_LARGE_SENDQ_BLOCKS;
+			}
 		}
 	}
 	if (isnew)
@@ -4342,6 +5071,9 @@ int	_test_class(ConfigFile *conf, ConfigEntry *ce)
 		{
 			for (cep2 = cep->ce_entries; cep2; cep2 = cep2->ce_next)
 			{
+				if (!strcmp(cep2->ce_varname, "large-sendq-blocks"))
+					;
+				else
 #ifdef FAKELAG_CONFIGURABLE
 				if (!strcmp(cep2->ce_varname, "nofakelag"))
 					;
@@ -4850,6 +5582,7 @@ int	_conf_listen(ConfigFile *conf, ConfigEntry *ce)
 	char *ip = NULL;
 	int start=0, end=0, port, isnew;
 	int tmpflags =0;
+	int reuseport = 0;
 	Hook *h;
 
 	for (cep = ce->ce_entries; cep; cep = cep->ce_next)
@@ -4864,6 +5597,10 @@ int	_conf_listen(ConfigFile *conf, ConfigEntry *ce)
 			if ((start < 0) || (start > 65535) || (end < 0) || (end > 65535))
 				return -1; /* this is already validated in _test_listen, but okay.. */
 		} else
+		if (!strcmp(cep->ce_varname, "reuse-port"))
+		{
+			reuseport = atoi(cep->ce_vardata);
+		} else
 		if (!strcmp(cep->ce_varname, "options"))
 		{
 			for (cepp = cep->ce_entries; cepp; cepp = cepp->ce_next)
@@ -4915,6 +5652,7 @@ int	_conf_listen(ConfigFile *conf, ConfigEntry *ce)
 				tmpflags |= LISTENER_BOUND;
 
 			listen->options = tmpflags;
+			listen->reuseport = reuseport;
 			if (isnew)
 				AddListItem(listen, conf_listen);
 			listen->flag.temporary = 0;
@@ -4948,6 +5686,8 @@ int	_conf_listen(ConfigFile *conf, ConfigEntry *ce)
 					;
 				else if (!strcmp(cep->ce_varname, "port"))
 					;
+				else if (!strcmp(cep->ce_varname, "reuse-port"))
+					;
 				else if (!strcmp(cep->ce_varname, "options"))
 				{
 					for (cepp = cep->ce_entries; cepp; cepp = cepp->ce_next)
@@ -4998,6 +5738,7 @@ int	_conf_listen(ConfigFile *conf, ConfigEntry *ce)
 					tmpflags |= LISTENER_BOUND;
 
 				listen->options = tmpflags;
+				listen->reuseport = reuseport;
 				if (isnew)
 					AddListItem(listen, conf_listen);
 				listen->flag.temporary = 0;
@@ -5029,6 +5770,8 @@ int	_conf_listen(ConfigFile *conf, ConfigEntry *ce)
 						;
 					else if (!strcmp(cep->ce_varname, "port"))
 						;
+					else if (!strcmp(cep->ce_varname, "reuse-port"))
+						;
 					else if (!strcmp(cep->ce_varname, "options"))
 					{
 						for (cepp = cep->ce_entries; cepp; cepp = cepp->ce_next)
@@ -5247,6 +5990,22 @@ int	_test_listen(ConfigFile *conf, ConfigEntry *ce)
 			if ((6667 >= start) && (6667 <= end))
 				port_6667 = 1;
 		} else
+		if (!strcmp(cep->ce_varname, "reuse-port"))
+		{
+			int v = atoi(cep->ce_vardata);
+
+			if ((v < 1) || (v > 64))
+			{
+				config_error("%s:%i: listen::reuse-port must be between 1 and 64",
+					cep->ce_fileptr->cf_filename, cep->ce_varlinenum);
+				errors++;
+			}
+#ifndef SO_REUSEPORT
+			config_warn("%s:%i: listen::reuse-port is not supported on this platform (SO_REUSEPORT missing), "
+				"a single listening socket will be used",
+				cep->ce_fileptr->cf_filename, cep->ce_varlinenum);
+#endif
+		} else
 		{
 			if (!used_by_module)
 			{
@@ -5727,7 +6486,7 @@ int _test_except(ConfigFile *conf, ConfigEntry *ce)
 		            "Simply rename the block from 'except tkl' to 'except ban' "
 		            "to get rid of this warning.",
 		            ce->ce_fileptr->cf_filename, ce->ce_varlinenum);
-		safe_strdup(ce->ce_vardata, "ban"); /* awww */
+		ce->ce_vardata = config_file_arena_strdup(ce->ce_fileptr, "ban"); /* awww */
 	}
 
 	for (h = Hooks[HOOKTYPE_CONFIGTEST]; h; h = h->next)
@@ -6029,6 +6788,7 @@ int	_conf_sni(ConfigFile *conf, ConfigEntry *ce)
 	conf_tlsblock(conf, tlsconfig, sni->tls_options);
 	sni->ssl_ctx = init_ctx(sni->tls_options, 1);
 	AddListItem(sni, conf_sni);
+	invalidate_sni_index();
 
 	return 1;
 }
@@ -6513,9 +7273,11 @@ int	_test_link(ConfigFile *conf, ConfigEntry *ce)
 			{
 				if (!strcmp(cepp->ce_varname, "quarantine"))
 					;
+				else if (!strcmp(cepp->ce_varname, "compressed"))
+					;
 				else
 				{
-					config_error("%s:%d: link::options only has one possible option ('quarantine', rarely used). "
+					config_error("%s:%d: link::options only has the options 'quarantine' (rarely used) and 'compressed'. "
 					             "Option '%s' is unrecognized. "
 					             "Perhaps you meant to set an outgoing option in link::outgoing::options instead?",
 					             cepp->ce_fileptr->cf_filename, cepp->ce_varlinenum, cepp->ce_varname);
@@ -7359,6 +8121,9 @@ int	_conf_set(ConfigFile *conf, ConfigEntry *ce)
 		else if (!strcmp(cep->ce_varname, "watch-away-notification")) {
 			tempiConf.watch_away_notification = config_checkval(cep->ce_vardata, CFG_YESNO);
 		}
+		else if (!strcmp(cep->ce_varname, "hugepage-pools")) {
+			tempiConf.hugepage_pools = config_checkval(cep->ce_vardata, CFG_YESNO);
+		}
 		else if (!strcmp(cep->ce_varname, "uhnames")) {
 			tempiConf.uhnames = config_checkval(cep->ce_vardata, CFG_YESNO);
 		}
@@ -7490,6 +8255,9 @@ int	_conf_set(ConfigFile *conf, ConfigEntry *ce)
 				if (!strcmp(cepp->ce_varname, "bind-ip")) {
 					safe_strdup(tempiConf.dns_bindip, cepp->ce_vardata);
 				}
+				else if (!strcmp(cepp->ce_varname, "cache-size")) {
+					tempiConf.dns_cache_size = atoi(cepp->ce_vardata);
+				}
 			}
 		}
 		else if (!strcmp(cep->ce_varname, "anti-flood")) {
@@ -7765,6 +8533,26 @@ int	_conf_set(ConfigFile *conf, ConfigEntry *ce)
 		{
 			tempiConf.handshake_timeout = config_checkval(cep->ce_vardata, CFG_TIME);
 		}
+		else if (!strcmp(cep->ce_varname, "loop-stall-warning-time"))
+		{
+			tempiConf.loop_stall_warning_time = config_checkval(cep->ce_vardata, CFG_TIME);
+		}
+		else if (!strcmp(cep->ce_varname, "log-fsync"))
+		{
+			tempiConf.log_fsync = config_checkval(cep->ce_vardata, CFG_YESNO);
+		}
+		else if (!strcmp(cep->ce_varname, "slow-command-trace-time"))
+		{
+			tempiConf.slow_command_trace_time = atol(cep->ce_vardata);
+		}
+		else if (!strcmp(cep->ce_varname, "replay-record-file"))
+		{
+			safe_strdup(tempiConf.replay_record_file, cep->ce_vardata);
+		}
+		else if (!strcmp(cep->ce_varname, "replay-record-strip-payload"))
+		{
+			tempiConf.replay_record_strip_payload = config_checkval(cep->ce_vardata, CFG_YESNO);
+		}
 		else if (!strcmp(cep->ce_varname, "sasl-timeout"))
 		{
 			tempiConf.sasl_timeout = config_checkval(cep->ce_vardata, CFG_TIME);
@@ -8030,6 +8818,10 @@ int	_test_set(ConfigFile *conf, ConfigEntry *ce)
 			CheckNull(cep);
 			CheckDuplicate(cep, watch_away_notification, "watch-away-notification");
 		}
+		else if (!strcmp(cep->ce_varname, "hugepage-pools")) {
+			CheckNull(cep);
+			CheckDuplicate(cep, hugepage_pools, "hugepage-pools");
+		}
 		else if (!strcmp(cep->ce_varname, "uhnames")) {
 			CheckNull(cep);
 			CheckDuplicate(cep, uhnames, "uhnames");
@@ -8297,6 +9089,16 @@ int	_test_set(ConfigFile *conf, ConfigEntry *ce)
 						}
 					}
 				}
+				else if (!strcmp(cepp->ce_varname, "cache-size")) {
+					CheckDuplicate(cepp, dns_cache_size, "dns::cache-size");
+					if (atoi(cepp->ce_vardata) < 16)
+					{
+						config_error("%s:%i: set::dns::cache-size must be at least 16",
+							cepp->ce_fileptr->cf_filename, cepp->ce_varlinenum);
+						errors++;
+						continue;
+					}
+				}
 				else
 				{
 					config_error_unknownopt(cepp->ce_fileptr->cf_filename,
@@ -8931,6 +9733,24 @@ int	_test_set(ConfigFile *conf, ConfigEntry *ce)
 				errors++;
 			}
 		}
+		else if (!strcmp(cep->ce_varname, "loop-stall-warning-time")) {
+			/* Zero (disabled) and any positive value is fine */
+			CheckNull(cep);
+		}
+		else if (!strcmp(cep->ce_varname, "log-fsync")) {
+			/* Fsync log files after every (periodic) flush? Default is no. */
+			CheckNull(cep);
+		}
+		else if (!strcmp(cep->ce_varname, "slow-command-trace-time")) {
+			/* In microseconds (not seconds!), zero disables the tracer */
+			CheckNull(cep);
+		}
+		else if (!strcmp(cep->ce_varname, "replay-record-file")) {
+			CheckNull(cep);
+		}
+		else if (!strcmp(cep->ce_varname, "replay-record-strip-payload")) {
+			CheckNull(cep);
+		}
 		else if (!strcmp(cep->ce_varname, "handshake-delay"))
 		{
 			int v;
@@ -9391,7 +10211,10 @@ int	_conf_alias(ConfigFile *conf, ConfigEntry *ce)
 		return 0;
 	}
 	if ((alias = find_alias(ce->ce_vardata)))
+	{
+		alias_hash_del(alias);
 		DelListItem(alias, conf_alias);
+	}
 	alias = safe_alloc(sizeof(ConfigItem_alias));
 	safe_strdup(alias->alias, ce->ce_vardata);
 	for (cep = ce->ce_entries; cep; cep = cep->ce_next)
@@ -9452,6 +10275,7 @@ int	_conf_alias(ConfigFile *conf, ConfigEntry *ce)
 	AliasAdd(NULL, alias->alias, cmd_alias, 1, CMD_USER|CMD_ALIAS);
 
 	AddListItem(alias, conf_alias);
+	alias_hash_add(alias);
 	return 0;
 }
 
@@ -10178,6 +11002,7 @@ int	rehash_internal(Client *client, int sig)
 {
 	if (sig == 1)
 		sendto_ops("Got signal SIGHUP, reloading %s file", configfile);
+	flight_record("Rehash (by %s)", client ? client->name : "signal");
 	loop.ircd_rehashing = 1; /* double checking.. */
 	if (init_conf(configfile, 1) == 0)
 		run_configuration();
@@ -10188,6 +11013,7 @@ int	rehash_internal(Client *client, int sig)
 	unload_all_unused_extcmodes();
 	unload_all_unused_caps();
 	unload_all_unused_history_backends();
+	unload_all_unused_memory_counters();
 	// unload_all_unused_moddata(); -- this will crash
 	extcmodes_check_for_changes();
 	umodes_check_for_changes();
@@ -288,6 +288,65 @@ int crash_report_backtrace(FILE *reportfd, char *coredump)
 #endif
 }
 
+/** Decode the crash flight recorder (see flight_record in src/ircd.c)
+ * from the core file: the ring is a global array of NUL-terminated
+ * strings, so a small gdb loop can print the entries oldest-first and
+ * show what the server was doing in the seconds before it died.
+ */
+int crash_report_flight_recorder(FILE *reportfd, char *coredump)
+{
+#ifndef _WIN32
+	FILE *fd;
+	char cmd[512], buf[1024];
+	int n;
+
+	snprintf(buf, sizeof(buf), "%s/gdb.commands.flightrecorder", TMPDIR);
+	fd = fopen(buf, "w");
+	if (!fd)
+	{
+		printf("ERROR: Could not write to %s.\n", buf);
+		return 0;
+	}
+	fprintf(fd, "set pagination off\n"
+	            "set $n = %d\n"
+	            "set $i = 0\n"
+	            "while $i < $n\n"
+	            " set $s = flight_recorder[((int)flight_recorder_pos + $i) %% $n]\n"
+	            " if $s[0]\n"
+	            "  printf \"%%s\\n\", $s\n"
+	            " end\n"
+	            " set $i = $i + 1\n"
+	            "end\n"
+	            "quit\n",
+	            FLIGHT_RECORDER_ENTRIES);
+	fclose(fd);
+
+	snprintf(cmd, sizeof(cmd), "gdb -batch -x %s/gdb.commands.flightrecorder %s/unrealircd %s 2>&1",
+		TMPDIR, BINDIR, coredump);
+
+	fd = popen(cmd, "r");
+	if (!fd)
+		return 0;
+
+	fprintf(reportfd, "START OF FLIGHT RECORDER\n");
+	while((fgets(buf, sizeof(buf), fd)))
+	{
+		stripcrlf(buf);
+		fprintf(reportfd, " %s\n", buf);
+	}
+	n = pclose(fd);
+
+	fprintf(reportfd, "END OF FLIGHT RECORDER\n");
+
+	if (WEXITSTATUS(n) == 127)
+		return 0;
+
+	return 1;
+#else
+	return 0;
+#endif
+}
+
 int crash_report_asan_log(FILE *reportfd, char *coredump)
 {
 #ifndef _WIN32
@@ -530,6 +589,7 @@ char *generate_crash_report(char *coredump, int *thirdpartymods)
 	crash_report_fix_libs(coredump, thirdpartymods);
 	
 	crash_report_backtrace(reportfd, coredump);
+	crash_report_flight_recorder(reportfd, coredump);
 	crash_report_asan_log(reportfd, coredump);
 	attach_coredump(reportfd, coredump);
 
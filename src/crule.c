@@ -91,6 +91,43 @@ int crule_directop(int, void **);
 int crule__andor(int, void **);
 int crule__not(int, void **);
 
+#if !defined(CR_DEBUG) && !defined(CR_CHKCONF)
+/* Compiled rule program.
+ *
+ * The recursive descent parser above still builds an expression tree,
+ * but that tree is only an intermediate form: crule_parse() flattens it
+ * into the instruction array below and frees it again. Evaluation then
+ * walks a flat array with an accumulator instead of chasing function
+ * pointers through heap nodes - the autoconnect timer evaluates every
+ * deny link { } rule each CONNECTFREQUENCY tick, so this is a hot(ish)
+ * path on hub servers with many links.
+ *
+ * The instruction set is accumulator based; and/or compile into
+ * conditional jumps so short-circuit behavior is kept:
+ *   a && b  ->  <a> JFALSE end <b>
+ *   a || b  ->  <a> JTRUE end <b>
+ */
+enum crule_opcode {
+	CROP_CALL,		/* acc = rule function (funcnum) result */
+	CROP_NOT,		/* acc = !acc */
+	CROP_JTRUE,		/* if (acc) jump */
+	CROP_JFALSE		/* if (!acc) jump */
+};
+
+typedef struct CruleInsn {
+	int opcode;		/* CROP_* */
+	int funcnum;		/* CROP_CALL: index into crule_funclist[] */
+	int numargs;		/* CROP_CALL: number of arguments */
+	char *arg[CR_MAXARGS];	/* CROP_CALL: the argument strings (owned) */
+	int jump;		/* CROP_JTRUE/CROP_JFALSE: target instruction */
+} CruleInsn;
+
+typedef struct CruleProgram {
+	int ninsns;		/* Number of instructions */
+	CruleInsn insn[];	/* The instructions */
+} CruleProgram;
+#endif
+
 /* parsing function prototypes - local! */
 int crule_gettoken(int *, char **);
 void crule_getword(char *, int *, int, char **);
@@ -99,6 +136,7 @@ int crule_parseorexpr(crule_treeptr *, int *, char **);
 int crule_parseprimary(crule_treeptr *, int *, char **);
 int crule_parsefunction(crule_treeptr *, int *, char **);
 int crule_parsearglist(crule_treeptr, int *, char **);
+void crule_free_tree(char **);
 
 #if defined(CR_DEBUG) || defined(CR_CHKCONF)
 /* prototypes for the test parser; if not debugging, these are
@@ -239,11 +277,165 @@ int  crule__not(int numargs, void *crulearg[])
 }
 
 #if !defined(CR_DEBUG) && !defined(CR_CHKCONF)
+/** Count the tree nodes of 'elem', which is also the number of
+ * instructions its compiled form needs (one per node).
+ */
+static int crule_count_nodes(crule_treeptr elem)
+{
+	if (elem->funcptr == crule__not)
+		return 1 + crule_count_nodes((crule_treeptr)elem->arg[0]);
+	if (elem->funcptr == crule__andor)
+		return 1 + crule_count_nodes((crule_treeptr)elem->arg[0]) +
+		           crule_count_nodes((crule_treeptr)elem->arg[1]);
+	return 1;
+}
+
+/** Emit the instructions for tree node 'elem' into 'prog'.
+ * @param prog	The program being built
+ * @param pc	Next free instruction slot, updated as we emit
+ */
+static void crule_emit(CruleProgram *prog, int *pc, crule_treeptr elem)
+{
+	CruleInsn *in;
+	int jumpinsn, funcnum, arg;
+
+	if (elem->funcptr == crule__not)
+	{
+		crule_emit(prog, pc, (crule_treeptr)elem->arg[0]);
+		prog->insn[(*pc)++].opcode = CROP_NOT;
+		return;
+	}
+	if (elem->funcptr == crule__andor)
+	{
+		crule_emit(prog, pc, (crule_treeptr)elem->arg[0]);
+		jumpinsn = (*pc)++;
+		prog->insn[jumpinsn].opcode = elem->arg[2] ? CROP_JTRUE : CROP_JFALSE;
+		crule_emit(prog, pc, (crule_treeptr)elem->arg[1]);
+		prog->insn[jumpinsn].jump = *pc;
+		return;
+	}
+
+	/* A rule function: map the function pointer back to its index in
+	 * crule_funclist[] (as print_tree does) and copy the arguments.
+	 */
+	for (funcnum = 0; crule_funclist[funcnum].funcptr; funcnum++)
+		if (elem->funcptr == crule_funclist[funcnum].funcptr)
+			break;
+	in = &prog->insn[(*pc)++];
+	in->opcode = CROP_CALL;
+	in->funcnum = funcnum;
+	in->numargs = elem->numargs;
+	for (arg = 0; arg < elem->numargs; arg++)
+		safe_strdup(in->arg[arg], (char *)elem->arg[arg]);
+}
+
+/** Compile the expression tree 'ruleroot' into a flat program */
+static CruleProgram *crule_compile(crule_treeptr ruleroot)
+{
+	CruleProgram *prog;
+	int ninsns = crule_count_nodes(ruleroot);
+	int pc = 0;
+
+	prog = safe_alloc(sizeof(CruleProgram) + ninsns * sizeof(CruleInsn));
+	crule_emit(prog, &pc, ruleroot);
+	prog->ninsns = pc;
+	return prog;
+}
+
+/* Memoization of rule function results.
+ *
+ * Within one evaluation round the network state the rule functions
+ * inspect (which servers are linked, whether an oper is on) cannot
+ * change, while the same subexpression - connected(*.example.net) and
+ * the like - tends to recur across the deny link { } rules checked for
+ * the different servers in that round. So each distinct call is
+ * evaluated once per round and reused from a small table. A round is
+ * opened explicitly with crule_eval_begin_round() by the callers that
+ * evaluate a batch of rules (autoconnect, /CONNECT, incoming server).
+ */
+#define CRULE_MEMO_SIZE 32
+
+static struct crule_memoent {
+	int serial;		/* Round this entry belongs to */
+	int funcnum;		/* Rule function */
+	char *arg[CR_MAXARGS];	/* Its arguments (pointers into the program) */
+	int result;		/* The memoized verdict */
+} crule_memo[CRULE_MEMO_SIZE];
+
+static int crule_round_serial = 1;
+static int crule_memo_next = 0;
+
+/** Open a new evaluation round: results memoized earlier are no longer
+ * trusted, since servers may have (dis)connected in the meantime.
+ */
+void crule_eval_begin_round(void)
+{
+	crule_round_serial++;
+}
+
+/** Call rule function instruction 'in', through the memo table */
+static int crule_call(CruleInsn *in)
+{
+	struct crule_memoent *m;
+	int i, arg, result;
+
+	for (i = 0; i < CRULE_MEMO_SIZE; i++)
+	{
+		m = &crule_memo[i];
+		if ((m->serial != crule_round_serial) || (m->funcnum != in->funcnum))
+			continue;
+		for (arg = 0; arg < in->numargs; arg++)
+			if (strcmp(m->arg[arg], in->arg[arg]))
+				break;
+		if (arg == in->numargs)
+			return m->result;
+	}
+
+	result = crule_funclist[in->funcnum].funcptr(in->numargs, (void **)in->arg);
+
+	/* Remember it, overwriting round-robin (entries from older rounds
+	 * are dead weight anyway).
+	 */
+	m = &crule_memo[crule_memo_next];
+	crule_memo_next = (crule_memo_next + 1) % CRULE_MEMO_SIZE;
+	m->serial = crule_round_serial;
+	m->funcnum = in->funcnum;
+	for (arg = 0; arg < in->numargs; arg++)
+		m->arg[arg] = in->arg[arg];
+	m->result = result;
+	return result;
+}
+
 int  crule_eval(rule)
 	char *rule;
 {
-	return (((crule_treeptr) rule)->funcptr
-	    (((crule_treeptr) rule)->numargs, ((crule_treeptr) rule)->arg));
+	CruleProgram *prog = (CruleProgram *)rule;
+	int acc = 0;
+	int pc;
+
+	for (pc = 0; pc < prog->ninsns; pc++)
+	{
+		CruleInsn *in = &prog->insn[pc];
+
+		switch (in->opcode)
+		{
+			case CROP_CALL:
+				acc = crule_call(in);
+				break;
+			case CROP_NOT:
+				acc = !acc;
+				break;
+			case CROP_JTRUE:
+				if (acc)
+					pc = in->jump - 1; /* -1: the for loop increments */
+				break;
+			case CROP_JFALSE:
+				if (!acc)
+					pc = in->jump - 1;
+				break;
+		}
+	}
+	return acc;
 }
 #endif
 
@@ -362,7 +554,18 @@ char *crule_parse(char *rule)
 		    &ruleptr)) == CR_NOERR) {
 			if (ruleroot != NULL) {
 				if (next_tok == CR_END)
+				{
+#if !defined(CR_DEBUG) && !defined(CR_CHKCONF)
+					/* Flatten the tree into the compiled
+					 * form used by crule_eval() and free it.
+					 */
+					CruleProgram *prog = crule_compile(ruleroot);
+					crule_free_tree((char **)&ruleroot);
+					return ((char *)prog);
+#else
 					return ((char *)ruleroot);
+#endif
+				}
 				else
 					errcode = CR_UNEXPCTTOK;
 			}
@@ -371,7 +574,7 @@ char *crule_parse(char *rule)
 		}
 	}
 	if (ruleroot != NULL)
-		crule_free((char **)&ruleroot);
+		crule_free_tree((char **)&ruleroot);
 #if !defined(CR_DEBUG) && !defined(CR_CHKCONF)
 	Debug((DEBUG_ERROR, "%s in rule: %s", crule_errstr[errcode], rule));
 #else
@@ -657,7 +860,7 @@ int  crule_parsearglist(crule_treeptr argrootp, int *next_tokp, char **ruleptr)
  * DO NOT CALL THIS FUNTION WITH A POINTER TO A NULL POINTER
  * (ie: if *elem is NULL, you're doing it wrong - seg fault)
  */
-void crule_free(char **elem)
+void crule_free_tree(char **elem)
 {
 	int  arg, numargs;
 
@@ -665,14 +868,14 @@ void crule_free(char **elem)
 	{
 		/* type conversions and ()'s are fun! ;)  here have an asprin.. */
 		if ((*((crule_treeptr *) elem))->arg[0] != NULL)
-			crule_free((char **)&((*((crule_treeptr *)
+			crule_free_tree((char **)&((*((crule_treeptr *)
 			    elem))->arg[0]));
 	}
 	else if ((*((crule_treeptr *) elem))->funcptr == crule__andor)
 	{
-		crule_free((char **)&((*((crule_treeptr *) elem))->arg[0]));
+		crule_free_tree((char **)&((*((crule_treeptr *) elem))->arg[0]));
 		if ((*((crule_treeptr *) elem))->arg[1] != NULL)
-			crule_free((char **)&((*((crule_treeptr *)
+			crule_free_tree((char **)&((*((crule_treeptr *)
 			    elem))->arg[1]));
 	}
 	else
@@ -688,6 +891,30 @@ void crule_free(char **elem)
 	*elem = NULL;
 }
 
+/** Free a rule as returned by crule_parse() */
+void crule_free(char **elem)
+{
+#if !defined(CR_DEBUG) && !defined(CR_CHKCONF)
+	CruleProgram *prog = (CruleProgram *)*elem;
+	int pc, arg;
+
+	for (pc = 0; pc < prog->ninsns; pc++)
+		if (prog->insn[pc].opcode == CROP_CALL)
+			for (arg = 0; arg < prog->insn[pc].numargs; arg++)
+				safe_free(prog->insn[pc].arg[arg]);
+	safe_free(*elem);
+	*elem = NULL;
+
+	/* Memo entries may point into the freed program: make sure they
+	 * can never match (or be dereferenced) again.
+	 */
+	crule_round_serial++;
+#else
+	/* In the debug/chkconf builds crule_parse() returns the tree */
+	crule_free_tree(elem);
+#endif
+}
+
 char *crule_errstring(int errcode)
 {
 	return crule_errstr[errcode-1];
@@ -706,7 +933,7 @@ int crule_test(char *rule)
 			if (ruleroot != NULL) {
 				if (next_tok == CR_END)
 				{
-					crule_free((char **)&ruleroot);
+					crule_free_tree((char **)&ruleroot);
 					return 0;
 				}
 				else
@@ -717,7 +944,7 @@ int crule_test(char *rule)
 		}
 	}
 	if (ruleroot != NULL)
-		crule_free((char **)&ruleroot);
+		crule_free_tree((char **)&ruleroot);
 	return errcode+1;
 }
 
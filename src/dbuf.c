@@ -20,24 +20,30 @@
 #include "unrealircd.h"
 
 static mp_pool_t *dbuf_bufpool = NULL;
+static mp_pool_t *dbuf_large_bufpool = NULL;
 
 void dbuf_init(void)
 {
-	dbuf_bufpool = mp_pool_new(sizeof(struct dbufbuf), 512 * 1024);
+	dbuf_bufpool = mp_pool_new(sizeof(struct dbufbuf), 512 * 1024, "dbuf");
+	/* The large blocks extend beyond data[DBUF_BLOCK_SIZE], hence
+	 * the adjusted item size.
+	 */
+	dbuf_large_bufpool = mp_pool_new(sizeof(struct dbufbuf) - DBUF_BLOCK_SIZE + DBUF_LARGE_BLOCK_SIZE, 1024 * 1024, "dbuf-large");
 }
 
 /*
 ** dbuf_alloc - allocates a dbufbuf structure either from freelist or
 ** creates a new one.
 */
-static dbufbuf *dbuf_alloc(dbuf *dbuf_p)
+static dbufbuf *dbuf_alloc_large(dbuf *dbuf_p, int large)
 {
 	dbufbuf *ptr;
 
 	assert(dbuf_p != NULL);
 
-	ptr = mp_pool_get(dbuf_bufpool);
+	ptr = mp_pool_get(large ? dbuf_large_bufpool : dbuf_bufpool);
 	memset(ptr, 0, sizeof(dbufbuf));
+	ptr->capacity = large ? DBUF_LARGE_BLOCK_SIZE : DBUF_BLOCK_SIZE;
 
 	INIT_LIST_HEAD(&ptr->dbuf_node);
 	list_add_tail(&ptr->dbuf_node, &dbuf_p->dbuf_list);
@@ -45,6 +51,11 @@ static dbufbuf *dbuf_alloc(dbuf *dbuf_p)
 	return ptr;
 }
 
+static dbufbuf *dbuf_alloc(dbuf *dbuf_p)
+{
+	return dbuf_alloc_large(dbuf_p, dbuf_p->large);
+}
+
 /*
 ** dbuf_free - return a dbufbuf structure to the freelist
 */
@@ -52,15 +63,54 @@ static void dbuf_free(dbufbuf *ptr)
 {
 	assert(ptr != NULL);
 
+	if (ptr->shared)
+		dbuf_shared_release(ptr->shared);
 	list_del(&ptr->dbuf_node);
 	mp_pool_release(ptr);
 }
 
+/** Create a refcounted shared message buffer holding a copy of 'buf'.
+ * The returned buffer starts with a reference count of 1, which is
+ * owned by the caller: release it with dbuf_shared_release() when done
+ * handing it out (each dbuf_put_shared() takes its own reference).
+ */
+dbufshared *dbuf_shared_create(char *buf, size_t length)
+{
+	dbufshared *ptr;
+
+	assert(length > 0);
+
+	ptr = safe_alloc(sizeof(dbufshared) + length);
+	ptr->ref = 1;
+	ptr->size = length;
+	memcpy(ptr->data, buf, length);
+
+	return ptr;
+}
+
+/** Drop a reference to a shared buffer, freeing it on the last one. */
+void dbuf_shared_release(dbufshared *ptr)
+{
+	assert(ptr->ref > 0);
+
+	if (--ptr->ref == 0)
+		safe_free(ptr);
+}
+
 void dbuf_queue_init(dbuf *dyn)
 {
 	INIT_LIST_HEAD(&dyn->dbuf_list);
 }
 
+/** Switch a queue to large (or normal) block allocation.
+ * Only affects blocks allocated from now on, existing blocks in the
+ * queue keep their size and are drained as usual.
+ */
+void dbuf_queue_set_large(dbuf *dyn, int large)
+{
+	dyn->large = large ? 1 : 0;
+}
+
 void dbuf_put(dbuf *dyn, char *buf, size_t length)
 {
 	struct dbufbuf *block;
@@ -74,11 +124,12 @@ void dbuf_put(dbuf *dyn, char *buf, size_t length)
 	{
 		block = container_of(dyn->dbuf_list.prev, struct dbufbuf, dbuf_node);
 
-		amount = DBUF_BLOCK_SIZE - block->size;
+		/* Shared blocks are immutable, we can never append to them */
+		amount = block->shared ? 0 : block->capacity - block->size;
 		if (!amount)
 		{
 			block = dbuf_alloc(dyn);
-			amount = DBUF_BLOCK_SIZE;
+			amount = block->capacity;
 		}
 		if (amount > length)
 			amount = length;
@@ -92,6 +143,26 @@ void dbuf_put(dbuf *dyn, char *buf, size_t length)
 	}
 }
 
+/** Append a shared message buffer to 'dyn' by reference.
+ * No bytes are copied: a block is linked in that points at the
+ * shared data and the reference count is bumped. The bytes are
+ * released when the block is consumed (or the queue is cleared).
+ */
+void dbuf_put_shared(dbuf *dyn, dbufshared *shared)
+{
+	dbufbuf *block;
+
+	/* Carrier blocks never use data[], so always take them from
+	 * the small pool, even on large-block queues.
+	 */
+	block = dbuf_alloc_large(dyn, 0);
+	block->shared = shared;
+	block->offset = 0;
+	block->size = shared->size;
+	shared->ref++;
+	dyn->length += shared->size;
+}
+
 void dbuf_delete(dbuf *dyn, size_t length)
 {
 	struct dbufbuf *block;
@@ -116,7 +187,10 @@ void dbuf_delete(dbuf *dyn, size_t length)
 
 	block->size -= length;
 	dyn->length -= length;
-	memmove(block->data, &block->data[length], block->size);
+	if (block->shared)
+		block->offset += length; /* shared data is immutable, just advance */
+	else
+		memmove(block->data, &block->data[length], block->size);
 }
 
 /*
@@ -152,7 +226,7 @@ int  dbuf_getmsg(dbuf *dyn, char *buf)
 	{
 		for (idx = 0; idx < block->size; idx++)
 		{
-			c = block->data[idx];
+			c = DBufBlockData(block)[idx];
 			if (c == '\r' || c == '\n' || (c == ' ' && phase != 1))
 			{
 				empty_bytes++;
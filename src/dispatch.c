@@ -42,6 +42,27 @@
 /***************************************************************************************
  * Backend-independent functions.  fd_setselect() and friends                          *
  ***************************************************************************************/
+
+/** Time (in usec) spent sleeping in the kernel during fd_select() since
+ * the main loop last reset this. The stall watchdog in SocketLoop()
+ * subtracts it from the loop iteration duration: deliberately sleeping
+ * while waiting for I/O is not a stall. Maintained by every backend
+ * via fd_wait_start()/fd_wait_finish() around the kernel wait call.
+ */
+MODVAR long long fd_select_sleep_usec = 0;
+
+static long long fd_wait_started_usec;
+
+static void fd_wait_start(void)
+{
+	fd_wait_started_usec = mono_time_usec();
+}
+
+static void fd_wait_finish(void)
+{
+	fd_select_sleep_usec += mono_time_usec() - fd_wait_started_usec;
+}
+
 void fd_setselect(int fd, int flags, IOCallbackFunc iocb, void *data)
 {
 	FDEntry *fde;
@@ -61,7 +82,7 @@ void fd_setselect(int fd, int flags, IOCallbackFunc iocb, void *data)
 		return;
 	}
 
-	fde = &fd_table[fd];
+	fde = fd_entry(fd);
 	fde->data = data;
 
 	if (flags & FD_SELECT_READ)
@@ -101,7 +122,7 @@ static fd_set read_fds, write_fds;
 
 void fd_refresh(int fd)
 {
-	FDEntry *fde = &fd_table[fd];
+	FDEntry *fde = fd_entry(fd);
 	unsigned int flags = 0;
 
 	if (fde->read_callback)
@@ -172,11 +193,13 @@ void fd_select(time_t delay)
 	ircd_log(LOG_ERROR, "fd_select() on 0-%d...", highest_fd+1);
 #endif
 
+	fd_wait_start();
 #ifdef _WIN32
 	num = select(highest_fd + 1, &work_read_fds, &work_write_fds, &work_except_fds, &to);
 #else
 	num = select(highest_fd + 1, &work_read_fds, &work_write_fds, NULL, &to);
 #endif
+	fd_wait_finish();
 	if (num < 0)
 	{
 		extern void report_baderror(char *text, Client *client);
@@ -200,7 +223,7 @@ void fd_select(time_t delay)
 		IOCallbackFunc iocb;
 		int evflags = 0;
 
-		fde = &fd_table[fd];
+		fde = fd_entry(fd);
 		if (!fde->is_open)
 			continue;
 
@@ -253,6 +276,342 @@ void fd_fork()
 
 #endif
 
+/***************************************************************************************
+ * I/O completion port backend (Windows).                                              *
+ ***************************************************************************************/
+#ifdef BACKEND_IOCP
+
+/* Read readiness is detected with the classic zero-byte overlapped
+ * WSARecv() trick: a pending zero-byte read completes as soon as data
+ * (or EOF, or an error) arrives, without locking down any buffer space
+ * in the kernel, and the completion is our read event. The request
+ * objects handed to the kernel come from a small free pool and are only
+ * recycled once their completion has been reaped, so closing a socket
+ * with a read in flight is safe.
+ *
+ * Not everything maps onto completions though: zero-byte reads do not
+ * work on listening or still-connecting sockets, and a zero-byte send
+ * always completes immediately so it cannot signal writability. Those
+ * cases (listeners, outgoing connects and write-blocked sockets - a
+ * small set at any time) are handled by a classic select() over just
+ * those fd's, polled without sleeping on every fd_select() call. The
+ * completion port wait is capped at IOCP_FALLBACK_DELAY while any such
+ * fd exists so the fallback set is never left unattended for long.
+ */
+
+/** How long (in msec) the completion port wait may sleep while fd's are
+ * on the fallback select() set.
+ */
+#define IOCP_FALLBACK_DELAY 25
+
+/** Maximum completions processed per fd_select() call; the remainder is
+ * simply picked up by the next call.
+ */
+#define IOCP_MAX_EVENTS 1024
+
+/** A zero-byte read handed to the kernel. The OVERLAPPED must be first:
+ * the completion gives us back a pointer to it.
+ */
+typedef struct IOCPRequest IOCPRequest;
+struct IOCPRequest {
+	OVERLAPPED ov;
+	IOCPRequest *next; /**< Next request on the free pool */
+	int fd; /**< The fd this read was posted for */
+	unsigned char cancelled; /**< Interest was dropped while the read was in flight */
+};
+
+/** Per-fd state of this backend */
+typedef struct IOCPSocket {
+	IOCPRequest *read_req; /**< In-flight zero-byte read, or NULL */
+	unsigned char associated; /**< Socket has been attached to the completion port */
+	unsigned char fallback; /**< FD_SELECT_* bits handled by the fallback select() */
+} IOCPSocket;
+
+static HANDLE iocp_port = NULL;
+static IOCPSocket *iocp_sockets = NULL;
+static IOCPRequest *iocp_request_pool = NULL;
+static fd_set fallback_read_fds, fallback_write_fds;
+static int fallback_count = 0;
+
+static void iocp_init(void)
+{
+	if (iocp_port)
+		return;
+	iocp_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	iocp_sockets = safe_alloc(sizeof(IOCPSocket) * MAXCONNECTIONS);
+	FD_ZERO(&fallback_read_fds);
+	FD_ZERO(&fallback_write_fds);
+}
+
+static IOCPRequest *iocp_request_get(void)
+{
+	IOCPRequest *req = iocp_request_pool;
+
+	if (req)
+		iocp_request_pool = req->next;
+	else
+		req = safe_alloc(sizeof(IOCPRequest));
+	memset(req, 0, sizeof(IOCPRequest));
+	return req;
+}
+
+static void iocp_request_put(IOCPRequest *req)
+{
+	req->next = iocp_request_pool;
+	iocp_request_pool = req;
+}
+
+static void iocp_fallback_add(int fd, int evflag)
+{
+	IOCPSocket *ios = &iocp_sockets[fd];
+
+	if (ios->fallback & evflag)
+		return;
+	if (!ios->fallback)
+		fallback_count++;
+	ios->fallback |= evflag;
+	if (evflag == FD_SELECT_READ)
+		FD_SET((SOCKET)fd, &fallback_read_fds);
+	else
+		FD_SET((SOCKET)fd, &fallback_write_fds);
+}
+
+static void iocp_fallback_clear(int fd, int evflag)
+{
+	IOCPSocket *ios = &iocp_sockets[fd];
+
+	if (!(ios->fallback & evflag))
+		return;
+	ios->fallback &= ~evflag;
+	if (!ios->fallback)
+		fallback_count--;
+	if (evflag == FD_SELECT_READ)
+		FD_CLR((SOCKET)fd, &fallback_read_fds);
+	else
+		FD_CLR((SOCKET)fd, &fallback_write_fds);
+}
+
+/** Post (or re-post) the zero-byte read that signals read readiness */
+static void iocp_arm_read(int fd)
+{
+	IOCPSocket *ios = &iocp_sockets[fd];
+	IOCPRequest *req;
+	WSABUF wsabuf;
+	DWORD transferred = 0, recvflags = 0;
+	int err;
+
+	if (ios->read_req)
+		return; /* already armed */
+
+	if (!ios->associated)
+	{
+		if (!CreateIoCompletionPort((HANDLE)(SOCKET)fd, iocp_port, (ULONG_PTR)fd, 0))
+		{
+			/* Not associable (not a socket?), let select() handle it */
+			iocp_fallback_add(fd, FD_SELECT_READ);
+			return;
+		}
+		ios->associated = 1;
+	}
+
+	req = iocp_request_get();
+	req->fd = fd;
+
+	wsabuf.len = 0;
+	wsabuf.buf = NULL;
+	if (WSARecv((SOCKET)fd, &wsabuf, 1, &transferred, &recvflags, &req->ov, NULL) == SOCKET_ERROR)
+	{
+		err = WSAGetLastError();
+		if (err != WSA_IO_PENDING)
+		{
+			if ((err == WSAENOTCONN) || (err == WSAEINVAL) || (err == WSAEOPNOTSUPP))
+			{
+				/* Listening or still-connecting socket: zero-byte
+				 * reads do not work here, let select() handle it.
+				 */
+				iocp_request_put(req);
+				iocp_fallback_add(fd, FD_SELECT_READ);
+				return;
+			}
+			/* Dead socket (eg connection reset): deliver a read event
+			 * so the normal read path picks up the error.
+			 */
+			if (!PostQueuedCompletionStatus(iocp_port, 0, (ULONG_PTR)fd, &req->ov))
+			{
+				iocp_request_put(req);
+				iocp_fallback_add(fd, FD_SELECT_READ);
+				return;
+			}
+		}
+	}
+	iocp_fallback_clear(fd, FD_SELECT_READ);
+	ios->read_req = req;
+}
+
+static void iocp_disarm_read(int fd)
+{
+	IOCPSocket *ios = &iocp_sockets[fd];
+
+	if (ios->read_req)
+	{
+		/* The in-flight read completes when the socket is closed (or
+		 * may already be queued); the request is recycled when that
+		 * completion is reaped.
+		 */
+		ios->read_req->cancelled = 1;
+		ios->read_req = NULL;
+	}
+	iocp_fallback_clear(fd, FD_SELECT_READ);
+}
+
+void fd_refresh(int fd)
+{
+	FDEntry *fde = fd_entry(fd);
+	unsigned int flags = 0;
+
+	iocp_init();
+
+	if (fde->read_callback)
+	{
+		flags |= FD_SELECT_READ;
+		iocp_arm_read(fd);
+	}
+	else
+		iocp_disarm_read(fd);
+
+	/* Write readiness cannot be expressed as a completion without
+	 * taking over the send path, so write interest (only registered
+	 * while a send is blocked) always uses the fallback select().
+	 */
+	if (fde->write_callback)
+	{
+		flags |= FD_SELECT_WRITE;
+		iocp_fallback_add(fd, FD_SELECT_WRITE);
+	}
+	else
+		iocp_fallback_clear(fd, FD_SELECT_WRITE);
+
+	if (!fde->is_open)
+		iocp_sockets[fd].associated = 0; /* fd is being closed: the association dies with the socket */
+
+	fde->backend_flags = flags;
+}
+
+/** Poll the fallback fd's without sleeping.
+ * @returns The number of events dispatched.
+ */
+static int iocp_fallback_select(void)
+{
+	struct timeval to;
+	fd_set work_read_fds, work_write_fds, work_except_fds;
+	int num, i, dispatched = 0;
+
+	memcpy(&work_read_fds, &fallback_read_fds, sizeof(fd_set));
+	memcpy(&work_write_fds, &fallback_write_fds, sizeof(fd_set));
+	/* An exception may happen due to a failed connect(). Translate to a write event, like on *NIX. */
+	memcpy(&work_except_fds, &fallback_write_fds, sizeof(fd_set));
+
+	memset(&to, 0, sizeof(to));
+	num = select(0, &work_read_fds, &work_write_fds, &work_except_fds, &to);
+	if (num <= 0)
+		return 0;
+
+	for (i = 0; i < work_read_fds.fd_count; i++)
+	{
+		int fd = (int)work_read_fds.fd_array[i];
+		FDEntry *fde = fd_entry(fd);
+
+		if (fde->is_open && fde->read_callback)
+		{
+			fde->read_callback(fd, FD_SELECT_READ, fde->data);
+			dispatched++;
+		}
+	}
+	for (i = 0; i < work_except_fds.fd_count; i++)
+		FD_SET(work_except_fds.fd_array[i], &work_write_fds);
+	for (i = 0; i < work_write_fds.fd_count; i++)
+	{
+		int fd = (int)work_write_fds.fd_array[i];
+		FDEntry *fde = fd_entry(fd);
+
+		if (fde->is_open && fde->write_callback)
+		{
+			fde->write_callback(fd, FD_SELECT_WRITE, fde->data);
+			dispatched++;
+		}
+	}
+	return dispatched;
+}
+
+void fd_select(time_t delay)
+{
+	int budget = IOCP_MAX_EVENTS;
+	DWORD timeout;
+
+	iocp_init();
+
+	if (fallback_count)
+	{
+		if (iocp_fallback_select())
+			delay = 0; /* work was dispatched, don't sleep on top of it */
+		else if (delay > IOCP_FALLBACK_DELAY)
+			delay = IOCP_FALLBACK_DELAY; /* don't leave the fallback fd's unattended for long */
+	}
+
+	timeout = (DWORD)delay;
+	while (budget--)
+	{
+		DWORD transferred = 0;
+		ULONG_PTR key = 0;
+		OVERLAPPED *ov = NULL;
+		IOCPRequest *req;
+		IOCPSocket *ios;
+		FDEntry *fde;
+		int fd;
+
+		if (timeout)
+			fd_wait_start();
+		GetQueuedCompletionStatus(iocp_port, &transferred, &key, &ov, timeout);
+		if (timeout)
+			fd_wait_finish();
+		timeout = 0; /* only the first call may sleep, the rest just drains */
+
+		if (!ov)
+			break; /* timed out: nothing (more) queued */
+
+		req = (IOCPRequest *)ov;
+		if (req->cancelled)
+		{
+			/* Interest was dropped (or the fd closed) after this read
+			 * was posted, nobody is waiting for the result anymore.
+			 */
+			iocp_request_put(req);
+			continue;
+		}
+
+		fd = req->fd;
+		ios = &iocp_sockets[fd];
+		if (ios->read_req == req)
+			ios->read_req = NULL;
+		iocp_request_put(req);
+
+		fde = fd_entry(fd);
+		if (fde->is_open && fde->read_callback)
+		{
+			fde->read_callback(fd, FD_SELECT_READ, fde->data);
+			/* Completions are one-shot: re-arm if still interested */
+			if (fde->is_open && fde->read_callback)
+				iocp_arm_read(fd);
+		}
+	}
+}
+
+void fd_fork()
+{
+}
+
+#endif
+
 /***************************************************************************************
  * kqueue() backend.                                                                   *
  ***************************************************************************************/
@@ -289,7 +648,7 @@ void fd_fork()
 
 void fd_refresh(int fd)
 {
-	FDEntry *fde = &fd_table[fd];
+	FDEntry *fde = fd_entry(fd);
 
 	if (kqueue_fd == -1)
 	{
@@ -362,7 +721,9 @@ void fd_select(time_t delay)
 	ts.tv_sec = delay / 1000;
 	ts.tv_nsec = delay % 1000 * 1000000;
 
+	fd_wait_start();
 	num = kevent(kqueue_fd, NULL, 0, kqueue_events, MAXCONNECTIONS * 2, &ts);
+	fd_wait_finish();
 	if (num <= 0)
 		return;
 
@@ -404,12 +765,192 @@ void fd_select(time_t delay)
 #include <sys/epoll.h>
 
 static int epoll_fd = -1;
-static struct epoll_event epfds[MAXCONNECTIONS + 1];
+/* Maximum events fetched per epoll_wait() call. If more fd's are ready
+ * than this then the remainder is simply picked up by the next call,
+ * so there is no point in sizing this to MAXCONNECTIONS.
+ */
+#define EPOLL_MAX_EVENTS	1024
+static struct epoll_event epfds[EPOLL_MAX_EVENTS];
+
+#ifdef USE_EPOLLET
+/* Edge-triggered variant (opt-in via USE_EPOLLET in include/config.h).
+ *
+ * Every fd is registered exactly once with EPOLLIN|EPOLLOUT|EPOLLET,
+ * so toggling read/write interest (which the send and TLS paths do
+ * constantly) no longer costs an epoll_ctl() syscall: interest lives
+ * purely in fd_table, and readiness reported by edges is remembered
+ * per fd in userspace. An fd whose remembered readiness overlaps its
+ * current interest sits on a pending list that is dispatched every
+ * fd_select() pass (with a zero wait while non-empty), so sockets
+ * are effectively drained until EAGAIN across loop iterations.
+ *
+ * Ready bits are only consumed when actually dispatched to a
+ * callback; an edge that arrives while the matching interest is off
+ * (e.g. during the TLS want-read/want-write dance) is kept until the
+ * interest returns, since the kernel will not repeat it.
+ */
+
+static unsigned char et_registered[MAXCONNECTIONS + 1];	/**< fd is known to the epoll set */
+static unsigned char et_ready[MAXCONNECTIONS + 1];	/**< remembered readiness (FD_SELECT_*) per fd */
+static unsigned char et_queued[MAXCONNECTIONS + 1];	/**< fd is on the pending list */
+static int et_pending[MAXCONNECTIONS + 1];		/**< fds with (ready & interest) != 0 */
+static int et_npending = 0;
+
+static void et_enqueue(int fd)
+{
+	if (!et_queued[fd])
+	{
+		et_queued[fd] = 1;
+		et_pending[et_npending++] = fd;
+	}
+}
+
+void fd_refresh(int fd)
+{
+	struct epoll_event ep_event;
+	FDEntry *fde = fd_entry(fd);
+	unsigned int pflags = 0;
+
+	if (epoll_fd == -1)
+		epoll_fd = epoll_create(MAXCONNECTIONS);
+
+	if (fde->read_callback)
+		pflags |= FD_SELECT_READ;
+
+	if (fde->write_callback)
+		pflags |= FD_SELECT_WRITE;
+
+	fde->backend_flags = pflags;
+
+	if (pflags == 0)
+	{
+		/* No interest left: drop the registration (this is the
+		 * only epoll_ctl besides the initial add) and forget any
+		 * remembered readiness, the fd is about to be closed or
+		 * handed elsewhere.
+		 */
+		if (et_registered[fd])
+		{
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &ep_event);
+			et_registered[fd] = 0;
+		}
+		et_ready[fd] = 0;
+		return;
+	}
+
+	if (!et_registered[fd])
+	{
+		memset(&ep_event, 0, sizeof(ep_event));
+		ep_event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ep_event.data.ptr = fde;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ep_event) != 0)
+		{
+			ircd_log(LOG_ERROR, "[BUG] fd_refresh(): epoll_ctl returned error %d (%s) for fd %d (%s)",
+				errno, STRERROR(ERRNO), fd, fde->desc);
+			return;
+		}
+		et_registered[fd] = 1;
+		/* The add reported current readiness as an initial edge,
+		 * nothing remembered yet beyond that.
+		 */
+	}
+
+	if (et_ready[fd] & pflags)
+		et_enqueue(fd);
+}
+
+void fd_select(time_t delay)
+{
+	int num, p, revents, fd, n, i, j;
+	struct epoll_event *epfd;
+
+	if (epoll_fd == -1)
+		epoll_fd = epoll_create(MAXCONNECTIONS);
+
+	/* Do not sleep while sockets still have undrained readiness */
+	fd_wait_start();
+	num = epoll_wait(epoll_fd, epfds, EPOLL_MAX_EVENTS, et_npending ? 0 : delay);
+	fd_wait_finish();
+
+	for (p = 0; p < num; p++)
+	{
+		FDEntry *fde;
+		unsigned int bits = 0;
+
+		epfd = &epfds[p];
+
+		revents = epfd->events;
+		if (revents == 0)
+			continue;
+
+		fde = epfd->data.ptr;
+		fd = fde->fd;
+
+		if (revents & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+			bits |= FD_SELECT_READ;
+
+		if (revents & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+			bits |= FD_SELECT_WRITE;
+
+		et_ready[fd] |= bits;
+		if (et_ready[fd] & fde->backend_flags)
+			et_enqueue(fd);
+	}
+
+	/* Dispatch the pending list as it was at the start of this pass;
+	 * callbacks may enqueue more (or re-enqueue themselves via
+	 * fd_refresh), those run next pass - with a zero timeout above.
+	 */
+	n = et_npending;
+	for (i = 0; i < n; i++)
+	{
+		FDEntry *fde;
+		IOCallbackFunc iocb;
+		int evflags;
+
+		fd = et_pending[i];
+		et_queued[fd] = 0;
+		fde = fd_entry(fd);
+		if (!fde->is_open)
+		{
+			et_ready[fd] = 0;
+			continue;
+		}
+
+		evflags = et_ready[fd] & fde->backend_flags;
+		if (!evflags)
+			continue;
+		et_ready[fd] &= ~evflags;
+
+		if (evflags & FD_SELECT_READ)
+		{
+			iocb = fde->read_callback;
+
+			if (iocb != NULL)
+				iocb(fd, evflags, fde->data);
+		}
+
+		if (evflags & FD_SELECT_WRITE)
+		{
+			iocb = fde->write_callback;
+
+			if (iocb != NULL)
+				iocb(fd, evflags, fde->data);
+		}
+	}
+
+	/* Compact out the entries we just dispatched */
+	for (i = n, j = 0; i < et_npending; i++)
+		et_pending[j++] = et_pending[i];
+	et_npending = j;
+}
+
+#else /* !USE_EPOLLET: the level-triggered implementation */
 
 void fd_refresh(int fd)
 {
 	struct epoll_event ep_event;
-	FDEntry *fde = &fd_table[fd];
+	FDEntry *fde = fd_entry(fd);
 	unsigned int pflags = 0;
 	int op = -1;
 
@@ -463,7 +1004,9 @@ void fd_select(time_t delay)
 	if (epoll_fd == -1)
 		epoll_fd = epoll_create(MAXCONNECTIONS);
 
-	num = epoll_wait(epoll_fd, epfds, MAXCONNECTIONS, delay);
+	fd_wait_start();
+	num = epoll_wait(epoll_fd, epfds, EPOLL_MAX_EVENTS, delay);
+	fd_wait_finish();
 	if (num <= 0)
 		return;
 
@@ -537,12 +1080,330 @@ void fd_select(time_t delay)
 }
 
 
+#endif /* USE_EPOLLET */
+
 void fd_fork()
 {
 }
 
 #endif
 
+/***************************************************************************************
+ * io_uring backend.                                                                   *
+ ***************************************************************************************/
+#ifdef BACKEND_IOURING
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <stdint.h>
+
+/* io_uring based I/O engine (Linux 5.11+, opt-in via USE_IOURING in
+ * include/config.h).
+ *
+ * This is a readiness-style engine behind the same fd_refresh() /
+ * fd_select() API as the other backends: interest changes become
+ * IORING_OP_POLL_ADD / IORING_OP_POLL_REMOVE entries that accumulate
+ * in the shared submission ring without any syscall, and everything
+ * (submissions plus the wait for completions) is done with a single
+ * io_uring_enter() per main loop iteration. Under load that replaces
+ * the epoll_ctl storm plus epoll_wait with one syscall per loop.
+ *
+ * One-shot polls are used rather than multishot: re-arming evaluates
+ * readiness at (batched) submission time, which preserves the
+ * level-triggered semantics that read_packet()/send_queued() rely on.
+ * A multishot poll only fires on wakeups and would stall a socket
+ * whose data is not fully drained in one callback.
+ *
+ * Unlike epoll, a pending poll is not removed by close(), and stale
+ * completions for a recycled fd could arrive after re-arming it.
+ * Therefore every armed poll carries a per-fd generation number in
+ * its user_data, completions with an old generation are discarded,
+ * and the engine tracks its armed state per fd on the side (the
+ * backend_flags field in fd_table is wiped by fd_unmap() before we
+ * get a chance to cancel).
+ */
+
+#define URING_ENTRIES		4096
+#define URING_UDATA_NONE	(~0ULL)
+
+static int ring_fd = -1;
+static unsigned int ring_to_submit = 0;
+
+static struct {
+	unsigned int *head, *tail, *ring_mask, *array;
+	struct io_uring_sqe *sqes;
+	unsigned int sqe_tail;
+	unsigned int entries;
+} sq;
+
+static struct {
+	unsigned int *head, *tail, *ring_mask;
+	struct io_uring_cqe *cqes;
+} cq;
+
+/** What this engine believes is currently armed in the kernel for
+ * each fd, and the generation of the latest armed poll.
+ */
+static struct {
+	unsigned int mask;
+	unsigned int gen;
+} ring_state[MAXCONNECTIONS + 1];
+
+static long io_uring_setup_(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static long io_uring_enter_(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags, void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int uring_init(void)
+{
+	struct io_uring_params p;
+	char *ptr;
+	size_t sq_sz, cq_sz;
+
+	memset(&p, 0, sizeof(p));
+	ring_fd = io_uring_setup_(URING_ENTRIES, &p);
+	if (ring_fd < 0)
+	{
+		ircd_log(LOG_ERROR, "[io_uring] io_uring_setup() failed: %s", STRERROR(ERRNO));
+		return -1;
+	}
+	/* EXT_ARG carries the fd_select() timeout, NODROP means the
+	 * kernel buffers completions instead of dropping them when the
+	 * CQ ring is full. Both are there since Linux 5.11.
+	 */
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_EXT_ARG) ||
+	    !(p.features & IORING_FEAT_NODROP))
+	{
+		ircd_log(LOG_ERROR, "[io_uring] kernel too old for this engine (need Linux 5.11 or newer)");
+		close(ring_fd);
+		ring_fd = -1;
+		return -1;
+	}
+	sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_sz > sq_sz)
+		sq_sz = cq_sz;
+	ptr = mmap(NULL, sq_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+	{
+		ircd_log(LOG_ERROR, "[io_uring] mmap of the rings failed: %s", STRERROR(ERRNO));
+		close(ring_fd);
+		ring_fd = -1;
+		return -1;
+	}
+	sq.head = (unsigned int *)(ptr + p.sq_off.head);
+	sq.tail = (unsigned int *)(ptr + p.sq_off.tail);
+	sq.ring_mask = (unsigned int *)(ptr + p.sq_off.ring_mask);
+	sq.array = (unsigned int *)(ptr + p.sq_off.array);
+	sq.entries = p.sq_entries;
+	cq.head = (unsigned int *)(ptr + p.cq_off.head);
+	cq.tail = (unsigned int *)(ptr + p.cq_off.tail);
+	cq.ring_mask = (unsigned int *)(ptr + p.cq_off.ring_mask);
+	cq.cqes = (struct io_uring_cqe *)(ptr + p.cq_off.cqes);
+	sq.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (sq.sqes == MAP_FAILED)
+	{
+		ircd_log(LOG_ERROR, "[io_uring] mmap of the sqe array failed: %s", STRERROR(ERRNO));
+		close(ring_fd);
+		ring_fd = -1;
+		return -1;
+	}
+	sq.sqe_tail = *sq.tail;
+	return 0;
+}
+
+/** Get a free submission entry, flushing the ring to the kernel if it
+ * is full (only happens when more than URING_ENTRIES interest changes
+ * pile up within one main loop iteration).
+ */
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	if (ring_to_submit == sq.entries)
+	{
+		if (io_uring_enter_(ring_fd, ring_to_submit, 0, 0, NULL, 0) < 0)
+			ircd_log(LOG_ERROR, "[io_uring] sqe flush failed: %s", STRERROR(ERRNO));
+		ring_to_submit = 0;
+	}
+	idx = sq.sqe_tail & *sq.ring_mask;
+	sq.array[idx] = idx;
+	sq.sqe_tail++;
+	__atomic_store_n(sq.tail, sq.sqe_tail, __ATOMIC_RELEASE);
+	ring_to_submit++;
+	sqe = &sq.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+/** user_data layout: fd in the low 32 bits, generation in the high. */
+static inline unsigned long long uring_udata(int fd)
+{
+	return ((unsigned long long)ring_state[fd].gen << 32) | (unsigned int)fd;
+}
+
+void fd_refresh(int fd)
+{
+	FDEntry *fde = fd_entry(fd);
+	unsigned int pflags = 0;
+	struct io_uring_sqe *sqe;
+
+	if (ring_fd == -1 && uring_init() < 0)
+		return;
+
+	if (fde->read_callback)
+		pflags |= POLLIN;
+
+	if (fde->write_callback)
+		pflags |= POLLOUT;
+
+	if (pflags == ring_state[fd].mask)
+	{
+		fde->backend_flags = pflags;
+		return;
+	}
+
+	if (ring_state[fd].mask)
+	{
+		/* Take down the currently armed poll first */
+		sqe = uring_get_sqe();
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = uring_udata(fd);
+		sqe->user_data = URING_UDATA_NONE;
+	}
+
+	if (pflags)
+	{
+		ring_state[fd].gen++;
+		sqe = uring_get_sqe();
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+		sqe->poll32_events = pflags;
+		sqe->user_data = uring_udata(fd);
+	}
+
+	ring_state[fd].mask = pflags;
+	fde->backend_flags = pflags;
+}
+
+void fd_select(time_t delay)
+{
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	unsigned int head, tail;
+	int fd, revents;
+	long r;
+
+	if (ring_fd == -1 && uring_init() < 0)
+		return;
+
+	ts.tv_sec = delay / 1000;
+	ts.tv_nsec = (delay % 1000) * 1000000L;
+	memset(&arg, 0, sizeof(arg));
+	arg.sigmask_sz = _NSIG / 8;
+	arg.ts = (unsigned long long)(uintptr_t)&ts;
+
+	/* One syscall: submit all queued (un)arms and wait for events */
+	fd_wait_start();
+	r = io_uring_enter_(ring_fd, ring_to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	fd_wait_finish();
+	if ((r < 0) && (ERRNO != P_EINTR) && (errno != ETIME))
+	{
+		ircd_log(LOG_ERROR, "[io_uring] io_uring_enter() returned error %d (%s)", errno, STRERROR(ERRNO));
+		return;
+	}
+	ring_to_submit = 0;
+
+	head = *cq.head;
+	tail = __atomic_load_n(cq.tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++)
+	{
+		struct io_uring_cqe *cqe = &cq.cqes[head & *cq.ring_mask];
+		FDEntry *fde;
+		IOCallbackFunc iocb;
+		int evflags = 0;
+
+		fd = (int)(cqe->user_data & 0xffffffffULL);
+		if ((fd < 0) || (fd >= MAXCONNECTIONS))
+			continue; /* poll-remove bookkeeping */
+
+		if ((unsigned int)(cqe->user_data >> 32) != ring_state[fd].gen)
+			continue; /* completion of an old, superseded poll */
+
+		/* The one-shot poll has now fired (or got canceled by the
+		 * kernel): nothing is armed for this fd anymore.
+		 */
+		ring_state[fd].mask = 0;
+
+		fde = fd_entry(fd);
+		if (!fde->is_open)
+			continue;
+		fde->backend_flags = 0;
+
+		if (cqe->res < 0)
+		{
+			fd_refresh(fd); /* re-arm and retry */
+			continue;
+		}
+
+		revents = cqe->res;
+		if (revents & (POLLIN | POLLHUP | POLLERR))
+			evflags |= FD_SELECT_READ;
+
+		if (revents & (POLLOUT | POLLHUP | POLLERR))
+			evflags |= FD_SELECT_WRITE;
+
+		if (evflags & FD_SELECT_READ)
+		{
+			iocb = fde->read_callback;
+
+			if (iocb != NULL)
+				iocb(fd, evflags, fde->data);
+		}
+
+		if (evflags & FD_SELECT_WRITE)
+		{
+			iocb = fde->write_callback;
+
+			if (iocb != NULL)
+				iocb(fd, evflags, fde->data);
+		}
+
+		/* Queue the re-arm per the (possibly just changed)
+		 * interest; goes to the kernel with the next enter.
+		 */
+		if (fde->is_open && (ring_state[fd].mask == 0))
+			fd_refresh(fd);
+	}
+	__atomic_store_n(cq.head, head, __ATOMIC_RELEASE);
+}
+
+void fd_fork()
+{
+	int fd;
+
+	/* Start over with a fresh ring and re-arm everything that was
+	 * being tracked, as the kqueue backend does.
+	 */
+	ring_fd = -1;
+	ring_to_submit = 0;
+	memset(ring_state, 0, sizeof(ring_state));
+	for_each_open_fd(fd)
+		fd_refresh(fd);
+}
+
+#endif
+
 /***************************************************************************************
  * Poll() backend.                                                                     *
  ***************************************************************************************/
@@ -560,7 +1421,7 @@ static nfds_t nfds = 0;
 
 void fd_refresh(int fd)
 {
-	FDEntry *fde = &fd_table[fd];
+	FDEntry *fde = fd_entry(fd);
 	unsigned int pflags = 0;
 	unsigned int i;
 
@@ -588,7 +1449,9 @@ void fd_select(time_t delay)
 	int num, p, revents, fd;
 	struct pollfd *pfd;
 
+	fd_wait_start();
 	num = poll(pollfds, nfds + 1, delay);
+	fd_wait_finish();
 	if (num <= 0)
 		return;
 
@@ -601,11 +1464,11 @@ void fd_select(time_t delay)
 		pfd = &pollfds[p];
 
 		revents = pfd->revents;
-		fd = pfd->local->fd;
+		fd = pfd->fd;
 		if (revents == 0 || fd == -1)
 			continue;
 
-		fde = &fd_table[fd];
+		fde = fd_entry(fd);
 
 		if (revents & (POLLRDNORM | POLLIN | POLLHUP | POLLERR))
 			evflags |= FD_SELECT_READ;
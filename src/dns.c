@@ -41,7 +41,8 @@ void unrealdns_cb_nametoip_link(void *arg, int status, int timeouts, struct host
 void unrealdns_delasyncconnects(void);
 static uint64_t unrealdns_hash_ip(const char *ip);
 static void unrealdns_addtocache(char *name, char *ip);
-static char *unrealdns_findcache_ip(char *ip);
+static int unrealdns_findcache_ip(char *ip, char **name);
+void unrealdns_loadcache(void);
 struct hostent *unreal_create_hostent(char *name, char *ip);
 static void unrealdns_freeandremovereq(DNSReq *r);
 void unrealdns_removecacherecord(DNSCache *c);
@@ -57,7 +58,8 @@ DNSStats dnsstats;
 
 static DNSReq *requests = NULL; /**< Linked list of requests (pending responses). */
 
-static DNSCache *cache_list = NULL; /**< Linked list of cache */
+static DNSCache *cache_list = NULL; /**< Linked list of cache, LRU order (head = most recently used) */
+static DNSCache *cache_list_tail = NULL; /**< Tail of the cache list, ie. the eviction candidate */
 static DNSCache *cache_hashtbl[DNS_HASH_SIZE]; /**< Hash table of cache */
 
 static unsigned int unrealdns_num_cache = 0; /**< # of cache entries in memory */
@@ -70,7 +72,7 @@ static void unrealdns_io_cb(int fd, int revents, void *data)
 	FDEntry *fde;
 
 	read_fd = write_fd = ARES_SOCKET_BAD;
-	fde = &fd_table[fd];
+	fde = fd_entry(fd);
 
 	if (revents & FD_SELECT_READ)
 		read_fd = fde->fd;
@@ -134,6 +136,7 @@ void init_resolver(int firsttime)
 		memset(&dnsstats, 0, sizeof(dnsstats));
 		siphash_generate_key(siphashkey_dns_ip);
 		ares_library_init(ARES_LIB_INIT_ALL);
+		unrealdns_loadcache();
 	}
 
 	memset(&options, 0, sizeof(options));
@@ -199,14 +202,23 @@ void unrealdns_addreqtolist(DNSReq *r)
  *   We return NULL in this case and an asynchronic request is done.
  *   When done, proceed_normal_client_handshake() is called.
  */
-struct hostent *unrealdns_doclient(Client *client)
+struct hostent *unrealdns_doclient(Client *client, int *negcache)
 {
 	DNSReq *r;
 	char *cache_name;
 
-	cache_name = unrealdns_findcache_ip(client->ip);
-	if (cache_name)
-		return unreal_create_hostent(cache_name, client->ip);
+	*negcache = 0;
+
+	if (unrealdns_findcache_ip(client->ip, &cache_name))
+	{
+		if (cache_name)
+			return unreal_create_hostent(cache_name, client->ip);
+		/* Negative entry: this IP recently failed to resolve,
+		 * tell the caller not to bother with a lookup.
+		 */
+		*negcache = 1;
+		return NULL;
+	}
 
 	/* Create a request */
 	r = safe_alloc(sizeof(DNSReq));
@@ -269,6 +281,7 @@ void unrealdns_cb_iptoname(void *arg, int status, int timeouts, struct hostent *
 	if ((status != 0) || !he->h_name || !*he->h_name)
 	{
 		/* Failed */
+		unrealdns_addtocache(NULL, client->ip); /* negative cache */
 		proceed_normal_client_handshake(client, NULL);
 		return;
 	}
@@ -318,6 +331,7 @@ void unrealdns_cb_nametoip_verify(void *arg, int status, int timeouts, struct ho
 	if ((status != 0) || (ipv6 && (he->h_length != 16)) || (!ipv6 && (he->h_length != 4)))
 	{
 		/* Failed: error code, or data length is incorrect */
+		unrealdns_addtocache(NULL, client->ip); /* negative cache */
 		proceed_normal_client_handshake(client, NULL);
 		goto bad;
 	}
@@ -344,13 +358,15 @@ void unrealdns_cb_nametoip_verify(void *arg, int status, int timeouts, struct ho
 	if (!he->h_addr_list[i])
 	{
 		/* Failed name <-> IP mapping */
+		unrealdns_addtocache(NULL, client->ip); /* negative cache */
 		proceed_normal_client_handshake(client, NULL);
 		goto bad;
 	}
 
 	if (!verify_hostname(r->name))
 	{
-		/* Hostname is bad, don't cache and consider unresolved */
+		/* Hostname is bad, consider unresolved (and negative cache it) */
+		unrealdns_addtocache(NULL, client->ip);
 		proceed_normal_client_handshake(client, NULL);
 		goto bad;
 	}
@@ -442,35 +458,78 @@ static uint64_t unrealdns_hash_ip(const char *ip)
         return siphash(ip, siphashkey_dns_ip) % DNS_HASH_SIZE;
 }
 
+/** Move a cache record to the head of the LRU list (= most recently used). */
+static void unrealdns_cache_touch(DNSCache *c)
+{
+	if (cache_list == c)
+		return; /* already at the head */
+
+	/* Unlink from the list.. */
+	if (c->prev)
+		c->prev->next = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	if (cache_list_tail == c)
+		cache_list_tail = c->prev;
+
+	/* ..and re-link at the head */
+	c->prev = NULL;
+	c->next = cache_list;
+	if (cache_list)
+		cache_list->prev = c;
+	cache_list = c;
+}
+
+/** Add an entry to the DNS cache.
+ * @param name The resolved (and verified) hostname, or NULL to record
+ *             a negative entry: this IP failed to resolve, don't retry
+ *             for DNSCACHE_TTL_NEGATIVE seconds.
+ * @param ip   The IP address
+ */
 static void unrealdns_addtocache(char *name, char *ip)
 {
 	unsigned int hashv;
 	DNSCache *c;
+	int maxentries = DNS_CACHE_SIZE ? DNS_CACHE_SIZE : DNS_MAX_ENTRIES;
 
-	dnsstats.cache_adds++;
+	if (name)
+		dnsstats.cache_adds++;
+	else
+		dnsstats.cache_adds_negative++;
 
 	hashv = unrealdns_hash_ip(ip);
 
 	/* Check first if it is already present in the cache.
 	 * This is possible, when 2 clients connect at the same time.
-	 */	
+	 */
 	for (c = cache_hashtbl[hashv]; c; c = c->hnext)
+	{
 		if (!strcmp(ip, c->ip))
+		{
+			if (name)
+			{
+				/* Refresh the record in place. This also upgrades
+				 * a negative entry once the IP resolves again.
+				 */
+				safe_strdup(c->name, name);
+				c->expires = TStime() + DNSCACHE_TTL;
+				unrealdns_cache_touch(c);
+			}
 			return; /* already present in cache */
-
-	/* Remove last item, if we got too many entries.. */
-	if (unrealdns_num_cache >= DNS_MAX_ENTRIES)
-	{
-		for (c = cache_list; c->next; c = c->next);
-		unrealdns_removecacherecord(c);
+		}
 	}
 
+	/* Remove the least recently used entries, if we got too many.. */
+	while ((unrealdns_num_cache >= maxentries) && cache_list_tail)
+		unrealdns_removecacherecord(cache_list_tail);
+
 	/* Create record */
 	c = safe_alloc(sizeof(DNSCache));
-	safe_strdup(c->name, name);
+	if (name)
+		safe_strdup(c->name, name);
 	safe_strdup(c->ip, ip);
-	c->expires = TStime() + DNSCACHE_TTL;
-	
+	c->expires = TStime() + (name ? DNSCACHE_TTL : DNSCACHE_TTL_NEGATIVE);
+
 	/* Add to hash table */
 	if (cache_hashtbl[hashv])
 	{
@@ -478,7 +537,7 @@ static void unrealdns_addtocache(char *name, char *ip)
 		c->hnext = cache_hashtbl[hashv];
 	}
 	cache_hashtbl[hashv] = c;
-	
+
 	/* Add to linked list */
 	if (cache_list)
 	{
@@ -486,30 +545,55 @@ static void unrealdns_addtocache(char *name, char *ip)
 		c->next = cache_list;
 	}
 	cache_list = c;
+	if (!cache_list_tail)
+		cache_list_tail = c;
 
 	unrealdns_num_cache++;
 	/* DONE */
 }
 
-/** Search the cache for a confirmed ip->name and name->ip match, by address.
- * @returns The resolved hostname, or NULL if not found in cache.
+/** Search the cache for this IP, by address.
+ * @param ip   The IP address
+ * @param name On a cache hit this is set to the resolved hostname, or
+ *             to NULL if we cached that this IP fails to resolve.
+ * @retval 1 Cache hit, '*name' is valid.
+ * @retval 0 Not in the cache (or the entry had expired).
  */
-static char *unrealdns_findcache_ip(char *ip)
+static int unrealdns_findcache_ip(char *ip, char **name)
 {
 	unsigned int hashv;
 	DNSCache *c;
 
 	hashv = unrealdns_hash_ip(ip);
-	
+
 	for (c = cache_hashtbl[hashv]; c; c = c->hnext)
+	{
 		if (!strcmp(ip, c->ip))
 		{
+			if (c->expires < TStime())
+			{
+				/* Expired: expunge it right here, there is no
+				 * periodic sweep anymore.
+				 */
+				unrealdns_removecacherecord(c);
+				break;
+			}
+			if (!c->name)
+			{
+				/* Negative entry: saved ourselves a doomed lookup */
+				dnsstats.cache_hits_negative++;
+				*name = NULL;
+				return 1;
+			}
 			dnsstats.cache_hits++;
-			return c->name;
+			unrealdns_cache_touch(c);
+			*name = c->name;
+			return 1;
 		}
-	
+	}
+
 	dnsstats.cache_misses++;
-	return NULL;
+	return 0;
 }
 
 /** Removes dns cache record from list (and frees it).
@@ -532,7 +616,10 @@ unsigned int hashv;
 	
 	if (c->next)
 		c->next->prev = c->prev;
-	
+
+	if (cache_list_tail == c)
+		cache_list_tail = c->prev;
+
 	if (c->hprev)
 		c->hprev->hnext = c->hnext;
 	else {
@@ -553,23 +640,67 @@ unsigned int hashv;
 	unrealdns_num_cache--;
 }
 
-/** This regulary removes old dns records from the cache */
-EVENT(unrealdns_removeoldrecords)
+/** Save the DNS cache to disk (see DNSCACHEFILE), so a restart can begin
+ * with a warm cache instead of hammering the resolvers with cold PTR
+ * lookups while everyone reconnects. Called on shutdown and restart.
+ */
+void unrealdns_savecache(void)
 {
-DNSCache *c, *next;
+	FILE *fd;
+	DNSCache *c;
 
-	for (c = cache_list; c; c = next)
+	fd = fopen(DNSCACHEFILE, "w");
+	if (!fd)
+		return;
+
+	fprintf(fd, "DNSCACHE 1\n");
+	/* Tail first, so reloading re-inserts the entries in the
+	 * original LRU order (most recently used ends up at the head).
+	 */
+	for (c = cache_list_tail; c; c = c->prev)
 	{
-		next = c->next;
-		if (c->expires < TStime())
-		{
-#if 0
-			sendto_realops(client, "[Syzop/DNS] Expire: %s [%s] (%ld < %ld)",
-				c->name, c->ip, c->expires, TStime());
-#endif
-			unrealdns_removecacherecord(c);
-		}
+		if (!c->name || (c->expires <= TStime()))
+			continue; /* negative and expired entries are not worth persisting */
+		fprintf(fd, "%lld %s %s\n", (long long)c->expires, c->ip, c->name);
+	}
+	fclose(fd);
+}
+
+/** Load the DNS cache snapshot written by unrealdns_savecache().
+ * Entries whose TTL ran out while we were down are skipped.
+ */
+void unrealdns_loadcache(void)
+{
+	FILE *fd;
+	char buf[512];
+	char ip[128], name[128];
+	long long expires;
+
+	fd = fopen(DNSCACHEFILE, "r");
+	if (!fd)
+		return;
+
+	if (!fgets(buf, sizeof(buf), fd) || strncmp(buf, "DNSCACHE 1", 10))
+	{
+		fclose(fd);
+		return; /* not ours, or an incompatible version */
+	}
+
+	while (fgets(buf, sizeof(buf), fd))
+	{
+		if (sscanf(buf, "%lld %127s %127s", &expires, ip, name) != 3)
+			continue;
+		if ((expires <= TStime()) || (strlen(name) > HOSTLEN))
+			continue;
+		unrealdns_addtocache(name, ip);
+		/* unrealdns_addtocache() starts a fresh TTL; restore the
+		 * remaining one from before the restart. The new entry sits
+		 * at the head of the list (unless it was a duplicate).
+		 */
+		if (cache_list && !strcmp(cache_list->ip, ip))
+			cache_list->expires = (time_t)expires;
 	}
+	fclose(fd);
 }
 
 struct hostent *unreal_create_hostent(char *name, char *ip)
@@ -685,6 +816,7 @@ CMD_FUNC(cmd_dns)
 			cache_list = c;
 		}
 		memset(&cache_hashtbl, 0, sizeof(cache_hashtbl));
+		cache_list_tail = NULL;
 		unrealdns_num_cache = 0;
 		sendnotice(client, "DNS Cache has been cleared");
 	} else
@@ -728,7 +860,10 @@ CMD_FUNC(cmd_dns)
 	{
 		sendtxtnumeric(client, "DNS CACHE Stats:");
 		sendtxtnumeric(client, " hits: %d", dnsstats.cache_hits);
+		sendtxtnumeric(client, " negative hits: %d", dnsstats.cache_hits_negative);
 		sendtxtnumeric(client, " misses: %d", dnsstats.cache_misses);
+		sendtxtnumeric(client, " entries in use: %u (max %d)", unrealdns_num_cache,
+			DNS_CACHE_SIZE ? DNS_CACHE_SIZE : DNS_MAX_ENTRIES);
 	}
 	return;
 }
@@ -22,7 +22,21 @@
 /* new FD management code, based on mowgli.eventloop from atheme, hammered into Unreal by
  * me, nenolod.
  */
-FDEntry fd_table[MAXCONNECTIONS + 1];
+FDEntry *fd_table_chunk[FD_TABLE_CHUNKS];
+int fd_first_open = -1;
+
+/** Get the FDEntry for 'fd', allocating its chunk of the fd table on
+ * first use. The caller must ensure 0 <= fd < MAXCONNECTIONS.
+ */
+FDEntry *fd_entry(int fd)
+{
+	FDEntry **chunk = &fd_table_chunk[fd >> FD_TABLE_CHUNK_SHIFT];
+
+	if (!*chunk)
+		*chunk = safe_alloc(sizeof(FDEntry) * FD_TABLE_CHUNK_SIZE);
+
+	return *chunk + (fd & (FD_TABLE_CHUNK_SIZE - 1));
+}
 
 int fd_open(int fd, const char *desc)
 {
@@ -40,7 +54,7 @@ int fd_open(int fd, const char *desc)
 		return -1;
 	}
 
-	fde = &fd_table[fd];
+	fde = fd_entry(fd);
 	memset(fde, 0, sizeof(FDEntry));
 
 	fde->fd = fd;
@@ -48,6 +62,13 @@ int fd_open(int fd, const char *desc)
 	fde->backend_flags = 0;
 	strlcpy(fde->desc, desc, FD_DESC_SZ);
 
+	/* Put it on the open fd list */
+	fde->prev_open = -1;
+	fde->next_open = fd_first_open;
+	if (fd_first_open >= 0)
+		fd_entry(fd_first_open)->prev_open = fd;
+	fd_first_open = fd;
+
 	return fde->fd;
 }
 
@@ -91,7 +112,7 @@ int fd_unmap(int fd)
 		return 0;
 	}
 
-	fde = &fd_table[fd];
+	fde = fd_entry(fd);
 	if (!fde->is_open)
 	{
 		sendto_realops("[BUG] trying to close fd #%d in fd table, but this FD isn't reported open",
@@ -104,10 +125,19 @@ int fd_unmap(int fd)
 		return 0;
 	}
 
+	/* Take it off the open fd list */
+	if (fde->prev_open >= 0)
+		fd_entry(fde->prev_open)->next_open = fde->next_open;
+	else
+		fd_first_open = fde->next_open;
+	if (fde->next_open >= 0)
+		fd_entry(fde->next_open)->prev_open = fde->prev_open;
+
 	befl = fde->backend_flags;
 	memset(fde, 0, sizeof(FDEntry));
 
 	fde->fd = fd;
+	fde->prev_open = fde->next_open = -1;
 
 	/* only notify the backend if it is actively tracking the FD */
 	if (befl)
@@ -134,7 +164,7 @@ FDEntry *fde;
 	if ((fd < 0) || (fd >= MAXCONNECTIONS))
 		return;
 	
-	fde = &fd_table[fd];
+	fde = fd_entry(fd);
 	if (!fde || !fde->is_open)
 		return;
 		
@@ -181,7 +211,7 @@ void fd_desc(int fd, const char *desc)
 		return;
 	}
 
-	fde = &fd_table[fd];
+	fde = fd_entry(fd);
 	if (!fde->is_open)
 	{
 		sendto_realops("[BUG] trying to modify fd #%d in fd table, but this FD isn't reported open",
@@ -252,45 +252,292 @@ uint64_t siphash(const char *in, const char *k)
  */
 void siphash_generate_key(char *k)
 {
-	int i;
-	for (i = 0; i < 16; i++)
-		k[i] = getrandom8();
+	getrandom_buf(k, 16);
 }
 
-static struct list_head clientTable[NICK_HASH_TABLE_SIZE];
-static struct list_head idTable[NICK_HASH_TABLE_SIZE];
+/** Open-addressed hash table with robin hood probing, used for the
+ * nick and UID/SID tables. Entries live in two parallel arrays (full
+ * hash plus value pointer), so the common hit case touches one or two
+ * cache lines instead of chasing cold list nodes all over the heap.
+ * Robin hood insertion keeps probe sequences short by letting a new
+ * entry steal the slot of any entry that sits closer to its home slot,
+ * and deletion shifts the tail of the probe sequence backwards so no
+ * tombstones are needed. A hash value of 0 marks an empty slot
+ * (hash_client_name() never returns 0).
+ *
+ * The tables resize incrementally: when the load factor gets too high
+ * (or, after lots of departures, too low) a fresh slot array is
+ * allocated and every subsequent add/del moves a batch of slots over
+ * from the previous array, so there is never a stop-the-world rehash
+ * pause. While a migration is in flight, lookups probe the new array
+ * first and then the remainder of the old one.
+ */
+typedef struct OpenHashTable {
+	unsigned int size;	/**< Number of slots (always a power of two) */
+	unsigned int count;	/**< Number of entries (both arrays together) */
+	uint64_t *hashes;	/**< Full hash per slot, 0 = empty */
+	void **values;		/**< Entry per slot */
+	unsigned int old_size;	/**< Size of the array being migrated away from */
+	unsigned int migrate_pos;	/**< Next old slot to migrate */
+	uint64_t *old_hashes;	/**< Previous slot array, NULL if no migration is in flight */
+	void **old_values;	/**< Previous slot array values */
+} OpenHashTable;
+
+/** How many old slots to migrate per add/del during a resize */
+#define OHT_MIGRATE_BATCH 64
+
+static OpenHashTable clientTable;
+static OpenHashTable idTable;
 static Channel *channelTable[CHAN_HASH_TABLE_SIZE];
 static Watch *watchTable[WATCH_HASH_TABLE_SIZE];
 
+/** How far the entry in 'slot' sits from its home slot */
+static unsigned int oht_distance_raw(unsigned int size, unsigned int slot, uint64_t hash)
+{
+	return (slot + size - ((unsigned int)hash & (size - 1))) & (size - 1);
+}
+
+static void oht_init(OpenHashTable *ht, unsigned int size)
+{
+	memset(ht, 0, sizeof(OpenHashTable));
+	ht->size = size;
+	ht->hashes = safe_alloc(size * sizeof(uint64_t));
+	ht->values = safe_alloc(size * sizeof(void *));
+}
+
+static void oht_insert_raw(uint64_t *hashes, void **values, unsigned int size, uint64_t hash, void *value)
+{
+	unsigned int mask = size - 1;
+	unsigned int slot = (unsigned int)hash & mask;
+	unsigned int dist = 0;
+	unsigned int d;
+
+	for (;;)
+	{
+		if (hashes[slot] == 0)
+		{
+			hashes[slot] = hash;
+			values[slot] = value;
+			return;
+		}
+		d = oht_distance_raw(size, slot, hashes[slot]);
+		if (d < dist)
+		{
+			/* Resident entry is closer to home than we are:
+			 * take its slot and carry it onwards (robin hood).
+			 */
+			uint64_t thash = hashes[slot];
+			void *tvalue = values[slot];
+			hashes[slot] = hash;
+			values[slot] = value;
+			hash = thash;
+			value = tvalue;
+			dist = d;
+		}
+		slot = (slot + 1) & mask;
+		dist++;
+	}
+}
+
+/** Remove an entry. Returns 1 if found and removed, 0 if not present. */
+static int oht_remove_raw(uint64_t *hashes, void **values, unsigned int size, uint64_t hash, void *value)
+{
+	unsigned int mask = size - 1;
+	unsigned int slot = (unsigned int)hash & mask;
+	unsigned int dist = 0;
+	unsigned int next;
+
+	for (;;)
+	{
+		if (hashes[slot] == 0)
+			return 0;
+		if ((hashes[slot] == hash) && (values[slot] == value))
+			break;
+		if (oht_distance_raw(size, slot, hashes[slot]) < dist)
+			return 0; /* would have been placed before this point */
+		slot = (slot + 1) & mask;
+		dist++;
+	}
+
+	/* Backward-shift deletion: pull every displaced successor one
+	 * slot closer to home, then clear the freed slot.
+	 */
+	next = (slot + 1) & mask;
+	while (hashes[next] && (oht_distance_raw(size, next, hashes[next]) > 0))
+	{
+		hashes[slot] = hashes[next];
+		values[slot] = values[next];
+		slot = next;
+		next = (next + 1) & mask;
+	}
+	hashes[slot] = 0;
+	values[slot] = NULL;
+	return 1;
+}
+
+/** Value matcher for oht_find(): called for full-hash matches only, so
+ * in practice once per successful lookup.
+ */
+typedef int (*OhtMatch)(void *value, const void *key);
+
+static void *oht_find_raw(uint64_t *hashes, void **values, unsigned int size, uint64_t hash, OhtMatch match, const void *key)
+{
+	unsigned int mask = size - 1;
+	unsigned int slot = (unsigned int)hash & mask;
+	unsigned int dist = 0;
+
+	while (hashes[slot])
+	{
+		if (hashes[slot] == hash)
+		{
+			if (match(values[slot], key))
+				return values[slot];
+		}
+		else if (oht_distance_raw(size, slot, hashes[slot]) < dist)
+			break; /* our entry would have been placed before this point */
+		slot = (slot + 1) & mask;
+		dist++;
+	}
+	return NULL;
+}
+
+static void *oht_find(OpenHashTable *ht, uint64_t hash, OhtMatch match, const void *key)
+{
+	void *value = oht_find_raw(ht->hashes, ht->values, ht->size, hash, match, key);
+
+	if (!value && ht->old_hashes)
+		value = oht_find_raw(ht->old_hashes, ht->old_values, ht->old_size, hash, match, key);
+	return value;
+}
+
+/** Prefetch the home slot of 'hash', so a later oht_find() for it is
+ * likely a cache hit. Used by find_persons() to overlap the memory
+ * stalls of many independent lookups.
+ */
+static void oht_prefetch(OpenHashTable *ht, uint64_t hash)
+{
+#if defined(__GNUC__)
+	__builtin_prefetch(&ht->hashes[(unsigned int)hash & (ht->size - 1)]);
+#endif
+}
+
+/** Move a batch of slots from the old array into the current one.
+ * Called on every add/del while a resize is in flight; scanning is
+ * sequential and cheap, so a migration completes long before the next
+ * resize can trigger.
+ */
+static void oht_migrate(OpenHashTable *ht, unsigned int slots)
+{
+	unsigned int end = ht->migrate_pos + slots;
+
+	if (!ht->old_hashes)
+		return;
+	if (end > ht->old_size)
+		end = ht->old_size;
+
+	for (; ht->migrate_pos < end; ht->migrate_pos++)
+	{
+		if (ht->old_hashes[ht->migrate_pos])
+			oht_insert_raw(ht->hashes, ht->values, ht->size,
+				ht->old_hashes[ht->migrate_pos],
+				ht->old_values[ht->migrate_pos]);
+	}
+
+	if (ht->migrate_pos == ht->old_size)
+	{
+		safe_free(ht->old_hashes);
+		safe_free(ht->old_values);
+		ht->old_hashes = NULL;
+		ht->old_values = NULL;
+		ht->old_size = 0;
+		ht->migrate_pos = 0;
+	}
+}
+
+/** Begin an incremental resize to 'newsize' slots */
+static void oht_start_resize(OpenHashTable *ht, unsigned int newsize)
+{
+	if (ht->old_hashes)
+		oht_migrate(ht, ht->old_size); /* finish the previous one first (rare) */
+
+	ht->old_hashes = ht->hashes;
+	ht->old_values = ht->values;
+	ht->old_size = ht->size;
+	ht->migrate_pos = 0;
+	ht->size = newsize;
+	ht->hashes = safe_alloc(newsize * sizeof(uint64_t));
+	ht->values = safe_alloc(newsize * sizeof(void *));
+}
+
+/** Keep the load factor bounded. Robin hood probing keeps lookups
+ * cheap up to fairly high load factors but degrades sharply when
+ * nearly full, so grow (double) at 75%. Shrink (halve) when a table
+ * that grew for a big net drops below 1/8 occupancy, but never below
+ * the initial size.
+ */
+static void oht_check_resize(OpenHashTable *ht)
+{
+	oht_migrate(ht, OHT_MIGRATE_BATCH);
+
+	if (ht->count >= ht->size - (ht->size / 4))
+		oht_start_resize(ht, ht->size * 2);
+	else if ((ht->size > NICK_HASH_TABLE_SIZE) && (ht->count < ht->size / 8) && !ht->old_hashes)
+		oht_start_resize(ht, ht->size / 2);
+}
+
+static void oht_add(OpenHashTable *ht, uint64_t hash, void *value)
+{
+	oht_check_resize(ht);
+	oht_insert_raw(ht->hashes, ht->values, ht->size, hash, value);
+	ht->count++;
+}
+
+static int oht_del(OpenHashTable *ht, uint64_t hash, void *value)
+{
+	int found = oht_remove_raw(ht->hashes, ht->values, ht->size, hash, value);
+
+	if (!found && ht->old_hashes)
+		found = oht_remove_raw(ht->old_hashes, ht->old_values, ht->old_size, hash, value);
+	if (found)
+		ht->count--;
+	oht_check_resize(ht);
+	return found;
+}
+
 static char siphashkey_nick[SIPHASH_KEY_LENGTH];
 static char siphashkey_chan[SIPHASH_KEY_LENGTH];
 static char siphashkey_watch[SIPHASH_KEY_LENGTH];
 static char siphashkey_whowas[SIPHASH_KEY_LENGTH];
-static char siphashkey_throttling[SIPHASH_KEY_LENGTH];
+static char siphashkey_ipstate[SIPHASH_KEY_LENGTH];
+static char siphashkey_whoindex[SIPHASH_KEY_LENGTH];
+#define WHO_INDEX_TABLE_SIZE	1024
+static WhoIndexEntry *whoIndexTable[WHOINDEX_MAX][WHO_INDEX_TABLE_SIZE];
+static Channel *chanSizeIndex[LIST_SIZE_INDEX_BUCKETS];
+static IpStateEntry *IpStateHash[IPSTATE_HASH_TABLE_SIZE];
+static int throttling_slot = -1;
 
 extern char unreallogo[];
 
 /** Initialize all hash tables */
 void init_hash(void)
 {
-	int i;
-
 	siphash_generate_key(siphashkey_nick);
 	siphash_generate_key(siphashkey_chan);
 	siphash_generate_key(siphashkey_watch);
 	siphash_generate_key(siphashkey_whowas);
-	siphash_generate_key(siphashkey_throttling);
+	siphash_generate_key(siphashkey_ipstate);
+	siphash_generate_key(siphashkey_whoindex);
 
-	for (i = 0; i < NICK_HASH_TABLE_SIZE; i++)
-		INIT_LIST_HEAD(&clientTable[i]);
-
-	for (i = 0; i < NICK_HASH_TABLE_SIZE; i++)
-		INIT_LIST_HEAD(&idTable[i]);
+	oht_init(&clientTable, NICK_HASH_TABLE_SIZE);
+	oht_init(&idTable, NICK_HASH_TABLE_SIZE);
 
 	memset(channelTable, 0, sizeof(channelTable));
 	memset(watchTable, 0, sizeof(watchTable));
 
-	memset(ThrottlingHash, 0, sizeof(ThrottlingHash));
+	memset(whoIndexTable, 0, sizeof(whoIndexTable));
+	memset(chanSizeIndex, 0, sizeof(chanSizeIndex));
+	memset(IpStateHash, 0, sizeof(IpStateHash));
+	throttling_slot = ipstate_slot_request("throttle", NULL);
 	/* do not call init_throttling() here, as
 	 * config file has not been read yet.
 	 * The hash table is ready, anyway.
@@ -302,7 +549,41 @@ void init_hash(void)
 
 uint64_t hash_client_name(const char *name)
 {
-	return siphash_nocase(name, siphashkey_nick) % NICK_HASH_TABLE_SIZE;
+	uint64_t hashv = siphash_nocase(name, siphashkey_nick);
+	return hashv ? hashv : 1; /* 0 means 'empty slot' in the open tables */
+}
+
+/** Pack a UID/SID into its 64-bit table key. IDs are short base36
+ * strings ([A-Z0-9], 3 characters for a SID, 9 for a UID), so they fit
+ * losslessly in a uint64_t: every character becomes a base37 digit
+ * 1..36. The packing is bijective, which means equal keys imply equal
+ * IDs: lookups on the ID table never have to hash or compare strings,
+ * which matters because every routed server-to-server line resolves
+ * its target through this table.
+ * Returns 0 (never a valid key) if 'id' is not a well-formed ID.
+ */
+static uint64_t hash_client_id(const char *id)
+{
+	uint64_t key = 0;
+	int len = 0;
+
+	for (; *id; id++, len++)
+	{
+		unsigned int v;
+
+		if ((*id >= '0') && (*id <= '9'))
+			v = *id - '0' + 1;
+		else if ((*id >= 'A') && (*id <= 'Z'))
+			v = *id - 'A' + 11;
+		else if ((*id >= 'a') && (*id <= 'z'))
+			v = *id - 'a' + 11; /* IDs are matched case insensitively */
+		else
+			return 0;
+		key = key * 37 + v;
+	}
+	if (!len || (len >= IDLEN))
+		return 0;
+	return key;
 }
 
 uint64_t hash_channel_name(const char *name)
@@ -320,12 +601,21 @@ uint64_t hash_whowas_name(const char *name)
 	return siphash_nocase(name, siphashkey_whowas) % WHOWAS_HASH_TABLE_SIZE;
 }
 
+uint64_t hash_whowas_ip(const char *ip)
+{
+	return siphash(ip, siphashkey_whowas) % WHOWAS_HASH_TABLE_SIZE;
+}
+
+uint64_t hash_whowas_account(const char *account)
+{
+	return siphash_nocase(account, siphashkey_whowas) % WHOWAS_HASH_TABLE_SIZE;
+}
+
 /*
  * add_to_client_hash_table
  */
 int add_to_client_hash_table(char *name, Client *client)
 {
-	unsigned int hashv;
 	/*
 	 * If you see this, you have probably found your way to why changing the 
 	 * base version made the IRCd become weird. This has been the case in all
@@ -341,8 +631,8 @@ int add_to_client_hash_table(char *name, Client *client)
 	*/
 	if (loop.tainted)
 		return 0;
-	hashv = hash_client_name(name);
-	list_add(&client->client_hash, &clientTable[hashv]);
+	oht_add(&clientTable, hash_client_name(name), client);
+	client->in_client_hash = 1;
 	return 0;
 }
 
@@ -351,9 +641,19 @@ int add_to_client_hash_table(char *name, Client *client)
  */
 int add_to_id_hash_table(char *name, Client *client)
 {
-	unsigned int hashv;
-	hashv = hash_client_name(name);
-	list_add(&client->id_hash, &idTable[hashv]);
+	uint64_t key = hash_client_id(name);
+
+	if (!key)
+	{
+		ircd_log(LOG_ERROR, "[BUG] add_to_id_hash_table() for malformed id '%s' (%p)",
+			name, (void *)client);
+#ifdef DEBUGMODE
+		abort();
+#endif
+		return 0;
+	}
+	oht_add(&idTable, key, client);
+	client->in_id_hash = 1;
 	return 0;
 }
 
@@ -374,21 +674,33 @@ int add_to_channel_hash_table(char *name, Channel *channel)
  */
 int del_from_client_hash_table(char *name, Client *client)
 {
-	if (!list_empty(&client->client_hash))
-		list_del(&client->client_hash);
-
-	INIT_LIST_HEAD(&client->client_hash);
-
+	if (!client->in_client_hash)
+		return 0;
+	if (!oht_del(&clientTable, hash_client_name(name), client))
+	{
+		ircd_log(LOG_ERROR, "[BUG] del_from_client_hash_table() for '%s' (%p): not found in table",
+			name, (void *)client);
+#ifdef DEBUGMODE
+		abort();
+#endif
+	}
+	client->in_client_hash = 0;
 	return 0;
 }
 
 int del_from_id_hash_table(char *name, Client *client)
 {
-	if (!list_empty(&client->id_hash))
-		list_del(&client->id_hash);
-
-	INIT_LIST_HEAD(&client->id_hash);
-
+	if (!client->in_id_hash)
+		return 0;
+	if (!oht_del(&idTable, hash_client_id(name), client))
+	{
+		ircd_log(LOG_ERROR, "[BUG] del_from_id_hash_table() for '%s' (%p): not found in table",
+			name, (void *)client);
+#ifdef DEBUGMODE
+		abort();
+#endif
+	}
+	client->in_id_hash = 0;
 	return 0;
 }
 
@@ -420,34 +732,42 @@ void del_from_channel_hash_table(char *name, Channel *channel)
 /*
  * hash_find_client
  */
-Client *hash_find_client(const char *name, Client *client)
+static int oht_match_client_name(void *value, const void *key)
 {
-	Client *tmp;
-	unsigned int hashv;
+	return smycmp((const char *)key, ((Client *)value)->name) == 0;
+}
 
-	hashv = hash_client_name(name);
-	list_for_each_entry(tmp, &clientTable[hashv], client_hash)
-	{
-		if (smycmp(name, tmp->name) == 0)
-			return tmp;
-	}
+/** Matcher for the ID table: keys pack the whole ID bijectively
+ * (see hash_client_id()), so a key match already is an ID match.
+ */
+static int oht_match_client_id(void *value, const void *key)
+{
+	return 1;
+}
 
-	return client;
+static int oht_match_server_name(void *value, const void *key)
+{
+	Client *tmp = value;
+
+	return (IsServer(tmp) || IsMe(tmp)) && (smycmp((const char *)key, tmp->name) == 0);
 }
 
-Client *hash_find_id(const char *name, Client *client)
+MODVAR Tracepoint tp_hash_find_client = { NULL, "hash_find_client", 0, 0 };
+
+Client *hash_find_client(const char *name, Client *client)
 {
-	Client *tmp;
-	unsigned int hashv;
+	Client *tmp = oht_find(&clientTable, hash_client_name(name), oht_match_client_name, name);
 
-	hashv = hash_client_name(name);
-	list_for_each_entry(tmp, &idTable[hashv], id_hash)
-	{
-		if (smycmp(name, tmp->id) == 0)
-			return tmp;
-	}
+	TRACEPOINT(tp_hash_find_client, "%s%s", name, tmp ? "" : " (miss)");
+	return tmp ? tmp : client;
+}
+
+Client *hash_find_id(const char *name, Client *client)
+{
+	uint64_t key = hash_client_id(name);
+	Client *tmp = key ? oht_find(&idTable, key, oht_match_client_id, NULL) : NULL;
 
-	return client;
+	return tmp ? tmp : client;
 }
 
 /*
@@ -483,21 +803,9 @@ Client *hash_find_nickatserver(const char *str, Client *def)
  */
 Client *hash_find_server(const char *server, Client *def)
 {
-	Client *tmp;
-	unsigned int hashv;
+	Client *tmp = oht_find(&clientTable, hash_client_name(server), oht_match_server_name, server);
 
-	hashv = hash_client_name(server);
-	list_for_each_entry(tmp, &clientTable[hashv], client_hash)
-	{
-		if (!IsServer(tmp) && !IsMe(tmp))
-			continue;
-		if (smycmp(server, tmp->name) == 0)
-		{
-			return tmp;
-		}
-	}
-
-	return def;
+	return tmp ? tmp : def;
 }
 
 /** Find a client by name.
@@ -557,6 +865,49 @@ Client *find_person(char *name, Client *requester)
 	return NULL;
 }
 
+/** How many names find_persons() hashes ahead of probing them */
+#define FIND_PERSONS_BATCH 16
+
+/** Batch version of find_person() with a NULL requester, for commands
+ * that resolve many nick names at once (USERHOST, ISON, WATCH, ..).
+ * All names are hashed up front with their home slots prefetched, so
+ * the cache misses of the independent probes overlap instead of being
+ * taken one lookup at a time.
+ * Sets results[i] to the online user that names[i] resolves to, or NULL.
+ */
+void find_persons(int count, char **names, Client **results)
+{
+	uint64_t namehash[FIND_PERSONS_BATCH];
+	uint64_t idkey[FIND_PERSONS_BATCH];
+	Client *acptr;
+	int i, n;
+
+	while (count > 0)
+	{
+		n = MIN(count, FIND_PERSONS_BATCH);
+		for (i = 0; i < n; i++)
+		{
+			namehash[i] = hash_client_name(names[i]);
+			oht_prefetch(&clientTable, namehash[i]);
+			if ((idkey[i] = hash_client_id(names[i])))
+				oht_prefetch(&idTable, idkey[i]);
+		}
+		for (i = 0; i < n; i++)
+		{
+			/* Same order as find_client() with a NULL requester:
+			 * the ID table first, then the nick table.
+			 */
+			acptr = idkey[i] ? oht_find(&idTable, idkey[i], oht_match_client_id, NULL) : NULL;
+			if (!acptr)
+				acptr = oht_find(&clientTable, namehash[i], oht_match_client_name, names[i]);
+			results[i] = (acptr && IsUser(acptr) && acptr->user) ? acptr : NULL;
+		}
+		names += n;
+		results += n;
+		count -= n;
+	}
+}
+
 
 /*
  * hash_find_channel
@@ -593,128 +944,259 @@ void  count_watch_memory(int *count, u_long *memory)
 		anptr = watchTable[i];
 		while (anptr)
 		{
+			WatchLink *wl;
+
 			(*count)++;
 			(*memory) += sizeof(Watch)+strlen(anptr->nick);
+			for (wl = anptr->watchers; wl; wl = wl->next_watcher)
+				(*memory) += sizeof(WatchLink);
 			anptr = anptr->hnext;
 		}
 	}
 }
 
+/* The watch subsystem stores one WatchLink node per (watcher, nick)
+ * relationship, linked into both the watched nick's watcher list
+ * (doubly, for O(1) removal when a watcher quits) and the watcher's
+ * own list. Online/offline/away notifications are not sent inline:
+ * hash_check_watch() snapshots what the numeric needs and queues it,
+ * and flush_watch_notifications() - called once per main loop
+ * iteration - fans the whole batch out. During a netsplit this keeps
+ * the per-quit work tiny and emits all RPL_LOGOFF traffic in one
+ * coalesced pass.
+ */
+typedef struct PendingWatchNotify PendingWatchNotify;
+struct PendingWatchNotify {
+	PendingWatchNotify *next;
+	int reply;			/**< RPL_LOGON, RPL_LOGOFF, RPL_GONEAWAY, ... */
+	time_t lasttime;		/**< Time of the state change (for away: lastaway) */
+	char nick[NICKLEN+1];
+	char username[USERLEN+1];
+	char host[HOSTLEN+1];
+	char away[MAXAWAYLEN+1];	/**< Away reason (RPL_GONEAWAY/RPL_REAWAY only) */
+	char info[REALLEN+1];
+};
+
+static PendingWatchNotify *pending_watch_notifies = NULL;
+static PendingWatchNotify *pending_watch_notifies_tail = NULL;
+
+/** Unlink 'wl' from its nick's watcher list (not from the watcher's own list) */
+static void watch_unlink_watcher(WatchLink *wl)
+{
+	if (wl->prev_watcher)
+		wl->prev_watcher->next_watcher = wl->next_watcher;
+	else
+		wl->entry->watchers = wl->next_watcher;
+	if (wl->next_watcher)
+		wl->next_watcher->prev_watcher = wl->prev_watcher;
+}
+
+/** Remove a watch header that no longer has any watchers */
+static void watch_free_empty_entry(Watch *anptr)
+{
+	unsigned int hashv = hash_watch_nick_name(anptr->nick);
+	Watch *np2, *nl = NULL;
+
+	for (np2 = watchTable[hashv]; np2 != anptr; np2 = np2->hnext)
+		nl = np2;
+	if (nl)
+		nl->hnext = anptr->hnext;
+	else
+		watchTable[hashv] = anptr->hnext;
+	safe_free(anptr);
+}
+
 /*
  * add_to_watch_hash_table
+ *
+ * Subscribes 'client' to state changes of 'nick'. WATCH and MONITOR
+ * subscriptions ('monitor' zero/non-zero) share one WatchLink per
+ * (watcher, nick) pair so a target's state change is detected once
+ * and fanned out to both subscriber kinds from the same batch.
  */
-int add_to_watch_hash_table(char *nick, Client *client, int awaynotify)
+int add_to_watch_hash_table(char *nick, Client *client, int awaynotify, int monitor)
 {
 	unsigned int hashv;
-	Watch  *anptr;
-	Link  *lp;
-	
-	
+	Watch *anptr;
+	WatchLink *wl;
+
 	/* Get the right bucket... */
 	hashv = hash_watch_nick_name(nick);
-	
+
 	/* Find the right nick (header) in the bucket, or NULL... */
 	if ((anptr = (Watch *)watchTable[hashv]))
 	  while (anptr && mycmp(anptr->nick, nick))
 		 anptr = anptr->hnext;
-	
+
 	/* If found NULL (no header for this nick), make one... */
 	if (!anptr) {
 		anptr = (Watch *)safe_alloc(sizeof(Watch)+strlen(nick));
 		anptr->lasttime = timeofday;
 		strcpy(anptr->nick, nick);
-		
-		anptr->watch = NULL;
-		
+
+		anptr->watchers = NULL;
+
 		anptr->hnext = watchTable[hashv];
 		watchTable[hashv] = anptr;
 	}
 	/* Is this client already on the watch-list? */
-	if ((lp = anptr->watch))
-	  while (lp && (lp->value.client != client))
-		 lp = lp->next;
-	
-	/* No it isn't, so add it in the bucket and client addint it */
-	if (!lp) {
-		lp = anptr->watch;
-		anptr->watch = make_link();
-		anptr->watch->value.client = client;
-		anptr->watch->flags = awaynotify;
-		anptr->watch->next = lp;
-		
-		lp = make_link();
-		lp->next = client->local->watch;
-		lp->value.wptr = anptr;
-		lp->flags = awaynotify;
-		client->local->watch = lp;
-		client->local->watches++;
+	for (wl = anptr->watchers; wl && (wl->watcher != client); wl = wl->next_watcher)
+		;
+
+	/* No it isn't, so link a node into both lists */
+	if (!wl) {
+		wl = safe_alloc(sizeof(WatchLink));
+		wl->entry = anptr;
+		wl->watcher = client;
+
+		wl->next_watcher = anptr->watchers;
+		if (anptr->watchers)
+			anptr->watchers->prev_watcher = wl;
+		anptr->watchers = wl;
+
+		wl->next_entry = client->local->watch;
+		client->local->watch = wl;
 	}
-	
+
+	/* Mark the subscription kind on the (possibly shared) link */
+	if (monitor)
+	{
+		if (!wl->monitor)
+		{
+			wl->monitor = 1;
+			client->local->monitors++;
+		}
+	} else {
+		if (!wl->watched)
+		{
+			wl->watched = 1;
+			wl->awaynotify = awaynotify;
+			client->local->watches++;
+		}
+	}
+
 	return 0;
 }
 
 /*
  *  hash_check_watch
+ *
+ * Queues a notification for everybody watching this client's nick.
+ * The actual numerics are sent by flush_watch_notifications().
  */
 int hash_check_watch(Client *client, int reply)
 {
-	unsigned int hashv;
-	Watch  *anptr;
-	Link  *lp;
+	Watch *anptr;
+	PendingWatchNotify *pn;
 	int awaynotify = 0;
-	
+
 	if ((reply == RPL_GONEAWAY) || (reply == RPL_NOTAWAY) || (reply == RPL_REAWAY))
 		awaynotify = 1;
 
-	/* Get us the right bucket */
-	hashv = hash_watch_nick_name(client->name);
-	
-	/* Find the right header in this bucket */
-	if ((anptr = (Watch *)watchTable[hashv]))
-	  while (anptr && mycmp(anptr->nick, client->name))
-		 anptr = anptr->hnext;
-	if (!anptr)
+	if (!hash_get_watch(client->name))
 	  return 0;   /* This nick isn't on watch */
-	
-	/* Update the time of last change to item */
-	anptr->lasttime = TStime();
-	
-	/* Send notifies out to everybody on the list in header */
-	for (lp = anptr->watch; lp; lp = lp->next)
+
+	/* Snapshot everything the numeric needs: by the time the batch
+	 * is flushed this client may already have been freed.
+	 */
+	pn = safe_alloc(sizeof(PendingWatchNotify));
+	pn->reply = reply;
+	strlcpy(pn->nick, client->name, sizeof(pn->nick));
+	if (IsUser(client))
 	{
-		if (!awaynotify)
-		{
-			sendnumeric(lp->value.client, reply,
-			    client->name,
-			    (IsUser(client) ? client->user->username : "<N/A>"),
-			    (IsUser(client) ?
-			    (IsHidden(client) ? client->user->virthost : client->
-			    user->realhost) : "<N/A>"), anptr->lasttime, client->info);
-		}
-		else
+		strlcpy(pn->username, client->user->username, sizeof(pn->username));
+		strlcpy(pn->host, IsHidden(client) ? client->user->virthost : client->user->realhost,
+			sizeof(pn->host));
+	} else {
+		strlcpy(pn->username, "<N/A>", sizeof(pn->username));
+		strlcpy(pn->host, "<N/A>", sizeof(pn->host));
+	}
+	if (awaynotify)
+	{
+		pn->lasttime = client->user->lastaway;
+		if (client->user->away)
+			strlcpy(pn->away, client->user->away, sizeof(pn->away));
+	} else {
+		pn->lasttime = TStime();
+		strlcpy(pn->info, client->info, sizeof(pn->info));
+	}
+
+	if (pending_watch_notifies_tail)
+		pending_watch_notifies_tail->next = pn;
+	else
+		pending_watch_notifies = pn;
+	pending_watch_notifies_tail = pn;
+
+	return 0;
+}
+
+/** Send out all queued watch notifications - called once per main
+ * loop iteration. Watchers that quit since a notification was queued
+ * have already been unlinked from the watcher lists, so they are
+ * naturally skipped.
+ */
+void flush_watch_notifications(void)
+{
+	PendingWatchNotify *pn, *pnnext;
+	Watch *anptr;
+	WatchLink *wl;
+	int awaynotify;
+
+	for (pn = pending_watch_notifies; pn; pn = pnnext)
+	{
+		pnnext = pn->next;
+		awaynotify = (pn->reply == RPL_GONEAWAY) || (pn->reply == RPL_NOTAWAY) || (pn->reply == RPL_REAWAY);
+
+		/* Re-resolve: the last watcher may have un-watched the
+		 * nick (freeing the header) since we queued this.
+		 */
+		if ((anptr = hash_get_watch(pn->nick)))
 		{
-			/* AWAY or UNAWAY */
-			if (!lp->flags)
-				continue; /* skip away/unaway notification for users not interested in them */
-
-			if (reply == RPL_NOTAWAY)
-				sendnumeric(lp->value.client, reply,
-				    client->name,
-				    (IsUser(client) ? client->user->username : "<N/A>"),
-				    (IsUser(client) ?
-				    (IsHidden(client) ? client->user->virthost : client->
-				    user->realhost) : "<N/A>"), client->user->lastaway);
-			else /* RPL_GONEAWAY / RPL_REAWAY */
-				sendnumeric(lp->value.client, reply,
-				    client->name,
-				    (IsUser(client) ? client->user->username : "<N/A>"),
-				    (IsUser(client) ?
-				    (IsHidden(client) ? client->user->virthost : client->
-				    user->realhost) : "<N/A>"), client->user->lastaway, client->user->away);
+			char monbuf[NICKLEN+USERLEN+HOSTLEN+4];
+
+			if (!awaynotify)
+			{
+				anptr->lasttime = pn->lasttime;
+				/* Render the MONITOR online payload once for the
+				 * whole batch entry, not once per subscriber.
+				 */
+				ircsnprintf(monbuf, sizeof(monbuf), "%s!%s@%s",
+				    pn->nick, pn->username, pn->host);
+			}
+			for (wl = anptr->watchers; wl; wl = wl->next_watcher)
+			{
+				if (!awaynotify)
+				{
+					if (wl->monitor)
+					{
+						if (pn->reply == RPL_LOGON)
+							sendnumeric(wl->watcher, RPL_MONONLINE, monbuf);
+						else if (pn->reply == RPL_LOGOFF)
+							sendnumeric(wl->watcher, RPL_MONOFFLINE, pn->nick);
+					}
+					if (wl->watched)
+						sendnumeric(wl->watcher, pn->reply, pn->nick,
+						    pn->username, pn->host, anptr->lasttime, pn->info);
+				}
+				else
+				{
+					/* AWAY or UNAWAY */
+					if (!wl->watched || !wl->awaynotify)
+						continue; /* skip away/unaway notification for users not interested in them */
+
+					if (pn->reply == RPL_NOTAWAY)
+						sendnumeric(wl->watcher, pn->reply, pn->nick,
+						    pn->username, pn->host, pn->lasttime);
+					else /* RPL_GONEAWAY / RPL_REAWAY */
+						sendnumeric(wl->watcher, pn->reply, pn->nick,
+						    pn->username, pn->host, pn->lasttime, pn->away);
+				}
+			}
 		}
+		safe_free(pn);
 	}
-	
-	return 0;
+	pending_watch_notifies = NULL;
+	pending_watch_notifies_tail = NULL;
 }
 
 /*
@@ -736,77 +1218,100 @@ Watch  *hash_get_watch(char *nick)
 
 /*
  * del_from_watch_hash_table
+ *
+ * Drops one subscription kind; the link (and the nick's header) only
+ * go away once neither WATCH nor MONITOR still references them.
  */
-int del_from_watch_hash_table(char *nick, Client *client)
+int del_from_watch_hash_table(char *nick, Client *client, int monitor)
 {
-	unsigned int hashv;
-	Watch  *anptr, *nlast = NULL;
-	Link  *lp, *last = NULL;
+	Watch *anptr;
+	WatchLink *wl, *last = NULL;
 
-	/* Get the bucket for this nick... */
-	hashv = hash_watch_nick_name(nick);
-	
-	/* Find the right header, maintaining last-link pointer... */
-	if ((anptr = (Watch *)watchTable[hashv]))
-	  while (anptr && mycmp(anptr->nick, nick)) {
-		  nlast = anptr;
-		  anptr = anptr->hnext;
-	  }
-	if (!anptr)
+	if (!(anptr = hash_get_watch(nick)))
 	  return 0;   /* No such watch */
-	
-	/* Find this client from the list of notifies... with last-ptr. */
-	if ((lp = anptr->watch))
-	  while (lp && (lp->value.client != client)) {
-		  last = lp;
-		  lp = lp->next;
-	  }
-	if (!lp)
+
+	/* Find this watch on the client's own list, keeping a last-ptr */
+	for (wl = client->local->watch; wl && (wl->entry != anptr); wl = wl->next_entry)
+		last = wl;
+	if (!wl)
 	  return 0;   /* No such client to watch */
-	
-	/* Fix the linked list under header, then remove the watch entry */
+
+	if (monitor)
+	{
+		if (!wl->monitor)
+			return 0;   /* Not monitored, only watched */
+		wl->monitor = 0;
+		client->local->monitors--;
+	} else {
+		if (!wl->watched)
+			return 0;   /* Not watched, only monitored */
+		wl->watched = 0;
+		wl->awaynotify = 0;
+		client->local->watches--;
+	}
+
+	/* The other subscription kind keeps the link alive */
+	if (wl->watched || wl->monitor)
+		return 0;
+
+	/* Unlink from the client's list... */
 	if (!last)
-	  anptr->watch = lp->next;
+	  client->local->watch = wl->next_entry;
 	else
-	  last->next = lp->next;
-	free_link(lp);
-	
-	/* Do the same regarding the links in client-record... */
-	last = NULL;
-	if ((lp = client->local->watch))
-	  while (lp && (lp->value.wptr != anptr)) {
-		  last = lp;
-		  lp = lp->next;
-	  }
-	
-	/*
-	 * Give error on the odd case... probobly not even neccessary
-	 * No error checking in ircd is unneccessary ;) -Cabal95
-	 */
-	if (!lp)
-	  sendto_ops("WATCH debug error: del_from_watch_hash_table "
-					 "found a watch entry with no client "
-					 "counterpoint processing nick %s on client %p!",
-					 nick, client->user);
-	else {
-		if (!last) /* First one matched */
-		  client->local->watch = lp->next;
-		else
-		  last->next = lp->next;
-		free_link(lp);
-	}
+	  last->next_entry = wl->next_entry;
+
+	/* ...and from the nick's watcher list */
+	watch_unlink_watcher(wl);
+	safe_free(wl);
+
 	/* In case this header is now empty of notices, remove it */
-	if (!anptr->watch) {
-		if (!nlast)
-		  watchTable[hashv] = anptr->hnext;
+	if (!anptr->watchers)
+		watch_free_empty_entry(anptr);
+
+	return 0;
+}
+
+/*
+ * hash_del_watch_subscriptions
+ *
+ * Drops every WATCH (monitor == 0) or MONITOR (monitor != 0)
+ * subscription of 'client', used by WATCH C and MONITOR C. Links that
+ * still carry the other subscription kind are kept.
+ */
+int hash_del_watch_subscriptions(Client *client, int monitor)
+{
+	WatchLink *wl, *next, *last = NULL;
+
+	for (wl = client->local->watch; wl; wl = next)
+	{
+		next = wl->next_entry;
+		if (monitor)
+			wl->monitor = 0;
 		else
-		  nlast->hnext = anptr->hnext;
-		safe_free(anptr);
+		{
+			wl->watched = 0;
+			wl->awaynotify = 0;
+		}
+		if (wl->watched || wl->monitor)
+		{
+			last = wl;
+			continue;
+		}
+		if (!last)
+			client->local->watch = next;
+		else
+			last->next_entry = next;
+		watch_unlink_watcher(wl);
+		if (!wl->entry->watchers)
+			watch_free_empty_entry(wl->entry);
+		safe_free(wl);
 	}
-	
-	/* Update count of notifies on nick */
-	client->local->watches--;
-	
+
+	if (monitor)
+		client->local->monitors = 0;
+	else
+		client->local->watches = 0;
+
 	return 0;
 }
 
@@ -815,76 +1320,333 @@ int del_from_watch_hash_table(char *nick, Client *client)
  */
 int   hash_del_watch_list(Client *client)
 {
-	unsigned int   hashv;
-	Watch  *anptr;
-	Link  *np, *lp, *last;
-	
-	
-	if (!(np = client->local->watch))
+	WatchLink *wl, *next;
+
+	if (!(wl = client->local->watch))
 	  return 0;   /* Nothing to do */
-	
+
 	client->local->watch = NULL; /* Break the watch-list for client */
-	while (np) {
-		/* Find the watch-record from hash-table... */
-		anptr = np->value.wptr;
-		last = NULL;
-		for (lp = anptr->watch; lp && (lp->value.client != client);
-			  lp = lp->next)
-		  last = lp;
-		
-		/* Not found, another "worst case" debug error */
-		if (!lp)
-		  sendto_ops("WATCH Debug error: hash_del_watch_list "
-						 "found a WATCH entry with no table "
-						 "counterpoint processing client %s!",
-						 client->name);
-		else {
-			/* Fix the watch-list and remove entry */
-			if (!last)
-			  anptr->watch = lp->next;
-			else
-			  last->next = lp->next;
-			free_link(lp);
-			
-			/*
-			 * If this leaves a header without notifies,
-			 * remove it. Need to find the last-pointer!
-			 */
-			if (!anptr->watch) {
-				Watch  *np2, *nl;
-				
-				hashv = hash_watch_nick_name(anptr->nick);
-				
-				nl = NULL;
-				np2 = watchTable[hashv];
-				while (np2 != anptr) {
-					nl = np2;
-					np2 = np2->hnext;
-				}
-				
-				if (nl)
-				  nl->hnext = anptr->hnext;
-				else
-				  watchTable[hashv] = anptr->hnext;
-				safe_free(anptr);
-			}
-		}
-		
-		lp = np; /* Save last pointer processed */
-		np = np->next; /* Jump to the next pointer */
-		free_link(lp); /* Free the previous */
+	for (; wl; wl = next)
+	{
+		next = wl->next_entry;
+		watch_unlink_watcher(wl);
+		if (!wl->entry->watchers)
+			watch_free_empty_entry(wl->entry);
+		safe_free(wl);
 	}
-	
+
 	client->local->watches = 0;
-	
+	client->local->monitors = 0;
+
 	return 0;
 }
 
-/* Throttling - originally by Stskeeps */
+/* == WHO index ==
+ * Secondary indexes over online users: account name, IP and host(s).
+ * A WHO query with an exact (wildcard-free) term on one of these can
+ * then visit just the clients filed under that key instead of scanning
+ * the whole client list. Users are filed by register_user(), re-filed
+ * by userhost_changed() and user_account_login(), and removed by
+ * free_user() on exit.
+ */
+
+static uint64_t hash_whoindex_key(const char *key)
+{
+	return siphash_nocase(key, siphashkey_whoindex) % WHO_INDEX_TABLE_SIZE;
+}
+
+/** Files 'client' in index 'type' under 'key' (NULL/empty: unfiled).
+ * Does nothing if the client is already filed under that key.
+ */
+static void whoindex_file(Client *client, int type, const char *key)
+{
+	WhoIndexEntry *e = client->user->who_index[type];
+
+	if (e && key && !strcasecmp(e->key, key))
+		return; /* already filed correctly */
+
+	if (e)
+	{
+		DelListItem(e, whoIndexTable[type][hash_whoindex_key(e->key)]);
+		safe_free(e->key);
+		safe_free(e);
+		client->user->who_index[type] = NULL;
+	}
+
+	if (!key || !*key)
+		return;
+
+	e = safe_alloc(sizeof(WhoIndexEntry));
+	e->client = client;
+	safe_strdup(e->key, key);
+	AddListItem(e, whoIndexTable[type][hash_whoindex_key(key)]);
+	client->user->who_index[type] = e;
+}
+
+/** (Re)files 'client' in the WHO indexes under its current account,
+ * IP, visible host and real host. Cheap if nothing changed.
+ */
+void whoindex_update(Client *client)
+{
+	char *account = NULL;
+
+	if (!client->user)
+		return;
+
+	if (!BadPtr(client->user->svid) && !isdigit(*client->user->svid))
+		account = client->user->svid;
+	whoindex_file(client, WHOINDEX_ACCOUNT, account);
+	whoindex_file(client, WHOINDEX_IP, client->ip);
+	whoindex_file(client, WHOINDEX_HOST, GetHost(client));
+	whoindex_file(client, WHOINDEX_REALHOST, client->user->realhost);
+}
+
+/** Removes 'client' from all WHO indexes (on exit). */
+void whoindex_remove(Client *client)
+{
+	int type;
+
+	if (!client->user)
+		return;
+
+	for (type = 0; type < WHOINDEX_MAX; type++)
+		whoindex_file(client, type, NULL);
+}
+
+/** Returns the bucket that exact key 'key' is filed in, or NULL.
+ * The bucket may contain other keys as well: walk the chain and
+ * compare e->key yourself (case insensitively).
+ */
+WhoIndexEntry *whoindex_fetch(int type, const char *key)
+{
+	return whoIndexTable[type][hash_whoindex_key(key)];
+}
+
+/* == Channel size index ==
+ * Channels filed by member count: bucket n holds exactly the channels
+ * with n members, the last bucket collects everything bigger. /LIST
+ * serves its results from this index, which lets it skip entire
+ * buckets when a user count filter (>n or <n) is given instead of
+ * walking the whole channel hash. Channels are filed at creation,
+ * re-filed as members come and go, and unfiled on destruction - all
+ * from src/channel.c.
+ */
+
+static unsigned int channel_sizeindex_pick_bucket(Channel *channel)
+{
+	return MIN(channel->users, LIST_SIZE_INDEX_BUCKETS - 1);
+}
+
+/** File a (newly created) channel in the size index */
+void channel_sizeindex_add(Channel *channel)
+{
+	unsigned int bucket = channel_sizeindex_pick_bucket(channel);
+
+	channel->lidx_bucket = bucket;
+	channel->lidx_prev = NULL;
+	channel->lidx_next = chanSizeIndex[bucket];
+	if (channel->lidx_next)
+		channel->lidx_next->lidx_prev = channel;
+	chanSizeIndex[bucket] = channel;
+}
 
-/* Note that we call this set::anti-flood::connect-flood nowadays */
+/** Unfile a channel from the size index (prior to destruction) */
+void channel_sizeindex_del(Channel *channel)
+{
+	if (channel->lidx_prev)
+		channel->lidx_prev->lidx_next = channel->lidx_next;
+	else
+		chanSizeIndex[channel->lidx_bucket] = channel->lidx_next;
+	if (channel->lidx_next)
+		channel->lidx_next->lidx_prev = channel->lidx_prev;
+	channel->lidx_prev = channel->lidx_next = NULL;
+}
 
-struct MODVAR ThrottlingBucket *ThrottlingHash[THROTTLING_HASH_TABLE_SIZE];
+/** Re-file a channel after its member count changed (cheap no-op if
+ * the count still maps to the same bucket).
+ */
+void channel_sizeindex_update(Channel *channel)
+{
+	if (channel->lidx_bucket == channel_sizeindex_pick_bucket(channel))
+		return;
+	channel_sizeindex_del(channel);
+	channel_sizeindex_add(channel);
+}
+
+/** Returns the channels with 'bucket' members. The last bucket holds
+ * every channel with LIST_SIZE_INDEX_BUCKETS-1 members or more.
+ */
+Channel *channel_sizeindex_bucket(unsigned int bucket)
+{
+	return chanSizeIndex[bucket];
+}
+
+/* Unified per-IP state table.
+ * One connecting IP used to be hashed and probed in several separate
+ * IP-keyed tables: connect-flood throttling below, the reputation
+ * module's score table, and so on. Here subsystems request a slot once
+ * (by name, so module reloads get the same slot back) and attach their
+ * record to the single shared entry for that IP. The registration hot
+ * path then hashes the address once and finds everything in one probe.
+ * An entry is freed automatically when its last slot is detached.
+ */
+
+typedef struct IpStateSlot IpStateSlot;
+struct IpStateSlot {
+	char *name;			/**< Subsystem name, eg "reputation" */
+	void (*free_data)(void *data);	/**< How to free a record, NULL = plain safe_free() */
+};
+static IpStateSlot ipstate_slots[IPSTATE_MAX_SLOTS];
+
+/** Request a slot in the per-IP state table.
+ * @param name      Name of the subsystem, eg "reputation".
+ * @param free_data Function to free an attached record,
+ *                  or NULL if a plain safe_free() suffices.
+ * @returns The slot number to use with ipstate_get() and friends,
+ *          or -1 if all slots are taken.
+ * Requesting a name again returns the existing slot (with the free
+ * callback updated), so records survive a module reload. Slots are
+ * never released.
+ */
+int ipstate_slot_request(char *name, void (*free_data)(void *data))
+{
+	int i;
+
+	for (i = 0; i < IPSTATE_MAX_SLOTS; i++)
+	{
+		if (ipstate_slots[i].name && !strcmp(ipstate_slots[i].name, name))
+		{
+			ipstate_slots[i].free_data = free_data; /* callback may have moved (module reload) */
+			return i;
+		}
+	}
+	for (i = 0; i < IPSTATE_MAX_SLOTS; i++)
+	{
+		if (!ipstate_slots[i].name)
+		{
+			safe_strdup(ipstate_slots[i].name, name);
+			ipstate_slots[i].free_data = free_data;
+			return i;
+		}
+	}
+	return -1;
+}
+
+static uint64_t hash_ipstate(char *ip)
+{
+	return siphash(ip, siphashkey_ipstate) % IPSTATE_HASH_TABLE_SIZE;
+}
+
+/** Find the shared state entry for an IP, or NULL if none exists.
+ * Useful when a caller wants to check multiple slots on one probe.
+ */
+IpStateEntry *find_ipstate(char *ip)
+{
+	IpStateEntry *e;
+
+	for (e = IpStateHash[hash_ipstate(ip)]; e; e = e->next)
+		if (!strcmp(e->ip, ip))
+			return e;
+
+	return NULL;
+}
+
+/** Get the record a subsystem attached to this IP, or NULL */
+void *ipstate_get(char *ip, int slot)
+{
+	IpStateEntry *e = find_ipstate(ip);
+
+	return e ? e->data[slot] : NULL;
+}
+
+static void ipstate_free_data(int slot, void *data)
+{
+	if (ipstate_slots[slot].free_data)
+		ipstate_slots[slot].free_data(data);
+	else
+		safe_free(data);
+}
+
+/** Free an entry if no subsystem has anything attached to it anymore */
+static void ipstate_free_entry_if_empty(IpStateEntry *e)
+{
+	int i;
+
+	for (i = 0; i < IPSTATE_MAX_SLOTS; i++)
+		if (e->data[i])
+			return;
+
+	DelListItem(e, IpStateHash[hash_ipstate(e->ip)]);
+	safe_free(e->ip);
+	safe_free(e);
+}
+
+/** Attach a record to (or detach from, if data is NULL) an IP.
+ * Any previously attached record in the slot is freed first.
+ */
+void ipstate_set(char *ip, int slot, void *data)
+{
+	IpStateEntry *e = find_ipstate(ip);
+
+	if (!e)
+	{
+		if (!data)
+			return; /* nothing to detach */
+		e = safe_alloc(sizeof(IpStateEntry));
+		safe_strdup(e->ip, ip);
+		AddListItem(e, IpStateHash[hash_ipstate(ip)]);
+	}
+
+	if (e->data[slot] && (e->data[slot] != data))
+		ipstate_free_data(slot, e->data[slot]);
+	e->data[slot] = data;
+
+	if (!data)
+		ipstate_free_entry_if_empty(e);
+}
+
+/** Walk the records attached in a slot for a range of hash buckets.
+ * Like ipstate_iterate() but only visits buckets 'first' up to and
+ * including 'last', so subsystems can spread a full sweep over
+ * multiple event ticks instead of walking the whole table at once.
+ */
+void ipstate_iterate_range(int slot, int first, int last, int (*cb)(char *ip, void *data, void *arg), void *arg)
+{
+	IpStateEntry *e, *e_next;
+	int i;
+
+	for (i = first; (i <= last) && (i < IPSTATE_HASH_TABLE_SIZE); i++)
+	{
+		for (e = IpStateHash[i]; e; e = e_next)
+		{
+			e_next = e->next;
+			if (!e->data[slot])
+				continue;
+			if (cb(e->ip, e->data[slot], arg))
+			{
+				ipstate_free_data(slot, e->data[slot]);
+				e->data[slot] = NULL;
+				ipstate_free_entry_if_empty(e);
+			}
+		}
+	}
+}
+
+/** Walk all records attached in a slot.
+ * The callback receives the IP, the record and 'arg'. If it returns
+ * non-zero the record is detached and freed (and the entry too, if
+ * this was the last record) - this is how subsystems expire entries.
+ */
+void ipstate_iterate(int slot, int (*cb)(char *ip, void *data, void *arg), void *arg)
+{
+	ipstate_iterate_range(slot, 0, IPSTATE_HASH_TABLE_SIZE - 1, cb, arg);
+}
+
+/* Throttling - originally by Stskeeps */
+
+/* Note that we call this set::anti-flood::connect-flood nowadays.
+ * The buckets live in the unified per-IP state table above.
+ */
 
 void update_throttling_timer_settings(void)
 {
@@ -917,45 +1679,23 @@ void init_throttling()
 	 */
 }
 
-uint64_t hash_throttling(char *ip)
+struct ThrottlingBucket *find_throttling_bucket(Client *client)
 {
-	return siphash(ip, siphashkey_throttling) % THROTTLING_HASH_TABLE_SIZE;
+	return ipstate_get(client->ip, throttling_slot);
 }
 
-struct ThrottlingBucket *find_throttling_bucket(Client *client)
+static int throttling_expire_cb(char *ip, void *data, void *arg)
 {
-	int hash = 0;
-	struct ThrottlingBucket *p;
-	hash = hash_throttling(client->ip);
-	
-	for (p = ThrottlingHash[hash]; p; p = p->next)
-	{
-		if (!strcmp(p->ip, client->ip))
-			return p;
-	}
-	
-	return NULL;
+	struct ThrottlingBucket *n = data;
+
+	return (TStime() - n->since) > (THROTTLING_PERIOD ? THROTTLING_PERIOD : 15);
 }
 
 EVENT(throttling_check_expire)
 {
-	struct ThrottlingBucket *n, *n_next;
-	int	i;
 	static time_t t = 0;
-		
-	for (i = 0; i < THROTTLING_HASH_TABLE_SIZE; i++)
-	{
-		for (n = ThrottlingHash[i]; n; n = n_next)
-		{
-			n_next = n->next;
-			if ((TStime() - n->since) > (THROTTLING_PERIOD ? THROTTLING_PERIOD : 15))
-			{
-				DelListItem(n, ThrottlingHash[i]);
-				safe_free(n->ip);
-				safe_free(n);
-			}
-		}
-	}
+
+	ipstate_iterate(throttling_slot, throttling_expire_cb, NULL);
 
 	if (!t || (TStime() - t > 30))
 	{
@@ -986,16 +1726,12 @@ EVENT(throttling_check_expire)
 
 void add_throttling_bucket(Client *client)
 {
-	int hash;
 	struct ThrottlingBucket *n;
 
-	n = safe_alloc(sizeof(struct ThrottlingBucket));	
-	n->next = n->prev = NULL; 
-	safe_strdup(n->ip, client->ip);
+	n = safe_alloc(sizeof(struct ThrottlingBucket));
 	n->since = TStime();
 	n->count = 1;
-	hash = hash_throttling(client->ip);
-	AddListItem(n, ThrottlingHash[hash]);
+	ipstate_set(client->ip, throttling_slot, n);
 	return;
 }
 
@@ -31,6 +31,7 @@ int  SVSNOOP = 0;
 extern MODVAR char *buildid;
 time_t timeofday = 0;
 struct timeval timeofday_tv;
+MODVAR long long monotime_ms = 0; /**< Cached monotonic clock (msec), see MonoTime() */
 int  tainted = 0;
 LoopStruct loop;
 MODVAR MemoryInfo StatsZ;
@@ -60,6 +61,7 @@ static void open_debugfile(), setup_signals();
 extern void init_glines(void);
 extern void tkl_init(void);
 extern void process_clients(void);
+extern void unrealdns_savecache(void);
 
 #ifndef _WIN32
 MODVAR char **myargv;
@@ -76,6 +78,8 @@ MODVAR int  booted = FALSE;
 
 void s_die()
 {
+	unrealdns_savecache(); /* keep the DNS cache warm across restarts */
+	ircd_log_flush(); /* we may not get another 'log_flush' event */
 #ifdef _WIN32
 	Client *client;
 	if (!IsService)
@@ -124,6 +128,205 @@ static void s_reloadcert()
 }
 #endif // #ifndef _WIN32
 
+/* == Sampling profiler ==
+ * Toggled at runtime with SIGUSR2: the first signal starts sampling,
+ * the second one stops it and writes a ranked report to the ircd log.
+ * Samples are taken from a SIGPROF interval timer (CPU time, so an
+ * idle server is never interrupted) and attributed to the command
+ * parse2() is currently running and the hook currently being
+ * dispatched by the RunHook* macros. This gives a per-command /
+ * per-hook CPU breakdown on a live server without attaching external
+ * tooling or pausing the process.
+ */
+#define PROFILING_HZ 1999	/* not a round number, to avoid sampling in lockstep with our timers */
+
+MODVAR RealCommand * volatile profiling_current_command = NULL;
+MODVAR volatile int profiling_current_hooktype = -1;
+
+/* Per-hook dispatch statistics, see slowtrace_hook_begin()/_end() */
+MODVAR long long hook_dispatch_calls[MAXHOOKTYPES];
+MODVAR long long hook_dispatch_usec[MAXHOOKTYPES];
+
+#ifndef _WIN32
+static volatile long long profiling_total_samples = 0;
+static volatile long long profiling_other_samples = 0;
+static volatile long long profiling_hook_samples[MAXHOOKTYPES];
+static int profiling_active = 0;
+static int doprofiling = 0;
+static time_t profiling_started = 0;
+
+/** SIGPROF handler: one counter increment per sample, nothing else */
+static void s_profsample()
+{
+	RealCommand *cmd = profiling_current_command;
+	int hooktype = profiling_current_hooktype;
+
+	profiling_total_samples++;
+	if (cmd)
+		cmd->profiling_samples++;
+	else
+		profiling_other_samples++;
+	if ((hooktype >= 0) && (hooktype < MAXHOOKTYPES))
+		profiling_hook_samples[hooktype]++;
+}
+
+static void s_profile()
+{
+	struct sigaction act;
+	doprofiling = 1;
+	act.sa_handler = s_profile;
+	act.sa_flags = 0;
+	(void)sigemptyset(&act.sa_mask);
+	(void)sigaddset(&act.sa_mask, SIGUSR2);
+	(void)sigaction(SIGUSR2, &act, NULL);
+}
+
+static void profiling_start(void)
+{
+	struct sigaction act;
+	struct itimerval tv;
+	RealCommand *cmptr;
+	int i;
+
+	/* Reset leftovers from a previous run */
+	for (i = 0; i < 256; i++)
+		for (cmptr = CommandHash[i]; cmptr; cmptr = cmptr->next)
+			cmptr->profiling_samples = 0;
+	memset((void *)profiling_hook_samples, 0, sizeof(profiling_hook_samples));
+	profiling_total_samples = profiling_other_samples = 0;
+
+	act.sa_handler = s_profsample;
+	act.sa_flags = SA_RESTART;
+	(void)sigemptyset(&act.sa_mask);
+	(void)sigaction(SIGPROF, &act, NULL);
+
+	tv.it_interval.tv_sec = 0;
+	tv.it_interval.tv_usec = 1000000 / PROFILING_HZ;
+	tv.it_value = tv.it_interval;
+	setitimer(ITIMER_PROF, &tv, NULL);
+
+	profiling_active = 1;
+	profiling_started = TStime();
+	sendto_realops("Sampling profiler started at %d Hz - send SIGUSR2 again to stop and dump the report", PROFILING_HZ);
+}
+
+static int profiling_cmd_cmp(const void *a, const void *b)
+{
+	const RealCommand *ca = *(RealCommand * const *)a;
+	const RealCommand *cb = *(RealCommand * const *)b;
+
+	if (ca->profiling_samples != cb->profiling_samples)
+		return (ca->profiling_samples < cb->profiling_samples) ? 1 : -1;
+	return strcmp(ca->cmd, cb->cmd);
+}
+
+typedef struct ProfilingHookCount {
+	int hooktype;
+	long long samples;
+} ProfilingHookCount;
+
+static int profiling_hook_cmp(const void *a, const void *b)
+{
+	const ProfilingHookCount *ha = a;
+	const ProfilingHookCount *hb = b;
+
+	if (ha->samples != hb->samples)
+		return (ha->samples < hb->samples) ? 1 : -1;
+	return ha->hooktype - hb->hooktype;
+}
+
+/** Returns the registered name for custom hooktypes, or NULL for the
+ * built-in HOOKTYPE_* ones (which only exist as numeric defines).
+ */
+static const char *profiling_hook_name(int hooktype)
+{
+	Hooktype *h;
+
+	for (h = Hooktypes; h->string; h++)
+		if (h->id == hooktype)
+			return h->string;
+	return NULL;
+}
+
+static void profiling_stop_and_report(void)
+{
+	struct itimerval tv;
+	RealCommand *cmds[1024];
+	ProfilingHookCount hooks[MAXHOOKTYPES];
+	RealCommand *cmptr;
+	long long total;
+	int i, n, shown;
+
+	memset(&tv, 0, sizeof(tv));
+	setitimer(ITIMER_PROF, &tv, NULL);
+	profiling_active = 0;
+
+	total = profiling_total_samples;
+	sendto_realops("Sampling profiler stopped: %lld samples over %lld seconds - report written to the ircd log",
+	    total, (long long)(TStime() - profiling_started));
+	ircd_log(LOG_ERROR, "PROFILE: %lld CPU samples at %d Hz over %lld seconds",
+	    total, PROFILING_HZ, (long long)(TStime() - profiling_started));
+	if (!total)
+		return;
+
+	n = 0;
+	for (i = 0; i < 256; i++)
+		for (cmptr = CommandHash[i]; cmptr; cmptr = cmptr->next)
+			if (cmptr->profiling_samples && (n < 1024))
+				cmds[n++] = cmptr;
+	qsort(cmds, n, sizeof(RealCommand *), profiling_cmd_cmp);
+
+	shown = (n > 20) ? 20 : n;
+	for (i = 0; i < shown; i++)
+		ircd_log(LOG_ERROR, "PROFILE: %6.2f%% %10lld  command %s",
+		    (double)cmds[i]->profiling_samples * 100.0 / total,
+		    cmds[i]->profiling_samples, cmds[i]->cmd);
+	ircd_log(LOG_ERROR, "PROFILE: %6.2f%% %10lld  (outside any command: event loop, I/O, timers)",
+	    (double)profiling_other_samples * 100.0 / total,
+	    (long long)profiling_other_samples);
+
+	/* Hook breakdown. Hook time is also part of whatever command (or
+	 * event) dispatched the hook, so this section overlaps the above.
+	 */
+	n = 0;
+	for (i = 0; i < MAXHOOKTYPES; i++)
+	{
+		if (profiling_hook_samples[i])
+		{
+			hooks[n].hooktype = i;
+			hooks[n].samples = profiling_hook_samples[i];
+			n++;
+		}
+	}
+	qsort(hooks, n, sizeof(ProfilingHookCount), profiling_hook_cmp);
+	shown = (n > 20) ? 20 : n;
+	for (i = 0; i < shown; i++)
+	{
+		const char *name = profiling_hook_name(hooks[i].hooktype);
+		char extra[64];
+
+		/* Cumulative time is only gathered while slow-command-trace-time
+		 * is active, so it may be absent even for busy hooks.
+		 */
+		if (hook_dispatch_usec[hooks[i].hooktype])
+			ircsnprintf(extra, sizeof(extra), " - %lld dispatches, %lldms traced",
+			    hook_dispatch_calls[hooks[i].hooktype],
+			    hook_dispatch_usec[hooks[i].hooktype] / 1000);
+		else
+			ircsnprintf(extra, sizeof(extra), " - %lld dispatches",
+			    hook_dispatch_calls[hooks[i].hooktype]);
+		if (name)
+			ircd_log(LOG_ERROR, "PROFILE: %6.2f%% %10lld  hook %s%s",
+			    (double)hooks[i].samples * 100.0 / total,
+			    hooks[i].samples, name, extra);
+		else
+			ircd_log(LOG_ERROR, "PROFILE: %6.2f%% %10lld  hooktype %d (see HOOKTYPE_* in include/modules.h)%s",
+			    (double)hooks[i].samples * 100.0 / total,
+			    hooks[i].samples, hooks[i].hooktype, extra);
+	}
+}
+#endif // #ifndef _WIN32
+
 void restart(char *mesg)
 {
 	server_reboot(mesg);
@@ -177,6 +380,9 @@ void server_reboot(char *mesg)
 	sendto_realops("Aieeeee!!!  Restarting server... %s", mesg);
 	Debug((DEBUG_NOTICE, "Restarting server... %s", mesg));
 
+	unrealdns_savecache(); /* keep the DNS cache warm across restarts */
+	ircd_log_flush(); /* we may not get another 'log_flush' event */
+
 	list_for_each_entry(client, &lclient_list, lclient_node)
 		(void) send_queued(client);
 
@@ -188,8 +394,16 @@ void server_reboot(char *mesg)
 	(void)closelog();
 #endif
 #ifndef _WIN32
+	/* Hand the bound listening sockets over to the new binary so
+	 * connecting clients never hit a window without a listener.
+	 */
+	prepare_listener_handover();
 	for (i = 3; i < MAXCONNECTIONS; i++)
+	{
+		if (is_handover_listener_fd(i))
+			continue;
 		(void)close(i);
+	}
 	if (!(bootopt & (BOOT_TTY | BOOT_DEBUG)))
 		(void)close(2);
 	(void)close(1);
@@ -285,6 +499,12 @@ EVENT(try_connections)
 	int  confrq;
 	ConfigItem_class *class;
 
+	/* One memoization round for the whole tick: server/oper state
+	 * cannot change while we walk the link blocks below, and the same
+	 * crule subexpressions recur across them (see src/crule.c).
+	 */
+	crule_eval_begin_round();
+
 	for (aconf = conf_link; aconf; aconf = aconf->next)
 	{
 		/* We're only interested in autoconnect blocks that are valid (and ignore temporary link blocks) */
@@ -380,33 +600,14 @@ int match_tkls(Client *client)
 	return 0;
 }
 
-/** Time out connections that are still in handshake.
+/** Ping individual user, and check for ping timeout.
+ * @returns The number of seconds until this client needs to be looked
+ * at again, or -1 if the client was exited.
  */
-EVENT(handshake_timeout)
-{
-	Client *client, *next;
-
-	list_for_each_entry_safe(client, next, &unknown_list, lclient_node)
-	{
-		if (client->local->firsttime && ((TStime() - client->local->firsttime) > iConf.handshake_timeout))
-		{
-			if (client->serv && *client->serv->by)
-			{
-				/* If this is a handshake timeout to an outgoing server then notify ops & log it */
-				sendto_ops_and_log("Connection handshake timeout while trying to link to server '%s' (%s)",
-					client->name, client->ip?client->ip:"<unknown ip>");
-			}
-
-			exit_client(client, NULL, "Registration Timeout");
-			continue;
-		}
-	}
-}
-
-/** Ping individual user, and check for ping timeout */
-void check_ping(Client *client)
+int check_ping(Client *client)
 {
 	char scratch[64];
+	long t;
 	int ping = 0;
 
 	ping = client->local->class ? client->local->class->pingfreq : iConf.handshake_timeout;
@@ -416,7 +617,7 @@ void check_ping(Client *client)
 
 	/* If ping is less than or equal to the last time we received a command from them */
 	if (ping > (TStime() - client->local->lasttime))
-		return; /* some recent command was executed */
+		return ping - (TStime() - client->local->lasttime); /* some recent command was executed */
 
 	if (
 		/* If we have sent a ping */
@@ -442,7 +643,7 @@ void check_ping(Client *client)
 		ircsnprintf(scratch, sizeof(scratch), "Ping timeout: %lld seconds",
 			(long long) (TStime() - client->local->lasttime));
 		exit_client(client, NULL, scratch);
-		return;
+		return -1;
 	}
 	else if (IsRegistered(client) && !IsPingSent(client))
 	{
@@ -463,30 +664,113 @@ void check_ping(Client *client)
 			get_client_name(client, FALSE), PINGWARNING);
 	}
 
-	return;
+	/* Next point of interest: the 2 x pingfreq final timeout, or the
+	 * ping warning if that comes first (both measured from lasttime).
+	 */
+	t = (client->local->lasttime + 2 * ping) - TStime();
+	if (!IsPingWarning(client) && PINGWARNING > 0 &&
+	    (IsServer(client) || IsHandshake(client) || IsConnecting(client) ||
+	     IsTLSConnectHandshake(client)))
+	{
+		t = MIN(t, (client->local->lasttime + ping + PINGWARNING) - TStime());
+	}
+	if (!IsRegistered(client))
+		t = MIN(t, (client->local->since + ping) - TStime());
+	return MAX(t, 1);
+}
+
+/** Per-client timer: registration timeout, sending PINGs and ping timeout.
+ * This used to be done by sweeping all of lclient_list every second
+ * (check_pings), which is a cache-miss storm with many thousands of
+ * clients. Instead every client now has its own timer which reschedules
+ * itself for the next moment something can actually be due, so each
+ * event tick only touches clients whose deadline elapsed.
+ */
+static EVENT(client_check)
+{
+	Client *client = data;
+	long next;
+
+	if (!IsRegistered(client))
+	{
+		/* Still in handshake: time out the registration if needed.. */
+		if (client->local->firsttime && ((TStime() - client->local->firsttime) > iConf.handshake_timeout))
+		{
+			if (client->serv && *client->serv->by)
+			{
+				/* If this is a handshake timeout to an outgoing server then notify ops & log it */
+				sendto_ops_and_log("Connection handshake timeout while trying to link to server '%s' (%s)",
+					client->name, client->ip?client->ip:"<unknown ip>");
+			}
+
+			exit_client(client, NULL, "Registration Timeout");
+			return;
+		}
+		/* ..and stay at 1 second granularity until registered:
+		 * the handshake state can change at any moment and the
+		 * number of clients in handshake is always small.
+		 */
+		next = 1;
+	} else
+	{
+		next = check_ping(client);
+		if (next == -1)
+			return; /* client was exited (and our event deleted) */
+	}
+
+	/* Reschedule ourselves: RunEvent() picks this up when we return */
+	client->local->check_event->every_msec = next * 1000;
+}
+
+/** Start the per-client ping / timeout timer for a newly accepted or
+ * initiated connection. The timer lives until free_client().
+ */
+void client_check_start(Client *client)
+{
+	client->local->check_event = EventAdd(NULL, "client_check", client_check, client, 1000, 0);
 }
 
 /*
- * Check registered connections for PING timeout.
- * XXX: also does some other stuff still, need to sort this.  --nenolod
- * Perhaps it would be wise to ping servers as well mr nenolod, just an idea -- Syzop
+ * Check all local connections against newly added TKL's.
+ * Ping timeout checking, which used to live here too, is handled by the
+ * per-client 'client_check' timers nowadays, so this sweep only does
+ * real work right after a ban or spamfilter was added.
  */
 EVENT(check_pings)
 {
-	Client *client, *next;
+	static Client **snapshot = NULL;
+	static int snapshot_size = 0;
+	Client *client;
+	int i, n;
 
-	list_for_each_entry_safe(client, next, &lclient_list, lclient_node)
+	if (!loop.do_bancheck && !loop.do_bancheck_spamf_user && !loop.do_bancheck_spamf_away)
+		return;
+
+	/* Sweep over a snapshot of the dense local client mirror:
+	 * match_tkls() may kill any number of clients, which swap-removes
+	 * entries from lclient_array mid-sweep. Killed clients are only
+	 * freed later in the main loop (dead_list), so validating the
+	 * remembered slot is enough to skip them safely.
+	 */
+	if (snapshot_size < lclient_array.count)
 	{
-		/* Check TKLs for this user */
-		if (loop.do_bancheck && match_tkls(client))
-			continue;
-		check_ping(client);
-		/* don't touch 'client' after this as it may have been killed */
+		safe_free(snapshot);
+		snapshot_size = lclient_array.allocated;
+		snapshot = safe_alloc(sizeof(Client *) * snapshot_size);
 	}
+	n = lclient_array.count;
+	if (n)
+		memcpy(snapshot, lclient_array.items, sizeof(Client *) * n);
 
-	list_for_each_entry_safe(client, next, &server_list, special_node)
+	for (i = 0; i < n; i++)
 	{
-		check_ping(client);
+		client = snapshot[i];
+		if (client->local->lclient_array_pos == -1)
+			continue; /* killed earlier in this sweep */
+		/* Check TKLs for this user */
+		if (match_tkls(client))
+			continue;
+		/* don't touch 'client' after this as it may have been killed */
 	}
 
 	loop.do_bancheck = loop.do_bancheck_spamf_user = loop.do_bancheck_spamf_away = 0;
@@ -529,7 +813,13 @@ EVENT(check_deadsockets)
 	 * The client is already out of all lists (channels, invites, etc etc)
 	 * and 90% has been freed. Here we actually free the remaining parts.
 	 * We don't have to send anything anymore.
+	 * Postponed while deferred netsplit exits are still queued: the
+	 * queued clients may still reference clients on the dead list
+	 * (such as their srvptr).
 	 */
+	if (pending_exits_queued())
+		return;
+
 	list_for_each_entry_safe(client, next, &dead_list, client_node)
 	{
 		if (!IsDead(client))
@@ -677,12 +967,20 @@ extern MODVAR Event *events;
  * are absolutely cruicial when the clock is adjusted - particularly
  * when the clock goes backwards. -- Syzop
  */
+static int fix_throttling_timer_cb(char *ip, void *data, void *arg)
+{
+	struct ThrottlingBucket *thr = data;
+
+	if (thr->since > TStime())
+		thr->since = TStime();
+	return 0;
+}
+
 void fix_timers(void)
 {
-	int i, cnt;
+	int cnt;
 	Client *client;
 	Event *e;
-	struct ThrottlingBucket *thr;
 	ConfigItem_link *lnk;
 
 	list_for_each_entry(client, &lclient_list, lclient_node)
@@ -734,6 +1032,8 @@ void fix_timers(void)
 			e->last_run.tv_usec = 0;
 		}
 	}
+	/* ..and re-derive the timer wheel from the new clock */
+	EventFixTimers();
 
 	/* For throttling we only have to deal with time jumping backward, which
 	 * is a real problem as if the jump was, say, 900 seconds, then it would
@@ -742,14 +1042,7 @@ void fix_timers(void)
 	 * sonner than we should.
 	 */
 	cnt = 0;
-	for (i = 0; i < THROTTLING_HASH_TABLE_SIZE; i++)
-	{
-		for (thr = ThrottlingHash[i]; thr; thr = thr->next)
-		{
-			if (thr->since > TStime())
-				thr->since = TStime();
-		}
-	}
+	ipstate_iterate(ipstate_slot_request("throttle", NULL), fix_throttling_timer_cb, NULL);
 	Debug((DEBUG_DEBUG, "fix_timers(): removed %d throttling item(s)", cnt));
 
 	/* Make sure autoconnect for servers still works (lnk->hold) */
@@ -918,6 +1211,154 @@ int minimum_msec_since_last_run(struct timeval *tv_old, long minimum)
 	return 0;
 }
 
+/* == Boot phase profiler ==
+ * Every restart is a user-visible netsplit, so when boot time regresses
+ * we want the log to answer which phase is to blame. main() brackets
+ * the major startup phases with boot_phase() calls; the wall clock and
+ * CPU time per phase are logged once the server is up and can be
+ * retrieved later with /STATS boottime. Sub-steps that happen inside a
+ * phase but deserve their own line (like the database reads of modules
+ * being loaded) book their time with boot_phase_credit() and show up
+ * as an 'of which' line.
+ */
+#define BOOTPHASE_MAX 24
+
+typedef struct BootPhase BootPhase;
+struct BootPhase {
+	const char *name;
+	long long wall_usec;
+	long long cpu_usec;
+	int credit; /**< 1 = booked via boot_phase_credit(), already part of a phase total */
+};
+
+static BootPhase bootphases[BOOTPHASE_MAX];
+static int num_bootphases = 0;
+static int bootphase_open = -1; /**< Index of the phase being measured, -1 if none */
+static int bootphase_finished = 0;
+static struct timeval bootphase_wall;
+static long long bootphase_cpu;
+
+/** Returns the CPU time (user+system) we used so far, in microseconds */
+long long boot_phase_cpu_now(void)
+{
+#ifndef _WIN32
+	struct rusage r;
+
+	if (getrusage(RUSAGE_SELF, &r))
+		return 0;
+	return (long long)r.ru_utime.tv_sec * 1000000 + r.ru_utime.tv_usec +
+	       (long long)r.ru_stime.tv_sec * 1000000 + r.ru_stime.tv_usec;
+#else
+	return 0;
+#endif
+}
+
+/** Ends the boot phase being measured and starts 'name', NULL to just end */
+void boot_phase(const char *name)
+{
+	struct timeval now;
+	long long cpu = boot_phase_cpu_now();
+
+	if (bootphase_finished)
+		return;
+
+	gettimeofday(&now, NULL);
+	if (bootphase_open >= 0)
+	{
+		BootPhase *bp = &bootphases[bootphase_open];
+		bp->wall_usec = (long long)(now.tv_sec - bootphase_wall.tv_sec) * 1000000 +
+		                (now.tv_usec - bootphase_wall.tv_usec);
+		bp->cpu_usec = cpu - bootphase_cpu;
+		bootphase_open = -1;
+	}
+	if (!name)
+	{
+		bootphase_finished = 1;
+		return;
+	}
+	if (num_bootphases < BOOTPHASE_MAX)
+	{
+		memset(&bootphases[num_bootphases], 0, sizeof(BootPhase));
+		bootphases[num_bootphases].name = name;
+		bootphase_open = num_bootphases;
+		num_bootphases++;
+	}
+	bootphase_wall = now;
+	bootphase_cpu = cpu;
+}
+
+/** Attributes time spent on a named sub-step to the boot report.
+ * The time is already part of the surrounding phase, this just gives
+ * it its own 'of which' line. Safe to call after boot: it is then a no-op.
+ */
+void boot_phase_credit(const char *name, long long wall_usec, long long cpu_usec)
+{
+	int i;
+
+	if (bootphase_finished)
+		return;
+
+	for (i = 0; i < num_bootphases; i++)
+	{
+		if (bootphases[i].credit && !strcmp(bootphases[i].name, name))
+		{
+			bootphases[i].wall_usec += wall_usec;
+			bootphases[i].cpu_usec += cpu_usec;
+			return;
+		}
+	}
+	if (num_bootphases < BOOTPHASE_MAX)
+	{
+		memset(&bootphases[num_bootphases], 0, sizeof(BootPhase));
+		bootphases[num_bootphases].name = name;
+		bootphases[num_bootphases].wall_usec = wall_usec;
+		bootphases[num_bootphases].cpu_usec = cpu_usec;
+		bootphases[num_bootphases].credit = 1;
+		num_bootphases++;
+	}
+}
+
+/** Logs the boot phase report, called once right after booting */
+static void boot_phase_report_log(void)
+{
+	long long wall = 0, cpu = 0;
+	int i;
+
+	for (i = 0; i < num_bootphases; i++)
+	{
+		if (!bootphases[i].credit)
+		{
+			wall += bootphases[i].wall_usec;
+			cpu += bootphases[i].cpu_usec;
+		}
+	}
+	ircd_log(LOG_ERROR, "Boot took %lld.%03lld ms wall time and %lld.%03lld ms CPU:",
+		wall / 1000, wall % 1000, cpu / 1000, cpu % 1000);
+	for (i = 0; i < num_bootphases; i++)
+	{
+		ircd_log(LOG_ERROR, "  %s%s: %lld.%03lld ms wall, %lld.%03lld ms CPU",
+			bootphases[i].credit ? "of which " : "",
+			bootphases[i].name,
+			bootphases[i].wall_usec / 1000, bootphases[i].wall_usec % 1000,
+			bootphases[i].cpu_usec / 1000, bootphases[i].cpu_usec % 1000);
+	}
+}
+
+/** Sends the boot phase report to 'client', for /STATS boottime */
+void boot_phase_report(Client *client)
+{
+	int i;
+
+	for (i = 0; i < num_bootphases; i++)
+	{
+		sendtxtnumeric(client, "%s%s: %lld.%03lld ms wall, %lld.%03lld ms CPU",
+			bootphases[i].credit ? "of which " : "",
+			bootphases[i].name,
+			bootphases[i].wall_usec / 1000, bootphases[i].wall_usec % 1000,
+			bootphases[i].cpu_usec / 1000, bootphases[i].cpu_usec % 1000);
+	}
+}
+
 /** The main function. This will call SocketLoop() once the server is ready. */
 #ifndef _WIN32
 int main(int argc, char *argv[])
@@ -941,6 +1382,9 @@ int InitUnrealIRCd(int argc, char *argv[])
 
 	gettimeofday(&timeofday_tv, NULL);
 	timeofday = timeofday_tv.tv_sec;
+	monotime_ms = mono_time_coarse_ms();
+
+	boot_phase("early init");
 
 	safe_strdup(configfile, CONFIGFILE);
 
@@ -1013,6 +1457,8 @@ int InitUnrealIRCd(int argc, char *argv[])
 	umode_init();
 	extcmode_init();
 	efunctions_init();
+	memory_counters_init();
+	tracepoints_init();
 	clear_scache_hash_table();
 #ifndef _WIN32
 	/* Make it so we can dump core */
@@ -1254,6 +1700,7 @@ int InitUnrealIRCd(int argc, char *argv[])
 	default_class->sendq = DEFAULT_RECVQ;
 	default_class->name = "default";
 	AddListItem(default_class, conf_class);
+	boot_phase("config read and module open");
 	if (init_conf(configfile, 0) < 0)
 	{
 		exit(-1);
@@ -1278,6 +1725,7 @@ int InitUnrealIRCd(int argc, char *argv[])
 #ifndef _WIN32
 	fprintf(stderr, "Initializing TLS..\n");
 #endif
+	boot_phase("TLS initialization");
 	if (!init_ssl())
 	{
 		config_error("Failed to load SSL/TLS (see errors above). UnrealIRCd can not start.");
@@ -1297,16 +1745,28 @@ int InitUnrealIRCd(int argc, char *argv[])
 #ifndef _WIN32
 	fprintf(stderr, "Dynamic configuration initialized.. booting IRCd.\n");
 #endif
+	boot_phase("listeners and configuration run");
 	open_debugfile();
 	me.local->port = 6667; /* pointless? */
 	init_sys();
 	applymeblock();
 #ifdef HAVE_SYSLOG
 	openlog("ircd", LOG_PID | LOG_NDELAY, LOG_DAEMON);
+#endif
+#ifndef _WIN32
+	/* If the previous instance handed us its listening sockets
+	 * across the restart exec(), adopt whatever still matches a
+	 * listen { } block and close the rest.
+	 */
+	listener_handover_read();
 #endif
 	run_configuration();
+#ifndef _WIN32
+	listener_handover_finish();
+#endif
 	ircd_log(LOG_ERROR, "UnrealIRCd started.");
 
+	boot_phase("motd files");
 	read_motd(conf_files->botmotd_file, &botmotd);
 	read_motd(conf_files->rules_file, &rules);
 	read_motd(conf_files->opermotd_file, &opermotd);
@@ -1331,6 +1791,8 @@ int InitUnrealIRCd(int argc, char *argv[])
 	add_to_client_hash_table(me.name, &me);
 	add_to_id_hash_table(me.id, &me);
 	list_add(&me.client_node, &global_server_list);
+	me.client_array_pos = -1; /* &me is never in the dense client mirrors */
+	me.local->lclient_array_pos = -1;
 #if !defined(_AMIGA) && !defined(_WIN32) && !defined(NO_FORKING)
 	if (!(bootopt & BOOT_NOFORK))
 	{
@@ -1371,7 +1833,10 @@ int InitUnrealIRCd(int argc, char *argv[])
 	PS_STRINGS->ps_nargvstr = 1;
 	PS_STRINGS->ps_argvstr = me.name;
 #endif
+	boot_phase("module load");
 	module_loadall();
+	boot_phase(NULL);
+	boot_phase_report_log();
 
 #ifndef _WIN32
 	SocketLoop(NULL);
@@ -1379,26 +1844,255 @@ int InitUnrealIRCd(int argc, char *argv[])
 	return 1;
 }
 
+/* Main loop latency instrumentation, shown by /STATS latency.
+ * Buckets are powers of two in milliseconds: bucket 0 counts
+ * iterations that were busy for <1 msec, bucket 1 <2 msec, and so on;
+ * the last bucket counts everything above. Time deliberately spent
+ * sleeping in the I/O engine (fd_select_sleep_usec, maintained by
+ * src/dispatch.c) is not counted as busy time.
+ */
+MODVAR long long loop_latency_hist[LOOP_LATENCY_BUCKETS];
+MODVAR long long loop_latency_total_msec = 0;
+MODVAR long long loop_latency_max_msec = 0;
+MODVAR long long loop_latency_stalls = 0;
+
+/** Account one completed main loop iteration that was busy for
+ * 'busy_msec' milliseconds, and warn if it exceeded the
+ * set::loop-stall-warning-time watchdog threshold.
+ */
+static void loop_latency_account(long long busy_msec)
+{
+	int bucket = 0;
+
+	while ((busy_msec >= (1LL << bucket)) && (bucket < LOOP_LATENCY_BUCKETS - 1))
+		bucket++;
+	loop_latency_hist[bucket]++;
+	loop_latency_total_msec += busy_msec;
+
+	if (busy_msec > loop_latency_max_msec)
+		loop_latency_max_msec = busy_msec;
+
+	if (LOOP_STALL_WARNING_TIME && (busy_msec >= LOOP_STALL_WARNING_TIME * 1000))
+	{
+		loop_latency_stalls++;
+		ircd_log(LOG_ERROR, "Main loop stalled for %lld msec (last command processed: %s)",
+			busy_msec, *backupbuf ? backupbuf : "<none>");
+	}
+}
+
+/* Crash flight recorder: a ring of the most recent significant events
+ * (lines processed, server links coming and going, rehashes, module
+ * loads/unloads). It is never read by the running server - its value is
+ * post-mortem: the slots are plain NUL-terminated strings in a global
+ * array, so crashreport.c can decode the tail straight out of a core
+ * file with gdb (see crash_report_flight_recorder) and show what the
+ * server was doing in the seconds before it died. Recording is one
+ * ircsnprintf into a preallocated slot; the position is advanced only
+ * after the slot is complete so a crash mid-write at most costs the
+ * newest entry.
+ */
+MODVAR char flight_recorder[FLIGHT_RECORDER_ENTRIES][FLIGHT_RECORDER_LINELEN];
+MODVAR unsigned int flight_recorder_pos = 0;
+
+/** Record one event in the crash flight recorder (cheap, always on) */
+void flight_record(const char *format, ...)
+{
+	char *slot = flight_recorder[flight_recorder_pos % FLIGHT_RECORDER_ENTRIES];
+	va_list vl;
+	int n;
+
+	n = ircsnprintf(slot, FLIGHT_RECORDER_LINELEN, "[%lld.%03lld] ",
+		(long long)timeofday_tv.tv_sec, (long long)timeofday_tv.tv_usec / 1000);
+	va_start(vl, format);
+	ircvsnprintf(slot + n, FLIGHT_RECORDER_LINELEN - n, format, vl);
+	va_end(vl);
+	flight_recorder_pos++;
+}
+
+/* Slow-command tracer, the flight data recorder for latency forensics.
+ * Whenever a command (timed in parse2) or a hook dispatch (timed by the
+ * RunHook* macros) exceeds the set::slow-command-trace-time budget
+ * (microseconds, 0=off) it is recorded in a small ring buffer: what ran,
+ * who triggered it, the (truncated) arguments and the elapsed time.
+ * The ring is drained into the ircd log once per main loop iteration,
+ * so when the latency histogram (/STATS latency) flags a stall the log
+ * shows exactly what was slow - at the price of one timestamp per
+ * traced event and nothing when the budget is not exceeded.
+ */
+#define SLOWTRACE_RING_SIZE 64
+
+typedef struct SlowTraceEntry SlowTraceEntry;
+struct SlowTraceEntry {
+	time_t when;		/**< When the event finished */
+	long long usec;		/**< How long it took, in microseconds */
+	char what[64];		/**< Command name or hook type */
+	char source[128];	/**< Who triggered it (nick!user@host, server, ..) */
+	char args[160];		/**< Truncated parameters, empty for hooks */
+};
+
+static SlowTraceEntry slowtrace_ring[SLOWTRACE_RING_SIZE];
+static unsigned int slowtrace_written = 0; /**< Entries ever recorded */
+static unsigned int slowtrace_drained = 0; /**< Entries ever logged */
+
+/** Record one slow event. Called from parse2() for commands and from
+ * slowtrace_hook_end() for hooks; the caller already verified that
+ * 'usec' exceeds the configured budget.
+ */
+void slowtrace_record(const char *what, Client *source, int parc, char *parv[], long long usec)
+{
+	SlowTraceEntry *e = &slowtrace_ring[slowtrace_written % SLOWTRACE_RING_SIZE];
+	int i;
+
+	e->when = TStime();
+	e->usec = usec;
+	strlcpy(e->what, what, sizeof(e->what));
+	if (!source)
+		strlcpy(e->source, "<internal>", sizeof(e->source));
+	else if (source->user)
+		ircsnprintf(e->source, sizeof(e->source), "%s!%s@%s",
+			source->name, source->user->username, GetHost(source));
+	else
+		strlcpy(e->source, *source->name ? source->name : "<unregistered>", sizeof(e->source));
+	*e->args = '\0';
+	for (i = 1; (i < parc) && parv[i]; i++)
+	{
+		if (i > 1)
+			strlcat(e->args, " ", sizeof(e->args));
+		strlcat(e->args, parv[i], sizeof(e->args)); /* silently truncated when full */
+	}
+	slowtrace_written++;
+}
+
+/** Start timing one hook dispatch (called by the RunHook* macros).
+ * Returns 0 when there is nothing to time - tracing disabled or no
+ * hooks registered for this type - which makes slowtrace_hook_end()
+ * a no-op, so an untraced dispatch only pays this call and a branch.
+ */
+long long slowtrace_hook_begin(int hooktype)
+{
+	struct timeval tv;
+
+	if (!HookTable[hooktype].count)
+		return 0;
+	hook_dispatch_calls[hooktype]++;
+	if (!SLOW_COMMAND_TRACE_TIME)
+		return 0;
+	gettimeofday(&tv, NULL);
+	return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/** Finish timing one hook dispatch and record it if it was slow */
+void slowtrace_hook_end(int hooktype, long long started)
+{
+	struct timeval tv;
+	long long usec;
+	const char *name = NULL;
+	char what[64];
+	Hooktype *ht;
+
+	if (!started)
+		return;
+	gettimeofday(&tv, NULL);
+	usec = ((long long)tv.tv_sec * 1000000 + tv.tv_usec) - started;
+	if (usec > 0)
+		hook_dispatch_usec[hooktype] += usec;
+	if ((usec < SLOW_COMMAND_TRACE_TIME) || (usec < 0))
+		return;
+
+	/* Custom hooktypes have a registered name, the built-in HOOKTYPE_*
+	 * ones only exist as numeric defines (see include/modules.h).
+	 */
+	for (ht = Hooktypes; ht->string; ht++)
+		if (ht->id == hooktype)
+		{
+			name = ht->string;
+			break;
+		}
+	if (name)
+		ircsnprintf(what, sizeof(what), "hook %s", name);
+	else
+		ircsnprintf(what, sizeof(what), "hook #%d", hooktype);
+	slowtrace_record(what, NULL, 0, NULL, usec);
+}
+
+/** Drain the trace ring into the ircd log, called once per main loop
+ * iteration. If more events were recorded than the ring holds since
+ * the last drain, the oldest ones were overwritten - say so instead of
+ * logging stale garbage.
+ */
+static void slowtrace_drain(void)
+{
+	unsigned int pending = slowtrace_written - slowtrace_drained;
+
+	if (!pending)
+		return;
+	if (pending > SLOWTRACE_RING_SIZE)
+	{
+		ircd_log(LOG_ERROR, "SLOW: %u trace entries overwritten before they could be logged",
+			pending - SLOWTRACE_RING_SIZE);
+		slowtrace_drained = slowtrace_written - SLOWTRACE_RING_SIZE;
+	}
+	for (; slowtrace_drained != slowtrace_written; slowtrace_drained++)
+	{
+		SlowTraceEntry *e = &slowtrace_ring[slowtrace_drained % SLOWTRACE_RING_SIZE];
+		ircd_log(LOG_ERROR, "SLOW: %s from %s took %lld.%03lld msec%s%s",
+			e->what, e->source, e->usec / 1000, e->usec % 1000,
+			*e->args ? ": " : "", e->args);
+	}
+}
+
 /** The main loop that the server will run all the time.
  * On Windows this is a thread, on *NIX we simply jump here from main()
  * when the server is ready.
  */
 void SocketLoop(void *dummy)
 {
-	struct timeval doevents_tv, process_clients_tv;
+	struct timeval process_clients_tv;
+	long long loop_start_mono_ms = 0;
+#ifdef DEBUGMODE
+	long long loop_start_clock_reads = 0;
+#endif
 
-	memset(&doevents_tv, 0, sizeof(doevents_tv));
 	memset(&process_clients_tv, 0, sizeof(process_clients_tv));
 
 	while (1)
 	{
 		gettimeofday(&timeofday_tv, NULL);
 		timeofday = timeofday_tv.tv_sec;
+		monotime_ms = mono_time_coarse_ms();
+
+#ifdef DEBUGMODE
+		/* Flag code paths that read the clock excessively instead of
+		 * using the cached TStime()/MonoTime()/timeofday_tv.
+		 */
+		if (mono_clock_reads - loop_start_clock_reads > 100)
+			ircd_log(LOG_ERROR, "[BUG?] %lld fresh clock reads in a single main loop iteration, "
+			         "some code path should probably use the cached clock",
+			         mono_clock_reads - loop_start_clock_reads);
+		loop_start_clock_reads = mono_clock_reads;
+#endif
+
+		/* Account the previous iteration: time since it started,
+		 * minus what was spent sleeping in the I/O engine, is how
+		 * long we were busy (or stalled somewhere).
+		 */
+		if (loop_start_mono_ms)
+		{
+			loop_latency_account((monotime_ms - loop_start_mono_ms)
+			                     - fd_select_sleep_usec / 1000);
+		}
+		loop_start_mono_ms = monotime_ms;
+		fd_select_sleep_usec = 0;
+
+		/* Log whatever the slow-command tracer caught last iteration */
+		slowtrace_drain();
 
 		detect_timeshift_and_warn();
 
-		if (minimum_msec_since_last_run(&doevents_tv, 250))
-			DoEvents();
+		/* Cheap now that events sit on a timer wheel: only the
+		 * ones actually due are touched.
+		 */
+		DoEvents();
 
 		/* Update statistics */
 		if (irccounts.clients > irccounts.global_max)
@@ -1406,8 +2100,47 @@ void SocketLoop(void *dummy)
 		if (irccounts.me_clients > irccounts.me_max)
 			irccounts.me_max = irccounts.me_clients;
 
-		/* Process I/O */
-		fd_select(SOCKETLOOP_MAX_DELAY);
+		/* Flush anything queued by timers/events before we
+		 * (possibly) go to sleep in the I/O engine.
+		 */
+		flush_pending_writes();
+
+		/* Process I/O. Sleep no longer than the next timer needs
+		 * us awake, and no longer than SOCKETLOOP_MAX_DELAY.
+		 * Don't sleep at all while deferred netsplit exits are
+		 * still queued, or while clients that exhausted their
+		 * drain budget still have sendq data waiting, so both
+		 * drain as fast as possible.
+		 */
+		fd_select((pending_exits_queued() || pending_handshakes_queued() || !list_empty(&pending_write_list)) ? 0 : EventNextDelay(syncsched_pending() ? 10 : SOCKETLOOP_MAX_DELAY));
+
+		/* Flush the replies generated by the commands we just processed */
+		flush_pending_writes();
+
+		/* Work off a batch of deferred netsplit exits (if any) */
+		process_pending_exits();
+
+		/* Feed a slice of deferred post-EOS sync data (TKLs etc.)
+		 * to freshly linked servers (if any).
+		 */
+		syncsched_run();
+
+		/* Write a chunk of pending database snapshots to disk (if any) */
+		dbwrite_run();
+
+		/* Deliver results of finished worker thread jobs (if any).
+		 * Normally the wakeup pipe takes care of this; this catches
+		 * jobs that finished while we were busy in this loop.
+		 */
+		workers_run();
+
+		/* Resume parked TLS handshakes, within the per-iteration budget */
+		process_pending_handshakes();
+
+		/* Fan out WATCH notifications queued by the above in one
+		 * coalesced pass.
+		 */
+		flush_watch_notifications();
 
 		if (minimum_msec_since_last_run(&process_clients_tv, 200))
 			process_clients();
@@ -1431,6 +2164,16 @@ void SocketLoop(void *dummy)
 			reinit_ssl(NULL);
 			doreloadcert = 0;
 		}
+#ifndef _WIN32
+		if (doprofiling)
+		{
+			doprofiling = 0;
+			if (!profiling_active)
+				profiling_start();
+			else
+				profiling_stop_and_report();
+		}
+#endif
 	}
 }
 
@@ -1518,5 +2261,9 @@ static void setup_signals()
 	(void)sigemptyset(&act.sa_mask);
 	(void)sigaddset(&act.sa_mask, SIGUSR1);
 	(void)sigaction(SIGUSR1, &act, NULL);
+	act.sa_handler = s_profile;
+	(void)sigemptyset(&act.sa_mask);
+	(void)sigaddset(&act.sa_mask, SIGUSR2);
+	(void)sigaction(SIGUSR2, &act, NULL);
 #endif
 }
@@ -25,22 +25,90 @@
  */
 #include "ircsprintf.h"
 #include <stdio.h>
+#include <string.h>
+
+/** Emit a signed 64 bit integer, optionally zero-padded to 'pad'
+ * digits (pad 0 means no padding). Returns the new string position.
+ * 'end' is the last position the terminating null can go, so we may
+ * write up to (but not beyond) it.
+ */
+static inline char *emit_int(char *str, const char *end, long long v, int pad)
+{
+	char scratch_buffer[32]; /* large enough for a 64 bit integer as a string */
+	char *t = scratch_buffer + sizeof(scratch_buffer);
+	size_t len;
+
+	if (v < 0)
+	{
+		if (str == end)
+			return str;
+		*str++ = '-';
+		if (pad)
+			pad--; /* the sign counts toward the field width, like snprintf */
+		do
+		{
+			*--t = '0' - (v % 10);
+			v /= 10;
+		} while (v);
+	} else {
+		do
+		{
+			*--t = (v % 10) + '0';
+			v /= 10;
+		} while (v);
+	}
+
+	len = sizeof(scratch_buffer) - (t - scratch_buffer);
+	while ((len < pad) && (str != end))
+	{
+		*str++ = '0';
+		pad--;
+	}
+	if (len > end - str)
+		len = end - str;
+	memcpy(str, t, len);
+	return str + len;
+}
+
+/** Emit an unsigned 64 bit integer. Returns the new string position. */
+static inline char *emit_uint(char *str, const char *end, unsigned long long v)
+{
+	char scratch_buffer[32];
+	char *t = scratch_buffer + sizeof(scratch_buffer);
+	size_t len;
+
+	do
+	{
+		*--t = (v % 10) + '0';
+		v /= 10;
+	} while (v);
+
+	len = sizeof(scratch_buffer) - (t - scratch_buffer);
+	if (len > end - str)
+		len = end - str;
+	memcpy(str, t, len);
+	return str + len;
+}
 
 /** Optimized version of vsnprintf() for us.
- * ircvsnprintf is optimized for the formats: %s, %c, %d, %i, %u, %lu and %lld.
- * If you only use these format string types then this function is significantly
- * faster than regular vsnprintf().
- * When it encounters any other format type or things like padding, precision,
- * etc. then it will resort to calling vsnprintf(), so no problem.
+ * ircvsnprintf is optimized for the formats: %s, %c, %d, %i, %u,
+ * %lu, %lld and zero-padded integers such as %03d / %.3d (as used
+ * by the numeric reply patterns).
+ * If you only use these format string types then this function is
+ * significantly faster than regular vsnprintf().
+ * When it encounters any other format type or things like field
+ * widths, precision, etc. then it will resort to calling
+ * vsnprintf(), so no problem.
+ * @returns The length of the result (excluding the terminating
+ * null byte), which is never more than size-1.
  */
-char *ircvsnprintf(char *str, size_t size, const char *format, va_list vl)
+int ircvsnprintf(char *str, size_t size, const char *format, va_list vl)
 {
 	char *str_begin = str;
 	char c;
 	const char *end = str+size-1; /* for comparison, not dereferencing.  It is the last position a null can go. */
-	char scratch_buffer[32]; /* large enough for 64 bit integer as a string */
 
-	if (!size) return str;
+	if (!size) return 0;
 
 	while (str!=end && (c = *format++))
 	{
@@ -49,9 +117,13 @@ char *ircvsnprintf(char *str, size_t size, const char *format, va_list vl)
 			c = *format++;
 			if (c == 's')
 			{
-				/* %s - string */
+				/* %s - string, copied via memcpy with truncation */
 				const char *p1 = va_arg(vl, const char *);
-				while (str!=end && *p1) *str++ = *p1++;
+				size_t len = strlen(p1);
+				if (len > end - str)
+					len = end - str;
+				memcpy(str, p1, len);
+				str += len;
 				continue;
 			}
 			else if (c == 'c')
@@ -63,37 +135,18 @@ char *ircvsnprintf(char *str, size_t size, const char *format, va_list vl)
 			else if (c == 'd' || c == 'i')
 			{
 				/* %d and %i - integer */
-				char *t;
-				int v = va_arg(vl, int);
-				int i = 0;
-				size_t len;
-				if (v==0)
-				{
-					*str++ = '0';
-					continue;
-				}
-				t = scratch_buffer + sizeof(scratch_buffer);
-				if (v<0)
-				{
-					*str++ = '-';
-					if (str==end) break;
-					while (v)
-					{
-						*--t = '0' - (v%10);
-						v/=10;
-					}
-				} else {
-					while (v)
-					{
-						*--t = (v%10) + '0';
-						v/=10;
-					}
-				}
-
-				len = sizeof(scratch_buffer)-(t-scratch_buffer);
-				if ((str+len)>end) break;
-				for (i = 0; i < len; i++)
-					*str++=t[i];
+				str = emit_int(str, end, va_arg(vl, int), 0);
+				continue;
+			}
+			else if (((c == '0') || (c == '.')) &&
+			         (format[0] >= '1') && (format[0] <= '9') && (format[1] == 'd'))
+			{
+				/* %0Nd and %.Nd - zero-padded integer (single
+				 * digit pad width), as in the numeric patterns.
+				 */
+				int pad = format[0] - '0';
+				format += 2;
+				str = emit_int(str, end, va_arg(vl, int), pad);
 				continue;
 			}
 			else if (c == 'l')
@@ -101,95 +154,22 @@ char *ircvsnprintf(char *str, size_t size, const char *format, va_list vl)
 				if (format[0] == 'l' && format[1] == 'd')
 				{
 					/* %lld - long long */
-					char *t;
-					long long v = va_arg(vl, long long);
-					int i = 0;
-					size_t len;
-
 					format += 2;
-
-					if (v==0)
-					{
-						*str++ = '0';
-						continue;
-					}
-					t = scratch_buffer + sizeof(scratch_buffer);
-					if (v<0)
-					{
-						*str++ = '-';
-						if (str==end) break;
-						while (v)
-						{
-							*--t = '0' - (v%10);
-							v/=10;
-						}
-					} else {
-						while (v)
-						{
-							*--t = (v%10) + '0';
-							v/=10;
-						}
-					}
-
-					len = sizeof(scratch_buffer)-(t-scratch_buffer);
-					if ((str+len)>end) break;
-					for (i = 0; i < len; i++)
-						*str++=t[i];
+					str = emit_int(str, end, va_arg(vl, long long), 0);
 					continue;
 				}
 				if (*format == 'u')
 				{
 					/* %lu - unsigned long */
-					char *t;
-					unsigned long v = va_arg(vl, unsigned long);
-					int i = 0;
-					size_t len;
-
 					format++;
-					if (v==0)
-					{
-						*str++ = '0';
-						continue;
-					}
-
-					t = scratch_buffer + sizeof(scratch_buffer);
-					while (v)
-					{
-						*--t = (v%10) + '0';
-						v/=10;
-					}
-
-					len = sizeof(scratch_buffer)-(t-scratch_buffer);
-					if ((str+len)>end) break;
-					for (i = 0; i < len; i++)
-						*str++=t[i];
+					str = emit_uint(str, end, va_arg(vl, unsigned long));
 					continue;
 				}
 			}
 			else if (c == 'u')
 			{
 				/* %u - unsigned integer */
-				char *t;
-				unsigned int v = va_arg(vl, unsigned int);
-				int i = 0;
-				size_t len;
-				if (v==0)
-				{
-					*str++ = '0';
-					continue;
-				}
-
-				t = scratch_buffer + sizeof(scratch_buffer);
-				while (v)
-				{
-					*--t = (v%10) + '0';
-					v/=10;
-				}
-
-				len = sizeof(scratch_buffer)-(t-scratch_buffer);
-				if ((str+len)>end) break;
-				for (i = 0; i < len; i++)
-					*str++=t[i];
+				str = emit_uint(str, end, va_arg(vl, unsigned int));
 				continue;
 			}
 			else if (c == '%')
@@ -200,23 +180,28 @@ char *ircvsnprintf(char *str, size_t size, const char *format, va_list vl)
 			}
 			else if (!c)
 				break; /* A % at the end of the format string (illegal, skipped) */
-			
+
 			/* The default case, when we cannot handle the % format:
 			 * Stop what we are doing and pass control to the real vsnprintf()
 			 */
-			format -= 2;
-			vsnprintf(str, (size_t)(end-str+1), format, vl);
-			return str_begin;
+			{
+				int r;
+				format -= 2;
+				r = vsnprintf(str, (size_t)(end-str+1), format, vl);
+				if (r > end - str)
+					r = end - str; /* truncated */
+				return (str - str_begin) + r;
+			}
 		}
 		*str++ = c;
 	}
 	*str = 0;
-	return str_begin;
+	return str - str_begin;
 }
 
-char *ircsnprintf(char *str, size_t size, const char *format, ...) {
+int ircsnprintf(char *str, size_t size, const char *format, ...) {
 	va_list vl;
-	char *ret;
+	int ret;
 	va_start(vl, format);
 	ret = ircvsnprintf(str, size, format, vl);
 	va_end(vl);
@@ -37,8 +37,7 @@ static struct liststats {
 MODVAR int  flinks = 0;
 MODVAR int  freelinks = 0;
 MODVAR Link *freelink = NULL;
-MODVAR Member *freemember = NULL;
-MODVAR Membership *freemembership = NULL;
+MODVAR mp_pool_t *membership_pool = NULL;
 MODVAR int  numclients = 0;
 
 // TODO: Document whether servers are included or excluded in these lists...
@@ -50,11 +49,94 @@ MODVAR struct list_head server_list;		/**< Locally connected servers */
 MODVAR struct list_head oper_list;		/**< Locally connected IRC Operators */
 MODVAR struct list_head global_server_list;	/**< All servers (local and remote) */
 MODVAR struct list_head dead_list;		/**< All dead clients (local and remote) that will soon be freed in the main loop */
+MODVAR struct list_head pending_write_list;	/**< Local clients with queued data, flushed once per main loop iteration (see flush_pending_writes) */
+
+/* Dense mirrors of the client lists.
+ *
+ * Full-population sweeps (TKL checks, WHO, stats reports) walk the
+ * client lists and chase cold pointers across the whole heap. The
+ * two big lists therefore have a parallel dense array of client
+ * pointers: additions append at the end, deletion swaps the last
+ * entry into the hole (each client remembers its slot), and a
+ * generation counter is bumped on every mutation so an iterator can
+ * tell the array shifted under it. Sweeps that may kill clients
+ * should iterate over a snapshot and validate every entry before use,
+ * see check_pings() in src/ircd.c for the canonical pattern. The
+ * linked lists remain authoritative for ordering-sensitive consumers.
+ */
+MODVAR ClientArray client_array;	/**< Dense mirror of client_list */
+MODVAR ClientArray lclient_array;	/**< Dense mirror of lclient_list */
+
+static void clientarray_add(ClientArray *a, Client *client, int *pos)
+{
+	if (a->count == a->allocated)
+	{
+		Client **items;
+
+		a->allocated = a->allocated ? a->allocated * 2 : 512;
+		items = safe_alloc(sizeof(Client *) * a->allocated);
+		if (a->count)
+			memcpy(items, a->items, sizeof(Client *) * a->count);
+		safe_free(a->items);
+		a->items = items;
+	}
+	a->items[a->count] = client;
+	*pos = a->count++;
+	a->generation++;
+}
+
+static void clientarray_del(ClientArray *a, Client *client, int *pos)
+{
+	int i = *pos;
+
+	if (i == -1)
+		return; /* not in the array (already removed, or never added) */
+	if ((i >= a->count) || (a->items[i] != client))
+	{
+		ircd_log(LOG_ERROR, "[BUG] clientarray_del(): client %p claims slot %d but is not there",
+		         (void *)client, i);
+#ifdef DEBUGMODE
+		abort();
+#endif
+		return;
+	}
+	a->count--;
+	if (i < a->count)
+	{
+		/* Swap-remove: the last entry moves into the hole */
+		Client *moved = a->items[a->count];
+		a->items[i] = moved;
+		if (a == &lclient_array)
+			moved->local->lclient_array_pos = i;
+		else
+			moved->client_array_pos = i;
+	}
+	*pos = -1;
+	a->generation++;
+}
+
+void client_array_del(Client *client)
+{
+	clientarray_del(&client_array, client, &client->client_array_pos);
+}
+
+void lclient_array_add(Client *client)
+{
+	clientarray_add(&lclient_array, client, &client->local->lclient_array_pos);
+}
+
+void lclient_array_del(Client *client)
+{
+	if (client->local)
+		clientarray_del(&lclient_array, client, &client->local->lclient_array_pos);
+}
 
 static mp_pool_t *client_pool = NULL;
 static mp_pool_t *local_client_pool = NULL;
 static mp_pool_t *user_pool = NULL;
+static mp_pool_t *server_pool = NULL;
 static mp_pool_t *link_pool = NULL;
+static mp_pool_t *ban_pool = NULL;
 
 void initlists(void)
 {
@@ -73,11 +155,15 @@ void initlists(void)
 	INIT_LIST_HEAD(&unknown_list);
 	INIT_LIST_HEAD(&global_server_list);
 	INIT_LIST_HEAD(&dead_list);
-
-	client_pool = mp_pool_new(sizeof(Client), 512 * 1024);
-	local_client_pool = mp_pool_new(sizeof(LocalClient), 512 * 1024);
-	user_pool = mp_pool_new(sizeof(ClientUser), 512 * 1024);
-	link_pool = mp_pool_new(sizeof(Link), 512 * 1024);
+	INIT_LIST_HEAD(&pending_write_list);
+
+	client_pool = mp_pool_new(sizeof(Client), 512 * 1024, "client");
+	local_client_pool = mp_pool_new(sizeof(LocalClient), 512 * 1024, "local-client");
+	user_pool = mp_pool_new(sizeof(ClientUser), 512 * 1024, "user");
+	server_pool = mp_pool_new(sizeof(Server), 32 * 1024, "server");
+	link_pool = mp_pool_new(sizeof(Link), 512 * 1024, "link");
+	ban_pool = mp_pool_new(sizeof(Ban), 64 * 1024, "ban");
+	membership_pool = mp_pool_new(sizeof(Membership), 128 * 1024, "membership");
 }
 
 /*
@@ -108,8 +194,7 @@ Client *make_client(Client *from, Client *servr)
 	client->status = CLIENT_STATUS_UNKNOWN;
 
 	INIT_LIST_HEAD(&client->client_node);
-	INIT_LIST_HEAD(&client->client_hash);
-	INIT_LIST_HEAD(&client->id_hash);
+	client->client_array_pos = -1;
 
 	strcpy(client->ident, "unknown");
 	if (!from)
@@ -122,6 +207,8 @@ Client *make_client(Client *from, Client *servr)
 		
 		INIT_LIST_HEAD(&client->lclient_node);
 		INIT_LIST_HEAD(&client->special_node);
+		INIT_LIST_HEAD(&client->pend_write_node);
+		client->local->lclient_array_pos = -1;
 
 		client->local->since = client->local->lasttime =
 		client->lastnick = client->local->firsttime =
@@ -147,17 +234,29 @@ void free_client(Client *client)
 {
 	if (!list_empty(&client->client_node))
 		list_del(&client->client_node);
+	client_array_del(client);
 
 	if (MyConnect(client))
 	{
 		if (!list_empty(&client->lclient_node))
 			list_del(&client->lclient_node);
+		lclient_array_del(client);
 		if (!list_empty(&client->special_node))
+		{
 			list_del(&client->special_node);
+			invalidate_snomask_subscribers();
+		}
+		if (!list_empty(&client->pend_write_node))
+			list_del(&client->pend_write_node);
 
 		RunHook(HOOKTYPE_FREE_CLIENT, client);
 		if (client->local)
 		{
+			if (client->local->check_event)
+			{
+				EventDel(client->local->check_event);
+				client->local->check_event = NULL;
+			}
 			safe_free(client->local->passwd);
 			safe_free(client->local->error_str);
 			if (client->local->hostp)
@@ -227,7 +326,8 @@ Server *make_server(Client *client)
 
 	if (!serv)
 	{
-		serv = safe_alloc(sizeof(Server));
+		serv = mp_pool_get(server_pool);
+		memset(serv, 0, sizeof(Server));
 #ifdef	DEBUGMODE
 		servs.inuse++;
 #endif
@@ -259,6 +359,7 @@ Server *make_server(Client *client)
 */
 void free_user(Client *client)
 {
+	whoindex_remove(client);
 	RunHook(HOOKTYPE_FREE_USER, client);
 	safe_free(client->user->away);
 	if (client->user->swhois)
@@ -288,13 +389,24 @@ void free_user(Client *client)
  */
 void remove_client_from_list(Client *client)
 {
+	/* Make sure the numeric routing cache never points to a gone client */
+	if (client == numeric_target_cache)
+		numeric_target_cache = NULL;
+
 	list_del(&client->client_node);
+	client_array_del(client);
 	if (MyConnect(client))
 	{
 		if (!list_empty(&client->lclient_node))
 			list_del(&client->lclient_node);
+		lclient_array_del(client);
 		if (!list_empty(&client->special_node))
+		{
 			list_del(&client->special_node);
+			invalidate_snomask_subscribers();
+		}
+		if (!list_empty(&client->pend_write_node))
+			list_del_init(&client->pend_write_node);
 	}
 	if (IsServer(client))
 	{
@@ -337,7 +449,8 @@ void remove_client_from_list(Client *client)
 		safe_free(client->serv->features.chanmodes[3]);
 		safe_free(client->serv->features.software);
 		safe_free(client->serv->features.nickchars);
-		safe_free(client->serv);
+		mp_pool_release(client->serv);
+		client->serv = NULL;
 #ifdef	DEBUGMODE
 		servs.inuse--;
 #endif
@@ -350,9 +463,9 @@ void remove_client_from_list(Client *client)
 #endif
 	if (!list_empty(&client->client_node))
 		abort();
-	if (!list_empty(&client->client_hash))
+	if (client->in_client_hash)
 		abort();
-	if (!list_empty(&client->id_hash))
+	if (client->in_id_hash)
 		abort();
 	numclients--;
 	/* Add to killed clients list */
@@ -372,6 +485,7 @@ void remove_client_from_list(Client *client)
 void add_client_to_list(Client *client)
 {
 	list_add(&client->client_node, &client_list);
+	clientarray_add(&client_array, client, &client->client_array_pos);
 }
 
 /** Make a new link entry.
@@ -402,7 +516,8 @@ Ban *make_ban(void)
 {
 	Ban *lp;
 
-	lp = safe_alloc(sizeof(Ban));
+	lp = mp_pool_get(ban_pool);
+	memset(lp, 0, sizeof(Ban));
 #ifdef	DEBUGMODE
 	links.inuse++;
 #endif
@@ -411,7 +526,9 @@ Ban *make_ban(void)
 
 void free_ban(Ban *lp)
 {
-	safe_free(lp);
+	if (lp->cmask)
+		free_compiled_mask(lp->cmask);
+	mp_pool_release(lp);
 #ifdef	DEBUGMODE
 	links.inuse--;
 #endif
@@ -203,6 +203,151 @@ char *collapse(char *pattern)
 }
 
 
+/* == Compiled wildcard masks ==
+ * match_simple() re-interprets the mask byte by byte on every call,
+ * restarting at the last '*' whenever a literal mismatches. For masks
+ * that live long and are evaluated often (channel bans, TKL's) we can
+ * pay the interpretation cost once instead: compile_simple_mask()
+ * splits the mask on its '*'s into lowercased literal segments ('?' is
+ * kept in the segment and handled per byte). Evaluation is then one
+ * left-to-right walk over the string: an anchored head segment must
+ * match at the start, an anchored tail segment at the end, and every
+ * middle segment is placed at its leftmost occurrence, which is always
+ * safe since the '*' in front of it can absorb whatever was skipped.
+ * A mask like *a*b*c*d* thus costs a single scan instead of the
+ * backtracking restart dance. Matching semantics are identical to
+ * match_simple(), including case folding and '_' matching ' '.
+ */
+
+/** Does segment 's' (lowercased, length 'len') match at position 'n'?
+ * The caller guarantees at least 'len' bytes are available at 'n'.
+ */
+static int cmask_match_at(const char *s, int len, const u_char *n)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+	{
+		if ((s[i] != '?') && (s[i] != lc(n[i])) && !((s[i] == '_') && (n[i] == ' ')))
+			return 0;
+	}
+	return 1;
+}
+
+/** Compile a mask (as accepted by match_simple) into segments.
+ * Never fails: every mask can be compiled.
+ */
+CompiledMask *compile_simple_mask(const char *mask)
+{
+	CompiledMask *cm = safe_alloc(sizeof(CompiledMask));
+	const u_char *m;
+	char *o;
+	int i, len = strlen(mask);
+
+	cm->anchor_l = (*mask != '*');
+	cm->anchor_r = (len > 0) && (mask[len-1] != '*');
+
+	for (m = mask; *m; )
+	{
+		if (*m == '*')
+		{
+			m++;
+			continue;
+		}
+		cm->numseg++;
+		while (*m && (*m != '*'))
+			m++;
+	}
+
+	cm->buf = safe_alloc(len + 1);
+	if (cm->numseg)
+	{
+		cm->seg = safe_alloc(cm->numseg * sizeof(char *));
+		cm->seglen = safe_alloc(cm->numseg * sizeof(int));
+	}
+
+	o = cm->buf;
+	i = 0;
+	for (m = mask; *m; )
+	{
+		if (*m == '*')
+		{
+			m++;
+			continue;
+		}
+		cm->seg[i] = o;
+		while (*m && (*m != '*'))
+		{
+			*o++ = lc(*m);
+			m++;
+		}
+		*o++ = '\0';
+		cm->seglen[i] = o - cm->seg[i] - 1;
+		i++;
+	}
+
+	return cm;
+}
+
+/** Match a compiled mask against a string.
+ * @returns 1 on match, 0 on no match (like match_simple()).
+ */
+int compiled_mask_match(CompiledMask *cm, const char *name)
+{
+	const u_char *p = name;
+	int left = strlen(name);
+	int i, len, first = 0, last = cm->numseg;
+
+	if (!cm->numseg)
+		return cm->anchor_l ? (left == 0) : 1; /* mask was "" resp. "*" */
+
+	if (cm->anchor_l)
+	{
+		len = cm->seglen[0];
+		if ((left < len) || !cmask_match_at(cm->seg[0], len, p))
+			return 0;
+		p += len;
+		left -= len;
+		first = 1;
+	}
+
+	if (cm->anchor_r)
+	{
+		if (first == cm->numseg)
+			return (left == 0); /* no '*' in the mask at all */
+		last = cm->numseg - 1;
+		len = cm->seglen[last];
+		if ((left < len) || !cmask_match_at(cm->seg[last], len, p + left - len))
+			return 0;
+		left -= len; /* the middle segments must fit before the tail */
+	}
+
+	for (i = first; i < last; i++)
+	{
+		len = cm->seglen[i];
+		while ((left >= len) && !cmask_match_at(cm->seg[i], len, p))
+		{
+			p++;
+			left--;
+		}
+		if (left < len)
+			return 0;
+		p += len;
+		left -= len;
+	}
+
+	return 1; /* all segments placed (a trailing '*' eats any remainder) */
+}
+
+/** Free a mask compiled by compile_simple_mask(). */
+void free_compiled_mask(CompiledMask *cm)
+{
+	safe_free(cm->buf);
+	safe_free(cm->seg);
+	safe_free(cm->seglen);
+	safe_free(cm);
+}
+
 /* Case insensitive comparison of two NULL terminated strings,
  * using the "IRC nick comparison" rules. Or, well, partially
  * anyway.
@@ -612,18 +757,201 @@ int fast_badword_replace(ConfigItem_badword *badword, char *line, char *buf, int
 	return cleaned;
 }
 
+/* == Aho-Corasick prefilter for fast badwords ==
+ * All fast (non-regex) entries of a badword list are compiled into one
+ * automaton, so finding out WHICH of the words occur in a message is a
+ * single pass over the text, regardless of the size of the list. The
+ * blocking/replacing itself still happens through fast_badword_match()
+ * and fast_badword_replace(), but only for the few words that actually
+ * occur, which keeps the exact word boundary and replacement semantics.
+ * The automaton is (re)built lazily: badword_config_process() and
+ * badword_config_free() bump a generation counter and the first
+ * stripbadwords() call after that rebuilds.
+ */
+typedef struct BadwordTrieNode BadwordTrieNode;
+struct BadwordTrieNode {
+	BadwordTrieNode *child;   /**< First child */
+	BadwordTrieNode *sibling; /**< Next sibling of our parent */
+	BadwordTrieNode *fail;    /**< Aho-Corasick failure link */
+	BadwordTrieNode *output;  /**< Next word-ending node on the fail chain */
+	BadwordTrieNode *bfs;     /**< Only used as queue while building */
+	ConfigItem_badword *word; /**< Badword ending at this node, if any */
+	unsigned char c;          /**< The (lowercased) byte on the edge to us */
+};
+
+typedef struct BadwordAutomaton BadwordAutomaton;
+struct BadwordAutomaton {
+	BadwordAutomaton *prev, *next;
+	ConfigItem_badword *list; /**< List head this was built from (key, don't deref!) */
+	unsigned int generation;  /**< badword_generation at build time */
+	BadwordTrieNode *root;
+};
+
+/** Marks an entry to always be processed, eg because another entry
+ * with the exact same word text occupies its spot in the automaton.
+ */
+#define BADWORD_SCAN_ALWAYS 0xffffffff
+
+static unsigned int badword_generation = 1;
+static unsigned int badword_scan_id = 0;
+static BadwordAutomaton *badword_automatons = NULL;
+
+static BadwordTrieNode *badword_trie_child(BadwordTrieNode *n, unsigned char c)
+{
+	for (n = n->child; n; n = n->sibling)
+		if (n->c == c)
+			return n;
+	return NULL;
+}
+
+static void badword_trie_insert(BadwordTrieNode *root, ConfigItem_badword *bw)
+{
+	BadwordTrieNode *n = root, *t;
+	char *p;
+
+	for (p = bw->word; *p; p++)
+	{
+		unsigned char c = tolower(*(unsigned char *)p);
+		t = badword_trie_child(n, c);
+		if (!t)
+		{
+			t = safe_alloc(sizeof(BadwordTrieNode));
+			t->c = c;
+			t->sibling = n->child;
+			n->child = t;
+		}
+		n = t;
+	}
+	if (!n->word)
+		n->word = bw;
+	else
+		bw->scan_id = BADWORD_SCAN_ALWAYS; /* duplicate word text */
+}
+
+static void badword_trie_free(BadwordTrieNode *n)
+{
+	BadwordTrieNode *c, *next;
+
+	if (!n)
+		return;
+	for (c = n->child; c; c = next)
+	{
+		next = c->sibling;
+		badword_trie_free(c);
+	}
+	safe_free(n);
+}
+
+/** Computes the failure and output links, breadth-first. */
+static void badword_trie_build_links(BadwordTrieNode *root)
+{
+	BadwordTrieNode *head = NULL, *tail = NULL, *n, *ch, *f, *t;
+
+	for (ch = root->child; ch; ch = ch->sibling)
+	{
+		ch->fail = root;
+		if (head)
+			tail->bfs = ch;
+		else
+			head = ch;
+		tail = ch;
+	}
+
+	while ((n = head))
+	{
+		head = n->bfs;
+		for (ch = n->child; ch; ch = ch->sibling)
+		{
+			t = NULL;
+			for (f = n->fail; f; f = f->fail)
+				if ((t = badword_trie_child(f, ch->c)))
+					break;
+			ch->fail = t ? t : root;
+			ch->output = ch->fail->word ? ch->fail : ch->fail->output;
+			if (head)
+				tail->bfs = ch;
+			else
+				head = ch;
+			tail = ch;
+		}
+	}
+}
+
+/** Returns the automaton for this badword list, (re)building if needed. */
+static BadwordAutomaton *badword_automaton_get(ConfigItem_badword *list)
+{
+	BadwordAutomaton *a, *a_next;
+	ConfigItem_badword *bw;
+
+	/* Drop automatons from before the last badword config change,
+	 * their list heads may be gone entirely.
+	 */
+	for (a = badword_automatons; a; a = a_next)
+	{
+		a_next = a->next;
+		if (a->generation != badword_generation)
+		{
+			DelListItem(a, badword_automatons);
+			badword_trie_free(a->root);
+			safe_free(a);
+		}
+	}
+
+	for (a = badword_automatons; a; a = a->next)
+		if (a->list == list)
+			return a;
+
+	a = safe_alloc(sizeof(BadwordAutomaton));
+	a->list = list;
+	a->generation = badword_generation;
+	a->root = safe_alloc(sizeof(BadwordTrieNode));
+	for (bw = list; bw; bw = bw->next)
+		if (bw->type & BADW_TYPE_FAST)
+			badword_trie_insert(a->root, bw);
+	badword_trie_build_links(a->root);
+	AddListItem(a, badword_automatons);
+	return a;
+}
+
+/** One pass over 'str', marking every fast badword occurring in it.
+ * @returns The scan id: entries whose scan_id equals it occur in str.
+ */
+static unsigned int badword_automaton_scan(BadwordAutomaton *a, char *str)
+{
+	BadwordTrieNode *n = a->root, *t, *o;
+	char *p;
+
+	if (++badword_scan_id == BADWORD_SCAN_ALWAYS)
+		badword_scan_id = 1;
+
+	for (p = str; *p; p++)
+	{
+		unsigned char c = tolower(*(unsigned char *)p);
+		while (!(t = badword_trie_child(n, c)) && (n != a->root))
+			n = n->fail;
+		if (t)
+			n = t;
+		for (o = n->word ? n : n->output; o; o = o->output)
+			if (o->word->scan_id != BADWORD_SCAN_ALWAYS)
+				o->word->scan_id = badword_scan_id;
+	}
+	return badword_scan_id;
+}
+
 /*
  * Returns a string, which has been filtered by the words loaded via
  * the loadbadwords() function.  It's primary use is to filter swearing
  * in both private and public messages
  */
-char *stripbadwords(char *str, ConfigItem_badword *start_bw, int *blocked)
+static char *stripbadwords_int(char *str, ConfigItem_badword *start_bw, int *blocked, int prestripped)
 {
 	static char cleanstr[4096];
 	char buf[4096];
 	char *ptr;
 	int matchlen, m, stringlen, cleaned;
 	ConfigItem_badword *this_word;
+	BadwordAutomaton *aca;
+	unsigned int scan;
 
 	*blocked = 0;
 
@@ -633,15 +961,25 @@ char *stripbadwords(char *str, ConfigItem_badword *start_bw, int *blocked)
 	/*
 	 * work on a copy
 	 */
-	stringlen = strlcpy(cleanstr, StripControlCodes(str), sizeof cleanstr);
+	if (prestripped)
+		stringlen = strlcpy(cleanstr, str, sizeof cleanstr);
+	else
+		stringlen = strlcpy(cleanstr, StripControlCodes(str), sizeof cleanstr);
 	matchlen = 0;
 	buf[0] = '\0';
 	cleaned = 0;
 
+	aca = badword_automaton_get(start_bw);
+	scan = badword_automaton_scan(aca, cleanstr);
+
 	for (this_word = start_bw; this_word; this_word = this_word->next)
 	{
 		if (this_word->type & BADW_TYPE_FAST)
 		{
+			/* Skip words the prefilter pass proved absent */
+			if ((this_word->scan_id != scan) && (this_word->scan_id != BADWORD_SCAN_ALWAYS))
+				continue;
+
 			if (this_word->action == BADWORD_BLOCK)
 			{
 				if (fast_badword_match(this_word, cleanstr))
@@ -659,6 +997,13 @@ char *stripbadwords(char *str, ConfigItem_badword *start_bw, int *blocked)
 					cleaned = n;
 				strcpy(cleanstr, buf);
 				memset(buf, 0, sizeof(buf)); /* regexp likes this somehow */
+				if (n)
+				{
+					/* The replacement text may have spelled out
+					 * other badwords, refresh the occurrence marks.
+					 */
+					scan = badword_automaton_scan(aca, cleanstr);
+				}
 			}
 		} else
 		if (this_word->type & BADW_TYPE_REGEX)
@@ -737,6 +1082,21 @@ char *stripbadwords(char *str, ConfigItem_badword *start_bw, int *blocked)
 	return (cleaned) ? cleanstr : str;
 }
 
+char *stripbadwords(char *str, ConfigItem_badword *start_bw, int *blocked)
+{
+	return stripbadwords_int(str, start_bw, blocked, 0);
+}
+
+/** Like stripbadwords() but the caller guarantees that control codes
+ * have already been stripped from 'str', eg because it is the
+ * text_stripped view from the text pipeline, so we don't make yet
+ * another StripControlCodes() pass and copy here.
+ */
+char *stripbadwords_prestripped(char *str, ConfigItem_badword *start_bw, int *blocked)
+{
+	return stripbadwords_int(str, start_bw, blocked, 1);
+}
+
 /** Checks if the specified regex (or fast badwords) is valid.
  * returns NULL in case of success [!],
  * pointer to buffer with error message otherwise
@@ -793,6 +1153,8 @@ int badword_config_process(ConfigItem_badword *ca, char *str)
 	short regex = 0;
 	int ast_l = 0, ast_r = 0;
 
+	badword_generation++; /* invalidate the Aho-Corasick automatons */
+
 	/* The fast badwords routine can do: "blah" "*blah" "blah*" and "*blah*",
 	 * in all other cases use regex.
 	 */
@@ -857,6 +1219,7 @@ int badword_config_process(ConfigItem_badword *ca, char *str)
  */
 void badword_config_free(ConfigItem_badword *e)
 {
+	badword_generation++; /* invalidate the Aho-Corasick automatons */
 	safe_free(e->word);
 	safe_free(e->replace);
 	if (e->pcre2_expr)
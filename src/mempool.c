@@ -37,6 +37,9 @@
  */
 
 #include "unrealircd.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 #if __has_feature(address_sanitizer) || defined(__SANITIZE_ADDRESS__)
 /* When running with AddressSanitizer, if using memory pools we will
@@ -54,7 +57,7 @@ void mp_pool_init(void)
 {
 }
 
-mp_pool_t *mp_pool_new(size_t sz, size_t ignored)
+mp_pool_t *mp_pool_new(size_t sz, size_t ignored, const char *name)
 {
     mp_pool_t *m = safe_alloc(sizeof(mp_pool_t));
     /* We (mis)use the item_alloc_size. It has a slightly different
@@ -62,6 +65,7 @@ mp_pool_t *mp_pool_new(size_t sz, size_t ignored)
      * That is something we don't want as it would hide small overflows.
      */
     m->item_alloc_size = sz;
+    m->name = name;
     return m;
 }
 
@@ -74,6 +78,18 @@ void mp_pool_release(void *item)
 {
     safe_free(item);
 }
+
+mp_pool_t *mp_pools(void)
+{
+    return NULL; /* no pooling, nothing to report */
+}
+
+void mp_pool_usage(mp_pool_t *pool, mp_pool_usage_t *usage)
+{
+    memset(usage, 0, sizeof(*usage));
+    usage->name = pool->name;
+    usage->item_size = pool->item_alloc_size;
+}
 #else
 
 /** Returns floor(log2(u64)).  If u64 is 0, (incorrectly) returns 0. */
@@ -211,6 +227,11 @@ struct mp_allocated_t {
    * very small items. */
   mp_chunk_t *in_chunk;
 
+#ifdef MEMPOOL_DEBUG
+  uint32_t debug_magic; /**< Allocation state, one of MP_ITEM_MAGIC_* */
+  uint32_t generation; /**< How often this slot has been recycled since it was carved */
+#endif
+
   union {
     /** If this item is free, the next item on the free list. */
     mp_allocated_t *next_free;
@@ -241,6 +262,8 @@ struct mp_chunk_t {
   mp_allocated_t *first_free;
   int n_allocated; /**< Number of currently allocated items in this chunk. */
   int capacity; /**< Number of items that can be fit into this chunk. */
+  size_t map_size; /**< Non-zero: chunk was mmap()ed at this total size
+                        (huge page backing), rather than malloc'd. */
   size_t mem_size; /**< Number of usable bytes in mem. */
   char *next_mem; /**< Pointer into part of <b>mem</b> not yet carved up. */
   char mem[]; /**< Storage for this chunk. */
@@ -258,31 +281,175 @@ static mp_pool_t *mp_allocated_pools = NULL;
  * mp_allocated_t. */
 #define M2A(p) (((char *)p) - offsetof(mp_allocated_t, u.mem))
 
+#ifdef MEMPOOL_DEBUG
+/** MEMPOOL_DEBUG: value of debug_magic while an item is handed out. */
+#define MP_ITEM_MAGIC_ALLOCATED 0xA110CA8D
+/** MEMPOOL_DEBUG: value of debug_magic while an item sits on a freelist. */
+#define MP_ITEM_MAGIC_FREE 0xF4EE51D3
+/** MEMPOOL_DEBUG: byte smeared over an item's memory on release. */
+#define MP_POISON_BYTE 0xDB
+
+/** MEMPOOL_DEBUG: poisonable payload bytes of an item in <b>pool</b>. */
+#define MP_POISON_SIZE(pool) ((pool)->item_alloc_size - offsetof(mp_allocated_t, u.mem))
+
+/** MEMPOOL_DEBUG: verify the state and poison pattern of a freelist item
+ * that is about to be handed out again, then mark it allocated and bump
+ * its generation counter. The first pointer-size payload bytes hold the
+ * freelist link and are exempt from the poison check.
+ */
+static void
+mp_debug_reuse(mp_pool_t *pool, mp_allocated_t *allocated)
+{
+  unsigned char *mem = (unsigned char *)A2M(allocated);
+  size_t i;
+
+  if (allocated->debug_magic != MP_ITEM_MAGIC_FREE)
+  {
+    ircd_log(LOG_ERROR, "[BUG] mempool '%s': freelist item %p has bad state 0x%08x (generation %u) - corrupted freelist",
+             pool->name, (void *)mem, allocated->debug_magic, allocated->generation);
+    abort();
+  }
+  for (i = sizeof(mp_allocated_t *); i < MP_POISON_SIZE(pool); i++)
+  {
+    if (mem[i] != MP_POISON_BYTE)
+    {
+      ircd_log(LOG_ERROR, "[BUG] mempool '%s': item %p (generation %u) was modified after release: offset %lu is 0x%02x, expected poison 0x%02x",
+               pool->name, (void *)mem, allocated->generation,
+               (unsigned long)i, mem[i], MP_POISON_BYTE);
+      abort();
+    }
+  }
+  allocated->debug_magic = MP_ITEM_MAGIC_ALLOCATED;
+  ++allocated->generation;
+}
+
+/** MEMPOOL_DEBUG: verify that a released item really was handed out by
+ * this pool (catches double free and rogue pointers), then poison it.
+ */
+static void
+mp_debug_release(mp_pool_t *pool, mp_allocated_t *allocated)
+{
+  if (allocated->debug_magic != MP_ITEM_MAGIC_ALLOCATED)
+  {
+    ircd_log(LOG_ERROR, "[BUG] mempool '%s': release of %p which is %s (state 0x%08x, generation %u)",
+             pool->name, (void *)A2M(allocated),
+             allocated->debug_magic == MP_ITEM_MAGIC_FREE ? "already free (double free)" : "not a live pool item",
+             allocated->debug_magic, allocated->generation);
+    abort();
+  }
+  allocated->debug_magic = MP_ITEM_MAGIC_FREE;
+  memset(A2M(allocated), MP_POISON_BYTE, MP_POISON_SIZE(pool));
+}
+#endif /* MEMPOOL_DEBUG */
+
 void
 mp_pool_init(void)
 {
   EventAdd(NULL, "mp_pool_garbage_collect", &mp_pool_garbage_collect, NULL, 119*1000, 0);
 }
 
+/** Huge page size we align mmap()ed chunks to when set::hugepage-pools
+ * is enabled. 2 MB on every platform we care about; transparent huge
+ * pages only back regions that are this size and this alignment.
+ */
+#define MP_HUGEPAGE_SIZE (2UL * 1024 * 1024)
+
+/** Only bother with huge page backing for chunks of at least this size.
+ * Small pools would waste most of a rounded-up 2 MB mapping.
+ */
+#define MP_HUGEPAGE_MIN_CHUNK (256 * 1024)
+
+/** Helper: mmap() a zeroed, 2 MB aligned region of at least <b>*sizep</b>
+ * bytes (rounded up to a multiple of MP_HUGEPAGE_SIZE, written back to
+ * <b>*sizep</b>) and ask the kernel to back it with transparent huge
+ * pages. Returns NULL if the platform lacks the pieces or the mapping
+ * fails, in which case the caller falls back to a plain malloc chunk.
+ */
+static void *
+mp_hugepage_alloc(size_t *sizep)
+{
+#if !defined(_WIN32) && defined(MAP_ANONYMOUS) && defined(MADV_HUGEPAGE)
+  size_t size = (*sizep + MP_HUGEPAGE_SIZE - 1) & ~(MP_HUGEPAGE_SIZE - 1);
+  char *raw, *aligned;
+  size_t head, tail;
+
+  /* Over-map by one huge page so we can trim to 2 MB alignment:
+   * mmap() only guarantees normal page alignment.
+   */
+  raw = mmap(NULL, size + MP_HUGEPAGE_SIZE, PROT_READ|PROT_WRITE,
+             MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED)
+    return NULL;
+  aligned = (char *)(((uintptr_t)raw + MP_HUGEPAGE_SIZE - 1) & ~(uintptr_t)(MP_HUGEPAGE_SIZE - 1));
+  head = aligned - raw;
+  tail = (raw + size + MP_HUGEPAGE_SIZE) - (aligned + size);
+  if (head)
+    munmap(raw, head);
+  if (tail)
+    munmap(aligned + size, tail);
+  (void)madvise(aligned, size, MADV_HUGEPAGE); /* advisory, failure is harmless */
+  *sizep = size;
+  return aligned;
+#else
+  return NULL;
+#endif
+}
+
 /** Helper: Allocate and return a new memory chunk for <b>pool</b>.  Does not
  * link the chunk into any list. */
 static mp_chunk_t *
 mp_chunk_new(mp_pool_t *pool)
 {
   size_t sz = pool->new_chunk_capacity * pool->item_alloc_size;
-  mp_chunk_t *chunk = safe_alloc(CHUNK_OVERHEAD + sz);
+  mp_chunk_t *chunk = NULL;
+  size_t map_size = 0;
+
+  if (HUGEPAGE_POOLS && CHUNK_OVERHEAD + sz >= MP_HUGEPAGE_MIN_CHUNK)
+  {
+    map_size = CHUNK_OVERHEAD + sz;
+    chunk = mp_hugepage_alloc(&map_size);
+  }
+  if (!chunk)
+  {
+    map_size = 0;
+    chunk = safe_alloc(CHUNK_OVERHEAD + sz);
+  }
 
 #ifdef MEMPOOL_STATS
   ++pool->total_chunks_allocated;
 #endif
   chunk->magic = MP_CHUNK_MAGIC;
-  chunk->capacity = pool->new_chunk_capacity;
-  chunk->mem_size = sz;
+  chunk->map_size = map_size;
+  if (map_size)
+  {
+    /* Use the entire rounded-up mapping for items instead of wasting
+     * the huge page slack.
+     */
+    chunk->capacity = (map_size - CHUNK_OVERHEAD) / pool->item_alloc_size;
+  } else
+  {
+    chunk->capacity = pool->new_chunk_capacity;
+  }
+  chunk->mem_size = (size_t)chunk->capacity * pool->item_alloc_size;
   chunk->next_mem = chunk->mem;
   chunk->pool = pool;
   return chunk;
 }
 
+/** Helper: free a chunk, whichever way it was allocated. */
+static void
+mp_chunk_free(mp_chunk_t *chunk)
+{
+#ifndef _WIN32
+  if (chunk->map_size)
+  {
+    munmap(chunk, chunk->map_size);
+    return;
+  }
+#endif
+  safe_free(chunk);
+}
+
 /** Take a <b>chunk</b> that has just been allocated or removed from
  * <b>pool</b>'s empty chunk list, and add it to the head of the used chunk
  * list. */
@@ -296,6 +463,64 @@ add_newly_used_chunk_to_used_list(mp_pool_t *pool, mp_chunk_t *chunk)
   assert(!chunk->prev);
 }
 
+/** Return the pages of an empty chunk to the OS, keeping the chunk
+ * itself (and its header) available for re-use. The chunk's carve
+ * state is rewound first, so the discarded contents - including the
+ * in-chunk freelist - are never looked at again; the next mp_pool_get()
+ * that picks this chunk up carves it from the start as if it were new.
+ * This is what keeps RSS from staying at the post-netsplit peak
+ * forever: mp_pool_clean() only frees chunks beyond the retention
+ * heuristic, while this also drops the memory of the retained ones.
+ */
+static void
+mp_chunk_decommit(mp_chunk_t *chunk)
+{
+#if !defined(_WIN32) && (defined(MADV_FREE) || defined(MADV_DONTNEED))
+  static long pagesize = 0;
+  uintptr_t start, end;
+
+  if (!pagesize)
+    pagesize = sysconf(_SC_PAGESIZE);
+
+  chunk->first_free = NULL;
+  chunk->next_mem = chunk->mem;
+
+  /* Chunks come from the heap allocator and are not page-aligned, so
+   * only the page-aligned interior can be discarded.
+   */
+  start = ((uintptr_t)chunk->mem + pagesize - 1) & ~(uintptr_t)(pagesize - 1);
+  end = ((uintptr_t)chunk->mem + chunk->mem_size) & ~(uintptr_t)(pagesize - 1);
+  if (end <= start)
+    return;
+#ifdef MADV_FREE
+  (void)madvise((void *)start, end - start, MADV_FREE);
+#else
+  (void)madvise((void *)start, end - start, MADV_DONTNEED);
+#endif
+#endif
+}
+
+/** Return the number of bytes of <b>chunk</b> that mp_chunk_decommit()
+ * is able to return to the OS (0 if decommit is unsupported here).
+ */
+static unsigned long long
+mp_chunk_decommit_size(mp_chunk_t *chunk)
+{
+#if !defined(_WIN32) && (defined(MADV_FREE) || defined(MADV_DONTNEED))
+  static long pagesize = 0;
+  uintptr_t start, end;
+
+  if (!pagesize)
+    pagesize = sysconf(_SC_PAGESIZE);
+
+  start = ((uintptr_t)chunk->mem + pagesize - 1) & ~(uintptr_t)(pagesize - 1);
+  end = ((uintptr_t)chunk->mem + chunk->mem_size) & ~(uintptr_t)(pagesize - 1);
+  return (end > start) ? (end - start) : 0;
+#else
+  return 0;
+#endif
+}
+
 /** Return a newly allocated item from <b>pool</b>. */
 void *
 mp_pool_get(mp_pool_t *pool)
@@ -347,6 +572,9 @@ mp_pool_get(mp_pool_t *pool)
     chunk->first_free = allocated->u.next_free;
     allocated->u.next_free = NULL; /* For debugging; not really needed. */
     assert(allocated->in_chunk == chunk);
+#ifdef MEMPOOL_DEBUG
+    mp_debug_reuse(pool, allocated);
+#endif
   } else {
     /* Otherwise, the chunk had better have some free space left on it. */
     assert(chunk->next_mem + pool->item_alloc_size <=
@@ -358,9 +586,16 @@ mp_pool_get(mp_pool_t *pool)
     chunk->next_mem += pool->item_alloc_size;
     allocated->in_chunk = chunk;
     allocated->u.next_free = NULL; /* For debugging; not really needed. */
+#ifdef MEMPOOL_DEBUG
+    allocated->debug_magic = MP_ITEM_MAGIC_ALLOCATED;
+    allocated->generation = 0;
+#endif
   }
 
   ++chunk->n_allocated;
+  ++pool->items_in_use;
+  if (pool->items_in_use > pool->items_peak)
+    pool->items_peak = pool->items_in_use;
 #ifdef MEMPOOL_STATS
   ++pool->total_items_allocated;
 #endif
@@ -396,6 +631,12 @@ mp_pool_release(void *item)
   assert(chunk->magic == MP_CHUNK_MAGIC);
   assert(chunk->n_allocated > 0);
 
+#ifdef MEMPOOL_DEBUG
+  mp_debug_release(chunk->pool, allocated);
+#endif
+
+  --chunk->pool->items_in_use;
+
   allocated->u.next_free = chunk->first_free;
   chunk->first_free = allocated;
 
@@ -449,7 +690,7 @@ mp_pool_release(void *item)
 /** Allocate a new memory pool to hold items of size <b>item_size</b>. We'll
  * try to fit about <b>chunk_capacity</b> bytes in each chunk. */
 mp_pool_t *
-mp_pool_new(size_t item_size, size_t chunk_capacity)
+mp_pool_new(size_t item_size, size_t chunk_capacity, const char *name)
 {
   mp_pool_t *pool;
   size_t alloc_size, new_chunk_cap;
@@ -502,6 +743,7 @@ mp_pool_new(size_t item_size, size_t chunk_capacity)
   pool->new_chunk_capacity = (int)new_chunk_cap;
 
   pool->item_alloc_size = alloc_size;
+  pool->name = name;
 
   pool->next = mp_allocated_pools;
   mp_allocated_pools = pool;
@@ -596,7 +838,7 @@ mp_pool_clean(mp_pool_t *pool, int n_to_keep, int keep_recently_used)
   while (chunk) {
     mp_chunk_t *next = chunk->next;
     chunk->magic = 0xdeadbeef;
-    safe_free(chunk);
+    mp_chunk_free(chunk);
 #ifdef MEMPOOL_STATS
     ++pool->total_chunks_freed;
 #endif
@@ -616,7 +858,7 @@ static void destroy_chunks(mp_chunk_t *chunk)
   while (chunk) {
     chunk->magic = 0xd3adb33f;
     next = chunk->next;
-    safe_free(chunk);
+    mp_chunk_free(chunk);
     chunk = next;
   }
 }
@@ -646,10 +888,10 @@ assert_chunks_ok(mp_pool_t *pool, mp_chunk_t *chunk, int empty, int full)
     else
       assert(chunk->n_allocated > 0 && chunk->n_allocated < chunk->capacity);
 
-    assert(chunk->capacity == pool->new_chunk_capacity);
+    assert(chunk->capacity >= pool->new_chunk_capacity);
 
     assert(chunk->mem_size ==
-           pool->new_chunk_capacity * pool->item_alloc_size);
+           (size_t)chunk->capacity * pool->item_alloc_size);
 
     assert(chunk->next_mem >= chunk->mem &&
            chunk->next_mem <= chunk->mem + chunk->mem_size);
@@ -676,13 +918,83 @@ mp_pool_assert_ok(mp_pool_t *pool)
   assert(pool->n_empty_chunks == n_empty);
 }
 
+/** Head of the list of all pools, for telemetry consumers (/STATS). */
+mp_pool_t *
+mp_pools(void)
+{
+  return mp_allocated_pools;
+}
+
+/** Fill <b>usage</b> with a telemetry snapshot of <b>pool</b>. */
+void
+mp_pool_usage(mp_pool_t *pool, mp_pool_usage_t *usage)
+{
+  mp_chunk_t *chunk;
+
+  memset(usage, 0, sizeof(*usage));
+  usage->name = pool->name;
+  usage->item_size = pool->item_alloc_size;
+  usage->items_in_use = pool->items_in_use;
+  usage->items_peak = pool->items_peak;
+  usage->empty_chunks = pool->n_empty_chunks;
+  usage->chunks = pool->n_empty_chunks;
+
+  for (chunk = pool->empty_chunks; chunk; chunk = chunk->next) {
+    usage->items_capacity += chunk->capacity;
+    usage->bytes_committed += chunk->mem_size;
+    /* Empty chunks have been decommitted by the garbage collect pass;
+     * count their discardable pages as returned to the OS.
+     */
+    usage->bytes_decommitted += mp_chunk_decommit_size(chunk);
+  }
+  for (chunk = pool->used_chunks; chunk; chunk = chunk->next) {
+    ++usage->chunks;
+    usage->items_capacity += chunk->capacity;
+    usage->bytes_committed += chunk->mem_size;
+  }
+  for (chunk = pool->full_chunks; chunk; chunk = chunk->next) {
+    ++usage->chunks;
+    usage->items_capacity += chunk->capacity;
+    usage->bytes_committed += chunk->mem_size;
+  }
+#ifdef MEMPOOL_STATS
+  usage->total_items_allocated = pool->total_items_allocated;
+  usage->total_chunks_allocated = pool->total_chunks_allocated;
+  usage->total_chunks_freed = pool->total_chunks_freed;
+#endif
+}
+
+/** Log a one-line occupancy summary of <b>pool</b>: how many items are
+ * in use versus how much chunk memory is committed. A pool that keeps a
+ * high chunk count with a low item count is fragmented.
+ */
+static void
+mp_pool_report_occupancy(mp_pool_t *pool)
+{
+  mp_pool_usage_t usage;
+
+  mp_pool_usage(pool, &usage);
+  ircd_log(LOG_DBG, "mempool '%s': %lld/%lld items used (peak %lld) in %d chunks, %llu bytes committed, %llu decommitted",
+       usage.name ? usage.name : "???",
+       usage.items_in_use, usage.items_capacity, usage.items_peak,
+       usage.chunks, usage.bytes_committed, usage.bytes_decommitted);
+}
+
 void
 mp_pool_garbage_collect(void *arg)
 {
   mp_pool_t *pool = mp_allocated_pools;
+  mp_chunk_t *chunk;
 
-  for (; pool; pool = pool->next)
+  for (; pool; pool = pool->next) {
     mp_pool_clean(pool, 0, 1);
+    /* Chunks that survived the clean are kept for quick re-use, but
+     * their pages can be handed back to the OS in the meantime.
+     */
+    for (chunk = pool->empty_chunks; chunk; chunk = chunk->next)
+      mp_chunk_decommit(chunk);
+    mp_pool_report_occupancy(pool);
+  }
 }
 
 /** Dump information about <b>pool</b>'s memory usage to the Tor log at level
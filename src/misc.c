@@ -97,6 +97,134 @@ SpamfilterTargetTable spamfiltertargettable[] = {
 /** IRC Statistics (quite useless?) */
 struct IRCStatistics ircstats;
 
+/* Log writing is buffered: ircd_log() only appends the formatted line to
+ * a per-log-block memory buffer, and the 'log_flush' event (or an explicit
+ * ircd_log_flush() call on shutdown and for LOG_ERROR messages) writes the
+ * pending data to disk. This way a flood of log messages, such as during
+ * a kill storm or a spamfilter hit wave, cannot stall the main loop on
+ * disk I/O: once a buffer is full further lines are dropped and counted,
+ * and the loss is reported in the log file itself on the next flush.
+ */
+
+/** Maximum amount of pending (unflushed) log data per log { } block */
+#define LOG_BUFFER_SIZE 65536
+
+static int last_log_file_warning = 0;
+
+/** Complain about an unwritable log file, but not too often */
+static void ircd_log_write_warning(ConfigItem_log *logs)
+{
+	if (!loop.ircd_booted)
+	{
+		config_status("WARNING: Unable to write to '%s': %s", logs->file, strerror(ERRNO));
+	} else {
+		if (last_log_file_warning + 300 < TStime())
+		{
+			config_status("WARNING: Unable to write to '%s': %s. This warning will not re-appear for at least 5 minutes.", logs->file, strerror(ERRNO));
+			last_log_file_warning = TStime();
+		}
+	}
+}
+
+/** Write a blob of already formatted log data to one log file.
+ * Takes care of opening the log file and of log rotation.
+ * @returns 1 if the data was written in full, 0 if (some of) it was lost.
+ */
+static int ircd_log_write(ConfigItem_log *logs, const char *data, int len)
+{
+	struct stat fstats;
+
+	if (stat(logs->file, &fstats) != -1 && logs->maxsize && fstats.st_size >= logs->maxsize)
+	{
+		char oldlog[512];
+		if (logs->logfd == -1)
+		{
+			/* Try to open, so we can write the 'Max file size reached' message. */
+			logs->logfd = fd_fileopen(logs->file, O_CREAT|O_APPEND|O_WRONLY);
+		}
+		if (logs->logfd != -1)
+		{
+			if (write(logs->logfd, "Max file size reached, starting new log file\n", 45) < 0)
+			{
+				/* We already handle the unable to write to log file case for normal data.
+				 * I think we can get away with not handling this one.
+				 */
+				;
+			}
+			fd_close(logs->logfd);
+		}
+
+		/* Rename log file to xxxxxx.old */
+		snprintf(oldlog, sizeof(oldlog), "%s.old", logs->file);
+		rename(logs->file, oldlog);
+
+		logs->logfd = fd_fileopen(logs->file, O_CREAT|O_WRONLY|O_TRUNC);
+		if (logs->logfd == -1)
+			return 0;
+	}
+	else if (logs->logfd == -1) {
+		logs->logfd = fd_fileopen(logs->file, O_CREAT|O_APPEND|O_WRONLY);
+		if (logs->logfd == -1)
+		{
+			ircd_log_write_warning(logs);
+			return 0;
+		}
+	}
+
+	if (write(logs->logfd, data, len) != len)
+	{
+		ircd_log_write_warning(logs);
+		return 0;
+	}
+	return 1;
+}
+
+/** Flush all pending log data to disk.
+ * Called once per second by the 'log_flush' event, immediately for
+ * LOG_ERROR messages (which may precede a crash or exit), and on
+ * shutdown / restart / rehash.
+ */
+void ircd_log_flush(void)
+{
+	static char flushing = 0;
+	ConfigItem_log *logs;
+	int len;
+
+	/* config_status() on a write error would recurse into us via ircd_log() */
+	if (flushing)
+		return;
+	flushing = 1;
+
+	for (logs = conf_log; logs; logs = logs->next)
+	{
+		if (!logs->bufferlen)
+			continue;
+		len = logs->bufferlen;
+		logs->bufferlen = 0;
+		if (!ircd_log_write(logs, logs->buffer, len))
+			continue;
+		if (logs->dropped)
+		{
+			char dropmsg[256];
+			snprintf(dropmsg, sizeof(dropmsg), "[%s] - WARNING: %lld log message(s) were dropped (log buffer full)\n",
+			         myctime(TStime()), logs->dropped);
+			if (ircd_log_write(logs, dropmsg, strlen(dropmsg)))
+				logs->dropped = 0;
+		}
+#ifndef _WIN32
+		if (LOG_FSYNC && (logs->logfd != -1))
+			fsync(logs->logfd);
+#endif
+	}
+
+	flushing = 0;
+}
+
+EVENT(log_flush)
+{
+	ircd_log_flush();
+}
+
 /** Main IRCd logging function.
  * @param flags		One of LOG_* (eg: LOG_ERROR)
  * @param format	Format string
@@ -106,15 +234,11 @@ struct IRCStatistics ircstats;
  */
 void ircd_log(int flags, FORMAT_STRING(const char *format), ...)
 {
-	static int last_log_file_warning = 0;
 	static char recursion_trap=0;
 
 	va_list ap;
 	ConfigItem_log *logs;
 	char buf[2048], timebuf[128];
-	struct stat fstats;
-	int written = 0;
-	int n;
 
 	/* Trap infinite recursions to avoid crash if log file is unavailable,
 	 * this will also avoid calling ircd_log from anything else called
@@ -150,95 +274,38 @@ void ircd_log(int flags, FORMAT_STRING(const char *format), ...)
 #ifdef HAVE_SYSLOG
 		if (!strcasecmp(logs->file, "syslog") && logs->flags & flags) {
 			syslog(LOG_INFO, "%s", buf);
-			written++;
 			continue;
 		}
 #endif
 		if (logs->flags & flags)
 		{
-			if (stat(logs->file, &fstats) != -1 && logs->maxsize && fstats.st_size >= logs->maxsize)
+			int timelen = strlen(timebuf);
+			int buflen = strlen(buf);
+
+			/* Queue the line, ircd_log_flush() takes it from here.
+			 * If the buffer is full then the disk cannot keep up
+			 * with the log rate: drop the line and count the loss
+			 * rather than stalling the main loop.
+			 */
+			if (!logs->buffer)
+				logs->buffer = safe_alloc(LOG_BUFFER_SIZE);
+			if (logs->bufferlen + timelen + buflen > LOG_BUFFER_SIZE)
 			{
-				char oldlog[512];
-				if (logs->logfd == -1)
-				{
-					/* Try to open, so we can write the 'Max file size reached' message. */
-#ifndef _WIN32
-					logs->logfd = fd_fileopen(logs->file, O_CREAT|O_APPEND|O_WRONLY);
-#else
-					logs->logfd = fd_fileopen(logs->file, O_CREAT|O_APPEND|O_WRONLY);
-#endif
-				}
-				if (logs->logfd != -1)
-				{
-					if (write(logs->logfd, "Max file size reached, starting new log file\n", 45) < 0)
-					{
-						/* We already handle the unable to write to log file case for normal data.
-						 * I think we can get away with not handling this one.
-						 */
-						;
-					}
-					fd_close(logs->logfd);
-				}
-
-				/* Rename log file to xxxxxx.old */
-				snprintf(oldlog, sizeof(oldlog), "%s.old", logs->file);
-				rename(logs->file, oldlog);
-
-				logs->logfd = fd_fileopen(logs->file, O_CREAT|O_WRONLY|O_TRUNC);
-				if (logs->logfd == -1)
-					continue;
-			}
-			else if (logs->logfd == -1) {
-#ifndef _WIN32
-				logs->logfd = fd_fileopen(logs->file, O_CREAT|O_APPEND|O_WRONLY);
-#else
-				logs->logfd = fd_fileopen(logs->file, O_CREAT|O_APPEND|O_WRONLY);
-#endif
-				if (logs->logfd == -1)
-				{
-					if (!loop.ircd_booted)
-					{
-						config_status("WARNING: Unable to write to '%s': %s", logs->file, strerror(ERRNO));
-					} else {
-						if (last_log_file_warning + 300 < TStime())
-						{
-							config_status("WARNING: Unable to write to '%s': %s. This warning will not re-appear for at least 5 minutes.", logs->file, strerror(ERRNO));
-							last_log_file_warning = TStime();
-						}
-					}
-					continue;
-				}
-			}
-			/* this shouldn't happen, but lets not waste unnecessary syscalls... */
-			if (logs->logfd == -1)
+				logs->dropped++;
 				continue;
-			if (write(logs->logfd, timebuf, strlen(timebuf)) < 0)
-			{
-				/* Let's ignore any write errors for this one. Next write() will catch it... */
-				;
-			}
-			n = write(logs->logfd, buf, strlen(buf));
-			if (n == strlen(buf))
-			{
-				written++;
-			}
-			else
-			{
-				if (!loop.ircd_booted)
-				{
-					config_status("WARNING: Unable to write to '%s': %s", logs->file, strerror(ERRNO));
-				} else {
-					if (last_log_file_warning + 300 < TStime())
-					{
-						config_status("WARNING: Unable to write to '%s': %s. This warning will not re-appear for at least 5 minutes.", logs->file, strerror(ERRNO));
-						last_log_file_warning = TStime();
-					}
-				}
 			}
+			memcpy(logs->buffer + logs->bufferlen, timebuf, timelen);
+			logs->bufferlen += timelen;
+			memcpy(logs->buffer + logs->bufferlen, buf, buflen);
+			logs->bufferlen += buflen;
 		}
 	}
 
 	recursion_trap = 0;
+
+	/* Errors may precede a crash or exit, get them out immediately */
+	if (flags & LOG_ERROR)
+		ircd_log_flush();
 }
 
 /** Returns the date in rather long string */
@@ -494,10 +561,43 @@ void set_sockhost(Client *client, char *host)
 	strlcpy(client->local->sockhost, s, sizeof(client->local->sockhost));
 }
 
+/* == Bloom guarded client lists ==
+ * Small per-client allow/deny lists (DCCALLOW today, and any future
+ * SILENCE style list) are consulted for events that nearly never
+ * match. A 64 bit bloom word kept next to the list makes the common
+ * miss two bit tests instead of a walk: every entry OR's in the bits
+ * of list_bloom_mask(), lookups bail out when one of them is clear,
+ * and removals rebuild the word from the (short) list.
+ */
+
+/** Returns the bloom mask (two bits) that an entry for 'client' sets */
+uint64_t list_bloom_mask(Client *client)
+{
+	uint64_t h = (uint64_t)(uintptr_t)client * 0x9e3779b97f4a7c15ULL;
+
+	return (1ULL << (h >> 58)) | (1ULL << ((h >> 52) & 63));
+}
+
+/** Recomputes the DCCALLOW bloom word of 'client', used after removals */
+void dccallow_bloom_rebuild(Client *client)
+{
+	Link *lp;
+
+	client->user->dccallow_bloom = 0;
+	for (lp = client->user->dccallow; lp; lp = lp->next)
+		if (lp->flags == DCC_LINK_ME)
+			client->user->dccallow_bloom |= list_bloom_mask(lp->value.client);
+}
+
 /** Returns 1 if 'from' is on the allow list of 'to' */
 int on_dccallow_list(Client *to, Client *from)
 {
 	Link *lp;
+	uint64_t mask = list_bloom_mask(from);
+
+	/* Settles the common "no entry" case without walking the list */
+	if ((to->user->dccallow_bloom & mask) != mask)
+		return 0;
 
 	for(lp = to->user->dccallow; lp; lp = lp->next)
 		if(lp->flags == DCC_LINK_ME && lp->value.client == from)
@@ -534,6 +634,8 @@ void remove_dcc_references(Client *client)
 				}
 				tmp = *lpp;
 				*lpp = tmp->next;
+				if (tmp->flags == DCC_LINK_ME)
+					dccallow_bloom_rebuild(acptr);
 				free_link(tmp);
 				found++;
 				break;
@@ -572,13 +674,135 @@ static void recurse_send_quits(Client *cptr, Client *client, Client *from, Clien
 		sendto_one(to, mtags, "SQUIT %s :%s", client->name, comment);
 }
 
+/* Deferred (batched) exiting of the dependents of a split server.
+ *
+ * When a hub splits, tearing down many thousands of remote clients in
+ * one go (hash removals, watch notifications, common-channel QUIT
+ * fanout) used to freeze the event loop for seconds. Instead the
+ * dependent clients are queued here and exit_one_client() is run on
+ * them in bounded batches from the main loop (process_pending_exits),
+ * which keeps input latency flat during a netsplit.
+ *
+ * Two invariants make this safe:
+ * 1) A server is always queued after its dependents, so by the time a
+ *    server is processed everything below it is already gone.
+ * 2) Exited-but-not-yet-freed clients on dead_list are not freed while
+ *    this queue is non-empty (see check_deadsockets), so pointers held
+ *    by queued clients (srvptr, direction) stay valid.
+ * A queued client that gets exited through other means in the meantime
+ * (eg: a KILL from services) loses its CLIENT_FLAG_DEFERREDEXIT flag
+ * in exit_one_client() and is then simply skipped by the queue.
+ */
+typedef struct PendingExitBatch PendingExitBatch;
+/** Shared context for the deferred exits caused by one server split */
+struct PendingExitBatch {
+	MessageTag *mtags;	/**< Base message tags for the QUITs (our own copy) */
+	char *splitstr;		/**< Netsplit quit reason for the dependent clients */
+	char *comment;		/**< The (s)quit reason for the server itself */
+	int refcount;		/**< Number of references (queue entries) left */
+};
+typedef struct PendingExit PendingExit;
+/** One queued deferred client exit */
+struct PendingExit {
+	PendingExit *next;
+	Client *client;		/**< The client to exit */
+	PendingExitBatch *batch;
+	char *comment;		/**< Quit reason - points into 'batch', not owned */
+};
+
+/** How many deferred exits to process per main loop iteration.
+ * The main loop does not sleep in the I/O engine while the queue is
+ * non-empty, so even a large split drains in a fraction of a second
+ * while inbound traffic keeps being serviced in between the batches.
+ */
+#define PENDING_EXIT_BATCH 128
+
+static PendingExit *pending_exits = NULL, *pending_exits_tail = NULL;
+
+/** Are any deferred exits queued? */
+int pending_exits_queued(void)
+{
+	return pending_exits ? 1 : 0;
+}
+
+static PendingExitBatch *pending_exit_batch_start(MessageTag *mtags, const char *comment, const char *splitstr)
+{
+	PendingExitBatch *batch = safe_alloc(sizeof(PendingExitBatch));
+	MessageTag *m, *n;
+
+	for (m = mtags; m; m = m->next)
+	{
+		n = duplicate_mtag(m);
+		AppendListItem(n, batch->mtags);
+	}
+	safe_strdup(batch->comment, comment);
+	safe_strdup(batch->splitstr, splitstr);
+	batch->refcount = 1; /* dropped by exit_client() once the server itself is queued */
+	return batch;
+}
+
+static void pending_exit_batch_release(PendingExitBatch *batch)
+{
+	if (--batch->refcount > 0)
+		return;
+	free_message_tags(batch->mtags);
+	safe_free(batch->comment);
+	safe_free(batch->splitstr);
+	safe_free(batch);
+}
+
+static void queue_pending_exit(Client *client, PendingExitBatch *batch, char *comment)
+{
+	PendingExit *pe;
+
+	if (IsDeferredExit(client))
+		return; /* already queued (eg: server split while a previous split still drains) */
+
+	pe = safe_alloc(sizeof(PendingExit));
+	pe->client = client;
+	pe->batch = batch;
+	pe->comment = comment;
+	batch->refcount++;
+	SetDeferredExit(client);
+
+	if (pending_exits_tail)
+		pending_exits_tail->next = pe;
+	else
+		pending_exits = pe;
+	pending_exits_tail = pe;
+}
+
+/** Process a bounded number of queued deferred exits.
+ * Called from the main loop (once per iteration).
+ */
+void process_pending_exits(void)
+{
+	PendingExit *pe;
+	int n = PENDING_EXIT_BATCH;
+
+	while ((pe = pending_exits) && n--)
+	{
+		pending_exits = pe->next;
+		if (!pending_exits)
+			pending_exits_tail = NULL;
+
+		if (IsDeferredExit(pe->client))
+		{
+			ClearDeferredExit(pe->client);
+			exit_one_client(pe->client, pe->batch->mtags, pe->comment);
+		}
+		pending_exit_batch_release(pe->batch);
+		safe_free(pe);
+	}
+}
+
 /*
- * Remove all clients that depend on source_p; assumes all (S)QUITs have
- * already been sent.  we make sure to exit a server's dependent clients
- * and servers before the server itself; exit_one_client takes care of
- * actually removing things off llists.   tweaked from +CSr31  -orabidoo
+ * Queue all clients that depend on source_p for deferred removal;
+ * assumes all (S)QUITs have already been sent.  we make sure to queue a
+ * server's dependent clients and servers before the server itself, so
+ * they are also exited in that order.   tweaked from +CSr31  -orabidoo
  */
-static void recurse_remove_clients(Client *client, MessageTag *mtags, const char *comment)
+static void recurse_remove_clients(Client *client, PendingExitBatch *batch)
 {
 	Client *acptr, *next;
 
@@ -587,16 +811,16 @@ static void recurse_remove_clients(Client *client, MessageTag *mtags, const char
 		if (acptr->srvptr != client)
 			continue;
 
-		exit_one_client(acptr, mtags, comment);
+		queue_pending_exit(acptr, batch, batch->splitstr);
 	}
 
 	list_for_each_entry_safe(acptr, next, &global_server_list, client_node)
 	{
-		if (acptr->srvptr != client)
+		if (acptr->srvptr != client || IsDeferredExit(acptr))
 			continue;
 
-		recurse_remove_clients(acptr, mtags, comment);
-		exit_one_client(acptr, mtags, comment);
+		recurse_remove_clients(acptr, batch);
+		queue_pending_exit(acptr, batch, batch->splitstr);
 	}
 }
 
@@ -604,15 +828,20 @@ static void recurse_remove_clients(Client *client, MessageTag *mtags, const char
 ** Remove *everything* that depends on source_p, from all lists, and sending
 ** all necessary QUITs and SQUITs.  source_p itself is still on the lists,
 ** and its SQUITs have been sent except for the upstream one  -orabidoo
+** The dependents are queued for deferred removal; the returned batch is
+** used by exit_client() to queue source_p itself behind them.
 */
-static void remove_dependents(Client *client, Client *from, MessageTag *mtags, const char *comment, const char *splitstr)
+static PendingExitBatch *remove_dependents(Client *client, Client *from, MessageTag *mtags, const char *comment, const char *splitstr)
 {
+	PendingExitBatch *batch;
 	Client *acptr;
 
 	list_for_each_entry(acptr, &global_server_list, client_node)
 		recurse_send_quits(client, client, from, acptr, mtags, comment, splitstr);
 
-	recurse_remove_clients(client, mtags, splitstr);
+	batch = pending_exit_batch_start(mtags, comment, splitstr);
+	recurse_remove_clients(client, batch);
+	return batch;
 }
 
 /*
@@ -626,6 +855,14 @@ static void exit_one_client(Client *client, MessageTag *mtags_i, const char *com
 
 	assert(!IsMe(client));
 
+	/* If this client was queued for a deferred exit but is exiting
+	 * through another way (eg: a KILL from services while a netsplit
+	 * is still being processed), then un-flag it so the deferred exit
+	 * queue knows to skip it.
+	 */
+	if (IsDeferredExit(client))
+		ClearDeferredExit(client);
+
 	if (IsUser(client))
 	{
 		MessageTag *mtags_o = NULL;
@@ -688,6 +925,7 @@ void exit_client(Client *client, MessageTag *recv_mtags, char *comment)
 	long long on_for;
 	ConfigItem_listen *listen_conf;
 	MessageTag *mtags_generated = NULL;
+	PendingExitBatch *batch = NULL;
 
 	if (IsDead(client))
 		return; /* Already marked as exited */
@@ -734,6 +972,7 @@ void exit_client(Client *client, MessageTag *recv_mtags, char *comment)
 			ircd_log(LOG_SERVER, "SQUIT %s (%s)", client->name, comment);
 		}
 		free_pending_net(client);
+		tls_handshake_dequeue(client);
 		if (client->local->listener)
 			if (client->local->listener && !IsOutgoing(client))
 			{
@@ -797,7 +1036,7 @@ void exit_client(Client *client, MessageTag *recv_mtags, char *comment)
 		else
 			ircsnprintf(splitstr, sizeof splitstr, "%s %s", client->srvptr->name, client->name);
 
-		remove_dependents(client, client->direction, recv_mtags, comment, splitstr);
+		batch = remove_dependents(client, client->direction, recv_mtags, comment, splitstr);
 
 		RunHook2(HOOKTYPE_SERVER_QUIT, client, recv_mtags);
 	}
@@ -807,7 +1046,16 @@ void exit_client(Client *client, MessageTag *recv_mtags, char *comment)
 	}
 
 	/* Finally, the client/server itself exits.. */
-	exit_one_client(client, recv_mtags, comment);
+	if (batch)
+	{
+		/* ..behind its (deferred) dependents, so it is still around
+		 * while they are being processed.
+		 */
+		queue_pending_exit(client, batch, batch->comment);
+		pending_exit_batch_release(batch);
+	}
+	else
+		exit_one_client(client, recv_mtags, comment);
 
 	free_message_tags(mtags_generated);
 	
@@ -1408,6 +1656,78 @@ MessageTag *find_mtag(MessageTag *mtags, const char *token)
 	return NULL;
 }
 
+/** Per-message bump arena for inbound message tags.
+ * The tags of an inbound message live exactly as long as the command
+ * that carried them: parse() frees the list right after command
+ * processing. Carving the nodes and their strings out of a small
+ * arena that is reset after every message avoids the malloc/free
+ * churn of allocating three blocks per tag per message. Anything
+ * that must outlive the message is a deep copy made with
+ * duplicate_mtag(), which always uses the heap.
+ */
+#define MTAG_ARENA_SIZE 8192
+static char mtag_arena[MTAG_ARENA_SIZE];
+static int mtag_arena_used = 0;
+
+/** Allocate 'size' zeroed bytes from the message tag arena,
+ * or return NULL if the arena is full.
+ */
+static void *mtag_arena_alloc(int size)
+{
+	char *p;
+
+	size = (size + 7) & ~7; /* keep everything pointer-aligned */
+	if (mtag_arena_used + size > MTAG_ARENA_SIZE)
+		return NULL;
+	p = mtag_arena + mtag_arena_used;
+	mtag_arena_used += size;
+	memset(p, 0, size);
+	return p;
+}
+
+/** Reset the message tag arena. Called from parse() after the
+ * inbound message - and thus any arena-carved tags - is processed.
+ */
+void mtag_arena_reset(void)
+{
+	mtag_arena_used = 0;
+}
+
+/** Allocate a MessageTag with the given name and value (value may be
+ * NULL) from the per-message arena. The tag, including its strings,
+ * is carved out of one arena block and is implicitly gone after
+ * mtag_arena_reset(), so this may ONLY be used for tags that do not
+ * outlive processing of the current inbound message.
+ * If the arena is full then this quietly falls back to a regular
+ * heap allocation, which free_message_tags() will free as usual.
+ */
+MessageTag *new_mtag_arena(const char *name, const char *value)
+{
+	int namelen = strlen(name) + 1;
+	int valuelen = value ? strlen(value) + 1 : 0;
+	MessageTag *m = mtag_arena_alloc(sizeof(MessageTag) + namelen + valuelen);
+
+	if (!m)
+	{
+		/* Arena full (eg: tags processed outside of parse()) */
+		m = safe_alloc(sizeof(MessageTag));
+		safe_strdup(m->name, name);
+		if (value)
+			safe_strdup(m->value, value);
+		return m;
+	}
+
+	m->arena = 1;
+	m->name = (char *)m + sizeof(MessageTag);
+	memcpy(m->name, name, namelen);
+	if (value)
+	{
+		m->value = m->name + namelen;
+		memcpy(m->value, value, valuelen);
+	}
+	return m;
+}
+
 /** Free all message tags in the list 'm' */
 void free_message_tags(MessageTag *m)
 {
@@ -1416,6 +1736,15 @@ void free_message_tags(MessageTag *m)
 	for (; m; m = m_next)
 	{
 		m_next = m->next;
+		if (m->memo)
+		{
+			int i;
+			for (i = 0; i < m->memo->n; i++)
+				safe_free(m->memo->str[i]);
+			safe_free(m->memo);
+		}
+		if (m->arena)
+			continue; /* node and strings die with the arena */
 		safe_free(m->name);
 		safe_free(m->value);
 		safe_free(m);
@@ -1434,6 +1763,55 @@ MessageTag *duplicate_mtag(MessageTag *mtag)
 	return m;
 }
 
+/** Duplicate a MessageTag structure - shared (shallow) edition.
+ * The returned node shares the name/value strings of the original
+ * instead of copying them, so inheriting a tag into a new list
+ * (the common case in HOOKTYPE_NEW_MESSAGE handlers) is just a
+ * node allocation from the per-message arena.
+ * @note  The copy is only valid while the original exists and only
+ *        during processing of the current (inbound) message - both
+ *        always hold for tags inherited from 'recv_mtags'. Also,
+ *        the shared strings must not be modified through the copy;
+ *        use duplicate_mtag() if you intend to rewrite the value.
+ *        Freeing via free_message_tags() works as usual.
+ */
+MessageTag *duplicate_mtag_shared(MessageTag *mtag)
+{
+	MessageTag *m = mtag_arena_alloc(sizeof(MessageTag));
+
+	if (!m)
+		return duplicate_mtag(mtag); /* arena full, deep copy so free semantics stay simple */
+
+	m->arena = 1;
+	m->name = mtag->name;
+	m->value = mtag->value;
+	return m;
+}
+
+/** Allocate a MessageTag from the per-message arena that references
+ * the caller's name/value strings instead of copying them.
+ * This is for tag handlers that keep the value around anyway
+ * (eg: on the sender's Client), so attaching the tag costs only a
+ * node allocation and zero string copies.
+ * @note  Both 'name' and 'value' must remain valid and unmodified
+ *        until processing of the current message is finished, and
+ *        the strings must not be modified through the tag either.
+ *        If the arena is full this falls back to a deep heap copy,
+ *        so free_message_tags() works as usual either way.
+ */
+MessageTag *new_mtag_arena_shared(char *name, char *value)
+{
+	MessageTag *m = mtag_arena_alloc(sizeof(MessageTag));
+
+	if (!m)
+		return new_mtag_arena(name, value); /* falls back to heap itself */
+
+	m->arena = 1;
+	m->name = name;
+	m->value = value;
+	return m;
+}
+
 /** New message. Either really brand new, or inherited from other servers.
  * This function calls modules so they can add tags, such as:
  * msgid, time and account.
@@ -1771,6 +2149,413 @@ int read_str(FILE *fd, char **x)
 	return 1;
 }
 
+/* Write-behind database persistence.
+ *
+ * The *db modules (tkldb, channeldb, ..) used to serialize their entire
+ * database straight to a temporary file from the main loop. On a slow or
+ * busy disk that can stall the IRCd for a noticeable amount of time.
+ * With these helpers the database is serialized to a memory buffer
+ * instead (which is fast and cannot fail due to I/O), after which the
+ * buffer is flushed to the temporary file in bounded chunks from the
+ * main loop, optionally fsync()'d, and finally renamed into place.
+ *
+ * Usage from a module:
+ *   fd = dbwrite_open();    // in-memory FILE, or NULL - in which case
+ *                           // the caller falls back to writing the
+ *                           // temporary file directly (eg on Windows).
+ *   ..write_int32() / write_str() / etc. as usual..
+ *   dbwrite_submit(fd, filename, do_fsync);  // on success, or..
+ *   dbwrite_discard(fd);                     // on a write error.
+ */
+
+/** How many bytes to write to disk per main loop iteration */
+#define DBWRITE_CHUNK_SIZE 262144
+
+/** An in-memory database snapshot that is still being serialized */
+typedef struct DBWriteSnapshot DBWriteSnapshot;
+struct DBWriteSnapshot {
+	DBWriteSnapshot *prev, *next;
+	FILE *fd; /**< The memory stream handed out to the module */
+	char *data; /**< Buffer managed by open_memstream() */
+	size_t len; /**< Length of 'data', set on fclose() */
+};
+
+/** A submitted snapshot that is being written out to disk */
+typedef struct DBWriteJob DBWriteJob;
+struct DBWriteJob {
+	DBWriteJob *prev, *next;
+	char *filename; /**< Final database path */
+	char *tmpfname; /**< Temporary file, renamed to 'filename' when complete */
+	char *data; /**< The serialized database */
+	size_t len; /**< Total length of 'data' */
+	size_t written; /**< How much of 'data' has been written so far */
+	FILE *fd; /**< The temporary file (opened on first dbwrite_run() visit) */
+	int do_fsync; /**< Fsync before the final rename? */
+	int inflight; /**< Being written by a worker thread right now */
+	int failed; /**< Worker thread write failed, see 'errmsg' */
+	char errmsg[512]; /**< Error to report from the main loop */
+};
+
+static DBWriteSnapshot *dbwritesnapshots = NULL;
+static DBWriteJob *dbwritejobs = NULL;
+
+static DBWriteSnapshot *dbwrite_find_snapshot(FILE *fd)
+{
+	DBWriteSnapshot *s;
+
+	for (s = dbwritesnapshots; s; s = s->next)
+		if (s->fd == fd)
+			return s;
+	return NULL;
+}
+
+/** Open an in-memory FILE to serialize a database to.
+ * @returns A FILE pointer, or NULL if memory streams are unavailable
+ *          (the caller should then write to the tempfile directly).
+ */
+FILE *dbwrite_open(void)
+{
+#ifdef _WIN32
+	return NULL; /* no open_memstream() - use the synchronous path */
+#else
+	DBWriteSnapshot *s = safe_alloc(sizeof(DBWriteSnapshot));
+
+	s->fd = open_memstream(&s->data, &s->len);
+	if (!s->fd)
+	{
+		safe_free(s);
+		return NULL;
+	}
+	AddListItem(s, dbwritesnapshots);
+	return s->fd;
+#endif
+}
+
+/** Throw away a (possibly in-memory) database file after a write error.
+ * This accepts any FILE: if 'fd' did not come from dbwrite_open() then
+ * this is simply fclose(fd), so module error paths need not care which
+ * kind of file they are dealing with.
+ */
+void dbwrite_discard(FILE *fd)
+{
+	DBWriteSnapshot *s = dbwrite_find_snapshot(fd);
+
+	fclose(fd);
+	if (s)
+	{
+		DelListItem(s, dbwritesnapshots);
+		/* 'data' is malloc'ed by open_memstream(), finalized by fclose() */
+		if (s->data)
+			free(s->data);
+		safe_free(s);
+	}
+}
+
+/** Is a worker thread writing this database right now? */
+static int dbwrite_file_inflight(const char *filename)
+{
+	DBWriteJob *job;
+
+	for (job = dbwritejobs; job; job = job->next)
+		if (job->inflight && !strcmp(job->filename, filename))
+			return 1;
+	return 0;
+}
+
+/** Free a (cancelled or failed) write job, removing the tempfile */
+static void dbwrite_job_cancel(DBWriteJob *job)
+{
+	DelListItem(job, dbwritejobs);
+	if (job->fd)
+		fclose(job->fd);
+	/* Jobs for the same database share the tempfile name. If a worker
+	 * thread is writing this database right now then the tempfile is
+	 * that job's, not ours - unlinking it would make the worker's
+	 * rename fail with a spurious "DATABASE NOT SAVED" alert.
+	 */
+	if (!dbwrite_file_inflight(job->filename))
+		unlink(job->tmpfname); /* harmless if it does not exist (yet) */
+	if (job->data)
+		free(job->data);
+	safe_free(job->filename);
+	safe_free(job->tmpfname);
+	safe_free(job);
+}
+
+/** Submit a completed in-memory database for writing to disk.
+ * @param fd        The FILE from dbwrite_open()
+ * @param filename  The final database path ("<filename>.tmp" is used
+ *                  as the temporary file)
+ * @param do_fsync  If nonzero, fsync() the tempfile before renaming it
+ *                  into place.
+ * @returns 1 on success, 0 on failure (in which case the FILE has been
+ *          cleaned up already and nothing will be written).
+ * @note  Any not-yet-finished write for the same database is superseded
+ *        by the new snapshot and cancelled.
+ */
+int dbwrite_submit(FILE *fd, const char *filename, int do_fsync)
+{
+	DBWriteSnapshot *s = dbwrite_find_snapshot(fd);
+	DBWriteJob *job, *job_next;
+	char tmpfname[512];
+
+	if (!s)
+	{
+		/* Not ours - this is a caller bug */
+		fclose(fd);
+		return 0;
+	}
+
+	if (fclose(fd) != 0)
+	{
+		DelListItem(s, dbwritesnapshots);
+		if (s->data)
+			free(s->data);
+		safe_free(s);
+		return 0;
+	}
+
+	/* A newer snapshot makes any queued write for this database
+	 * obsolete. A write that a worker thread is executing right now
+	 * cannot be cancelled anymore; the new snapshot simply queues
+	 * behind it (dbwrite_run never runs two writes for the same
+	 * database concurrently).
+	 */
+	for (job = dbwritejobs; job; job = job_next)
+	{
+		job_next = job->next;
+		if (!job->inflight && !strcmp(job->filename, filename))
+			dbwrite_job_cancel(job);
+	}
+
+	snprintf(tmpfname, sizeof(tmpfname), "%s.tmp", filename);
+	job = safe_alloc(sizeof(DBWriteJob));
+	safe_strdup(job->filename, filename);
+	safe_strdup(job->tmpfname, tmpfname);
+	job->data = s->data;
+	job->len = s->len;
+	job->do_fsync = do_fsync;
+	AddListItem(job, dbwritejobs);
+
+	DelListItem(s, dbwritesnapshots);
+	safe_free(s);
+	return 1;
+}
+
+#ifndef _WIN32
+/** Worker thread side of a database write: the whole write, fsync and
+ * rename happens here, off the main thread. This runs concurrently
+ * with the daemon so it must only touch its own job - errors are
+ * recorded in the job and reported by dbwrite_job_complete().
+ */
+static void dbwrite_job_work(void *data)
+{
+	DBWriteJob *job = data;
+	FILE *fd;
+
+	fd = fopen(job->tmpfname, "wb");
+	if (!fd)
+	{
+		snprintf(job->errmsg, sizeof(job->errmsg),
+		         "[dbwrite] Error opening temporary database file "
+		         "'%s': %s (DATABASE NOT SAVED)",
+		         job->tmpfname, strerror(errno));
+		job->failed = 1;
+		return;
+	}
+	if ((job->len && (fwrite(job->data, 1, job->len, fd) < job->len)) ||
+	    (fflush(fd) != 0))
+	{
+		snprintf(job->errmsg, sizeof(job->errmsg),
+		         "[dbwrite] Error writing to temporary database file "
+		         "'%s': %s (DATABASE NOT SAVED)",
+		         job->tmpfname, strerror(errno));
+		job->failed = 1;
+		fclose(fd);
+		return;
+	}
+	if (job->do_fsync && (fsync(fileno(fd)) < 0))
+	{
+		snprintf(job->errmsg, sizeof(job->errmsg),
+		         "[dbwrite] Error syncing temporary database file "
+		         "'%s': %s (DATABASE NOT SAVED)",
+		         job->tmpfname, strerror(errno));
+		job->failed = 1;
+		fclose(fd);
+		return;
+	}
+	if (fclose(fd) != 0)
+	{
+		snprintf(job->errmsg, sizeof(job->errmsg),
+		         "[dbwrite] Error writing to temporary database file "
+		         "'%s': %s (DATABASE NOT SAVED)",
+		         job->tmpfname, strerror(errno));
+		job->failed = 1;
+		return;
+	}
+	if (rename(job->tmpfname, job->filename) < 0)
+	{
+		snprintf(job->errmsg, sizeof(job->errmsg),
+		         "[dbwrite] Error renaming '%s' to '%s': %s "
+		         "(DATABASE NOT SAVED)",
+		         job->tmpfname, job->filename, strerror(errno));
+		job->failed = 1;
+	}
+}
+
+/** Main loop side of a worker thread database write: report the
+ * result and free the job.
+ */
+static void dbwrite_job_complete(void *data)
+{
+	DBWriteJob *job = data;
+
+	job->inflight = 0;
+	if (job->failed)
+	{
+		sendto_realops_and_log("%s", job->errmsg);
+		dbwrite_job_cancel(job);
+		return;
+	}
+	DelListItem(job, dbwritejobs);
+	if (job->data)
+		free(job->data);
+	safe_free(job->filename);
+	safe_free(job->tmpfname);
+	safe_free(job);
+}
+#endif
+
+/** Push pending database writes forward.
+ * With worker threads available this only hands jobs to the pool (the
+ * write, fsync and rename all happen off the main thread). Without
+ * them, each call writes a bounded amount of data (DBWRITE_CHUNK_SIZE
+ * bytes at most) so the main loop never stalls on a slow disk.
+ */
+void dbwrite_run(void)
+{
+	DBWriteJob *job = dbwritejobs;
+	size_t chunk;
+
+	if (!job)
+		return;
+
+#ifndef _WIN32
+	if (workers_available())
+	{
+		DBWriteJob *other;
+
+		for (job = dbwritejobs; job; job = job->next)
+		{
+			if (job->inflight || job->fd)
+				continue;
+			/* Writes for the same database must not run
+			 * concurrently: wait for the older one to finish.
+			 */
+			for (other = dbwritejobs; other; other = other->next)
+				if (other->inflight && !strcmp(other->filename, job->filename))
+					break;
+			if (other)
+				continue;
+			job->inflight = 1;
+			if (!worker_submit(dbwrite_job_work, dbwrite_job_complete, job))
+			{
+				job->inflight = 0;
+				break; /* no workers after all - chunked path next call */
+			}
+		}
+		return;
+	}
+#endif
+
+	if (!job->fd)
+	{
+		job->fd = fopen(job->tmpfname, "wb");
+		if (!job->fd)
+		{
+			sendto_realops_and_log("[dbwrite] Error opening temporary database file "
+			                       "'%s': %s (DATABASE NOT SAVED)",
+			                       job->tmpfname, strerror(errno));
+			dbwrite_job_cancel(job);
+			return;
+		}
+	}
+
+	chunk = job->len - job->written;
+	if (chunk > DBWRITE_CHUNK_SIZE)
+		chunk = DBWRITE_CHUNK_SIZE;
+	if (chunk && (fwrite(job->data + job->written, 1, chunk, job->fd) < chunk))
+	{
+		sendto_realops_and_log("[dbwrite] Error writing to temporary database file "
+		                       "'%s': %s (DATABASE NOT SAVED)",
+		                       job->tmpfname, strerror(errno));
+		dbwrite_job_cancel(job);
+		return;
+	}
+	job->written += chunk;
+	if (job->written < job->len)
+		return; /* more to do next loop iteration */
+
+	/* All data is out: flush, optionally fsync, and rename into place */
+	if (fflush(job->fd) != 0)
+	{
+		sendto_realops_and_log("[dbwrite] Error writing to temporary database file "
+		                       "'%s': %s (DATABASE NOT SAVED)",
+		                       job->tmpfname, strerror(errno));
+		dbwrite_job_cancel(job);
+		return;
+	}
+#ifndef _WIN32
+	if (job->do_fsync && (fsync(fileno(job->fd)) < 0))
+	{
+		sendto_realops_and_log("[dbwrite] Error syncing temporary database file "
+		                       "'%s': %s (DATABASE NOT SAVED)",
+		                       job->tmpfname, strerror(errno));
+		dbwrite_job_cancel(job);
+		return;
+	}
+#endif
+	if (fclose(job->fd) != 0)
+	{
+		job->fd = NULL;
+		sendto_realops_and_log("[dbwrite] Error writing to temporary database file "
+		                       "'%s': %s (DATABASE NOT SAVED)",
+		                       job->tmpfname, strerror(errno));
+		dbwrite_job_cancel(job);
+		return;
+	}
+	job->fd = NULL;
+#ifdef _WIN32
+	/* The rename operation cannot be atomic on Windows as it will cause a "file exists" error */
+	unlink(job->filename);
+#endif
+	if (rename(job->tmpfname, job->filename) < 0)
+		sendto_realops_and_log("[dbwrite] Error renaming '%s' to '%s': %s (DATABASE NOT SAVED)",
+		                       job->tmpfname, job->filename, strerror(errno));
+	if (job->data)
+		free(job->data);
+	DelListItem(job, dbwritejobs);
+	safe_free(job->filename);
+	safe_free(job->tmpfname);
+	safe_free(job);
+}
+
+/** Synchronously finish all pending database writes.
+ * Called on shutdown / module unload, when the main loop can no longer
+ * be relied upon to drain the queue.
+ */
+void dbwrite_flush(void)
+{
+	while (dbwritejobs)
+	{
+		dbwrite_run();
+		/* Wait for writes handed to worker threads and deliver
+		 * their completions (no-op without worker threads).
+		 */
+		workers_flush();
+	}
+}
+
 /** Generates an MD5 checksum.
  * @param mdout[out] Buffer to store result in, the result will be 16 bytes in binary
  *                   (not ascii printable!).
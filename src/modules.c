@@ -39,6 +39,7 @@
 #include "modversion.h"
 
 Hook	   	*Hooks[MAXHOOKTYPES];
+HookDispatch	HookTable[MAXHOOKTYPES];	/* Flattened Hooks[] lists for the RunHook* macros, see hook_flatten() */
 Hooktype	Hooktypes[MAXCUSTOMHOOKS];
 Callback	*Callbacks[MAXCALLBACKS];	/* Callback objects for modules, used for rehashing etc (can be multiple) */
 Callback	*RCallbacks[MAXCALLBACKS];	/* 'Real' callback function, used for callback function calls */
@@ -75,6 +76,8 @@ void *obsd_dlsym(void *handle, char *symbol)
 void deletetmp(char *path)
 {
 #ifndef NOREMOVETMP
+	if (!strncmp(path, CACHEDIR "/", strlen(CACHEDIR "/")))
+		return; /* content-addressed module cache copy, kept for the next boot */
 	if (!loop.config_test)
 		remove(path);
 #endif
@@ -134,6 +137,124 @@ void DeleteTempModules(void)
 #endif	
 }
 
+/* == Content-addressed module cache ==
+ * Loading a module means copying the .so to a temporary file first (see
+ * Module_Create for why) and with a typical config that is well over a
+ * hundred copies on every boot, which hurts on slow or networked disks.
+ * We therefore keep the copies in cache/ under a name derived from a
+ * hash of the module contents: if an identical copy is already there
+ * from an earlier boot we dlopen() it straight away and skip the copy.
+ * A cached copy that is still dlopen()'ed (a rehash loading the same,
+ * unchanged, module again) cannot be reused, since the dynamic loader
+ * would just hand us the old handle back; in that case we fall back to
+ * the classic temporary copy.
+ */
+
+/** Returns 1 if 'cachefile' is the backing file of a currently loaded module */
+static int module_cache_in_use(const char *cachefile)
+{
+	Module *m;
+
+	for (m = Modules; m; m = m->next)
+		if (m->tmp_file && !strcmp(m->tmp_file, cachefile))
+			return 1;
+	return 0;
+}
+
+/** Removes cached copies of 'modfilename' other than 'keep' (old versions) */
+static void module_cache_prune(const char *modfilename, const char *keep)
+{
+	char buf[PATH_MAX+1];
+#ifndef _WIN32
+	DIR *fd = opendir(CACHEDIR);
+	struct dirent *dir;
+
+	if (!fd)
+		return;
+	while ((dir = readdir(fd)))
+	{
+		char *fname = dir->d_name;
+		if (strncmp(fname, "module.", 7) || (strlen(fname) < 41) ||
+		    (fname[39] != '.') || strcmp(fname+40, modfilename))
+			continue;
+		ircsnprintf(buf, sizeof(buf), "%s/%s", CACHEDIR, fname);
+		if (strcmp(buf, keep) && !module_cache_in_use(buf))
+			remove(buf);
+	}
+	closedir(fd);
+#else
+	WIN32_FIND_DATA hData;
+	HANDLE hFile;
+
+	snprintf(buf, sizeof(buf), "%s/module.*", CACHEDIR);
+	hFile = FindFirstFile(buf, &hData);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return;
+	do
+	{
+		char *fname = hData.cFileName;
+		if (strncmp(fname, "module.", 7) || (strlen(fname) < 41) ||
+		    (fname[39] != '.') || strcmp(fname+40, modfilename))
+			continue;
+		ircsnprintf(buf, sizeof(buf), "%s/%s", CACHEDIR, fname);
+		if (strcmp(buf, keep) && !module_cache_in_use(buf))
+			remove(buf);
+	} while (FindNextFile(hFile, &hData));
+	FindClose(hFile);
+#endif
+}
+
+/** Returns the name of a ready-to-dlopen() cached copy of the module at
+ * 'path', copying it into the cache first if needed, or NULL if the
+ * cache cannot be used, in which case the caller falls back to the
+ * temporary copy scheme.
+ */
+static char *module_cache_find(char *path)
+{
+	static char cachefile[PATH_MAX+1];
+	char hashbuf[64];
+	char *contents;
+	long size;
+	FILE *fd = fopen(path, "rb");
+
+	if (!fd)
+		return NULL;
+	fseek(fd, 0, SEEK_END);
+	size = ftell(fd);
+	if ((size <= 0) || fseek(fd, 0, SEEK_SET))
+	{
+		fclose(fd);
+		return NULL;
+	}
+	contents = safe_alloc(size);
+	if (fread(contents, 1, size, fd) != (size_t)size)
+	{
+		safe_free(contents);
+		fclose(fd);
+		return NULL;
+	}
+	fclose(fd);
+	md5hash(hashbuf, contents, size);
+	safe_free(contents);
+
+	ircsnprintf(cachefile, sizeof(cachefile), "%s/module.%s.%s",
+	            CACHEDIR, hashbuf, unreal_getmodfilename(path));
+
+	/* Copies of older versions of this module are of no use anymore */
+	module_cache_prune(unreal_getmodfilename(path), cachefile);
+
+	if (file_exists(cachefile))
+	{
+		if (module_cache_in_use(cachefile))
+			return NULL; /* rehash still holds this copy */
+		return cachefile;
+	}
+
+	if (!unreal_copyfileex(path, cachefile, 0))
+		return NULL;
+	return cachefile;
+}
+
 Module *Module_Find(char *name)
 {
 	Module *p;
@@ -303,6 +424,7 @@ char  *Module_Create(char *path_)
 	unsigned int expectedcompilerversion = our_compiler_version;
 	long modsys_ver = 0;
 	Debug((DEBUG_DEBUG, "Attempting to load module from %s", path_));
+	flight_record("Loading module %s", path_);
 
 	path = Module_TransformPath(path_);
 
@@ -321,20 +443,27 @@ char  *Module_Create(char *path_)
 		/* For './unrealircd configtest' we don't have to do any copying and shit */
 		tmppath = path;
 	} else {
-		tmppath = unreal_mktemp(TMPDIR, unreal_getmodfilename(path));
-		if (!tmppath)
-			return "Unable to create temporary file!";
-
-		/* We have to copy the module, because otherwise the dynamic loader
-		 * will not load the new .so if we rehash while holding the original .so
-		 * We used to hardlink here instead of copy, but then OpenBSD and Linux
-		 * got smart and detected that, so now we always copy.
+		/* Try the content-addressed module cache first: an identical
+		 * copy from an earlier boot can be dlopen()'ed as-is.
 		 */
-		ret = unreal_copyfileex(path, tmppath, 0);
-		if (!ret)
+		tmppath = module_cache_find(path);
+		if (!tmppath)
 		{
-			snprintf(errorbuf, sizeof(errorbuf), "Failed to copy module file.");
-			return errorbuf;
+			tmppath = unreal_mktemp(TMPDIR, unreal_getmodfilename(path));
+			if (!tmppath)
+				return "Unable to create temporary file!";
+
+			/* We have to copy the module, because otherwise the dynamic loader
+			 * will not load the new .so if we rehash while holding the original .so
+			 * We used to hardlink here instead of copy, but then OpenBSD and Linux
+			 * got smart and detected that, so now we always copy.
+			 */
+			ret = unreal_copyfileex(path, tmppath, 0);
+			if (!ret)
+			{
+				snprintf(errorbuf, sizeof(errorbuf), "Failed to copy module file.");
+				return errorbuf;
+			}
 		}
 	}
 
@@ -566,6 +695,9 @@ void FreeModObj(ModuleObject *obj, Module *m)
 	else if (obj->type == MOBJ_HISTORY_BACKEND) {
 		HistoryBackendDel(obj->object.history_backend);
 	}
+	else if (obj->type == MOBJ_MEMORYCOUNTER) {
+		MemoryCounterDel(obj->object.memorycounter);
+	}
 	else
 	{
 		ircd_log(LOG_ERROR, "FreeModObj() called for unknown object");
@@ -715,6 +847,7 @@ int Module_Unload(char *name)
 	{
 		return -1;
 	}
+	flight_record("Unloading module %s", name);
 	ret = (*Mod_Unload)(&m->modinfo);
 	if (ret == MOD_DELAY)
 	{
@@ -987,6 +1120,34 @@ void VersionflagDel(Versionflag *vflag, Module *module)
 	}
 }
 
+/** Rebuilds the flat dispatch array for one hook type from its Hooks[]
+ * list. The list is kept in priority order by AddListItemPrio(), so a
+ * plain copy preserves dispatch order. The array is rebuilt in place
+ * and only reallocated when it has to grow: that way a HookDel() from
+ * inside a hook function (eg a module unloading itself) never frees
+ * the array a RunHook* macro is currently indexing - the macros
+ * re-read .count on every iteration.
+ */
+static void hook_flatten(int hooktype)
+{
+	HookDispatch *d = &HookTable[hooktype];
+	Hook *p;
+	int n = 0;
+
+	for (p = Hooks[hooktype]; p; p = p->next)
+		n++;
+	if (n > d->allocated)
+	{
+		safe_free(d->funcs);
+		d->allocated = n + 8;
+		d->funcs = safe_alloc(sizeof(*d->funcs) * d->allocated);
+	}
+	n = 0;
+	for (p = Hooks[hooktype]; p; p = p->next)
+		d->funcs[n++] = p->func.intfunc;
+	d->count = n;
+}
+
 Hook *HookAddMain(Module *module, int hooktype, int priority, int (*func)(), void (*vfunc)(), char *(*cfunc)())
 {
 	Hook *p;
@@ -1011,6 +1172,7 @@ Hook *HookAddMain(Module *module, int hooktype, int priority, int (*func)(), voi
 	}
 	
 	AddListItemPrio(p, Hooks[hooktype], p->priority);
+	hook_flatten(hooktype);
 
 	return p;
 }
@@ -1018,10 +1180,12 @@ Hook *HookAddMain(Module *module, int hooktype, int priority, int (*func)(), voi
 Hook *HookDel(Hook *hook)
 {
 	Hook *p, *q;
-	for (p = Hooks[hook->type]; p; p = p->next) {
+	int hooktype = hook->type;
+
+	for (p = Hooks[hooktype]; p; p = p->next) {
 		if (p == hook) {
 			q = p->next;
-			DelListItem(p, Hooks[hook->type]);
+			DelListItem(p, Hooks[hooktype]);
 			if (p->owner) {
 				ModuleObject *hookobj;
 				for (hookobj = p->owner->objects; hookobj; hookobj = hookobj->next) {
@@ -1033,6 +1197,7 @@ Hook *HookDel(Hook *hook)
 				}
 			}
 			safe_free(p);
+			hook_flatten(hooktype);
 			return q;
 		}
 	}
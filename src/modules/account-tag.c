@@ -89,10 +89,10 @@ void mtag_add_account(Client *client, MessageTag *recv_mtags, MessageTag **mtag_
 
 	if (client && client->user && (*client->user->svid != '*') && !isdigit(*client->user->svid))
 	{
-		m = safe_alloc(sizeof(MessageTag));
-		safe_strdup(m->name, "account");
-		safe_strdup(m->value, client->user->svid);
-
+		/* The account name lives on the client itself, so the tag
+		 * can reference it directly instead of copying the string.
+		 */
+		m = new_mtag_arena_shared("account", client->user->svid);
 		AddListItem(m, *mtag_list);
 	}
 }
@@ -63,96 +63,18 @@ static void init_config(void);
 int antimixedutf8_config_test(ConfigFile *, ConfigEntry *, int, int *);
 int antimixedutf8_config_run(ConfigFile *, ConfigEntry *, int);
 
-#define SCRIPT_UNDEFINED	0
-#define SCRIPT_LATIN		1
-#define SCRIPT_CYRILLIC		2
-#define SCRIPT_CJK		3
-#define SCRIPT_HANGUL		4
-#define SCRIPT_CANADIAN		5
-#define SCRIPT_TELUGU		6
-
 /**** the detection algorithm follows first, the module/config code is at the end ****/
 
-/** Detect which script the current character is,
- * such as latin script or cyrillic script.
- * @retval See SCRIPT_*
+/* UTF-8 character length and script classification live in the shared
+ * kernel in src/utf8.c nowadays: see unrl_utf8_charlen() and
+ * unrl_utf8_script() with the UTF8_SCRIPT_* classes, which are also
+ * used by the nick character validation.
  */
-int detect_script(const char *t)
-{
-	/* Safety: as long as *t is never \0 then at worst
-	 * the character after this will be \0 and since we
-	 * only look at 2 characters (at most) at a time
-	 * this will be safe.
-	 */
-
-	/* Currently we only detect cyrillic and call all the
-	 * rest latin (which is not true). This can always
-	 * be enhanced later.
-	 */
-
-	if ((t[0] == 0xd0) && (t[1] >= 0x80) && (t[1] <= 0xbf))
-		return SCRIPT_CYRILLIC;
-	else if ((t[0] == 0xd1) && (t[1] >= 0x80) && (t[1] <= 0xbf))
-		return SCRIPT_CYRILLIC;
-	else if ((t[0] == 0xd2) && (t[1] >= 0x80) && (t[1] <= 0xbf))
-		return SCRIPT_CYRILLIC;
-	else if ((t[0] == 0xd3) && (t[1] >= 0x80) && (t[1] <= 0xbf))
-		return SCRIPT_CYRILLIC;
-
-	if((t[0] == 0xe4) && (t[1] >= 0xb8) && (t[1] <= 0xbf))
-		return SCRIPT_CJK;
-	else if ((t[0] >= 0xe5) && (t[0] <= 0xe9) && (t[1] >= 0x80) && (t[1] <= 0xbf))
-		return SCRIPT_CJK;
-
-	if((t[0] == 0xea) && (t[1] >= 0xb0) && (t[1] <= 0xbf))
-		return SCRIPT_HANGUL;
-	else if ((t[0] >= 0xeb) && (t[0] <= 0xec) && (t[1] >= 0x80) && (t[1] <= 0xbf))
-		return SCRIPT_HANGUL;
-	else if ((t[0] == 0xed) && (t[1] >= 0x80) && (t[1] <= 0x9f))
-		return SCRIPT_HANGUL;
-
-	if((t[0] == 0xe1) && (t[1] >= 0x90) && (t[1] <= 0x99))
-		return SCRIPT_CANADIAN;
-
-	if((t[0] == 0xe0) && (t[1] >= 0xb0) && (t[1] <= 0xb1))
-		return SCRIPT_TELUGU;
-
-	if ((t[0] >= 'a') && (t[0] <= 'z'))
-		return SCRIPT_LATIN;
-	if ((t[0] >= 'A') && (t[0] <= 'Z'))
-		return SCRIPT_LATIN;
-
-	return SCRIPT_UNDEFINED;
-}
-
-/** Returns length of an (UTF8) character. May return <1 for error conditions.
- * Made by i <info@servx.org>
- */
-static int utf8_charlen(const char *str)
-{
-	struct { char mask; char val; } t[4] =
-	{ { 0x80, 0x00 }, { 0xE0, 0xC0 }, { 0xF0, 0xE0 }, { 0xF8, 0xF0 } };
-	unsigned k, j;
-
-	for (k = 0; k < 4; k++)
-	{
-		if ((*str & t[k].mask) == t[k].val)
-		{
-			for (j = 0; j < k; j++)
-			{
-				if ((*(++str) & 0xC0) != 0x80)
-					return -1;
-			}
-			return k + 1;
-		}
-	}
-	return 1;
-}
 
 int lookalikespam_score(const char *text)
 {
 	const char *p;
-	int last_script = SCRIPT_UNDEFINED;
+	int last_script = UTF8_SCRIPT_UNDEFINED;
 	int current_script;
 	int points = 0;
 	int last_character_was_word_separator = 0;
@@ -160,11 +82,11 @@ int lookalikespam_score(const char *text)
 
 	for (p = text; *p; p++)
 	{
-		current_script = detect_script(p);
+		current_script = unrl_utf8_script(p);
 
-		if (current_script != SCRIPT_UNDEFINED)
+		if (current_script != UTF8_SCRIPT_UNDEFINED)
 		{
-			if ((current_script != last_script) && (last_script != SCRIPT_UNDEFINED))
+			if ((current_script != last_script) && (last_script != UTF8_SCRIPT_UNDEFINED))
 			{
 				/* A script change = 1 point */
 				points++;
@@ -184,7 +106,7 @@ int lookalikespam_score(const char *text)
 		else
 			last_character_was_word_separator = 0;
 
-		skip = utf8_charlen(p);
+		skip = unrl_utf8_charlen(p);
 		if (skip > 1)
 			p += skip - 1;
 	}
@@ -490,16 +490,28 @@ static char *triples_txt[] = {
 	NULL, NULL
 };
 
-/* Used for parsed triples: */
-#define TRIPLES_REST_SIZE	32
-typedef struct Triples Triples;
-struct Triples {
-	Triples *next;
-	char two[3];
-	char rest[TRIPLES_REST_SIZE];
+/* The triples_txt table above is compiled into this flat matrix at module
+ * load by init_triples(): triples_matrix[a][b] has bit (c-'a') set when the
+ * three-letter combination "abc" scores a point. That way scoring a string
+ * is one load and one bit test per character pair instead of a walk over
+ * the entire table for every position.
+ */
+static unsigned int triples_matrix[26][26];
+
+/** One cached antirandom score. Bot floods tend to reuse the exact same
+ * nick/ident/gecos material for every clone, so identical tuples are served
+ * from this small direct-mapped table instead of being scored again
+ * (see get_spam_score).
+ */
+typedef struct ScoreCacheEntry ScoreCacheEntry;
+struct ScoreCacheEntry {
+	uint64_t hash;	/**< siphash of the nick!user:gecos tuple (0 = empty slot) */
+	int score;	/**< Score that was computed for that tuple */
 };
+#define SCORECACHELEN 256	/* Number of slots (direct-mapped by tuple hash) */
 
-Triples *triples = NULL;
+static ScoreCacheEntry score_cache[SCORECACHELEN];
+static char siphashkey_scorecache[SIPHASH_KEY_LENGTH];
 
 struct {
 	int threshold;
@@ -549,6 +561,8 @@ MOD_INIT()
 		free_stuff();
 		return MOD_FAILED;
 	}
+	memset(score_cache, 0, sizeof(score_cache));
+	siphash_generate_key(siphashkey_scorecache);
 	HookAdd(modinfo->handle, HOOKTYPE_PRE_LOCAL_CONNECT, 0, antirandom_preconnect);
 	HookAdd(modinfo->handle, HOOKTYPE_CONFIGRUN, 0, antirandom_config_run);
 
@@ -711,6 +725,12 @@ int antirandom_config_run(ConfigFile *cf, ConfigEntry *ce, int type)
 			cfg.fullstatus_on_load = config_checkval(cep->ce_vardata, CFG_YESNO);
 		}
 	}
+
+	/* A rehash may have changed convert-to-lowercase, which would make
+	 * previously cached scores wrong, so throw them all away.
+	 */
+	memset(score_cache, 0, sizeof(score_cache));
+
 	return 1;
 }
 
@@ -734,24 +754,25 @@ static int init_stuff(void)
 	return 1;
 }
 
-/** Initializes the triples list. */
+/** Compiles triples_txt into the flat triples_matrix. */
 static int init_triples(void)
 {
 	char **s;
-	Triples *e, *last=NULL;
+	char *two, *p;
+	unsigned int mask;
 	int cnt=0;
 
+	memset(triples_matrix, 0, sizeof(triples_matrix));
 	for (s=triples_txt; *s; s++)
 	{
 		cnt++;
-		e = safe_alloc(sizeof(Triples));
-		if (strlen(*s) > 2)
+		two = *s;
+		if ((strlen(two) != 2) || (two[0] < 'a') || (two[0] > 'z') || (two[1] < 'a') || (two[1] > 'z'))
 		{
-			config_error("init_triples: error parsing triples_txt, cnt=%d, item='%s' (length>2)",
-				cnt, *s);
+			config_error("init_triples: error parsing triples_txt, cnt=%d, item='%s' (expected two letters a-z)",
+				cnt, two);
 			return 0;
 		}
-		strcpy(e->two, *s); /* (SAFE) */
 		s++;
 		if (!*s)
 		{
@@ -759,20 +780,18 @@ static int init_triples(void)
 				cnt);
 			return 0;
 		}
-		if (strlen(*s) > TRIPLES_REST_SIZE-1)
+		mask = 0;
+		for (p=*s; *p; p++)
 		{
-			config_error("init_triples: error parsing triples_txt, cnt=%d, item='%s' (length>%d)",
-				cnt, *s, TRIPLES_REST_SIZE-1);
-			return 0;
+			if ((*p < 'a') || (*p > 'z'))
+			{
+				config_error("init_triples: error parsing triples_txt, cnt=%d, item='%s' (expected letters a-z)",
+					cnt, *s);
+				return 0;
+			}
+			mask |= 1U << (*p - 'a');
 		}
-		strcpy(e->rest, *s); /* (SAFE) */
-
-		/* Append at end of list (to keep it in order, not importent yet, but..) */
-		if (last)
-			last->next = e;
-		else
-			triples = e; /*(head)*/
-		last = e;
+		triples_matrix[two[0] - 'a'][two[1] - 'a'] |= mask;
 	}
 	return 1;
 }
@@ -785,7 +804,6 @@ static int init_triples(void)
  */
 static int internal_getscore(char *str)
 {
-	Triples *t;
 	register char *s;
 	int score = 0;
 	int highest_vowels=0, highest_consonants=0, highest_digits=0;
@@ -840,21 +858,25 @@ static int internal_getscore(char *str)
 #endif
 	}
 	
-	for (t=triples; t; t=t->next)
+	/* Triples check: one matrix load and one bit test per character pair.
+	 * Characters outside a-z can never match (the table is all lowercase).
+	 */
+	for (s=str; s[0] && s[1]; s++)
 	{
-		for (s=str; *s; s++)
-			if ((t->two[0] == s[0]) && (t->two[1] == s[1]) && s[2] && strchr(t->rest, s[2]))
-			{
-				score++; /* OK */
+		if ((s[0] < 'a') || (s[0] > 'z') || (s[1] < 'a') || (s[1] > 'z') ||
+		    (s[2] < 'a') || (s[2] > 'z'))
+			continue;
+		if (triples_matrix[s[0] - 'a'][s[1] - 'a'] & (1U << (s[2] - 'a')))
+		{
+			score++; /* OK */
 #ifdef DEBUGMODE
-				sendto_ops_and_log("score@'%s': MATCH for '%s[%s]' %c/%c/%c", str, t->two, t->rest,
-					s[0], s[1], s[2]);
+			sendto_ops_and_log("score@'%s': MATCH for triple %c/%c/%c", str,
+				s[0], s[1], s[2]);
 #endif
-			}
+		}
 	}
 
-	
-	
+
 	return score;
 }
 
@@ -881,6 +903,9 @@ static int get_spam_score(Client *client)
 	char *user = client->user->username;
 	char *gecos = client->info;
 	char nbuf[NICKLEN+1], ubuf[USERLEN+1], rbuf[REALLEN+1];
+	char keybuf[NICKLEN+USERLEN+REALLEN+3];
+	uint64_t hash;
+	ScoreCacheEntry *e;
 	int nscore, uscore, gscore, score;
 #ifdef TIMING
 	struct timeval tv_alpha, tv_beta;
@@ -898,11 +923,25 @@ static int get_spam_score(Client *client)
 		gecos = rbuf;
 	}
 
+	/* Clones carry identical nick/user/gecos material, so check the
+	 * verdict cache before doing any real scoring work.
+	 */
+	snprintf(keybuf, sizeof(keybuf), "%s!%s:%s", nick, user, gecos);
+	hash = siphash(keybuf, siphashkey_scorecache);
+	if (!hash)
+		hash = 1; /* zero means 'empty slot' */
+	e = &score_cache[hash % SCORECACHELEN];
+	if (e->hash == hash)
+		return e->score;
+
 	nscore = internal_getscore(nick);
 	uscore = internal_getscore(user);
 	gscore = internal_getscore(gecos);
 	score = nscore + uscore + gscore;
 
+	e->hash = hash;
+	e->score = score;
+
 #ifdef TIMING
 	gettimeofday(&tv_beta, NULL);
 	ircd_log(LOG_ERROR, "AntiRandom Timing: %ld microseconds",
@@ -970,14 +1009,8 @@ int antirandom_preconnect(Client *client)
 
 static void free_stuff(void)
 {
-	Triples *t, *t_next;
-
-	for (t=triples; t; t=t_next)
-	{
-		t_next = t->next;
-		safe_free(t);
-	}
-	triples = NULL;
+	memset(triples_matrix, 0, sizeof(triples_matrix));
+	memset(score_cache, 0, sizeof(score_cache));
 }
 
 /** Is this user exempt from antirandom interventions? */
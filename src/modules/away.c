@@ -54,6 +54,22 @@ MOD_UNLOAD()
 	return MOD_SUCCESS;
 }
 
+/* Cached away-notify capability bit: revalidated via clicap_generation
+ * instead of walking the capability list on every AWAY change.
+ */
+static long CAP_AWAY_NOTIFY = 0L;
+static int away_caps_generation = -1;
+
+static long away_notify_cap(void)
+{
+	if (away_caps_generation != clicap_generation)
+	{
+		CAP_AWAY_NOTIFY = ClientCapabilityBit("away-notify");
+		away_caps_generation = clicap_generation;
+	}
+	return CAP_AWAY_NOTIFY;
+}
+
 /** Mark client as AWAY or mark them as back (in case of empty reason) */
 CMD_FUNC(cmd_away)
 {
@@ -74,7 +90,7 @@ CMD_FUNC(cmd_away)
 			new_message(client, recv_mtags, &mtags);
 			sendto_server(client, 0, 0, mtags, ":%s AWAY", client->name);
 			hash_check_watch(client, RPL_NOTAWAY);
-			sendto_local_common_channels(client, client, ClientCapabilityBit("away-notify"), mtags,
+			sendto_local_common_channels(client, client, away_notify_cap(), mtags,
 			                             ":%s AWAY", client->name);
 			RunHook3(HOOKTYPE_AWAY, client, mtags, NULL);
 			free_message_tags(mtags);
@@ -136,7 +152,7 @@ CMD_FUNC(cmd_away)
 	hash_check_watch(client, already_as_away ? RPL_REAWAY : RPL_GONEAWAY);
 
 	sendto_local_common_channels(client, client,
-	                             ClientCapabilityBit("away-notify"), mtags,
+	                             away_notify_cap(), mtags,
 	                             ":%s AWAY :%s", client->name, client->user->away);
 
 	RunHook3(HOOKTYPE_AWAY, client, mtags, client->user->away);
@@ -67,6 +67,14 @@ struct Blacklist {
 	int action;
 	long ban_time;
 	char *reason;
+	long cache_time; /**< How long to cache verdicts (blacklist::cache-time) */
+	/* Statistics, shown in /STATS blacklist: */
+	unsigned int stats_queries; /**< DNS queries actually sent */
+	unsigned int stats_deduped; /**< Lookups answered by an identical in-flight query */
+	unsigned int stats_cachehits; /**< Lookups answered from the verdict cache */
+	unsigned int stats_answers; /**< Replies received (positive or NXDOMAIN) */
+	unsigned int stats_timeouts; /**< Queries that timed out */
+	long long stats_latency_total_ms; /**< Summed latency of all answers */
 };
 
 /* Blacklist user struct. In the c-ares DNS reply callback we need to pass
@@ -76,7 +84,6 @@ struct Blacklist {
 typedef struct BLUser BLUser;
 struct BLUser {
 	Client *client;
-	int is_ipv6;
 	int refcnt;
 	/* The following save_* fields are used by softbans: */
 	int save_action;
@@ -85,9 +92,47 @@ struct BLUser {
 	char *save_reason;
 };
 
+/* One in-flight DNSBL query, shared by all clients waiting for its answer.
+ * Keyed by the full query name (reversed-ip + dnsbl zone), so concurrent
+ * connects from the same IP cost one DNS query per blacklist instead of
+ * one per client.
+ */
+typedef struct BLWaiter BLWaiter;
+struct BLWaiter {
+	BLWaiter *next;
+	BLUser *blu;
+};
+
+typedef struct BLQuery BLQuery;
+struct BLQuery {
+	BLQuery *prev, *next;
+	char *query; /**< The full DNS query name */
+	char *dnsbl_name; /**< The dnsbl zone (to find the blacklist { } block at reply time) */
+	BLWaiter *waiters; /**< Clients waiting for this answer */
+	struct timeval started; /**< When the query was sent (for latency stats) */
+};
+
+/* Verdict cache: remembers the outcome of one (IP, DNSBL) query so
+ * reconnecting clients do not re-ask the blacklist. A verdict of 0
+ * means 'clean', anything else is the matched reply value.
+ */
+typedef struct BLCacheEntry BLCacheEntry;
+struct BLCacheEntry {
+	char valid; /**< Slot in use? */
+	char query[256]; /**< The full DNS query name */
+	int reply; /**< Matched reply value, 0 = clean */
+	time_t expires;
+};
+
+#define BLCACHE_SIZE 256
+
 /* Global variables */
 ModDataInfo *blacklist_md = NULL;
 Blacklist *conf_blacklist = NULL;
+static BLQuery *blqueries = NULL; /**< In-flight DNSBL queries */
+static BLCacheEntry blcache[BLCACHE_SIZE]; /**< Verdict cache */
+static char siphashkey_blcache[SIPHASH_KEY_LENGTH];
+static int siphashkey_blcache_set = 0;
 
 /* Forward declarations */
 int blacklist_config_test(ConfigFile *, ConfigEntry *, int, int *);
@@ -105,6 +150,11 @@ int blacklist_rehash(void);
 int blacklist_rehash_complete(void);
 void blacklist_set_handshake_delay(void);
 void blacklist_free_bluser_if_able(BLUser *bl);
+int blacklist_stats(Client *client, char *para);
+void blacklist_hit(Client *client, Blacklist *bl, int reply);
+static int blacklist_match(Blacklist *bl, struct hostent *he);
+static BLCacheEntry *blacklist_cache_find(char *query);
+static void blacklist_cache_add(char *query, int reply, long ttl);
 
 #define SetBLUser(x, y)	do { moddata_client(x, blacklist_md).ptr = y; } while(0)
 #define BLUSER(x)	((BLUser *)moddata_client(x, blacklist_md).ptr)
@@ -149,6 +199,7 @@ MOD_INIT()
 	HookAdd(modinfo->handle, HOOKTYPE_REHASH, 0, blacklist_rehash);
 	HookAdd(modinfo->handle, HOOKTYPE_REHASH_COMPLETE, 0, blacklist_rehash_complete);
 	HookAdd(modinfo->handle, HOOKTYPE_LOCAL_QUIT, 0, blacklist_quit);
+	HookAdd(modinfo->handle, HOOKTYPE_STATS, 0, blacklist_stats);
 
 	SnomaskAdd(modinfo->handle, 'b', umode_allow_opers, &SNO_BLACKLIST);
 
@@ -242,7 +293,7 @@ int blacklist_config_test(ConfigFile *cf, ConfigEntry *ce, int type, int *errs)
 {
 	ConfigEntry	*cep, *cepp, *ceppp;
 	int errors = 0;
-	char has_reason = 0, has_ban_time = 0, has_action = 0;
+	char has_reason = 0, has_ban_time = 0, has_action = 0, has_cache_time = 0;
 	char has_dns_type = 0, has_dns_reply = 0, has_dns_name = 0;
 
 	if (type != CONFIG_MAIN)
@@ -387,6 +438,16 @@ int blacklist_config_test(ConfigFile *cf, ConfigEntry *ce, int type, int *errs)
 				continue;
 			}
 			has_ban_time = 1;
+		}
+		else if (!strcmp(cep->ce_varname, "cache-time"))
+		{
+			if (has_cache_time)
+			{
+				config_warn_duplicate(cep->ce_fileptr->cf_filename,
+					cep->ce_varlinenum, "blacklist::cache-time");
+				continue;
+			}
+			has_cache_time = 1;
 		} else
 		if (!strcmp(cep->ce_varname, "reason"))
 		{
@@ -462,6 +523,7 @@ int blacklist_config_run(ConfigFile *cf, ConfigEntry *ce, int type)
 	d->action = BAN_ACT_KILL;
 	safe_strdup(d->reason, "Your IP is on a DNS Blacklist");
 	d->ban_time = 3600;
+	d->cache_time = 60;
 	
 	/* assume dns for now ;) */
 	d->backend_type = BLACKLIST_BACKEND_DNS;
@@ -531,6 +593,10 @@ int blacklist_config_run(ConfigFile *cf, ConfigEntry *ce, int type)
 		{
 			d->ban_time = config_checkval(cep->ce_vardata, CFG_TIME);
 		}
+		else if (!strcmp(cep->ce_varname, "cache-time"))
+		{
+			d->cache_time = config_checkval(cep->ce_vardata, CFG_TIME);
+		}
 	}
 
 	AddListItem(d, conf_blacklist);
@@ -568,6 +634,9 @@ int blacklist_start_check(Client *client)
 		BLUSER(client)->client = client;
 	}
 
+	if (conf_blacklist)
+		handshake_phase_mark(&client->local->handshake.dnsbl_start);
+
 	for (bl = conf_blacklist; bl; bl = bl->next)
 	{
 		/* Stop processing if client is (being) killed already */
@@ -578,16 +647,61 @@ int blacklist_start_check(Client *client)
 		if (bl->backend_type == BLACKLIST_BACKEND_DNS)
 			blacklist_dns_request(client, bl);
 	}
-	
+
+	/* All answers came from the verdict cache: phase done already */
+	if (BLUSER(client) && (BLUSER(client)->refcnt == 0))
+		client->local->handshake.dnsbl_ms =
+			handshake_phase_done(HANDSHAKE_PHASE_DNSBL, &client->local->handshake.dnsbl_start);
+
 	return 0;
 }
 
+/** Find a verdict cache entry for this query name (NULL if absent/expired) */
+static BLCacheEntry *blacklist_cache_find(char *query)
+{
+	BLCacheEntry *e;
+
+	if (!siphashkey_blcache_set)
+	{
+		siphash_generate_key(siphashkey_blcache);
+		siphashkey_blcache_set = 1;
+	}
+
+	e = &blcache[siphash(query, siphashkey_blcache) % BLCACHE_SIZE];
+	if (!e->valid || strcmp(e->query, query))
+		return NULL;
+	if (e->expires <= TStime())
+	{
+		e->valid = 0;
+		return NULL;
+	}
+	return e;
+}
+
+/** Remember the verdict of a finished query ('reply' 0 = clean) */
+static void blacklist_cache_add(char *query, int reply, long ttl)
+{
+	BLCacheEntry *e;
+
+	if ((ttl <= 0) || (strlen(query) >= sizeof(e->query)))
+		return;
+
+	e = &blcache[siphash(query, siphashkey_blcache) % BLCACHE_SIZE];
+	strlcpy(e->query, query, sizeof(e->query));
+	e->reply = reply;
+	e->expires = TStime() + ttl;
+	e->valid = 1;
+}
+
 int blacklist_dns_request(Client *client, Blacklist *d)
 {
 	char buf[256], wbuf[128];
 	unsigned int e[8];
 	char *ip = GetIP(client);
-	
+	BLCacheEntry *cached;
+	BLQuery *q;
+	BLWaiter *w;
+
 	if (!ip)
 		return 0;
 
@@ -598,14 +712,13 @@ int blacklist_dns_request(Client *client, Blacklist *d)
 		/* IPv4 */
 		if (sscanf(ip, "%u.%u.%u.%u", &e[0], &e[1], &e[2], &e[3]) != 4)
 			return 0;
-	
+
 		snprintf(buf, sizeof(buf), "%u.%u.%u.%u.%s", e[3], e[2], e[1], e[0], d->backend->dns->name);
 	} else
 	if (strchr(ip, ':'))
 	{
 		/* IPv6 */
 		int i;
-		BLUSER(client)->is_ipv6 = 1;
 		if (sscanf(ip, "%x:%x:%x:%x:%x:%x:%x:%x",
 		    &e[0], &e[1], &e[2], &e[3], &e[4], &e[5], &e[6], &e[7]) != 8)
 		{
@@ -626,10 +739,47 @@ int blacklist_dns_request(Client *client, Blacklist *d)
 	else
 		return 0; /* unknown IP format */
 
+	/* Do we already know the verdict from a recent query? */
+	if ((cached = blacklist_cache_find(buf)))
+	{
+		d->stats_cachehits++;
+		if (cached->reply)
+			blacklist_hit(client, d, cached->reply);
+		return 0;
+	}
+
+	/* Is the exact same query already in flight (concurrent connects
+	 * from the same IP)? Then just wait for that answer too.
+	 */
+	for (q = blqueries; q; q = q->next)
+	{
+		if (!strcmp(q->query, buf))
+		{
+			w = safe_alloc(sizeof(BLWaiter));
+			w->blu = BLUSER(client);
+			w->next = q->waiters;
+			q->waiters = w;
+			BLUSER(client)->refcnt++; /* one (more) blacklist result remaining */
+			d->stats_deduped++;
+			return 0;
+		}
+	}
+
+	/* Nope: send a fresh query */
+	q = safe_alloc(sizeof(BLQuery));
+	safe_strdup(q->query, buf);
+	safe_strdup(q->dnsbl_name, d->backend->dns->name);
+	gettimeofday(&q->started, NULL);
+	w = safe_alloc(sizeof(BLWaiter));
+	w->blu = BLUSER(client);
+	q->waiters = w;
+	AddListItem(q, blqueries);
+
 	BLUSER(client)->refcnt++; /* one (more) blacklist result remaining */
-	
-	unreal_gethostbyname(buf, AF_INET, blacklist_resolver_callback, BLUSER(client));
-	
+	d->stats_queries++;
+
+	unreal_gethostbyname(buf, AF_INET, blacklist_resolver_callback, q);
+
 	return 0;
 }
 
@@ -667,31 +817,6 @@ void blacklist_free_bluser_if_able(BLUser *bl)
 	safe_free(bl);
 }
 
-char *getdnsblname(char *p, Client *client)
-{
-	int dots = 0;
-	int dots_count;
-
-	if (!client)
-		return NULL;
-
-	if (BLUSER(client)->is_ipv6)
-		dots_count = 32;
-	else
-		dots_count = 4;
-
-	for (; *p; p++)
-	{
-		if (*p == '.')
-		{
-			dots++;
-			if (dots == dots_count)
-				return p+1;
-		}
-	}
-	return NULL;
-}
-
 /* Parse DNS reply.
  * A reply will be an A record in the format x.x.x.<reply>
  */
@@ -766,24 +891,15 @@ void blacklist_hit(Client *client, Blacklist *bl, int reply)
 	}
 }
 
-void blacklist_process_result(Client *client, int status, struct hostent *he)
+/** Check a DNS reply against the configured reply values of 'bl'.
+ * @returns The matched reply value (a hit), or 0 if the reply is clean.
+ */
+static int blacklist_match(Blacklist *bl, struct hostent *he)
 {
-	Blacklist *bl;
-	char *domain;
 	int reply;
 	int i;
 	int replycnt;
-	
-	if ((status != 0) || (he->h_length != 4) || !he->h_name)
-		return; /* invalid reply */
-	
-	domain = getdnsblname(he->h_name, client);
-	if (!domain)
-		return; /* odd */
-	bl = blacklist_find_block_by_dns(domain);
-	if (!bl)
-		return; /* possibly just rehashed and the blacklist block is gone now */
-	
+
 	/* walk through all replies for this record... until we have a hit */
 	for (replycnt=0; he->h_addr_list[replycnt]; replycnt++)
 	{
@@ -795,33 +911,118 @@ void blacklist_process_result(Client *client, int status, struct hostent *he)
 				( (bl->backend->dns->type == DNSBL_BITMASK) && (reply & bl->backend->dns->reply[i]) ) ||
 				( (bl->backend->dns->type == DNSBL_RECORD) && (bl->backend->dns->reply[i] == reply) ) )
 			{
-				blacklist_hit(client, bl, reply);
-				return;
+				return reply;
 			}
 		}
 	}
+	return 0;
 }
 
 void blacklist_resolver_callback(void *arg, int status, int timeouts, struct hostent *he)
 {
-	BLUser *blu = (BLUser *)arg;
-	Client *client = blu->client;
+	BLQuery *q = (BLQuery *)arg;
+	BLWaiter *w, *w_next;
+	Blacklist *bl;
+	int verdict = 0;
+	int have_verdict = 0;
+
+	DelListItem(q, blqueries);
+
+	/* Look up the blacklist { } block again: it may be gone (or
+	 * replaced) after a rehash.
+	 */
+	bl = blacklist_find_block_by_dns(q->dnsbl_name);
 
-	blu->refcnt--; /* one less outstanding DNS request remaining */
+	if (bl)
+	{
+		if (status == ARES_ETIMEOUT)
+		{
+			bl->stats_timeouts++;
+		} else
+		{
+			struct timeval now;
+			gettimeofday(&now, NULL);
+			bl->stats_answers++;
+			bl->stats_latency_total_ms +=
+				(long long)(now.tv_sec - q->started.tv_sec) * 1000 +
+				(now.tv_usec - q->started.tv_usec) / 1000;
+		}
+	}
 
-	/* If we are the last to resolve something and the client is gone
-	 * already then free the struct.
+	/* Determine the verdict. A listed IP gives us a reply, NXDOMAIN
+	 * means 'clean'. Timeouts and other errors give no verdict and
+	 * are therefore also not cached.
 	 */
-	if ((blu->refcnt == 0) && !client)
-		blacklist_free_bluser_if_able(blu);
+	if ((status == 0) && he && (he->h_length == 4))
+	{
+		have_verdict = 1;
+		if (bl)
+			verdict = blacklist_match(bl, he);
+	} else
+	if (status == ARES_ENOTFOUND)
+	{
+		have_verdict = 1; /* clean */
+	}
+
+	if (have_verdict && bl)
+		blacklist_cache_add(q->query, verdict, bl->cache_time);
+
+	/* Fan the answer out to everyone waiting on this query */
+	for (w = q->waiters; w; w = w_next)
+	{
+		BLUser *blu = w->blu;
+		Client *client = blu->client;
+
+		w_next = w->next;
+
+		blu->refcnt--; /* one less outstanding DNS request remaining */
+
+		/* If we are the last to resolve something and the client is
+		 * gone already then free the struct.
+		 */
+		if ((blu->refcnt == 0) && !client)
+			blacklist_free_bluser_if_able(blu);
+		else
+		{
+			if (client && (blu->refcnt == 0))
+			{
+				/* Last outstanding DNSBL answer for this client */
+				client->local->handshake.dnsbl_ms =
+					handshake_phase_done(HANDSHAKE_PHASE_DNSBL, &client->local->handshake.dnsbl_start);
+			}
+			if (client && verdict && bl)
+				blacklist_hit(client, bl, verdict);
+		}
+
+		safe_free(w);
+	}
+
+	safe_free(q->query);
+	safe_free(q->dnsbl_name);
+	safe_free(q);
+}
 
-	blu = NULL;
+/** Show per-blacklist query/cache/latency statistics in /STATS blacklist */
+int blacklist_stats(Client *client, char *para)
+{
+	Blacklist *d;
 
-	if (!client)
-		return; /* Client left already */
-	/* ^^ note: do not merge this with the other 'if' a few lines up (refcnt!) */
+	if (!para || strcasecmp(para, "blacklist"))
+		return 0;
 
-	blacklist_process_result(client, status, he);
+	for (d = conf_blacklist; d; d = d->next)
+	{
+		sendtxtnumeric(client, "blacklist %s: queries %u, deduped %u, cache hits %u, "
+		                       "answers %u, timeouts %u, avg latency %lldms",
+			d->name,
+			d->stats_queries,
+			d->stats_deduped,
+			d->stats_cachehits,
+			d->stats_answers,
+			d->stats_timeouts,
+			d->stats_answers ? (d->stats_latency_total_ms / d->stats_answers) : 0);
+	}
+	return 1;
 }
 
 int blacklist_preconnect(Client *client)
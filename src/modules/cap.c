@@ -104,8 +104,11 @@ MOD_LOAD()
 	return MOD_SUCCESS;
 }
 
+static void clicap_cache_free(void);
+
 MOD_UNLOAD()
 {
+	clicap_cache_free();
 	return MOD_SUCCESS;
 }
 
@@ -167,6 +170,61 @@ static ClientCapability *clicap_find(Client *client, const char *data, int *nega
 	return cap;
 }
 
+/* == CAP LS cache ==
+ * Most capabilities have no visible/parameter callback: their CAP LS
+ * token is the same bytes for every client. Those are rendered once per
+ * clicap_generation (bumped by ClientCapabilityAdd/Del) into the
+ * segments below and clicap_generate() appends the cached segments
+ * as-is, only the few callback-carrying caps (sasl, sts, ..) are still
+ * rendered per client. Each segment is kept short enough to always fit
+ * on a CAP line of its own, whatever the client's nick length.
+ */
+#define CLICAP_CACHE_SEGMENTS 8
+#define CLICAP_CACHE_SEGLEN (BUFSIZE-HOSTLEN-NICKLEN-32)
+static char *clicap_cached_segment[CLICAP_CACHE_SEGMENTS+1];
+static int clicap_cached_generation = -1;
+
+/** (Re)renders the client-independent capabilities, with trailing spaces */
+static void clicap_cache_rebuild(void)
+{
+	ClientCapability *cap;
+	char segment[CLICAP_CACHE_SEGLEN+1];
+	int i;
+
+	for (i = 0; clicap_cached_segment[i]; i++)
+		safe_free(clicap_cached_segment[i]);
+
+	i = 0;
+	*segment = '\0';
+	for (cap = clicaps; cap; cap = cap->next)
+	{
+		if (cap->visible || cap->parameter)
+			continue; /* rendered per client */
+
+		if (strlen(segment) + strlen(cap->name) + 1 >= sizeof(segment))
+		{
+			safe_strdup(clicap_cached_segment[i], segment);
+			*segment = '\0';
+			if (++i == CLICAP_CACHE_SEGMENTS)
+				abort(); /* should never happen anyway */
+		}
+		strlcat(segment, cap->name, sizeof(segment));
+		strlcat(segment, " ", sizeof(segment));
+	}
+	if (*segment)
+		safe_strdup(clicap_cached_segment[i], segment);
+
+	clicap_cached_generation = clicap_generation;
+}
+
+static void clicap_cache_free(void)
+{
+	int i;
+
+	for (i = 0; clicap_cached_segment[i]; i++)
+		safe_free(clicap_cached_segment[i]);
+}
+
 static void clicap_generate(Client *client, const char *subcmd, int flags)
 {
 	ClientCapability *cap;
@@ -175,6 +233,7 @@ static void clicap_generate(Client *client, const char *subcmd, int flags)
 	char *p;
 	int buflen = 0;
 	int curlen, mlen;
+	int i;
 
 	mlen = snprintf(buf, BUFSIZE, ":%s CAP %s %s", me.name,	BadPtr(client->name) ? "*" : client->name, subcmd);
 
@@ -192,6 +251,9 @@ static void clicap_generate(Client *client, const char *subcmd, int flags)
 		char name[256];
 		char *param;
 
+		if (!flags && !cap->visible && !cap->parameter)
+			continue; /* served from the cached segments below */
+
 		if (cap->visible && !cap->visible(client))
 			continue; /* hidden */
 
@@ -224,6 +286,31 @@ static void clicap_generate(Client *client, const char *subcmd, int flags)
 		buflen += curlen;
 	}
 
+	if (!flags)
+	{
+		/* Append the prerendered client-independent capabilities */
+		if (clicap_cached_generation != clicap_generation)
+			clicap_cache_rebuild();
+
+		for (i = 0; clicap_cached_segment[i]; i++)
+		{
+			if (buflen + strlen(clicap_cached_segment[i]) >= BUFSIZE - 10)
+			{
+				if (buflen != mlen)
+					*(p - 1) = '\0';
+				else
+					*p = '\0';
+
+				sendto_one(client, NULL, "%s * :%s", buf, capbuf);
+				p = capbuf;
+				buflen = mlen;
+			}
+			curlen = snprintf(p, (capbuf + BUFSIZE) - p, "%s", clicap_cached_segment[i]);
+			p += curlen;
+			buflen += curlen;
+		}
+	}
+
 	if (buflen != mlen)
 		*(p - 1) = '\0';
 	else
@@ -20,7 +20,7 @@ Cmode_t EXTMODE_CENSOR = 0L;
 
 #define IsCensored(x) ((x)->mode.extmode & EXTMODE_CENSOR)
 
-int censor_can_send_to_channel(Client *client, Channel *channel, Membership *lp, char **msg, char **errmsg, SendType sendtype);
+int censor_text_transform(Client *client, Channel *channel, Membership *lp, char **msg, TextPipe *pipe, char **errmsg, SendType sendtype);
 char *censor_pre_local_part(Client *client, Channel *channel, char *text);
 char *censor_pre_local_quit(Client *client, char *text);
 int censor_stats_badwords_channel(Client *client, char *para);
@@ -52,7 +52,7 @@ MOD_INIT()
 	req.flag = 'G';
 	CmodeAdd(modinfo->handle, req, &EXTMODE_CENSOR);
 
-	HookAdd(modinfo->handle, HOOKTYPE_CAN_SEND_TO_CHANNEL, 0, censor_can_send_to_channel);
+	HookAdd(modinfo->handle, HOOKTYPE_TEXT_TRANSFORM, 0, censor_text_transform);
 	HookAddPChar(modinfo->handle, HOOKTYPE_PRE_LOCAL_PART, 0, censor_pre_local_part);
 	HookAddPChar(modinfo->handle, HOOKTYPE_PRE_LOCAL_QUIT, 0, censor_pre_local_quit);
 	HookAdd(modinfo->handle, HOOKTYPE_STATS, 0, censor_stats_badwords_channel);
@@ -253,9 +253,10 @@ char *stripbadwords_channel(char *str, int *blocked)
 	return stripbadwords(str, conf_badword_channel, blocked);
 }
 
-int censor_can_send_to_channel(Client *client, Channel *channel, Membership *lp, char **msg, char **errmsg, SendType sendtype)
+int censor_text_transform(Client *client, Channel *channel, Membership *lp, char **msg, TextPipe *pipe, char **errmsg, SendType sendtype)
 {
 	int blocked;
+	char *filtered;
 	Hook *h;
 	int i;
 
@@ -271,12 +272,17 @@ int censor_can_send_to_channel(Client *client, Channel *channel, Membership *lp,
 			break;
 	}
 
-	*msg = stripbadwords_channel(*msg, &blocked);
+	/* Match on the shared stripped view from the pipeline, rather
+	 * than making yet another control code stripped copy ourselves.
+	 */
+	filtered = stripbadwords_prestripped(pipe->text_stripped, conf_badword_channel, &blocked);
 	if (blocked)
 	{
 		*errmsg = "Swearing is not permitted in this channel";
 		return HOOK_DENY;
 	}
+	if (filtered != pipe->text_stripped)
+		*msg = filtered; /* a bad word was replaced */
 
 	return HOOK_CONTINUE;
 }
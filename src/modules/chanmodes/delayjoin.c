@@ -18,6 +18,7 @@ ModuleHeader MOD_HEADER
 #define MOD_DATA_INVISIBLE "1"
 
 static long UMODE_PRIVDEAF = 0;
+static ModDataInfo *delayjoin_md = NULL; /* resolved once at load, used on every lookup */
 static Cmode *CmodeDelayed = NULL;
 static Cmode *CmodePostDelayed = NULL;
 static Cmode_t EXTMODE_DELAYED;
@@ -60,7 +61,9 @@ MOD_INIT()
 	mreq.unserialize = moded_unserialize;
 	mreq.sync = 0;
 	mreq.type = MODDATATYPE_MEMBER;
-	if (!ModDataAdd(modinfo->handle, mreq))
+	mreq.hot = 1; /* looked up on every message in a +d channel */
+	delayjoin_md = ModDataAdd(modinfo->handle, mreq);
+	if (!delayjoin_md)
 		abort();
 
 	if (!CmodeDelayed || !CmodePostDelayed)
@@ -122,7 +125,7 @@ bool moded_member_invisible(Member* m, Channel *channel)
 	if (!m)
 		return false;
 
-	md = findmoddata_byname(MOD_DATA_STR, MODDATATYPE_MEMBER);
+	md = delayjoin_md;
 	if (!md)
 		return false;
 
@@ -171,7 +174,7 @@ void clear_user_invisible(Channel *channel, Client *client)
 	ModDataInfo *md;
 	bool should_clear = true, found_member = false;
 
-	md = findmoddata_byname(MOD_DATA_STR, MODDATATYPE_MEMBER);
+	md = delayjoin_md;
 	if (!md)
 		return;
 	for (i = channel->members; i; i = i->next)
@@ -243,7 +246,7 @@ void set_user_invisible(Channel *channel, Client *client)
 	if (!m)
 		return;
 
-	md = findmoddata_byname(MOD_DATA_STR, MODDATATYPE_MEMBER);
+	md = delayjoin_md;
 
 	if (!md || !md->unserialize)
 		return;
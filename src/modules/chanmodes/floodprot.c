@@ -73,15 +73,27 @@ struct MemberFlood {
  */
 #define MAXCHMODEFACTIONS 8
 
-/** Per-channel flood protection settings and counters */
+/** Number of counting slots per flood type. The 'per' period is spread
+ * over this many slots, which are advanced lazily whenever a counter is
+ * touched - there are no timers and idle channels cost nothing.
+ */
+#define FLOODPROT_BUCKETS 8
+
+/** Per-channel flood protection settings and counters.
+ * Counting uses a sliding window: a small ring of per-slot counts
+ * covering the last 'per' seconds, plus a running total. On access the
+ * slots that have fallen out of the window are expired (at most
+ * FLOODPROT_BUCKETS steps, so O(1)) and the new message is added.
+ */
 struct ChannelFloodProtection {
 	unsigned short	per; /**< setting: per <XX> seconds */
-	time_t		timer[NUMFLD]; /**< runtime: timers */
-	unsigned short	counter[NUMFLD]; /**< runtime: counters */
 	unsigned short	limit[NUMFLD]; /**< setting: limit */
 	unsigned char	action[NUMFLD]; /**< setting: action */
 	unsigned char	remove_after[NUMFLD]; /**< setting: remove-after <this> minutes */
 	unsigned char   timers_running[MAXCHMODEFACTIONS+1]; /**< if for example a '-m' timer is running then this contains 'm' */
+	unsigned short	bucket[NUMFLD][FLOODPROT_BUCKETS]; /**< runtime: per-slot counts (sliding window ring) */
+	unsigned short	total[NUMFLD]; /**< runtime: sum of bucket[type][*] */
+	long		head_slot[NUMFLD]; /**< runtime: absolute slot index the ring was last advanced to */
 };
 
 /* Global variables */
@@ -103,6 +115,7 @@ void floodprottimer_stopchantimers(Channel *channel);
 static inline char *chmodefstrhelper(char *buf, char t, char tdef, unsigned short l, unsigned char a, unsigned char r);
 static int compare_floodprot_modes(ChannelFloodProtection *a, ChannelFloodProtection *b);
 static int do_floodprot(Channel *channel, int what);
+static void floodprot_window_reset(ChannelFloodProtection *chp, int what);
 char *channel_modef_string(ChannelFloodProtection *x, char *str);
 void do_floodprot_action(Channel *channel, int what, char *text);
 void floodprottimer_add(Channel *channel, char mflag, time_t when);
@@ -162,6 +175,7 @@ MOD_INIT()
 	mreq.name = "floodprot";
 	mreq.type = MODDATATYPE_MEMBERSHIP;
 	mreq.free = memberflood_free;
+	mreq.hot = 1; /* looked up on every channel message */
 	mdflood = ModDataAdd(modinfo->handle, mreq);
 	if (!mdflood)
 	        abort();
@@ -620,14 +634,17 @@ void *cmodef_put_param(void *fld_in, char *param)
 	v = atoi(p2);
 	if (v < 1)
 		v = 1;
-	/* if new 'per xxx seconds' is smaller than current 'per' then reset timers/counters (t, c) */
-	if (v < fld->per)
+	/* if 'per xxx seconds' changed then the slot length changes too,
+	 * so restart all counting windows.
+	 */
+	if (v != fld->per)
 	{
 		int i;
 		for (i=0; i < NUMFLD; i++)
 		{
-			fld->timer[i] = 0;
-			fld->counter[i] = 0;
+			memset(fld->bucket[i], 0, sizeof(fld->bucket[i]));
+			fld->total[i] = 0;
+			fld->head_slot[i] = 0;
 		}
 	}
 	fld->per = v;
@@ -1128,27 +1145,27 @@ int floodprot_chanmode_del(Channel *channel, int modechar)
 	switch(modechar)
 	{
 		case 'C':
-			chp->counter[FLD_CTCP] = 0;
+			floodprot_window_reset(chp, FLD_CTCP);
 			break;
 		case 'N':
-			chp->counter[FLD_NICK] = 0;
+			floodprot_window_reset(chp, FLD_NICK);
 			break;
 		case 'm':
-			chp->counter[FLD_MSG] = 0;
-			chp->counter[FLD_CTCP] = 0;
+			floodprot_window_reset(chp, FLD_MSG);
+			floodprot_window_reset(chp, FLD_CTCP);
 			break;
 		case 'K':
-			chp->counter[FLD_KNOCK] = 0;
+			floodprot_window_reset(chp, FLD_KNOCK);
 			break;
 		case 'i':
-			chp->counter[FLD_JOIN] = 0;
+			floodprot_window_reset(chp, FLD_JOIN);
 			break;
 		case 'M':
-			chp->counter[FLD_MSG] = 0;
-			chp->counter[FLD_CTCP] = 0;
+			floodprot_window_reset(chp, FLD_MSG);
+			floodprot_window_reset(chp, FLD_CTCP);
 			break;
 		case 'R':
-			chp->counter[FLD_JOIN] = 0;
+			floodprot_window_reset(chp, FLD_JOIN);
 			break;
 		default:
 			break;
@@ -1177,6 +1194,28 @@ void strccat(char *s, char c)
 	*s++ = '\0';
 }
 
+/** Link a mode-removal timer into the global list, which is kept
+ * sorted on 'when' so the expiry event only ever has to look at the
+ * head of the list. Insertion cost is paid on the (rare) flood action
+ * rather than on every tick.
+ */
+static void floodprottimer_insert(RemoveChannelModeTimer *e)
+{
+	RemoveChannelModeTimer *cur;
+
+	if (!removechannelmodetimer_list || (e->when <= removechannelmodetimer_list->when))
+	{
+		AddListItem(e, removechannelmodetimer_list);
+		return;
+	}
+	for (cur = removechannelmodetimer_list; cur->next && (cur->next->when <= e->when); cur = cur->next);
+	e->next = cur->next;
+	e->prev = cur;
+	if (cur->next)
+		cur->next->prev = e;
+	cur->next = e;
+}
+
 /*
  * Adds a "remove channelmode set by +f" timer.
  * channel	Channel
@@ -1192,7 +1231,6 @@ void strccat(char *s, char c)
 void floodprottimer_add(Channel *channel, char mflag, time_t when)
 {
 	RemoveChannelModeTimer *e = NULL;
-	unsigned char add=1;
 	ChannelFloodProtection *chp = (ChannelFloodProtection *)GETPARASTRUCT(channel, 'f');
 
 	if (strchr(chp->timers_running, mflag))
@@ -1200,7 +1238,10 @@ void floodprottimer_add(Channel *channel, char mflag, time_t when)
 		/* Already exists... */
 		e = floodprottimer_find(channel, mflag);
 		if (e)
-			add = 0;
+		{
+			/* Unlink so it can be re-inserted at the right spot */
+			DelListItem(e, removechannelmodetimer_list);
+		}
 	}
 
 	if (!strchr(chp->timers_running, mflag))
@@ -1214,15 +1255,14 @@ void floodprottimer_add(Channel *channel, char mflag, time_t when)
 		strccat(chp->timers_running, mflag); /* bounds already checked ^^ */
 	}
 
-	if (add)
+	if (!e)
 		e = safe_alloc(sizeof(RemoveChannelModeTimer));
 
 	e->channel = channel;
 	e->m = mflag;
 	e->when = when;
 
-	if (add)
-		AddListItem(e, removechannelmodetimer_list);
+	floodprottimer_insert(e);
 }
 
 void floodprottimer_del(Channel *channel, char mflag)
@@ -1253,51 +1293,45 @@ void floodprottimer_del(Channel *channel, char mflag)
 
 EVENT(modef_event)
 {
-	RemoveChannelModeTimer *e, *e_next;
+	RemoveChannelModeTimer *e;
 	time_t now;
 
 	now = TStime();
 
-	for (e = removechannelmodetimer_list; e; e = e_next)
+	/* The list is sorted on 'when', so we only touch what is due
+	 * and stop at the first entry that lies in the future.
+	 */
+	while ((e = removechannelmodetimer_list) && (e->when <= now))
 	{
-		e_next = e->next;
-		if (e->when <= now)
-		{
-			/* Remove chanmode... */
-			long mode = 0;
-			Cmode_t extmode = 0;
+		/* Remove chanmode... */
+		long mode = 0;
+		Cmode_t extmode = 0;
 #ifdef NEWFLDDBG
-			sendto_realops("modef_event: chan %s mode -%c EXPIRED", e->channel->chname, e->m);
+		sendto_realops("modef_event: chan %s mode -%c EXPIRED", e->channel->chname, e->m);
 #endif
-			mode = get_mode_bitbychar(e->m);
-			if (mode == 0)
-			        extmode = get_extmode_bitbychar(e->m);
+		mode = get_mode_bitbychar(e->m);
+		if (mode == 0)
+		        extmode = get_extmode_bitbychar(e->m);
 
-			if ((mode && (e->channel->mode.mode & mode)) ||
-			    (extmode && (e->channel->mode.extmode & extmode)))
-			{
-				MessageTag *mtags = NULL;
-
-				new_message(&me, NULL, &mtags);
-				sendto_server(NULL, 0, 0, mtags, ":%s MODE %s -%c 0", me.id, e->channel->chname, e->m);
-				sendto_channel(e->channel, &me, NULL, 0, 0, SEND_LOCAL, mtags,
-				               ":%s MODE %s -%c",
-				               me.name, e->channel->chname, e->m);
-				free_message_tags(mtags);
+		if ((mode && (e->channel->mode.mode & mode)) ||
+		    (extmode && (e->channel->mode.extmode & extmode)))
+		{
+			MessageTag *mtags = NULL;
 
-				e->channel->mode.mode &= ~mode;
-				e->channel->mode.extmode &= ~extmode;
-			}
+			new_message(&me, NULL, &mtags);
+			sendto_server(NULL, 0, 0, mtags, ":%s MODE %s -%c 0", me.id, e->channel->chname, e->m);
+			sendto_channel(e->channel, &me, NULL, 0, 0, SEND_LOCAL, mtags,
+			               ":%s MODE %s -%c",
+			               me.name, e->channel->chname, e->m);
+			free_message_tags(mtags);
 
-			/* And delete... */
-			DelListItem(e, removechannelmodetimer_list);
-			safe_free(e);
-		} else {
-#ifdef NEWFLDDBG
-			sendto_realops("modef_event: chan %s mode -%c about %d seconds",
-				e->channel->chname, e->m, e->when - now);
-#endif
+			e->channel->mode.mode &= ~mode;
+			e->channel->mode.extmode &= ~extmode;
 		}
+
+		/* And delete... */
+		DelListItem(e, removechannelmodetimer_list);
+		safe_free(e);
 	}
 }
 
@@ -1316,33 +1350,57 @@ void floodprottimer_stopchantimers(Channel *channel)
 	}
 }
 
+/** Length in seconds of one counting slot for this +f setting */
+static int floodprot_slotlen(ChannelFloodProtection *chp)
+{
+	int len = (chp->per + FLOODPROT_BUCKETS - 1) / FLOODPROT_BUCKETS;
+	return len ? len : 1;
+}
+
+/** Forget all counts for one flood type */
+static void floodprot_window_reset(ChannelFloodProtection *chp, int what)
+{
+	memset(chp->bucket[what], 0, sizeof(chp->bucket[what]));
+	chp->total[what] = 0;
+}
+
 int do_floodprot(Channel *channel, int what)
 {
 	ChannelFloodProtection *chp = (ChannelFloodProtection *)GETPARASTRUCT(channel, 'f');
+	long slot, s;
 
 	if (!chp || !chp->limit[what]) /* no +f or not restricted */
 		return 0;
-	if (TStime() - chp->timer[what] >= chp->per)
+
+	/* Slide the window forward: expire the slots we moved past since
+	 * the previous event of this type. Purely arithmetic, no timers,
+	 * and at most FLOODPROT_BUCKETS steps.
+	 */
+	slot = TStime() / floodprot_slotlen(chp);
+	if (slot - chp->head_slot[what] >= FLOODPROT_BUCKETS)
 	{
-		chp->timer[what] = TStime();
-		chp->counter[what] = 1;
+		floodprot_window_reset(chp, what); /* whole window expired */
 	} else
 	{
-		chp->counter[what]++;
-		if ((chp->counter[what] > chp->limit[what]) &&
-		    (TStime() - chp->timer[what] < chp->per))
+		for (s = chp->head_slot[what] + 1; s <= slot; s++)
 		{
-			/* reset it too (makes it easier for chanops to handle the situation) */
-			/*
-			 *XXchp->timer[what] = TStime();
-			 *XXchp->counter[what] = 1;
-			 *
-			 * BAD.. there are some situations where we might 'miss' a flood
-			 * because of this. The reset has been moved to -i,-m,-N,-C,etc.
-			*/
-			return 1; /* flood detected! */
+			int idx = (int)(s % FLOODPROT_BUCKETS);
+			chp->total[what] -= chp->bucket[what][idx];
+			chp->bucket[what][idx] = 0;
 		}
 	}
+	chp->head_slot[what] = slot;
+
+	chp->bucket[what][(int)(slot % FLOODPROT_BUCKETS)]++;
+	chp->total[what]++;
+
+	/* Note that we never reset on detection: the window keeps sliding
+	 * and forgives by itself once things quiet down. Explicit resets
+	 * still happen on -i,-m,-N,-C,etc.
+	 */
+	if (chp->total[what] > chp->limit[what])
+		return 1; /* flood detected! */
+
 	return 0;
 }
 
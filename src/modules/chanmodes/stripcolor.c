@@ -34,7 +34,7 @@ Cmode_t EXTCMODE_STRIPCOLOR;
 
 #define IsStripColor(channel)    (channel->mode.extmode & EXTCMODE_STRIPCOLOR)
 
-int stripcolor_can_send_to_channel(Client *client, Channel *channel, Membership *lp, char **msg, char **errmsg, SendType sendtype);
+int stripcolor_text_transform(Client *client, Channel *channel, Membership *lp, char **msg, TextPipe *pipe, char **errmsg, SendType sendtype);
 char *stripcolor_prelocalpart(Client *client, Channel *channel, char *comment);
 char *stripcolor_prelocalquit(Client *client, char *comment);
 
@@ -54,7 +54,7 @@ CmodeInfo req;
 	req.is_ok = extcmode_default_requirechop;
 	CmodeAdd(modinfo->handle, req, &EXTCMODE_STRIPCOLOR);
 	
-	HookAdd(modinfo->handle, HOOKTYPE_CAN_SEND_TO_CHANNEL, 0, stripcolor_can_send_to_channel);
+	HookAdd(modinfo->handle, HOOKTYPE_TEXT_TRANSFORM, -100, stripcolor_text_transform); /* (prio: before rewriting stages like +G) */
 	HookAddPChar(modinfo->handle, HOOKTYPE_PRE_LOCAL_PART, 0, stripcolor_prelocalpart);
 	HookAddPChar(modinfo->handle, HOOKTYPE_PRE_LOCAL_QUIT_CHAN, 0, stripcolor_prelocalpart);
 	HookAddPChar(modinfo->handle, HOOKTYPE_PRE_LOCAL_QUIT, 0, stripcolor_prelocalquit);
@@ -73,7 +73,7 @@ MOD_UNLOAD()
 	return MOD_SUCCESS;
 }
 
-int stripcolor_can_send_to_channel(Client *client, Channel *channel, Membership *lp, char **msg, char **errmsg, SendType sendtype)
+int stripcolor_text_transform(Client *client, Channel *channel, Membership *lp, char **msg, TextPipe *pipe, char **errmsg, SendType sendtype)
 {
 	Hook *h;
 	int i;
@@ -89,7 +89,8 @@ int stripcolor_can_send_to_channel(Client *client, Channel *channel, Membership
 				break;
 		}
 
-		*msg = StripColors(*msg);
+		/* The pipeline already stripped for us, just pick up that view */
+		*msg = pipe->text_colorstripped;
 	}
 
 	return HOOK_CONTINUE;
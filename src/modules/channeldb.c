@@ -35,7 +35,7 @@ ModuleHeader MOD_HEADER = {
 	do { \
 		if (!(x)) { \
 			WARN_WRITE_ERROR(tmpfname); \
-			fclose(fd); \
+			dbwrite_discard(fd); \
 			return 0; \
 		} \
 	} while(0)
@@ -64,6 +64,7 @@ static void set_channel_mode(Channel *channel, char *modes, char *parameters);
 static uint32_t channeldb_version = CHANNELDB_VERSION;
 struct cfgstruct {
 	char *database;
+	int fsync;
 };
 static struct cfgstruct cfg;
 
@@ -92,6 +93,10 @@ MOD_LOAD()
 {
 	if (!channeldb_next_event)
 	{
+		struct timeval db_start, db_end;
+		long long db_cpu = boot_phase_cpu_now();
+
+		gettimeofday(&db_start, NULL);
 		/* If this is the first time that our module is loaded, then read the database. */
 		if (!read_channeldb())
 		{
@@ -102,6 +107,10 @@ MOD_LOAD()
 			else
 				config_warn("[channeldb] Failed to rename database from %s to %s: %s", cfg.database, fname, strerror(errno));
 		}
+		gettimeofday(&db_end, NULL);
+		boot_phase_credit("channeldb read",
+			(long long)(db_end.tv_sec - db_start.tv_sec) * 1000000 + (db_end.tv_usec - db_start.tv_usec),
+			boot_phase_cpu_now() - db_cpu);
 		channeldb_next_event = TStime() + CHANNELDB_SAVE_EVERY;
 	}
 	EventAdd(modinfo->handle, "channeldb_write_channeldb", write_channeldb_evt, NULL, 1000, 0);
@@ -115,6 +124,7 @@ MOD_LOAD()
 
 MOD_UNLOAD()
 {
+	dbwrite_flush(); /* finish any pending database write synchronously */
 	freecfg();
 	SavePersistentLong(modinfo, channeldb_next_event);
 	return MOD_SUCCESS;
@@ -131,6 +141,7 @@ void setcfg(void)
 	// Default: data/channel.db
 	safe_strdup(cfg.database, "channel.db");
 	convert_to_absolute_path(&cfg.database, PERMDATADIR);
+	cfg.fsync = 0;
 }
 
 void freecfg(void)
@@ -161,6 +172,8 @@ int channeldb_configtest(ConfigFile *cf, ConfigEntry *ce, int type, int *errs)
 			convert_to_absolute_path(&cep->ce_vardata, PERMDATADIR);
 			continue;
 		}
+		if (!strcmp(cep->ce_varname, "fsync"))
+			continue;
 		config_error("%s:%i: unknown directive set::channeldb::%s", cep->ce_fileptr->cf_filename, cep->ce_varlinenum, cep->ce_varname);
 		errors++;
 	}
@@ -184,6 +197,8 @@ int channeldb_configrun(ConfigFile *cf, ConfigEntry *ce, int type)
 	{
 		if (!strcmp(cep->ce_varname, "database"))
 			safe_strdup(cfg.database, cep->ce_vardata);
+		else if (!strcmp(cep->ce_varname, "fsync"))
+			cfg.fsync = config_checkval(cep->ce_vardata, CFG_YESNO);
 	}
 	return 1;
 }
@@ -200,6 +215,7 @@ int write_channeldb(void)
 {
 	char tmpfname[512];
 	FILE *fd;
+	int writebehind = 0;
 	Channel *channel;
 	int cnt = 0;
 #ifdef BENCHMARK
@@ -208,9 +224,17 @@ int write_channeldb(void)
 	gettimeofday(&tv_alpha, NULL);
 #endif
 
-	// Write to a tempfile first, then rename it if everything succeeded
+	/* Serialize to memory when possible, the result is then written to
+	 * disk in small chunks from the main loop (see dbwrite_run). If
+	 * that is unavailable then write to a tempfile directly - in both
+	 * cases the tempfile is renamed into place once complete.
+	 */
 	snprintf(tmpfname, sizeof(tmpfname), "%s.tmp", cfg.database);
-	fd = fopen(tmpfname, "wb");
+	fd = dbwrite_open();
+	if (fd)
+		writebehind = 1;
+	else
+		fd = fopen(tmpfname, "wb");
 	if (!fd)
 	{
 		WARN_WRITE_ERROR(tmpfname);
@@ -235,21 +259,39 @@ int write_channeldb(void)
 		}
 	}
 
-	// Everything seems to have gone well, attempt to close and rename the tempfile
-	if (fclose(fd) != 0)
+	if (writebehind)
 	{
-		WARN_WRITE_ERROR(tmpfname);
-		return 0;
-	}
+		// Everything is in memory now, disk I/O happens from the main loop
+		if (!dbwrite_submit(fd, cfg.database, cfg.fsync))
+		{
+			WARN_WRITE_ERROR(tmpfname);
+			return 0;
+		}
+	} else {
+		// Everything seems to have gone well, attempt to close and rename the tempfile
+#ifndef _WIN32
+		if (cfg.fsync && (fflush(fd) != 0 || fsync(fileno(fd)) < 0))
+		{
+			WARN_WRITE_ERROR(tmpfname);
+			fclose(fd);
+			return 0;
+		}
+#endif
+		if (fclose(fd) != 0)
+		{
+			WARN_WRITE_ERROR(tmpfname);
+			return 0;
+		}
 
 #ifdef _WIN32
-	/* The rename operation cannot be atomic on Windows as it will cause a "file exists" error */
-	unlink(cfg.database);
+		/* The rename operation cannot be atomic on Windows as it will cause a "file exists" error */
+		unlink(cfg.database);
 #endif
-	if (rename(tmpfname, cfg.database) < 0)
-	{
-		sendto_realops_and_log("[channeldb] Error renaming '%s' to '%s': %s (DATABASE NOT SAVED)", tmpfname, cfg.database, strerror(errno));
-		return 0;
+		if (rename(tmpfname, cfg.database) < 0)
+		{
+			sendto_realops_and_log("[channeldb] Error renaming '%s' to '%s': %s (DATABASE NOT SAVED)", tmpfname, cfg.database, strerror(errno));
+			return 0;
+		}
 	}
 #ifdef BENCHMARK
 	gettimeofday(&tv_beta, NULL);
@@ -50,6 +50,15 @@ struct MBList
 };
 MBList *mblist = NULL, *mblist_tail = NULL;
 
+/* The multibyte ranges above are compiled into this pair-validity
+ * bitmap: one bit per (first byte, second byte) combination, so
+ * do_nick_name_multibyte() does a single bit test per character pair
+ * instead of walking the range list. Rebuilt lazily whenever the
+ * range list changed, see mbvalid_rebuild().
+ */
+static unsigned char mbvalid[256][256/8];
+static int mbvalid_dirty = 0;
+
 /* Use this to prevent mixing of certain combinations
  * (such as GBK & high-ascii, etc)
  */
@@ -166,11 +175,22 @@ ILangList *ilanglist = NULL;
  */
 const char *illegalnickchars = "!+%@&~#$:'\"?*,.";
 
+/* Table-driven variant of the always-illegal check above:
+ * nick_illegal_tab[c] is nonzero for ascii <= 32 and the characters in
+ * illegalnickchars. Filled in once at module test time and used by the
+ * per-character validation loops, so they do not strchr() for every
+ * character of every nick - remote nick validation runs for each user
+ * introduced during a server burst.
+ */
+static char nick_illegal_tab[256];
+
 /* Forward declarations */
 int _do_nick_name(char *nick);
 int _do_remote_nick_name(char *nick);
 static int do_nick_name_multibyte(char *nick);
 static int do_nick_name_standard(char *nick);
+static void nickverdict_flush(void);
+static void mbvalid_rebuild(void);
 void charsys_reset(void);
 void charsys_reset_pretest(void);
 void charsys_finish(void);
@@ -184,9 +204,23 @@ int charsys_config_run(ConfigFile *cf, ConfigEntry *ce, int type);
 int charsys_config_posttest(int *errs);
 char *_charsys_get_current_languages(void);
 
+static void nick_illegal_tab_init(void)
+{
+	int i;
+
+	memset(nick_illegal_tab, 0, sizeof(nick_illegal_tab));
+	for (i = 0; i < 256; i++)
+	{
+		char c = (char)i;
+		if ((c <= 32) || strchr(illegalnickchars, c))
+			nick_illegal_tab[i] = 1;
+	}
+}
+
 MOD_TEST()
 {
 	MARK_AS_OFFICIAL_MODULE(modinfo);
+	nick_illegal_tab_init();
 	EfunctionAdd(modinfo->handle, EFUNC_DO_NICK_NAME, _do_nick_name);
 	EfunctionAdd(modinfo->handle, EFUNC_DO_REMOTE_NICK_NAME, _do_remote_nick_name);
 	EfunctionAddPChar(modinfo->handle, EFUNC_CHARSYS_GET_CURRENT_LANGUAGES, _charsys_get_current_languages);
@@ -356,6 +390,7 @@ void charsys_reset(void)
 		safe_free(m);
 	}
 	mblist=mblist_tail=NULL;
+	mbvalid_dirty = 1;
 	/* Then add the default which will always be allowed */
 	charsys_addallowed("0123456789-ABCDEFGHIJKLMNOPQRSTUVWXYZ[\\]^_`abcdefghijklmnopqrstuvwxyzy{|}");
 	langav = 0;
@@ -398,6 +433,7 @@ static void ilang_sort(void)
 
 void charsys_finish(void)
 {
+	static char prev_langsinuse[4096];
 	ILangList *e, *e_next;
 
 	/* Sort alphabetically */
@@ -425,6 +461,19 @@ void charsys_finish(void)
 		abort();
 #endif
 	charsys_check_for_changes();
+
+	/* A rehash wipes and rebuilds the tables unconditionally, but when
+	 * set::allowed-nickchars did not change the rebuilt tables are
+	 * byte-identical to what we had: the cached verdicts and the
+	 * compiled multibyte bitmap are then still valid and kept warm.
+	 */
+	if (strcmp(langsinuse, prev_langsinuse))
+	{
+		strlcpy(prev_langsinuse, langsinuse, sizeof(prev_langsinuse));
+		nickverdict_flush();
+	} else {
+		mbvalid_dirty = 0;
+	}
 }
 
 /** Add a character range to the multibyte list.
@@ -448,6 +497,34 @@ MBList *m = safe_alloc(sizeof(MBList));
 	else
 		mblist = m;
 	mblist_tail = m;
+	mbvalid_dirty = 1;
+}
+
+/** (Re)compiles the mblist ranges into the mbvalid pair bitmap */
+static void mbvalid_rebuild(void)
+{
+	MBList *m;
+	int i, j;
+
+	memset(mbvalid, 0, sizeof(mbvalid));
+	for (m=mblist; m; m=m->next)
+	{
+		for (i = 0; i < 256; i++)
+		{
+			unsigned char c1 = i;
+
+			if (!((c1 >= m->s1) && (c1 <= m->e1)))
+				continue;
+			for (j = 0; j < 256; j++)
+			{
+				unsigned char c2 = j;
+
+				if ((c2 >= m->s2) && (c2 <= m->e2))
+					mbvalid[c1][c2 >> 3] |= (1 << (c2 & 7));
+			}
+		}
+	}
+	mbvalid_dirty = 0;
 }
 
 /** Adds all characters in the specified string to the allowed list. */
@@ -474,12 +551,60 @@ void charsys_addallowed_range(unsigned char from, unsigned char to)
 		char_atribs[i] |= ALLOWN;
 }
 
+/* Verdict cache for do_nick_name(). Nick validation runs on every local
+ * and remote nick introduction and the multibyte walk is the expensive
+ * variant. The same nicks come back over and over (services clients,
+ * nick floods, re-checks after rule changes), so remember recent
+ * verdicts in a small direct-mapped table keyed by the nick as offered.
+ * The cache is flushed whenever the character system configuration
+ * changes, see charsys_finish().
+ */
+#define NICKVERDICT_CACHE_SIZE 256
+typedef struct NickVerdict NickVerdict;
+struct NickVerdict {
+	char nick[NICKLEN+1]; /**< The nick as offered (before any truncation) */
+	int verdict; /**< Length result of do_nick_name_*() */
+};
+static NickVerdict nickverdict_cache[NICKVERDICT_CACHE_SIZE];
+
+static unsigned int nickverdict_hash(const char *nick)
+{
+	unsigned int h = 5381;
+
+	for (; *nick; nick++)
+		h = (h << 5) + h + (unsigned char)*nick;
+	return h % NICKVERDICT_CACHE_SIZE;
+}
+
+static void nickverdict_flush(void)
+{
+	memset(nickverdict_cache, 0, sizeof(nickverdict_cache));
+}
+
 int _do_nick_name(char *nick)
 {
-	if (mblist)
-		return do_nick_name_multibyte(nick);
-	else
-		return do_nick_name_standard(nick);
+	NickVerdict *v;
+	int len;
+
+	/* Oversized input cannot be cached (and will be rejected or
+	 * truncated by the walk anyway), take the direct route.
+	 */
+	if (strlen(nick) > NICKLEN)
+		return mblist ? do_nick_name_multibyte(nick) : do_nick_name_standard(nick);
+
+	v = &nickverdict_cache[nickverdict_hash(nick)];
+	if (!strcmp(v->nick, nick))
+	{
+		/* Cache hit: replay the truncation the real check would do */
+		if (v->verdict > 0)
+			nick[v->verdict] = '\0';
+		return v->verdict;
+	}
+
+	strlcpy(v->nick, nick, sizeof(v->nick));
+	len = mblist ? do_nick_name_multibyte(nick) : do_nick_name_standard(nick);
+	v->verdict = len;
+	return len;
 }
 
 static int do_nick_name_standard(char *nick)
@@ -499,15 +624,9 @@ static int do_nick_name_standard(char *nick)
 
 static int isvalidmbyte(unsigned char c1, unsigned char c2)
 {
-	MBList *m;
-
-	for (m=mblist; m; m=m->next)
-	{
-		if ((c1 >= m->s1) && (c1 <= m->e1) &&
-		    (c2 >= m->s2) && (c2 <= m->e2))
-		    return 1;
-	}
-	return 0;
+	if (mbvalid_dirty)
+		mbvalid_rebuild();
+	return mbvalid[c1][c2 >> 3] & (1 << (c2 & 7));
 }
 
 /* hmmm.. there must be some problems with multibyte &
@@ -526,7 +645,7 @@ static int do_nick_name_multibyte(char *nick)
 	for (ch=nick,len=0; *ch && len <= NICKLEN; ch++, len++)
 	{
 		/* Some characters are ALWAYS illegal, so they have to be disallowed here */
-		if ((*ch <= 32) || strchr(illegalnickchars, *ch))
+		if (nick_illegal_tab[(unsigned char)*ch])
 			return 0;
 		if (firstmbchar)
 		{
@@ -563,7 +682,7 @@ int _do_remote_nick_name(char *nick)
 
 	/* Now the other, more relaxed checks.. */
 	for (c=nick; *c; c++)
-		if ((*c <= 32) || strchr(illegalnickchars, *c))
+		if (nick_illegal_tab[(unsigned char)*c])
 			return 0;
 
 	return (c - nick);
@@ -693,7 +812,7 @@ void charsys_add_language(char *name)
 	if (latin1 || !strcmp(name, "german"))
 	{
 		/* a", A", o", O", u", U" and es-zett */
-		charsys_addallowed("�������");
+		charsys_addallowed("�������");
 	}
 	if (latin_utf8 || !strcmp(name, "german-utf8"))
 	{
@@ -708,7 +827,7 @@ void charsys_add_language(char *name)
 	if (latin1 || !strcmp(name, "swiss-german"))
 	{
 		/* a", A", o", O", u", U"  */
-		charsys_addallowed("������");
+		charsys_addallowed("������");
 	}
 	if (latin_utf8 || !strcmp(name, "swiss-german-utf8"))
 	{
@@ -728,7 +847,7 @@ void charsys_add_language(char *name)
 		 * I suggest you to use just latin1 :P.
 		 */
 		/* e', e", o", i", u", e`. */
-		charsys_addallowed("������");
+		charsys_addallowed("������");
 	}
 	if (latin_utf8 || !strcmp(name, "dutch-utf8"))
 	{
@@ -742,7 +861,7 @@ void charsys_add_language(char *name)
 	{
 		/* supplied by klaus:
 		 * <ae>, <AE>, ao, Ao, o/, O/ */
-		charsys_addallowed("������");
+		charsys_addallowed("������");
 	}
 	if (latin_utf8 || !strcmp(name, "danish-utf8"))
 	{
@@ -758,7 +877,7 @@ void charsys_add_language(char *name)
 		 * Hmm.. there might be more, but I'm not sure how common they are
 		 * and I don't think they are always displayed correctly (?).
 		 */
-		charsys_addallowed("���������������������������");
+		charsys_addallowed("���������������������������");
 	}
 	if (latin_utf8 || !strcmp(name, "french-utf8"))
 	{
@@ -781,7 +900,7 @@ void charsys_add_language(char *name)
 	if (latin1 || !strcmp(name, "spanish"))
 	{
 		/* a', A', e', E', i', I', o', O', u', U', u", U", n~, N~ */
-		charsys_addallowed("��������������");
+		charsys_addallowed("��������������");
 	}
 	if (latin_utf8 || !strcmp(name, "spanish-utf8"))
 	{
@@ -803,7 +922,7 @@ void charsys_add_language(char *name)
 	if (latin1 || !strcmp(name, "italian"))
 	{
 		/* A`, E`, E', I`, I', O`, O', U`, U', a`, e`, e', i`, i', o`, o', u`, u' */
-		charsys_addallowed("������������������");
+		charsys_addallowed("������������������");
 	}
 	if (latin_utf8 || !strcmp(name, "italian-utf8"))
 	{
@@ -822,7 +941,7 @@ void charsys_add_language(char *name)
 	{
 		/* supplied by Trocotronic */
 		/* a`, A`, e`, weird-c, weird-C, E`, e', E', i', I', o`, O`, o', O', u', U', i", I", u", U", weird-dot */
-		charsys_addallowed("��������������������");
+		charsys_addallowed("��������������������");
 	}
 	if (latin_utf8 || !strcmp(name, "catalan-utf8"))
 	{
@@ -844,7 +963,7 @@ void charsys_add_language(char *name)
 	{
 		/* supplied by Tank */
 		/* ao, Ao, a", A", o", O" */
-		charsys_addallowed("������");
+		charsys_addallowed("������");
 	}
 	if (latin_utf8 || !strcmp(name, "swedish-utf8"))
 	{
@@ -856,7 +975,7 @@ void charsys_add_language(char *name)
 	if (latin1 || !strcmp(name, "icelandic"))
 	{
 		/* supplied by Saevar */
-		charsys_addallowed("������������������");
+		charsys_addallowed("������������������");
 	}
 	if (latin_utf8 || !strcmp(name, "icelandic-utf8"))
 	{
@@ -891,7 +1010,7 @@ void charsys_add_language(char *name)
 	{
 		/* supplied by AngryWolf */
 		/* a', e', i', o', o", o~, u', u", u~, A', E', I', O', O", O~, U', U", U~ */
-		charsys_addallowed("������������������");
+		charsys_addallowed("������������������");
 	}
 	if (latin_utf8 || !strcmp(name, "hungarian-utf8"))
 	{
@@ -917,7 +1036,7 @@ void charsys_add_language(char *name)
 	{
 		/* With some help from crazytoon */
 		/* 'S,' 's,' 'A^' 'A<' 'I^' 'T,' 'a^' 'a<' 'i^' 't,' */
-		charsys_addallowed("����������");
+		charsys_addallowed("����������");
 	}
 	if (latin_utf8 || !strcmp(name, "romanian-utf8"))
 	{
@@ -933,7 +1052,7 @@ void charsys_add_language(char *name)
 	if (latin2 || !strcmp(name, "polish"))
 	{
 		/* supplied by k4be */
-		charsys_addallowed("����󶿼��ʣ�Ӧ��");
+		charsys_addallowed("����󶿼��ʣ�Ӧ��");
 	}
 	if (latin_utf8 || !strcmp(name, "polish-utf8"))
 	{
@@ -949,12 +1068,12 @@ void charsys_add_language(char *name)
 	if (w1250 || !strcmp(name, "polish-w1250"))
 	{
 		/* supplied by k4be */
-		charsys_addallowed("����󜿟��ʣ�ӌ��");
+		charsys_addallowed("����󜿟��ʣ�ӌ��");
 	}
 	if (w1250 || !strcmp(name, "czech-w1250"))
 	{
 		/* Syzop [probably incomplete] */
-		charsys_addallowed("������������������������������");
+		charsys_addallowed("������������������������������");
 	}
 	if (latin_utf8 || !strcmp(name, "czech-utf8"))
 	{
@@ -982,7 +1101,7 @@ void charsys_add_language(char *name)
 	if (w1250 || !strcmp(name, "slovak-w1250"))
 	{
 		/* Syzop [probably incomplete] */
-		charsys_addallowed("�����������������������������");
+		charsys_addallowed("�����������������������������");
 	}
 	if (latin_utf8 || !strcmp(name, "slovak-utf8"))
 	{
@@ -1013,7 +1132,7 @@ void charsys_add_language(char *name)
 		/* supplied by Roman Parkin:
 		 * 128-159 and 223-254
 		 */
-		charsys_addallowed("������������������������������������������������������������������");
+		charsys_addallowed("������������������������������������������������������������������");
 	}
 	if (cyrillic_utf8 || !strcmp(name, "russian-utf8"))
 	{
@@ -1029,7 +1148,7 @@ void charsys_add_language(char *name)
 		 * 128-159, 161, 162, 178, 179 and 223-254
 		 * Corrected 01.11.2006 to more "correct" behavior by Bock
 		 */
-		charsys_addallowed("�����Ũ�ǲ����������ӡ���������������������������������������");
+		charsys_addallowed("�����Ũ�ǲ����������ӡ���������������������������������������");
 	}
 	if (cyrillic_utf8 || !strcmp(name, "belarussian-utf8"))
 	{
@@ -1053,7 +1172,7 @@ void charsys_add_language(char *name)
 		 * 128-159, 170, 175, 178, 179, 186, 191 and 223-254
 		 * Corrected 01.11.2006 to more "correct" behavior by core
 		 */
-		charsys_addallowed("���å�Ū��Ȳ�����������������������������賿��������������������");
+		charsys_addallowed("���å�Ū��Ȳ�����������������������������賿��������������������");
 	}
 	if (cyrillic_utf8 || !strcmp(name, "ukrainian-utf8"))
 	{
@@ -1075,7 +1194,7 @@ void charsys_add_language(char *name)
 	{
 		/* supplied by GSF */
 		/* ranges from rfc1947 / iso 8859-7 */
-		charsys_addallowed("�����������������������������������������������������������");
+		charsys_addallowed("�����������������������������������������������������������");
 	}
 	if (!strcmp(name, "greek-utf8"))
 	{
@@ -1091,7 +1210,7 @@ void charsys_add_language(char *name)
 	if (!strcmp(name, "turkish"))
 	{
 		/* Supplied by Ayberk Yancatoral */
-		charsys_addallowed("�����������");
+		charsys_addallowed("�����������");
 	}
 	if (!strcmp(name, "turkish-utf8"))
 	{
@@ -1111,7 +1230,7 @@ void charsys_add_language(char *name)
 	{
 		/* Supplied by PHANTOm. */
 		/* 0xE0 - 0xFE */
-		charsys_addallowed("�������������������������������");
+		charsys_addallowed("�������������������������������");
 	}
 	if (!strcmp(name, "hebrew-utf8"))
 	{
@@ -1142,7 +1261,7 @@ void charsys_add_language(char *name)
 	/* [LATVIAN] */
 	if (latin_utf8 || !strcmp(name, "latvian-utf8"))
 	{
-		/* A a, C c, E e, G g, I i, K k, � �, U u, � � */
+		/* A a, C c, E e, G g, I i, K k, � �, U u, � � */
 		charsys_addmultibyterange(0xc4, 0xc4, 0x80, 0x81);
 		charsys_addmultibyterange(0xc4, 0xc4, 0x92, 0x93);
 		charsys_addmultibyterange(0xc4, 0xc4, 0x8c, 0x8d);
@@ -1158,7 +1277,7 @@ void charsys_add_language(char *name)
 	/* [ESTONIAN] */
 	if (latin_utf8 || !strcmp(name, "estonian-utf8"))
 	{
-		/* �, �, �, �,  �, �, �, � */
+		/* �, �, �, �,  �, �, �, � */
 		charsys_addmultibyterange(0xc3, 0xc3, 0xb5, 0xb6);
 		charsys_addmultibyterange(0xc3, 0xc3, 0xa4, 0xa4);
 		charsys_addmultibyterange(0xc3, 0xc3, 0xbc, 0xbc);
@@ -1170,7 +1289,7 @@ void charsys_add_language(char *name)
 	/* [LITHUANIAN] */
 	if (latin_utf8 || !strcmp(name, "lithuanian-utf8"))
 	{
-		/* a, c, e, e, i, �, u, u, �, A, C, E, E, I, �, U, U, � */
+		/* a, c, e, e, i, �, u, u, �, A, C, E, E, I, �, U, U, � */
 		charsys_addmultibyterange(0xc4, 0xc4, 0x84, 0x85);
 		charsys_addmultibyterange(0xc4, 0xc4, 0x8c, 0x8d);
 		charsys_addmultibyterange(0xc4, 0xc4, 0x96, 0x99);
@@ -24,6 +24,32 @@
 
 static char *cloak_key1 = NULL, *cloak_key2 = NULL, *cloak_key3 = NULL;
 static char cloak_checksum[64];
+
+/* Memoized cloak results.
+ * hidehost() runs several MD5 rounds per call and is hit on every user
+ * registration, vhost check and cloaked-host ban match; a clone flood
+ * recomputes near-identical digests thousands of times. We keep a
+ * direct-mapped cache of input host/IP -> cloaked form. The comparison
+ * is case sensitive on purpose: the MD5 input is the raw host string,
+ * so "Foo.example.net" and "foo.example.net" really do cloak
+ * differently. The whole cache is invalidated at once when the cloak
+ * keys change, by bumping the generation number that each entry must
+ * match. Hit/miss counters are shown in /STATS cloak for sizing.
+ */
+#define CLOAK_CACHE_SIZE 1024 /* must be a power of two */
+
+typedef struct CloakCacheEntry CloakCacheEntry;
+struct CloakCacheEntry {
+	char host[HOSTLEN+1];		/**< Input host or IP */
+	char cloaked[HOSTLEN+1];	/**< Cloaked form of 'host' */
+	unsigned int generation;	/**< Cloak keys generation this was computed under (0: unused) */
+};
+
+static CloakCacheEntry cloak_cache[CLOAK_CACHE_SIZE];
+static unsigned int cloak_keys_generation = 0;
+static char cloak_siphashkey[SIPHASH_KEY_LENGTH];
+static int cloak_siphashkey_set = 0;
+static long long cloak_cache_hits = 0, cloak_cache_misses = 0;
 static int nokeys = 1;
 
 int CLOAK_IP_ONLY = 0;
@@ -36,6 +62,7 @@ int CLOAK_IP_ONLY = 0;
 #define KEY3 cloak_key3
 
 char *hidehost(Client *client, char *host);
+int cloak_stats(Client *client, char *para);
 char *cloakcsum();
 int cloak_config_test(ConfigFile *, ConfigEntry *, int, int *);
 int cloak_config_run(ConfigFile *, ConfigEntry *, int);
@@ -79,6 +106,7 @@ MOD_INIT()
 {
 	MARK_AS_OFFICIAL_MODULE(modinfo);
 	HookAdd(modinfo->handle, HOOKTYPE_CONFIGRUN, 0, cloak_config_run);
+	HookAdd(modinfo->handle, HOOKTYPE_STATS, 0, cloak_stats);
 	return MOD_SUCCESS;
 }
 
@@ -253,25 +281,68 @@ char buf[512], result[16];
 		(u_int)(result[13] & 0xf), (u_int)(result[13] >> 4),
 		(u_int)(result[14] & 0xf), (u_int)(result[14] >> 4),
 		(u_int)(result[15] & 0xf), (u_int)(result[15] >> 4));
+
+	/* New keys mean new cloaks: invalidate all memoized results */
+	cloak_keys_generation++;
+	if (cloak_keys_generation == 0)
+		cloak_keys_generation = 1; /* 0 means 'entry unused' */
+
 	return 1;
 }
 
 char *hidehost(Client *client, char *host)
 {
-	char *p;
+	CloakCacheEntry *e = NULL;
+	char *result;
 	int host_type;
 
 	if (CLOAK_IP_ONLY)
 		host = GetIP(client);
 
+	if (strlen(host) <= HOSTLEN)
+	{
+		if (!cloak_siphashkey_set)
+		{
+			siphash_generate_key(cloak_siphashkey);
+			cloak_siphashkey_set = 1;
+		}
+		e = &cloak_cache[siphash(host, cloak_siphashkey) & (CLOAK_CACHE_SIZE-1)];
+		if ((e->generation == cloak_keys_generation) && !strcmp(e->host, host))
+		{
+			cloak_cache_hits++;
+			return e->cloaked;
+		}
+	}
+
 	host_type = is_valid_ip(host);
 
 	if (host_type == 4)
-		return hidehost_ipv4(host);
+		result = hidehost_ipv4(host);
 	else if (host_type == 6)
-		return hidehost_ipv6(host);
+		result = hidehost_ipv6(host);
 	else
-		return hidehost_normalhost(host);
+		result = hidehost_normalhost(host);
+
+	cloak_cache_misses++;
+	if (e && result && (strlen(result) <= HOSTLEN))
+	{
+		strlcpy(e->host, host, sizeof(e->host));
+		strlcpy(e->cloaked, result, sizeof(e->cloaked));
+		e->generation = cloak_keys_generation;
+	}
+
+	return result;
+}
+
+/** '/STATS cloak': show how well the cloak cache is doing */
+int cloak_stats(Client *client, char *para)
+{
+	if (!para || strcasecmp(para, "cloak"))
+		return 0;
+
+	sendtxtnumeric(client, "cloak cache: %lld hits, %lld misses, %d slots",
+		cloak_cache_hits, cloak_cache_misses, CLOAK_CACHE_SIZE);
+	return 1;
 }
 
 char *cloakcsum()
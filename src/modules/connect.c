@@ -115,6 +115,7 @@ CMD_FUNC(cmd_connect)
 	}
 
 	/* Evaluate deny link */
+	crule_eval_begin_round();
 	for (deny = conf_deny_link; deny; deny = deny->next)
 	{
 		if (deny->flag.type == CRULE_ALL && match_simple(deny->mask, aconf->servername)
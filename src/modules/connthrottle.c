@@ -31,6 +31,7 @@ struct cfgstruct {
 	/* set::connthrottle::known-users: */
 	ThrottleSetting local;
 	ThrottleSetting global;
+	ThrottleSetting subnet;
 	/* set::connthrottle::new-users: */
 	int minimum_reputation_score;
 	int sasl_bypass;
@@ -65,11 +66,32 @@ struct UCounter {
 };
 UCounter *ucounter = NULL;
 
+/* Subnet-level throttling. The local/global counters above catch a flood
+ * as a whole, but a botnet rotating through one prefix stays under the
+ * per-IP radar of the reputation module. One aggregated bucket per /24
+ * (IPv6: per /64) catches that case. The table is direct-mapped: on a
+ * hash collision the old bucket is simply taken over, which at worst
+ * means a subnet gets a fresh (empty) counter - never a false reject.
+ */
+#define SUBNET_TABLE_SIZE 256
+
+typedef struct SubnetBucket SubnetBucket;
+struct SubnetBucket {
+	char valid;			/**< Slot in use? */
+	char net[64];			/**< Prefix, eg "203.0.113." */
+	ThrottleCounter counter;	/**< Connects from this subnet */
+};
+
+static SubnetBucket subnet_table[SUBNET_TABLE_SIZE];
+static char siphashkey_subnet[SIPHASH_KEY_LENGTH];
+static int siphashkey_subnet_set = 0;
+
 #define MSG_THROTTLE "THROTTLE"
 
 #define GetReputation(client)     (moddata_client_get(client, "reputation") ? atoi(moddata_client_get(client, "reputation")) : 0)
 
 /* Forward declarations */
+static SubnetBucket *find_subnet_bucket(Client *client);
 int ct_config_test(ConfigFile *cf, ConfigEntry *ce, int type, int *errs);
 int ct_config_posttest(int *errs);
 int ct_config_run(ConfigFile *cf, ConfigEntry *ce, int type);
@@ -87,6 +109,7 @@ MOD_TEST()
 	/* Defaults: */
 	cfg.local.count = 20; cfg.local.period = 60;
 	cfg.global.count = 30; cfg.global.period = 60;
+	cfg.subnet.count = 10; cfg.subnet.period = 60;
 	cfg.start_delay = 180;		/* 3 minutes */
 	safe_strdup(cfg.reason, "Throttled: Too many users trying to connect, please wait a while and try again");
 	cfg.minimum_reputation_score = 24;
@@ -228,6 +251,20 @@ int ct_config_test(ConfigFile *cf, ConfigEntry *ce, int type, int *errs)
 						continue;
 					}
 				} else
+				if (!strcmp(cepp->ce_varname, "subnet-throttle"))
+				{
+					int cnt, period;
+					if (!config_parse_flood(cepp->ce_vardata, &cnt, &period) ||
+					    (cnt < 1) || (cnt > 2000000000) || (period > 2000000000))
+					{
+						config_error("%s:%i: set::connthrottle::new-users::subnet-throttle error. "
+							     "Syntax is <count>:<period> (eg 6:60), "
+							     "and count and period should be non-zero.",
+							     cepp->ce_fileptr->cf_filename, cepp->ce_varlinenum);
+						errors++;
+						continue;
+					}
+				} else
 				{
 					config_error_unknown(cepp->ce_fileptr->cf_filename, cepp->ce_varlinenum,
 					                     "set::connthrottle::new-users", cepp->ce_varname);
@@ -311,6 +348,8 @@ int ct_config_run(ConfigFile *cf, ConfigEntry *ce, int type)
 					config_parse_flood(cepp->ce_vardata, &cfg.local.count, &cfg.local.period);
 				else if (!strcmp(cepp->ce_varname, "global-throttle"))
 					config_parse_flood(cepp->ce_vardata, &cfg.global.count, &cfg.global.period);
+				else if (!strcmp(cepp->ce_varname, "subnet-throttle"))
+					config_parse_flood(cepp->ce_vardata, &cfg.subnet.count, &cfg.subnet.period);
 			}
 		} else
 		if (!strcmp(cep->ce_varname, "disabled-when"))
@@ -386,8 +425,46 @@ EVENT(connthrottle_evt)
 	ucounter->throttling_banner_displayed = 0; /* reset */
 }
 
+/** Find (or claim) the throttle bucket for the client's subnet:
+ * the /24 for IPv4 and (roughly) the /64 for IPv6.
+ */
+static SubnetBucket *find_subnet_bucket(Client *client)
+{
+	char net[64];
+	char sep = IsIPV6(client) ? ':' : '.';
+	int want = IsIPV6(client) ? 4 : 3;
+	int seen = 0;
+	char *i, *o = net;
+	SubnetBucket *e;
+
+	if (!siphashkey_subnet_set)
+	{
+		siphash_generate_key(siphashkey_subnet);
+		siphashkey_subnet_set = 1;
+	}
+
+	for (i = client->ip; *i && (o < net + sizeof(net) - 1); i++)
+	{
+		*o++ = *i;
+		if ((*i == sep) && (++seen == want))
+			break;
+	}
+	*o = '\0';
+
+	e = &subnet_table[siphash(net, siphashkey_subnet) % SUBNET_TABLE_SIZE];
+	if (!e->valid || strcmp(e->net, net))
+	{
+		/* Free slot or collision: take it over with a fresh counter */
+		e->valid = 1;
+		strlcpy(e->net, net, sizeof(e->net));
+		memset(&e->counter, 0, sizeof(e->counter));
+	}
+	return e;
+}
+
 #define THROT_LOCAL 1
 #define THROT_GLOBAL 2
+#define THROT_SUBNET 4
 int ct_pre_lconnect(Client *client)
 {
 	int throttle=0;
@@ -431,6 +508,14 @@ int ct_pre_lconnect(Client *client)
 	if ((TStime() - ucounter->local.t < cfg.local.period) && (ucounter->local.count+1 > cfg.local.count))
 		throttle |= THROT_LOCAL;
 
+	/* +1 client from this subnet would reach the subnet limit? */
+	if (cfg.subnet.count)
+	{
+		SubnetBucket *e = find_subnet_bucket(client);
+		if ((TStime() - e->counter.t < cfg.subnet.period) && (e->counter.count+1 > cfg.subnet.count))
+			throttle |= THROT_SUBNET;
+	}
+
 	if (throttle)
 	{
 		ucounter->throttling_this_minute = 1;
@@ -452,7 +537,7 @@ int ct_pre_lconnect(Client *client)
 }
 
 /** Increase the connect counter(s), nothing else. */
-void bump_connect_counter(int local_connect)
+void bump_connect_counter(Client *client, int local_connect)
 {
 	if (local_connect)
 	{
@@ -464,6 +549,21 @@ void bump_connect_counter(int local_connect)
 		} else {
 			ucounter->local.count++;
 		}
+
+		/* Bump the subnet counter (local connects only, remote
+		 * servers run their own subnet buckets).
+		 */
+		if (cfg.subnet.count)
+		{
+			SubnetBucket *e = find_subnet_bucket(client);
+			if (TStime() - e->counter.t >= cfg.subnet.period)
+			{
+				e->counter.t = TStime();
+				e->counter.count = 1;
+			} else {
+				e->counter.count++;
+			}
+		}
 	}
 
 	/* Bump global connect counter */
@@ -514,7 +614,7 @@ int ct_lconnect(Client *client)
 	/* Allowed NEW user */
 	ucounter->allowed_other++;
 
-	bump_connect_counter(1);
+	bump_connect_counter(client, 1);
 
 	return 0;
 }
@@ -546,7 +646,7 @@ int ct_rconnect(Client *client)
 	if (score >= cfg.minimum_reputation_score)
 		return 0; /* sufficient reputation: "known-user" */
 
-	bump_connect_counter(0);
+	bump_connect_counter(client, 0);
 
 	return 0;
 }
@@ -621,6 +721,7 @@ CMD_FUNC(ct_throttle)
 	if (!strcasecmp(parv[1], "RESET"))
 	{
 		memset(ucounter, 0, sizeof(UCounter));
+		memset(subnet_table, 0, sizeof(subnet_table));
 		sendto_realops("[connthrottle] %s (%s@%s) did a RESET on the stats/counters!!",
 			client->name, client->user->username, client->user->realhost);
 	} else
@@ -193,6 +193,7 @@ int add_dccallow(Client *client, Client *optr)
 	lp->flags = DCC_LINK_ME;
 	lp->next = client->user->dccallow;
 	client->user->dccallow = lp;
+	client->user->dccallow_bloom |= list_bloom_mask(optr);
 
 	lp = make_link();
 	lp->value.client = client;
@@ -228,6 +229,7 @@ int del_dccallow(Client *client, Client *optr)
 		sendnumericfmt(client, RPL_DCCINFO, ":%s is not in your DCC allow list", optr->name);
 		return 0;
 	}
+	dccallow_bloom_rebuild(client);
 
 	for (found = 0, lpp = &(optr->user->dccallow); *lpp; lpp=&((*lpp)->next))
 	{
@@ -68,6 +68,14 @@ int em_chanmsg(Client *client, Channel *channel, int sendflags, int prefix, char
 {
 	if (MyUser(client) && HasCapabilityFast(client, CAP_ECHO_MESSAGE))
 	{
+		/* The echo is rendered identically to the copy the channel
+		 * members just received, so reuse that one (including its
+		 * serialized tags if the sender shares a cap set with some
+		 * recipient) rather than formatting our own.
+		 */
+		if (sendbufto_one_echo(client, mtags))
+			return 0;
+
 		if (sendtype != SEND_TYPE_TAGMSG)
 		{
 			sendto_prefix_one(client, client, mtags, ":%s %s %s :%s",
@@ -29,21 +29,26 @@
 /* Maximum length of a ban */
 #define MAX_LENGTH 128
 
-/* Split timeout event in <this> amount of iterations */
-#define TIMEDBAN_TIMER_ITERATION_SPLIT 4
-
-/* Call timeout event every <this> seconds.
- * NOTE: until all channels are processed it takes
- *       TIMEDBAN_TIMER_ITERATION_SPLIT * TIMEDBAN_TIMER.
- */
+/* Call timeout event every <this> seconds. */
 #define TIMEDBAN_TIMER	2
 
 /* We allow a ban to (potentially) expire slightly before the deadline.
- * For example with TIMEDBAN_TIMER_ITERATION_SPLIT=4 and TIMEDBAN_TIMER=2
- * a 1 minute ban would expire at 56-63 seconds, rather than 60-67 seconds.
+ * For example with TIMEDBAN_TIMER_DELTA=4 and TIMEDBAN_TIMER=2
+ * a 1 minute ban would expire at 56-58 seconds, rather than 60-62 seconds.
  * This is usually preferred.
  */
-#define TIMEDBAN_TIMER_DELTA ((TIMEDBAN_TIMER_ITERATION_SPLIT*TIMEDBAN_TIMER)/2)
+#define TIMEDBAN_TIMER_DELTA (TIMEDBAN_TIMER*2)
+
+/** Per-channel cache of the earliest ~t deadline. It lets the timeout
+ * event skip a channel without walking its ban lists: as long as the
+ * lists did not change (channel->acl_generation) and the earliest
+ * deadline has not been reached yet, there is nothing to do there.
+ */
+typedef struct TimedBanCache TimedBanCache;
+struct TimedBanCache {
+	unsigned int acl_generation; /**< channel->acl_generation this was computed at */
+	time_t next_expire; /**< Earliest deadline among the timed entries, 0 = none */
+};
 
 ModuleHeader MOD_HEADER
   = {
@@ -60,6 +65,9 @@ int timedban_extban_is_ok(Client *client, Channel* channel, char *para_in, int c
 int timedban_is_banned(Client *client, Channel *channel, char *ban, int chktype, char **msg, char **errmsg);
 void add_send_mode_param(Channel *channel, Client *from, char what, char mode, char *param);
 char *timedban_chanmsg(Client *, Client *, Channel *, char *, int);
+void timedban_mdata_free(ModData *m);
+
+ModDataInfo *timedban_md = NULL;
 
 EVENT(timedban_timeout);
 
@@ -71,9 +79,22 @@ MOD_TEST()
 MOD_INIT()
 {
 ExtbanInfo extban;
+ModDataInfo mreq;
 
 	MARK_AS_OFFICIAL_MODULE(modinfo);
 
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.name = "timedban";
+	mreq.free = timedban_mdata_free;
+	mreq.sync = 0;
+	mreq.type = MODDATATYPE_CHANNEL;
+	timedban_md = ModDataAdd(modinfo->handle, mreq);
+	if (!timedban_md)
+	{
+		config_error("timedban: unable to register channel moddata!!");
+		return MOD_FAILED;
+	}
+
 	memset(&extban, 0, sizeof(ExtbanInfo));
 	extban.flag = 't';
 	extban.options |= EXTBOPT_ACTMODIFIER; /* not really, but ours shouldn't be stacked from group 1 */
@@ -353,13 +374,14 @@ int timedban_is_banned(Client *client, Channel *channel, char *ban, int chktype,
 	return ban_check_mask(client, channel, ban, chktype, msg, errmsg, 0);
 }
 
-/** Helper to check if the ban has been expired */
-int timedban_has_ban_expired(Ban *ban)
+/** Get the (slightly early, see TIMEDBAN_TIMER_DELTA) deadline at
+ * which a timed ban expires, or 0 if it is not a valid ~t ban.
+ */
+time_t timedban_ban_deadline(Ban *ban)
 {
 	char *banstr = ban->banstr;
 	char *p;
 	int t;
-	time_t expire_on;
 
 	if (strncmp(banstr, "~t:", 3))
 		return 0; /* not for us */
@@ -369,66 +391,73 @@ int timedban_has_ban_expired(Ban *ban)
 	*p = '\0'; /* danger.. must restore!! */
 	t = atoi(banstr+3);
 	*p = ':'; /* restored.. */
-	
-	expire_on = ban->when + (t * 60) - TIMEDBAN_TIMER_DELTA;
-	
-	if (expire_on < TStime())
-		return 1;
-	return 0;
+
+	return ban->when + (t * 60) - TIMEDBAN_TIMER_DELTA;
+}
+
+void timedban_mdata_free(ModData *m)
+{
+	safe_free(m->ptr); /* the TimedBanCache has no members to free */
 }
 
 static char mbuf[512];
 static char pbuf[512];
 
+/** Process one ban list of a channel: remove the expired timed entries
+ * and keep track of the earliest deadline among the remaining ones.
+ */
+static void timedban_process_list(Channel *channel, Ban **list, char mode, time_t now, time_t *next)
+{
+	Ban *ban, *nextban;
+	time_t deadline;
+
+	for (ban = *list; ban; ban=nextban)
+	{
+		nextban = ban->next;
+		if (strncmp(ban->banstr, "~t:", 3))
+			continue;
+		deadline = timedban_ban_deadline(ban);
+		if (!deadline)
+			continue;
+		if (deadline < now)
+		{
+			add_send_mode_param(channel, &me, '-',  mode, ban->banstr);
+			del_listmode(list, channel, ban->banstr);
+		} else
+		if (!*next || (deadline < *next))
+		{
+			*next = deadline;
+		}
+	}
+}
+
 /** This removes any expired timedbans */
 EVENT(timedban_timeout)
 {
 	Channel *channel;
-	Ban *ban, *nextban;
-	static int current_iteration = 0;
-
-	if (++current_iteration >= TIMEDBAN_TIMER_ITERATION_SPLIT)
-		current_iteration = 0;
+	TimedBanCache *tbc;
+	time_t now = TStime();
+	time_t next;
 
 	for (channel = channels; channel; channel = channel->nextch)
 	{
-		/* This is a very quick check, at the cost of it being
-		 * biased since there's always a tendency of more channel
-		 * names to start with one specific letter. But hashing
-		 * is too costly. So we stick with this. It should be
-		 * good enough. Alternative would be some channel->id value.
+		/* If the ban lists did not change since we last looked
+		 * and the earliest deadline we saw back then has not been
+		 * reached yet, then we can skip this channel without
+		 * walking its ban lists at all - the common case.
 		 */
-		if (((unsigned int)channel->chname[1] % TIMEDBAN_TIMER_ITERATION_SPLIT) != current_iteration)
-			continue; /* not this time, maybe next */
-
-		*mbuf = *pbuf = '\0';
-		for (ban = channel->banlist; ban; ban=nextban)
-		{
-			nextban = ban->next;
-			if (!strncmp(ban->banstr, "~t:", 3) && timedban_has_ban_expired(ban))
-			{
-				add_send_mode_param(channel, &me, '-',  'b', ban->banstr);
-				del_listmode(&channel->banlist, channel, ban->banstr);
-			}
-		}
-		for (ban = channel->exlist; ban; ban=nextban)
+		tbc = moddata_channel(channel, timedban_md).ptr;
+		if (tbc && (tbc->acl_generation == channel->acl_generation) &&
+		    (!tbc->next_expire || (tbc->next_expire >= now)))
 		{
-			nextban = ban->next;
-			if (!strncmp(ban->banstr, "~t:", 3) && timedban_has_ban_expired(ban))
-			{
-				add_send_mode_param(channel, &me, '-',  'e', ban->banstr);
-				del_listmode(&channel->exlist, channel, ban->banstr);
-			}
-		}
-		for (ban = channel->invexlist; ban; ban=nextban)
-		{
-			nextban = ban->next;
-			if (!strncmp(ban->banstr, "~t:", 3) && timedban_has_ban_expired(ban))
-			{
-				add_send_mode_param(channel, &me, '-',  'I', ban->banstr);
-				del_listmode(&channel->invexlist, channel, ban->banstr);
-			}
+			continue;
 		}
+
+		next = 0;
+		*mbuf = *pbuf = '\0';
+		timedban_process_list(channel, &channel->banlist, 'b', now, &next);
+		timedban_process_list(channel, &channel->exlist, 'e', now, &next);
+		timedban_process_list(channel, &channel->invexlist, 'I', now, &next);
 		if (*pbuf)
 		{
 			MessageTag *mtags = NULL;
@@ -438,6 +467,17 @@ EVENT(timedban_timeout)
 			free_message_tags(mtags);
 			*pbuf = 0;
 		}
+
+		/* Cache what we learned. Note that del_listmode() above
+		 * bumped acl_generation, so this must be read afterwards.
+		 */
+		if (!tbc)
+		{
+			tbc = safe_alloc(sizeof(TimedBanCache));
+			moddata_channel(channel, timedban_md).ptr = tbc;
+		}
+		tbc->acl_generation = channel->acl_generation;
+		tbc->next_expire = next;
 	}
 }
 
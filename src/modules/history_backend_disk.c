@@ -0,0 +1,891 @@
+/* src/modules/history_backend_disk.c - History Backend: disk
+ * (C) Copyright 2020 Bram Matthys (Syzop) and the UnrealIRCd team
+ * License: GPLv2
+ */
+#include "unrealircd.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+ #include <sys/mman.h>
+ #include <dirent.h>
+#endif
+
+/* This is the disk type backend, for when you want (days of) history
+ * on more channels than comfortably fits in RAM. Load this module
+ * INSTEAD OF history_backend_mem (both register as backend "mem", so
+ * they are mutually exclusive).
+ *
+ * Storage model:
+ * - Channels are hashed into a fixed number of shards. Each shard owns
+ *   a series of append-only segment files in set::history-disk::directory.
+ *   Adding a line is a single append to the shard's active segment; the
+ *   segment is rotated once it exceeds HBD_SEGMENT_ROTATE_SIZE.
+ * - Per history object we keep an in-memory ring of index entries
+ *   (segment, offset, timestamp), at most max_lines deep. Expiry and
+ *   the line limit only touch this index; a segment file is deleted
+ *   when no index entry references it anymore.
+ * - Playback maps the segment read-only (page cache does the rest) and
+ *   rebuilds the message tags on the stack, so requesting the last N
+ *   lines reads exactly N records.
+ * - On boot the segment files are scanned once to rebuild the indexes,
+ *   so history survives restarts.
+ */
+
+ModuleHeader MOD_HEADER
+= {
+	"history_backend_disk",
+	"1.0",
+	"History backend: disk",
+	"UnrealIRCd Team",
+	"unrealircd-5",
+};
+
+/* Defines */
+#define OBJECTLEN	((NICKLEN > CHANNELLEN) ? NICKLEN : CHANNELLEN)
+#define HBD_HASH_TABLE_SIZE	1019
+#define HBD_NUM_SHARDS	64
+
+/** Rotate the active segment of a shard after this many bytes */
+#define HBD_SEGMENT_ROTATE_SIZE	1048576
+
+/** Segment file header: magic + version */
+#define HBD_SEGMENT_MAGIC	0x48445347
+#define HBD_SEGMENT_VERSION	100
+
+/** Per-record magic, for detecting truncated/corrupt segments */
+#define HBD_RECORD_MAGIC	0x48445243
+
+/** Maximum size of one serialized record (tags + line are well below this) */
+#define HBD_RECORD_MAX_SIZE	16384
+
+/** Maximum number of message tags we serialize per line */
+#define HBD_MAX_MTAGS	64
+
+/** Index entries for objects that never received a limit (eg the
+ * channel no longer exists after a restart) are expired after this
+ * many seconds.
+ */
+#define HBD_ORPHAN_MAX_TIME	(86400*7)
+
+/* Cleaning spread, same approach as history_backend_mem */
+#define HBD_SPREAD	16
+#define HBD_MAX_OFF_SECS	128
+#define HBD_CLEAN_PER_LOOP	(HBD_HASH_TABLE_SIZE/HBD_SPREAD)
+#define HBD_TIMER_EVERY	(HBD_MAX_OFF_SECS/HBD_SPREAD)
+
+/* Definitions (structs, etc.) */
+
+/** On-disk record header (written field by field, packed) */
+typedef struct HBDRecordHeader HBDRecordHeader;
+struct HBDRecordHeader {
+	uint32_t magic; /**< HBD_RECORD_MAGIC */
+	uint32_t size; /**< Total record size including this header */
+	uint64_t t; /**< Time of the message */
+	uint16_t objlen; /**< Length of the object name (without NUL) */
+	uint16_t nmtags; /**< Number of serialized message tags */
+};
+/* Followed by: object NUL, nmtags x (name NUL, flag byte, [value NUL]), line NUL */
+
+typedef struct HBDSegment HBDSegment;
+struct HBDSegment {
+	HBDSegment *prev, *next;
+	uint32_t id; /**< Serial number within the shard */
+	int shard; /**< Shard this segment belongs to */
+	int fd; /**< Write fd (active segment only), otherwise -1 */
+	uint32_t size; /**< Current file size */
+	int lines; /**< Number of index entries referencing this segment */
+	char *map; /**< Read-only mapping for playback (or NULL) */
+	uint32_t maplen; /**< Length of 'map' */
+};
+
+typedef struct HBDShard HBDShard;
+struct HBDShard {
+	HBDSegment *segments; /**< All live segments of this shard */
+	HBDSegment *active; /**< Segment currently being appended to */
+	uint32_t serial; /**< Next segment id to hand out */
+};
+
+typedef struct HBDIndexEntry HBDIndexEntry;
+struct HBDIndexEntry {
+	HBDSegment *seg;
+	uint32_t offset;
+	time_t t;
+};
+
+typedef struct HBDObject HBDObject;
+struct HBDObject {
+	HBDObject *prev, *next;
+	HBDIndexEntry *entries; /**< Ring buffer of index entries */
+	int capacity; /**< Allocated size of 'entries' */
+	int count; /**< Number of live entries */
+	int start; /**< Ring position of the oldest entry */
+	int max_lines; /**< Maximum number of lines permitted */
+	long max_time; /**< Maximum number of seconds to retain history */
+	char name[OBJECTLEN+1];
+};
+
+/* Global variables */
+static char siphashkey_hbd[SIPHASH_KEY_LENGTH];
+static HBDObject *hbd_hash_table[HBD_HASH_TABLE_SIZE];
+static HBDShard hbd_shards[HBD_NUM_SHARDS];
+static struct cfgstruct {
+	char *directory;
+} cfg;
+
+/* Forward declarations */
+void hbd_setcfg(void);
+void hbd_freecfg(void);
+int hbd_configtest(ConfigFile *cf, ConfigEntry *ce, int type, int *errs);
+int hbd_configrun(ConfigFile *cf, ConfigEntry *ce, int type);
+int hbd_history_add(char *object, MessageTag *mtags, char *line);
+int hbd_history_request(Client *client, char *object, HistoryFilter *filter);
+int hbd_history_destroy(char *object);
+int hbd_history_set_limit(char *object, int max_lines, long max_time);
+static void hbd_startup_scan(void);
+EVENT(history_disk_clean);
+
+MOD_TEST()
+{
+	memset(&cfg, 0, sizeof(cfg));
+	HookAdd(modinfo->handle, HOOKTYPE_CONFIGTEST, 0, hbd_configtest);
+	return MOD_SUCCESS;
+}
+
+MOD_INIT()
+{
+	HistoryBackendInfo hbi;
+
+	MARK_AS_OFFICIAL_MODULE(modinfo);
+	ModuleSetOptions(modinfo->handle, MOD_OPT_PERM, 1);
+
+	memset(&hbd_hash_table, 0, sizeof(hbd_hash_table));
+	memset(&hbd_shards, 0, sizeof(hbd_shards));
+	siphash_generate_key(siphashkey_hbd);
+
+	hbd_setcfg();
+	HookAdd(modinfo->handle, HOOKTYPE_CONFIGRUN, 0, hbd_configrun);
+
+	memset(&hbi, 0, sizeof(hbi));
+	hbi.name = "mem";
+	hbi.history_add = hbd_history_add;
+	hbi.history_request = hbd_history_request;
+	hbi.history_destroy = hbd_history_destroy;
+	hbi.history_set_limit = hbd_history_set_limit;
+	if (!HistoryBackendAdd(modinfo->handle, &hbi))
+		return MOD_FAILED;
+
+	return MOD_SUCCESS;
+}
+
+MOD_LOAD()
+{
+	hbd_startup_scan();
+	EventAdd(modinfo->handle, "history_disk_clean", history_disk_clean, NULL, HBD_TIMER_EVERY*1000, 0);
+	return MOD_SUCCESS;
+}
+
+MOD_UNLOAD()
+{
+	hbd_freecfg();
+	return MOD_SUCCESS;
+}
+
+void hbd_setcfg(void)
+{
+	// Default: data/history
+	safe_strdup(cfg.directory, "history");
+	convert_to_absolute_path(&cfg.directory, PERMDATADIR);
+}
+
+void hbd_freecfg(void)
+{
+	safe_free(cfg.directory);
+}
+
+int hbd_configtest(ConfigFile *cf, ConfigEntry *ce, int type, int *errs)
+{
+	int errors = 0;
+	ConfigEntry *cep;
+
+	// We are only interested in set::history-disk::directory
+	if (type != CONFIG_SET)
+		return 0;
+
+	if (!ce || strcmp(ce->ce_varname, "history-disk"))
+		return 0;
+
+	for (cep = ce->ce_entries; cep; cep = cep->ce_next)
+	{
+		if (!cep->ce_vardata) {
+			config_error("%s:%i: blank set::history-disk::%s without value", cep->ce_fileptr->cf_filename, cep->ce_varlinenum, cep->ce_varname);
+			errors++;
+			continue;
+		}
+		if (!strcmp(cep->ce_varname, "directory")) {
+			convert_to_absolute_path(&cep->ce_vardata, PERMDATADIR);
+			continue;
+		}
+		config_error("%s:%i: unknown directive set::history-disk::%s", cep->ce_fileptr->cf_filename, cep->ce_varlinenum, cep->ce_varname);
+		errors++;
+	}
+
+	*errs = errors;
+	return errors ? -1 : 1;
+}
+
+int hbd_configrun(ConfigFile *cf, ConfigEntry *ce, int type)
+{
+	ConfigEntry *cep;
+
+	// We are only interested in set::history-disk::directory
+	if (type != CONFIG_SET)
+		return 0;
+
+	if (!ce || strcmp(ce->ce_varname, "history-disk"))
+		return 0;
+
+	for (cep = ce->ce_entries; cep; cep = cep->ce_next)
+	{
+		if (!strcmp(cep->ce_varname, "directory"))
+			safe_strdup(cfg.directory, cep->ce_vardata);
+	}
+	return 1;
+}
+
+uint64_t hbd_hash(char *object)
+{
+	return siphash_nocase(object, siphashkey_hbd);
+}
+
+HBDObject *hbd_find_object(char *object)
+{
+	int hashv = hbd_hash(object) % HBD_HASH_TABLE_SIZE;
+	HBDObject *h;
+
+	for (h = hbd_hash_table[hashv]; h; h = h->next)
+	{
+		if (!strcasecmp(object, h->name))
+			return h;
+	}
+	return NULL;
+}
+
+HBDObject *hbd_find_or_add_object(char *object)
+{
+	int hashv = hbd_hash(object) % HBD_HASH_TABLE_SIZE;
+	HBDObject *h;
+
+	for (h = hbd_hash_table[hashv]; h; h = h->next)
+	{
+		if (!strcasecmp(object, h->name))
+			return h;
+	}
+	/* Create new one */
+	h = safe_alloc(sizeof(HBDObject));
+	strlcpy(h->name, object, sizeof(h->name));
+	AddListItem(h, hbd_hash_table[hashv]);
+	return h;
+}
+
+static void hbd_segment_filename(char *buf, size_t buflen, int shard, uint32_t id)
+{
+	snprintf(buf, buflen, "%s/%02d-%010u.db", cfg.directory, shard, id);
+}
+
+static void hbd_segment_unmap(HBDSegment *seg)
+{
+	if (!seg->map)
+		return;
+#ifndef _WIN32
+	munmap(seg->map, seg->maplen);
+#else
+	safe_free(seg->map);
+#endif
+	seg->map = NULL;
+	seg->maplen = 0;
+}
+
+/** Free a segment (and delete the file) once nothing references it */
+static void hbd_segment_try_free(HBDSegment *seg)
+{
+	char fname[512];
+
+	if ((seg->lines > 0) || (hbd_shards[seg->shard].active == seg))
+		return;
+	hbd_segment_unmap(seg);
+	if (seg->fd >= 0)
+		close(seg->fd);
+	hbd_segment_filename(fname, sizeof(fname), seg->shard, seg->id);
+	unlink(fname);
+	DelListItem(seg, hbd_shards[seg->shard].segments);
+	safe_free(seg);
+}
+
+/** Drop one index reference to a segment */
+static void hbd_segment_release(HBDSegment *seg)
+{
+	seg->lines--;
+	hbd_segment_try_free(seg);
+}
+
+/** Get (creating if needed) the active segment of a shard for appending */
+static HBDSegment *hbd_active_segment(int shard)
+{
+	HBDShard *sh = &hbd_shards[shard];
+	HBDSegment *seg;
+	char fname[512];
+	uint32_t hdr[2];
+	int fd;
+
+	if (sh->active)
+		return sh->active;
+
+	hbd_segment_filename(fname, sizeof(fname), shard, sh->serial);
+	fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd < 0)
+	{
+		sendto_realops_and_log("[history] Error creating segment file '%s': %s (HISTORY NOT SAVED)",
+			fname, strerror(errno));
+		return NULL;
+	}
+	hdr[0] = HBD_SEGMENT_MAGIC;
+	hdr[1] = HBD_SEGMENT_VERSION;
+	if (write(fd, hdr, sizeof(hdr)) != sizeof(hdr))
+	{
+		sendto_realops_and_log("[history] Error writing to segment file '%s': %s (HISTORY NOT SAVED)",
+			fname, strerror(errno));
+		close(fd);
+		unlink(fname);
+		return NULL;
+	}
+
+	seg = safe_alloc(sizeof(HBDSegment));
+	seg->id = sh->serial++;
+	seg->shard = shard;
+	seg->fd = fd;
+	seg->size = sizeof(hdr);
+	AddListItem(seg, sh->segments);
+	sh->active = seg;
+	return seg;
+}
+
+/** Rotate the active segment of a shard (close it for writing) */
+static void hbd_rotate_segment(int shard)
+{
+	HBDShard *sh = &hbd_shards[shard];
+	HBDSegment *seg = sh->active;
+
+	if (!seg)
+		return;
+	close(seg->fd);
+	seg->fd = -1;
+	sh->active = NULL;
+	hbd_segment_try_free(seg); /* in case nothing ever referenced it */
+}
+
+/** Make sure 'seg' is mapped at least up to offset 'needed' (for reading) */
+static char *hbd_segment_mapped(HBDSegment *seg, uint32_t needed)
+{
+	char fname[512];
+	int fd;
+
+	if (seg->map && (seg->maplen >= needed))
+		return seg->map;
+	hbd_segment_unmap(seg);
+
+	hbd_segment_filename(fname, sizeof(fname), seg->shard, seg->id);
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+#ifndef _WIN32
+	seg->map = mmap(NULL, seg->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (seg->map == MAP_FAILED)
+		seg->map = NULL;
+#else
+	/* No mmap on Windows: read the segment into memory instead */
+	seg->map = safe_alloc(seg->size);
+	if (read(fd, seg->map, seg->size) != seg->size)
+		safe_free(seg->map);
+#endif
+	close(fd);
+	if (seg->map)
+		seg->maplen = seg->size;
+	return seg->map;
+}
+
+/** Append an index entry to the object's ring, overwriting the oldest
+ * entry when the object is at its line limit.
+ */
+static void hbd_index_push(HBDObject *h, HBDSegment *seg, uint32_t offset, time_t t)
+{
+	HBDIndexEntry *e;
+
+	if (h->count == h->capacity)
+	{
+		if ((h->max_lines > 0) && (h->capacity >= h->max_lines))
+		{
+			/* Full: recycle the oldest slot */
+			e = &h->entries[h->start];
+			hbd_segment_release(e->seg);
+			e->seg = seg;
+			e->offset = offset;
+			e->t = t;
+			h->start = (h->start + 1) % h->capacity;
+			seg->lines++;
+			return;
+		}
+		else
+		{
+			/* Grow (linearizing the ring) */
+			int newcap = h->capacity ? h->capacity * 2 : 8;
+			HBDIndexEntry *newentries = safe_alloc(newcap * sizeof(HBDIndexEntry));
+			int i;
+
+			for (i = 0; i < h->count; i++)
+				newentries[i] = h->entries[(h->start + i) % (h->capacity ? h->capacity : 1)];
+			safe_free(h->entries);
+			h->entries = newentries;
+			h->capacity = newcap;
+			h->start = 0;
+		}
+	}
+	e = &h->entries[(h->start + h->count) % h->capacity];
+	e->seg = seg;
+	e->offset = offset;
+	e->t = t;
+	h->count++;
+	seg->lines++;
+}
+
+/** Drop the oldest index entry of an object */
+static void hbd_index_drop_oldest(HBDObject *h)
+{
+	if (h->count <= 0)
+		return;
+	hbd_segment_release(h->entries[h->start].seg);
+	h->start = (h->start + 1) % h->capacity;
+	h->count--;
+	if (h->count == 0)
+		h->start = 0;
+}
+
+/** Serialize object + message tags + line into 'buf'.
+ * Ensures a "time" message tag is present, since that drives expiry.
+ * @returns The record size, or 0 if it does not fit.
+ */
+static uint32_t hbd_serialize_record(char *buf, uint32_t buflen, char *object, MessageTag *mtags, char *line, time_t *t)
+{
+	HBDRecordHeader hdr;
+	MessageTag *m, *time_mtag;
+	char timebuf[64];
+	char *generated_time = NULL;
+	char *p = buf + sizeof(HBDRecordHeader);
+	char *end = buf + buflen;
+	uint32_t nmtags = 0;
+	size_t len;
+
+	time_mtag = find_mtag(mtags, "time");
+	if (!time_mtag)
+	{
+		struct timeval tv;
+		struct tm *tm;
+		time_t sec;
+
+		gettimeofday(&tv, NULL);
+		sec = tv.tv_sec;
+		tm = gmtime(&sec);
+		snprintf(timebuf, sizeof(timebuf), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ",
+			tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
+			tm->tm_hour, tm->tm_min, tm->tm_sec,
+			(int)(tv.tv_usec / 1000));
+		generated_time = timebuf;
+	}
+
+	/* Object name */
+	len = strlen(object);
+	if (p + len + 1 >= end)
+		return 0;
+	strcpy(p, object);
+	p += len + 1;
+
+	/* Message tags */
+	for (m = mtags; m; m = m->next)
+	{
+		if (nmtags >= HBD_MAX_MTAGS)
+			break;
+		len = strlen(m->name) + 1 + 1 + (m->value ? strlen(m->value) + 1 : 0);
+		if (p + len >= end)
+			return 0;
+		strcpy(p, m->name);
+		p += strlen(p) + 1;
+		if (m->value)
+		{
+			*p++ = 1;
+			strcpy(p, m->value);
+			p += strlen(p) + 1;
+		} else {
+			*p++ = 0;
+		}
+		nmtags++;
+	}
+	if (generated_time && (nmtags < HBD_MAX_MTAGS))
+	{
+		len = 5 + 1 + strlen(generated_time) + 1;
+		if (p + len >= end)
+			return 0;
+		strcpy(p, "time");
+		p += 5;
+		*p++ = 1;
+		strcpy(p, generated_time);
+		p += strlen(p) + 1;
+		nmtags++;
+	}
+
+	/* The line */
+	len = strlen(line);
+	if (p + len + 1 >= end)
+		return 0;
+	strcpy(p, line);
+	p += len + 1;
+
+	*t = server_time_to_unix_time(time_mtag ? time_mtag->value : generated_time);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = HBD_RECORD_MAGIC;
+	hdr.size = p - buf;
+	hdr.t = *t;
+	hdr.objlen = strlen(object);
+	hdr.nmtags = nmtags;
+	memcpy(buf, &hdr, sizeof(hdr));
+	return hdr.size;
+}
+
+/** Add history entry */
+int hbd_history_add(char *object, MessageTag *mtags, char *line)
+{
+	HBDObject *h = hbd_find_or_add_object(object);
+	int shard = hbd_hash(object) % HBD_NUM_SHARDS;
+	HBDSegment *seg;
+	char buf[HBD_RECORD_MAX_SIZE];
+	uint32_t size, offset;
+	time_t t = 0;
+
+	if (!h->max_lines)
+	{
+		sendto_realops("hbd_history_add() for '%s', which has no limit", h->name);
+#ifdef DEBUGMODE
+		abort();
+#else
+		h->max_lines = 50;
+		h->max_time = 86400;
+#endif
+	}
+
+	size = hbd_serialize_record(buf, sizeof(buf), object, mtags, line, &t);
+	if (!size)
+		return 0; /* does not fit - can't happen with real IRC lines */
+
+	seg = hbd_active_segment(shard);
+	if (!seg)
+		return 0;
+
+	offset = seg->size;
+	if (write(seg->fd, buf, size) != (ssize_t)size)
+	{
+		sendto_realops_and_log("[history] Error writing to segment file (shard %d): %s (HISTORY NOT SAVED)",
+			shard, strerror(errno));
+		/* Roll back to a consistent file so the scan never sees a partial record */
+		if (ftruncate(seg->fd, offset) == 0)
+			lseek(seg->fd, offset, SEEK_SET);
+		return 0;
+	}
+	seg->size += size;
+
+	while (h->count >= h->max_lines)
+		hbd_index_drop_oldest(h);
+	hbd_index_push(h, seg, offset, t);
+
+	if (seg->size >= HBD_SEGMENT_ROTATE_SIZE)
+		hbd_rotate_segment(shard);
+
+	return 0;
+}
+
+static int hbd_can_receive_history(Client *client)
+{
+	if (HasCapability(client, "server-time"))
+		return 1;
+	return 0;
+}
+
+/** Send one stored record to the client, message tags rebuilt on the
+ * stack pointing straight into the segment mapping.
+ */
+static void hbd_send_record(Client *client, HBDIndexEntry *e, char *batchid)
+{
+	HBDRecordHeader hdr;
+	MessageTag tags[HBD_MAX_MTAGS], batch_mtag;
+	MessageTag *first = NULL, *prev = NULL;
+	char *map, *p;
+	uint32_t i;
+
+	map = hbd_segment_mapped(e->seg, e->offset + sizeof(HBDRecordHeader));
+	if (!map)
+		return;
+	memcpy(&hdr, map + e->offset, sizeof(hdr));
+	if ((hdr.magic != HBD_RECORD_MAGIC) ||
+	    (hdr.size < sizeof(hdr)) ||
+	    (e->offset + hdr.size > e->seg->maplen) ||
+	    (hdr.nmtags > HBD_MAX_MTAGS))
+		return; /* corrupt - skip */
+
+	p = map + e->offset + sizeof(HBDRecordHeader);
+	p += hdr.objlen + 1; /* skip the object name */
+
+	memset(&tags, 0, sizeof(MessageTag) * (hdr.nmtags ? hdr.nmtags : 1));
+	for (i = 0; i < hdr.nmtags; i++)
+	{
+		tags[i].name = p;
+		p += strlen(p) + 1;
+		if (*p++ == 1)
+		{
+			tags[i].value = p;
+			p += strlen(p) + 1;
+		}
+		if (prev)
+			prev->next = &tags[i];
+		else
+			first = &tags[i];
+		tags[i].prev = prev;
+		prev = &tags[i];
+	}
+	/* 'p' now points at the line itself */
+
+	if (!BadPtr(batchid))
+	{
+		memset(&batch_mtag, 0, sizeof(batch_mtag));
+		batch_mtag.name = "batch";
+		batch_mtag.value = batchid;
+		batch_mtag.next = first;
+		if (first)
+			first->prev = &batch_mtag;
+		first = &batch_mtag;
+	}
+	sendto_one(client, first, "%s", p);
+}
+
+int hbd_history_request(Client *client, char *object, HistoryFilter *filter)
+{
+	HBDObject *h = hbd_find_object(object);
+	char batch[BATCHLEN+1];
+	long redline; /* Imaginary timestamp. Before the red line, history is too old. */
+	int lines_sendable = 0, lines_to_skip = 0, cnt = 0;
+	int i;
+
+	if (!h || !hbd_can_receive_history(client))
+		return 0;
+
+	batch[0] = '\0';
+
+	if (HasCapability(client, "batch"))
+	{
+		/* Start a new batch */
+		generate_batch_id(batch);
+		sendto_one(client, NULL, ":%s BATCH +%s chathistory %s", me.name, batch, object);
+	}
+
+	/* Decide on red line, under this the history is too old.
+	 * Filter can be more strict than history object (but not the other way around):
+	 */
+	if (filter && filter->last_seconds && (filter->last_seconds < h->max_time))
+		redline = TStime() - filter->last_seconds;
+	else
+		redline = TStime() - h->max_time;
+
+	/* The first pass runs entirely on the in-memory index: no disk
+	 * access happens until we know which lines will actually be sent.
+	 */
+	for (i = 0; i < h->count; i++)
+		if (h->entries[(h->start + i) % h->capacity].t >= redline)
+			lines_sendable++;
+	if (filter && (lines_sendable > filter->last_lines))
+		lines_to_skip = lines_sendable - filter->last_lines;
+
+	for (i = 0; i < h->count; i++)
+	{
+		HBDIndexEntry *e = &h->entries[(h->start + i) % h->capacity];
+		if (e->t >= redline && (++cnt > lines_to_skip))
+			hbd_send_record(client, e, batch);
+	}
+
+	/* End of batch */
+	if (*batch)
+		sendto_one(client, NULL, ":%s BATCH -%s", me.name, batch);
+	return 1;
+}
+
+/** Expire entries of one object (time and line limits) */
+static void hbd_object_cleanup(HBDObject *h)
+{
+	long max_time = h->max_time;
+	long redline;
+
+	/* Objects that never received a limit (stale leftovers from a
+	 * previous run) eventually expire too.
+	 */
+	if (!h->max_lines && !max_time)
+		max_time = HBD_ORPHAN_MAX_TIME;
+
+	if (max_time)
+	{
+		redline = TStime() - max_time;
+		while (h->count && (h->entries[h->start].t < redline))
+			hbd_index_drop_oldest(h);
+	}
+	if (h->max_lines)
+		while (h->count > h->max_lines)
+			hbd_index_drop_oldest(h);
+}
+
+int hbd_history_destroy(char *object)
+{
+	HBDObject *h = hbd_find_object(object);
+	int hashv;
+
+	if (!h)
+		return 0;
+
+	while (h->count)
+		hbd_index_drop_oldest(h);
+	hashv = hbd_hash(h->name) % HBD_HASH_TABLE_SIZE;
+	DelListItem(h, hbd_hash_table[hashv]);
+	safe_free(h->entries);
+	safe_free(h);
+	return 1;
+}
+
+/** Set new limit on history object */
+int hbd_history_set_limit(char *object, int max_lines, long max_time)
+{
+	HBDObject *h = hbd_find_or_add_object(object);
+	h->max_lines = max_lines;
+	h->max_time = max_time;
+	hbd_object_cleanup(h); /* impose new restrictions */
+	return 1;
+}
+
+/** Scan the storage directory on boot and rebuild the in-memory
+ * indexes from the segment files, so history survives restarts.
+ */
+static void hbd_startup_scan(void)
+{
+#ifndef _WIN32
+	DIR *dir;
+	struct dirent *de;
+	int shard;
+	uint32_t id;
+	HBDSegment *seg, *best;
+	char fname[512];
+	struct stat st;
+
+	/* Create the directory if it does not exist yet */
+	(void)mkdir(cfg.directory, S_IRUSR|S_IWUSR|S_IXUSR);
+
+	dir = opendir(cfg.directory);
+	if (!dir)
+	{
+		config_warn("[history] Could not open history directory '%s': %s",
+			cfg.directory, strerror(errno));
+		return;
+	}
+	while ((de = readdir(dir)))
+	{
+		if (sscanf(de->d_name, "%d-%u.db", &shard, &id) != 2)
+			continue;
+		if ((shard < 0) || (shard >= HBD_NUM_SHARDS))
+			continue;
+		hbd_segment_filename(fname, sizeof(fname), shard, id);
+		if (stat(fname, &st) < 0)
+			continue;
+		seg = safe_alloc(sizeof(HBDSegment));
+		seg->id = id;
+		seg->shard = shard;
+		seg->fd = -1;
+		seg->size = st.st_size;
+		AddListItem(seg, hbd_shards[shard].segments);
+		if (id >= hbd_shards[shard].serial)
+			hbd_shards[shard].serial = id + 1;
+	}
+	closedir(dir);
+
+	/* Replay each shard's segments in id order so the index entries of
+	 * every object end up oldest-first.
+	 */
+	for (shard = 0; shard < HBD_NUM_SHARDS; shard++)
+	{
+		for (;;)
+		{
+			char *map;
+			uint32_t offset;
+
+			/* Pick the unscanned segment with the lowest id */
+			best = NULL;
+			for (seg = hbd_shards[shard].segments; seg; seg = seg->next)
+				if (!seg->maplen && (!best || (seg->id < best->id)))
+					best = seg;
+			if (!best)
+				break;
+
+			map = hbd_segment_mapped(best, best->size);
+			if (!map || (best->size < 8) ||
+			    (((uint32_t *)map)[0] != HBD_SEGMENT_MAGIC) ||
+			    (((uint32_t *)map)[1] > HBD_SEGMENT_VERSION))
+			{
+				if (!map)
+					best->maplen = 1; /* mark as scanned */
+				hbd_segment_try_free(best);
+				continue;
+			}
+			offset = 8;
+			while (offset + sizeof(HBDRecordHeader) <= best->size)
+			{
+				HBDRecordHeader hdr;
+				memcpy(&hdr, map + offset, sizeof(hdr));
+				if ((hdr.magic != HBD_RECORD_MAGIC) ||
+				    (hdr.size < sizeof(hdr) + hdr.objlen + 2) ||
+				    (offset + hdr.size > best->size))
+				{
+					config_warn("[history] Truncated or corrupt segment '%02d-%010u.db', "
+						"ignoring the remainder", shard, best->id);
+					break;
+				}
+				hbd_index_push(hbd_find_or_add_object(map + offset + sizeof(HBDRecordHeader)),
+					best, offset, (time_t)hdr.t);
+				offset += hdr.size;
+			}
+			hbd_segment_try_free(best); /* in case it was empty */
+		}
+	}
+#endif
+}
+
+/** Periodically expire history, a couple of hash buckets per call,
+ * same spreading approach as the memory backend.
+ */
+EVENT(history_disk_clean)
+{
+	static int hashnum = 0;
+	int loopcnt = 0;
+	HBDObject *h;
+
+	do
+	{
+		for (h = hbd_hash_table[hashnum]; h; h = h->next)
+			hbd_object_cleanup(h);
+
+		hashnum++;
+
+		if (hashnum >= HBD_HASH_TABLE_SIZE)
+			hashnum = 0;
+	} while(loopcnt++ < HBD_CLEAN_PER_LOOP);
+}
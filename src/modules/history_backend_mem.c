@@ -9,12 +9,20 @@
  * and "oldest record", so frequent cleaning operations such as
  * "delete any record older than time T" or "keep only N lines"
  * are executed as fast as possible.
+ *
+ * Storage: each history object owns a circular arena of contiguous
+ * variable-length records rather than a linked list of individually
+ * allocated lines. Adding a line is a bump-write at the tail, expiry
+ * just advances the head offset, and playback is a linear scan over
+ * memory that the prefetcher likes. Message tags are serialized into
+ * the record and reconstructed on the stack during playback, so a
+ * stored line costs exactly one region of one allocation.
  */
 
 ModuleHeader MOD_HEADER
 = {
 	"history_backend_mem",
-	"2.0",
+	"2.1",
 	"History backend: memory",
 	"UnrealIRCd Team",
 	"unrealircd-5",
@@ -24,46 +32,100 @@ ModuleHeader MOD_HEADER
 #define OBJECTLEN	((NICKLEN > CHANNELLEN) ? NICKLEN : CHANNELLEN)
 #define HISTORY_BACKEND_MEM_HASH_TABLE_SIZE 1019
 
-/* The regular history cleaning (by timer) is spread out
- * a bit, rather than doing ALL channels every T time.
- * HISTORY_SPREAD: how much to spread the "cleaning", eg 1 would be
- *  to clean everything in 1 go, 2 would mean the first event would
- *  clean half of the channels, and the 2nd event would clean the rest.
- *  Obviously more = better to spread the load, but doing a reasonable
- *  amount of work is also benefitial for performance (think: CPU cache).
- * HISTORY_MAX_OFF_SECS: how many seconds may the history be 'off',
- *  that is: how much may we store the history longer than required.
- * The other 2 macros are calculated based on that target.
+/* The regular history cleaning (by timer) only has to look at objects
+ * that can actually have something to expire: every object with
+ * history sits in a min-heap keyed on the moment its oldest record
+ * expires (oldest_t + max_time), so each timer tick pops the (usually
+ * few) objects that are due instead of scanning every history-carrying
+ * channel.
+ * HISTORY_TIMER_EVERY: how often the expiry timer runs; this is also
+ *  how many seconds the history may be 'off', that is: how much we may
+ *  store the history longer than required.
  */
-#define HISTORY_SPREAD	16
-#define HISTORY_MAX_OFF_SECS	128
-#define HISTORY_CLEAN_PER_LOOP	(HISTORY_BACKEND_MEM_HASH_TABLE_SIZE/HISTORY_SPREAD)
-#define HISTORY_TIMER_EVERY	(HISTORY_MAX_OFF_SECS/HISTORY_SPREAD)
+#define HISTORY_TIMER_EVERY	8
+
+/** Initial arena size for a history object (doubles on demand) */
+#define HBM_ARENA_INITIAL_SIZE	4096
+
+/** Maximum number of message tags we serialize per line. Playback
+ * rebuilds the tags in a stack array of this size; real lines carry
+ * nowhere near this many tags.
+ */
+#define HBM_MAX_MTAGS	64
+
+/** Round record sizes up so every record starts at an aligned offset */
+#define HBM_ALIGN(x)	(((x) + 7) & ~7UL)
 
 /* Definitions (structs, etc.) */
-typedef struct HistoryLogLine HistoryLogLine;
-struct HistoryLogLine {
-	HistoryLogLine *prev, *next;
-	time_t t;
-	MessageTag *mtags;
-	char line[1];
+
+/** One line in the arena. Directly followed by 'nmtags' serialized
+ * message tags (name NUL, flag byte 0=no value / 1=value follows,
+ * value NUL) and then the NUL-terminated line itself.
+ * A record with size 0 is a wrap marker: iteration continues at
+ * offset 0 of the arena.
+ */
+typedef struct HistoryRecord HistoryRecord;
+struct HistoryRecord {
+	uint32_t size; /**< Total record size in bytes (aligned), 0 = wrap marker */
+	uint32_t nmtags; /**< Number of serialized message tags */
+	time_t t; /**< Time of the message (from the 'time' message tag) */
+	char data[1]; /**< Serialized message tags followed by the line */
+};
+
+#define HBM_RECORD_HEADER_SIZE	offsetof(HistoryRecord, data)
+
+/** Number of capability-variants of a rendered playback we remember
+ * per history object. As with the fanout cache in send.c, only a
+ * handful of cap combinations exist among clients in practice.
+ */
+#define HBM_PLAYBACK_VARIANTS	4
+
+/** One cached, fully rendered playback: the batch start/end lines plus
+ * every history line serialized for one capability combination, kept
+ * in a refcounted buffer that is linked into each matching recipient's
+ * sendq by reference. Replaying history to the Nth member rejoining
+ * after a netjoin is then a cache lookup instead of re-serializing the
+ * whole backlog per recipient.
+ */
+typedef struct HbmPlayback HbmPlayback;
+struct HbmPlayback {
+	long caps; /**< Capability bitmask this variant was rendered for */
+	long redline; /**< Cut-off timestamp used during rendering */
+	int last_lines; /**< filter->last_lines used during rendering */
+	dbufshared *buf; /**< The rendered bytes (NULL = slot empty) */
 };
 
 typedef struct HistoryLogObject HistoryLogObject;
 struct HistoryLogObject {
 	HistoryLogObject *prev, *next;
-	HistoryLogLine *head; /**< Start of the log (the earliest entry) */
-	HistoryLogLine *tail; /**< End of the log (the latest entry) */
+	char *arena; /**< Circular record arena */
+	uint32_t arena_size; /**< Size of the arena in bytes */
+	uint32_t head; /**< Offset of the oldest record */
+	uint32_t tail; /**< Offset where the next record will be written */
 	int num_lines; /**< Number of lines of log */
-	time_t oldest_t; /**< Oldest time in log */
+	time_t oldest_t; /**< Time of the oldest (head) record */
 	int max_lines; /**< Maximum number of lines permitted */
 	long max_time; /**< Maximum number of seconds to retain history */
+	int heap_pos; /**< Position in the expiry heap, or -1 if not queued */
+	time_t deadline; /**< When the oldest record expires (heap key) */
+	HbmPlayback playback[HBM_PLAYBACK_VARIANTS]; /**< Cached rendered playbacks */
+	int playback_rr; /**< Round-robin eviction index into playback[] */
 	char name[OBJECTLEN+1];
 };
 
+/** Iterator over the records of a history object, oldest first */
+typedef struct HistoryIterator HistoryIterator;
+struct HistoryIterator {
+	uint32_t offset;
+	int remaining;
+};
+
 /* Global variables */
 static char siphashkey_history_backend_mem[SIPHASH_KEY_LENGTH];
 HistoryLogObject *history_hash_table[HISTORY_BACKEND_MEM_HASH_TABLE_SIZE];
+static HistoryLogObject **expiry_heap = NULL;
+static int expiry_heap_count = 0;
+static int expiry_heap_capacity = 0;
 
 /* Forward declarations */
 int hbm_history_add(char *object, MessageTag *mtags, char *line);
@@ -71,6 +133,7 @@ int hbm_history_cleanup(HistoryLogObject *h);
 int hbm_history_request(Client *client, char *object, HistoryFilter *filter);
 int hbm_history_destroy(char *object);
 int hbm_history_set_limit(char *object, int max_lines, long max_time);
+void hbm_count_memory(long long *objects, long long *bytes);
 EVENT(history_mem_clean);
 
 MOD_INIT()
@@ -92,6 +155,8 @@ MOD_INIT()
 	if (!HistoryBackendAdd(modinfo->handle, &hbi))
 		return MOD_FAILED;
 
+	MemoryCounterAdd(modinfo->handle, "history", hbm_count_memory);
+
 	return MOD_SUCCESS;
 }
 
@@ -111,6 +176,117 @@ uint64_t hbm_hash(char *object)
 	return siphash_nocase(object, siphashkey_history_backend_mem) % HISTORY_BACKEND_MEM_HASH_TABLE_SIZE;
 }
 
+/* The expiry heap: a standard binary min-heap on 'deadline', with each
+ * object tracking its own position so removal and re-keying are cheap.
+ */
+
+static void hbm_heap_set(int i, HistoryLogObject *h)
+{
+	expiry_heap[i] = h;
+	h->heap_pos = i;
+}
+
+static void hbm_heap_up(int i)
+{
+	while (i > 0)
+	{
+		int parent = (i - 1) / 2;
+		HistoryLogObject *h;
+
+		if (expiry_heap[parent]->deadline <= expiry_heap[i]->deadline)
+			break;
+		h = expiry_heap[parent];
+		hbm_heap_set(parent, expiry_heap[i]);
+		hbm_heap_set(i, h);
+		i = parent;
+	}
+}
+
+static void hbm_heap_down(int i)
+{
+	for (;;)
+	{
+		int left = i * 2 + 1, right = i * 2 + 2, smallest = i;
+		HistoryLogObject *h;
+
+		if ((left < expiry_heap_count) && (expiry_heap[left]->deadline < expiry_heap[smallest]->deadline))
+			smallest = left;
+		if ((right < expiry_heap_count) && (expiry_heap[right]->deadline < expiry_heap[smallest]->deadline))
+			smallest = right;
+		if (smallest == i)
+			break;
+		h = expiry_heap[smallest];
+		hbm_heap_set(smallest, expiry_heap[i]);
+		hbm_heap_set(i, h);
+		i = smallest;
+	}
+}
+
+static void hbm_heap_remove(HistoryLogObject *h)
+{
+	int i = h->heap_pos;
+
+	if (i < 0)
+		return;
+	h->heap_pos = -1;
+	expiry_heap_count--;
+	if (i == expiry_heap_count)
+		return;
+	hbm_heap_set(i, expiry_heap[expiry_heap_count]);
+	hbm_heap_down(i);
+	hbm_heap_up(i);
+}
+
+static void hbm_heap_update(HistoryLogObject *h, time_t deadline)
+{
+	h->deadline = deadline;
+	if (h->heap_pos < 0)
+	{
+		if (expiry_heap_count == expiry_heap_capacity)
+		{
+			int newcap = expiry_heap_capacity ? expiry_heap_capacity * 2 : 64;
+			HistoryLogObject **newheap = safe_alloc(newcap * sizeof(HistoryLogObject *));
+
+			if (expiry_heap_count)
+				memcpy(newheap, expiry_heap, expiry_heap_count * sizeof(HistoryLogObject *));
+			safe_free(expiry_heap);
+			expiry_heap = newheap;
+			expiry_heap_capacity = newcap;
+		}
+		hbm_heap_set(expiry_heap_count++, h);
+		hbm_heap_up(h->heap_pos);
+	} else {
+		hbm_heap_up(h->heap_pos);
+		hbm_heap_down(h->heap_pos);
+	}
+}
+
+/** (Re)queue the object in the expiry heap based on its current state */
+static void hbm_schedule_expiry(HistoryLogObject *h)
+{
+	if ((h->num_lines == 0) || !h->max_time)
+		hbm_heap_remove(h);
+	else
+		hbm_heap_update(h, h->oldest_t + h->max_time);
+}
+
+/** Throw away all cached rendered playbacks of an object. Must be
+ * called whenever the record set changes (add, expiry, limit change).
+ */
+static void hbm_playback_invalidate(HistoryLogObject *h)
+{
+	int i;
+
+	for (i = 0; i < HBM_PLAYBACK_VARIANTS; i++)
+	{
+		if (h->playback[i].buf)
+		{
+			dbuf_shared_release(h->playback[i].buf);
+			h->playback[i].buf = NULL;
+		}
+	}
+}
+
 HistoryLogObject *hbm_find_object(char *object)
 {
 	int hashv = hbm_hash(object);
@@ -137,6 +313,7 @@ HistoryLogObject *hbm_find_or_add_object(char *object)
 	/* Create new one */
 	h = safe_alloc(sizeof(HistoryLogObject));
 	strlcpy(h->name, object, sizeof(h->name));
+	h->heap_pos = -1;
 	AddListItem(h, history_hash_table[hashv]);
 	return h;
 }
@@ -145,22 +322,153 @@ void hbm_delete_object_hlo(HistoryLogObject *h)
 {
 	int hashv = hbm_hash(h->name);
 
+	hbm_heap_remove(h);
+	hbm_playback_invalidate(h);
 	DelListItem(h, history_hash_table[hashv]);
+	safe_free(h->arena);
 	safe_free(h);
 }
 
-void hbm_duplicate_mtags(HistoryLogLine *l, MessageTag *m)
+/** Normalize an arena offset: wrap at the end of the arena and skip
+ * over wrap markers, so the offset points at a real record.
+ */
+static uint32_t hbm_normalize_offset(HistoryLogObject *h, uint32_t offset)
 {
-	MessageTag *n;
+	HistoryRecord *rec;
+
+	if (h->arena_size - offset < HBM_RECORD_HEADER_SIZE)
+		return 0; /* implicit wrap: no room for even a header */
+	rec = (HistoryRecord *)(h->arena + offset);
+	if (rec->size == 0)
+		return 0; /* explicit wrap marker */
+	return offset;
+}
 
-	/* Duplicate all message tags */
-	for (; m; m = m->next)
+static void hbm_iterator_init(HistoryLogObject *h, HistoryIterator *iter)
+{
+	iter->offset = h->head;
+	iter->remaining = h->num_lines;
+}
+
+static HistoryRecord *hbm_iterator_next(HistoryLogObject *h, HistoryIterator *iter)
+{
+	HistoryRecord *rec;
+
+	if (iter->remaining <= 0)
+		return NULL;
+	iter->offset = hbm_normalize_offset(h, iter->offset);
+	rec = (HistoryRecord *)(h->arena + iter->offset);
+	iter->offset += rec->size;
+	iter->remaining--;
+	return rec;
+}
+
+/** Remove the oldest record from the arena (pointer arithmetic only) */
+static void hbm_drop_oldest(HistoryLogObject *h)
+{
+	HistoryRecord *rec;
+
+	if (h->num_lines <= 0)
+		return;
+	h->head = hbm_normalize_offset(h, h->head);
+	rec = (HistoryRecord *)(h->arena + h->head);
+	h->head += rec->size;
+	h->num_lines--;
+	if (h->num_lines == 0)
+	{
+		h->head = h->tail = 0;
+		h->oldest_t = 0;
+	} else {
+		/* Keep oldest_t current: it is the head record's time */
+		h->head = hbm_normalize_offset(h, h->head);
+		h->oldest_t = ((HistoryRecord *)(h->arena + h->head))->t;
+	}
+}
+
+/** Grow the arena so a record of 'needed' bytes is guaranteed to fit,
+ * linearizing the existing records into the new buffer.
+ */
+static void hbm_arena_grow(HistoryLogObject *h, uint32_t needed)
+{
+	uint32_t newsize = h->arena_size ? h->arena_size * 2 : HBM_ARENA_INITIAL_SIZE;
+	char *newarena;
+	uint32_t used = 0;
+	HistoryIterator iter;
+	HistoryRecord *rec;
+
+	/* '+ 8' for breathing room: some placements need a strict fit */
+	while (newsize < needed + 8)
+		newsize *= 2;
+
+	newarena = safe_alloc(newsize);
+	hbm_iterator_init(h, &iter);
+	while ((rec = hbm_iterator_next(h, &iter)))
 	{
-		n = duplicate_mtag(m);
-		AppendListItem(n, l->mtags);
+		memcpy(newarena + used, rec, rec->size);
+		used += rec->size;
 	}
-	n = find_mtag(l->mtags, "time");
-	if (!n)
+	safe_free(h->arena);
+	h->arena = newarena;
+	h->arena_size = newsize;
+	h->head = 0;
+	h->tail = used;
+}
+
+/** Reserve 'needed' (aligned) bytes of contiguous arena space.
+ * @returns The offset to write the record at. The caller must bump
+ *          h->tail to offset+needed afterwards.
+ */
+static uint32_t hbm_arena_reserve(HistoryLogObject *h, uint32_t needed)
+{
+	for (;;)
+	{
+		if (h->num_lines == 0)
+		{
+			h->head = h->tail = 0;
+			if (needed + 8 <= h->arena_size)
+				return 0;
+		}
+		else if (h->tail > h->head)
+		{
+			/* Not wrapped: free space at the end, then before head */
+			if (h->arena_size - h->tail >= needed)
+				return h->tail;
+			if (h->head > needed)
+			{
+				/* Wrap: leave a marker (if a header fits) and restart at 0 */
+				if (h->arena_size - h->tail >= HBM_RECORD_HEADER_SIZE)
+					((HistoryRecord *)(h->arena + h->tail))->size = 0;
+				h->tail = 0;
+				return 0;
+			}
+		}
+		else
+		{
+			/* Wrapped: free space is between tail and head.
+			 * Strictly greater, so tail never catches up with head.
+			 */
+			if (h->head - h->tail > needed)
+				return h->tail;
+		}
+		hbm_arena_grow(h, needed);
+	}
+}
+
+/** Serialize a line plus its message tags into the arena.
+ * Ensures a "time" message tag is present (generating one if needed,
+ * like server-time.c does) since that is what drives expiry.
+ */
+static void hbm_history_add_line(HistoryLogObject *h, MessageTag *mtags, char *line)
+{
+	MessageTag *m, *time_mtag = NULL;
+	char timebuf[64];
+	char *generated_time = NULL;
+	uint32_t payload, needed, offset, nmtags = 0;
+	HistoryRecord *rec;
+	char *p;
+
+	time_mtag = find_mtag(mtags, "time");
+	if (!time_mtag)
 	{
 		/* This is duplicate code from src/modules/server-time.c
 		 * which seems silly.
@@ -168,12 +476,11 @@ void hbm_duplicate_mtags(HistoryLogLine *l, MessageTag *m)
 		struct timeval t;
 		struct tm *tm;
 		time_t sec;
-		char buf[64];
 
 		gettimeofday(&t, NULL);
 		sec = t.tv_sec;
 		tm = gmtime(&sec);
-		snprintf(buf, sizeof(buf), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ",
+		snprintf(timebuf, sizeof(timebuf), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ",
 			tm->tm_year + 1900,
 			tm->tm_mon + 1,
 			tm->tm_mday,
@@ -181,63 +488,64 @@ void hbm_duplicate_mtags(HistoryLogLine *l, MessageTag *m)
 			tm->tm_min,
 			tm->tm_sec,
 			(int)(t.tv_usec / 1000));
-
-		n = safe_alloc(sizeof(MessageTag));
-		safe_strdup(n->name, "time");
-		safe_strdup(n->value, buf);
-		AddListItem(n, l->mtags);
+		generated_time = timebuf;
 	}
-	/* Now convert the "time" message tag to something we can use in l->t */
-	l->t = server_time_to_unix_time(n->value);
-}
 
-/** Add a line to a history object */
-void hbm_history_add_line(HistoryLogObject *h, MessageTag *mtags, char *line)
-{
-	HistoryLogLine *l = safe_alloc(sizeof(HistoryLogLine) + strlen(line));
-	strcpy(l->line, line); /* safe, see memory allocation above ^ */
-	hbm_duplicate_mtags(l, mtags);
-	if (h->tail)
+	/* Compute the payload size */
+	payload = strlen(line) + 1;
+	for (m = mtags; m; m = m->next)
 	{
-		/* append to tail */
-		h->tail->next = l;
-		l->prev = h->tail;
-		h->tail = l;
-	} else {
-		/* no tail, no head */
-		h->head = h->tail = l;
+		if (nmtags >= HBM_MAX_MTAGS)
+			break;
+		payload += strlen(m->name) + 1 + 1 + (m->value ? strlen(m->value) + 1 : 0);
+		nmtags++;
+	}
+	if (generated_time && (nmtags < HBM_MAX_MTAGS))
+	{
+		payload += 4 + 1 + 1 + strlen(generated_time) + 1; /* "time" */
+		nmtags++;
 	}
-	h->num_lines++;
-	if ((l->t < h->oldest_t) || (h->oldest_t == 0))
-		h->oldest_t = l->t;
-}
 
-/** Delete a line from a history object */
-void hbm_history_del_line(HistoryLogObject *h, HistoryLogLine *l)
-{
-	if (l->prev)
-		l->prev->next = l->next;
-	if (l->next)
-		l->next->prev = l->prev;
-	if (h->head == l)
+	needed = HBM_ALIGN(HBM_RECORD_HEADER_SIZE + payload);
+	offset = hbm_arena_reserve(h, needed);
+
+	rec = (HistoryRecord *)(h->arena + offset);
+	rec->size = needed;
+	rec->nmtags = 0;
+	p = rec->data;
+	for (m = mtags; m; m = m->next)
 	{
-		/* New head */
-		h->head = l->next;
+		if (rec->nmtags >= nmtags)
+			break;
+		strcpy(p, m->name);
+		p += strlen(p) + 1;
+		if (m->value)
+		{
+			*p++ = 1;
+			strcpy(p, m->value);
+			p += strlen(p) + 1;
+		} else {
+			*p++ = 0;
+		}
+		rec->nmtags++;
 	}
-	if (h->tail == l)
+	if (generated_time && (rec->nmtags < nmtags))
 	{
-		/* New tail */
-		h->tail = l->prev; /* could be NULL now */
+		strcpy(p, "time");
+		p += 5;
+		*p++ = 1;
+		strcpy(p, generated_time);
+		p += strlen(p) + 1;
+		rec->nmtags++;
 	}
+	strcpy(p, line);
 
-	free_message_tags(l->mtags);
-	safe_free(l);
+	rec->t = server_time_to_unix_time(time_mtag ? time_mtag->value : generated_time);
 
-	h->num_lines--;
-
-	/* IMPORTANT: updating h->oldest_t takes place at the caller
-	 * because it is in a better position to optimize the process
-	 */
+	h->tail = offset + needed;
+	h->num_lines++;
+	if (h->num_lines == 1)
+		h->oldest_t = rec->t;
 }
 
 /** Add history entry */
@@ -254,12 +562,14 @@ int hbm_history_add(char *object, MessageTag *mtags, char *line)
 		h->max_time = 86400;
 #endif
 	}
-	if (h->num_lines >= h->max_lines)
+	while (h->num_lines >= h->max_lines)
 	{
 		/* Delete previous line */
-		hbm_history_del_line(h, h->head);
+		hbm_drop_oldest(h);
 	}
 	hbm_history_add_line(h, mtags, line);
+	hbm_playback_invalidate(h);
+	hbm_schedule_expiry(h);
 	return 0;
 }
 
@@ -270,31 +580,175 @@ int can_receive_history(Client *client)
 	return 0;
 }
 
-void hbm_send_line(Client *client, HistoryLogLine *l, char *batchid)
+/** Send one stored record to the client. The message tags are rebuilt
+ * on the stack, pointing straight into the arena - no allocations.
+ */
+/** Rebuild the MessageTag list of a stored record on the stack.
+ * 'tags' must have room for HBM_MAX_MTAGS entries; the names/values
+ * point straight into the arena - no allocations. Returns the head of
+ * the list (NULL if the record has no tags) and points *line at the
+ * stored text line.
+ */
+static MessageTag *hbm_record_mtags(HistoryRecord *rec, MessageTag *tags, char **line)
 {
-	if (can_receive_history(client))
+	MessageTag *first = NULL, *prev = NULL;
+	uint32_t i;
+	char *p;
+
+	memset(tags, 0, sizeof(MessageTag) * (rec->nmtags ? rec->nmtags : 1));
+	p = rec->data;
+	for (i = 0; i < rec->nmtags; i++)
 	{
-		if (BadPtr(batchid))
+		tags[i].name = p;
+		p += strlen(p) + 1;
+		if (*p++ == 1)
 		{
-			sendto_one(client, l->mtags, "%s", l->line);
-		} else {
-			MessageTag *m = safe_alloc(sizeof(MessageTag));
-			m->name = "batch";
-			m->value = batchid;
-			AddListItem(m, l->mtags);
-			sendto_one(client, l->mtags, "%s", l->line);
-			DelListItem(m, l->mtags);
-			safe_free(m);
+			tags[i].value = p;
+			p += strlen(p) + 1;
 		}
-	} else {
+		if (prev)
+			prev->next = &tags[i];
+		else
+			first = &tags[i];
+		tags[i].prev = prev;
+		prev = &tags[i];
+	}
+	/* 'p' now points at the line itself */
+	*line = p;
+	return first;
+}
+
+/** Prepend the 'batch' message tag to a reconstructed tag list */
+static MessageTag *hbm_prepend_batch_mtag(MessageTag *batch_mtag, char *batchid, MessageTag *first)
+{
+	memset(batch_mtag, 0, sizeof(MessageTag));
+	batch_mtag->name = "batch";
+	batch_mtag->value = batchid;
+	batch_mtag->next = first;
+	if (first)
+		first->prev = batch_mtag;
+	return batch_mtag;
+}
+
+void hbm_send_line(Client *client, HistoryRecord *rec, char *batchid)
+{
+	MessageTag tags[HBM_MAX_MTAGS], batch_mtag;
+	MessageTag *first;
+	char *p;
+
+	if (!can_receive_history(client))
+	{
 		/* without server-time, log playback is a bit annoying, so skip it? */
+		return;
+	}
+
+	first = hbm_record_mtags(rec, tags, &p);
+
+	if (!BadPtr(batchid))
+		first = hbm_prepend_batch_mtag(&batch_mtag, batchid, first);
+	sendto_one(client, first, "%s", p);
+}
+
+/** Append bytes to a grow-on-demand render buffer */
+static void hbm_render_append(char **out, size_t *outlen, size_t *outsize, const char *data, size_t len)
+{
+	if (*outlen + len > *outsize)
+	{
+		char *newout;
+		size_t newsize = *outsize ? *outsize : 8192;
+
+		while (*outlen + len > newsize)
+			newsize *= 2;
+		newout = safe_alloc(newsize);
+		if (*out)
+		{
+			memcpy(newout, *out, *outlen);
+			safe_free(*out);
+		}
+		*out = newout;
+		*outsize = newsize;
+	}
+	memcpy(*out + *outlen, data, len);
+	*outlen += len;
+}
+
+/** Render a complete history playback for 'client' into one refcounted
+ * buffer: the BATCH start line (if the client negotiated 'batch'),
+ * every record serialized for the client's capability set, and the
+ * BATCH end line. The same batch id is baked into the buffer for every
+ * recipient it is later shared with; batch ids only need to be unique
+ * per connection, so that is fine.
+ * Returns NULL when the output cannot safely be shared between clients
+ * with equal caps (a tag with a dynamic can_send filter), in which
+ * case the caller falls back to per-line delivery.
+ */
+static dbufshared *hbm_render_playback(Client *client, HistoryLogObject *h, long redline, int lines_to_skip)
+{
+	HistoryIterator iter;
+	HistoryRecord *rec;
+	MessageTag tags[HBM_MAX_MTAGS], batch_mtag;
+	MessageTag *first, *m;
+	dbufshared *shared;
+	char batch[BATCHLEN+1];
+	char linebuf[4096];
+	char *out = NULL, *line, *mtags_str;
+	size_t outlen = 0, outsize = 0;
+	int cnt = 0, len;
+
+	batch[0] = '\0';
+	if (HasCapability(client, "batch"))
+	{
+		generate_batch_id(batch);
+		len = snprintf(linebuf, sizeof(linebuf), ":%s BATCH +%s chathistory %s\r\n", me.name, batch, h->name);
+		hbm_render_append(&out, &outlen, &outsize, linebuf, len);
+	}
+
+	hbm_iterator_init(h, &iter);
+	while ((rec = hbm_iterator_next(h, &iter)))
+	{
+		if ((rec->t < redline) || (++cnt <= lines_to_skip))
+			continue;
+		first = hbm_record_mtags(rec, tags, &line);
+		for (m = first; m; m = m->next)
+		{
+			MessageTagHandler *handler = MessageTagHandlerFind(m->name);
+			if (handler && handler->can_send)
+			{
+				/* Output may differ between clients with
+				 * identical caps: don't share bytes.
+				 */
+				safe_free(out);
+				return NULL;
+			}
+		}
+		if (*batch)
+			first = hbm_prepend_batch_mtag(&batch_mtag, batch, first);
+		mtags_str = mtags_to_string(first, client);
+		if (BadPtr(mtags_str))
+			len = snprintf(linebuf, sizeof(linebuf), "%s\r\n", line);
+		else
+			len = snprintf(linebuf, sizeof(linebuf), "@%s %s\r\n", mtags_str, line);
+		if (len >= sizeof(linebuf))
+			len = sizeof(linebuf) - 1; /* truncated */
+		hbm_render_append(&out, &outlen, &outsize, linebuf, len);
 	}
+
+	if (*batch)
+	{
+		len = snprintf(linebuf, sizeof(linebuf), ":%s BATCH -%s\r\n", me.name, batch);
+		hbm_render_append(&out, &outlen, &outsize, linebuf, len);
+	}
+
+	shared = dbuf_shared_create(out ? out : linebuf, outlen);
+	safe_free(out);
+	return shared;
 }
 
 int hbm_history_request(Client *client, char *object, HistoryFilter *filter)
 {
 	HistoryLogObject *h = hbm_find_object(object);
-	HistoryLogLine *l;
+	HistoryIterator iter;
+	HistoryRecord *rec;
 	char batch[BATCHLEN+1];
 	long redline; /* Imaginary timestamp. Before the red line, history is too old. */
 	int lines_sendable = 0, lines_to_skip = 0, cnt = 0;
@@ -302,15 +756,6 @@ int hbm_history_request(Client *client, char *object, HistoryFilter *filter)
 	if (!h || !can_receive_history(client))
 		return 0;
 
-	batch[0] = '\0';
-
-	if (HasCapability(client, "batch"))
-	{
-		/* Start a new batch */
-		generate_batch_id(batch);
-		sendto_one(client, NULL, ":%s BATCH +%s chathistory %s", me.name, batch, object);
-	}
-
 	/* Decide on red line, under this the history is too old.
 	 * Filter can be more strict than history object (but not the other way around):
 	 */
@@ -323,20 +768,79 @@ int hbm_history_request(Client *client, char *object, HistoryFilter *filter)
 	 * For now, this is sufficient, since requests are only about lines:
 	 */
 	lines_sendable = 0;
-	for (l = h->head; l; l = l->next)
-		if (l->t >= redline)
+	hbm_iterator_init(h, &iter);
+	while ((rec = hbm_iterator_next(h, &iter)))
+		if (rec->t >= redline)
 			lines_sendable++;
 	if (filter && (lines_sendable > filter->last_lines))
 		lines_to_skip = lines_sendable - filter->last_lines;
 
-	for (l = h->head; l; l = l->next)
+	/* Fast path: serve a cached rendered playback, or render one and
+	 * cache it. After a netjoin the members of a channel rejoin (and
+	 * replay) in a tight burst; every member after the first with the
+	 * same cap set reuses the same refcounted bytes. PACKET hooks may
+	 * rewrite output per recipient, which rules out sharing.
+	 */
+	if (MyConnect(client) && !Hooks[HOOKTYPE_PACKET])
+	{
+		HbmPlayback *pb = NULL;
+		int last_lines = filter ? filter->last_lines : 0;
+		int i;
+
+		for (i = 0; i < HBM_PLAYBACK_VARIANTS; i++)
+		{
+			if (h->playback[i].buf &&
+			    (h->playback[i].caps == client->local->caps) &&
+			    (h->playback[i].redline == redline) &&
+			    (h->playback[i].last_lines == last_lines))
+			{
+				pb = &h->playback[i];
+				break;
+			}
+		}
+		if (!pb)
+		{
+			dbufshared *shared = hbm_render_playback(client, h, redline, lines_to_skip);
+			if (shared)
+			{
+				pb = &h->playback[h->playback_rr];
+				h->playback_rr = (h->playback_rr + 1) % HBM_PLAYBACK_VARIANTS;
+				if (pb->buf)
+					dbuf_shared_release(pb->buf);
+				pb->buf = shared;
+				pb->caps = client->local->caps;
+				pb->redline = redline;
+				pb->last_lines = last_lines;
+			}
+		}
+		if (pb)
+		{
+			sendbufto_one_shared(client, pb->buf);
+			return 1;
+		}
+	}
+
+	/* Slow path: per-line serialization, for when the stored tags have
+	 * dynamic outgoing filters or PACKET hooks are loaded.
+	 */
+	batch[0] = '\0';
+
+	if (HasCapability(client, "batch"))
+	{
+		/* Start a new batch */
+		generate_batch_id(batch);
+		sendto_one(client, NULL, ":%s BATCH +%s chathistory %s", me.name, batch, object);
+	}
+
+	hbm_iterator_init(h, &iter);
+	while ((rec = hbm_iterator_next(h, &iter)))
 	{
 		/* Make sure we don't send too old entries:
 		 * We only have to check for time here, as line count is already
 		 * taken into account in hbm_history_add.
 		 */
-		if (l->t >= redline && (++cnt > lines_to_skip))
-			hbm_send_line(client, l, batch);
+		if (rec->t >= redline && (++cnt > lines_to_skip))
+			hbm_send_line(client, rec, batch);
 	}
 
 	/* End of batch */
@@ -348,69 +852,31 @@ int hbm_history_request(Client *client, char *object, HistoryFilter *filter)
 /** Clean up expired entries */
 int hbm_history_cleanup(HistoryLogObject *h)
 {
-	HistoryLogLine *l, *l_next = NULL;
 	long redline = TStime() - h->max_time;
 
-	/* First enforce 'h->max_time', after that enforce 'h->max_lines' */
-
-	/* Checking for time */
-	if (h->oldest_t < redline)
-	{
-		h->oldest_t = 0; /* recalculate in next loop */
-
-		for (l = h->head; l; l = l_next)
-		{
-			l_next = l->next;
-			if (l->t < redline)
-			{
-				hbm_history_del_line(h, l); /* too old, delete it */
-				continue;
-			}
-			if ((h->oldest_t == 0) || (l->t < h->oldest_t))
-				h->oldest_t = l->t;
-		}
-	}
-
-	if (h->num_lines > h->max_lines)
-	{
-		h->oldest_t = 0; /* recalculate in next loop */
+	/* First enforce 'h->max_time', after that enforce 'h->max_lines'.
+	 * Records sit in the arena in arrival order, which is also (as good
+	 * as) time order, so expiry is simply advancing the head offset past
+	 * the too-old records - oldest_t tracks the head record throughout.
+	 */
+	while (h->num_lines && (h->oldest_t < redline))
+		hbm_drop_oldest(h);
 
-		for (l = h->head; l; l = l_next)
-		{
-			l_next = l->next;
-			if (h->num_lines > h->max_lines)
-			{
-				hbm_history_del_line(h, l);
-				continue;
-			}
-			if ((h->oldest_t == 0) || (l->t < h->oldest_t))
-				h->oldest_t = l->t;
-		}
-	}
+	while (h->num_lines > h->max_lines)
+		hbm_drop_oldest(h);
 
+	hbm_playback_invalidate(h);
+	hbm_schedule_expiry(h);
 	return 1;
 }
 
 int hbm_history_destroy(char *object)
 {
 	HistoryLogObject *h = hbm_find_object(object);
-	HistoryLogLine *l, *l_next;
 
 	if (!h)
 		return 0;
 
-	for (l = h->head; l; l = l_next)
-	{
-		l_next = l->next;
-		/* We could use hbm_history_del_line() here but
-		 * it does unnecessary work, this is quicker.
-		 * The only danger is that we may forget to free some
-		 * fields that are added later there but not here.
-		 */
-		free_message_tags(l->mtags);
-		safe_free(l);
-	}
-
 	hbm_delete_object_hlo(h);
 	return 1;
 }
@@ -425,28 +891,51 @@ int hbm_history_set_limit(char *object, int max_lines, long max_time)
 	return 1;
 }
 
+/** Report our memory usage to the /STATS Z memory report:
+ * one object per logged channel, bytes covering the record arenas,
+ * the cached rendered playbacks and the expiry heap.
+ */
+void hbm_count_memory(long long *objects, long long *bytes)
+{
+	HistoryLogObject *h;
+	int hashv, i;
+
+	for (hashv = 0; hashv < HISTORY_BACKEND_MEM_HASH_TABLE_SIZE; hashv++)
+	{
+		for (h = history_hash_table[hashv]; h; h = h->next)
+		{
+			*objects += 1;
+			*bytes += sizeof(HistoryLogObject) + h->arena_size;
+			for (i = 0; i < HBM_PLAYBACK_VARIANTS; i++)
+				if (h->playback[i].buf)
+					*bytes += sizeof(dbufshared) + h->playback[i].buf->size;
+		}
+	}
+	*bytes += expiry_heap_capacity * sizeof(HistoryLogObject *);
+}
+
 /** Periodically clean the history.
- * Instead of doing all channels in 1 go, we do a limited number
- * of channels each call, hence the 'static int' and the do { } while
- * rather than a regular for loop.
+ * Only objects whose oldest record has actually reached its expiry
+ * deadline are popped off the heap and trimmed; idle channels and
+ * channels with only fresh history cost nothing here.
  * Note that we already impose the line limit in hbm_history_add,
  * so this history_mem_clean is for removals due to max_time limits.
  */
 EVENT(history_mem_clean)
 {
-	static int hashnum = 0;
-	int loopcnt = 0;
-	Channel *channel;
-	HistoryLogObject *h;
+	time_t now = TStime();
 
-	do
+	while (expiry_heap_count && (expiry_heap[0]->deadline <= now))
 	{
-		for (h = history_hash_table[hashnum++]; h; h = h->next)
-			hbm_history_cleanup(h);
-
-		hashnum++;
+		HistoryLogObject *h = expiry_heap[0];
 
-		if (hashnum >= HISTORY_BACKEND_MEM_HASH_TABLE_SIZE)
-			hashnum = 0;
-	} while(loopcnt++ < HISTORY_CLEAN_PER_LOOP);
+		hbm_history_cleanup(h);
+		if ((h->heap_pos == 0) && (h->deadline <= now))
+		{
+			/* Still due (eg: head record exactly on the red line),
+			 * push it to the next timer run rather than spinning.
+			 */
+			hbm_heap_update(h, now + HISTORY_TIMER_EVERY);
+		}
+	}
 }
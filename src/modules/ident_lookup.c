@@ -13,12 +13,48 @@ ModuleHeader MOD_HEADER
 	"unrealircd-5",
 };
 
+/* A global budget on concurrent ident lookups. Every registering client
+ * used to open its own connection to port 113 immediately, so a connect
+ * flood turned into thousands of ident sockets all waiting for their
+ * timeout. Lookups beyond the budget are queued (flagged on the client,
+ * no resources held) and started as running ones finish.
+ */
+#define IDENT_MAX_CONCURRENT 100
+
+/* Adaptive skip: per-/24 (or IPv6 /64-ish) sliding window of ident
+ * outcomes. If every recent attempt towards a network timed out - the
+ * typical consumer NAT situation where packets to port 113 are silently
+ * dropped - we stop trying for that network until the window expires,
+ * instead of gating every client's registration on the full timeout.
+ */
+#define IDENT_NET_TABLE_SIZE 256
+#define IDENT_NET_WINDOW 600		/* seconds */
+#define IDENT_NET_MIN_ATTEMPTS 5	/* don't judge a network on less */
+
+typedef struct IdentNetStats IdentNetStats;
+struct IdentNetStats {
+	char valid; /**< Slot in use? */
+	char net[64]; /**< Network prefix, eg "203.0.113." */
+	time_t window_start;
+	unsigned int attempts; /**< Lookups attempted in this window */
+	unsigned int timeouts; /**< ..of which timed out */
+};
+
+static IdentNetStats ident_nets[IDENT_NET_TABLE_SIZE];
+static char siphashkey_identnet[SIPHASH_KEY_LENGTH];
+static int siphashkey_identnet_set = 0;
+static int ident_in_flight = 0; /**< Number of ident sockets currently open */
+
 /* Forward declarations */
 static EVENT(check_ident_timeout);
 static int ident_lookup_connect(Client *client);
+static void ident_lookup_start(Client *client);
+static void ident_lookup_kick_queue(void);
 static void ident_lookup_send(int fd, int revents, void *data);
 static void ident_lookup_receive(int fd, int revents, void *data);
 static char *ident_lookup_parse(Client *client, char *buf);
+static void ident_net_record(Client *client, int timedout);
+static int ident_net_is_dead(Client *client);
 
 MOD_INIT()
 {
@@ -41,25 +77,107 @@ MOD_UNLOAD()
 }
 
 
+/** Derive the network prefix key for the adaptive tracker:
+ * everything up to and including the 3rd '.' for IPv4 (a /24),
+ * or the 4th ':' for IPv6 (roughly a /64).
+ */
+static void ident_net_key(Client *client, char *buf, size_t buflen)
+{
+	char sep = IsIPV6(client) ? ':' : '.';
+	int want = IsIPV6(client) ? 4 : 3;
+	int seen = 0;
+	char *o = buf;
+	char *i;
+
+	for (i = client->ip; *i && (o < buf + buflen - 1); i++)
+	{
+		*o++ = *i;
+		if ((*i == sep) && (++seen == want))
+			break;
+	}
+	*o = '\0';
+}
+
+static IdentNetStats *ident_net_find(Client *client, char *net, size_t netlen)
+{
+	if (!siphashkey_identnet_set)
+	{
+		siphash_generate_key(siphashkey_identnet);
+		siphashkey_identnet_set = 1;
+	}
+	ident_net_key(client, net, netlen);
+	return &ident_nets[siphash(net, siphashkey_identnet) % IDENT_NET_TABLE_SIZE];
+}
+
+/** Record the outcome of an ident lookup for the client's network */
+static void ident_net_record(Client *client, int timedout)
+{
+	char net[64];
+	IdentNetStats *e = ident_net_find(client, net, sizeof(net));
+
+	if (!e->valid || strcmp(e->net, net) || (TStime() - e->window_start > IDENT_NET_WINDOW))
+	{
+		/* Free slot, different network (collision) or stale window: take it over */
+		e->valid = 1;
+		strlcpy(e->net, net, sizeof(e->net));
+		e->window_start = TStime();
+		e->attempts = e->timeouts = 0;
+	}
+	e->attempts++;
+	if (timedout)
+		e->timeouts++;
+}
+
+/** Is ident considered hopeless for this client's network?
+ * True if we have enough recent samples and every single one timed out.
+ */
+static int ident_net_is_dead(Client *client)
+{
+	char net[64];
+	IdentNetStats *e = ident_net_find(client, net, sizeof(net));
+
+	if (!e->valid || strcmp(e->net, net))
+		return 0;
+	if (TStime() - e->window_start > IDENT_NET_WINDOW)
+		return 0;
+	return (e->attempts >= IDENT_NET_MIN_ATTEMPTS) && (e->timeouts == e->attempts);
+}
+
 static void ident_lookup_failed(Client *client)
 {
 	Debug((DEBUG_NOTICE, "ident_lookup_failed() for %p", client));
+	client->local->handshake.ident_ms =
+		handshake_phase_done(HANDSHAKE_PHASE_IDENT, &client->local->handshake.ident_start);
 	ircstats.is_abad++;
 	if (client->local->authfd != -1)
 	{
 		fd_close(client->local->authfd);
 		--OpenFiles;
 		client->local->authfd = -1;
+		if (ident_in_flight > 0)
+			ident_in_flight--;
 	}
 	ClearIdentLookupSent(client);
 	ClearIdentLookup(client);
 	if (should_show_connect_info(client))
 		sendto_one(client, NULL, ":%s %s", me.name, REPORT_FAIL_ID);
+	ident_lookup_kick_queue();
 }
 
 static EVENT(check_ident_timeout)
 {
 	Client *client, *next;
+	int open_lookups = 0;
+
+	/* Resync the in-flight counter first. When a client exits,
+	 * close_connection() closes the ident socket directly without
+	 * going through this module, so counting incrementally alone
+	 * would slowly leak slots. A recount per tick keeps us honest.
+	 */
+	list_for_each_entry(client, &unknown_list, lclient_node)
+		if (client->local->authfd != -1)
+			open_lookups++;
+	ident_in_flight = open_lookups;
 
 	list_for_each_entry_safe(client, next, &unknown_list, lclient_node)
 	{
@@ -69,27 +187,60 @@ static EVENT(check_ident_timeout)
 			{
 				/* set::ident::connect-timeout */
 				if ((TStime() - client->local->firsttime) > IDENT_CONNECT_TIMEOUT)
+				{
+					ident_net_record(client, 1);
 					ident_lookup_failed(client);
+				}
 			} else
 			{
-				/* set::ident::read-timeout */
+				/* set::ident::read-timeout
+				 * (also reached by clients still queued for a slot)
+				 */
 				if ((TStime() - client->local->firsttime) > IDENT_READ_TIMEOUT)
+				{
+					if (client->local->authfd != -1)
+						ident_net_record(client, 1);
 					ident_lookup_failed(client);
+				}
 			}
 		}
 	}
+	ident_lookup_kick_queue();
 }
 
-/** Start the ident lookup for this user */
+/** Start the ident lookup for this user, or queue/skip it.
+ * Networks where every recent attempt timed out are skipped outright,
+ * and when the concurrency budget is spent the client is only flagged
+ * (IsIdentLookup without a socket) and picked up as slots free up.
+ */
 static int ident_lookup_connect(Client *client)
+{
+	if (ident_net_is_dead(client))
+	{
+		/* Port 113 is black-holed for this network, don't even try */
+		ident_lookup_failed(client);
+		return 0;
+	}
+	if (ident_in_flight >= IDENT_MAX_CONCURRENT)
+	{
+		SetIdentLookup(client); /* queued: no fd yet, see ident_lookup_kick_queue() */
+		return 0;
+	}
+	ident_lookup_start(client);
+	return 0;
+}
+
+/** Actually open the connection to the remote ident server */
+static void ident_lookup_start(Client *client)
 {
 	char buf[BUFSIZE];
 
+	handshake_phase_mark(&client->local->handshake.ident_start);
 	snprintf(buf, sizeof buf, "identd: %s", get_client_name(client, TRUE));
 	if ((client->local->authfd = fd_socket(IsIPV6(client) ? AF_INET6 : AF_INET, SOCK_STREAM, 0, buf)) == -1)
 	{
 		ident_lookup_failed(client);
-		return 0;
+		return;
 	}
 	if (++OpenFiles >= maxclients+1)
 	{
@@ -97,8 +248,9 @@ static int ident_lookup_connect(Client *client)
 		fd_close(client->local->authfd);
 		--OpenFiles;
 		client->local->authfd = -1;
-		return 0;
+		return;
 	}
+	ident_in_flight++;
 
 	if (should_show_connect_info(client))
 		sendto_one(client, NULL, ":%s %s", me.name, REPORT_DO_ID);
@@ -112,14 +264,26 @@ static int ident_lookup_connect(Client *client)
 	if (!unreal_connect(client->local->authfd, client->ip, 113, IsIPV6(client)))
 	{
 		ident_lookup_failed(client);
-		return 0;
+		return;
 	}
 	SetIdentLookupSent(client);
 	SetIdentLookup(client);
 
 	fd_setselect(client->local->authfd, FD_SELECT_WRITE, ident_lookup_send, client);
+}
 
-	return 0;
+/** Start queued lookups, as long as the concurrency budget allows */
+static void ident_lookup_kick_queue(void)
+{
+	Client *client, *next;
+
+	list_for_each_entry_safe(client, next, &unknown_list, lclient_node)
+	{
+		if (ident_in_flight >= IDENT_MAX_CONCURRENT)
+			break;
+		if (IsIdentLookup(client) && !IsIdentLookupSent(client) && (client->local->authfd == -1))
+			ident_lookup_start(client);
+	}
 }
 
 /** Send the request to the ident server */
@@ -170,6 +334,13 @@ static void ident_lookup_receive(int fd, int revents, void *userdata)
 	client->local->authfd = -1;
 	client->local->identbufcnt = 0;
 	ClearIdentLookup(client);
+	if (ident_in_flight > 0)
+		ident_in_flight--;
+	ident_lookup_kick_queue();
+
+	client->local->handshake.ident_ms =
+		handshake_phase_done(HANDSHAKE_PHASE_IDENT, &client->local->handshake.ident_start);
+	ident_net_record(client, 0); /* the server answered: the network is alive */
 
 	if (should_show_connect_info(client))
 		sendto_one(client, NULL, ":%s %s", me.name, REPORT_FIN_ID);
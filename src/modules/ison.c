@@ -64,12 +64,19 @@ MOD_UNLOAD()
 
 static char buf[BUFSIZE];
 
+/* A BUFSIZE line can never hold more space separated names than this */
+#define MAXISONNAMES (BUFSIZE/2)
+
 CMD_FUNC(cmd_ison)
 {
 	char namebuf[USERLEN + HOSTLEN + 4];
 	Client *acptr;
 	char *s, *user;
 	char *p = NULL;
+	char *names[MAXISONNAMES];
+	char *users[MAXISONNAMES];
+	Client *targets[MAXISONNAMES];
+	int n = 0, i, len;
 
 	if (!MyUser(client))
 		return;
@@ -80,24 +87,30 @@ CMD_FUNC(cmd_ison)
 		return;
 	}
 
-	ircsnprintf(buf, sizeof(buf), ":%s %d %s :", me.name, RPL_ISON, client->name);
-
-	for (s = strtoken(&p, parv[1], " "); s; s = strtoken(&p, NULL, " "))
+	for (s = strtoken(&p, parv[1], " "); s && (n < MAXISONNAMES); s = strtoken(&p, NULL, " "))
 	{
 		if ((user = strchr(s, '!')))
 			*user++ = '\0';
-		if ((acptr = find_person(s, NULL)))
+		names[n] = s;
+		users[n] = user;
+		n++;
+	}
+	find_persons(n, names, targets);
+
+	len = ircsnprintf(buf, sizeof(buf), ":%s %d %s :", me.name, RPL_ISON, client->name);
+
+	for (i = 0; i < n; i++)
+	{
+		if (!(acptr = targets[i]))
+			continue;
+		if (users[i])
 		{
-			if (user)
-			{
-				ircsnprintf(namebuf, sizeof(namebuf), "%s@%s", acptr->user->username, GetHost(acptr));
-				if (!match_simple(user, namebuf)) continue;
-				*--user = '!';
-			}
-
-			strlcat(buf, s, sizeof(buf));
-			strlcat(buf, " ", sizeof(buf));
+			ircsnprintf(namebuf, sizeof(namebuf), "%s@%s", acptr->user->username, GetHost(acptr));
+			if (!match_simple(users[i], namebuf))
+				continue;
+			*--users[i] = '!';
 		}
+		len += ircsnprintf(buf + len, sizeof(buf) - len, "%s ", names[i]);
 	}
 
 	sendto_one(client, NULL, "%s", buf);
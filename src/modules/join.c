@@ -183,6 +183,14 @@ CMD_FUNC(cmd_join)
  * Taking into account that not everyone in channel should see the JOIN (mode +D)
  * and taking into account the different types of JOIN (due to CAP extended-join).
  */
+/* Cached capability bits for send_join_to_local_users(): looked up once
+ * and revalidated via clicap_generation, instead of walking the
+ * capability list twice for every single join.
+ */
+static long CAP_EXTENDED_JOIN = 0L;
+static long CAP_AWAY_NOTIFY = 0L;
+static int join_caps_generation = -1;
+
 void _send_join_to_local_users(Client *client, Channel *channel, MessageTag *mtags)
 {
 	int chanops_only = invisible_user_in_channel(client, channel);
@@ -190,8 +198,13 @@ void _send_join_to_local_users(Client *client, Channel *channel, MessageTag *mta
 	Client *acptr;
 	char joinbuf[512];
 	char exjoinbuf[512];
-	long CAP_EXTENDED_JOIN = ClientCapabilityBit("extended-join");
-	long CAP_AWAY_NOTIFY = ClientCapabilityBit("away-notify");
+
+	if (join_caps_generation != clicap_generation)
+	{
+		CAP_EXTENDED_JOIN = ClientCapabilityBit("extended-join");
+		CAP_AWAY_NOTIFY = ClientCapabilityBit("away-notify");
+		join_caps_generation = clicap_generation;
+	}
 
 	ircsnprintf(joinbuf, sizeof(joinbuf), ":%s!%s@%s JOIN :%s",
 		client->name, client->user->username, GetHost(client), channel->chname);
@@ -454,6 +467,12 @@ void _do_join(Client *client, int parc, char *parv[])
 			continue;
 		}
 
+		/* Resolve the target channel once; the checks below and the
+		 * create-if-needed step further down all reuse this instead
+		 * of each doing their own hash lookup.
+		 */
+		channel = get_channel(client, name, 0);
+
 		if (MyConnect(client))
 		{
 			/*
@@ -467,8 +486,7 @@ void _do_join(Client *client, int parc, char *parv[])
 
 			 */
 
-			flags =
-			    (ChannelExists(name)) ? CHFL_DEOPPED : LEVEL_ON_JOIN;
+			flags = channel ? CHFL_DEOPPED : LEVEL_ON_JOIN;
 
 			if (!ValidatePermissionsForPath("immune:maxchannelsperuser",client,NULL,NULL,NULL))	/* opers can join unlimited chans */
 				if (client->user->joined >= MAXCHANNELSPERUSER)
@@ -514,8 +532,6 @@ void _do_join(Client *client, int parc, char *parv[])
 			    !strcasecmp(name, SPAMFILTER_VIRUSCHAN) &&
 			    !ValidatePermissionsForPath("immune:server-ban:viruschan",client,NULL,NULL,NULL) && !spamf_ugly_vchanoverride)
 			{
-				Channel *channel = find_channel(name, NULL);
-				
 				if (!channel || !is_invited(client, channel))
 				{
 					sendnotice(client, "*** Cannot join '%s' because it's the virus-help-channel "
@@ -525,7 +541,8 @@ void _do_join(Client *client, int parc, char *parv[])
 			}
 		}
 
-		channel = get_channel(client, name, CREATE);
+		if (!channel)
+			channel = get_channel(client, name, CREATE);
 		if (channel && (lp = find_membership_link(client->user->channel, channel)))
 			continue;
 
@@ -690,6 +707,22 @@ void _userhost_changed(Client *client)
 	if (!strcmp(remember_user, client->user->username) && !strcmp(remember_host, GetHost(client)))
 		return; /* Nothing to do */
 
+	/* The cached sender prefix (see send.c) and the cached userhost/
+	 * userip tag values were built from the old user@host, drop them
+	 * so they get rebuilt on next use.
+	 */
+	client->user->prefix.len = 0;
+	client->user->userhost_tag.len = 0;
+	client->user->userip_tag.len = 0;
+	client->user->acl_generation++; /* ban masks match on user@host */
+	whoindex_update(client); /* re-file under the new host */
+
+	/* Per-channel renderings keyed on channel->acl_generation (eg the
+	 * NAMES reply cache) may embed our user@host, invalidate those too.
+	 */
+	for (channels = client->user->channel; channels; channels = channels->next)
+		channels->channel->acl_generation++;
+
 	/* Most of the work is only necessary for set::allow-userhost-change force-rejoin */
 	if (UHOST_ALLOWED == UHALLOW_REJOIN)
 	{
@@ -703,8 +736,16 @@ void _userhost_changed(Client *client)
 			char joinbuf[512]; /* JOIN */
 			char exjoinbuf[512]; /* JOIN (for CAP extended-join) */
 			char modebuf[512]; /* MODE (if any) */
-			int chanops_only = invisible_user_in_channel(client, channel);
+			int chanops_only;
+
+			/* Everything below only talks to local members, so don't
+			 * even render the buffers for all-remote channels (the
+			 * common case on hubs during a mass vhost application).
+			 */
+			if (!channel->local_members)
+				continue;
 
+			chanops_only = invisible_user_in_channel(client, channel);
 			modebuf[0] = '\0';
 
 			/* If the user is banned, don't send any rejoins, it would only be annoying */
@@ -776,6 +817,8 @@ void _userhost_changed(Client *client)
 	current_serial++;
 	for (channels = client->user->channel; channels; channels = channels->next)
 	{
+		if (!channels->channel->local_members)
+			continue; /* nobody local to notify here */
 		for (lp = channels->channel->members; lp; lp = lp->next)
 		{
 			acptr = lp->client;
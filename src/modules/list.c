@@ -316,8 +316,11 @@ CMD_FUNC(cmd_list)
 }
 /*
  * The function which sends the actual channel list back to the user.
- * Operates by stepping through the hashtable, sending the entries back if
- * they match the criteria.
+ * Operates by stepping through the channel size index (channels filed
+ * by member count, see src/hash.c), sending the entries back if they
+ * match the criteria. Since bucket n holds exactly the channels with n
+ * members, a >min or <max user count filter translates into a smaller
+ * bucket range instead of a per-channel test against every channel.
  * client = Local client to send the output back to.
  * Taken from bahamut, modified for Unreal by codemastr.
  */
@@ -326,6 +329,7 @@ int send_list(Client *client)
 	Channel *channel;
 	ChannelListOptions *lopt = CHANNELLISTOPTIONS(client);
 	unsigned int  hashnum;
+	unsigned int  endhash = LIST_SIZE_INDEX_BUCKETS;
 	int numsend = (get_sendq(client) / 768) + 1; /* (was previously hard-coded) */
 	/* ^
 	 * numsend = Number (roughly) of lines to send back. Once this number has
@@ -354,11 +358,23 @@ int send_list(Client *client)
 		}
 	}
 
-	for (hashnum = lopt->starthash; hashnum < CHAN_HASH_TABLE_SIZE; hashnum++)
+	/* Restrict the bucket range if a user count filter was given.
+	 * Note that the last bucket holds every channel above the bucket
+	 * range and thus can never be skipped for a >min filter.
+	 */
+	if (!lopt->showall)
+	{
+		if ((lopt->starthash == 0) && (lopt->usermin > 0))
+			lopt->starthash = MIN(lopt->usermin, LIST_SIZE_INDEX_BUCKETS - 1);
+		if ((lopt->usermax >= 0) && (lopt->usermax < LIST_SIZE_INDEX_BUCKETS - 1))
+			endhash = lopt->usermax + 1;
+	}
+
+	for (hashnum = lopt->starthash; hashnum < endhash; hashnum++)
 	{
 		if (numsend > 0)
-			for (channel = hash_get_chan_bucket(hashnum);
-			    channel; channel = channel->hnextch)
+			for (channel = channel_sizeindex_bucket(hashnum);
+			    channel; channel = channel->lidx_next)
 			{
 				if (SecretChannel(channel)
 				    && !IsMember(client, channel)
@@ -435,7 +451,7 @@ int send_list(Client *client)
 	}
 
 	/* All done */
-	if (hashnum == CHAN_HASH_TABLE_SIZE)
+	if (hashnum >= endhash)
 	{
 		sendnumeric(client, RPL_LISTEND);
 		free_list_options(client);
@@ -53,25 +53,108 @@ MOD_UNLOAD()
 	return MOD_SUCCESS;
 }
 
+/* /MAP used to rescan the entire global_server_list for the children of
+ * every single server, which is O(servers^2) - and opers tend to run MAP
+ * repeatedly exactly when the server is busiest (netsplits). We now take
+ * a child/sibling snapshot of the server tree in one pass and render
+ * from that, so the whole command is linear in the number of servers.
+ */
+typedef struct MapNode MapNode;
+struct MapNode {
+	Client *server; /**< The server this node represents */
+	MapNode *children; /**< First child (in global_server_list order) */
+	MapNode *ctail; /**< Last child, for cheap appending */
+	MapNode *sibling; /**< Next sibling */
+	int hidden; /**< ULine hidden from this requester (hides the subtree) */
+};
+
+/** Look up the node for 'server' in the snapshot's pointer hash */
+static MapNode *map_snapshot_find(MapNode **tab, unsigned int tabsize, Client *server)
+{
+	unsigned int b = ((size_t)server / sizeof(void *)) % tabsize;
+
+	while (tab[b] && (tab[b]->server != server))
+		b = (b + 1) % tabsize;
+	return tab[b];
+}
+
+/** Build a snapshot of the server tree, rooted at &me (node [0]).
+ * @param client  The requester (for ULine visibility)
+ * @returns An array of nodes linked into a tree, to be freed by the
+ *          caller with safe_free().
+ */
+static MapNode *map_snapshot_build(Client *client)
+{
+	MapNode *nodes, *node, *parent;
+	MapNode **tab;
+	Client *acptr;
+	unsigned int cnt = 1, tabsize, b;
+	int hide_ulines;
+
+	hide_ulines = (HIDE_ULINES && !ValidatePermissionsForPath("server:info:map:ulines",client,NULL,NULL,NULL)) ? 1 : 0;
+
+	list_for_each_entry(acptr, &global_server_list, client_node)
+		cnt++;
+	tabsize = cnt * 2 + 1;
+	nodes = safe_alloc(cnt * sizeof(MapNode));
+	tab = safe_alloc(tabsize * sizeof(MapNode *));
+
+	/* First pass: create a node for every server (hidden or not, since
+	 * a child may precede its parent in global_server_list)..
+	 */
+	nodes[0].server = &me;
+	cnt = 1;
+	list_for_each_entry(acptr, &global_server_list, client_node)
+	{
+		node = &nodes[cnt++];
+		node->server = acptr;
+		node->hidden = (IsULine(acptr) && hide_ulines) ? 1 : 0;
+	}
+	for (b = 0; b < cnt; b++)
+	{
+		unsigned int h = ((size_t)nodes[b].server / sizeof(void *)) % tabsize;
+		while (tab[h])
+			h = (h + 1) % tabsize;
+		tab[h] = &nodes[b];
+	}
+
+	/* ..second pass: hook each server up to its parent */
+	for (b = 1; b < cnt; b++)
+	{
+		node = &nodes[b];
+		parent = node->server->srvptr ? map_snapshot_find(tab, tabsize, node->server->srvptr) : NULL;
+		if (!parent)
+			continue; /* orphan, just as invisible as it was before */
+		if (parent->ctail)
+			parent->ctail->sibling = node;
+		else
+			parent->children = node;
+		parent->ctail = node;
+	}
+
+	safe_free(tab);
+	return nodes;
+}
+
 /*
  * New /MAP format -Potvin
  * dump_map function.
  */
-static void dump_map(Client *client, Client *server, char *mask, int prompt_length, int length)
+static void dump_map(Client *client, MapNode *node, int prompt_length, int length)
 {
 	static char prompt[64];
 	char *p = &prompt[prompt_length];
 	int  cnt = 0;
-	Client *acptr;
+	MapNode *child;
 
 	*p = '\0';
 
 	if (prompt_length > 60)
-		sendnumeric(client, RPL_MAPMORE, prompt, length, server->name);
+		sendnumeric(client, RPL_MAPMORE, prompt, length, node->server->name);
 	else
 	{
 		sendnumeric(client, RPL_MAP, prompt,
-		            length, server->name, server->serv->users, IsOper(client) ? server->id : "");
+		            length, node->server->name, node->server->serv->users, IsOper(client) ? node->server->id : "");
 		cnt = 0;
 	}
 
@@ -86,26 +169,17 @@ static void dump_map(Client *client, Client *server, char *mask, int prompt_leng
 
 	strcpy(p, "|-");
 
-	list_for_each_entry(acptr, &global_server_list, client_node)
-	{
-		if (acptr->srvptr != server ||
- 		    (IsULine(acptr) && HIDE_ULINES && !ValidatePermissionsForPath("server:info:map:ulines",client,NULL,NULL,NULL)))
-			continue;
-		SetMap(acptr);
-		cnt++;
-	}
+	for (child = node->children; child; child = child->sibling)
+		if (!child->hidden)
+			cnt++;
 
-	list_for_each_entry(acptr, &global_server_list, client_node)
+	for (child = node->children; child; child = child->sibling)
 	{
-		if (IsULine(acptr) && HIDE_ULINES && !ValidatePermissionsForPath("server:info:map:ulines",client,NULL,NULL,NULL))
-			continue;
-		if (acptr->srvptr != server)
-			continue;
-		if (!IsMap(acptr))
+		if (child->hidden)
 			continue;
 		if (--cnt == 0)
 			*p = '`';
-		dump_map(client, acptr, mask, prompt_length + 2, length - 2);
+		dump_map(client, child, prompt_length + 2, length - 2);
 	}
 
 	if (prompt_length > 0)
@@ -167,7 +241,11 @@ CMD_FUNC(cmd_map)
 	if (FLAT_MAP && !ValidatePermissionsForPath("server:info:map:real-map",client,NULL,NULL,NULL))
 		dump_flat_map(client, &me, longest);
 	else
-		dump_map(client, &me, "*", 0, longest);
+	{
+		MapNode *snapshot = map_snapshot_build(client);
+		dump_map(client, &snapshot[0], 0, longest);
+		safe_free(snapshot);
+	}
 
 	sendnumeric(client, RPL_MAPEND);
 }
@@ -115,7 +115,7 @@ void mtag_add_or_inherit_msgid(Client *sender, MessageTag *recv_mtags, MessageTa
 {
 	MessageTag *m = find_mtag(recv_mtags, "msgid");
 	if (m)
-		m = duplicate_mtag(m);
+		m = signature ? duplicate_mtag(m) : duplicate_mtag_shared(m); /* the signature case rewrites m->value below, so it needs a private copy */
 	else
 		m = mtag_generate_msgid();
 
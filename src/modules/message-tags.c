@@ -195,13 +195,12 @@ void _parse_message_tags(Client *client, char **str, MessageTag **mtag_list)
 		 */
 		if (message_tag_ok(client, name, value))
 		{
-			m = safe_alloc(sizeof(MessageTag));
-			safe_strdup(m->name, name);
-			/* Both NULL and empty become NULL: */
-			if (BadPtr(value))
-				m->value = NULL;
-			else /* a real value... */
-				safe_strdup(m->value, value);
+			/* The tag list only lives for the duration of this
+			 * message, so the tags are carved out of the
+			 * per-message arena rather than heap-allocated.
+			 * Both NULL and empty value become NULL.
+			 */
+			m = new_mtag_arena(name, BadPtr(value) ? NULL : value);
 			AddListItem(m, *mtag_list);
 		}
 	}
@@ -209,31 +208,17 @@ void _parse_message_tags(Client *client, char **str, MessageTag **mtag_list)
 	*str = remainder + 1;
 }
 
-/** Outgoing filter for tags */
-int client_accepts_tag(const char *token, Client *client)
+/** The cap-derived part of the outgoing tag filter: may this tag, in
+ * principle, be sent to this local client? The dynamic can_send
+ * filter (usually not present) is deliberately not part of this, so
+ * the answer can be cached, see mtag_accept_bitmap().
+ */
+static int client_accepts_handler_caps(MessageTagHandler *m, Client *client)
 {
-	MessageTagHandler *m;
-
-	/* Send all tags to remote links, without checking here.
-	 * Note that mtags_to_string() already prevents sending messages
-	 * with message tags to links without PROTOCTL MTAGS, so we can
-	 * simply always return 1 here, regardless of checking (again).
-	 */
-	if (IsServer(client) || !MyConnect(client))
-		return 1;
-
-	m = MessageTagHandlerFind(token);
-	if (!m)
-		return 0;
-
-	/* Maybe there is an outgoing filter in effect (usually not) */
-	if (m->can_send && !m->can_send(client))
-		return 0;
-
 	/* If the client has indicated 'message-tags' support then we can
 	 * send any message tag, regardless of other CAP's.
 	 */
-	if (HasCapability(client, "message-tags"))
+	if (client->local->caps & CAP_MESSAGE_TAGS)
 		return 1;
 
 	/* We continue here if the client did not indicate 'message-tags' support... */
@@ -253,6 +238,60 @@ int client_accepts_tag(const char *token, Client *client)
 	return 0;
 }
 
+/** Bitmap of registered message tags this local client accepts: an OR
+ * of the handler ->bit values. Derived purely from the cap bitmask and
+ * cached on the client, recomputed only when the caps change or a
+ * message tag handler gets (un)registered. This way the per-recipient
+ * fanout filter is a single AND instead of a handler list walk per tag.
+ */
+static long mtag_accept_bitmap(Client *client)
+{
+	MessageTagHandler *m;
+	long accept;
+
+	if ((client->local->mtag_accept_caps == client->local->caps) &&
+	    (client->local->mtag_accept_gen == mtag_handler_generation))
+		return client->local->mtag_accept;
+
+	accept = 0;
+	for (m = mtaghandlers; m; m = m->next)
+		if (m->bit && client_accepts_handler_caps(m, client))
+			accept |= m->bit;
+
+	client->local->mtag_accept = accept;
+	client->local->mtag_accept_caps = client->local->caps;
+	client->local->mtag_accept_gen = mtag_handler_generation;
+	return accept;
+}
+
+/** Outgoing filter for tags */
+int client_accepts_tag(const char *token, Client *client)
+{
+	MessageTagHandler *m;
+
+	/* Send all tags to remote links, without checking here.
+	 * Note that mtags_to_string() already prevents sending messages
+	 * with message tags to links without PROTOCTL MTAGS, so we can
+	 * simply always return 1 here, regardless of checking (again).
+	 */
+	if (IsServer(client) || !MyConnect(client))
+		return 1;
+
+	m = MessageTagHandlerFind(token);
+	if (!m)
+		return 0;
+
+	if (m->bit ? !(mtag_accept_bitmap(client) & m->bit)
+	           : !client_accepts_handler_caps(m, client))
+		return 0;
+
+	/* Maybe there is an outgoing filter in effect (usually not) */
+	if (m->can_send && !m->can_send(client))
+		return 0;
+
+	return 1;
+}
+
 /** Return the message tag string (without @) of the message tag linked list.
  * Taking into account the restrictions that 'client' may have.
  * @returns A string (static buffer) or NULL if no tags at all (!)
@@ -261,6 +300,10 @@ char *_mtags_to_string(MessageTag *m, Client *client)
 {
 	static char buf[4096], name[8192], value[8192];
 	char tbuf[512];
+	MessageTag *head = m, *t;
+	int local_client, cacheable;
+	long accept = 0;
+	int i;
 
 	if (!m)
 		return NULL;
@@ -269,11 +312,52 @@ char *_mtags_to_string(MessageTag *m, Client *client)
 	if (client->direction && IsServer(client->direction) && !SupportMTAGS(client->direction))
 		return NULL;
 
+	/* For local (non-server) clients the result depends purely on the
+	 * cap bitmask, unless one of the tags has a dynamic outgoing
+	 * filter (can_send). In that common case we memoize the rendered
+	 * string on the list head, so a fanout to thousands of recipients
+	 * only stringifies each cap-variant once.
+	 */
+	local_client = MyConnect(client) && !IsServer(client);
+	cacheable = local_client;
+	if (cacheable)
+	{
+		for (t = head; t; t = t->next)
+		{
+			if (!t->handler)
+				t->handler = MessageTagHandlerFind(t->name);
+			if (t->handler && t->handler->can_send)
+			{
+				cacheable = 0;
+				break;
+			}
+		}
+	}
+
+	if (cacheable && head->memo)
+	{
+		for (i = 0; i < head->memo->n; i++)
+			if (head->memo->caps[i] == client->local->caps)
+				return *head->memo->str[i] ? head->memo->str[i] : NULL;
+	}
+
+	if (local_client)
+		accept = mtag_accept_bitmap(client);
+
 	*buf = '\0';
 	for (; m; m = m->next)
 	{
-		if (!client_accepts_tag(m->name, client))
-			continue;
+		if (local_client)
+		{
+			MessageTagHandler *h = m->handler;
+			if (!h && !(h = m->handler = MessageTagHandlerFind(m->name)))
+				continue;
+			if (h->bit ? !(accept & h->bit)
+			           : !client_accepts_handler_caps(h, client))
+				continue;
+			if (h->can_send && !h->can_send(client))
+				continue;
+		}
 		if (m->value)
 		{
 			message_tag_escape(m->name, name);
@@ -286,11 +370,25 @@ char *_mtags_to_string(MessageTag *m, Client *client)
 		strlcat(buf, tbuf, sizeof(buf));
 	}
 
+	/* Strip off the final semicolon */
+	if (*buf)
+		buf[strlen(buf)-1] = '\0';
+
+	if (cacheable)
+	{
+		if (!head->memo)
+			head->memo = safe_alloc(sizeof(MessageTagMemo));
+		if (head->memo->n < MTAG_MEMO_SLOTS)
+		{
+			/* An empty string records the "no visible tags" result */
+			head->memo->caps[head->memo->n] = client->local->caps;
+			safe_strdup(head->memo->str[head->memo->n], buf);
+			head->memo->n++;
+		}
+	}
+
 	if (!*buf)
 		return NULL;
 
-	/* Strip off the final semicolon */
-	buf[strlen(buf)-1] = '\0';
-
 	return buf;
 }
@@ -299,6 +299,14 @@ void cmd_message(Client *client, MessageTag *recv_mtags, int parc, char *parv[],
 
 	if (MyConnect(client))
 		parv[1] = (char *)canonize(parv[1]);
+	else
+	{
+		/* The strtoken() below would otherwise chop up the shared
+		 * parse buffer in place, see the CMD_FUNC documentation.
+		 * (For local clients canonize() already returns a copy.)
+		 */
+		parv[1] = parse_scratch_copy(parv[1]);
+	}
 
 	for (p = NULL, targetstr = strtoken(&p, parv[1], ","); targetstr; targetstr = strtoken(&p, NULL, ","))
 	{
@@ -760,6 +768,160 @@ int ban_version(Client *client, char *text)
 	return 0;
 }
 
+/** Shared scanner for the text transformation pipeline.
+ * Produces both the color-stripped view (what StripColors() would
+ * return) and the fully control code stripped view (what
+ * StripControlCodes() would return) of 'text' in a single pass,
+ * so the HOOKTYPE_TEXT_TRANSFORM modules (+S, +G, ..) don't each
+ * rescan and recopy the message.
+ * The state machine below is the same as in the two functions above.
+ */
+static void textpipe_scan(unsigned char *text, TextPipe *pipe)
+{
+	int len = strlen(text), save_len = 0;
+	char nc = 0, col = 0, rgb = 0;
+	unsigned char *save_text = NULL;
+	static unsigned char view_color[4096];
+	static unsigned char view_stripped[4096];
+	int c = 0, s = 0;
+
+	while (len > 0)
+	{
+		if (col && ((isdigit(*text) && nc < 2) || (*text == ',' && nc < 3)))
+		{
+			nc++;
+			if (*text == ',')
+				nc = 0;
+		}
+		/* Syntax for RGB is ^DHHHHHH where H is a hex digit.
+		 * If < 6 hex digits are specified, the code is displayed
+		 * as text
+		 */
+		else if ((rgb && isxdigit(*text) && nc < 6) || (rgb && *text == ',' && nc < 7))
+		{
+			nc++;
+			if (*text == ',')
+				nc = 0;
+		}
+		else
+		{
+			if (col)
+				col = 0;
+			if (rgb)
+			{
+				if (nc != 6)
+				{
+					text = save_text+1;
+					len = save_len-1;
+					rgb = 0;
+					continue;
+				}
+				rgb = 0;
+			}
+			switch (*text)
+			{
+			case 3:
+				/* color */
+				col = 1;
+				nc = 0;
+				break;
+			case 4:
+				/* RGB */
+				save_text = text;
+				save_len = len;
+				rgb = 1;
+				nc = 0;
+				break;
+			case 22:
+				/* reverse: stripped from both views */
+				break;
+			case 2:  /* bold */
+			case 31: /* underline */
+			case 15: /* plain */
+			case 29: /* italic */
+			case 30: /* strikethrough */
+			case 17: /* monospace */
+				/* not a color code, only the fully stripped view drops these */
+				view_color[c++] = *text;
+				break;
+			case 0xe2:
+				if (!strncmp(text+1, "\x80\x8b", 2))
+				{
+					/* ZWSP: kept in the color view, dropped from the stripped view */
+					view_color[c++] = text[0];
+					view_color[c++] = text[1];
+					view_color[c++] = text[2];
+					/* +2 means we skip 3 */
+					text += 2;
+					len -= 2;
+					break;
+				}
+				/*fallthrough*/
+			default:
+				view_color[c++] = *text;
+				view_stripped[s++] = *text;
+				break;
+			}
+		}
+		text++;
+		len--;
+	}
+	view_color[c] = '\0';
+	view_stripped[s] = '\0';
+	pipe->text_colorstripped = view_color;
+	pipe->text_stripped = view_stripped;
+}
+
+/** May is_banned() verdicts be cached for this channel?
+ * Verdicts can only be reused between messages if no ban or except
+ * entry depends on the message contents (EXTBOPT_MSGCONTENT, eg ~T)
+ * and every extban involved is known to us. The answer is memoized on
+ * the channel per acl_generation, so the list walk happens once per
+ * channel change rather than once per message.
+ */
+static int ban_verdict_cacheable(Channel *channel)
+{
+	Ban *lists[2], *ban;
+	char *p;
+	int i;
+
+	if ((channel->acl_cacheable != 0) && (channel->acl_cacheable_gen == channel->acl_generation))
+		return (channel->acl_cacheable == 2);
+
+	lists[0] = channel->banlist;
+	lists[1] = channel->exlist;
+
+	channel->acl_cacheable = 2;
+	for (i = 0; (i < 2) && (channel->acl_cacheable == 2); i++)
+	{
+		for (ban = lists[i]; ban; ban = ban->next)
+		{
+			/* Check every extban in the mask, including ones
+			 * nested behind action modifiers ("..:~X").
+			 */
+			for (p = ban->banstr; p; )
+			{
+				if (*p == '~')
+				{
+					Extban *extban = findmod_by_bantype(p[1]);
+					if (!extban || (extban->options & EXTBOPT_MSGCONTENT))
+					{
+						channel->acl_cacheable = 1;
+						break;
+					}
+				}
+				p = strchr(p, ':');
+				if (p)
+					p++;
+			}
+			if (channel->acl_cacheable == 1)
+				break;
+		}
+	}
+	channel->acl_cacheable_gen = channel->acl_generation;
+	return (channel->acl_cacheable == 2);
+}
+
 /** Can user send a message to this channel?
  * @param client    The client
  * @param channel   The channel
@@ -822,6 +984,44 @@ int _can_send_to_channel(Client *client, Channel *channel, char **msgtext, char
 		}
 	}
 
+	/* Text transformation pipeline: modules that match on or rewrite
+	 * the message text (+S, +G, ..) hook in here. The control code
+	 * stripped views they work on are produced once, in a single pass,
+	 * by textpipe_scan() and shared between all of them.
+	 */
+	if (Hooks[HOOKTYPE_TEXT_TRANSFORM] && *msgtext && **msgtext)
+	{
+		TextPipe pipe;
+
+		textpipe_scan((unsigned char *)*msgtext, &pipe);
+		for (h = Hooks[HOOKTYPE_TEXT_TRANSFORM]; h; h = h->next)
+		{
+			i = (*(h->func.intfunc))(client, channel, lp, msgtext, &pipe, errmsg, sendtype);
+			if (i != HOOK_CONTINUE)
+			{
+				if (!*errmsg)
+				{
+					ircd_log(LOG_ERROR, "Module %s did not set errmsg!!!", h->owner->header->name);
+					abort();
+				}
+				/* Don't send message if the user was previously a member
+				 * and isn't anymore, so if the user is KICK'ed, eg by floodprot.
+				 */
+				if (member && !IsDead(client) && !find_membership_link(client->user->channel, channel))
+					*errmsg = NULL;
+				return 0;
+			}
+			if (!*msgtext || !**msgtext)
+			{
+				if (sendtype != SEND_TYPE_TAGMSG)
+					return 0;
+				else
+					*msgtext = "";
+			}
+		}
+		i = 0;
+	}
+
 	/* Modules can plug in as well */
 	for (h = Hooks[HOOKTYPE_CAN_SEND_TO_CHANNEL]; h; h = h->next)
 	{
@@ -864,13 +1064,34 @@ int _can_send_to_channel(Client *client, Channel *channel, char **msgtext, char
 
 	if ((!lp
 	    || !(lp->flags & (CHFL_CHANOP | CHFL_VOICE | CHFL_CHANOWNER |
-	    CHFL_HALFOP | CHFL_CHANADMIN))) && MyUser(client)
-	    && is_banned(client, channel, BANCHK_MSG, msgtext, errmsg))
+	    CHFL_HALFOP | CHFL_CHANADMIN))) && MyUser(client))
 	{
-		/* Modules can set 'errmsg', otherwise we default to this: */
-		if (!*errmsg)
-			*errmsg = "You are banned";
-		return 0;
+		/* Steady-state fast path: if neither the channel (modes,
+		 * bans, membership) nor the client identity changed since
+		 * the last message, the ban walk would come to the exact
+		 * same verdict, so skip it. Only "not banned" is ever
+		 * cached; a deny always re-runs the walk so the proper
+		 * (possibly extban-specific) error message is generated.
+		 */
+		if (lp && lp->acl_not_banned
+		    && (lp->acl_generation == channel->acl_generation)
+		    && (lp->acl_client_generation == client->user->acl_generation))
+			return 1;
+
+		if (is_banned(client, channel, BANCHK_MSG, msgtext, errmsg))
+		{
+			/* Modules can set 'errmsg', otherwise we default to this: */
+			if (!*errmsg)
+				*errmsg = "You are banned";
+			return 0;
+		}
+
+		if (lp && ban_verdict_cacheable(channel))
+		{
+			lp->acl_not_banned = 1;
+			lp->acl_generation = channel->acl_generation;
+			lp->acl_client_generation = client->user->acl_generation;
+		}
 	}
 
 	return 1;
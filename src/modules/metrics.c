@@ -0,0 +1,227 @@
+/*
+ * metrics - OpenMetrics (Prometheus) exporter
+ * (C)Copyright 2021 Bram Matthys and the UnrealIRCd team
+ * License: GPLv2
+ *
+ * Serves the counters the server maintains anyway - user/channel
+ * counts, per-command timing, the main loop latency histogram, sendq
+ * usage, memory pool telemetry and the memory accounting registry - in
+ * OpenMetrics text format over a dedicated listener:
+ *
+ *   listen { ip 127.0.0.1; port 9099; options { metrics; } }
+ *
+ * A scrape is a plain HTTP GET; we render, flush and close. Everything
+ * is read-only rendering of already-maintained counters, so scraping
+ * costs nothing on the IRC hot path - bind the listener to localhost
+ * or firewall it, the exporter itself has no authentication.
+ */
+
+#include "unrealircd.h"
+
+ModuleHeader MOD_HEADER
+  = {
+	"metrics",
+	"1.0.0",
+	"OpenMetrics exporter for monitoring scrapers",
+	"UnrealIRCd Team",
+	"unrealircd-5",
+    };
+
+/* Forward declarations */
+int metrics_packet_in(Client *client, char *readbuf, int *length);
+static void metrics_render(Client *client);
+
+MOD_INIT()
+{
+	MARK_AS_OFFICIAL_MODULE(modinfo);
+
+	HookAdd(modinfo->handle, HOOKTYPE_RAWPACKET_IN, INT_MIN, metrics_packet_in);
+
+	return MOD_SUCCESS;
+}
+
+MOD_LOAD()
+{
+	return MOD_SUCCESS;
+}
+
+MOD_UNLOAD()
+{
+	return MOD_SUCCESS;
+}
+
+/** Append one formatted line to the scrape response.
+ * Same sendQ bypass as the websocket handshake response: this is
+ * bounded text served once to a connection that is closed right after.
+ */
+static void metrics_sendf(Client *client, FORMAT_STRING(const char *format), ...)
+{
+	va_list vl;
+	char buf[1024];
+	int n;
+
+	va_start(vl, format);
+	n = ircvsnprintf(buf, sizeof(buf), format, vl);
+	va_end(vl);
+	dbuf_put(&client->local->sendQ, buf, n);
+}
+
+/** Intercept data on metrics listeners: answer the HTTP GET and close.
+ * Runs at INT_MIN priority so not even the websocket module sees these
+ * connections; they never register as IRC clients.
+ */
+int metrics_packet_in(Client *client, char *readbuf, int *length)
+{
+	if (!client->local || !client->local->listener ||
+	    !(client->local->listener->options & LISTENER_METRICS))
+		return 1; /* not for us */
+
+	if (*length < 4)
+		return 0; /* wait for more data (first packet cut very short) */
+
+	if (!strncmp(readbuf, "GET ", 4))
+	{
+		metrics_sendf(client, "HTTP/1.1 200 OK\r\n"
+		                      "Content-Type: text/plain; version=0.0.4\r\n"
+		                      "Connection: close\r\n\r\n");
+		metrics_render(client);
+	} else {
+		metrics_sendf(client, "HTTP/1.1 400 Bad Request\r\n"
+		                      "Connection: close\r\n\r\n");
+	}
+	send_queued(client);
+	dead_socket(client, "Metrics scrape served"); /* close_connection() flushes the rest */
+	return -1;
+}
+
+/** Render the scrape body. All numbers come from counters that are
+ * maintained elsewhere anyway; nothing here writes any state.
+ */
+static void metrics_render(Client *client)
+{
+	RealCommand *mptr;
+	MemoryCounter *mc;
+	mp_pool_t *pool;
+	mp_pool_usage_t usage;
+	Client *acptr;
+	long long cumulative, sendq_total, sendq_max, v;
+	int i;
+
+	metrics_sendf(client, "# TYPE unrealircd_info gauge\n"
+		"unrealircd_info{version=\"%s\"} 1\n", VERSIONONLY);
+	metrics_sendf(client, "# TYPE unrealircd_uptime_seconds gauge\n"
+		"unrealircd_uptime_seconds %lld\n", (long long)(TStime() - me.local->since));
+
+	/* The LUSERS counters */
+	metrics_sendf(client, "# TYPE unrealircd_clients gauge\n"
+		"unrealircd_clients{scope=\"local\"} %d\n"
+		"unrealircd_clients{scope=\"global\"} %d\n"
+		"unrealircd_clients{scope=\"unknown\"} %d\n",
+		irccounts.me_clients, irccounts.clients, irccounts.unknown);
+	metrics_sendf(client, "# TYPE unrealircd_servers gauge\n"
+		"unrealircd_servers %hu\n", irccounts.servers);
+	metrics_sendf(client, "# TYPE unrealircd_operators gauge\n"
+		"unrealircd_operators %d\n", irccounts.operators);
+	metrics_sendf(client, "# TYPE unrealircd_channels gauge\n"
+		"unrealircd_channels %d\n", irccounts.channels);
+
+	/* Per-command counters, as shown by /STATS M and /STATS R */
+	metrics_sendf(client, "# TYPE unrealircd_command_calls_total counter\n");
+	for (i = 0; i < 256; i++)
+		for (mptr = CommandHash[i]; mptr; mptr = mptr->next)
+			if (mptr->count)
+				metrics_sendf(client, "unrealircd_command_calls_total{command=\"%s\"} %u\n",
+					mptr->cmd, mptr->count);
+	metrics_sendf(client, "# TYPE unrealircd_command_seconds_total counter\n");
+	for (i = 0; i < 256; i++)
+		for (mptr = CommandHash[i]; mptr; mptr = mptr->next)
+			if (mptr->count)
+				metrics_sendf(client, "unrealircd_command_seconds_total{command=\"%s\"} %lld.%06lld\n",
+					mptr->cmd, mptr->time_usec / 1000000, mptr->time_usec % 1000000);
+	metrics_sendf(client, "# TYPE unrealircd_command_max_seconds gauge\n");
+	for (i = 0; i < 256; i++)
+		for (mptr = CommandHash[i]; mptr; mptr = mptr->next)
+			if (mptr->count)
+				metrics_sendf(client, "unrealircd_command_max_seconds{command=\"%s\"} %lld.%06lld\n",
+					mptr->cmd, mptr->time_max_usec / 1000000, mptr->time_max_usec % 1000000);
+
+	/* Main loop latency histogram, same buckets as /STATS latency
+	 * (powers of two in milliseconds), rendered cumulatively as a
+	 * proper histogram.
+	 */
+	metrics_sendf(client, "# TYPE unrealircd_mainloop_busy_seconds histogram\n");
+	cumulative = 0;
+	for (i = 0; i < LOOP_LATENCY_BUCKETS - 1; i++)
+	{
+		cumulative += loop_latency_hist[i];
+		metrics_sendf(client, "unrealircd_mainloop_busy_seconds_bucket{le=\"%g\"} %lld\n",
+			(double)(1 << i) / 1000.0, cumulative);
+	}
+	cumulative += loop_latency_hist[LOOP_LATENCY_BUCKETS - 1];
+	metrics_sendf(client, "unrealircd_mainloop_busy_seconds_bucket{le=\"+Inf\"} %lld\n", cumulative);
+	metrics_sendf(client, "unrealircd_mainloop_busy_seconds_sum %lld.%03lld\n",
+		loop_latency_total_msec / 1000, loop_latency_total_msec % 1000);
+	metrics_sendf(client, "unrealircd_mainloop_busy_seconds_count %lld\n", cumulative);
+	metrics_sendf(client, "# TYPE unrealircd_mainloop_busy_max_seconds gauge\n"
+		"unrealircd_mainloop_busy_max_seconds %lld.%03lld\n",
+		loop_latency_max_msec / 1000, loop_latency_max_msec % 1000);
+	metrics_sendf(client, "# TYPE unrealircd_mainloop_stalls_total counter\n"
+		"unrealircd_mainloop_stalls_total %lld\n", loop_latency_stalls);
+
+	/* Send queue watermarks over all local connections */
+	sendq_total = sendq_max = 0;
+	list_for_each_entry(acptr, &lclient_list, lclient_node)
+	{
+		v = DBufLength(&acptr->local->sendQ);
+		sendq_total += v;
+		if (v > sendq_max)
+			sendq_max = v;
+	}
+	metrics_sendf(client, "# TYPE unrealircd_sendq_bytes gauge\n"
+		"unrealircd_sendq_bytes %lld\n", sendq_total);
+	metrics_sendf(client, "# TYPE unrealircd_sendq_max_bytes gauge\n"
+		"unrealircd_sendq_max_bytes %lld\n", sendq_max);
+
+	/* Memory pool telemetry, as shown by /STATS z */
+	metrics_sendf(client, "# TYPE unrealircd_mempool_items_in_use gauge\n");
+	for (pool = mp_pools(); pool; pool = pool->next)
+	{
+		mp_pool_usage(pool, &usage);
+		metrics_sendf(client, "unrealircd_mempool_items_in_use{pool=\"%s\"} %lld\n",
+			usage.name ? usage.name : "???", usage.items_in_use);
+	}
+	metrics_sendf(client, "# TYPE unrealircd_mempool_items_capacity gauge\n");
+	for (pool = mp_pools(); pool; pool = pool->next)
+	{
+		mp_pool_usage(pool, &usage);
+		metrics_sendf(client, "unrealircd_mempool_items_capacity{pool=\"%s\"} %lld\n",
+			usage.name ? usage.name : "???", usage.items_capacity);
+	}
+	metrics_sendf(client, "# TYPE unrealircd_mempool_bytes_committed gauge\n");
+	for (pool = mp_pools(); pool; pool = pool->next)
+	{
+		mp_pool_usage(pool, &usage);
+		metrics_sendf(client, "unrealircd_mempool_bytes_committed{pool=\"%s\"} %lld\n",
+			usage.name ? usage.name : "???", (long long)usage.bytes_committed);
+	}
+
+	/* The memory accounting registry, as shown by /STATS Z */
+	metrics_sendf(client, "# TYPE unrealircd_subsystem_objects gauge\n");
+	for (mc = memorycounters; mc; mc = mc->next)
+	{
+		long long objects = 0, bytes = 0;
+		mc->count(&objects, &bytes);
+		metrics_sendf(client, "unrealircd_subsystem_objects{subsystem=\"%s\"} %lld\n",
+			mc->name, objects);
+	}
+	metrics_sendf(client, "# TYPE unrealircd_subsystem_bytes gauge\n");
+	for (mc = memorycounters; mc; mc = mc->next)
+	{
+		long long objects = 0, bytes = 0;
+		mc->count(&objects, &bytes);
+		metrics_sendf(client, "unrealircd_subsystem_bytes{subsystem=\"%s\"} %lld\n",
+			mc->name, bytes);
+	}
+
+	metrics_sendf(client, "# EOF\n");
+}
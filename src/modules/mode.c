@@ -67,11 +67,25 @@ MOD_TEST()
 	return MOD_SUCCESS;
 }
 
+/** Direct mode letter to corechannelmodetable entry mapping, so set_mode()
+ * resolves a letter with one lookup instead of a scan per letter - services
+ * routinely send long batched mode strings. Built once in MOD_INIT, the
+ * core table is static.
+ */
+static CoreChannelModeTable *coremodeindex[256];
+
 MOD_INIT()
 {
+	CoreChannelModeTable *tab;
+
 	CommandAdd(modinfo->handle, MSG_MODE, cmd_mode, MAXPARA, CMD_USER|CMD_SERVER);
 	CommandAdd(modinfo->handle, MSG_MLOCK, cmd_mlock, MAXPARA, CMD_SERVER);
 	MARK_AS_OFFICIAL_MODULE(modinfo);
+
+	memset(&coremodeindex, 0, sizeof(coremodeindex));
+	for (tab = &corechannelmodetable[0]; tab->mode; tab++)
+		coremodeindex[(unsigned char)tab->flag] = tab;
+
 	return MOD_SUCCESS;
 }
 
@@ -317,7 +331,7 @@ static void mode_cutoff2(Client *client, Channel *channel, int *parc_out, char *
 	/* Calculate length of MODE if it would go through fully as-is */
 	/* :nick!user@host MODE #channel +something param1 param2 etc... */
 	len = strlen(client->name) + strlen(client->user->username) + strlen(GetHost(client)) +
-	      strlen(channel->chname) + 11;
+	      channel->chnamelen + 11;
 
 	len += strlen(parv[2]);
 
@@ -1422,7 +1436,7 @@ void _set_mode(Channel *channel, Client *client, int parc, char *parv[], u_int *
 	unsigned int htrig = 0;
 	long oldm, oldl;
 	int checkrestr = 0, warnrestr = 1;
-	int extm = 1000000; /* (default value not used but stops gcc from complaining) */
+	Cmode *extcm = NULL;
 	Cmode_t oldem;
 	long my_access;
 	paracount = 1;
@@ -1431,6 +1445,8 @@ void _set_mode(Channel *channel, Client *client, int parc, char *parv[], u_int *
 	oldm = channel->mode.mode;
 	oldl = channel->mode.limit;
 	oldem = channel->mode.extmode;
+	/* Conservative: any MODE (attempt) invalidates cached can-send verdicts */
+	channel->acl_generation++;
 	if (RESTRICT_CHANNELMODES && !ValidatePermissionsForPath("immune:restrict-channelmodes",client,NULL,channel,NULL)) /* "cache" this */
 		checkrestr = 1;
 
@@ -1462,29 +1478,15 @@ void _set_mode(Channel *channel, Client *client, int parc, char *parv[], u_int *
 					}
 				}
 				found = 0;
-				tab = &corechannelmodetable[0];
-				while ((tab->mode != 0x0) && found == 0)
-				{
-					if (tab->flag == *curchr)
-					{
-						found = 1;
-						foundat = *tab;
-					}
-					tab++;
-				}
-				if (found == 1)
+				if ((tab = coremodeindex[(unsigned char)*curchr]))
 				{
+					found = 1;
+					foundat = *tab;
 					modetype = foundat.mode;
 				} else {
 					/* Maybe in extmodes */
-					for (extm=0; extm <= Channelmode_highest; extm++)
-					{
-						if (Channelmode_Table[extm].flag == *curchr)
-						{
-							found = 2;
-							break;
-						}
-					}
+					if ((extcm = extcmode_find(*curchr)))
+						found = 2;
 				}
 				if (found == 0) /* Mode char unknown */
 				{
@@ -1546,7 +1548,7 @@ void _set_mode(Channel *channel, Client *client, int parc, char *parv[], u_int *
 				}
 				else if (found == 2)
 				{
-					paracount += do_extmode_char(channel, &Channelmode_Table[extm], argument,
+					paracount += do_extmode_char(channel, extcm, argument,
 								     what, client, pcount, pvar, bounce);
 				}
 				break;
@@ -1746,26 +1748,25 @@ CMD_FUNC(_cmd_umode)
 				break;
 			default:
 			def:
-				for (i = 0; i <= Usermode_highest; i++)
+			{
+				Umode *um = find_usermode(*m);
+
+				if (um)
 				{
-					if (*m == Usermode_Table[i].flag)
-					{
-						if (Usermode_Table[i].allowed)
-						if (!Usermode_Table[i].allowed(client,what))
-							break;
-						if (what == MODE_ADD)
-							client->umodes |= Usermode_Table[i].mode;
-						else
-							client->umodes &= ~Usermode_Table[i].mode;
+					if (um->allowed && !um->allowed(client, what))
 						break;
-					}
-					else if (i == Usermode_highest && MyConnect(client) && !rpterror)
-					{
-						sendnumeric(client, ERR_UMODEUNKNOWNFLAG);
-						rpterror = 1;
-					}
+					if (what == MODE_ADD)
+						client->umodes |= um->mode;
+					else
+						client->umodes &= ~um->mode;
+				}
+				else if (MyConnect(client) && !rpterror)
+				{
+					sendnumeric(client, ERR_UMODEUNKNOWNFLAG);
+					rpterror = 1;
 				}
 				break;
+			}
 		} /* switch */
 	} /* for */
 
@@ -1873,6 +1874,7 @@ CMD_FUNC(_cmd_umode)
 	if ((oldumodes & UMODE_OPER) && !IsOper(client) && MyConnect(client))
 	{
 		list_del(&client->special_node);
+		invalidate_snomask_subscribers();
 		remove_oper_privileges(client, 0);
 		RunHook2(HOOKTYPE_LOCAL_OPER, client, 0);
 	}
@@ -1910,12 +1912,19 @@ CMD_FUNC(_cmd_umode)
 	 * will cause servers to update correctly.
 	 */
 	if (oldumodes != client->umodes)
+	{
+		if (client->user)
+			client->user->acl_generation++; /* umodes can matter to ban masks (eg ~O) */
 		RunHook3(HOOKTYPE_UMODE_CHANGE, client, oldumodes, client->umodes);
+	}
 	if (dontspread == 0)
 		send_umode_out(client, 1, oldumodes);
 
 	if (MyConnect(client) && setsnomask != client->user->snomask)
+	{
+		invalidate_snomask_subscribers();
 		sendnumeric(client, RPL_SNOMASK, get_snomask_string(client));
+	}
 }
 
 CMD_FUNC(cmd_mlock)
@@ -0,0 +1,218 @@
+/*
+ *   IRC - Internet Relay Chat, src/modules/monitor.c
+ *   (C) 2021 The UnrealIRCd Team
+ *
+ *   See file AUTHORS in IRC package for additional names of
+ *   the programmers.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 1, or (at your option)
+ *   any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "unrealircd.h"
+
+CMD_FUNC(cmd_monitor);
+
+#define MSG_MONITOR 	"MONITOR"
+
+ModuleHeader MOD_HEADER
+  = {
+	"monitor",
+	"5.0",
+	"command /monitor",
+	"UnrealIRCd Team",
+	"unrealircd-5",
+    };
+
+MOD_INIT()
+{
+	CommandAdd(modinfo->handle, MSG_MONITOR, cmd_monitor, MAXPARA, CMD_USER);
+	MARK_AS_OFFICIAL_MODULE(modinfo);
+	ISupportSetFmt(modinfo->handle, "MONITOR", "%d", MAXWATCH);
+	return MOD_SUCCESS;
+}
+
+MOD_LOAD()
+{
+	return MOD_SUCCESS;
+}
+
+MOD_UNLOAD()
+{
+	return MOD_SUCCESS;
+}
+
+/** Comma separated reply line under construction (MONITOR replies list
+ * as many targets as fit on one numeric, unlike the one-target-per-line
+ * WATCH numerics).
+ */
+typedef struct MonitorReply MonitorReply;
+struct MonitorReply {
+	int numeric;
+	int count;
+	char buf[BUFSIZE];
+};
+
+static void monitor_reply_init(Client *client, MonitorReply *r, int numeric)
+{
+	r->numeric = numeric;
+	r->count = strlen(client->name) + strlen(me.name) + 10;
+	*r->buf = '\0';
+}
+
+static void monitor_reply_flush(Client *client, MonitorReply *r)
+{
+	if (*r->buf)
+		sendnumeric(client, r->numeric, r->buf);
+	r->count = strlen(client->name) + strlen(me.name) + 10;
+	*r->buf = '\0';
+}
+
+static void monitor_reply_add(Client *client, MonitorReply *r, char *item)
+{
+	if (*r->buf && (r->count + strlen(item) + 1 > BUFSIZE - 2))
+		monitor_reply_flush(client, r);
+	if (*r->buf)
+		strcat(r->buf, ",");
+	strcat(r->buf, item);
+	r->count += strlen(item) + 1;
+}
+
+/** Add 'target' to the proper online/offline reply being built */
+static void monitor_reply_status(Client *client, char *name, Client *target,
+                                 MonitorReply *online, MonitorReply *offline)
+{
+	char item[NICKLEN+USERLEN+HOSTLEN+4];
+
+	if (target)
+	{
+		ircsnprintf(item, sizeof(item), "%s!%s@%s",
+		    target->name, target->user->username,
+		    IsHidden(target) ? target->user->virthost : target->user->realhost);
+		monitor_reply_add(client, online, item);
+	}
+	else
+		monitor_reply_add(client, offline, name);
+}
+
+/*
+ * cmd_monitor
+ *
+ * The IRCv3 counterpart of /WATCH. Subscriptions live in the same
+ * watch hash as WATCH entries, so online/offline detection and the
+ * batched notification flush are shared between both commands - see
+ * flush_watch_notifications() in hash.c.
+ */
+CMD_FUNC(cmd_monitor)
+{
+	Client *target;
+	WatchLink *wl;
+	char *s, *p = NULL;
+	MonitorReply online, offline;
+
+	if (!MyUser(client))
+		return;
+
+	if (parc < 2 || BadPtr(parv[1]))
+		return;
+
+	if (*parv[1] == '+')
+	{
+		if (parc < 3 || BadPtr(parv[2]))
+			return;
+
+		monitor_reply_init(client, &online, RPL_MONONLINE);
+		monitor_reply_init(client, &offline, RPL_MONOFFLINE);
+		for (s = strtoken(&p, parv[2], ","); s; s = strtoken(&p, NULL, ","))
+		{
+			if (!do_nick_name(s))
+				continue;
+			if (client->local->monitors >= MAXWATCH)
+			{
+				sendnumeric(client, ERR_MONLISTFULL, MAXWATCH, s);
+				continue;
+			}
+			add_to_watch_hash_table(s, client, 0, 1);
+			monitor_reply_status(client, s, find_person(s, NULL), &online, &offline);
+		}
+		monitor_reply_flush(client, &online);
+		monitor_reply_flush(client, &offline);
+		return;
+	}
+
+	if (*parv[1] == '-')
+	{
+		if (parc < 3 || BadPtr(parv[2]))
+			return;
+
+		for (s = strtoken(&p, parv[2], ","); s; s = strtoken(&p, NULL, ","))
+			del_from_watch_hash_table(s, client, 1);
+		return;
+	}
+
+	if (*parv[1] == 'C' || *parv[1] == 'c')
+	{
+		hash_del_watch_subscriptions(client, 1);
+		return;
+	}
+
+	if (*parv[1] == 'L' || *parv[1] == 'l')
+	{
+		monitor_reply_init(client, &online, RPL_MONLIST);
+		for (wl = client->local->watch; wl; wl = wl->next_entry)
+			if (wl->monitor)
+				monitor_reply_add(client, &online, wl->entry->nick);
+		monitor_reply_flush(client, &online);
+		sendnumeric(client, RPL_ENDOFMONLIST);
+		return;
+	}
+
+	if (*parv[1] == 'S' || *parv[1] == 's')
+	{
+#define MONITORSTATUSBATCH 16
+		WatchLink *batch[MONITORSTATUSBATCH];
+		char *names[MONITORSTATUSBATCH];
+		Client *targets[MONITORSTATUSBATCH];
+		int n, i;
+
+		monitor_reply_init(client, &online, RPL_MONONLINE);
+		monitor_reply_init(client, &offline, RPL_MONOFFLINE);
+
+		/* Resolve the monitor list a batch at a time, which
+		 * overlaps the hash lookups (see find_persons).
+		 */
+		wl = client->local->watch;
+		while (wl)
+		{
+			for (n = 0; wl && (n < MONITORSTATUSBATCH); wl = wl->next_entry)
+			{
+				if (!wl->monitor)
+					continue; /* WATCH-only entry */
+				batch[n] = wl;
+				names[n] = wl->entry->nick;
+				n++;
+			}
+			find_persons(n, names, targets);
+
+			for (i = 0; i < n; i++)
+				monitor_reply_status(client, batch[i]->entry->nick,
+				    targets[i], &online, &offline);
+		}
+		monitor_reply_flush(client, &online);
+		monitor_reply_flush(client, &offline);
+		return;
+	}
+
+	/* Unknown subcommand.. Ignore it. :-) */
+}
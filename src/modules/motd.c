@@ -100,23 +100,27 @@ CMD_FUNC(cmd_motd)
 			themotd->last_modified.tm_min);
 	}
 
-	motdline = NULL;
-	if(themotd)
-		motdline = themotd->lines;
-	while (motdline)
+	if (!send_motd_cache(client, themotd, RPL_MOTD))
 	{
-		sendnumeric(client, RPL_MOTD,
-			motdline->line);
-		motdline = motdline->next;
+		motdline = themotd->lines;
+		while (motdline)
+		{
+			sendnumeric(client, RPL_MOTD,
+				motdline->line);
+			motdline = motdline->next;
+		}
 	}
 	svsmotd:
 
-	motdline = svsmotd.lines;
-	while (motdline)
+	if (!send_motd_cache(client, &svsmotd, RPL_MOTD))
 	{
-		sendnumeric(client, RPL_MOTD,
-			motdline->line);
-		motdline = motdline->next;
+		motdline = svsmotd.lines;
+		while (motdline)
+		{
+			sendnumeric(client, RPL_MOTD,
+				motdline->line);
+			motdline = motdline->next;
+		}
 	}
 	if (svsnofile == 0)
 		sendnumeric(client, RPL_ENDOFMOTD);
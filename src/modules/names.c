@@ -30,15 +30,63 @@ ModuleHeader MOD_HEADER
   = {
 	"names",
 	"5.0",
-	"command /names", 
+	"command /names",
 	"UnrealIRCd Team",
 	"unrealircd-5",
     };
 
+/* NAMES reply cache.
+ * The rendered RPL_NAMREPLY payloads are kept on the channel, one
+ * variant per multi-prefix/userhost-in-names cap combination, so a
+ * join storm on a busy channel does not re-render thousands of members
+ * for every single join (every join sends the full NAMES list).
+ * A variant is rendered on first use and stays valid as long as
+ * channel->acl_generation does not move, which is bumped on every
+ * membership, mode and member user@host change. Nick changes
+ * invalidate through the nickchange hooks below.
+ * The cache is only served to viewers that are a member of the channel
+ * and only when no member is hidden by mode +D rules, as those are the
+ * cases where the output is the same for every viewer.
+ */
+#define NAMES_CACHE_VARIANTS 4	/* bit 0 = multi-prefix, bit 1 = userhost-in-names */
+
+typedef struct NamesCache NamesCache;
+struct NamesCache {
+	unsigned int acl_generation[NAMES_CACHE_VARIANTS];	/**< channel->acl_generation the variant was rendered at (0 = never) */
+	MultiLine *lines[NAMES_CACHE_VARIANTS];			/**< rendered payloads. NULL with a current generation means the
+								     output was viewer dependent and cannot be served from cache. */
+};
+
+/* Global variables */
+ModDataInfo *names_md = NULL;
+
+/* Macros */
+#define NAMESCACHE(channel)	((NamesCache *)moddata_channel(channel, names_md).ptr)
+
+/* Forward declarations */
+int names_nickchange(Client *client, char *newnick);
+void names_md_free(ModData *md);
+
 MOD_INIT()
 {
-	CommandAdd(modinfo->handle, MSG_NAMES, cmd_names, MAXPARA, CMD_USER|CMD_SERVER);
+	ModDataInfo mreq;
+
 	MARK_AS_OFFICIAL_MODULE(modinfo);
+
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.name = "names";
+	mreq.type = MODDATATYPE_CHANNEL;
+	mreq.free = names_md_free;
+	names_md = ModDataAdd(modinfo->handle, mreq);
+	if (!names_md)
+	{
+		config_error("could not register names moddata");
+		return MOD_FAILED;
+	}
+
+	CommandAdd(modinfo->handle, MSG_NAMES, cmd_names, MAXPARA, CMD_USER|CMD_SERVER);
+	HookAdd(modinfo->handle, HOOKTYPE_LOCAL_NICKCHANGE, 0, names_nickchange);
+	HookAdd(modinfo->handle, HOOKTYPE_REMOTE_NICKCHANGE, 0, names_nickchange);
 	return MOD_SUCCESS;
 }
 
@@ -59,55 +107,23 @@ MOD_UNLOAD()
 
 static char buf[BUFSIZE];
 
-/*
-** cmd_names
-**	parv[1] = channel
-*/
-#define TRUNCATED_NAMES 64
-CMD_FUNC(cmd_names)
+/* Renders the RPL_NAMREPLY payload(s) for a channel.
+ * If 'cache' is NULL the lines are sent to 'client' directly, applying
+ * the viewer dependent visibility rules. Otherwise the lines are
+ * appended to '*cache' with no viewer filters applied; this returns 0
+ * (with '*cache' freed) if such a render is not possible because some
+ * member is subject to mode +D visibility rules.
+ */
+static int names_render(Client *client, Channel *channel, int member, int multiprefix, int uhnames, MultiLine **cache)
 {
-	int multiprefix = (MyConnect(client) && HasCapability(client, "multi-prefix"));
-	int uhnames = (MyConnect(client) && HasCapability(client, "userhost-in-names")); // cache UHNAMES support
 	int bufLen = NICKLEN + (!uhnames ? 0 : (1 + USERLEN + 1 + HOSTLEN));
 	int mlen = strlen(me.name) + bufLen + 7;
-	Channel *channel;
 	Client *acptr;
-	int member;
 	Member *cm;
 	int idx, flag = 1, spos;
-	char *s, *para = parv[1];
+	char *s;
 	char nuhBuffer[NICKLEN+USERLEN+HOSTLEN+3];
 
-	if (parc < 2 || !MyConnect(client))
-	{
-		sendnumeric(client, RPL_ENDOFNAMES, "*");
-		return;
-	}
-
-	for (s = para; *s; s++)
-	{
-		if (*s == ',')
-		{
-			if (strlen(para) > TRUNCATED_NAMES)
-				para[TRUNCATED_NAMES] = '\0';
-			sendto_realops("names abuser %s %s",
-			    get_client_name(client, FALSE), para);
-			sendnumeric(client, ERR_TOOMANYTARGETS, s+1, 1, "NAMES");
-			return;
-		}
-	}
-
-	channel = find_channel(para, NULL);
-
-	if (!channel || (!ShowChannel(client, channel) && !ValidatePermissionsForPath("channel:see:names:secret",client,NULL,channel,NULL)))
-	{
-		sendnumeric(client, RPL_ENDOFNAMES, para);
-		return;
-	}
-
-	/* cache whether this user is a member of this channel or not */
-	member = IsMember(client, channel);
-
 	if (PubChannel(channel))
 		buf[0] = '=';
 	else if (SecretChannel(channel))
@@ -132,11 +148,24 @@ CMD_FUNC(cmd_names)
 	for (cm = channel->members; cm; cm = cm->next)
 	{
 		acptr = cm->client;
-		if (IsInvisible(acptr) && !member && !ValidatePermissionsForPath("channel:see:names:invisible",client,acptr,channel,NULL))
-			continue;
+		if (cache)
+		{
+			/* Members hidden by mode +D rules are visible to some
+			 * viewers but not to others: such output cannot be cached.
+			 */
+			if (Hooks[HOOKTYPE_VISIBLE_IN_CHANNEL] && invisible_user_in_channel(acptr, channel))
+			{
+				safe_free_multiline(*cache);
+				return 0;
+			}
+		} else
+		{
+			if (IsInvisible(acptr) && !member && !ValidatePermissionsForPath("channel:see:names:invisible",client,acptr,channel,NULL))
+				continue;
 
-		if (!user_can_see_member(client, acptr, channel))
-			continue; /* invisible (eg: due to delayjoin) */
+			if (!user_can_see_member(client, acptr, channel))
+				continue; /* invisible (eg: due to delayjoin) */
+		}
 
 		if (!multiprefix)
 		{
@@ -189,14 +218,139 @@ CMD_FUNC(cmd_names)
 		flag = 1;
 		if (mlen + idx + bufLen > BUFSIZE - 7)
 		{
-			sendnumeric(client, RPL_NAMREPLY, buf);
+			if (cache)
+				addmultiline(cache, buf);
+			else
+				sendnumeric(client, RPL_NAMREPLY, buf);
 			idx = spos;
 			flag = 0;
 		}
 	}
 
 	if (flag)
-		sendnumeric(client, RPL_NAMREPLY, buf);
+	{
+		if (cache)
+			addmultiline(cache, buf);
+		else
+			sendnumeric(client, RPL_NAMREPLY, buf);
+	}
+
+	return 1;
+}
+
+/*
+** cmd_names
+**	parv[1] = channel
+*/
+#define TRUNCATED_NAMES 64
+CMD_FUNC(cmd_names)
+{
+	int multiprefix = (MyConnect(client) && HasCapability(client, "multi-prefix"));
+	int uhnames = (MyConnect(client) && HasCapability(client, "userhost-in-names")); // cache UHNAMES support
+	Channel *channel;
+	int member;
+	char *s, *para = parv[1];
 
+	if (parc < 2 || !MyConnect(client))
+	{
+		sendnumeric(client, RPL_ENDOFNAMES, "*");
+		return;
+	}
+
+	for (s = para; *s; s++)
+	{
+		if (*s == ',')
+		{
+			if (strlen(para) > TRUNCATED_NAMES)
+				para[TRUNCATED_NAMES] = '\0';
+			sendto_realops("names abuser %s %s",
+			    get_client_name(client, FALSE), para);
+			sendnumeric(client, ERR_TOOMANYTARGETS, s+1, 1, "NAMES");
+			return;
+		}
+	}
+
+	channel = find_channel(para, NULL);
+
+	if (!channel || (!ShowChannel(client, channel) && !ValidatePermissionsForPath("channel:see:names:secret",client,NULL,channel,NULL)))
+	{
+		sendnumeric(client, RPL_ENDOFNAMES, para);
+		return;
+	}
+
+	/* cache whether this user is a member of this channel or not */
+	member = IsMember(client, channel);
+
+	/* Members all see the same output (unless +D rules hide someone),
+	 * serve them from the per-channel cache, rendering it if needed.
+	 */
+	if (member)
+	{
+		NamesCache *nc = NAMESCACHE(channel);
+		int variant = (multiprefix ? 1 : 0) | (uhnames ? 2 : 0);
+
+		if (!nc)
+		{
+			nc = safe_alloc(sizeof(NamesCache));
+			moddata_channel(channel, names_md).ptr = nc;
+		}
+		if (nc->acl_generation[variant] != channel->acl_generation)
+		{
+			safe_free_multiline(nc->lines[variant]);
+			nc->acl_generation[variant] = channel->acl_generation;
+			names_render(NULL, channel, 1, multiprefix, uhnames, &nc->lines[variant]);
+		}
+		if (nc->lines[variant])
+		{
+			MultiLine *m;
+			for (m = nc->lines[variant]; m; m = m->next)
+				sendnumeric(client, RPL_NAMREPLY, m->line);
+			sendnumeric(client, RPL_ENDOFNAMES, para);
+			return;
+		}
+		/* Output is viewer dependent: fall through to a direct render */
+	}
+
+	names_render(client, channel, member, multiprefix, uhnames, NULL);
 	sendnumeric(client, RPL_ENDOFNAMES, para);
 }
+
+/** Called on nick changes: the nick is embedded in the cached NAMES
+ * output of every channel the user is in, drop those renderings.
+ */
+int names_nickchange(Client *client, char *newnick)
+{
+	Membership *lp;
+	NamesCache *nc;
+	int i;
+
+	if (!client->user)
+		return 0;
+
+	for (lp = client->user->channel; lp; lp = lp->next)
+	{
+		if (!(nc = NAMESCACHE(lp->channel)))
+			continue;
+		for (i = 0; i < NAMES_CACHE_VARIANTS; i++)
+		{
+			safe_free_multiline(nc->lines[i]);
+			nc->acl_generation[i] = 0;
+		}
+	}
+	return 0;
+}
+
+/** Called on channel destruction: free the cached NAMES output */
+void names_md_free(ModData *md)
+{
+	NamesCache *nc = (NamesCache *)md->ptr;
+	int i;
+
+	if (!nc)
+		return;
+
+	for (i = 0; i < NAMES_CACHE_VARIANTS; i++)
+		safe_free_multiline(nc->lines[i]);
+
+	safe_free(md->ptr);
+}
@@ -39,6 +39,9 @@ CMD_FUNC(cmd_uid);
 int _register_user(Client *client, char *nick, char *username, char *umode, char *virthost, char *ip);
 void nick_collision(Client *cptr, char *newnick, char *newid, Client *new, Client *existing, int type);
 int AllowClient(Client *client, char *username);
+static void allow_index_build(void);
+static void allow_index_free(void);
+int allow_index_rehash_complete(void);
 
 MOD_TEST()
 {
@@ -51,20 +54,30 @@ MOD_INIT()
 {
 	CommandAdd(modinfo->handle, "NICK", cmd_nick, MAXPARA, CMD_USER|CMD_SERVER|CMD_UNREGISTERED);
 	CommandAdd(modinfo->handle, "UID", cmd_uid, MAXPARA, CMD_SERVER);
+	HookAdd(modinfo->handle, HOOKTYPE_REHASH_COMPLETE, 0, allow_index_rehash_complete);
 	MARK_AS_OFFICIAL_MODULE(modinfo);
 	return MOD_SUCCESS;
 }
 
 MOD_LOAD()
 {
+	allow_index_build();
 	return MOD_SUCCESS;
 }
 
 MOD_UNLOAD()
 {
+	allow_index_free();
 	return MOD_SUCCESS;
 }
 
+int allow_index_rehash_complete(void)
+{
+	/* The allow { } blocks have all been freed and reloaded, recompile the index */
+	allow_index_build();
+	return 0;
+}
+
 static char buf[BUFSIZE];
 static char spamfilter_user[NICKLEN + USERLEN + HOSTLEN + REALLEN + 64];
 
@@ -232,6 +245,8 @@ CMD_FUNC(cmd_nick_remote)
 
 	strcpy(client->name, nick);
 	add_to_client_hash_table(nick, client);
+	if (client->user)
+		client->user->acl_generation++; /* ban masks match on nick */
 
 	hash_check_watch(client, RPL_LOGON);
 }
@@ -472,6 +487,8 @@ CMD_FUNC(cmd_nick_local)
 
 	strlcpy(client->name, nick, sizeof(client->name));
 	add_to_client_hash_table(nick, client);
+	if (client->user)
+		client->user->acl_generation++; /* ban masks match on nick */
 
 	/* update fdlist --nenolod */
 	snprintf(descbuf, sizeof(descbuf), "Client: %s", nick);
@@ -579,20 +596,24 @@ CMD_FUNC(cmd_uid)
 		}
 	}
 
-	/* Now check if 'nick' already exists - first, collisions with server names/ids (extremely rare) */
-	if ((acptr = find_server(nick, NULL)) != NULL)
-	{
-		sendto_umode(UMODE_OPER, "Nick collision on %s(%s <- %s)",
-		    client->name, acptr->direction->name,
-		    get_client_name(client, FALSE));
-		ircstats.is_kill++;
-		sendto_one(client, NULL, ":%s KILL %s :Nick-server-collision", me.id, parv[1]);
-		return;
-	}
-
-	/* Now check if 'nick' already exists - collision with a user (or still in handshake, unknown) */
+	/* Now check if 'nick' already exists. A single hash lookup covers
+	 * both the collision with a server name/id (extremely rare) and the
+	 * collision with a user (or still in handshake, unknown) - this used
+	 * to be two lookups per introduced user, which adds up when a server
+	 * bursts tens of thousands of them.
+	 */
 	if ((acptr = find_client(nick, NULL)) != NULL)
 	{
+		if (IsServer(acptr) || IsMe(acptr))
+		{
+			sendto_umode(UMODE_OPER, "Nick collision on %s(%s <- %s)",
+			    client->name, acptr->direction->name,
+			    get_client_name(client, FALSE));
+			ircstats.is_kill++;
+			sendto_one(client, NULL, ":%s KILL %s :Nick-server-collision", me.id, parv[1]);
+			return;
+		}
+
 		/* If there's a collision with a user that is still in handshake, on our side,
 		 * then we can just kill our client and continue.
 		 */
@@ -701,6 +722,125 @@ CMD_FUNC(cmd_nick)
 		cmd_nick_remote(client, recv_mtags, parc, parv);
 }
 
+/** Cached welcome burst (the 002..005 numerics).
+ * Except for the nick, these lines are identical for every client
+ * that registers, yet they were rendered - a dozen printf's and as
+ * many passes through the send path - again on every single connect,
+ * which adds up during reconnect storms. Instead they are rendered
+ * once into a template below, with a \001 placeholder byte marking
+ * where the nick goes, and delivered per connect by splicing in the
+ * nick and queueing the whole block with one sendbufto_one_batch().
+ * The template is rebuilt whenever the 005 tokens change (tracked
+ * via isupport_generation) or the other rendered inputs do.
+ * RPL_WELCOME (001) is not part of the template as it also contains
+ * the user@host.
+ */
+#define WELCOME_BURST_SIZE 8192
+static char welcome_burst[WELCOME_BURST_SIZE];
+static int welcome_burst_len = 0; /**< 0 = not built yet (or does not fit) */
+static int welcome_burst_lines = 0;
+static int welcome_burst_isupport_gen = -1;
+static char *welcome_burst_me_name = NULL;
+static char *welcome_burst_umodes = NULL;
+static char *welcome_burst_cmodes = NULL;
+
+/** Append one numeric line to the welcome burst template.
+ * The rendered content can never contain the \001 nick placeholder
+ * itself: 005 values are restricted to printable ASCII and the rest
+ * is server configuration.
+ * @returns 1 on success, 0 if the line does not fit.
+ */
+static int welcome_burst_add(int numeric, ...)
+{
+	va_list vl;
+	char fmt[512], line[512];
+	int n;
+
+	snprintf(fmt, sizeof(fmt), ":%s %.3d \001 %s", me.name, numeric, rpl_str(numeric));
+	va_start(vl, numeric);
+	ircvsnprintf(line, sizeof(line)-2, fmt, vl);
+	va_end(vl);
+	n = strlen(line);
+	line[n++] = '\r';
+	line[n++] = '\n';
+
+	if (welcome_burst_len + n > WELCOME_BURST_SIZE)
+		return 0;
+	memcpy(welcome_burst + welcome_burst_len, line, n);
+	welcome_burst_len += n;
+	welcome_burst_lines++;
+	return 1;
+}
+
+/** (Re)build the welcome burst template, see above. */
+static void build_welcome_burst(void)
+{
+	int i;
+
+	welcome_burst_len = 0;
+	welcome_burst_lines = 0;
+	welcome_burst_isupport_gen = isupport_generation;
+	safe_strdup(welcome_burst_me_name, me.name);
+	safe_strdup(welcome_burst_umodes, umodestring);
+	safe_strdup(welcome_burst_cmodes, cmodestring);
+
+	if (!welcome_burst_add(RPL_YOURHOST, me.name, version) ||
+	    !welcome_burst_add(RPL_CREATED, creation) ||
+	    !welcome_burst_add(RPL_MYINFO, me.name, version, umodestring, cmodestring))
+	{
+		welcome_burst_len = 0; /* does not fit: use the classic path */
+		return;
+	}
+	for (i = 0; ISupportStrings[i]; i++)
+	{
+		if (!welcome_burst_add(RPL_ISUPPORT, ISupportStrings[i]))
+		{
+			welcome_burst_len = 0;
+			return;
+		}
+	}
+}
+
+/** Send the 002..005 numerics to a registering client as one
+ * pre-rendered block, see the welcome burst comment above.
+ * @returns 1 if the block was sent, 0 if the caller must fall back
+ *          to sending the numerics the classic way.
+ */
+static int send_welcome_burst(Client *client)
+{
+	/* Worst case expansion: one nick spliced in per line */
+	char outbuf[WELCOME_BURST_SIZE + 16 * (NICKLEN + 1)];
+	char *src, *end, *p;
+	int len = 0, nicklen;
+
+	if ((welcome_burst_isupport_gen != isupport_generation) ||
+	    !welcome_burst_me_name || strcmp(welcome_burst_me_name, me.name) ||
+	    strcmp(welcome_burst_umodes, umodestring) ||
+	    strcmp(welcome_burst_cmodes, cmodestring))
+	{
+		build_welcome_burst();
+	}
+	if (!welcome_burst_len)
+		return 0;
+
+	nicklen = strlen(client->name);
+	src = welcome_burst;
+	end = welcome_burst + welcome_burst_len;
+	while ((p = memchr(src, '\001', end - src)))
+	{
+		memcpy(outbuf + len, src, p - src);
+		len += p - src;
+		memcpy(outbuf + len, client->name, nicklen);
+		len += nicklen;
+		src = p + 1;
+	}
+	memcpy(outbuf + len, src, end - src);
+	len += end - src;
+
+	sendbufto_one_batch(client, outbuf, len, welcome_burst_lines);
+	return 1;
+}
+
 /** Register the connection as a User.
  * This is called after NICK + USER (in no particular order)
  * and possibly other protocol messages as well (eg CAP).
@@ -918,6 +1058,7 @@ int _register_user(Client *client, char *nick, char *username, char *umode, char
 		fd_desc(client->local->fd, descbuf);
 
 		list_move(&client->lclient_node, &lclient_list);
+		lclient_array_add(client);
 
 		irccounts.unknown--;
 		irccounts.me_clients++;
@@ -935,23 +1076,34 @@ int _register_user(Client *client, char *nick, char *username, char *umode, char
 			ircd_log(LOG_CLIENT, "Connect - %s!%s@%s", nick, user->username,
 				user->realhost);
 
+		client->local->handshake.total_ms =
+			handshake_phase_done(HANDSHAKE_PHASE_TOTAL, &client->local->handshake.accepted);
+
 		RunHook2(HOOKTYPE_WELCOME, client, 0);
 		sendnumeric(client, RPL_WELCOME, ircnetwork, nick, user->username, user->realhost);
 
-		RunHook2(HOOKTYPE_WELCOME, client, 1);
-		sendnumeric(client, RPL_YOURHOST, me.name, version);
+		/* The 002..005 numerics normally go out as one cached,
+		 * pre-rendered block. If a module hooks on WELCOME then we
+		 * fall back to sending them one by one, since such hooks
+		 * exist to inject output at specific points in the burst.
+		 */
+		if (Hooks[HOOKTYPE_WELCOME] || !send_welcome_burst(client))
+		{
+			RunHook2(HOOKTYPE_WELCOME, client, 1);
+			sendnumeric(client, RPL_YOURHOST, me.name, version);
 
-		RunHook2(HOOKTYPE_WELCOME, client, 2);
-		sendnumeric(client, RPL_CREATED, creation);
+			RunHook2(HOOKTYPE_WELCOME, client, 2);
+			sendnumeric(client, RPL_CREATED, creation);
 
-		RunHook2(HOOKTYPE_WELCOME, client, 3);
-		sendnumeric(client, RPL_MYINFO, me.name, version, umodestring, cmodestring);
+			RunHook2(HOOKTYPE_WELCOME, client, 3);
+			sendnumeric(client, RPL_MYINFO, me.name, version, umodestring, cmodestring);
 
-		RunHook2(HOOKTYPE_WELCOME, client, 4);
-		for (i = 0; ISupportStrings[i]; i++)
-			sendnumeric(client, RPL_ISUPPORT, ISupportStrings[i]);
+			RunHook2(HOOKTYPE_WELCOME, client, 4);
+			for (i = 0; ISupportStrings[i]; i++)
+				sendnumeric(client, RPL_ISUPPORT, ISupportStrings[i]);
 
-		RunHook2(HOOKTYPE_WELCOME, client, 5);
+			RunHook2(HOOKTYPE_WELCOME, client, 5);
+		}
 
 		if (IsHidden(client))
 		{
@@ -1072,6 +1224,7 @@ int _register_user(Client *client, char *nick, char *username, char *umode, char
 			safe_strdup(client->user->virthost, virthost);
 	}
 
+	whoindex_update(client); /* file in the WHO account/ip/host indexes */
 	hash_check_watch(client, RPL_LOGON);	/* Uglier hack */
 	build_umode_string(client, 0, SEND_UMODES|UMODE_SERVNOTICE, buf);
 
@@ -1258,6 +1411,266 @@ int check_init(Client *client, char *sockn, size_t size)
 	return 1;
 }
 
+/* Compiled allow { } block index.
+ * At (re)load time every allow block is classified by its allow::ip mask:
+ * literal IPs go into a small hash table, CIDR masks into a precompiled
+ * binary prefix list and everything else (wildcards, ident@ masks and
+ * blocks with a usable allow::hostname) stays on a 'residue' list that is
+ * still matched the traditional way. AllowClient() then only evaluates
+ * blocks that can possibly match the connecting IP, in the original
+ * conf_allow order, instead of mask-matching every block on every connect.
+ */
+
+#define ALLOWIPHASHLEN 64
+
+/* Classification of one allow block, see allow_index_classify() */
+#define ALLOW_INDEX_EXACT   0  /* allow::ip is a literal IP address */
+#define ALLOW_INDEX_CIDR    1  /* allow::ip is ip/prefixlen */
+#define ALLOW_INDEX_RESIDUE 2  /* anything else: match the traditional way */
+
+typedef struct AllowCompiled AllowCompiled;
+struct AllowCompiled {
+	AllowCompiled *next;     /**< Next entry on the same chain, in conf_allow order */
+	ConfigItem_allow *allow; /**< The allow block itself */
+	unsigned int seq;        /**< Position in conf_allow (lower = matched earlier) */
+	int type;                /**< ALLOW_INDEX_* */
+	int family;              /**< AF_INET / AF_INET6 (EXACT and CIDR only) */
+	unsigned char addr[16];  /**< Binary IP (EXACT and CIDR only) */
+	int prefixlen;           /**< Prefix length in bits (CIDR only) */
+};
+
+static AllowCompiled *allow_exact_hash[ALLOWIPHASHLEN];
+static AllowCompiled *allow_cidr_list = NULL;
+static AllowCompiled *allow_residue_list = NULL;
+
+/** CIDR function to compare the first 'mask' bits.
+ * @author Taken from atheme
+ * @returns 1 if equal, 0 if not.
+ */
+static int allow_comp_with_mask(void *addr, void *dest, u_int mask)
+{
+	if (memcmp(addr, dest, mask / 8) == 0)
+	{
+		int n = mask / 8;
+		int m = (0xffff << (8 - (mask % 8)));
+		if (mask % 8 == 0 || (((u_char *) addr)[n] & m) == (((u_char *) dest)[n] & m))
+		{
+			return (1);
+		}
+	}
+	return (0);
+}
+
+/** Hash a binary IP into an allow_exact_hash bucket */
+static int allow_ip_hash(int family, unsigned char *addr)
+{
+	unsigned int h = (unsigned int)family;
+	int i, len = (family == AF_INET) ? 4 : 16;
+
+	for (i = 0; i < len; i++)
+		h = h * 33 + addr[i];
+	return h % ALLOWIPHASHLEN;
+}
+
+/** Try to compile the allow::ip mask of one block into a binary IP (+ prefix).
+ * Only masks of the form 'ip', '*@ip' and '*!*@ip', optionally with a
+ * /prefixlen, qualify; anything that needs ident or wildcard matching
+ * does not. Blocks with a usable allow::hostname never qualify either,
+ * since they can also match on the resolved host ("*@NOMATCH" is the
+ * never-matching default that _conf_allow() fills in).
+ * @returns ALLOW_INDEX_EXACT or ALLOW_INDEX_CIDR on success (with
+ *          family/addr/prefixlen filled in), ALLOW_INDEX_RESIDUE otherwise.
+ */
+static int allow_index_classify(ConfigItem_allow *allow, int *family, unsigned char *addr, int *prefixlen)
+{
+	char mask[USERLEN + HOSTLEN + 8];
+	char *host, *p;
+	int cidr = -1;
+
+	if (strcmp(allow->hostname, "*@NOMATCH"))
+		return ALLOW_INDEX_RESIDUE;
+
+	strlcpy(mask, allow->ip, sizeof(mask));
+	host = mask;
+	if ((p = strchr(host, '!')))
+	{
+		*p++ = '\0';
+		if (strcmp(host, "*"))
+			return ALLOW_INDEX_RESIDUE;
+		host = p;
+	}
+	if ((p = strchr(host, '@')))
+	{
+		*p++ = '\0';
+		if (strcmp(host, "*"))
+			return ALLOW_INDEX_RESIDUE;
+		host = p;
+	}
+	if ((p = strchr(host, '/')))
+	{
+		*p++ = '\0';
+		cidr = atoi(p);
+		if (cidr <= 0)
+			return ALLOW_INDEX_RESIDUE;
+	}
+	if (!*host || strchr(host, '*') || strchr(host, '?'))
+		return ALLOW_INDEX_RESIDUE;
+
+	if (strchr(host, ':'))
+	{
+		if (!inet_pton(AF_INET6, host, addr) || (cidr > 128))
+			return ALLOW_INDEX_RESIDUE;
+		*family = AF_INET6;
+	} else
+	{
+		if (!inet_pton(AF_INET, host, addr) || (cidr > 32))
+			return ALLOW_INDEX_RESIDUE;
+		*family = AF_INET;
+	}
+
+	if (cidr < 0)
+		return ALLOW_INDEX_EXACT;
+	*prefixlen = cidr;
+	return ALLOW_INDEX_CIDR;
+}
+
+static void allow_index_free_chain(AllowCompiled **chain)
+{
+	AllowCompiled *e, *e_next;
+
+	for (e = *chain; e; e = e_next)
+	{
+		e_next = e->next;
+		safe_free(e);
+	}
+	*chain = NULL;
+}
+
+/** Throw away the compiled allow block index (module unload / index rebuild) */
+static void allow_index_free(void)
+{
+	int i;
+
+	for (i = 0; i < ALLOWIPHASHLEN; i++)
+		allow_index_free_chain(&allow_exact_hash[i]);
+	allow_index_free_chain(&allow_cidr_list);
+	allow_index_free_chain(&allow_residue_list);
+}
+
+/** (Re)compile conf_allow into the allow block index.
+ * All chains are built in conf_allow order so AllowClient() can merge
+ * them back into one ordered walk.
+ */
+static void allow_index_build(void)
+{
+	ConfigItem_allow *allow;
+	AllowCompiled *e;
+	AllowCompiled **exact_tail[ALLOWIPHASHLEN];
+	AllowCompiled **cidr_tail = &allow_cidr_list;
+	AllowCompiled **residue_tail = &allow_residue_list;
+	unsigned int seq = 0;
+	int i;
+
+	allow_index_free();
+	for (i = 0; i < ALLOWIPHASHLEN; i++)
+		exact_tail[i] = &allow_exact_hash[i];
+
+	for (allow = conf_allow; allow; allow = allow->next)
+	{
+		e = safe_alloc(sizeof(AllowCompiled));
+		e->allow = allow;
+		e->seq = seq++;
+		e->type = allow_index_classify(allow, &e->family, e->addr, &e->prefixlen);
+		switch (e->type)
+		{
+			case ALLOW_INDEX_EXACT:
+				i = allow_ip_hash(e->family, e->addr);
+				*exact_tail[i] = e;
+				exact_tail[i] = &e->next;
+				break;
+			case ALLOW_INDEX_CIDR:
+				*cidr_tail = e;
+				cidr_tail = &e->next;
+				break;
+			default:
+				*residue_tail = e;
+				residue_tail = &e->next;
+				break;
+		}
+	}
+}
+
+/** Walk state for one AllowClient() call, see allow_index_cursor_next() */
+typedef struct AllowIndexCursor {
+	AllowCompiled *exact;   /**< Next exact-IP candidate (already matched on IP) */
+	AllowCompiled *cidr;    /**< Next CIDR candidate (already matched on IP) */
+	AllowCompiled *residue; /**< Next residue block (matched the traditional way) */
+	int family;             /**< Client address family, or -1 if no usable IP */
+	unsigned char addr[16]; /**< Client binary IP */
+} AllowIndexCursor;
+
+/** Fast-forward the exact and CIDR chains to the next entry matching the client IP */
+static void allow_index_cursor_skip(AllowIndexCursor *c)
+{
+	int addrlen = (c->family == AF_INET) ? 4 : 16;
+
+	while (c->exact && ((c->exact->family != c->family) || memcmp(c->exact->addr, c->addr, addrlen)))
+		c->exact = c->exact->next;
+	while (c->cidr && ((c->cidr->family != c->family) || !allow_comp_with_mask(c->addr, c->cidr->addr, c->cidr->prefixlen)))
+		c->cidr = c->cidr->next;
+}
+
+static void allow_index_cursor_init(AllowIndexCursor *c, Client *client)
+{
+	c->family = -1;
+	c->exact = c->cidr = NULL;
+	c->residue = allow_residue_list;
+
+	if (client->ip)
+	{
+		if (strchr(client->ip, ':'))
+		{
+			if (inet_pton(AF_INET6, client->ip, c->addr))
+				c->family = AF_INET6;
+		} else
+		{
+			if (inet_pton(AF_INET, client->ip, c->addr))
+				c->family = AF_INET;
+		}
+	}
+	if (c->family != -1)
+	{
+		c->exact = allow_exact_hash[allow_ip_hash(c->family, c->addr)];
+		c->cidr = allow_cidr_list;
+		allow_index_cursor_skip(c);
+	}
+}
+
+/** Next allow block that may match the client, in conf_allow order.
+ * Exact-IP and CIDR candidates returned here have already matched on the
+ * client IP, only residue entries still need the full host/IP checks.
+ */
+static AllowCompiled *allow_index_cursor_next(AllowIndexCursor *c)
+{
+	AllowCompiled *best = c->residue;
+
+	if (c->exact && (!best || (c->exact->seq < best->seq)))
+		best = c->exact;
+	if (c->cidr && (!best || (c->cidr->seq < best->seq)))
+		best = c->cidr;
+	if (!best)
+		return NULL;
+
+	if (best == c->exact)
+		c->exact = c->exact->next;
+	else if (best == c->cidr)
+		c->cidr = c->cidr->next;
+	else
+		c->residue = c->residue->next;
+	allow_index_cursor_skip(c);
+	return best;
+}
+
 /** Returns 1 if allow::maxperip is exceeded by 'client' */
 int exceeds_maxperip(Client *client, ConfigItem_allow *aconf)
 {
@@ -1290,6 +1703,8 @@ int AllowClient(Client *client, char *username)
 	struct hostent *hp = NULL;
 	int i;
 	ConfigItem_allow *aconf;
+	AllowIndexCursor cursor;
+	AllowCompiled *e;
 	char *hname;
 	static char uhost[HOSTLEN + USERLEN + 3];
 	static char fullname[HOSTLEN + 1];
@@ -1314,11 +1729,17 @@ int AllowClient(Client *client, char *username)
 		return 0;
 	}
 
-	for (aconf = conf_allow; aconf; aconf = aconf->next)
+	allow_index_cursor_init(&cursor, client);
+	while ((e = allow_index_cursor_next(&cursor)))
 	{
+		aconf = e->allow;
+
 		if (aconf->flags.tls && !IsSecure(client))
 			continue;
 
+		if (e->type != ALLOW_INDEX_RESIDUE)
+			goto attach; /* The index already matched this block on the client IP */
+
 		if (hp && hp->h_name)
 		{
 			hname = hp->h_name;
@@ -1388,6 +1809,8 @@ int AllowClient(Client *client, char *username)
 			}
 		}
 
+		aconf->hits++;
+
 		if (!aconf->flags.noident)
 			SetUseIdent(client);
 		if (!aconf->flags.useip && hp)
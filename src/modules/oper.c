@@ -283,6 +283,7 @@ CMD_FUNC(cmd_oper)
 	sendnumeric(client, RPL_SNOMASK, get_snomask_string(client));
 
 	list_add(&client->special_node, &oper_list);
+	invalidate_snomask_subscribers();
 
 	RunHook2(HOOKTYPE_LOCAL_OPER, client, 1);
 
@@ -114,6 +114,14 @@ CMD_FUNC(cmd_protoctl)
 		{
 			SetMTAGS(client);
 		}
+		else if (!strcmp(name, "COMPRESSION") && value && !strcmp(value, "zlib"))
+		{
+			SetCOMPRESSION(client);
+		}
+		else if (!strcmp(name, "TKLDSYNC"))
+		{
+			SetTKLDSYNC(client);
+		}
 		else if (!strcmp(name, "NICKCHARS") && value)
 		{
 			if (!IsServer(client) && !IsEAuth(client) && !IsHandshake(client))
@@ -0,0 +1,353 @@
+/*
+ *   IRC - Internet Relay Chat, src/modules/replay.c
+ *   (C) 2021 The UnrealIRCd Team
+ *
+ *   See file AUTHORS in IRC package for additional names of
+ *   the programmers.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 1, or (at your option)
+ *   any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Replay driver for the deterministic replay harness.
+ *
+ * A traffic recording - made earlier with set::replay-record-file, see
+ * the traffic recorder in src/parse.c - is fed back through the normal
+ * parse pipeline against a population of synthetic clients, one per
+ * connection seen in the recording, preserving the recorded timing (or
+ * a multiple of it). This makes parser/fanout profiles and regression
+ * measurements reproducible for the exact traffic mix of a production
+ * box: record once when it hurts, replay under the profiler as often
+ * as needed.
+ *
+ * Synthetic clients have no socket (fd -1), so everything the server
+ * sends them is discarded and they can never trigger host bans (see
+ * the fd checks in src/parse.c). They register through the replayed
+ * NICK/USER lines just like the original connections did, which means
+ * the recording should start before the connections it covers.
+ *
+ * This is a load/profiling tool: run it on a lab instance, not on a
+ * production network.
+ */
+
+#include "unrealircd.h"
+
+CMD_FUNC(cmd_replay);
+EVENT(replay_feed);
+static int replay_close_connection(Client *client);
+static void replay_stop(Client *requester, const char *how);
+
+#define MSG_REPLAY	"REPLAY"
+
+ModuleHeader MOD_HEADER
+  = {
+	"replay",
+	"5.0",
+	"command /replay (traffic replay driver)",
+	"UnrealIRCd Team",
+	"unrealircd-5",
+    };
+
+/** One synthetic client, keyed by the connection id in the recording */
+typedef struct ReplayClient ReplayClient;
+struct ReplayClient {
+	ReplayClient *prev, *next;
+	char uid[IDLEN + 1];	/**< Connection id as it appears in the recording */
+	Client *client;		/**< The synthetic client standing in for it */
+};
+
+static ReplayClient *replay_clients = NULL;
+static FILE *replay_file = NULL;
+static char *replay_file_name = NULL;
+static double replay_speed = 1.0;
+static struct timeval replay_started;
+static long long replay_first_usec;		/**< Timestamp of the first recorded line */
+static long long replay_lines_fed, replay_clients_made;
+static char replay_pending[READBUFSIZE];	/**< Lookahead: next recorded line, not due yet */
+static int replay_pending_valid = 0;
+
+MOD_INIT()
+{
+	CommandAdd(modinfo->handle, MSG_REPLAY, cmd_replay, MAXPARA, CMD_OPER);
+	HookAdd(modinfo->handle, HOOKTYPE_CLOSE_CONNECTION, 0, replay_close_connection);
+	MARK_AS_OFFICIAL_MODULE(modinfo);
+	return MOD_SUCCESS;
+}
+
+MOD_LOAD()
+{
+	EventAdd(modinfo->handle, "replay_feed", replay_feed, NULL, 100, 0);
+	return MOD_SUCCESS;
+}
+
+MOD_UNLOAD()
+{
+	if (replay_file)
+		replay_stop(NULL, "module unloaded");
+	return MOD_SUCCESS;
+}
+
+/** Find the synthetic client standing in for recorded connection 'uid' */
+static ReplayClient *replay_find_client(const char *uid)
+{
+	ReplayClient *e;
+
+	for (e = replay_clients; e; e = e->next)
+		if (!strcmp(e->uid, uid))
+			return e;
+	return NULL;
+}
+
+/** Create a synthetic client for recorded connection 'uid'.
+ * This mirrors what add_connection() does for a real connection, minus
+ * everything that needs a socket: no fd, no DNS/ident/TLS handshake, no
+ * ban checks. The client is parked on 127.0.0.1 and starts out unknown;
+ * the replayed stream itself registers it (or doesn't).
+ */
+static Client *replay_make_client(const char *uid)
+{
+	Client *client;
+	ReplayClient *e;
+
+	client = make_client(NULL, &me);
+	set_sockhost(client, "127.0.0.1");
+	safe_strdup(client->ip, "127.0.0.1");
+	SetLocalhost(client);
+
+	/* Point at an existing listener: parts of the registration path
+	 * dereference local->listener without a NULL check.
+	 */
+	client->local->listener = conf_listen;
+	if (client->local->listener)
+		client->local->listener->clients++;
+
+	add_client_to_list(client);
+	irccounts.unknown++;
+	client->status = CLIENT_STATUS_UNKNOWN;
+	list_add(&client->lclient_node, &unknown_list);
+
+	e = safe_alloc(sizeof(ReplayClient));
+	strlcpy(e->uid, uid, sizeof(e->uid));
+	e->client = client;
+	AddListItem(e, replay_clients);
+	replay_clients_made++;
+	return client;
+}
+
+/** A local connection is closing: if it is one of ours, drop the mapping */
+static int replay_close_connection(Client *client)
+{
+	ReplayClient *e;
+
+	for (e = replay_clients; e; e = e->next)
+	{
+		if (e->client == client)
+		{
+			DelListItem(e, replay_clients);
+			safe_free(e);
+			break;
+		}
+	}
+	return 0;
+}
+
+/** Stop the running replay: close the recording and exit all synthetic
+ * clients. 'how' says why, for the oper notice.
+ */
+static void replay_stop(Client *requester, const char *how)
+{
+	if (!replay_file)
+		return;
+
+	fclose(replay_file);
+	replay_file = NULL;
+	replay_pending_valid = 0;
+
+	sendto_realops("[replay] Replay of '%s' %s by %s: %lld line%s fed to %lld synthetic client%s",
+		replay_file_name, how, requester ? requester->name : "me",
+		replay_lines_fed, (replay_lines_fed == 1) ? "" : "s",
+		replay_clients_made, (replay_clients_made == 1) ? "" : "s");
+	safe_free(replay_file_name);
+
+	/* Exiting a client removes its ReplayClient entry through the
+	 * CLOSE_CONNECTION hook above, hence the head-chopping loop.
+	 */
+	while (replay_clients)
+		exit_client(replay_clients->client, NULL, "Replay ended");
+}
+
+/** Feed one recorded line ("<sec>.<usec> <uid> <raw line>") to the parser */
+static void replay_feed_line(char *line)
+{
+	char buf[READBUFSIZE];
+	char *uid, *raw, *p;
+	ReplayClient *e;
+	Client *client;
+
+	/* Skip the timestamp */
+	p = strchr(line, ' ');
+	if (!p)
+		return;
+	uid = p + 1;
+	p = strchr(uid, ' ');
+	if (!p)
+		return;
+	*p = '\0';
+	raw = p + 1;
+
+	e = replay_find_client(uid);
+	client = e ? e->client : replay_make_client(uid);
+	if (IsDeadSocket(client))
+		return; /* killed earlier in the replay, swallow the rest of its lines */
+
+	replay_lines_fed++;
+
+	/* dopacket() hands the line to parse(), which modifies it in place */
+	strlcpy(buf, raw, sizeof(buf));
+	dopacket(client, buf, strlen(buf));
+}
+
+/** Called every 100 msec: feed all recorded lines that are due by now */
+EVENT(replay_feed)
+{
+	struct timeval now;
+	long long elapsed_usec, due_usec;
+	long long sec, usec;
+	char *p;
+
+	if (!replay_file)
+		return;
+
+	gettimeofday(&now, NULL);
+	elapsed_usec = ((long long)now.tv_sec - replay_started.tv_sec) * 1000000 +
+	               ((long long)now.tv_usec - replay_started.tv_usec);
+
+	for (;;)
+	{
+		if (!replay_pending_valid)
+		{
+			if (!fgets(replay_pending, sizeof(replay_pending), replay_file))
+			{
+				replay_stop(NULL, "finished");
+				return;
+			}
+			if ((p = strchr(replay_pending, '\n')))
+				*p = '\0';
+			if ((p = strchr(replay_pending, '\r')))
+				*p = '\0';
+			replay_pending_valid = 1;
+		}
+
+		if (sscanf(replay_pending, "%lld.%lld", &sec, &usec) != 2)
+		{
+			replay_pending_valid = 0; /* malformed, skip */
+			continue;
+		}
+		if (replay_first_usec < 0)
+			replay_first_usec = sec * 1000000 + usec;
+
+		/* The recorded offset, compressed by the speed multiplier */
+		due_usec = (long long)((sec * 1000000 + usec - replay_first_usec) / replay_speed);
+		if (due_usec > elapsed_usec)
+			return; /* not due yet, the lookahead line stays pending */
+
+		replay_feed_line(replay_pending);
+		replay_pending_valid = 0;
+	}
+}
+
+/** REPLAY: control the traffic replay driver.
+ * parv[1]: START | STOP | STATUS
+ * parv[2]: recording file (START)
+ * parv[3]: speed multiplier (START, default 1: recorded timing)
+ */
+CMD_FUNC(cmd_replay)
+{
+	if (!ValidatePermissionsForPath("server:replay", client, NULL, NULL, NULL))
+	{
+		sendnumeric(client, ERR_NOPRIVILEGES);
+		return;
+	}
+
+	if ((parc < 2) || BadPtr(parv[1]))
+	{
+		sendnotice(client, "Use: /REPLAY START <file> [speed-multiplier] | STOP | STATUS");
+		return;
+	}
+
+	if (!strcasecmp(parv[1], "START"))
+	{
+		double speed = 1.0;
+
+		if ((parc < 3) || BadPtr(parv[2]))
+		{
+			sendnotice(client, "Use: /REPLAY START <file> [speed-multiplier]");
+			return;
+		}
+		if (replay_file)
+		{
+			sendnotice(client, "A replay of '%s' is already running, /REPLAY STOP it first", replay_file_name);
+			return;
+		}
+		if ((parc > 3) && !BadPtr(parv[3]))
+			speed = atof(parv[3]);
+		if (speed <= 0)
+		{
+			sendnotice(client, "Invalid speed multiplier '%s' (try 1 for recorded speed, 10 for 10x)", parv[3]);
+			return;
+		}
+		replay_file = fopen(parv[2], "r");
+		if (!replay_file)
+		{
+			sendnotice(client, "Could not open '%s': %s", parv[2], STRERROR(ERRNO));
+			return;
+		}
+		safe_strdup(replay_file_name, parv[2]);
+		replay_speed = speed;
+		gettimeofday(&replay_started, NULL);
+		replay_first_usec = -1;
+		replay_lines_fed = replay_clients_made = 0;
+		replay_pending_valid = 0;
+		sendto_realops("[replay] %s started replaying '%s' at %gx speed",
+			client->name, replay_file_name, replay_speed);
+		return;
+	}
+
+	if (!strcasecmp(parv[1], "STOP"))
+	{
+		if (!replay_file)
+		{
+			sendnotice(client, "No replay is running");
+			return;
+		}
+		replay_stop(client, "stopped");
+		return;
+	}
+
+	if (!strcasecmp(parv[1], "STATUS"))
+	{
+		if (!replay_file)
+		{
+			sendnotice(client, "No replay is running");
+			return;
+		}
+		sendtxtnumeric(client, "Replaying '%s' at %gx speed: %lld line%s fed, %lld synthetic client%s created",
+			replay_file_name, replay_speed,
+			replay_lines_fed, (replay_lines_fed == 1) ? "" : "s",
+			replay_clients_made, (replay_clients_made == 1) ? "" : "s");
+		return;
+	}
+
+	sendnotice(client, "Use: /REPLAY START <file> [speed-multiplier] | STOP | STATUS");
+}
@@ -4,8 +4,11 @@
  * License: GPLv2
  *
  * How this works is simple:
- * Every 5 minutes the IP address of all the connected users receive
- * a point. Registered users receive 2 points every 5 minutes.
+ * The IP address of a connected user receives a point for every
+ * 5 minutes of being online. Registered users receive 2 points per
+ * 5 minutes. Scoring is lazy: entries track how many users are
+ * currently on the IP and accrued points are materialized whenever
+ * the entry is touched, rather than by sweeping all clients on a timer.
  * The total reputation score is then later used, by other modules, for
  * example to make decisions such as to reject or allow a user if the
  * server is under attack.
@@ -44,13 +47,27 @@
 #ifndef TEST
  #define BUMP_SCORE_EVERY	300
  #define DELETE_OLD_EVERY	605
+ #define FLUSH_JOURNAL_EVERY	181
  #define SAVE_DB_EVERY		902
+ /* The expiry sweep visits 1/16th of the hash buckets per run, so a
+  * full pass over the table still takes about DELETE_OLD_EVERY seconds
+  * but no single event tick walks the whole thing.
+  */
+ #define DELETE_OLD_CHUNKS	16
 #else
  #define BUMP_SCORE_EVERY 	3
  #define DELETE_OLD_EVERY	3
+ #define FLUSH_JOURNAL_EVERY	3
  #define SAVE_DB_EVERY		3
+ #define DELETE_OLD_CHUNKS	1
 #endif
 
+/** Rewrite (compact) the full snapshot once the journal holds at least
+ * this many deltas, or a quarter of all records, whichever is more.
+ * Until then the periodic "save" is just a cheap journal append.
+ */
+#define COMPACT_MIN_JOURNAL_ENTRIES 1000
+
 #ifndef CALLBACKTYPE_REPUTATION_STARTTIME
  #define CALLBACKTYPE_REPUTATION_STARTTIME 5
 #endif
@@ -72,8 +89,6 @@ ModuleHeader MOD_HEADER
 
 #define UPDATE_SCORE_MARGIN 1
 
-#define REPUTATION_HASH_TABLE_SIZE 2048
-
 #define Reputation(client)	moddata_client(client, reputation_md).l
 
 /* Definitions (structs, etc.) */
@@ -87,11 +102,12 @@ struct cfgstruct {
 typedef struct ReputationEntry ReputationEntry;
 
 struct ReputationEntry {
-	ReputationEntry *prev, *next;
 	unsigned short score; /**< score for the user */
 	long last_seen; /**< user last seen (unix timestamp) */
-	int marker; /**< internal marker, not written to db */
-	char ip[1]; /*< ip address */
+	long accrued_until; /**< lazy scoring: accrual materialized up to this time, not written to db */
+	unsigned short present; /**< connected users currently on this IP, not written to db */
+	unsigned short present_registered; /**< ..of which are logged into a services account */
+	unsigned char dirty; /**< changed since last written to disk? */
 };
 
 /* Global variables */
@@ -99,13 +115,24 @@ struct ReputationEntry {
 static struct cfgstruct cfg; /**< Current configuration */
 long reputation_starttime = 0;
 long reputation_writtentime = 0;
+static long journal_entries = 0; /**< Deltas in the journal since the last compaction */
 
-static ReputationEntry *ReputationHashTable[REPUTATION_HASH_TABLE_SIZE];
-static char siphashkey_reputation[SIPHASH_KEY_LENGTH];
+/* The entries are attached to the shared per-IP state table (ipstate,
+ * see src/hash.c), so one connect probes the same entry as the
+ * connect-flood throttle instead of a second IP-keyed hash table.
+ * A nice side effect is that the records now survive a module reload.
+ */
+static int reputation_slot = -1;
 
 static ModuleInfo ModInf;
 
 ModDataInfo *reputation_md; /* Module Data structure which we acquire */
+ModDataInfo *reputation_presence_md; /* Tracks whether (and how) this client is counted in an entry */
+
+/* Values of the presence moddata above */
+#define PRESENCE_NOT_COUNTED	0
+#define PRESENCE_COUNTED	1
+#define PRESENCE_COUNTED_REGISTERED	2
 
 /* Forward declarations */
 void reputation_md_free(ModData *m);
@@ -117,16 +144,24 @@ CMD_FUNC(reputationunperm);
 int reputation_whois(Client *client, Client *target);
 int reputation_set_on_connect(Client *client);
 int reputation_pre_lconnect(Client *client);
+int reputation_connect(Client *client);
+int reputation_quit(Client *client, MessageTag *mtags, char *comment);
+int reputation_account_login(Client *client, MessageTag *mtags);
 int reputation_config_test(ConfigFile *cf, ConfigEntry *ce, int type, int *errs);
 int reputation_config_run(ConfigFile *cf, ConfigEntry *ce, int type);
 int reputation_config_posttest(int *errs);
-static uint64_t hash_reputation_entry(char *ip);
-void add_reputation_entry(ReputationEntry *e);
+void add_reputation_entry(char *ip, ReputationEntry *e);
+ReputationEntry *find_reputation_entry(char *ip);
+static void reputation_materialize(ReputationEntry *e);
 EVENT(delete_old_records);
-EVENT(add_scores);
+EVENT(flush_journal_evt);
 EVENT(save_db_evt);
 void load_db(void);
+void load_journal(void);
+void save_journal(void);
 void save_db(void);
+static char *journal_filename(void);
+int count_reputation_records(void);
 int reputation_starttime_callback(void);
 
 MOD_TEST()
@@ -145,8 +180,9 @@ MOD_INIT()
 
 	MARK_AS_OFFICIAL_MODULE(modinfo);
 	ModuleSetOptions(modinfo->handle, MOD_OPT_PERM, 1);
-	memset(&ReputationHashTable, 0, sizeof(ReputationHashTable));
-	siphash_generate_key(siphashkey_reputation);
+	reputation_slot = ipstate_slot_request("reputation", NULL);
+	if (reputation_slot < 0)
+		abort(); /* all ipstate slots taken, should never happen */
 
 	memset(&mreq, 0, sizeof(mreq));
 	mreq.name = "reputation";
@@ -155,28 +191,77 @@ MOD_INIT()
 	mreq.unserialize = reputation_md_unserialize;
 	mreq.sync = 0; /* local! */
 	mreq.type = MODDATATYPE_CLIENT;
+	mreq.hot = 1; /* looked up on every message */
 	reputation_md = ModDataAdd(modinfo->handle, mreq);
 	if (!reputation_md)
 		abort();
 
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.name = "reputation-presence";
+	mreq.free = reputation_md_free;
+	mreq.sync = 0; /* local! */
+	mreq.type = MODDATATYPE_CLIENT;
+	reputation_presence_md = ModDataAdd(modinfo->handle, mreq);
+	if (!reputation_presence_md)
+		abort();
+
 	config_setdefaults();
 	HookAdd(modinfo->handle, HOOKTYPE_CONFIGRUN, 0, reputation_config_run);
 	HookAdd(modinfo->handle, HOOKTYPE_WHOIS, 0, reputation_whois);
 	HookAdd(modinfo->handle, HOOKTYPE_HANDSHAKE, 0, reputation_set_on_connect);
 	HookAdd(modinfo->handle, HOOKTYPE_PRE_LOCAL_CONNECT, 2000000000, reputation_pre_lconnect); /* (prio: last) */
 	HookAdd(modinfo->handle, HOOKTYPE_REMOTE_CONNECT, -1000000000, reputation_set_on_connect); /* (prio: near-first) */
+	HookAdd(modinfo->handle, HOOKTYPE_LOCAL_CONNECT, 0, reputation_connect);
+	HookAdd(modinfo->handle, HOOKTYPE_REMOTE_CONNECT, 0, reputation_connect);
+	HookAdd(modinfo->handle, HOOKTYPE_LOCAL_QUIT, 0, reputation_quit);
+	HookAdd(modinfo->handle, HOOKTYPE_REMOTE_QUIT, 0, reputation_quit);
+	HookAdd(modinfo->handle, HOOKTYPE_ACCOUNT_LOGIN, 0, reputation_account_login);
 	CommandAdd(ModInf.handle, "REPUTATION", reputation_cmd, MAXPARA, CMD_USER|CMD_SERVER);
 	CommandAdd(ModInf.handle, "REPUTATIONUNPERM", reputationunperm, MAXPARA, CMD_USER|CMD_SERVER);
 	return MOD_SUCCESS;
 }
 
+static int reset_presence_callback(char *ip, void *data, void *arg)
+{
+	ReputationEntry *e = data;
+
+	e->present = e->present_registered = 0;
+	e->accrued_until = TStime();
+	return 0;
+}
+
+/** Rebuild the presence counters from the actual client list.
+ * Needed at (re)load: the counters are not persisted and a module
+ * reload loses both them and the per-client counted state.
+ */
+static void rebuild_presence(void)
+{
+	Client *client;
+
+	ipstate_iterate(reputation_slot, reset_presence_callback, NULL);
+	list_for_each_entry(client, &client_list, client_node)
+	{
+		if (IsUser(client))
+			reputation_connect(client);
+	}
+}
+
 MOD_LOAD()
 {
+	struct timeval db_start, db_end;
+	long long db_cpu = boot_phase_cpu_now();
+
+	gettimeofday(&db_start, NULL);
 	load_db();
+	gettimeofday(&db_end, NULL);
+	boot_phase_credit("reputationdb read",
+		(long long)(db_end.tv_sec - db_start.tv_sec) * 1000000 + (db_end.tv_usec - db_start.tv_usec),
+		boot_phase_cpu_now() - db_cpu);
 	if (reputation_starttime == 0)
 		reputation_starttime = TStime();
-	EventAdd(ModInf.handle, "delete_old_records", delete_old_records, NULL, DELETE_OLD_EVERY*1000, 0);
-	EventAdd(ModInf.handle, "add_scores", add_scores, NULL, BUMP_SCORE_EVERY*1000, 0);
+	rebuild_presence();
+	EventAdd(ModInf.handle, "delete_old_records", delete_old_records, NULL, (DELETE_OLD_EVERY*1000)/DELETE_OLD_CHUNKS, 0);
+	EventAdd(ModInf.handle, "flush_journal", flush_journal_evt, NULL, FLUSH_JOURNAL_EVERY*1000, 0);
 	EventAdd(ModInf.handle, "save_db", save_db_evt, NULL, SAVE_DB_EVERY*1000, 0);
 	return MOD_SUCCESS;
 }
@@ -366,15 +451,16 @@ void load_db(void)
 		if (!last_seen)
 			continue;
 		
-		e = safe_alloc(sizeof(ReputationEntry)+strlen(ip));
-		strcpy(e->ip, ip); /* safe, see alloc above */
+		e = safe_alloc(sizeof(ReputationEntry));
 		e->score = atoi(score);
 		e->last_seen = atol(last_seen);
 		
-		add_reputation_entry(e);
+		add_reputation_entry(ip, e);
 	}
 	fclose(fd);
 
+	load_journal();
+
 #ifdef BENCHMARK
 	gettimeofday(&tv_beta, NULL);
 	ircd_log(LOG_ERROR, "Reputation benchmark: LOAD DB: %lld microseconds",
@@ -382,12 +468,140 @@ void load_db(void)
 #endif
 }
 
+/** Name of the append-only journal next to the snapshot database */
+static char *journal_filename(void)
+{
+	static char fname[512];
+
+	snprintf(fname, sizeof(fname), "%s.journal", cfg.database);
+	return fname;
+}
+
+/** Replay the journal over the freshly loaded snapshot.
+ * This recovers the deltas written after the last compaction, eg after
+ * a crash. Lines use the same '<ip> <score> <last seen>' format as the
+ * snapshot body and later lines simply overwrite earlier state.
+ * Expired entries that get resurrected here are harmless: the next
+ * delete_old_records() run removes them again.
+ */
+void load_journal(void)
+{
+	FILE *fd;
+	char buf[512], *p;
+
+	fd = fopen(journal_filename(), "r");
+	if (!fd)
+		return; /* no journal: clean shutdown or first boot */
+
+	while(fgets(buf, 512, fd) != NULL)
+	{
+		char *ip = NULL, *score = NULL, *last_seen = NULL;
+		ReputationEntry *e;
+
+		stripcrlf(buf);
+		ip = strtoken(&p, buf, " ");
+		if (!ip)
+			continue;
+		score = strtoken(&p, NULL, " ");
+		if (!score)
+			continue;
+		last_seen = strtoken(&p, NULL, " ");
+		if (!last_seen)
+			continue;
+
+		e = find_reputation_entry(ip);
+		if (!e)
+		{
+			e = safe_alloc(sizeof(ReputationEntry));
+			add_reputation_entry(ip, e);
+		}
+		e->score = atoi(score);
+		e->last_seen = atol(last_seen);
+		journal_entries++;
+	}
+	fclose(fd);
+}
+
+/** State carried through the save_journal() iteration callback */
+typedef struct SaveJournalState SaveJournalState;
+struct SaveJournalState {
+	FILE *fd;
+	int error;
+};
+
+static int save_journal_callback(char *ip, void *data, void *arg)
+{
+	ReputationEntry *e = data;
+	SaveJournalState *state = arg;
+
+	if (state->error)
+		return 0;
+	reputation_materialize(e); /* may set 'dirty' */
+	if (!e->dirty)
+		return 0;
+	if (fprintf(state->fd, "%s %d %lld\n", ip, (int)e->score, (long long)e->last_seen) < 0)
+	{
+		state->error = 1;
+		return 0;
+	}
+	e->dirty = 0;
+	journal_entries++;
+	return 0;
+}
+
+/** Append all changed entries to the journal.
+ * This is the cheap, frequent persistence step: in steady state only
+ * the handful of recently active IP's is written, not the full
+ * database. Deletions are not journaled on purpose, see load_journal().
+ */
+void save_journal(void)
+{
+	FILE *fd;
+	SaveJournalState state;
+
+	fd = fopen(journal_filename(), "a");
+	if (!fd)
+	{
+		config_error("ERROR: Could not open/write journal '%s': %s", journal_filename(), strerror(ERRNO));
+		return;
+	}
+
+	memset(&state, 0, sizeof(state));
+	state.fd = fd;
+	ipstate_iterate(reputation_slot, save_journal_callback, &state);
+	if (state.error || (fclose(fd) < 0))
+		config_error("ERROR writing to journal '%s': %s -- some deltas only survive until the next write", journal_filename(), strerror(ERRNO));
+}
+
+/** State carried through the save_db() iteration callback */
+typedef struct SaveDbState SaveDbState;
+struct SaveDbState {
+	FILE *fd;
+	int error;
+};
+
+static int save_db_callback(char *ip, void *data, void *arg)
+{
+	ReputationEntry *e = data;
+	SaveDbState *state = arg;
+
+	if (state->error)
+		return 0; /* write already failed, skip the rest */
+	reputation_materialize(e);
+	if (fprintf(state->fd, "%s %d %lld\n", ip, (int)e->score, (long long)e->last_seen) < 0)
+	{
+		state->error = 1;
+		return 0;
+	}
+	e->dirty = 0; /* snapshot now covers this entry */
+	return 0;
+}
+
 void save_db(void)
 {
 	FILE *fd;
 	char tmpfname[512];
-	int i;
-	ReputationEntry *e;
+	SaveDbState state;
 #ifdef BENCHMARK
 	struct timeval tv_alpha, tv_beta;
 
@@ -408,21 +622,17 @@ void save_db(void)
 		return;
 	}
 
+	memset(&state, 0, sizeof(state));
+	state.fd = fd;
 	if (fprintf(fd, "REPDB 1 %lld %lld\n", (long long)reputation_starttime, (long long)TStime()) < 0)
-		goto write_fail;
-
-	for (i = 0; i < REPUTATION_HASH_TABLE_SIZE; i++)
+		state.error = 1;
+	if (!state.error)
+		ipstate_iterate(reputation_slot, save_db_callback, &state);
+	if (state.error)
 	{
-		for (e = ReputationHashTable[i]; e; e = e->next)
-		{
-			if (fprintf(fd, "%s %d %lld\n", e->ip, (int)e->score, (long long)e->last_seen) < 0)
-			{
-write_fail:
-				config_error("ERROR writing to '%s': %s -- DATABASE *NOT* SAVED!!!", tmpfname, strerror(ERRNO));
-				fclose(fd);
-				return;
-			}
-		}
+		config_error("ERROR writing to '%s': %s -- DATABASE *NOT* SAVED!!!", tmpfname, strerror(ERRNO));
+		fclose(fd);
+		return;
 	}
 
 	if (fclose(fd) < 0)
@@ -447,6 +657,15 @@ write_fail:
 
 	reputation_writtentime = TStime();
 
+	/* The snapshot covers everything, so the journal can start over.
+	 * If we crash right before this truncate then the replay is merely
+	 * redundant (it re-applies state the snapshot already has).
+	 */
+	fd = fopen(journal_filename(), "w");
+	if (fd)
+		fclose(fd);
+	journal_entries = 0;
+
 #ifdef BENCHMARK
 	gettimeofday(&tv_beta, NULL);
 	ircd_log(LOG_ERROR, "Reputation benchmark: SAVE DB: %lld microseconds",
@@ -456,28 +675,14 @@ write_fail:
 	return;
 }
 
-static uint64_t hash_reputation_entry(char *ip)
-{
-	return siphash(ip, siphashkey_reputation) % REPUTATION_HASH_TABLE_SIZE;
-}
-
-void add_reputation_entry(ReputationEntry *e)
+void add_reputation_entry(char *ip, ReputationEntry *e)
 {
-	int hashv = hash_reputation_entry(e->ip);
-
-	AddListItem(e, ReputationHashTable[hashv]);
+	ipstate_set(ip, reputation_slot, e);
 }
 
 ReputationEntry *find_reputation_entry(char *ip)
 {
-	ReputationEntry *e;
-	int hashv = hash_reputation_entry(ip);
-
-	for (e = ReputationHashTable[hashv]; e; e = e->next)
-		if (!strcmp(e->ip, ip))
-			return e;
-
-	return NULL;
+	return ipstate_get(ip, reputation_slot);
 }
 
 int reputation_lookup_score_and_set(Client *client)
@@ -491,6 +696,7 @@ int reputation_lookup_score_and_set(Client *client)
 		e = find_reputation_entry(ip);
 		if (e)
 		{
+			reputation_materialize(e);
 			Reputation(client) = e->score; /* SET MODDATA */
 		}
 	}
@@ -528,76 +734,125 @@ int reputation_pre_lconnect(Client *client)
 	return 0;
 }
 
-EVENT(add_scores)
+/** Materialize the score an entry has lazily accrued.
+ * While at least one user is connected from the IP, the entry earns a
+ * point per BUMP_SCORE_EVERY seconds (two points if any of them is
+ * logged into an account). Rather than bumping all entries from a
+ * periodic all-clients sweep, the points are computed here, from the
+ * time that has passed since the last materialization. This is called
+ * on every access to an entry (lookups, persistence, presence
+ * changes), so scores are always current when they are read.
+ */
+static void reputation_materialize(ReputationEntry *e)
+{
+	long now = TStime();
+	long periods;
+	int bump;
+
+	if (!e->present)
+	{
+		/* Nobody here: nothing accrues, just advance the clock */
+		e->accrued_until = now;
+		return;
+	}
+
+	e->last_seen = now;
+	periods = (now - e->accrued_until) / BUMP_SCORE_EVERY;
+	if (periods <= 0)
+		return;
+	/* Only consume whole periods, the remaining seconds keep counting */
+	e->accrued_until += periods * BUMP_SCORE_EVERY;
+	bump = periods * (e->present_registered ? 2 : 1);
+	if (e->score + bump > REPUTATION_SCORE_CAP)
+		e->score = REPUTATION_SCORE_CAP;
+	else
+		e->score += bump;
+	e->dirty = 1;
+}
+
+/** A user started counting towards the score of their IP.
+ * Called when a user comes online (local or remote).
+ */
+int reputation_connect(Client *client)
 {
-	static int marker = 0;
-	char *ip;
-	Client *client;
 	ReputationEntry *e;
 
-	/* This marker is used so we only bump score for an IP entry
-	 * once and not twice (or more) if there are multiple users
-	 * with the same IP address.
-	 */
-	marker += 2;
+	if (!client->ip || (moddata_client(client, reputation_presence_md).l != PRESENCE_NOT_COUNTED))
+		return 0;
 
-	/* These macros make the code below easier to read. Also,
-	 * this explains why we just did marker+=2 and not marker++.
-	 */
-	#define MARKER_UNREGISTERED_USER (marker)
-	#define MARKER_REGISTERED_USER (marker+1)
-	
-	list_for_each_entry(client, &client_list, client_node)
+	e = find_reputation_entry(client->ip);
+	if (!e)
 	{
-		if (!IsUser(client))
-			continue; /* skip servers, unknowns, etc.. */
+		e = safe_alloc(sizeof(ReputationEntry));
+		e->accrued_until = TStime();
+		add_reputation_entry(client->ip, e);
+	} else {
+		reputation_materialize(e);
+	}
+	e->present++;
+	e->last_seen = TStime();
+	e->dirty = 1;
+	if (IsLoggedIn(client))
+	{
+		e->present_registered++;
+		moddata_client(client, reputation_presence_md).l = PRESENCE_COUNTED_REGISTERED;
+	} else {
+		moddata_client(client, reputation_presence_md).l = PRESENCE_COUNTED;
+	}
+	return 0;
+}
 
-		ip = client->ip;
-		if (!ip)
-			continue;
+/** The user is gone: settle the accrued score and stop counting them */
+int reputation_quit(Client *client, MessageTag *mtags, char *comment)
+{
+	ReputationEntry *e;
+	long state = moddata_client(client, reputation_presence_md).l;
 
-		e = find_reputation_entry(ip);
-		if (!e)
-		{
-			/* Create */
-			e = safe_alloc(sizeof(ReputationEntry)+strlen(ip));
-			strcpy(e->ip, ip); /* safe, allocated above */
-			add_reputation_entry(e);
-		}
+	if ((state == PRESENCE_NOT_COUNTED) || !client->ip)
+		return 0;
+	moddata_client(client, reputation_presence_md).l = PRESENCE_NOT_COUNTED;
 
-		/* If this is not a duplicate entry, then bump the score.. */
-		if ((e->marker != MARKER_UNREGISTERED_USER) && (e->marker != MARKER_REGISTERED_USER))
-		{
-			e->marker = MARKER_UNREGISTERED_USER;
-			if (e->score < REPUTATION_SCORE_CAP)
-			{
-				/* Regular users receive a point. */
-				e->score++;
-				/* Registered users receive an additional point */
-				if (IsLoggedIn(client) && (e->score < REPUTATION_SCORE_CAP))
-				{
-					e->score++;
-					e->marker = MARKER_REGISTERED_USER;
-				}
-			}
-		} else
-		if ((e->marker == MARKER_UNREGISTERED_USER) && IsLoggedIn(client) && (e->score < REPUTATION_SCORE_CAP))
-		{
-			/* This is to catch a special case:
-			 * If there are 2 or more users with the same IP
-			 * address and the first user was not registered
-			 * then the IP entry only received a score bump of +1.
-			 * If the 2nd user (with same IP) is a registered
-			 * user then the IP should actually receive a
-			 * score bump of +2 (in total).
-			 */
-			e->score++;
-			e->marker = MARKER_REGISTERED_USER;
-		}
+	e = find_reputation_entry(client->ip);
+	if (!e)
+		return 0; /* should not happen: entries with users present never expire */
+	reputation_materialize(e);
+	if (e->present)
+		e->present--;
+	if ((state == PRESENCE_COUNTED_REGISTERED) && e->present_registered)
+		e->present_registered--;
+	e->last_seen = TStime();
+	e->dirty = 1;
+	return 0;
+}
 
-		e->last_seen = TStime();
-		Reputation(client) = e->score; /* update moddata */
+/** Account state changed: move the user between the registered and
+ * unregistered presence count (the former earns double points).
+ */
+int reputation_account_login(Client *client, MessageTag *mtags)
+{
+	ReputationEntry *e;
+	long state = moddata_client(client, reputation_presence_md).l;
+
+	if ((state == PRESENCE_NOT_COUNTED) || !client->ip)
+		return 0;
+
+	e = find_reputation_entry(client->ip);
+	if (!e)
+		return 0;
+	/* Settle at the old rate before the rate changes */
+	reputation_materialize(e);
+	if (IsLoggedIn(client) && (state == PRESENCE_COUNTED))
+	{
+		e->present_registered++;
+		moddata_client(client, reputation_presence_md).l = PRESENCE_COUNTED_REGISTERED;
+	} else
+	if (!IsLoggedIn(client) && (state == PRESENCE_COUNTED_REGISTERED))
+	{
+		if (e->present_registered)
+			e->present_registered--;
+		moddata_client(client, reputation_presence_md).l = PRESENCE_COUNTED;
 	}
+	return 0;
 }
 
 /** Is this entry expired? */
@@ -614,33 +869,39 @@ static inline int is_reputation_expired(ReputationEntry *e)
 	return 0;
 }
 
+static int delete_old_records_callback(char *ip, void *data, void *arg)
+{
+	ReputationEntry *e = data;
+
+	if (e->present)
+		return 0; /* users still connected from this IP, never expire */
+	if (is_reputation_expired(e))
+	{
+#ifdef DEBUGMODE
+		ircd_log(LOG_ERROR, "Deleting expired entry for '%s' (score %hd, last seen %lld seconds ago)",
+		         ip, e->score, (long long)(TStime() - e->last_seen));
+#endif
+		return 1; /* detach and free */
+	}
+	return 0;
+}
+
 EVENT(delete_old_records)
 {
-	int i;
-	ReputationEntry *e, *e_next;
+	static int chunk = 0;
+	int per_chunk = IPSTATE_HASH_TABLE_SIZE / DELETE_OLD_CHUNKS;
+	int first = chunk * per_chunk;
+	int last = (chunk == DELETE_OLD_CHUNKS - 1) ? IPSTATE_HASH_TABLE_SIZE - 1 : first + per_chunk - 1;
 #ifdef BENCHMARK
 	struct timeval tv_alpha, tv_beta;
 
 	gettimeofday(&tv_alpha, NULL);
 #endif
-	
-	for (i = 0; i < REPUTATION_HASH_TABLE_SIZE; i++)
-	{
-		for (e = ReputationHashTable[i]; e; e = e_next)
-		{
-			e_next = e->next;
-			
-			if (is_reputation_expired(e))
-			{
-#ifdef DEBUGMODE
-				ircd_log(LOG_ERROR, "Deleting expired entry for '%s' (score %hd, last seen %lld seconds ago)",
-				         e->ip, e->score, (long long)(TStime() - e->last_seen));
-#endif
-				DelListItem(e, ReputationHashTable[i]);
-				safe_free(e);
-			}
-		}
-	}
+
+	/* Incremental: one chunk of hash buckets per run, see DELETE_OLD_CHUNKS */
+	ipstate_iterate_range(reputation_slot, first, last, delete_old_records_callback, NULL);
+	if (++chunk >= DELETE_OLD_CHUNKS)
+		chunk = 0;
 
 #ifdef BENCHMARK
 	gettimeofday(&tv_beta, NULL);
@@ -649,9 +910,25 @@ EVENT(delete_old_records)
 #endif
 }
 
+EVENT(flush_journal_evt)
+{
+	save_journal();
+}
+
 EVENT(save_db_evt)
 {
-	save_db();
+	long threshold = count_reputation_records() / 4;
+
+	if (threshold < COMPACT_MIN_JOURNAL_ENTRIES)
+		threshold = COMPACT_MIN_JOURNAL_ENTRIES;
+
+	/* Only rewrite the full snapshot ("compact") once enough deltas
+	 * have piled up in the journal; the journal appends meanwhile
+	 * provide the durability. This is what makes steady-state I/O
+	 * cheap for databases with hundreds of thousands of entries.
+	 */
+	if (journal_entries >= threshold)
+		save_db();
 }
 
 CMD_FUNC(reputationunperm)
@@ -669,15 +946,17 @@ CMD_FUNC(reputationunperm)
 	               client->name);
 }
 
+static int count_reputation_records_callback(char *ip, void *data, void *arg)
+{
+	(*(int *)arg)++;
+	return 0;
+}
+
 int count_reputation_records(void)
 {
-	int i;
-	ReputationEntry *e;
 	int total = 0;
 
-	for (i = 0; i < REPUTATION_HASH_TABLE_SIZE; i++)
-		for (e = ReputationHashTable[i]; e; e = e->next)
-			total++;
+	ipstate_iterate(reputation_slot, count_reputation_records_callback, &total);
 
 	return total;
 }
@@ -708,6 +987,7 @@ CMD_FUNC(reputation_user_cmd)
 			sendnotice(client, "Last successful db write: never");
 		}
 		sendnotice(client, "Current number of records (IP's): %d", count_reputation_records());
+		sendnotice(client, "Journal: %ld delta(s) since last snapshot", journal_entries);
 		sendnotice(client, "-");
 		sendnotice(client, "For more specific information, use: /REPUTATION [nick|IP-address]");
 		return;
@@ -737,6 +1017,7 @@ CMD_FUNC(reputation_user_cmd)
 		sendnotice(client, "No reputation record found for IP %s", ip);
 		return;
 	}
+	reputation_materialize(e);
 
 	sendnotice(client, "****************************************************");
 	sendnotice(client, "Reputation record for IP %s:", ip);
@@ -802,6 +1083,8 @@ CMD_FUNC(reputation_server_cmd)
 		score = REPUTATION_SCORE_CAP;
 
 	e = find_reputation_entry(ip);
+	if (e)
+		reputation_materialize(e);
 	if (allow_reply && e && (e->score > score) && (e->score - score > UPDATE_SCORE_MARGIN))
 	{
 		/* We have a higher score, inform the client direction about it.
@@ -823,6 +1106,7 @@ CMD_FUNC(reputation_server_cmd)
 			ip, client->name, score, e->score, score);
 #endif
 		e->score = score;
+		e->dirty = 1;
 	}
 
 	/* If we don't have any entry for this IP, add it now. */
@@ -832,11 +1116,12 @@ CMD_FUNC(reputation_server_cmd)
 		ircd_log(LOG_ERROR, "[reputation] Score for '%s' from %s is %d, we had no entry, adding it",
 			ip, client->name, score);
 #endif
-		e = safe_alloc(sizeof(ReputationEntry)+strlen(ip));
-		strcpy(e->ip, ip); /* safe, see alloc above */
+		e = safe_alloc(sizeof(ReputationEntry));
 		e->score = score;
 		e->last_seen = TStime();
-		add_reputation_entry(e);
+		e->accrued_until = TStime();
+		e->dirty = 1;
+		add_reputation_entry(ip, e);
 	}
 
 	/* Propagate to the non-client direction (score may be updated) */
@@ -862,7 +1147,21 @@ int reputation_whois(Client *client, Client *target)
 
 	if (!IsOper(client))
 		return 0; /* only opers can see this.. */
-	
+
+	/* The moddata snapshot is from connect time; with lazy scoring the
+	 * entry itself is authoritative, so prefer the materialized score.
+	 */
+	if (target->ip)
+	{
+		ReputationEntry *e = find_reputation_entry(target->ip);
+		if (e)
+		{
+			reputation_materialize(e);
+			reputation = e->score;
+			Reputation(target) = e->score; /* refresh moddata */
+		}
+	}
+
 	if (reputation > 0)
 	{
 		sendto_one(client, NULL, ":%s %d %s %s :is using an IP with a reputation score of %d",
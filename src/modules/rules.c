@@ -59,21 +59,22 @@ MOD_UNLOAD()
 CMD_FUNC(cmd_rules)
 {
 	ConfigItem_tld *ptr;
+	MOTDFile *therules;
 	MOTDLine *temp;
 
-	temp = NULL;
+	therules = NULL;
 
 	if (hunt_server(client, recv_mtags, ":%s RULES :%s", 1, parc, parv) != HUNTED_ISME)
 		return;
 
 	ptr = find_tld(client);
 
-	if (ptr)
-		temp = ptr->rules.lines;
-	if(!temp)
-		temp = rules.lines;
+	if (ptr && ptr->rules.lines)
+		therules = &ptr->rules;
+	if (!therules)
+		therules = &rules;
 
-	if (temp == NULL)
+	if (therules->lines == NULL)
 	{
 		sendnumeric(client, ERR_NORULES);
 		return;
@@ -82,11 +83,15 @@ CMD_FUNC(cmd_rules)
 
 	sendnumeric(client, RPL_RULESSTART, me.name);
 
-	while (temp)
+	if (!send_motd_cache(client, therules, RPL_RULES))
 	{
-		sendnumeric(client, RPL_RULES,
-		    temp->line);
-		temp = temp->next;
+		temp = therules->lines;
+		while (temp)
+		{
+			sendnumeric(client, RPL_RULES,
+			    temp->line);
+			temp = temp->next;
+		}
 	}
 	sendnumeric(client, RPL_ENDOFRULES);
 }
@@ -85,16 +85,10 @@ CMD_FUNC(cmd_sendumode)
 
 	for (p = parv[1]; *p; p++)
 	{
-		for(i = 0; i <= Usermode_highest; i++)
-		{
-			if (!Usermode_Table[i].flag)
-				continue;
-			if (Usermode_Table[i].flag == *p)
-			{
-				umode_s |= Usermode_Table[i].mode;
-				break;
-			}
-		}
+		Umode *um = find_usermode(*p);
+
+		if (um)
+			umode_s |= um->mode;
 	}
 
 	list_for_each_entry(acptr, &oper_list, special_node)
@@ -88,7 +88,7 @@ void mtag_add_or_inherit_time(Client *sender, MessageTag *recv_mtags, MessageTag
 	MessageTag *m = find_mtag(recv_mtags, "time");
 	if (m)
 	{
-		m = duplicate_mtag(m);
+		m = duplicate_mtag_shared(m);
 	} else
 	{
 		struct timeval t;
@@ -96,7 +96,10 @@ void mtag_add_or_inherit_time(Client *sender, MessageTag *recv_mtags, MessageTag
 		time_t sec;
 		char buf[64];
 
-		gettimeofday(&t, NULL);
+		/* The cached clock is precise enough for message timestamps
+		 * and this runs for every single tagged message.
+		 */
+		t = timeofday_tv;
 		sec = t.tv_sec;
 		tm = gmtime(&sec);
 		snprintf(buf, sizeof(buf), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ",
@@ -108,9 +111,7 @@ void mtag_add_or_inherit_time(Client *sender, MessageTag *recv_mtags, MessageTag
 			tm->tm_sec,
 			(int)(t.tv_usec / 1000));
 
-		m = safe_alloc(sizeof(MessageTag));
-		safe_strdup(m->name, "time");
-		safe_strdup(m->value, buf);
+		m = new_mtag_arena("time", buf);
 	}
 	AddListItem(m, *mtag_list);
 }
@@ -24,8 +24,11 @@
 
 /* Forward declarations */
 void send_channel_modes_sjoin3(Client *to, Channel *channel);
+static void sjoin_batch_flush(Client *to);
+static void sjoin_batch_line(Client *to, char *mtags_str, char *line, int len);
 CMD_FUNC(cmd_server);
 CMD_FUNC(cmd_sid);
+CMD_FUNC(cmd_compress);
 int _verify_link(Client *client, char *servername, ConfigItem_link **link_out);
 void _send_protoctl_servers(Client *client, int response);
 void _send_server_message(Client *client);
@@ -63,6 +66,7 @@ MOD_INIT()
 {
 	CommandAdd(modinfo->handle, MSG_SERVER, cmd_server, MAXPARA, CMD_UNREGISTERED|CMD_SERVER);
 	CommandAdd(modinfo->handle, "SID", cmd_sid, MAXPARA, CMD_SERVER);
+	CommandAdd(modinfo->handle, "COMPRESS", cmd_compress, 1, CMD_SERVER);
 
 	MARK_AS_OFFICIAL_MODULE(modinfo);
 
@@ -585,6 +589,7 @@ CMD_FUNC(cmd_server)
 	}
 
 	/* Process deny server { } restrictions */
+	crule_eval_begin_round();
 	for (deny = conf_deny_link; deny; deny = deny->next)
 	{
 		if (deny->flag.type == CRULE_ALL && match_simple(deny->mask, servername)
@@ -763,6 +768,7 @@ CMD_FUNC(cmd_sid)
 	add_to_client_hash_table(acptr->name, acptr);
 	add_to_id_hash_table(acptr->id, acptr);
 	list_move(&acptr->client_node, &global_server_list);
+	client_array_del(acptr); /* servers are not part of the dense client_list mirror */
 
 	RunHook(HOOKTYPE_SERVER_CONNECT, acptr);
 
@@ -903,6 +909,54 @@ void _broadcast_sinfo(Client *acptr, Client *to, Client *except)
 	}
 }
 
+/* Flow control for the sync burst.
+ *
+ * The burst is generated in one synchronous pass, so on a large network
+ * the sendq would balloon to the full burst size before the first byte
+ * hits the wire. Making generation fully resumable - yield back to the
+ * event loop, continue when the sendq drains - is not safe with the
+ * current protocol: traffic arriving from other links meanwhile would
+ * be broadcast to the half-synced server and could reference users or
+ * channels that are not in its burst yet. What we can do safely is
+ * interleave generation with socket writes: whenever the sendq grows
+ * past the threshold, push what we have to the kernel before producing
+ * more. That bounds peak sendq memory to roughly the threshold plus
+ * whatever the socket refuses to take, without changing line order.
+ */
+/** COMPRESS command - sent by the peer right before it switches its
+ * side of the link to zlib compression (see server_sync). Everything
+ * the peer sends after this line is part of the compressed stream, so
+ * we activate the inflater immediately; raw bytes already buffered
+ * behind this line are handed off to it by the parser.
+ */
+CMD_FUNC(cmd_compress)
+{
+	if (!MyConnect(client) || !IsServer(client))
+		return;
+	if ((parc < 2) || strcmp(parv[1], "zlib"))
+	{
+		exit_client(client, NULL, "Unsupported compression method");
+		return;
+	}
+	if (!zip_start_in(client))
+		exit_client(client, NULL, "Compression initialization failed");
+}
+
+#define SYNC_FLUSH_THRESHOLD 1048576
+
+/** Give the socket a chance to drain the burst generated so far.
+ * @retval 1 Keep generating.
+ * @retval 0 The link died while writing, abort the burst.
+ */
+static int sync_flush(Client *to)
+{
+	if (IsDeadSocket(to))
+		return 0;
+	if (DBufLength(&to->local->sendQ) > SYNC_FLUSH_THRESHOLD)
+		send_queued(to);
+	return !IsDeadSocket(to);
+}
+
 int	server_sync(Client *cptr, ConfigItem_link *aconf)
 {
 	char		*inpath = get_client_name(cptr, TRUE);
@@ -911,6 +965,14 @@ int	server_sync(Client *cptr, ConfigItem_link *aconf)
 
 	ircd_log(LOG_SERVER, "SERVER %s", cptr->name);
 
+	/* Cork the link for the duration of the burst: the thousands of
+	 * short SID/UID/SJOIN lines then leave as full-sized TCP segments
+	 * instead of one packet each. send_queued() uncorks once the
+	 * send queue has fully drained (which implies EOS went out, as
+	 * that is queued last).
+	 */
+	sock_set_cork(cptr, 1);
+
 	if (cptr->local->passwd)
 	{
 		safe_free(cptr->local->passwd);
@@ -928,6 +990,22 @@ int	server_sync(Client *cptr, ConfigItem_link *aconf)
 		send_server_message(cptr);
 	}
 
+	/* Start compressing our side of the link if both sides agreed to it:
+	 * we have link::options::compressed and the peer announced
+	 * PROTOCTL COMPRESSION=zlib. The plaintext COMPRESS line marks the
+	 * exact point where our stream switches over; everything we queue
+	 * after zip_start_out() (the entire burst) goes out deflated.
+	 */
+	if (aconf && (aconf->options & CONNECT_COMPRESSED) && SupportCOMPRESSION(cptr))
+	{
+		sendto_one(cptr, NULL, "COMPRESS zlib");
+		if (!zip_start_out(cptr))
+		{
+			exit_client(cptr, NULL, "Compression initialization failed");
+			return 0;
+		}
+	}
+
 	/* Set up server structure */
 	free_pending_net(cptr);
 	SetServer(cptr);
@@ -935,7 +1013,9 @@ int	server_sync(Client *cptr, ConfigItem_link *aconf)
 	irccounts.servers++;
 	irccounts.unknown--;
 	list_move(&cptr->client_node, &global_server_list);
+	client_array_del(cptr); /* servers are not part of the dense client_list mirror */
 	list_move(&cptr->lclient_node, &lclient_list);
+	lclient_array_add(cptr);
 	list_add(&cptr->special_node, &server_list);
 	if (find_uline(cptr->name))
 	{
@@ -951,6 +1031,7 @@ int	server_sync(Client *cptr, ConfigItem_link *aconf)
 		SetULine(cptr);
 	}
 	find_or_add(cptr->name);
+	flight_record("Link %s -> %s established", me.name, inpath);
 	if (IsSecure(cptr))
 	{
 		sendto_umode_global(UMODE_OPER,
@@ -993,6 +1074,8 @@ int	server_sync(Client *cptr, ConfigItem_link *aconf)
 	}
 	cptr->serv->conf->class->clients++;
 	cptr->local->class = cptr->serv->conf->class;
+	if (cptr->local->class->options & CLASS_OPT_LARGE_SENDQ_BLOCKS)
+		dbuf_queue_set_large(&cptr->local->sendQ, 1);
 	RunHook(HOOKTYPE_SERVER_CONNECT, cptr);
 
 	/* Broadcast new server to the rest of the network */
@@ -1048,30 +1131,57 @@ int	server_sync(Client *cptr, ConfigItem_link *aconf)
 		if (acptr->direction == cptr)
 			continue;
 		if (IsUser(acptr))
+		{
 			introduce_user(cptr, acptr);
+			if (!sync_flush(cptr))
+				return 0;
+		}
 	}
 	/*
 	   ** Last, pass all channels plus statuses
 	 */
 	{
 		Channel *channel;
+		ModDataInfo *mdi;
+		char topicbuf[512];
+		int have_chan_md = 0;
+
+		/* Only channels with syncable moddata force a batch flush,
+		 * and such moddata rarely exists at all: check once.
+		 */
+		for (mdi = MDInfo; mdi; mdi = mdi->next)
+			if ((mdi->type == MODDATATYPE_CHANNEL) && mdi->sync && mdi->serialize)
+				have_chan_md = 1;
+
 		for (channel = channels; channel; channel = channel->nextch)
 		{
+			if (!sync_flush(cptr))
+				return 0;
 			send_channel_modes_sjoin3(cptr, channel);
 			if (channel->topic_time)
-				sendto_one(cptr, NULL, "TOPIC %s %s %lld :%s",
+			{
+				ircsnprintf(topicbuf, sizeof(topicbuf), "TOPIC %s %s %lld :%s",
 				    channel->chname, channel->topic_nick,
 				    (long long)channel->topic_time, channel->topic);
-			send_moddata_channel(cptr, channel);
+				sjoin_batch_line(cptr, NULL, topicbuf, strlen(topicbuf));
+			}
+			if (have_chan_md)
+			{
+				/* MD lines go through sendto_one() directly:
+				 * flush the batch first to keep the line order.
+				 */
+				sjoin_batch_flush(cptr);
+				send_moddata_channel(cptr, channel);
+			}
 		}
+		sjoin_batch_flush(cptr);
 	}
 	
 	/* Send ModData for all member(ship) structs */
+	if (!sync_flush(cptr))
+		return 0;
 	send_moddata_members(cptr);
 	
-	/* pass on TKLs */
-	tkl_sync(cptr);
-
 	RunHook(HOOKTYPE_SERVER_SYNC, cptr);
 
 	sendto_one(cptr, NULL, "NETINFO %i %lld %i %s 0 0 0 :%s",
@@ -1085,19 +1195,114 @@ int	server_sync(Client *cptr, ConfigItem_link *aconf)
 	ircd_log(LOG_ERROR, "[EOSDBG] server_sync: sending to justlinked '%s' with src ME...",
 			cptr->name);
 #endif
+
+	/* Large-but-deferrable state (TKLs and whatever else modules
+	 * registered) now trickles out via the post-EOS sync scheduler,
+	 * interleaved with normal traffic, rather than stacking onto the
+	 * burst above. See syncsched_register() in src/serv.c.
+	 */
+	syncsched_start(cptr);
+
 	RunHook(HOOKTYPE_POST_SERVER_CONNECT, cptr);
 	return 0;
 }
 
+/* Burst batching for SJOIN generation.
+ *
+ * On netjoin we generate one or more SJOIN lines for every channel we
+ * know, and on a big network that is easily tens of thousands of lines.
+ * Sending each of them through sendto_one() costs a printf-style pass,
+ * message tag serialization and a dbuf_put() per line. Instead the
+ * finished lines are rendered into this buffer and handed to the sendq
+ * in batches of many channels via sendbufto_one_batch(), see
+ * send_channel_modes_sjoin3() and server_sync().
+ */
+#define SJOINBATCH_SIZE 16384
+static char sjoinbatch[SJOINBATCH_SIZE];
+static int sjoinbatch_len = 0;
+static int sjoinbatch_lines = 0;
+
+/** Hand the accumulated burst lines to the sendq (if any) */
+static void sjoin_batch_flush(Client *to)
+{
+	if (!sjoinbatch_len)
+		return;
+	sendbufto_one_batch(to, sjoinbatch, sjoinbatch_len, sjoinbatch_lines);
+	sjoinbatch_len = sjoinbatch_lines = 0;
+}
+
+/** Append one finished line (without CR+LF) to the burst batch.
+ * @param to		The server the burst is for (only used when flushing)
+ * @param mtags_str	Serialized message tags to prepend, or NULL
+ * @param line		The line, NOT including the trailing CR+LF
+ * @param len		Length of 'line' in bytes
+ */
+static void sjoin_batch_line(Client *to, char *mtags_str, char *line, int len)
+{
+	int tagslen = !BadPtr(mtags_str) ? strlen(mtags_str) : 0;
+	int needed = len + 2 + (tagslen ? tagslen + 2 : 0); /* '@'+tags+' ' ... CR+LF */
+
+	if (sjoinbatch_len + needed > SJOINBATCH_SIZE)
+		sjoin_batch_flush(to);
+
+	if (tagslen)
+	{
+		sjoinbatch[sjoinbatch_len++] = '@';
+		memcpy(sjoinbatch + sjoinbatch_len, mtags_str, tagslen);
+		sjoinbatch_len += tagslen;
+		sjoinbatch[sjoinbatch_len++] = ' ';
+	}
+	memcpy(sjoinbatch + sjoinbatch_len, line, len);
+	sjoinbatch_len += len;
+	sjoinbatch[sjoinbatch_len++] = '\r';
+	sjoinbatch[sjoinbatch_len++] = '\n';
+	sjoinbatch_lines++;
+}
+
+/* Member prefix strings ("@", "+~", ..) precomputed per flag
+ * combination, so the per-member work in the burst loop is just two
+ * string copies.
+ */
+#define SJOINPFX_MASK (MODE_CHANOP|MODE_VOICE|MODE_HALFOP|MODE_CHANOWNER|MODE_CHANADMIN)
+static char sjoinpfx[SJOINPFX_MASK+1][8];
+static int sjoinpfx_built = 0;
+
+static void sjoin_build_prefixes(void)
+{
+	int i;
+
+	for (i = 0; i <= SJOINPFX_MASK; i++)
+	{
+		char *p = sjoinpfx[i];
+		if (i & MODE_CHANOP)
+			*p++ = '@';
+		if (i & MODE_VOICE)
+			*p++ = '+';
+		if (i & MODE_HALFOP)
+			*p++ = '%';
+		if (i & MODE_CHANOWNER)
+			*p++ = '*';
+		if (i & MODE_CHANADMIN)
+			*p++ = '~';
+		*p = '\0';
+	}
+	sjoinpfx_built = 1;
+}
+
 /** This will send "to" a full list of the modes for channel channel,
  *
  * Half of it recoded by Syzop: the whole buffering and size checking stuff
  * looked weird and just plain inefficient. We now fill up our send-buffer
  * really as much as we can, without causing any overflows of course.
+ *
+ * The lines end up in the burst batch, the caller must do a (final)
+ * sjoin_batch_flush() before sending anything else to 'to'.
  */
 void send_channel_modes_sjoin3(Client *to, Channel *channel)
 {
 	MessageTag *mtags = NULL;
+	char mtagsbuf[512];
+	char *mtags_str;
 	Member *members;
 	Member *lp;
 	Ban *ban;
@@ -1134,6 +1339,18 @@ void send_channel_modes_sjoin3(Client *to, Channel *channel)
 	 */
 	new_message(&me, NULL, &mtags);
 
+	/* Serialize the tags once for all lines of this channel.
+	 * Copied to a local buffer since mtags_to_string() returns a
+	 * static one and the batch may flush between our appends.
+	 */
+	mtags_str = mtags ? mtags_to_string(mtags, to) : NULL;
+	if (!BadPtr(mtags_str))
+	{
+		strlcpy(mtagsbuf, mtags_str, sizeof(mtagsbuf));
+		mtags_str = mtagsbuf;
+	} else
+		mtags_str = NULL;
+
 	if (nomode && nopara)
 	{
 		ircsnprintf(buf, sizeof(buf),
@@ -1178,20 +1395,12 @@ void send_channel_modes_sjoin3(Client *to, Channel *channel)
 	 *      -- Syzop
 	 */
 
+	if (!sjoinpfx_built)
+		sjoin_build_prefixes();
+
 	for (lp = members; lp; lp = lp->next)
 	{
-		p = tbuf;
-		if (lp->flags & MODE_CHANOP)
-			*p++ = '@';
-		if (lp->flags & MODE_VOICE)
-			*p++ = '+';
-		if (lp->flags & MODE_HALFOP)
-			*p++ = '%';
-		if (lp->flags & MODE_CHANOWNER)
-			*p++ = '*';
-		if (lp->flags & MODE_CHANADMIN)
-			*p++ = '~';
-
+		p = mystpcpy(tbuf, sjoinpfx[lp->flags & SJOINPFX_MASK]);
 		p = mystpcpy(p, lp->client->id);
 		*p++ = ' ';
 		*p = '\0';
@@ -1199,8 +1408,8 @@ void send_channel_modes_sjoin3(Client *to, Channel *channel)
 		/* this is: if (strlen(tbuf) + strlen(buf) > BUFSIZE - 8) */
 		if ((p - tbuf) + (bufptr - buf) > BUFSIZE - 8)
 		{
-			/* Would overflow, so send our current stuff right now (except new stuff) */
-			sendto_one(to, mtags, "%s", buf);
+			/* Would overflow, so batch our current stuff right now (except new stuff) */
+			sjoin_batch_line(to, mtags_str, buf, bufptr - buf);
 			sent++;
 			bufptr = buf + prebuflen;
 			*bufptr = '\0';
@@ -1222,8 +1431,8 @@ void send_channel_modes_sjoin3(Client *to, Channel *channel)
 		/* this is: if (strlen(tbuf) + strlen(buf) > BUFSIZE - 8) */
 		if ((p - tbuf) + (bufptr - buf) > BUFSIZE - 8)
 		{
-			/* Would overflow, so send our current stuff right now (except new stuff) */
-			sendto_one(to, mtags, "%s", buf);
+			/* Would overflow, so batch our current stuff right now (except new stuff) */
+			sjoin_batch_line(to, mtags_str, buf, bufptr - buf);
 			sent++;
 			bufptr = buf + prebuflen;
 			*bufptr = '\0';
@@ -1245,8 +1454,8 @@ void send_channel_modes_sjoin3(Client *to, Channel *channel)
 		/* this is: if (strlen(tbuf) + strlen(buf) > BUFSIZE - 8) */
 		if ((p - tbuf) + (bufptr - buf) > BUFSIZE - 8)
 		{
-			/* Would overflow, so send our current stuff right now (except new stuff) */
-			sendto_one(to, mtags, "%s", buf);
+			/* Would overflow, so batch our current stuff right now (except new stuff) */
+			sjoin_batch_line(to, mtags_str, buf, bufptr - buf);
 			sent++;
 			bufptr = buf + prebuflen;
 			*bufptr = '\0';
@@ -1268,8 +1477,8 @@ void send_channel_modes_sjoin3(Client *to, Channel *channel)
 		/* this is: if (strlen(tbuf) + strlen(buf) > BUFSIZE - 8) */
 		if ((p - tbuf) + (bufptr - buf) > BUFSIZE - 8)
 		{
-			/* Would overflow, so send our current stuff right now (except new stuff) */
-			sendto_one(to, mtags, "%s", buf);
+			/* Would overflow, so batch our current stuff right now (except new stuff) */
+			sjoin_batch_line(to, mtags_str, buf, bufptr - buf);
 			sent++;
 			bufptr = buf + prebuflen;
 			*bufptr = '\0';
@@ -1279,7 +1488,7 @@ void send_channel_modes_sjoin3(Client *to, Channel *channel)
 	}
 
 	if (buf[prebuflen] || !sent)
-		sendto_one(to, mtags, "%s", buf);
+		sjoin_batch_line(to, mtags_str, buf, bufptr - buf);
 
 	free_message_tags(mtags);
 }
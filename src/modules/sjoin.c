@@ -179,6 +179,8 @@ CMD_FUNC(cmd_sjoin)
 		nomode = 1;
 
 	channel = get_channel(client, parv[2], CREATE);
+	/* SJOIN merges modes/bans/members directly, invalidate cached can-send verdicts */
+	channel->acl_generation++;
 
 	ts = (time_t)atol(parv[1]);
 
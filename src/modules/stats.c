@@ -56,8 +56,12 @@ extern MODVAR int  max_connection_count;
 extern char *get_client_name2(Client *, int);
 
 int stats_banversion(Client *, char *);
+int stats_boottime(Client *, char *);
+int stats_latency(Client *, char *);
+int stats_handshake(Client *, char *);
 int stats_links(Client *, char *);
 int stats_denylinkall(Client *, char *);
+int stats_fakelag(Client *, char *);
 int stats_gline(Client *, char *);
 int stats_except(Client *, char *);
 int stats_allow(Client *, char *);
@@ -86,6 +90,9 @@ int stats_class(Client *, char *);
 int stats_officialchannels(Client *, char *);
 int stats_spamfilter(Client *, char *);
 int stats_fdtable(Client *, char *);
+int stats_cputime(Client *, char *);
+int stats_mempool(Client *, char *);
+int stats_memory(Client *, char *);
 
 #define SERVER_AS_PARA 0x1
 #define FLAGS_AS_PARA 0x2
@@ -100,9 +107,12 @@ struct statstab {
 /* Must be listed lexicographically */
 /* Long flags must be lowercase */
 struct statstab StatsTable[] = {
+	{ 'A', "latency",	stats_latency,		0		},
 	{ 'B', "banversion",	stats_banversion,	0		},
 	{ 'C', "link", 		stats_links,		0 		},
 	{ 'D', "denylinkall",	stats_denylinkall,	0		},
+	{ 'E', "handshake",	stats_handshake,	FLAGS_AS_PARA	},
+	{ 'F', "fakelag",	stats_fakelag,		0		},
 	{ 'G', "gline",		stats_gline,		FLAGS_AS_PARA	},
 	{ 'H', "link",	 	stats_links,		0 		},
 	{ 'I', "allow",		stats_allow,		0 		},
@@ -112,6 +122,7 @@ struct statstab StatsTable[] = {
 	{ 'O', "oper",		stats_oper,		0 		},
 	{ 'P', "port",		stats_port,		0 		},
 	{ 'Q', "sqline",	stats_sqline,		FLAGS_AS_PARA 	},
+	{ 'R', "cputime",	stats_cputime,		0		},
 	{ 'S', "set",		stats_set,		0		},
 	{ 'T', "traffic",	stats_traffic,		0 		},
 	{ 'U', "uline",		stats_uline,		0 		},
@@ -119,6 +130,8 @@ struct statstab StatsTable[] = {
 	{ 'W', "fdtable",       stats_fdtable,          0               },
 	{ 'X', "notlink",	stats_notlink,		0 		},
 	{ 'Y', "class",		stats_class,		0 		},
+	{ 'Z', "memory",	stats_memory,		0		},
+	{ 'b', "boottime",	stats_boottime,		0		},
 	{ 'c', "link", 		stats_links,		0 		},
 	{ 'd', "denylinkauto",	stats_denylinkauto,	0 		},
 	{ 'e', "except",	stats_except,		0 		},
@@ -139,6 +152,7 @@ struct statstab StatsTable[] = {
 	{ 'v', "denyver",	stats_denyver,		0 		},
 	{ 'x', "notlink",	stats_notlink,		0 		},
 	{ 'y', "class",		stats_class,		0 		},
+	{ 'z', "mempool",	stats_mempool,		0 		},
 	{ 0, 	NULL, 		NULL, 			0		}
 };
 
@@ -195,6 +209,7 @@ static inline void stats_help(Client *client)
 	sendnumeric(client, RPL_STATSHELP, "d - denylinkauto - Send the deny link (auto) block list");
 	sendnumeric(client, RPL_STATSHELP, "D - denylinkall - Send the deny link (all) block list");
 	sendnumeric(client, RPL_STATSHELP, "e - except - Send the ban exception list (ELINEs and in config))");
+	sendnumeric(client, RPL_STATSHELP, "E - handshake - Send handshake phase latency histograms (or +nick for one client)");
 	sendnumeric(client, RPL_STATSHELP, "f - spamfilter - Send the spamfilter list");
 	sendnumeric(client, RPL_STATSHELP, "F - denydcc - Send the deny dcc and allow dcc block lists");
 	sendnumeric(client, RPL_STATSHELP, "G - gline - Send the gline and gzline list");
@@ -389,6 +404,32 @@ CMD_FUNC(cmd_stats)
 			stat->flag, client->name, client->user->username, GetHost(client));
 }
 
+/** Main loop latency histogram and stall watchdog counters.
+ * See loop_latency_account() in src/ircd.c for how these are gathered.
+ */
+int stats_latency(Client *client, char *para)
+{
+	long long total = 0;
+	int i;
+
+	for (i = 0; i < LOOP_LATENCY_BUCKETS; i++)
+		total += loop_latency_hist[i];
+
+	sendtxtnumeric(client, "Main loop iterations: %lld", total);
+	sendtxtnumeric(client, "Slowest iteration: %lld msec", loop_latency_max_msec);
+	sendtxtnumeric(client, "Fresh clock reads: %lld", mono_clock_reads);
+	if (LOOP_STALL_WARNING_TIME)
+		sendtxtnumeric(client, "Stall warnings (>=%s): %lld",
+			pretty_time_val(LOOP_STALL_WARNING_TIME), loop_latency_stalls);
+	else
+		sendtxtnumeric(client, "Stall warnings: disabled (set::loop-stall-warning-time 0)");
+	for (i = 0; i < LOOP_LATENCY_BUCKETS - 1; i++)
+		sendtxtnumeric(client, "busy < %4d msec: %lld", 1 << i, loop_latency_hist[i]);
+	sendtxtnumeric(client, "busy >=%4d msec: %lld", 1 << (LOOP_LATENCY_BUCKETS - 2),
+		loop_latency_hist[LOOP_LATENCY_BUCKETS - 1]);
+	return 0;
+}
+
 int stats_banversion(Client *client, char *para)
 {
 	ConfigItem_ban *bans;
@@ -460,6 +501,99 @@ int stats_denylinkall(Client *client, char *para)
 	return 0;
 }
 
+static const char *handshake_phase_name[HANDSHAKE_NPHASES] = { "dns", "ident", "dnsbl", "tls", "total" };
+
+/** Handshake phase latency: aggregated histograms, or with '+nick' as
+ * parameter the per-phase breakdown of one local client.
+ * See handshake_phase_done() in src/socket.c for how these are gathered.
+ */
+int stats_handshake(Client *client, char *para)
+{
+	int phase, i;
+
+	if (para && (*para == '+') && para[1])
+	{
+		Client *acptr = find_person(para + 1, NULL);
+		HandshakeTimings *t;
+
+		if (!acptr)
+		{
+			sendnumeric(client, ERR_NOSUCHNICK, para + 1);
+			return 0;
+		}
+		if (!MyConnect(acptr))
+		{
+			sendtxtnumeric(client, "%s is not connected to this server, no handshake timings available", acptr->name);
+			return 0;
+		}
+		t = &acptr->local->handshake;
+		sendtxtnumeric(client, "Handshake timings for %s:", acptr->name);
+		for (phase = 0; phase < HANDSHAKE_NPHASES; phase++)
+		{
+			int ms;
+			switch (phase)
+			{
+				case HANDSHAKE_PHASE_DNS: ms = t->dns_ms; break;
+				case HANDSHAKE_PHASE_IDENT: ms = t->ident_ms; break;
+				case HANDSHAKE_PHASE_DNSBL: ms = t->dnsbl_ms; break;
+				case HANDSHAKE_PHASE_TLS: ms = t->tls_ms; break;
+				default: ms = t->total_ms; break;
+			}
+			if (ms < 0)
+				sendtxtnumeric(client, "%-5s: n/a (phase did not run or has not finished)", handshake_phase_name[phase]);
+			else
+				sendtxtnumeric(client, "%-5s: %d msec", handshake_phase_name[phase], ms);
+		}
+		return 0;
+	}
+
+	for (phase = 0; phase < HANDSHAKE_NPHASES; phase++)
+	{
+		HandshakePhaseStats *st = &handshake_phase_stats[phase];
+
+		if (!st->samples)
+		{
+			sendtxtnumeric(client, "%-5s: no samples", handshake_phase_name[phase]);
+			continue;
+		}
+		sendtxtnumeric(client, "%-5s: %u sample%s, avg %llu msec",
+			handshake_phase_name[phase], st->samples,
+			(st->samples == 1) ? "" : "s", st->total_ms / st->samples);
+		for (i = 0; i < HANDSHAKE_NBUCKETS - 1; i++)
+			sendtxtnumeric(client, "%-5s  < %4d msec: %u",
+				handshake_phase_name[phase], handshake_bucket_ms[i], st->buckets[i]);
+		sendtxtnumeric(client, "%-5s >= %4d msec: %u",
+			handshake_phase_name[phase], handshake_bucket_ms[HANDSHAKE_NBUCKETS - 2],
+			st->buckets[HANDSHAKE_NBUCKETS - 1]);
+	}
+	return 0;
+}
+
+int stats_fakelag(Client *client, char *para)
+{
+	Client *acptr;
+	long lag;
+	int shown = 0;
+
+	list_for_each_entry(acptr, &lclient_list, lclient_node)
+	{
+		if (!IsUser(acptr))
+			continue;
+		lag = (long)(acptr->local->since - TStime());
+		if (lag <= 0)
+			continue;
+		sendtxtnumeric(client, "%s fakelag: %ld second%s of penalty, recvq: %u byte%s%s",
+			acptr->name, lag, (lag == 1) ? "" : "s",
+			DBufLength(&acptr->local->recvQ),
+			(DBufLength(&acptr->local->recvQ) == 1) ? "" : "s",
+			(lag >= 10) ? " (LAGGED UP)" : "");
+		shown++;
+	}
+	sendtxtnumeric(client, "%d client%s with accumulated fake lag (threshold for withholding data: 10 seconds)",
+		shown, (shown == 1) ? "" : "s");
+	return 0;
+}
+
 int stats_gline(Client *client, char *para)
 {
 	tkl_stats(client, TKL_GLOBAL|TKL_KILL, para);
@@ -487,7 +621,8 @@ int stats_allow(Client *client, char *para)
 	for (allows = conf_allow; allows; allows = allows->next)
 		sendnumeric(client, RPL_STATSILINE, allows->ip, allows->hostname, allows->maxperip,
 			allows->class->name, allows->server ? allows->server
-			: defserv, allows->port ? allows->port : 6667);
+			: defserv, allows->port ? allows->port : 6667,
+			allows->hits);
 	return 0;
 }
 
@@ -511,6 +646,86 @@ int stats_command(Client *client, char *para)
 	return 0;
 }
 
+int stats_cputime(Client *client, char *para)
+{
+	int i;
+	RealCommand *mptr;
+
+	for (i = 0; i < 256; i++)
+	{
+		for (mptr = CommandHash[i]; mptr; mptr = mptr->next)
+		{
+			if (!mptr->count)
+				continue;
+			sendtxtnumeric(client, "%s: %u call%s, total %lld.%03lld ms, avg %lld usec, max %lld usec",
+				mptr->cmd,
+				mptr->count, (mptr->count == 1) ? "" : "s",
+				mptr->time_usec / 1000, mptr->time_usec % 1000,
+				mptr->time_usec / mptr->count,
+				mptr->time_max_usec);
+		}
+	}
+	return 0;
+}
+
+/** Memory pool telemetry (/STATS z). One line per pool: current and
+ * peak item usage, chunk counts, and how much chunk memory is
+ * committed vs handed back to the OS by the decommit pass.
+ */
+int stats_mempool(Client *client, char *para)
+{
+	mp_pool_t *pool = mp_pools();
+	mp_pool_usage_t usage;
+
+	if (!pool)
+	{
+		sendtxtnumeric(client, "Memory pooling is not active in this build");
+		return 0;
+	}
+
+	for (; pool; pool = pool->next)
+	{
+		mp_pool_usage(pool, &usage);
+		sendtxtnumeric(client, "mempool %s: items %lld/%lld (peak %lld, size %lld), "
+		                       "chunks %d (%d empty), %lld bytes committed, %lld decommitted, "
+		                       "lifetime: %lld items, %lld/%lld chunks alloc/freed",
+			usage.name ? usage.name : "???",
+			usage.items_in_use, usage.items_capacity, usage.items_peak,
+			(long long)usage.item_size,
+			usage.chunks, usage.empty_chunks,
+			(long long)usage.bytes_committed, (long long)usage.bytes_decommitted,
+			(long long)usage.total_items_allocated,
+			(long long)usage.total_chunks_allocated,
+			(long long)usage.total_chunks_freed);
+	}
+	return 0;
+}
+
+/** Consolidated memory report (/STATS Z). One line per registered
+ * memory counter (see MemoryCounterAdd in src/api-memory.c) plus a
+ * grand total. The per-subsystem numbers are approximations, meant to
+ * show which subsystem grew - /STATS z has the exact pool telemetry.
+ */
+int stats_memory(Client *client, char *para)
+{
+	MemoryCounter *m;
+	long long objects, bytes;
+	long long total_objects = 0, total_bytes = 0;
+
+	for (m = memorycounters; m; m = m->next)
+	{
+		objects = bytes = 0;
+		m->count(&objects, &bytes);
+		sendtxtnumeric(client, "%s: %lld object(s), %lld bytes",
+			m->name, objects, bytes);
+		total_objects += objects;
+		total_bytes += bytes;
+	}
+	sendtxtnumeric(client, "Total: %lld object(s), %lld bytes (%.1f MB)",
+		total_objects, total_bytes, (double)total_bytes / 1048576.0);
+	return 0;
+}
+
 int stats_oper(Client *client, char *para)
 {
 	ConfigItem_oper *oper_p;
@@ -639,6 +854,9 @@ int stats_traffic(Client *client, char *para)
 	sendnumericfmt(client, RPL_STATSDEBUG, "time connected %lld %lld",
 	    (long long)sp->is_cti, (long long)sp->is_sti);
 
+	/* Per-link compression ratios, for compressed server links (if any) */
+	zip_stats(client);
+
 	return 0;
 }
 
@@ -646,12 +864,9 @@ int stats_fdtable(Client *client, char *para)
 {
 	int i;
 
-	for (i = 0; i < MAXCONNECTIONS; i++)
+	for_each_open_fd(i)
 	{
-		FDEntry *fde = &fd_table[i];
-
-		if (!fde->is_open)
-			continue;
+		FDEntry *fde = fd_entry(i);
 
 		sendnumericfmt(client, RPL_STATSDEBUG,
 			"fd %3d, desc '%s', read-hdl %p, write-hdl %p, cbdata %p",
@@ -867,6 +1082,7 @@ int stats_set(Client *client, char *para)
 	}
 	sendtxtnumeric(client, "anti-flood::nick-flood: %d per %s", NICK_COUNT, pretty_time_val(NICK_PERIOD));
 	sendtxtnumeric(client, "handshake-timeout: %s", pretty_time_val(iConf.handshake_timeout));
+	sendtxtnumeric(client, "loop-stall-warning-time: %s", pretty_time_val(iConf.loop_stall_warning_time));
 	sendtxtnumeric(client, "sasl-timeout: %s", pretty_time_val(iConf.sasl_timeout));
 	sendtxtnumeric(client, "ident::connect-timeout: %s", pretty_time_val(IDENT_CONNECT_TIMEOUT));
 	sendtxtnumeric(client, "ident::read-timeout: %s", pretty_time_val(IDENT_READ_TIMEOUT));
@@ -913,6 +1129,13 @@ int stats_uptime(Client *client, char *para)
 	return 0;
 }
 
+/** Boot phase timings (/STATS boottime), see boot_phase() in ircd.c */
+int stats_boottime(Client *client, char *para)
+{
+	boot_phase_report(client);
+	return 0;
+}
+
 int stats_denyver(Client *client, char *para)
 {
 	ConfigItem_deny_version *versions;
@@ -942,11 +1165,33 @@ int stats_notlink(Client *client, char *para)
 int stats_class(Client *client, char *para)
 {
 	ConfigItem_class *classes;
+	int i;
 
 	for (classes = conf_class; classes; classes = classes->next)
 	{
 		sendnumeric(client, RPL_STATSYLINE, classes->name, classes->pingfreq, classes->connfreq,
 			classes->maxclients, classes->sendq, classes->recvq ? classes->recvq : DEFAULT_RECVQ);
+		if (classes->sendq_peak || classes->sendq_overflows)
+			sendtxtnumeric(client, "class '%s' sendq peak: %u bytes, sendq exceeded kills: %u",
+				classes->name, classes->sendq_peak, classes->sendq_overflows);
+		if (classes->sendq_above_time || classes->sendq_alerts)
+			sendtxtnumeric(client, "class '%s' time above 50%% sendq: %lld second%s, early warnings: %u",
+				classes->name, classes->sendq_above_time,
+				(classes->sendq_above_time == 1) ? "" : "s", classes->sendq_alerts);
+		for (i = 0; i < SENDQ_HIST_NBUCKETS; i++)
+			if (classes->sendq_hist[i])
+				break;
+		if (i < SENDQ_HIST_NBUCKETS)
+		{
+			for (i = 0; i < SENDQ_HIST_NBUCKETS - 1; i++)
+				if (classes->sendq_hist[i])
+					sendtxtnumeric(client, "class '%s' sendq at flush <%d%%: %u",
+						classes->name, sendq_hist_pct[i], classes->sendq_hist[i]);
+			if (classes->sendq_hist[SENDQ_HIST_NBUCKETS - 1])
+				sendtxtnumeric(client, "class '%s' sendq at flush >=%d%%: %u",
+					classes->name, sendq_hist_pct[SENDQ_HIST_NBUCKETS - 2],
+					classes->sendq_hist[SENDQ_HIST_NBUCKETS - 1]);
+		}
 #ifdef DEBUGMODE
 		sendnotice(client, "class '%s' has clients=%d, xrefcount=%d",
 			classes->name, classes->clients, classes->xrefcount);
@@ -965,15 +1210,63 @@ int stats_linkinfoall(Client *client, char *para)
 	return stats_linkinfoint(client, para, 1);
 }
 
-int stats_linkinfoint(Client *client, char *para, int all)
+/** Sends one RPL_STATSLINKINFO row for 'acptr', see stats_linkinfoint() */
+static void stats_linkinfo_send(Client *client, Client *acptr, int all, int showports)
 {
 #ifndef DEBUGMODE
-	static char Sformat[] = "SendQ SendM SendBytes RcveM RcveBytes Open_since :Idle";
 	static char Lformat[] = "%s%s %u %u %u %u %u %u :%u";
 #else
-	static char Sformat[] = "SendQ SendM SendBytes RcveM RcveBytes Open_since CPU :Idle";
 	static char Lformat[] = "%s%s %u %u %u %u %u %u %s";
 	char pbuf[96];		/* Should be enough for to ints */
+
+	ircsnprintf(pbuf, sizeof(pbuf), "%ld :%ld", (long)acptr->local->cputime,
+	      (long)(acptr->user && MyConnect(acptr)) ? TStime() - acptr->local->last : 0);
+#endif
+	if (showports)
+	{
+		sendnumericfmt(client, RPL_STATSLINKINFO, Lformat,
+			all ?
+			(get_client_name2(acptr, showports)) :
+			(get_client_name(acptr, FALSE)),
+			get_client_status(acptr),
+			(int)DBufLength(&acptr->local->sendQ),
+			(int)acptr->local->sendM, (int)acptr->local->sendK,
+			(int)acptr->local->receiveM,
+			(int)acptr->local->receiveK,
+		 	TStime() - acptr->local->firsttime,
+#ifndef DEBUGMODE
+			(acptr->user && MyConnect(acptr)) ?
+			TStime() - acptr->local->last : 0);
+#else
+			pbuf);
+#endif
+	}
+	else if (!strchr(acptr->name, '.'))
+		sendnumericfmt(client, RPL_STATSLINKINFO, Lformat,
+			IsHidden(acptr) ? acptr->name :
+			all ?	/* Potvin - PreZ */
+			get_client_name2(acptr, showports) :
+			get_client_name(acptr, FALSE),
+			get_client_status(acptr),
+			(int)DBufLength(&acptr->local->sendQ),
+			(int)acptr->local->sendM, (int)acptr->local->sendK,
+			(int)acptr->local->receiveM,
+			(int)acptr->local->receiveK,
+			TStime() - acptr->local->firsttime,
+#ifndef DEBUGMODE
+			(acptr->user && MyConnect(acptr)) ?
+			TStime() - acptr->local->last : 0);
+#else
+			pbuf);
+#endif
+}
+
+int stats_linkinfoint(Client *client, char *para, int all)
+{
+#ifndef DEBUGMODE
+	static char Sformat[] = "SendQ SendM SendBytes RcveM RcveBytes Open_since :Idle";
+#else
+	static char Sformat[] = "SendQ SendM SendBytes RcveM RcveBytes Open_since CPU :Idle";
 #endif
 	int remote = 0;
 	int wilds = 0;
@@ -1004,6 +1297,23 @@ int stats_linkinfoint(Client *client, char *para, int all)
 		wilds = 0;
 	}
 
+	if (!doall && !wilds)
+	{
+		/* An exact target: the rows are every local server link plus
+		 * the named connection. Serve them from server_list and a
+		 * hash lookup instead of scanning every local connection,
+		 * which matters on servers with many local clients
+		 * (monitoring tends to poll this).
+		 */
+		if (!remote)
+		{
+			list_for_each_entry(acptr, &server_list, special_node)
+				stats_linkinfo_send(client, acptr, all, showports);
+		}
+		acptr = para ? find_client(para, NULL) : NULL;
+		if (acptr && MyConnect(acptr) && !IsMe(acptr) && !IsServer(acptr))
+			stats_linkinfo_send(client, acptr, all, showports);
+	} else
 	list_for_each_entry(acptr, &lclient_list, lclient_node)
 	{
 		if (IsInvisible(acptr) && (doall || wilds) &&
@@ -1022,47 +1332,7 @@ int stats_linkinfoint(Client *client, char *para, int all)
 			continue;
 		}
 
-#ifdef DEBUGMODE
-		ircsnprintf(pbuf, sizeof(pbuf), "%ld :%ld", (long)acptr->local->cputime,
-		      (long)(acptr->user && MyConnect(acptr)) ? TStime() - acptr->local->last : 0);
-#endif
-		if (ValidatePermissionsForPath("server:info:stats",client,NULL,NULL,NULL))
-		{
-			sendnumericfmt(client, RPL_STATSLINKINFO, Lformat,
-				all ?
-				(get_client_name2(acptr, showports)) :
-				(get_client_name(acptr, FALSE)),
-				get_client_status(acptr),
-				(int)DBufLength(&acptr->local->sendQ),
-				(int)acptr->local->sendM, (int)acptr->local->sendK,
-				(int)acptr->local->receiveM,
-				(int)acptr->local->receiveK,
-			 	TStime() - acptr->local->firsttime,
-#ifndef DEBUGMODE
-				(acptr->user && MyConnect(acptr)) ?
-				TStime() - acptr->local->last : 0);
-#else
-				pbuf);
-#endif
-		}
-		else if (!strchr(acptr->name, '.'))
-			sendnumericfmt(client, RPL_STATSLINKINFO, Lformat,
-				IsHidden(acptr) ? acptr->name :
-				all ?	/* Potvin - PreZ */
-				get_client_name2(acptr, showports) :
-				get_client_name(acptr, FALSE),
-				get_client_status(acptr),
-				(int)DBufLength(&acptr->local->sendQ),
-				(int)acptr->local->sendM, (int)acptr->local->sendK,
-				(int)acptr->local->receiveM,
-				(int)acptr->local->receiveK,
-				TStime() - acptr->local->firsttime,
-#ifndef DEBUGMODE
-				(acptr->user && MyConnect(acptr)) ?
-				TStime() - acptr->local->last : 0);
-#else
-				pbuf);
-#endif
+		stats_linkinfo_send(client, acptr, all, showports);
 	}
 #ifdef DEBUGMODE
 	list_for_each_entry(acptr, &client_list, client_node)
@@ -195,7 +195,7 @@ void clear_bans(Client *client, Channel *channel, char chmode)
  *
  * OLD syntax had a 'ts' parameter. No services are known to use this.
  */
-void channel_svsmode(Client *client, int parc, char *parv[]) 
+void channel_svsmode(Client *client, int parc, char *parv[])
 {
 	Channel *channel;
 	Client *target;
@@ -203,7 +203,7 @@ void channel_svsmode(Client *client, int parc, char *parv[])
 	int what = MODE_ADD;
 	int i = 4; // wtf is this
 	Member *cm;
-	int channel_flags;
+	int strip_flags = 0; /* member flags to remove, all in one pass */
 
 	*parabuf = *modebuf = '\0';
 
@@ -234,19 +234,12 @@ void channel_svsmode(Client *client, int parc, char *parv[])
 						*m, channel->chname, client->name);
 					continue;
 				}
-				channel_flags = char_to_channelflag(*m);
-				for (cm = channel->members; cm; cm = cm->next)
-				{
-					if (cm->flags & channel_flags)
-					{
-						Membership *mb;
-						mb = find_membership_link(cm->client->user->channel, channel);
-						add_send_mode_param(channel, client, '-', *m, cm->client->name);
-						cm->flags &= ~channel_flags;
-						if (mb)
-							mb->flags = cm->flags;
-					}
-				}
+				/* Collected here, then applied in one single walk
+				 * over the members below: services routinely strip
+				 * several statuses at once (eg -qaohv) and walking
+				 * a big channel once per letter adds up.
+				 */
+				strip_flags |= char_to_channelflag(*m);
 				break;
 			case 'b':
 			case 'e':
@@ -274,6 +267,48 @@ void channel_svsmode(Client *client, int parc, char *parv[])
 		}
 	}
 
+	if (strip_flags)
+	{
+		/* One walk over the members, removing all requested
+		 * statuses at once (one membership lookup per affected
+		 * member, rather than one walk + lookup per mode letter).
+		 */
+		static const struct { char letter; int flag; } statusmodes[] = {
+			{ 'q', CHFL_CHANOWNER },
+			{ 'a', CHFL_CHANADMIN },
+			{ 'o', CHFL_CHANOP },
+			{ 'h', CHFL_HALFOP },
+			{ 'v', CHFL_VOICE },
+		};
+		int n;
+		int stripped = 0;
+
+		for (cm = channel->members; cm; cm = cm->next)
+		{
+			Membership *mb;
+
+			if (!(cm->flags & strip_flags))
+				continue;
+			mb = find_membership_link(cm->client->user->channel, channel);
+			for (n = 0; n < ARRAY_SIZEOF(statusmodes); n++)
+			{
+				if ((cm->flags & strip_flags) & statusmodes[n].flag)
+					add_send_mode_param(channel, client, '-', statusmodes[n].letter, cm->client->name);
+			}
+			cm->flags &= ~strip_flags;
+			if (mb)
+				mb->flags = cm->flags;
+			stripped = 1;
+		}
+
+		/* Member statuses changed: invalidate cached output that
+		 * embeds member prefixes (NAMES, WHOIS channels), just
+		 * like the normal MODE path does.
+		 */
+		if (stripped)
+			channel->acl_generation++;
+	}
+
 	/* only send message if modes have changed */
 	if (*parabuf)
 	{
@@ -363,7 +398,10 @@ void do_svsmode(Client *client, MessageTag *recv_mtags, int parc, char *parv[],
 				if ((what == MODE_ADD) && !(target->umodes & UMODE_OPER))
 				{
 					if (!IsOper(target) && MyUser(target))
+					{
 						list_add(&target->special_node, &oper_list);
+						invalidate_snomask_subscribers();
+					}
 
 					irccounts.operators++;
 				}
@@ -378,7 +416,10 @@ void do_svsmode(Client *client, MessageTag *recv_mtags, int parc, char *parv[],
 					}
 
 					if (MyUser(target) && !list_empty(&target->special_node))
+					{
 						list_del(&target->special_node);
+						invalidate_snomask_subscribers();
+					}
 					
 					/* User is no longer oper (after the goto below, anyway)...
 					 * so remove all oper-only modes and snomasks.
@@ -475,17 +516,15 @@ void do_svsmode(Client *client, MessageTag *recv_mtags, int parc, char *parv[],
 				break;
 			default:
 				setmodex:
-				for (i = 0; i <= Usermode_highest; i++)
 				{
-					if (!Usermode_Table[i].flag)
-						continue;
-					if (*m == Usermode_Table[i].flag)
+					Umode *um = find_usermode(*m);
+
+					if (um)
 					{
 						if (what == MODE_ADD)
-							target->umodes |= Usermode_Table[i].mode;
+							target->umodes |= um->mode;
 						else
-							target->umodes &= ~Usermode_Table[i].mode;
-						break;
+							target->umodes &= ~um->mode;
 					}
 				}
 				break;
@@ -504,7 +543,10 @@ void do_svsmode(Client *client, MessageTag *recv_mtags, int parc, char *parv[],
 	   only if the old flags (setflags) are different than the newly-
 	   set ones */
 	if (setflags != target->umodes)
+	{
+		target->user->acl_generation++; /* umodes can matter to ban masks (eg ~O) */
 		RunHook3(HOOKTYPE_UMODE_CHANGE, client, setflags, target->umodes);
+	}
 
 	if (show_change)
 	{
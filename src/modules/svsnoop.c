@@ -79,7 +79,10 @@ CMD_FUNC(cmd_svsnoop)
 					}
 
 					if (!list_empty(&acptr->special_node))
+					{
 						list_del(&acptr->special_node);
+						invalidate_snomask_subscribers();
+					}
 
 					remove_oper_privileges(acptr, 1);
 					RunHook2(HOOKTYPE_LOCAL_OPER, acptr, 0);
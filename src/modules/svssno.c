@@ -116,6 +116,7 @@ void do_svssno(Client *client, int parc, char *parv[], int show_change)
 				}
 			}
 		}
+		invalidate_snomask_subscribers();
 	}
 
 	if (show_change)
@@ -31,18 +31,58 @@ struct TargetFloodConfig {
 	int t[TFP_MAX];
 };
 
+/* Per-(sender,target) accounting.
+ * The per-target counters above are the enforcement mechanism, but
+ * they aggregate all senders, so they cannot tell WHO is flooding.
+ * Every message is therefore also accounted in a global open-addressed
+ * hash table keyed by the (sender,target) pair: one short linear probe
+ * run per message regardless of how many senders or targets an attack
+ * touches. Entries age out incrementally during probing (no sweeps)
+ * and when a probe run is full the stalest entry is evicted; eviction
+ * counters are exported via /STATS S so attack shapes are visible.
+ */
+typedef struct TargetFloodPair TargetFloodPair;
+struct TargetFloodPair {
+	uint64_t key;			/**< siphash of "sender-id target" (0 = empty slot) */
+	time_t last;			/**< last activity, for aging and eviction */
+	unsigned short cnt[TFP_MAX];	/**< counters, same windowing as TargetFlood */
+	time_t t[TFP_MAX];		/**< window start per message type */
+};
+
+typedef struct TargetFloodPairTable TargetFloodPairTable;
+struct TargetFloodPairTable {
+	unsigned int size;		/**< Number of slots (power of two) */
+	unsigned long in_use;		/**< Occupied slots */
+	unsigned long inserts;		/**< Pairs inserted since boot */
+	unsigned long evictions;	/**< Live entries kicked out because a probe run was full */
+	TargetFloodPair slot[];
+};
+
+/** Length of a linear probe run */
+#define TFP_PAIR_PROBES	8
+
+/** Entries idle this long are reclaimed during probing (>= max period) */
+#define TFP_PAIR_TTL	120
+
 /* Forward declarations */
 int targetfloodprot_config_test(ConfigFile *cf, ConfigEntry *ce, int type, int *errs);
 int targetfloodprot_config_run(ConfigFile *cf, ConfigEntry *ce, int type);
 void targetfloodprot_mdata_free(ModData *m);
 int targetfloodprot_can_send_to_channel(Client *client, Channel *channel, Membership *lp, char **msg, char **errmsg, SendType sendtype);
 int targetfloodprot_can_send_to_user(Client *client, Client *target, char **text, char **errmsg, SendType sendtype);
+int targetfloodprot_stats(Client *client, char *flag);
+int targetfloodprot_rehash_complete(void);
+void targetfloodprot_free_pair_table(ModData *m);
+void targetfloodprot_free_pair_hash_key(ModData *m);
 
 /* Global variables */
 ModDataInfo *targetfloodprot_client_md = NULL;
 ModDataInfo *targetfloodprot_channel_md = NULL;
 TargetFloodConfig *channelcfg = NULL;
 TargetFloodConfig *privatecfg = NULL;
+TargetFloodPairTable *pair_table = NULL;
+char *targetfloodprot_pair_hash_key = NULL;
+static int pair_table_size_conf; /**< set::anti-flood::target-flood::pair-table-size */
 
 MOD_TEST()
 {
@@ -75,6 +115,34 @@ void targetfloodprot_defaults(void)
 	/* set::anti-flood::target-flood::private-tagmsg */
 	privatecfg->cnt[TFP_TAGMSG] = 10;
 	privatecfg->t[TFP_TAGMSG] = 5;
+
+	/* set::anti-flood::target-flood::pair-table-size */
+	pair_table_size_conf = 16384;
+}
+
+/** Round up to the next power of two (for the pair table size) */
+static unsigned int tfp_next_power_of_two(unsigned int v)
+{
+	unsigned int r = 1024;
+
+	while (r < v)
+		r <<= 1;
+	return r;
+}
+
+/** (Re)allocate the pair table so it matches the configured size.
+ * Existing contents are discarded on resize; the table is accounting
+ * state, losing it on rehash is harmless.
+ */
+static void tfp_pair_table_setup(void)
+{
+	unsigned int size = tfp_next_power_of_two(pair_table_size_conf);
+
+	if (pair_table && (pair_table->size == size))
+		return;
+	safe_free(pair_table);
+	pair_table = safe_alloc(sizeof(TargetFloodPairTable) + sizeof(TargetFloodPair) * size);
+	pair_table->size = size;
 }
 
 MOD_INIT()
@@ -86,6 +154,16 @@ MOD_INIT()
 	HookAdd(modinfo->handle, HOOKTYPE_CONFIGRUN, 0, targetfloodprot_config_run);
 	HookAdd(modinfo->handle, HOOKTYPE_CAN_SEND_TO_CHANNEL, 0, targetfloodprot_can_send_to_channel);
 	HookAdd(modinfo->handle, HOOKTYPE_CAN_SEND_TO_USER, 0, targetfloodprot_can_send_to_user);
+	HookAdd(modinfo->handle, HOOKTYPE_STATS, 0, targetfloodprot_stats);
+	HookAdd(modinfo->handle, HOOKTYPE_REHASH_COMPLETE, 0, targetfloodprot_rehash_complete);
+
+	LoadPersistentPointer(modinfo, pair_table, targetfloodprot_free_pair_table);
+	LoadPersistentPointer(modinfo, targetfloodprot_pair_hash_key, targetfloodprot_free_pair_hash_key);
+	if (!targetfloodprot_pair_hash_key)
+	{
+		targetfloodprot_pair_hash_key = safe_alloc(16);
+		siphash_generate_key(targetfloodprot_pair_hash_key);
+	}
 
 	memset(&mreq, 0, sizeof(mreq));
 	mreq.name = "targetfloodprot";
@@ -112,11 +190,14 @@ MOD_INIT()
 
 MOD_LOAD()
 {
+	tfp_pair_table_setup();
 	return MOD_SUCCESS;
 }
 
 MOD_UNLOAD()
 {
+	SavePersistentPointer(modinfo, pair_table);
+	SavePersistentPointer(modinfo, targetfloodprot_pair_hash_key);
 	return MOD_SUCCESS;
 }
 
@@ -160,6 +241,18 @@ int targetfloodprot_config_test(ConfigFile *cf, ConfigEntry *ce, int type, int *
 				errors++;
 			}
 		} else
+		if (!strcmp(cep->ce_varname, "pair-table-size"))
+		{
+			int v = atoi(cep->ce_vardata);
+
+			if ((v < 1024) || (v > 1048576))
+			{
+				config_error("%s:%i: set::anti-flood::target-flood::pair-table-size: "
+				             "value '%d' out of range (should be 1024-1048576)",
+				             cep->ce_fileptr->cf_filename, cep->ce_varlinenum, v);
+				errors++;
+			}
+		} else
 		{
 			config_error("%s:%i: unknown directive set::anti-flood::target-flood:%s",
 				cep->ce_fileptr->cf_filename, cep->ce_varlinenum, cep->ce_varname);
@@ -197,11 +290,19 @@ int targetfloodprot_config_run(ConfigFile *cf, ConfigEntry *ce, int type)
 			config_parse_flood(cep->ce_vardata, &privatecfg->cnt[TFP_NOTICE], &privatecfg->t[TFP_NOTICE]);
 		else if (!strcmp(cep->ce_varname, "private-tagmsg"))
 			config_parse_flood(cep->ce_vardata, &privatecfg->cnt[TFP_TAGMSG], &privatecfg->t[TFP_TAGMSG]);
+		else if (!strcmp(cep->ce_varname, "pair-table-size"))
+			pair_table_size_conf = atoi(cep->ce_vardata);
 	}
 
 	return 1;
 }
 
+int targetfloodprot_rehash_complete(void)
+{
+	tfp_pair_table_setup(); /* apply a pair-table-size change, if any */
+	return 0;
+}
+
 /** UnrealIRCd internals: free object. */
 void targetfloodprot_mdata_free(ModData *m)
 {
@@ -224,6 +325,84 @@ int sendtypetowhat(SendType sendtype)
 	return 0; /* otherwise, default to privmsg i guess */
 }
 
+/** Account one message on the (sender,target) pair table.
+ * One linear probe run of TFP_PAIR_PROBES slots: an exact key match is
+ * updated, otherwise we insert into the first empty or aged-out slot in
+ * the run, and if the whole run holds live entries the stalest one is
+ * evicted (counted, see /STATS S). Aging thus happens incrementally as
+ * a side effect of probing - there is no periodic sweep.
+ */
+static void tfp_pair_account(Client *client, const char *target, int what, int period)
+{
+	char keybuf[512];
+	uint64_t key;
+	unsigned int mask, i, idx;
+	TargetFloodPair *e, *empty = NULL, *stalest = NULL;
+	time_t now = TStime();
+
+	if (!pair_table)
+		return;
+
+	snprintf(keybuf, sizeof(keybuf), "%s %s", client->id, target);
+	key = siphash(keybuf, targetfloodprot_pair_hash_key);
+	if (!key)
+		key = 1; /* 0 means 'empty slot' */
+
+	mask = pair_table->size - 1;
+	for (i = 0; i < TFP_PAIR_PROBES; i++)
+	{
+		idx = (unsigned int)(key + i) & mask;
+		e = &pair_table->slot[idx];
+		if (e->key == key)
+		{
+			/* Same windowing as the per-target counters */
+			if ((now - e->t[what]) >= period)
+			{
+				e->t[what] = now;
+				e->cnt[what] = 1;
+			} else {
+				e->cnt[what]++;
+			}
+			e->last = now;
+			return;
+		}
+		if (!e->key)
+		{
+			if (!empty)
+				empty = e;
+			continue;
+		}
+		if ((now - e->last) > TFP_PAIR_TTL)
+		{
+			/* Aged out: reclaimable, counts as free */
+			if (!empty)
+			{
+				empty = e;
+				pair_table->in_use--; /* will be re-occupied below */
+			}
+			continue;
+		}
+		if (!stalest || (e->last < stalest->last))
+			stalest = e;
+	}
+
+	if (empty)
+	{
+		e = empty;
+		pair_table->in_use++;
+	} else
+	{
+		e = stalest;
+		pair_table->evictions++;
+	}
+	memset(e, 0, sizeof(TargetFloodPair));
+	e->key = key;
+	e->last = now;
+	e->t[what] = now;
+	e->cnt[what] = 1;
+	pair_table->inserts++;
+}
+
 int targetfloodprot_can_send_to_channel(Client *client, Channel *channel, Membership *lp, char **msg, char **errmsg, SendType sendtype)
 {
 	TargetFlood *flood;
@@ -240,6 +419,11 @@ int targetfloodprot_can_send_to_channel(Client *client, Channel *channel, Member
 
 	what = sendtypetowhat(sendtype);
 
+	/* Attribute this message to the (sender,channel) pair, so attacks
+	 * tripping the aggregate counter below can be broken down by sender.
+	 */
+	tfp_pair_account(client, channel->chname, what, channelcfg->t[what]);
+
 	if (moddata_channel(channel, targetfloodprot_channel_md).ptr == NULL)
 	{
 		/* Alloc a new entry if it doesn't exist yet */
@@ -268,6 +452,32 @@ int targetfloodprot_can_send_to_channel(Client *client, Channel *channel, Member
 	return HOOK_CONTINUE;
 }
 
+int targetfloodprot_stats(Client *client, char *flag)
+{
+	if (*flag != 'S')
+		return 0;
+
+	if (pair_table)
+	{
+		sendtxtnumeric(client, "target-flood pair table size: %u", pair_table->size);
+		sendtxtnumeric(client, "target-flood pair table in use: %lu", pair_table->in_use);
+		sendtxtnumeric(client, "target-flood pair table inserts: %lu", pair_table->inserts);
+		sendtxtnumeric(client, "target-flood pair table evictions: %lu", pair_table->evictions);
+	}
+	return 1;
+}
+
+/** Admin unloading the module for good. */
+void targetfloodprot_free_pair_table(ModData *m)
+{
+	safe_free(pair_table);
+}
+
+void targetfloodprot_free_pair_hash_key(ModData *m)
+{
+	safe_free(targetfloodprot_pair_hash_key);
+}
+
 int targetfloodprot_can_send_to_user(Client *client, Client *target, char **text, char **errmsg, SendType sendtype)
 {
 	TargetFlood *flood;
@@ -286,6 +496,8 @@ int targetfloodprot_can_send_to_user(Client *client, Client *target, char **text
 
 	what = sendtypetowhat(sendtype);
 
+	tfp_pair_account(client, target->id, what, privatecfg->t[what]);
+
 	if (moddata_local_client(target, targetfloodprot_client_md).ptr == NULL)
 	{
 		/* Alloc a new entry if it doesn't exist yet */
@@ -78,6 +78,8 @@ TKL *_find_qline(Client *client, char *nick, int *ishold);
 TKL *_find_tkline_match_zap(Client *client);
 void _tkl_stats(Client *client, int type, char *para);
 void _tkl_sync(Client *client);
+int tkl_sync_generate(Client *to, int budget);
+CMD_FUNC(cmd_tklsync);
 CMD_FUNC(_cmd_tkl);
 int _place_host_ban(Client *client, BanAction action, char *reason, long duration);
 int _match_spamfilter(Client *client, char *str_in, int type, char *target, int flags, TKL **rettk);
@@ -199,6 +201,7 @@ MOD_INIT()
 	CommandAdd(modinfo->handle, "SPAMFILTER", cmd_spamfilter, 7, CMD_OPER);
 	CommandAdd(modinfo->handle, "ELINE", cmd_eline, 4, CMD_OPER);
 	CommandAdd(modinfo->handle, "TKL", _cmd_tkl, MAXPARA, CMD_OPER|CMD_SERVER);
+	CommandAdd(modinfo->handle, "TKLSYNC", cmd_tklsync, 1, CMD_SERVER);
 	MARK_AS_OFFICIAL_MODULE(modinfo);
 	return MOD_SUCCESS;
 }
@@ -206,11 +209,18 @@ MOD_INIT()
 MOD_LOAD()
 {
 	EventAdd(modinfo->handle, "tklexpire", tkl_check_expire, NULL, 5000, 0);
+	/* TKLs are synced to freshly linked servers via the post-EOS sync
+	 * scheduler (bounded slices, interleaved with normal traffic)
+	 * rather than inside the burst. Priority 0: before anything else
+	 * modules may register.
+	 */
+	syncsched_register("tkl", 0, tkl_sync_generate);
 	return MOD_SUCCESS;
 }
 
 MOD_UNLOAD()
 {
+	syncsched_unregister("tkl");
 	return MOD_SUCCESS;
 }
 
@@ -2249,6 +2259,299 @@ int _tkl_ip_hash_type(int type)
 		return -1;
 }
 
+/* CIDR radix tree for IP-typed TKL's.
+ *
+ * The TKL ip hash table above only takes masks that are a plain IP
+ * (no wildcards, no prefix length), so every CIDR ban like 1.2.3.0/24
+ * used to end up on the generic tklines[] lists and was checked with
+ * match_user() per entry on every connect. With tens of thousands of
+ * Z-Lines/G-Lines from DNSBL feeds that linear scan is real cost.
+ *
+ * CIDR masks are therefore additionally indexed in a path-compressed
+ * binary radix tree per ban category and address family, so looking up
+ * a connecting address is O(address bits): walk the tree along the
+ * address and every node on the way whose prefix covers it is a
+ * candidate. The TKL entry itself stays on its normal tklines[] list
+ * (stats, expiry and sync iterate those unchanged) and is marked
+ * TKL_FLAG_IP_INDEXED so the linear ban scans skip it.
+ */
+
+typedef struct TKLRadixRef TKLRadixRef;
+struct TKLRadixRef {
+	TKLRadixRef *next;
+	TKL *tkl;
+};
+
+typedef struct TKLRadixNode TKLRadixNode;
+struct TKLRadixNode {
+	TKLRadixNode *child[2];
+	unsigned char key[16];	/**< Prefix bits (bits past 'prefixlen' are zero) */
+	unsigned int prefixlen;	/**< Number of significant bits in 'key' */
+	TKLRadixRef *entries;	/**< TKL's whose mask is exactly key/prefixlen */
+};
+
+/** One root per TKL ip hash category (see tkl_ip_hash_type) and
+ * address family (0=IPv4, 1=IPv6).
+ */
+static TKLRadixNode *tkl_cidr_root[TKLIPHASHLEN1][2];
+
+static int tkl_cidr_getbit(const unsigned char *key, unsigned int bit)
+{
+	return (key[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+/** Number of leading bits that 'a' and 'b' have in common, capped at 'max' */
+static unsigned int tkl_cidr_common_bits(const unsigned char *a, const unsigned char *b, unsigned int max)
+{
+	unsigned int bits = 0;
+
+	while (bits + 8 <= max && (a[bits >> 3] == b[bits >> 3]))
+		bits += 8;
+	while ((bits < max) && (tkl_cidr_getbit(a, bits) == tkl_cidr_getbit(b, bits)))
+		bits++;
+	return bits;
+}
+
+/** Does the prefix in 'node' cover address 'addr' (of 'addrbits' bits)? */
+static int tkl_cidr_prefix_covers(TKLRadixNode *node, const unsigned char *addr, unsigned int addrbits)
+{
+	if (node->prefixlen > addrbits)
+		return 0;
+	return tkl_cidr_common_bits(node->key, addr, node->prefixlen) == node->prefixlen;
+}
+
+/** Parse a hostmask into a radix key if (and only if) it is a CIDR
+ * mask such as 1.2.3.0/24 or 2001:db8::/32.
+ * @param mask    The TKL host mask
+ * @param key     Buffer of 16 bytes, receives the (canonicalized) address bits
+ * @param prefixlen  Receives the prefix length in bits
+ * @param family  Receives 0 for IPv4, 1 for IPv6
+ * @returns 1 if this is a CIDR mask suitable for the radix tree, 0 if not.
+ */
+static int tkl_cidr_parse(const char *mask, unsigned char *key, unsigned int *prefixlen, int *family)
+{
+	char addr[64], *slash;
+	const char *p;
+	unsigned int plen, maxbits, bit;
+
+	for (p = mask; *p; p++)
+		if ((*p == '?') || (*p == '*'))
+			return 0;
+	strlcpy(addr, mask, sizeof(addr));
+	slash = strchr(addr, '/');
+	if (!slash)
+		return 0;
+	*slash++ = '\0';
+	for (p = slash; *p; p++)
+		if (!isdigit(*p))
+			return 0;
+	if (*slash == '\0')
+		return 0;
+	plen = atoi(slash);
+
+	memset(key, 0, 16);
+	if (inet_pton(AF_INET, addr, key) == 1)
+	{
+		*family = 0;
+		maxbits = 32;
+	} else
+	if (inet_pton(AF_INET6, addr, key) == 1)
+	{
+		*family = 1;
+		maxbits = 128;
+	} else
+	{
+		return 0;
+	}
+	if (plen > maxbits)
+		return 0;
+
+	/* Zero the bits past the prefix so 1.2.3.4/24 and 1.2.3.0/24
+	 * end up on the same node.
+	 */
+	for (bit = plen; bit & 7; bit++)
+		key[bit >> 3] &= ~(0x80 >> (bit & 7));
+	if (bit < maxbits)
+		memset(key + (bit >> 3), 0, (maxbits - bit) >> 3);
+
+	*prefixlen = plen;
+	return 1;
+}
+
+static TKLRadixNode *tkl_cidr_new_node(const unsigned char *key, unsigned int prefixlen)
+{
+	TKLRadixNode *node = safe_alloc(sizeof(TKLRadixNode));
+	memcpy(node->key, key, 16);
+	node->prefixlen = prefixlen;
+	return node;
+}
+
+static void tkl_cidr_insert(TKLRadixNode **rootp, const unsigned char *key, unsigned int prefixlen, TKL *tkl)
+{
+	TKLRadixNode **link = rootp, *node, *split;
+	TKLRadixRef *ref = safe_alloc(sizeof(TKLRadixRef));
+	unsigned int common;
+
+	ref->tkl = tkl;
+
+	while ((node = *link))
+	{
+		common = tkl_cidr_common_bits(node->key, key, (node->prefixlen < prefixlen) ? node->prefixlen : prefixlen);
+		if (common == node->prefixlen)
+		{
+			if (prefixlen == node->prefixlen)
+			{
+				/* Same prefix, just another entry on this node */
+				ref->next = node->entries;
+				node->entries = ref;
+				return;
+			}
+			link = &node->child[tkl_cidr_getbit(key, node->prefixlen)];
+			continue;
+		}
+		/* Diverges inside this node's prefix: split it */
+		split = tkl_cidr_new_node(key, common);
+		split->child[tkl_cidr_getbit(node->key, common)] = node;
+		if (prefixlen == common)
+		{
+			split->entries = ref;
+		} else
+		{
+			TKLRadixNode *leaf = tkl_cidr_new_node(key, prefixlen);
+			leaf->entries = ref;
+			split->child[tkl_cidr_getbit(key, common)] = leaf;
+		}
+		*link = split;
+		return;
+	}
+
+	node = tkl_cidr_new_node(key, prefixlen);
+	node->entries = ref;
+	*link = node;
+}
+
+static void tkl_cidr_remove(TKLRadixNode **rootp, const unsigned char *key, unsigned int prefixlen, TKL *tkl)
+{
+	TKLRadixNode **link = rootp, *node;
+	TKLRadixRef **refp, *ref;
+
+	while ((node = *link))
+	{
+		if (node->prefixlen > prefixlen)
+			break;
+		if (node->prefixlen == prefixlen)
+		{
+			if (tkl_cidr_common_bits(node->key, key, prefixlen) != prefixlen)
+				break;
+			for (refp = &node->entries; (ref = *refp); refp = &ref->next)
+			{
+				if (ref->tkl == tkl)
+				{
+					*refp = ref->next;
+					safe_free(ref);
+					/* Prune the node when it no longer carries
+					 * entries and has at most one child.
+					 */
+					if (!node->entries && !(node->child[0] && node->child[1]))
+					{
+						*link = node->child[0] ? node->child[0] : node->child[1];
+						safe_free(node);
+					}
+					return;
+				}
+			}
+			break;
+		}
+		link = &node->child[tkl_cidr_getbit(key, node->prefixlen)];
+	}
+
+	ircd_log(LOG_ERROR, "[BUG] tkl_cidr_remove(): TKL %p not found in radix tree", (void *)tkl);
+#ifdef DEBUGMODE
+	abort();
+#endif
+}
+
+/** The host mask of a TKL entry that may qualify for the radix tree,
+ * or NULL for types that never do.
+ */
+static char *tkl_cidr_hostmask(TKL *tkl)
+{
+	if (TKLIsServerBan(tkl))
+		return tkl->ptr.serverban->hostmask;
+	if (TKLIsBanException(tkl))
+		return tkl->ptr.banexception->hostmask;
+	return NULL;
+}
+
+/** Index a server ban or ban exception in the CIDR radix tree, if its
+ * mask qualifies.
+ * Sets TKL_FLAG_IP_INDEXED on success so the linear scans skip it.
+ * @returns 1 if indexed, 0 if this is not a radix tree candidate.
+ */
+static int tkl_cidr_index_add(TKL *tkl)
+{
+	unsigned char key[16];
+	unsigned int prefixlen;
+	int family, index;
+	char *hostmask = tkl_cidr_hostmask(tkl);
+
+	if (!hostmask)
+		return 0;
+	index = tkl_ip_hash_type(tkl_typetochar(tkl->type));
+	if (index < 0)
+		return 0;
+	if (!tkl_cidr_parse(hostmask, key, &prefixlen, &family))
+		return 0;
+	tkl_cidr_insert(&tkl_cidr_root[index][family], key, prefixlen, tkl);
+	tkl->flags |= TKL_FLAG_IP_INDEXED;
+	return 1;
+}
+
+/** Remove a server ban from the CIDR radix tree (TKL_FLAG_IP_INDEXED entries only) */
+static void tkl_cidr_index_del(TKL *tkl)
+{
+	unsigned char key[16];
+	unsigned int prefixlen;
+	int family, index;
+	char *hostmask = tkl_cidr_hostmask(tkl);
+
+	index = tkl_ip_hash_type(tkl_typetochar(tkl->type));
+	if ((index < 0) || !hostmask || !tkl_cidr_parse(hostmask, key, &prefixlen, &family))
+	{
+		ircd_log(LOG_ERROR, "[BUG] tkl_cidr_index_del(): TKL %p has TKL_FLAG_IP_INDEXED "
+		                    "but mask '%s' does not parse", (void *)tkl,
+		                    hostmask ? hostmask : "<null>");
+#ifdef DEBUGMODE
+		abort();
+#endif
+		return;
+	}
+	tkl_cidr_remove(&tkl_cidr_root[index][family], key, prefixlen, tkl);
+	tkl->flags &= ~TKL_FLAG_IP_INDEXED;
+}
+
+/** Resolve the IP of 'client' to a radix tree key.
+ * @returns 1 on success (family/addrbits filled in), 0 if the client
+ *          has no numeric IP.
+ */
+static int tkl_cidr_client_key(Client *client, unsigned char *addr, unsigned int *addrbits, int *family)
+{
+	memset(addr, 0, 16);
+	if (inet_pton(AF_INET, GetIP(client), addr) == 1)
+	{
+		*family = 0;
+		*addrbits = 32;
+		return 1;
+	}
+	if (inet_pton(AF_INET6, GetIP(client), addr) == 1)
+	{
+		*family = 1;
+		*addrbits = 128;
+		return 1;
+	}
+	return 0;
+}
+
 /* Find the appropriate list 'head' that we need to iterate.
  * This is simply a helper that is used at 3 places and I hate duplicate code.
  * NOTE: this function may return NULL.
@@ -2264,12 +2567,605 @@ TKL *tkl_find_head(char type, char *hostmask, TKL *def)
 		index2 = tkl_ip_hash(hostmask);
 		if (index2 >= 0)
 		{
-			/* iterate tklines_ip_hash[index][index2] */
-			return tklines_ip_hash[index][index2];
+			/* iterate tklines_ip_hash[index][index2] */
+			return tklines_ip_hash[index][index2];
+		}
+	}
+	/* Fallback to the default */
+	return def;
+}
+
+/* Exact-name hash for Q-Lines.
+ *
+ * Services push thousands of reserved nicks and every NICK command and
+ * every burst-introduced user runs find_qline() against all of them.
+ * The vast majority of reservations are plain names without wildcards,
+ * so those are additionally kept in a hash table keyed by the folded
+ * name: the common case is then one probe and only the wildcard
+ * reservations are still matched linearly. The TKL entry itself stays
+ * on its normal tklines[] list (stats, expiry and sync iterate those
+ * unchanged) and is marked TKL_FLAG_NAME_INDEXED so the linear name
+ * scans skip it.
+ *
+ * Folding matches what match_simple() would do for a wildcard-free
+ * mask: case via the lowercase table, plus the rule that '_' in a mask
+ * also matches a space, which is why ' ' hashes like '_'.
+ */
+
+#define NAMEBANHASHLEN 1024
+
+typedef struct NameBanRef NameBanRef;
+struct NameBanRef {
+	NameBanRef *prev, *next;
+	TKL *tkl;
+};
+
+static NameBanRef *nameban_hash[NAMEBANHASHLEN];
+
+static unsigned int tkl_nameban_hash(const char *name)
+{
+	unsigned int h = 5381;
+	const u_char *p;
+
+	for (p = (const u_char *)name; *p; p++)
+		h = (h * 33) + tolowertab[(*p == ' ') ? (u_char)'_' : *p];
+	return h % NAMEBANHASHLEN;
+}
+
+/** Compare 'name' against the wildcard-free mask 'mask', with the same
+ * semantics match_simple() has for such a mask.
+ */
+static int tkl_nameban_exact_match(const char *mask, const char *name)
+{
+	const u_char *m = (const u_char *)mask;
+	const u_char *n = (const u_char *)name;
+
+	for (; *m && *n; m++, n++)
+		if ((tolowertab[*m] != tolowertab[*n]) && !((*m == '_') && (*n == ' ')))
+			return 0;
+	return !*m && !*n;
+}
+
+/** Index a name ban in the exact-name hash, if its name qualifies.
+ * Sets TKL_FLAG_NAME_INDEXED on success so the linear scans skip it.
+ * @returns 1 if indexed, 0 if this is a wildcard reservation.
+ */
+static int tkl_nameban_index_add(TKL *tkl)
+{
+	char *name = tkl->ptr.nameban->name;
+	NameBanRef *ref;
+	char *p;
+
+	for (p = name; *p; p++)
+		if ((*p == '*') || (*p == '?'))
+			return 0; /* wildcard reservation, keep on the linear path */
+
+	ref = safe_alloc(sizeof(NameBanRef));
+	ref->tkl = tkl;
+	AddListItem(ref, nameban_hash[tkl_nameban_hash(name)]);
+	tkl->flags |= TKL_FLAG_NAME_INDEXED;
+	return 1;
+}
+
+/** Remove a name ban from the exact-name hash (TKL_FLAG_NAME_INDEXED entries only) */
+static void tkl_nameban_index_del(TKL *tkl)
+{
+	NameBanRef *ref;
+	unsigned int bucket = tkl_nameban_hash(tkl->ptr.nameban->name);
+
+	for (ref = nameban_hash[bucket]; ref; ref = ref->next)
+	{
+		if (ref->tkl == tkl)
+		{
+			DelListItem(ref, nameban_hash[bucket]);
+			safe_free(ref);
+			tkl->flags &= ~TKL_FLAG_NAME_INDEXED;
+			return;
+		}
+	}
+	ircd_log(LOG_ERROR, "[BUG] tkl_nameban_index_del(): TKL %p (%s) has TKL_FLAG_NAME_INDEXED "
+	                    "but was not found in the name hash", (void *)tkl,
+	                    tkl->ptr.nameban->name);
+#ifdef DEBUGMODE
+	abort();
+#endif
+}
+
+/** Look up an exact-name reservation matching 'name' (any name ban type) */
+static TKL *tkl_nameban_index_find(const char *name)
+{
+	NameBanRef *ref;
+
+	for (ref = nameban_hash[tkl_nameban_hash(name)]; ref; ref = ref->next)
+		if (tkl_nameban_exact_match(ref->tkl->ptr.nameban->name, name))
+			return ref->tkl;
+	return NULL;
+}
+
+/* Spamfilter literal pre-filter.
+ *
+ * Running every spamfilter regex against every PRIVMSG/NOTICE/PART
+ * does not scale: with hundreds of filters the message path executes
+ * hundreds of regexes per line. Most patterns, however, contain some
+ * literal text that must occur in the message for the pattern to be
+ * able to match at all. We extract such a required literal factor from
+ * each pattern at add time and build one Aho-Corasick automaton over
+ * all of them; each message is then scanned once by the automaton and
+ * only the filters whose literal actually occurred run their regex.
+ * Filters from which no safe literal can be derived simply always run,
+ * so the pre-filter can never cause a missed match.
+ *
+ * All literals and the scanned text are folded through the lowercase
+ * table: that covers both the caseless PCRE matching and the (even
+ * more lenient) IRC casemapping of simple masks, erring only towards
+ * running a regex that was not strictly needed.
+ */
+
+/** Minimum length for a literal factor to be worth indexing */
+#define SPAMFILTER_PREFILTER_MINLEN 3
+
+typedef struct SpamfilterACOutput SpamfilterACOutput;
+struct SpamfilterACOutput {
+	SpamfilterACOutput *next;
+	Spamfilter *spamfilter;
+};
+
+typedef struct SpamfilterACNode SpamfilterACNode;
+struct SpamfilterACNode {
+	SpamfilterACNode *firstchild;
+	SpamfilterACNode *sibling;	/**< Next child of our parent */
+	SpamfilterACNode *fail;		/**< Aho-Corasick failure link */
+	SpamfilterACOutput *outputs;	/**< Literals ending exactly here */
+	unsigned char byte;		/**< Folded byte on the edge from the parent */
+	unsigned char output_in_chain;	/**< Any outputs on the failure chain (incl. here)? */
+};
+
+static SpamfilterACNode *spamfilter_ac_root = NULL;
+static SpamfilterACNode *spamfilter_ac_rootedge[256]; /**< Dense goto table for the root */
+static SpamfilterACNode **spamfilter_ac_nodes = NULL; /**< All nodes, for BFS and freeing */
+static int spamfilter_ac_numnodes = 0;
+static int spamfilter_ac_maxnodes = 0;
+static int spamfilter_ac_dirty = 1; /**< Filters changed, automaton needs a rebuild */
+static unsigned int spamfilter_prefilter_scangen = 0;
+
+/** Extract a required literal factor from a simple (wildcard) mask.
+ * Everything between wildcards must occur literally; we take the
+ * longest such run.
+ */
+static int spamfilter_simple_literal(const char *mask, char *buf, int bufsize)
+{
+	char cur[512], best[512];
+	int curlen = 0, bestlen = 0;
+	const char *p;
+
+	for (p = mask; *p; p++)
+	{
+		if ((*p == '*') || (*p == '?'))
+		{
+			if (curlen > bestlen)
+			{
+				memcpy(best, cur, curlen);
+				bestlen = curlen;
+			}
+			curlen = 0;
+			continue;
+		}
+		if ((*p == '\\') && p[1])
+			p++; /* escaped wildcard, take the char itself */
+		if (curlen < sizeof(cur))
+			cur[curlen++] = tolower(*p);
+	}
+	if (curlen > bestlen)
+	{
+		memcpy(best, cur, curlen);
+		bestlen = curlen;
+	}
+
+	if ((bestlen < SPAMFILTER_PREFILTER_MINLEN) || (bestlen >= bufsize))
+		return 0;
+	memcpy(buf, best, bestlen);
+	buf[bestlen] = '\0';
+	return 1;
+}
+
+/** Extract a required literal factor from a regex, conservatively.
+ * We only take literal runs at the top level (outside groups and
+ * character classes), drop the last character of a run when a
+ * quantifier could make it optional, and give up entirely on
+ * alternation. When in doubt the answer is "no literal", which just
+ * means the regex always runs.
+ */
+static int spamfilter_regex_literal(const char *pattern, char *buf, int bufsize)
+{
+	char cur[512], best[512];
+	int curlen = 0, bestlen = 0;
+	int depth = 0;
+	const char *p;
+
+	if (strchr(pattern, '|'))
+		return 0; /* any branch could match, nothing is required */
+
+	for (p = pattern; *p; p++)
+	{
+#define SPAMFILTER_LITERAL_ENDRUN() do { \
+		if (curlen > bestlen) \
+		{ \
+			memcpy(best, cur, curlen); \
+			bestlen = curlen; \
+		} \
+		curlen = 0; } while(0)
+
+		if (*p == '\\')
+		{
+			/* Escapes (\d, \., \w, ..): don't interpret, just
+			 * end the current run and skip the escaped char.
+			 */
+			if (p[1])
+				p++;
+			SPAMFILTER_LITERAL_ENDRUN();
+			continue;
+		}
+		if (*p == '[')
+		{
+			/* Skip the character class */
+			p++;
+			if (*p == '^')
+				p++;
+			if (*p == ']')
+				p++;
+			while (*p && (*p != ']'))
+			{
+				if ((*p == '\\') && p[1])
+					p++;
+				p++;
+			}
+			if (!*p)
+				return 0; /* malformed, play safe */
+			SPAMFILTER_LITERAL_ENDRUN();
+			continue;
+		}
+		if (*p == '(')
+		{
+			depth++;
+			SPAMFILTER_LITERAL_ENDRUN();
+			continue;
+		}
+		if (*p == ')')
+		{
+			if (depth > 0)
+				depth--;
+			SPAMFILTER_LITERAL_ENDRUN();
+			continue;
+		}
+		if ((*p == '?') || (*p == '*'))
+		{
+			/* Previous char is optional */
+			if (curlen > 0)
+				curlen--;
+			SPAMFILTER_LITERAL_ENDRUN();
+			continue;
+		}
+		if (*p == '{')
+		{
+			/* Could be {0,..}: treat like '?' and skip the braces */
+			if (curlen > 0)
+				curlen--;
+			SPAMFILTER_LITERAL_ENDRUN();
+			while (*p && (*p != '}'))
+				p++;
+			if (!*p)
+				return 0; /* malformed, play safe */
+			continue;
+		}
+		if (*p == '+')
+		{
+			/* Previous char still required (at least once) */
+			SPAMFILTER_LITERAL_ENDRUN();
+			continue;
+		}
+		if ((*p == '.') || (*p == '^') || (*p == '$'))
+		{
+			SPAMFILTER_LITERAL_ENDRUN();
+			continue;
+		}
+		if ((depth == 0) && (curlen < sizeof(cur)))
+			cur[curlen++] = tolower(*p);
+	}
+	SPAMFILTER_LITERAL_ENDRUN();
+#undef SPAMFILTER_LITERAL_ENDRUN
+
+	if ((bestlen < SPAMFILTER_PREFILTER_MINLEN) || (bestlen >= bufsize))
+		return 0;
+	memcpy(buf, best, bestlen);
+	buf[bestlen] = '\0';
+	return 1;
+}
+
+/** Derive the required literal for a spamfilter, or NULL if none */
+static char *spamfilter_extract_literal(Match *m)
+{
+	char buf[512];
+	char *literal = NULL;
+	int ok;
+
+	if (m->type == MATCH_SIMPLE)
+		ok = spamfilter_simple_literal(m->str, buf, sizeof(buf));
+	else if (m->type == MATCH_PCRE_REGEX)
+		ok = spamfilter_regex_literal(m->str, buf, sizeof(buf));
+	else
+		ok = 0;
+
+	if (ok)
+		safe_strdup(literal, buf);
+	return literal;
+}
+
+static void spamfilter_ac_free(void)
+{
+	int i;
+
+	for (i = 0; i < spamfilter_ac_numnodes; i++)
+	{
+		SpamfilterACOutput *o, *o_next;
+		for (o = spamfilter_ac_nodes[i]->outputs; o; o = o_next)
+		{
+			o_next = o->next;
+			safe_free(o);
+		}
+		safe_free(spamfilter_ac_nodes[i]);
+	}
+	safe_free(spamfilter_ac_nodes);
+	spamfilter_ac_numnodes = 0;
+	spamfilter_ac_maxnodes = 0;
+	spamfilter_ac_root = NULL;
+	memset(spamfilter_ac_rootedge, 0, sizeof(spamfilter_ac_rootedge));
+}
+
+static SpamfilterACNode *spamfilter_ac_new_node(unsigned char byte)
+{
+	SpamfilterACNode *node = safe_alloc(sizeof(SpamfilterACNode));
+
+	node->byte = byte;
+	if (spamfilter_ac_numnodes == spamfilter_ac_maxnodes)
+	{
+		SpamfilterACNode **newlist;
+		spamfilter_ac_maxnodes = spamfilter_ac_maxnodes ? spamfilter_ac_maxnodes * 2 : 64;
+		newlist = safe_alloc(spamfilter_ac_maxnodes * sizeof(SpamfilterACNode *));
+		if (spamfilter_ac_nodes)
+		{
+			memcpy(newlist, spamfilter_ac_nodes, spamfilter_ac_numnodes * sizeof(SpamfilterACNode *));
+			safe_free(spamfilter_ac_nodes);
+		}
+		spamfilter_ac_nodes = newlist;
+	}
+	spamfilter_ac_nodes[spamfilter_ac_numnodes++] = node;
+	return node;
+}
+
+/** Add one literal to the trie (failure links are computed later) */
+static void spamfilter_ac_add_literal(const char *literal, Spamfilter *spamfilter)
+{
+	SpamfilterACNode *node = spamfilter_ac_root, *child;
+	SpamfilterACOutput *output;
+	const char *p;
+
+	for (p = literal; *p; p++)
+	{
+		unsigned char c = *p;
+
+		for (child = node->firstchild; child; child = child->sibling)
+			if (child->byte == c)
+				break;
+		if (!child)
+		{
+			child = spamfilter_ac_new_node(c);
+			child->sibling = node->firstchild;
+			node->firstchild = child;
+			if (node == spamfilter_ac_root)
+				spamfilter_ac_rootedge[c] = child;
+		}
+		node = child;
+	}
+
+	output = safe_alloc(sizeof(SpamfilterACOutput));
+	output->spamfilter = spamfilter;
+	output->next = node->outputs;
+	node->outputs = output;
+}
+
+/** (Re)build the Aho-Corasick automaton over all spamfilter literals */
+static void spamfilter_prefilter_rebuild(void)
+{
+	TKL *tkl;
+	SpamfilterACNode **queue, *node, *child, *f;
+	int qhead = 0, qtail = 0;
+
+	spamfilter_ac_free();
+	spamfilter_ac_root = spamfilter_ac_new_node(0);
+
+	for (tkl = tklines[tkl_hash('F')]; tkl; tkl = tkl->next)
+	{
+		if (!TKLIsSpamfilter(tkl))
+			continue;
+		if (tkl->ptr.spamfilter->prefilter)
+			spamfilter_ac_add_literal(tkl->ptr.spamfilter->prefilter, tkl->ptr.spamfilter);
+	}
+
+	/* Breadth-first walk to set the failure links */
+	queue = safe_alloc(spamfilter_ac_numnodes * sizeof(SpamfilterACNode *));
+	for (child = spamfilter_ac_root->firstchild; child; child = child->sibling)
+	{
+		child->fail = spamfilter_ac_root;
+		queue[qtail++] = child;
+	}
+	while (qhead < qtail)
+	{
+		node = queue[qhead++];
+		node->output_in_chain = (node->outputs || node->fail->output_in_chain) ? 1 : 0;
+		for (child = node->firstchild; child; child = child->sibling)
+		{
+			/* Longest proper suffix of 'child' present in the trie */
+			for (f = node->fail; ; f = f->fail)
+			{
+				SpamfilterACNode *t;
+				if (f == spamfilter_ac_root)
+				{
+					t = spamfilter_ac_rootedge[child->byte];
+					child->fail = (t && (t != child)) ? t : spamfilter_ac_root;
+					break;
+				}
+				for (t = f->firstchild; t; t = t->sibling)
+					if (t->byte == child->byte)
+						break;
+				if (t)
+				{
+					child->fail = t;
+					break;
+				}
+			}
+			queue[qtail++] = child;
+		}
+	}
+	safe_free(queue);
+
+	spamfilter_ac_dirty = 0;
+}
+
+/** Advance the automaton by one (folded) byte */
+static SpamfilterACNode *spamfilter_ac_step(SpamfilterACNode *node, unsigned char c)
+{
+	SpamfilterACNode *child;
+
+	for (;;)
+	{
+		if (node == spamfilter_ac_root)
+			return spamfilter_ac_rootedge[c] ? spamfilter_ac_rootedge[c] : spamfilter_ac_root;
+		for (child = node->firstchild; child; child = child->sibling)
+			if (child->byte == c)
+				return child;
+		node = node->fail;
+	}
+}
+
+/** Scan 'str' once, marking every spamfilter whose literal occurs in
+ * it with the current scan generation.
+ */
+static void spamfilter_prefilter_scan(const char *str)
+{
+	SpamfilterACNode *node = spamfilter_ac_root, *t;
+	SpamfilterACOutput *output;
+	const char *p;
+
+	spamfilter_prefilter_scangen++;
+	for (p = str; *p; p++)
+	{
+		node = spamfilter_ac_step(node, (unsigned char)tolower(*p));
+		if (!node->output_in_chain)
+			continue;
+		for (t = node; t != spamfilter_ac_root; t = t->fail)
+			for (output = t->outputs; output; output = output->next)
+				output->spamfilter->prefilter_gen = spamfilter_prefilter_scangen;
+	}
+}
+
+/* == TKL expiry heap ==
+ * Every TKL entry with a deadline (expire_at != 0) also sits in a
+ * min-heap ordered on expire_at, next to its regular hash/list entry.
+ * The expiry event then only has to look at the earliest deadline
+ * instead of walking all TKL lists and hash buckets on every run.
+ * The heap storage itself lives in src/serv.c, like the TKL lists,
+ * so it survives a reload of this module. TKL::expiry_slot is the
+ * position+1 of the entry in the heap, or 0 when not queued.
+ */
+
+static void tkl_expiry_heap_setpos(int i, TKL *tkl)
+{
+	tkl_expiry_heap[i] = tkl;
+	tkl->expiry_slot = i + 1;
+}
+
+static void tkl_expiry_heap_up(int i)
+{
+	while (i > 0)
+	{
+		int parent = (i - 1) / 2;
+		TKL *tkl;
+
+		if (tkl_expiry_heap[parent]->expire_at <= tkl_expiry_heap[i]->expire_at)
+			break;
+		tkl = tkl_expiry_heap[parent];
+		tkl_expiry_heap_setpos(parent, tkl_expiry_heap[i]);
+		tkl_expiry_heap_setpos(i, tkl);
+		i = parent;
+	}
+}
+
+static void tkl_expiry_heap_down(int i)
+{
+	for (;;)
+	{
+		int left = i * 2 + 1, right = i * 2 + 2, smallest = i;
+		TKL *tkl;
+
+		if ((left < tkl_expiry_heap_count) && (tkl_expiry_heap[left]->expire_at < tkl_expiry_heap[smallest]->expire_at))
+			smallest = left;
+		if ((right < tkl_expiry_heap_count) && (tkl_expiry_heap[right]->expire_at < tkl_expiry_heap[smallest]->expire_at))
+			smallest = right;
+		if (smallest == i)
+			break;
+		tkl = tkl_expiry_heap[smallest];
+		tkl_expiry_heap_setpos(smallest, tkl_expiry_heap[i]);
+		tkl_expiry_heap_setpos(i, tkl);
+		i = smallest;
+	}
+}
+
+/** Take a TKL entry out of the expiry heap (eg: it is being deleted). */
+static void tkl_expiry_heap_remove(TKL *tkl)
+{
+	int i = (int)tkl->expiry_slot - 1;
+
+	if (i < 0)
+		return; /* not queued */
+	tkl->expiry_slot = 0;
+	tkl_expiry_heap_count--;
+	if (i == tkl_expiry_heap_count)
+		return;
+	tkl_expiry_heap_setpos(i, tkl_expiry_heap[tkl_expiry_heap_count]);
+	tkl_expiry_heap_down(i);
+	tkl_expiry_heap_up(i);
+}
+
+/** (Re)queue a TKL entry in the expiry heap based on its current
+ * expire_at. Call this after setting or changing the expiry time.
+ */
+static void tkl_expiry_schedule(TKL *tkl)
+{
+	if (!tkl->expire_at)
+	{
+		tkl_expiry_heap_remove(tkl); /* became permanent */
+		return;
+	}
+
+	if (!tkl->expiry_slot)
+	{
+		if (tkl_expiry_heap_count == tkl_expiry_heap_capacity)
+		{
+			int newcap = tkl_expiry_heap_capacity ? tkl_expiry_heap_capacity * 2 : 256;
+			TKL **newheap = safe_alloc(newcap * sizeof(TKL *));
+
+			if (tkl_expiry_heap_count)
+				memcpy(newheap, tkl_expiry_heap, tkl_expiry_heap_count * sizeof(TKL *));
+			safe_free(tkl_expiry_heap);
+			tkl_expiry_heap = newheap;
+			tkl_expiry_heap_capacity = newcap;
 		}
+		tkl_expiry_heap_setpos(tkl_expiry_heap_count++, tkl);
+		tkl_expiry_heap_up(tkl->expiry_slot - 1);
+	} else {
+		tkl_expiry_heap_up(tkl->expiry_slot - 1);
+		tkl_expiry_heap_down(tkl->expiry_slot - 1);
 	}
-	/* Fallback to the default */
-	return def;
 }
 
 /** Add a spamfilter entry to the list.
@@ -2304,6 +3200,7 @@ TKL *_tkl_add_spamfilter(int type, unsigned short target, BanAction action, Matc
 	tkl->set_at = set_at;
 	safe_strdup(tkl->set_by, set_by);
 	tkl->expire_at = expire_at;
+	tkl_expiry_schedule(tkl);
 	/* Then the spamfilter fields */
 	tkl->ptr.spamfilter = safe_alloc(sizeof(Spamfilter));
 	tkl->ptr.spamfilter->target = target;
@@ -2317,6 +3214,10 @@ TKL *_tkl_add_spamfilter(int type, unsigned short target, BanAction action, Matc
 	if (tkl->ptr.spamfilter->target & SPAMF_AWAY)
 		loop.do_bancheck_spamf_away = 1;
 
+	/* Feed the literal pre-filter (see spamfilter_prefilter_rebuild) */
+	tkl->ptr.spamfilter->prefilter = spamfilter_extract_literal(match);
+	spamfilter_ac_dirty = 1;
+
 	/* Spamfilters go via the normal TKL list... */
 	index = tkl_hash(tkl_typetochar(type));
 	AddListItem(tkl, tklines[index]);
@@ -2341,6 +3242,48 @@ TKL *_tkl_add_spamfilter(int type, unsigned short target, BanAction action, Matc
  * Be sure not to call this function for spamfilters,
  * qlines or exempts, which have their own function!
  */
+/** Compile the user and host mask of a server ban for fast matching,
+ * if eligible. Eligible means a plain user@host mask (no extban) where
+ * the host mask contains a wildcard, so matching it is pure text
+ * matching: those are exactly the entries that the ip hash table and
+ * the CIDR radix tree cannot index and that would otherwise take a
+ * full match_user() walk on every connect.
+ */
+static void tkl_serverban_compile(ServerBan *ban)
+{
+	if (is_extended_ban(ban->usermask) ||
+	    !*ban->usermask || !*ban->hostmask ||
+	    strpbrk(ban->usermask, "@!") ||
+	    strchr(ban->hostmask, '/') ||
+	    !strpbrk(ban->hostmask, "*?"))
+	{
+		return; /* not eligible: keep matching through match_user() */
+	}
+	ban->cmask_user = compile_simple_mask(ban->usermask);
+	ban->cmask_host = compile_simple_mask(ban->hostmask);
+}
+
+/** Evaluate a server ban through its compiled masks.
+ * Mirrors exactly what match_user(uhost, client, MATCH_CHECK_REAL)
+ * does for the masks that tkl_serverban_compile() accepts: a text
+ * match of the user mask against the username and of the host mask
+ * against the IP and the real host.
+ * @returns 1 on match, 0 on no match.
+ */
+static int tkl_serverban_compiled_match(Client *client, ServerBan *ban)
+{
+	char *username = (client->user && *client->user->username) ? client->user->username : client->ident;
+	char *hostname = client->user ? client->user->realhost : (MyUser(client) ? client->local->sockhost : NULL);
+
+	if (!compiled_mask_match(ban->cmask_user, username))
+		return 0;
+	if (client->ip && compiled_mask_match(ban->cmask_host, client->ip))
+		return 1;
+	if (hostname && compiled_mask_match(ban->cmask_host, hostname))
+		return 1;
+	return 0;
+}
+
 TKL *_tkl_add_serverban(int type, char *usermask, char *hostmask, char *reason, char *set_by,
                            time_t expire_at, time_t set_at, int soft, int flags)
 {
@@ -2357,6 +3300,10 @@ TKL *_tkl_add_serverban(int type, char *usermask, char *hostmask, char *reason,
 	tkl->set_at = set_at;
 	safe_strdup(tkl->set_by, set_by);
 	tkl->expire_at = expire_at;
+	tkl_expiry_schedule(tkl);
+	if (!++tkl_id_sequence)
+		++tkl_id_sequence; /* id 0 means 'empty slot' in the verdict cache */
+	tkl->id = tkl_id_sequence;
 	/* Now the server ban fields */
 	tkl->ptr.serverban = safe_alloc(sizeof(ServerBan));
 	safe_strdup(tkl->ptr.serverban->usermask, usermask);
@@ -2364,6 +3311,7 @@ TKL *_tkl_add_serverban(int type, char *usermask, char *hostmask, char *reason,
 	if (soft)
 		tkl->ptr.serverban->subtype = TKL_SUBTYPE_SOFT;
 	safe_strdup(tkl->ptr.serverban->reason, reason);
+	tkl_serverban_compile(tkl->ptr.serverban);
 
 	/* For ip hash table TKL's... */
 	index = tkl_ip_hash_type(tkl_typetochar(type));
@@ -2377,6 +3325,12 @@ TKL *_tkl_add_serverban(int type, char *usermask, char *hostmask, char *reason,
 		}
 	}
 
+	/* CIDR masks get an additional entry in the radix tree, the
+	 * TKL itself still goes on the normal list below (which is
+	 * what stats, expiry and sync iterate).
+	 */
+	tkl_cidr_index_add(tkl);
+
 	/* If we get here it's just for our normal list.. */
 	index = tkl_hash(tkl_typetochar(type));
 	AddListItem(tkl, tklines[index]);
@@ -2417,6 +3371,10 @@ TKL *_tkl_add_banexception(int type, char *usermask, char *hostmask, char *reaso
 	tkl->set_at = set_at;
 	safe_strdup(tkl->set_by, set_by);
 	tkl->expire_at = expire_at;
+	tkl_expiry_schedule(tkl);
+	if (!++tkl_id_sequence)
+		++tkl_id_sequence; /* id 0 means 'empty slot' in the verdict cache */
+	tkl->id = tkl_id_sequence;
 	/* Now the ban except fields */
 	tkl->ptr.banexception = safe_alloc(sizeof(BanException));
 	safe_strdup(tkl->ptr.banexception->usermask, usermask);
@@ -2438,6 +3396,11 @@ TKL *_tkl_add_banexception(int type, char *usermask, char *hostmask, char *reaso
 		}
 	}
 
+	/* CIDR masks go in the radix tree as well, just like server
+	 * bans (the entry still lives on the normal list below).
+	 */
+	tkl_cidr_index_add(tkl);
+
 	/* If we get here it's just for our normal list.. */
 	index = tkl_hash(tkl_typetochar(type));
 	AddListItem(tkl, tklines[index]);
@@ -2477,6 +3440,7 @@ TKL *_tkl_add_nameban(int type, char *name, int hold, char *reason, char *set_by
 	tkl->set_at = set_at;
 	safe_strdup(tkl->set_by, set_by);
 	tkl->expire_at = expire_at;
+	tkl_expiry_schedule(tkl);
 	/* Now the name ban fields */
 	tkl->ptr.nameban = safe_alloc(sizeof(ServerBan));
 	safe_strdup(tkl->ptr.nameban->name, name);
@@ -2487,6 +3451,9 @@ TKL *_tkl_add_nameban(int type, char *name, int hold, char *reason, char *set_by
 	index = tkl_hash(tkl_typetochar(type));
 	AddListItem(tkl, tklines[index]);
 
+	/* ..and wildcard-free names additionally in the exact-name hash */
+	tkl_nameban_index_add(tkl);
+
 	return tkl;
 }
 
@@ -2506,6 +3473,10 @@ void _free_tkl(TKL *tkl)
 		safe_free(tkl->ptr.serverban->usermask);
 		safe_free(tkl->ptr.serverban->hostmask);
 		safe_free(tkl->ptr.serverban->reason);
+		if (tkl->ptr.serverban->cmask_user)
+			free_compiled_mask(tkl->ptr.serverban->cmask_user);
+		if (tkl->ptr.serverban->cmask_host)
+			free_compiled_mask(tkl->ptr.serverban->cmask_host);
 		safe_free(tkl->ptr.serverban);
 	} else
 	if (TKLIsNameBan(tkl) && tkl->ptr.nameban)
@@ -2518,6 +3489,7 @@ void _free_tkl(TKL *tkl)
 	{
 		/* Spamfilter */
 		safe_free(tkl->ptr.spamfilter->tkl_reason);
+		safe_free(tkl->ptr.spamfilter->prefilter);
 		if (tkl->ptr.spamfilter->match)
 			unreal_delete_match(tkl->ptr.spamfilter->match);
 		safe_free(tkl->ptr.spamfilter);
@@ -2541,6 +3513,9 @@ void _tkl_del_line(TKL *tkl)
 	int index, index2;
 	int found = 0;
 
+	/* Take it out of the expiry heap (no-op if it was permanent) */
+	tkl_expiry_heap_remove(tkl);
+
 	/* Try to find it in the ip TKL hash table first
 	 * (this only applies to server bans)
 	 */
@@ -2582,6 +3557,18 @@ void _tkl_del_line(TKL *tkl)
 		}
 	}
 
+	if (tkl->flags & TKL_FLAG_IP_INDEXED)
+		tkl_cidr_index_del(tkl);
+
+	if (tkl->flags & TKL_FLAG_NAME_INDEXED)
+		tkl_nameban_index_del(tkl);
+
+	/* The literal pre-filter automaton references spamfilters by
+	 * pointer, so have it rebuilt before its next use.
+	 */
+	if (TKLIsSpamfilter(tkl))
+		spamfilter_ac_dirty = 1;
+
 	if (!found)
 	{
 		/* If we get here it's just for our normal list.. */
@@ -2758,49 +3745,45 @@ void tkl_expire_entry(TKL *tkl)
 	tkl_del_line(tkl);
 }
 
-/** Regularly check TKL entries for expiration */
+/** Regularly check TKL entries for expiration.
+ * All entries with a deadline sit in the expiry min-heap, so we only
+ * look at the earliest deadline instead of walking every TKL list.
+ * Each tkl_expire_entry() call ends in tkl_del_line(), which removes
+ * the entry from the heap, so the top keeps advancing.
+ */
 EVENT(tkl_check_expire)
 {
-	TKL *tkl, *next;
-	time_t nowtime;
-	int index, index2;
+	time_t nowtime = TStime();
 
-	nowtime = TStime();
-
-	/* First, hashed entries.. */
-	for (index = 0; index < TKLIPHASHLEN1; index++)
-	{
-		for (index2 = 0; index2 < TKLIPHASHLEN2; index2++)
-		{
-			for (tkl = tklines_ip_hash[index][index2]; tkl; tkl = next)
-			{
-				next = tkl->next;
-				if (tkl->expire_at <= nowtime && !(tkl->expire_at == 0))
-				{
-					tkl_expire_entry(tkl);
-				}
-			}
-		}
-	}
+	while (tkl_expiry_heap_count && (tkl_expiry_heap[0]->expire_at <= nowtime))
+		tkl_expire_entry(tkl_expiry_heap[0]);
+}
 
-	/* Now normal entries.. */
-	for (index = 0; index < TKLISTLEN; index++)
-	{
-		for (tkl = tklines[index]; tkl; tkl = next)
-		{
-			next = tkl->next;
-			if (tkl->expire_at <= nowtime && !(tkl->expire_at == 0))
-			{
-				tkl_expire_entry(tkl);
-			}
-		}
-	}
+/** Per-client cache of server ban and ban exception mask-match verdicts.
+ * Every new *LINE triggers a full ban sweep (loop.do_bancheck) in which
+ * every local client is matched against every server ban again, even
+ * though for all pre-existing entries nothing changed. The outcome of
+ * the pure mask match only depends on the TKL's masks (immutable for
+ * the lifetime of its id) and on client state that is covered by
+ * user->acl_generation, so it can be cached per client in a small
+ * direct-mapped table keyed by TKL id. Only the mask verdict is
+ * cached; soft ban authentication state and (for bans) ELINE
+ * exceptions are (re)checked on every hit, as those can change
+ * independently.
+ * @returns The cache slot for this client+TKL, or NULL if not cacheable.
+ */
+static TKLVerdictCache *tkl_verdict_cache_slot(Client *client, TKL *tkl)
+{
+	if (!tkl->id || !client->user || !MyConnect(client))
+		return NULL;
+	return &client->local->tkl_verdicts[tkl->id % TKLVERDICTCACHELEN];
 }
 
 /* This is just a helper function for find_tkl_exception() */
 static int find_tkl_exception_matcher(Client *client, int ban_type, TKL *except_tkl)
 {
-	char uhost[NICKLEN+HOSTLEN+1];
+	TKLVerdictCache *e;
+	int matched;
 
 	if (!TKLIsBanException(except_tkl))
 		return 0;
@@ -2808,9 +3791,24 @@ static int find_tkl_exception_matcher(Client *client, int ban_type, TKL *except_
 	if (!tkl_banexception_matches_type(except_tkl, ban_type))
 		return 0;
 
-	tkl_uhost(except_tkl, uhost, sizeof(uhost), NO_SOFT_PREFIX);
+	e = tkl_verdict_cache_slot(client, except_tkl);
+	if (e && (e->tkl_id == except_tkl->id) && (e->acl_generation == client->user->acl_generation))
+	{
+		matched = e->verdict;
+	} else {
+		char uhost[NICKLEN+HOSTLEN+1];
+
+		tkl_uhost(except_tkl, uhost, sizeof(uhost), NO_SOFT_PREFIX);
+		matched = match_user(uhost, client, MATCH_CHECK_REAL);
+		if (e)
+		{
+			e->tkl_id = except_tkl->id;
+			e->acl_generation = client->user->acl_generation;
+			e->verdict = matched;
+		}
+	}
 
-	if (match_user(uhost, client, MATCH_CHECK_REAL))
+	if (matched)
 	{
 		if (!(except_tkl->ptr.banexception->subtype & TKL_SUBTYPE_SOFT))
 			return 1; /* hard ban exempt */
@@ -2853,9 +3851,40 @@ int _find_tkl_exception(int ban_type, Client *client)
 		}
 	}
 
+	/* Then CIDR exceptions, from the radix tree: every node along
+	 * the client address with entries is a covering prefix.
+	 */
+	{
+		unsigned char addr[16];
+		unsigned int addrbits;
+		int family;
+
+		if (tkl_cidr_client_key(client, addr, &addrbits, &family))
+		{
+			TKLRadixNode *node;
+			TKLRadixRef *ref;
+
+			for (node = tkl_cidr_root[index][family]; node; )
+			{
+				if (!tkl_cidr_prefix_covers(node, addr, addrbits))
+					break;
+				for (ref = node->entries; ref; ref = ref->next)
+				{
+					if (find_tkl_exception_matcher(client, ban_type, ref->tkl))
+						return 1; /* exempt */
+				}
+				if (node->prefixlen >= addrbits)
+					break;
+				node = node->child[tkl_cidr_getbit(addr, node->prefixlen)];
+			}
+		}
+	}
+
 	/* If not banned (yet), then check regular entries.. */
 	for (tkl = tklines[tkl_hash('e')]; tkl; tkl = tkl->next)
 	{
+			if (tkl->flags & TKL_FLAG_IP_INDEXED)
+				continue; /* checked via the radix tree above */
 			if (find_tkl_exception_matcher(client, ban_type, tkl))
 				return 1; /* exempt */
 	}
@@ -2872,6 +3901,8 @@ int _find_tkl_exception(int ban_type, Client *client)
 int find_tkline_match_matcher(Client *client, int skip_soft, TKL *tkl)
 {
 	char uhost[NICKLEN+HOSTLEN+1];
+	TKLVerdictCache *e;
+	int matched;
 
 	if (!TKLIsServerBan(tkl) || (tkl->type & TKL_SHUN))
 		return 0;
@@ -2879,9 +3910,29 @@ int find_tkline_match_matcher(Client *client, int skip_soft, TKL *tkl)
 	if (skip_soft && (tkl->ptr.serverban->subtype & TKL_SUBTYPE_SOFT))
 		return 0;
 
-	tkl_uhost(tkl, uhost, sizeof(uhost), NO_SOFT_PREFIX);
+	e = tkl_verdict_cache_slot(client, tkl);
+	if (e && (e->tkl_id == tkl->id) && (e->acl_generation == client->user->acl_generation))
+	{
+		matched = e->verdict;
+	} else
+	{
+		if (tkl->ptr.serverban->cmask_host)
+		{
+			/* Compiled at insertion: no uhost rebuild, no mask re-parsing */
+			matched = tkl_serverban_compiled_match(client, tkl->ptr.serverban);
+		} else {
+			tkl_uhost(tkl, uhost, sizeof(uhost), NO_SOFT_PREFIX);
+			matched = match_user(uhost, client, MATCH_CHECK_REAL);
+		}
+		if (e)
+		{
+			e->tkl_id = tkl->id;
+			e->acl_generation = client->user->acl_generation;
+			e->verdict = matched;
+		}
+	}
 
-	if (match_user(uhost, client, MATCH_CHECK_REAL))
+	if (matched)
 	{
 		/* If hard-ban, or soft-ban&unauthenticated.. */
 		if (!(tkl->ptr.serverban->subtype & TKL_SUBTYPE_SOFT) ||
@@ -2928,6 +3979,44 @@ int _find_tkline_match(Client *client, int skip_soft)
 		}
 	}
 
+	/* Then the CIDR radix trees: walk each tree along the client
+	 * address, every node on the way with entries is a covering
+	 * prefix.
+	 */
+	if (!banned)
+	{
+		unsigned char addr[16];
+		unsigned int addrbits;
+		int family;
+
+		if (tkl_cidr_client_key(client, addr, &addrbits, &family))
+		{
+			TKLRadixNode *node;
+			TKLRadixRef *ref;
+
+			for (index = 0; (index < TKLIPHASHLEN1) && !banned; index++)
+			{
+				for (node = tkl_cidr_root[index][family]; node; )
+				{
+					if (!tkl_cidr_prefix_covers(node, addr, addrbits))
+						break;
+					for (ref = node->entries; ref; ref = ref->next)
+					{
+						banned = find_tkline_match_matcher(client, skip_soft, ref->tkl);
+						if (banned)
+						{
+							tkl = ref->tkl;
+							break;
+						}
+					}
+					if (banned || (node->prefixlen >= addrbits))
+						break;
+					node = node->child[tkl_cidr_getbit(addr, node->prefixlen)];
+				}
+			}
+		}
+	}
+
 	/* If not banned (yet), then check regular entries.. */
 	if (!banned)
 	{
@@ -2935,6 +4024,8 @@ int _find_tkline_match(Client *client, int skip_soft)
 		{
 			for (tkl = tklines[index]; tkl; tkl = tkl->next)
 			{
+				if (tkl->flags & TKL_FLAG_IP_INDEXED)
+					continue; /* checked via the radix tree above */
 				banned = find_tkline_match_matcher(client, skip_soft, tkl);
 				if (banned)
 					break;
@@ -2990,13 +4081,34 @@ int _find_shun(Client *client)
 	for (tkl = tklines[tkl_hash('s')]; tkl; tkl = tkl->next)
 	{
 		char uhost[NICKLEN+HOSTLEN+1];
+		TKLVerdictCache *e;
+		int matched;
 
 		if (!(tkl->type & TKL_SHUN))
 			continue;
 
-		snprintf(uhost, sizeof(uhost), "%s@%s", tkl->ptr.serverban->usermask, tkl->ptr.serverban->hostmask);
+		e = tkl_verdict_cache_slot(client, tkl);
+		if (e && (e->tkl_id == tkl->id) && (e->acl_generation == client->user->acl_generation))
+		{
+			matched = e->verdict;
+		} else
+		{
+			if (tkl->ptr.serverban->cmask_host)
+			{
+				matched = tkl_serverban_compiled_match(client, tkl->ptr.serverban);
+			} else {
+				snprintf(uhost, sizeof(uhost), "%s@%s", tkl->ptr.serverban->usermask, tkl->ptr.serverban->hostmask);
+				matched = match_user(uhost, client, MATCH_CHECK_REAL);
+			}
+			if (e)
+			{
+				e->tkl_id = tkl->id;
+				e->acl_generation = client->user->acl_generation;
+				e->verdict = matched;
+			}
+		}
 
-		if (match_user(uhost, client, MATCH_CHECK_REAL))
+		if (matched)
 		{
 			/* If hard-ban, or soft-ban&unauthenticated.. */
 			if (!(tkl->ptr.serverban->subtype & TKL_SUBTYPE_SOFT) ||
@@ -3136,28 +4248,34 @@ int spamfilter_check_all_users(Client *from, TKL *tkl)
 TKL *_find_qline(Client *client, char *name, int *ishold)
 {
 	TKL *tkl;
-	int	points = 0;
 	*ishold = 0;
 
 	if (IsServer(client) || IsMe(client))
 		return NULL;
 
-	for (tkl = tklines[tkl_hash('q')]; tkl; tkl = tkl->next)
-	{
-		points = 0;
-
-		if (!TKLIsNameBan(tkl))
-			continue;
+	/* Exact reservations (the common case) are one hash probe away.
+	 * No '#' check needed there: an exact match implies the first
+	 * characters are identical anyway.
+	 */
+	tkl = tkl_nameban_index_find(name);
 
-		if (((*tkl->ptr.nameban->name == '#' && *name == '#') || (*tkl->ptr.nameban->name != '#' && *name != '#'))
-		    && match_simple(tkl->ptr.nameban->name, name))
+	if (!tkl)
+	{
+		/* Only the wildcard reservations are left on this path */
+		for (tkl = tklines[tkl_hash('q')]; tkl; tkl = tkl->next)
 		{
-			points = 1;
-			break;
+			if (!TKLIsNameBan(tkl) || (tkl->flags & TKL_FLAG_NAME_INDEXED))
+				continue;
+
+			if (((*tkl->ptr.nameban->name == '#' && *name == '#') || (*tkl->ptr.nameban->name != '#' && *name != '#'))
+			    && match_simple(tkl->ptr.nameban->name, name))
+			{
+				break;
+			}
 		}
 	}
 
-	if (points != 1)
+	if (!tkl)
 		return NULL;
 
 	/* It's a services hold (except bans don't override this) */
@@ -3214,9 +4332,41 @@ TKL *_find_tkline_match_zap(Client *client)
 		}
 	}
 
+	/* Then the CIDR radix tree: O(address bits) for any number of
+	 * CIDR Z-Lines.
+	 */
+	{
+		unsigned char addr[16];
+		unsigned int addrbits;
+		int family;
+
+		if (tkl_cidr_client_key(client, addr, &addrbits, &family))
+		{
+			TKLRadixNode *node;
+			TKLRadixRef *ref;
+
+			for (node = tkl_cidr_root[index][family]; node; )
+			{
+				if (!tkl_cidr_prefix_covers(node, addr, addrbits))
+					break;
+				for (ref = node->entries; ref; ref = ref->next)
+				{
+					ret = find_tkline_match_zap_matcher(client, ref->tkl);
+					if (ret)
+						return ret;
+				}
+				if (node->prefixlen >= addrbits)
+					break;
+				node = node->child[tkl_cidr_getbit(addr, node->prefixlen)];
+			}
+		}
+	}
+
 	/* If not banned (yet), then check regular entries.. */
 	for (tkl = tklines[tkl_hash('z')]; tkl; tkl = tkl->next)
 	{
+		if (tkl->flags & TKL_FLAG_IP_INDEXED)
+			continue; /* checked via the radix tree above */
 		ret = find_tkline_match_zap_matcher(client, tkl);
 		if (ret)
 			return ret;
@@ -3417,6 +4567,15 @@ void tkl_stats_matcher(Client *client, int type, char *para, TKLFlag *tklflags,
 			tkl->ptr.spamfilter->tkl_duration, tkl->ptr.spamfilter->tkl_reason,
 			tkl->set_by,
 			tkl->ptr.spamfilter->match->str);
+		if (tkl->ptr.spamfilter->stats_scans)
+		{
+			sendtxtnumeric(client, "    %llu scans, %llu hits, %llu.%03llu ms matcher time%s",
+				tkl->ptr.spamfilter->stats_scans,
+				tkl->ptr.spamfilter->stats_hits,
+				tkl->ptr.spamfilter->stats_usec / 1000,
+				tkl->ptr.spamfilter->stats_usec % 1000,
+				tkl->ptr.spamfilter->prefilter ? "" : " (no pre-filter literal)");
+		}
 		if (para && !strcasecmp(para, "del"))
 		{
 			char *hash = spamfilter_id(tkl);
@@ -3606,6 +4765,263 @@ void _tkl_sync(Client *client)
 	}
 }
 
+/* Differential TKL sync.
+ *
+ * Re-sending every TKL on every link establishment is megabytes of
+ * netjoin traffic on networks with tens of thousands of entries, even
+ * though the rejoining peer usually already has nearly all of them.
+ * When both sides announce PROTOCTL TKLDSYNC, each side sends a
+ * TKLSYNC line after EOS containing TKLDSYNC_BUCKETS digests: every
+ * global TKL is hashed (over the same canonical fields the TKL sync
+ * line carries) into one of the digest buckets, whose digest is the
+ * XOR of its entry hashes - order independent, so it does not matter
+ * in which order the entries were learned. On receiving the peer's
+ * digests each side replays only its entries from buckets whose
+ * digests differ; duplicate adds are ignored by the receiver as usual.
+ * Malformed digests, a bucket count mismatch or a timeout degrade to
+ * replaying all buckets, which equals the old full sync.
+ */
+#define TKLDSYNC_BUCKETS 64
+
+/** Scheduler iterations (~10 msec each) to wait for the peer's
+ * TKLSYNC digests before falling back to a full replay.
+ */
+#define TKLDSYNC_TIMEOUT 1000
+
+/* Phases of tkl_sync_generate(), kept in syncsched.cursor[1] */
+#define TKLDSYNC_PHASE_DIGEST	0	/* Send our digests */
+#define TKLDSYNC_PHASE_WAIT	1	/* Waiting for the peer's digests */
+#define TKLDSYNC_PHASE_SEND	2	/* Replay entries from differing buckets */
+
+/** Deterministic hash over the canonical (synced) fields of a TKL
+ * entry - FNV-1a, so both sides compute identical values regardless
+ * of platform. Returns 0 for entries that are not synced at all.
+ */
+static unsigned long long tkl_dsync_entry_hash(TKL *tkl)
+{
+	char buf[1024];
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+	char *p;
+
+	if (!(tkl->type & TKL_GLOBAL))
+		return 0; /* not synced, not part of the digest */
+
+	if (TKLIsServerBan(tkl))
+		ircsnprintf(buf, sizeof(buf), "%c %s%s %s %s %lld %lld %s",
+			tkl_typetochar(tkl->type),
+			(tkl->ptr.serverban->subtype & TKL_SUBTYPE_SOFT) ? "%" : "",
+			*tkl->ptr.serverban->usermask ? tkl->ptr.serverban->usermask : "*",
+			tkl->ptr.serverban->hostmask, tkl->set_by,
+			(long long)tkl->expire_at, (long long)tkl->set_at,
+			tkl->ptr.serverban->reason);
+	else if (TKLIsNameBan(tkl))
+		ircsnprintf(buf, sizeof(buf), "%c %c %s %s %lld %lld %s",
+			tkl_typetochar(tkl->type),
+			tkl->ptr.nameban->hold ? 'H' : '*',
+			tkl->ptr.nameban->name, tkl->set_by,
+			(long long)tkl->expire_at, (long long)tkl->set_at,
+			tkl->ptr.nameban->reason);
+	else if (TKLIsSpamfilter(tkl))
+		ircsnprintf(buf, sizeof(buf), "%c %s %c %s %lld %lld %lld %s %s %s",
+			tkl_typetochar(tkl->type),
+			spamfilter_target_inttostring(tkl->ptr.spamfilter->target),
+			banact_valtochar(tkl->ptr.spamfilter->action),
+			tkl->set_by,
+			(long long)tkl->expire_at, (long long)tkl->set_at,
+			(long long)tkl->ptr.spamfilter->tkl_duration, tkl->ptr.spamfilter->tkl_reason,
+			unreal_match_method_valtostr(tkl->ptr.spamfilter->match->type),
+			tkl->ptr.spamfilter->match->str);
+	else if (TKLIsBanException(tkl))
+		ircsnprintf(buf, sizeof(buf), "%c %s%s %s %s %lld %lld %s %s",
+			tkl_typetochar(tkl->type),
+			(tkl->ptr.banexception->subtype & TKL_SUBTYPE_SOFT) ? "%" : "",
+			*tkl->ptr.banexception->usermask ? tkl->ptr.banexception->usermask : "*",
+			tkl->ptr.banexception->hostmask, tkl->set_by,
+			(long long)tkl->expire_at, (long long)tkl->set_at,
+			tkl->ptr.banexception->bantypes,
+			tkl->ptr.banexception->reason);
+	else
+		return 0;
+
+	for (p = buf; *p; p++)
+	{
+		hash ^= (unsigned char)*p;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/** Fold an entry hash into its 32 bit on-the-wire contribution */
+#define TKLDSYNC_FOLD(hash)	((unsigned int)((hash) ^ ((hash) >> 32)))
+
+/** Compute our digest of all global TKLs, one entry per bucket */
+static void tkl_dsync_compute(unsigned int *digests)
+{
+	TKL *tkl;
+	unsigned long long hash;
+	int index, index2;
+
+	memset(digests, 0, TKLDSYNC_BUCKETS * sizeof(unsigned int));
+
+	for (index = 0; index < TKLIPHASHLEN1; index++)
+		for (index2 = 0; index2 < TKLIPHASHLEN2; index2++)
+			for (tkl = tklines_ip_hash[index][index2]; tkl; tkl = tkl->next)
+				if ((hash = tkl_dsync_entry_hash(tkl)))
+					digests[hash % TKLDSYNC_BUCKETS] ^= TKLDSYNC_FOLD(hash);
+
+	for (index = 0; index < TKLISTLEN; index++)
+		for (tkl = tklines[index]; tkl; tkl = tkl->next)
+			if ((hash = tkl_dsync_entry_hash(tkl)))
+				digests[hash % TKLDSYNC_BUCKETS] ^= TKLDSYNC_FOLD(hash);
+}
+
+/** Send our TKLSYNC digest line to 'to' */
+static void tkl_dsync_send_digest(Client *to)
+{
+	unsigned int digests[TKLDSYNC_BUCKETS];
+	char buf[TKLDSYNC_BUCKETS * 9 + 1];
+	char *p = buf;
+	int i;
+
+	tkl_dsync_compute(digests);
+	for (i = 0; i < TKLDSYNC_BUCKETS; i++)
+		p += ircsnprintf(p, buf + sizeof(buf) - p, "%s%x", i ? "," : "", digests[i]);
+	sendto_one(to, NULL, ":%s TKLSYNC :%s", me.id, buf);
+}
+
+/** TKLSYNC command - the peer's TKL digests (see the comment above).
+ * Compares them against our own and stores the bitmask of differing
+ * buckets for tkl_sync_generate() to replay. Anything unparsable
+ * makes us replay everything, which is simply the old full sync.
+ */
+CMD_FUNC(cmd_tklsync)
+{
+	unsigned int ours[TKLDSYNC_BUCKETS];
+	unsigned long long mask = ~0ULL;
+	char *p;
+	int i;
+
+	if (!MyConnect(client) || !IsServer(client))
+		return;
+
+	if ((parc > 1) && !BadPtr(parv[1]))
+	{
+		tkl_dsync_compute(ours);
+		mask = 0;
+		p = parv[1];
+		for (i = 0; i < TKLDSYNC_BUCKETS; i++)
+		{
+			if (!p)
+				break;
+			if ((unsigned int)strtoul(p, NULL, 16) != ours[i])
+				mask |= 1ULL << i;
+			p = strchr(p, ',');
+			if (p)
+				p++;
+		}
+		if ((i < TKLDSYNC_BUCKETS) || p)
+			mask = ~0ULL; /* bucket count mismatch: replay everything */
+	}
+
+	/* Hand the verdict to our sync generator for this link. If it is
+	 * not (or no longer) in its waiting phase we ignore the message.
+	 */
+	if (client->serv->syncsched.gen &&
+	    !strcmp(client->serv->syncsched.gen->name, "tkl") &&
+	    (client->serv->syncsched.cursor[1] <= TKLDSYNC_PHASE_WAIT))
+	{
+		client->serv->syncsched.scratch = mask;
+		client->serv->syncsched.cursor[0] = 0;
+		client->serv->syncsched.cursor[1] = TKLDSYNC_PHASE_SEND;
+	}
+}
+
+/** Resumable TKL sync, driven by the post-EOS sync scheduler.
+ * Sends roughly 'budget' entries per call to 'to', remembering the
+ * position in to->serv->syncsched.cursor[0] as a flattened bucket
+ * index: first the TKLIPHASHLEN1*TKLIPHASHLEN2 buckets of the IP hash,
+ * then the TKLISTLEN regular lists. The cursor only ever points at a
+ * bucket boundary, so entries added or removed between slices are no
+ * problem: changes are covered by the normal TKL broadcasts, which the
+ * new server already receives, and duplicate adds are harmless.
+ *
+ * For TKLDSYNC peers this runs as a small state machine (cursor[1]):
+ * exchange digests first, then replay only the entries from digest
+ * buckets that differ (bitmask in syncsched.scratch). For old peers
+ * the mask is all ones, i.e. a full replay.
+ * @returns 0 when everything was sent, non-zero to be called again.
+ */
+int tkl_sync_generate(Client *to, int budget)
+{
+	int *cursor = to->serv->syncsched.cursor;
+	unsigned long long mask;
+	unsigned long long hash;
+	int sent = 0;
+	TKL *tkl;
+
+	if (SupportTKLDSYNC(to) && (cursor[1] < TKLDSYNC_PHASE_SEND))
+	{
+		if (cursor[1] == TKLDSYNC_PHASE_DIGEST)
+		{
+			tkl_dsync_send_digest(to);
+			cursor[0] = 0;
+			cursor[1] = TKLDSYNC_PHASE_WAIT;
+			return 1;
+		}
+		/* TKLDSYNC_PHASE_WAIT: cmd_tklsync() advances us. If the
+		 * peer's digests never arrive, fall back to a full replay.
+		 */
+		if (++cursor[0] < TKLDSYNC_TIMEOUT)
+			return 1;
+		to->serv->syncsched.scratch = ~0ULL;
+		cursor[0] = 0;
+		cursor[1] = TKLDSYNC_PHASE_SEND;
+	}
+
+	mask = SupportTKLDSYNC(to) ? to->serv->syncsched.scratch : ~0ULL;
+	if (!mask)
+		return 0; /* in sync, nothing to replay */
+
+	/* First, hashed entries.. */
+	while (cursor[0] < TKLIPHASHLEN1 * TKLIPHASHLEN2)
+	{
+		int index = cursor[0] / TKLIPHASHLEN2;
+		int index2 = cursor[0] % TKLIPHASHLEN2;
+
+		for (tkl = tklines_ip_hash[index][index2]; tkl; tkl = tkl->next)
+		{
+			hash = tkl_dsync_entry_hash(tkl);
+			if (!(mask & (1ULL << (hash % TKLDSYNC_BUCKETS))))
+				continue;
+			tkl_sync_send_entry(1, &me, to, tkl);
+			sent++;
+		}
+		cursor[0]++;
+		if (sent >= budget)
+			return 1;
+	}
+
+	/* Then, regular entries.. */
+	while (cursor[0] < TKLIPHASHLEN1 * TKLIPHASHLEN2 + TKLISTLEN)
+	{
+		int index = cursor[0] - TKLIPHASHLEN1 * TKLIPHASHLEN2;
+
+		for (tkl = tklines[index]; tkl; tkl = tkl->next)
+		{
+			hash = tkl_dsync_entry_hash(tkl);
+			if (!(mask & (1ULL << (hash % TKLDSYNC_BUCKETS))))
+				continue;
+			tkl_sync_send_entry(1, &me, to, tkl);
+			sent++;
+		}
+		cursor[0]++;
+		if (sent >= budget)
+			return 1;
+	}
+
+	return 0;
+}
+
 /** Find a server ban TKL - only used to prevent duplicates and for deletion */
 TKL *_find_tkl_serverban(int type, char *usermask, char *hostmask, int softban)
 {
@@ -3662,14 +5078,24 @@ TKL *_find_tkl_banexception(int type, char *usermask, char *hostmask, int softba
 TKL *_find_tkl_nameban(int type, char *name, int hold)
 {
 	char tpe = tkl_typetochar(type);
+	NameBanRef *ref;
 	TKL *tkl;
 
 	if (!TKLIsNameBanType(type))
 		abort();
 
+	/* Wildcard-free names sit in the exact-name hash.. */
+	for (ref = nameban_hash[tkl_nameban_hash(name)]; ref; ref = ref->next)
+	{
+		if ((ref->tkl->type == type) && !strcasecmp(ref->tkl->ptr.nameban->name, name))
+			return ref->tkl;
+	}
+
+	/* ..which leaves only the wildcard reservations to scan */
 	for (tkl = tklines[tkl_hash(tpe)]; tkl; tkl = tkl->next)
 	{
-		if ((tkl->type == type) && !strcasecmp(tkl->ptr.nameban->name, name))
+		if ((tkl->type == type) && !(tkl->flags & TKL_FLAG_NAME_INDEXED) &&
+		    !strcasecmp(tkl->ptr.nameban->name, name))
 			return tkl;
 	}
 	return NULL; /* Not found */
@@ -4092,6 +5518,7 @@ CMD_FUNC(cmd_tkl_add)
 				tkl->expire_at = 0;
 			else
 				tkl->expire_at = MAX(tkl->expire_at, expire_at);
+			tkl_expiry_schedule(tkl);
 
 			if (strcmp(tkl->set_by, parv[5]) < 0)
 				safe_strdup(tkl->set_by, parv[5]);
@@ -4603,8 +6030,18 @@ int _match_spamfilter(Client *client, char *str_in, int target, char *destinatio
 	if (!client->user || ValidatePermissionsForPath("immune:server-ban:spamfilter",client,NULL,NULL,NULL) || IsULine(client))
 		return 0;
 
+	/* One automaton pass over the text marks every filter whose
+	 * required literal occurs in it; only those run their matcher.
+	 */
+	if (spamfilter_ac_dirty)
+		spamfilter_prefilter_rebuild();
+	spamfilter_prefilter_scan(str);
+
 	for (tkl = tklines[tkl_hash('F')]; tkl; tkl = tkl->next)
 	{
+		struct timeval match_start, match_end;
+		long long match_usec;
+
 		if (!(tkl->ptr.spamfilter->target & target))
 			continue;
 
@@ -4617,6 +6054,13 @@ int _match_spamfilter(Client *client, char *str_in, int target, char *destinatio
 		if (IsSoftBanAction(tkl->ptr.spamfilter->action) && IsLoggedIn(client))
 			continue;
 
+		/* If the pattern has a required literal and it did not
+		 * occur in the text, then the matcher cannot match.
+		 */
+		if (tkl->ptr.spamfilter->prefilter &&
+		    (tkl->ptr.spamfilter->prefilter_gen != spamfilter_prefilter_scangen))
+			continue;
+
 #ifdef SPAMFILTER_DETECTSLOW
 		memset(&rnow, 0, sizeof(rnow));
 		memset(&rprev, 0, sizeof(rnow));
@@ -4624,7 +6068,16 @@ int _match_spamfilter(Client *client, char *str_in, int target, char *destinatio
 		getrusage(RUSAGE_SELF, &rprev);
 #endif
 
+		gettimeofday(&match_start, NULL);
 		ret = unreal_match(tkl->ptr.spamfilter->match, str);
+		gettimeofday(&match_end, NULL);
+		match_usec = (long long)(match_end.tv_sec - match_start.tv_sec) * 1000000 +
+		             (match_end.tv_usec - match_start.tv_usec);
+		tkl->ptr.spamfilter->stats_scans++;
+		if (ret)
+			tkl->ptr.spamfilter->stats_hits++;
+		if (match_usec > 0) /* guard against wall clock jumping back */
+			tkl->ptr.spamfilter->stats_usec += match_usec;
 
 #ifdef SPAMFILTER_DETECTSLOW
 		getrusage(RUSAGE_SELF, &rnow);
@@ -71,7 +71,7 @@ ModuleHeader MOD_HEADER = {
 	do { \
 		if (!(x)) { \
 			WARN_WRITE_ERROR(tmpfname); \
-			fclose(fd); \
+			dbwrite_discard(fd); \
 			return 0; \
 		} \
 	} while(0)
@@ -99,6 +99,7 @@ int read_tkldb(void);
 const uint32_t tkl_db_version = TKL_DB_VERSION;
 struct cfgstruct {
 	char *database;
+	int fsync;
 };
 static struct cfgstruct cfg;
 
@@ -121,6 +122,10 @@ MOD_INIT()
 
 	if (!tkls_loaded)
 	{
+		struct timeval db_start, db_end;
+		long long db_cpu = boot_phase_cpu_now();
+
+		gettimeofday(&db_start, NULL);
 		/* If this is the first time that our module is loaded, then
 		 * read the TKL DB and add all *-Lines.
 		 */
@@ -133,6 +138,10 @@ MOD_INIT()
 			else
 				config_warn("[tkldb] Failed to rename database from %s to %s: %s", cfg.database, fname, strerror(errno));
 		}
+		gettimeofday(&db_end, NULL);
+		boot_phase_credit("tkldb read",
+			(long long)(db_end.tv_sec - db_start.tv_sec) * 1000000 + (db_end.tv_usec - db_start.tv_usec),
+			boot_phase_cpu_now() - db_cpu);
 		tkls_loaded = 1;
 	}
 	HookAdd(modinfo->handle, HOOKTYPE_CONFIGRUN, 0, tkldb_configrun);
@@ -153,6 +162,7 @@ MOD_LOAD()
 MOD_UNLOAD()
 {
 	write_tkldb();
+	dbwrite_flush(); /* we may not get another main loop iteration */
 	freecfg();
 	SavePersistentInt(modinfo, tkls_loaded);
 	return MOD_SUCCESS;
@@ -169,6 +179,7 @@ void setcfg(void)
 	// Default: data/tkl.db
 	safe_strdup(cfg.database, "tkl.db");
 	convert_to_absolute_path(&cfg.database, PERMDATADIR);
+	cfg.fsync = 0;
 }
 
 void freecfg(void)
@@ -199,6 +210,8 @@ int tkldb_configtest(ConfigFile *cf, ConfigEntry *ce, int type, int *errs)
 			convert_to_absolute_path(&cep->ce_vardata, PERMDATADIR);
 			continue;
 		}
+		if (!strcmp(cep->ce_varname, "fsync"))
+			continue;
 		config_error("%s:%i: unknown directive set::tkldb::%s", cep->ce_fileptr->cf_filename, cep->ce_varlinenum, cep->ce_varname);
 		errors++;
 	}
@@ -222,6 +235,8 @@ int tkldb_configrun(ConfigFile *cf, ConfigEntry *ce, int type)
 	{
 		if (!strcmp(cep->ce_varname, "database"))
 			safe_strdup(cfg.database, cep->ce_vardata);
+		else if (!strcmp(cep->ce_varname, "fsync"))
+			cfg.fsync = config_checkval(cep->ce_vardata, CFG_YESNO);
 	}
 	return 1;
 }
@@ -235,6 +250,7 @@ int write_tkldb(void)
 {
 	char tmpfname[512];
 	FILE *fd;
+	int writebehind = 0;
 	uint64_t tklcount;
 	int index, index2;
 	TKL *tkl;
@@ -244,9 +260,17 @@ int write_tkldb(void)
 	gettimeofday(&tv_alpha, NULL);
 #endif
 
-	// Write to a tempfile first, then rename it if everything succeeded
+	/* Serialize to memory when possible, the result is then written to
+	 * disk in small chunks from the main loop (see dbwrite_run). If
+	 * that is unavailable then write to a tempfile directly - in both
+	 * cases the tempfile is renamed into place once complete.
+	 */
 	snprintf(tmpfname, sizeof(tmpfname), "%s.tmp", cfg.database);
-	fd = fopen(tmpfname, "wb");
+	fd = dbwrite_open();
+	if (fd)
+		writebehind = 1;
+	else
+		fd = fopen(tmpfname, "wb");
 	if (!fd)
 	{
 		WARN_WRITE_ERROR(tmpfname);
@@ -310,20 +334,38 @@ int write_tkldb(void)
 		}
 	}
 
-	// Everything seems to have gone well, attempt to close and rename the tempfile
-	if (fclose(fd) != 0)
+	if (writebehind)
 	{
-		WARN_WRITE_ERROR(tmpfname);
-		return 0;
-	}
+		// Everything is in memory now, disk I/O happens from the main loop
+		if (!dbwrite_submit(fd, cfg.database, cfg.fsync))
+		{
+			WARN_WRITE_ERROR(tmpfname);
+			return 0;
+		}
+	} else {
+		// Everything seems to have gone well, attempt to close and rename the tempfile
+#ifndef _WIN32
+		if (cfg.fsync && (fflush(fd) != 0 || fsync(fileno(fd)) < 0))
+		{
+			WARN_WRITE_ERROR(tmpfname);
+			fclose(fd);
+			return 0;
+		}
+#endif
+		if (fclose(fd) != 0)
+		{
+			WARN_WRITE_ERROR(tmpfname);
+			return 0;
+		}
 #ifdef _WIN32
-	/* The rename operation cannot be atomic on Windows as it will cause a "file exists" error */
-	unlink(cfg.database);
+		/* The rename operation cannot be atomic on Windows as it will cause a "file exists" error */
+		unlink(cfg.database);
 #endif
-	if (rename(tmpfname, cfg.database) < 0)
-	{
-		sendto_realops_and_log("[tkldb] Error renaming '%s' to '%s': %s (DATABASE NOT SAVED)", tmpfname, cfg.database, strerror(errno));
-		return 0;
+		if (rename(tmpfname, cfg.database) < 0)
+		{
+			sendto_realops_and_log("[tkldb] Error renaming '%s' to '%s': %s (DATABASE NOT SAVED)", tmpfname, cfg.database, strerror(errno));
+			return 0;
+		}
 	}
 #ifdef BENCHMARK
 	gettimeofday(&tv_beta, NULL);
@@ -0,0 +1,128 @@
+/*
+ *   IRC - Internet Relay Chat, src/modules/tracepoint.c
+ *   (C) 2021 The UnrealIRCd Team
+ *
+ *   See file AUTHORS in IRC package for additional names of
+ *   the programmers.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 1, or (at your option)
+ *   any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "unrealircd.h"
+
+CMD_FUNC(cmd_tracepoint);
+
+#define MSG_TRACEPOINT	"TRACEPOINT"
+
+ModuleHeader MOD_HEADER
+  = {
+	"tracepoint",
+	"5.0",
+	"command /tracepoint",
+	"UnrealIRCd Team",
+	"unrealircd-5",
+    };
+
+MOD_INIT()
+{
+	CommandAdd(modinfo->handle, MSG_TRACEPOINT, cmd_tracepoint, MAXPARA, CMD_OPER);
+	MARK_AS_OFFICIAL_MODULE(modinfo);
+	return MOD_SUCCESS;
+}
+
+MOD_LOAD()
+{
+	return MOD_SUCCESS;
+}
+
+MOD_UNLOAD()
+{
+	return MOD_SUCCESS;
+}
+
+/** TRACEPOINT: control the tracepoint framework (see src/trace.c).
+ * parv[1]: LIST | ON | OFF | DUMP
+ * parv[2]: tracepoint name (ON/OFF) or number of events (DUMP)
+ */
+CMD_FUNC(cmd_tracepoint)
+{
+	Tracepoint *tp;
+
+	if (!ValidatePermissionsForPath("server:tracepoint", client, NULL, NULL, NULL))
+	{
+		sendnumeric(client, ERR_NOPRIVILEGES);
+		return;
+	}
+
+	if ((parc < 2) || BadPtr(parv[1]))
+	{
+		sendnotice(client, "Use: /TRACEPOINT LIST | ON <name> | OFF <name> | DUMP [count]");
+		return;
+	}
+
+	if (!strcasecmp(parv[1], "LIST"))
+	{
+		for (tp = tracepoints; tp; tp = tp->next)
+			sendtxtnumeric(client, "%s: %s, %llu event%s recorded",
+				tp->name, tp->enabled ? "ON" : "off",
+				tp->hits, (tp->hits == 1) ? "" : "s");
+		return;
+	}
+
+	if (!strcasecmp(parv[1], "ON") || !strcasecmp(parv[1], "OFF"))
+	{
+		int enable = !strcasecmp(parv[1], "ON");
+
+		if ((parc < 3) || BadPtr(parv[2]))
+		{
+			sendnotice(client, "Use: /TRACEPOINT %s <name>", enable ? "ON" : "OFF");
+			return;
+		}
+		tp = tracepoint_find(parv[2]);
+		if (!tp)
+		{
+			sendnotice(client, "No such tracepoint '%s', try /TRACEPOINT LIST", parv[2]);
+			return;
+		}
+		tp->enabled = enable;
+		sendnotice(client, "Tracepoint '%s' is now %s", tp->name, enable ? "ON" : "off");
+		sendto_realops("%s (%s@%s) turned tracepoint '%s' %s", client->name,
+			client->user->username, GetHost(client), tp->name, enable ? "ON" : "off");
+		return;
+	}
+
+	if (!strcasecmp(parv[1], "DUMP"))
+	{
+		unsigned int n = 50; /* default: the last 50 events */
+		unsigned int pos;
+
+		if ((parc > 2) && !BadPtr(parv[2]))
+			n = atoi(parv[2]);
+		if ((n < 1) || (n > TRACE_RING_ENTRIES))
+			n = TRACE_RING_ENTRIES;
+		if (n > trace_ring_pos)
+			n = trace_ring_pos;
+		if (!n)
+		{
+			sendnotice(client, "Trace ring is empty - enable a tracepoint first (/TRACEPOINT LIST)");
+			return;
+		}
+		for (pos = trace_ring_pos - n; pos != trace_ring_pos; pos++)
+			sendtxtnumeric(client, "%s", trace_ring[pos % TRACE_RING_ENTRIES]);
+		return;
+	}
+
+	sendnotice(client, "Use: /TRACEPOINT LIST | ON <name> | OFF <name> | DUMP [count]");
+}
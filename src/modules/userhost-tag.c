@@ -88,15 +88,19 @@ void mtag_add_userhost(Client *client, MessageTag *recv_mtags, MessageTag **mtag
 		MessageTag *m = find_mtag(recv_mtags, "unrealircd.org/userhost");
 		if (m)
 		{
-			m = duplicate_mtag(m);
+			m = duplicate_mtag_shared(m);
 		} else {
-			char nuh[USERLEN+HOSTLEN+1];
-
-			snprintf(nuh, sizeof(nuh), "%s@%s", client->user->username, client->user->realhost);
-
-			m = safe_alloc(sizeof(MessageTag));
-			safe_strdup(m->name, "unrealircd.org/userhost");
-			safe_strdup(m->value, nuh);
+			/* The rendered user@host is cached on the sender -
+			 * userhost_changed() invalidates it - so the tag can
+			 * reference it instead of re-rendering per message.
+			 */
+			if (!client->user->userhost_tag.len)
+			{
+				client->user->userhost_tag.len =
+					snprintf(client->user->userhost_tag.buf, sizeof(client->user->userhost_tag.buf),
+					         "%s@%s", client->user->username, client->user->realhost);
+			}
+			m = new_mtag_arena_shared("unrealircd.org/userhost", client->user->userhost_tag.buf);
 		}
 		AddListItem(m, *mtag_list);
 	}
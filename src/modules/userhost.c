@@ -65,8 +65,11 @@ CMD_FUNC(cmd_userhost)
 	char *p;		/* scratch end pointer */
 	char *cn;		/* current name */
 	Client *acptr;
+	char *names[MAXUSERHOSTREPLIES];
+	Client *targets[MAXUSERHOSTREPLIES];
 	char response[MAXUSERHOSTREPLIES][NICKLEN * 2 + CHANNELLEN + USERLEN + HOSTLEN + 30];
 	int i;			/* loop counter */
+	int n;			/* number of names requested */
 	int w;
 
 	if (parc < 2)
@@ -85,12 +88,18 @@ CMD_FUNC(cmd_userhost)
 
 	cn = parv[1];
 
-	for (w = 0, i = 0; (i < MAXUSERHOSTREPLIES) && cn; i++)
+	for (n = 0; (n < MAXUSERHOSTREPLIES) && cn; n++)
 	{
 		if ((p = strchr(cn, ' ')))
-			*p = '\0';
+			*p++ = '\0';
+		names[n] = cn;
+		cn = p;
+	}
+	find_persons(n, names, targets);
 
-		if ((acptr = find_person(cn, NULL)))
+	for (w = 0, i = 0; i < n; i++)
+	{
+		if ((acptr = targets[i]))
 		{
 			ircsnprintf(response[w], NICKLEN * 2 + CHANNELLEN + USERLEN + HOSTLEN + 30,
                             "%s%s=%c%s@%s",
@@ -104,9 +113,6 @@ CMD_FUNC(cmd_userhost)
 			    acptr->user->realhost));
 			w++;
 		}
-		if (p)
-			p++;
-		cn = p;
 	}
 
 	sendnumeric(client, RPL_USERHOST, response[0], response[1], response[2], response[3], response[4]);
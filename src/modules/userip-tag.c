@@ -88,15 +88,19 @@ void mtag_add_userip(Client *client, MessageTag *recv_mtags, MessageTag **mtag_l
 		MessageTag *m = find_mtag(recv_mtags, "unrealircd.org/userip");
 		if (m)
 		{
-			m = duplicate_mtag(m);
+			m = duplicate_mtag_shared(m);
 		} else {
-			char nuh[USERLEN+HOSTLEN+1];
-
-			snprintf(nuh, sizeof(nuh), "%s@%s", client->user->username, GetIP(client));
-
-			m = safe_alloc(sizeof(MessageTag));
-			safe_strdup(m->name, "unrealircd.org/userip");
-			safe_strdup(m->value, nuh);
+			/* The rendered user@ip is cached on the sender -
+			 * userhost_changed() invalidates it - so the tag can
+			 * reference it instead of re-rendering per message.
+			 */
+			if (!client->user->userip_tag.len)
+			{
+				client->user->userip_tag.len =
+					snprintf(client->user->userip_tag.buf, sizeof(client->user->userip_tag.buf),
+					         "%s@%s", client->user->username, GetIP(client));
+			}
+			m = new_mtag_arena_shared("unrealircd.org/userip", client->user->userip_tag.buf);
 		}
 		AddListItem(m, *mtag_list);
 	}
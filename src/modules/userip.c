@@ -69,8 +69,11 @@ CMD_FUNC(cmd_userip)
 	char *cn;		/* current name */
 	char *ip, ipbuf[HOSTLEN+1];
 	Client *acptr;
+	char *names[MAXUSERHOSTREPLIES];
+	Client *targets[MAXUSERHOSTREPLIES];
 	char response[MAXUSERHOSTREPLIES][NICKLEN * 2 + CHANNELLEN + USERLEN + HOSTLEN + 30];
 	int  i;			/* loop counter */
+	int n;			/* number of names requested */
 	int w;
 
 	if (!MyUser(client))
@@ -93,12 +96,18 @@ CMD_FUNC(cmd_userip)
 
 	cn = parv[1];
 
-	for (w = 0, i = 0; (i < MAXUSERHOSTREPLIES) && cn; i++)
+	for (n = 0; (n < MAXUSERHOSTREPLIES) && cn; n++)
 	{
 		if ((p = strchr(cn, ' ')))
-			*p = '\0';
+			*p++ = '\0';
+		names[n] = cn;
+		cn = p;
+	}
+	find_persons(n, names, targets);
 
-		if ((acptr = find_person(cn, NULL)))
+	for (w = 0, i = 0; i < n; i++)
+	{
+		if ((acptr = targets[i]))
 		{
 			if (!(ip = GetIP(acptr)))
 				ip = "<unknown>";
@@ -116,9 +125,6 @@ CMD_FUNC(cmd_userip)
 			    acptr->user->username, ip);
 			w++;
 		}
-		if (p)
-			p++;
-		cn = p;
 	}
 
 	sendnumeric(client, RPL_USERIP, response[0], response[1], response[2], response[3], response[4]);
@@ -133,7 +133,7 @@ CMD_FUNC(cmd_watch)
 					continue;
 				}
 
-				add_to_watch_hash_table(s + 1, client, awaynotify);
+				add_to_watch_hash_table(s + 1, client, awaynotify, 0);
 			}
 
 			show_watch(client, s + 1, RPL_NOWON, RPL_NOWOFF, awaynotify);
@@ -148,7 +148,7 @@ CMD_FUNC(cmd_watch)
 		{
 			if (!*(s+1))
 				continue;
-			del_from_watch_hash_table(s + 1, client);
+			del_from_watch_hash_table(s + 1, client, 0);
 			show_watch(client, s + 1, RPL_WATCHOFF, RPL_WATCHOFF, 0);
 
 			continue;
@@ -160,7 +160,7 @@ CMD_FUNC(cmd_watch)
 		 */
 		if (*s == 'C' || *s == 'c')
 		{
-			hash_del_watch_list(client);
+			hash_del_watch_subscriptions(client, 0);
 
 			continue;
 		}
@@ -172,7 +172,7 @@ CMD_FUNC(cmd_watch)
 		 */
 		if ((*s == 'S' || *s == 's') && !did_s)
 		{
-			Link *lp;
+			WatchLink *wl;
 			Watch *anptr;
 			int  count = 0;
 			
@@ -184,39 +184,36 @@ CMD_FUNC(cmd_watch)
 			 */
 			anptr = hash_get_watch(client->name);
 			if (anptr)
-				for (lp = anptr->watch, count = 1;
-				    (lp = lp->next); count++)
-					;
+				for (wl = anptr->watchers; wl; wl = wl->next_watcher)
+					if (wl->watched)
+						count++;
 			sendnumeric(client, RPL_WATCHSTAT, client->local->watches, count);
 
 			/*
 			 * Send a list of everybody in their WATCH list. Be careful
-			 * not to buffer overflow.
+			 * not to buffer overflow. Entries that exist only for
+			 * MONITOR are not part of the WATCH list.
 			 */
-			if ((lp = client->local->watch) == NULL)
-			{
-				sendnumeric(client, RPL_ENDOFWATCHLIST, *s);
-				continue;
-			}
 			*buf = '\0';
-			strlcpy(buf, lp->value.wptr->nick, sizeof buf);
-			count =
-			    strlen(client->name) + strlen(me.name) + 10 +
-			    strlen(buf);
-			while ((lp = lp->next))
+			count = strlen(client->name) + strlen(me.name) + 10;
+			for (wl = client->local->watch; wl; wl = wl->next_entry)
 			{
-				if (count + strlen(lp->value.wptr->nick) + 1 >
-				    BUFSIZE - 2)
+				if (!wl->watched)
+					continue;
+				if (*buf && (count + strlen(wl->entry->nick) + 1 >
+				    BUFSIZE - 2))
 				{
 					sendnumeric(client, RPL_WATCHLIST, buf);
 					*buf = '\0';
 					count = strlen(client->name) + strlen(me.name) + 10;
 				}
-				strcat(buf, " ");
-				strcat(buf, lp->value.wptr->nick);
-				count += (strlen(lp->value.wptr->nick) + 1);
+				if (*buf)
+					strcat(buf, " ");
+				strcat(buf, wl->entry->nick);
+				count += (strlen(wl->entry->nick) + 1);
 			}
-			sendnumeric(client, RPL_WATCHLIST, buf);
+			if (*buf)
+				sendnumeric(client, RPL_WATCHLIST, buf);
 
 			sendnumeric(client, RPL_ENDOFWATCHLIST, *s);
 			continue;
@@ -229,29 +226,49 @@ CMD_FUNC(cmd_watch)
 		 */
 		if ((*s == 'L' || *s == 'l') && !did_l)
 		{
-			Link *lp = client->local->watch;
+#define WATCHSTATUSBATCH 16
+			WatchLink *wl = client->local->watch;
+			WatchLink *batch[WATCHSTATUSBATCH];
+			char *names[WATCHSTATUSBATCH];
+			Client *targets[WATCHSTATUSBATCH];
+			int n, i;
 
 			did_l = 1;
 
-			while (lp)
+			/* Resolve the watch list a batch at a time, which
+			 * overlaps the hash lookups (see find_persons).
+			 */
+			while (wl)
 			{
-				if ((target = find_person(lp->value.wptr->nick, NULL)))
+				for (n = 0; wl && (n < WATCHSTATUSBATCH); wl = wl->next_entry)
+				{
+					if (!wl->watched)
+						continue; /* MONITOR-only entry */
+					batch[n] = wl;
+					names[n] = wl->entry->nick;
+					n++;
+				}
+				find_persons(n, names, targets);
+
+				for (i = 0; i < n; i++)
 				{
-					sendnumeric(client, RPL_NOWON, target->name,
-					    target->user->username,
-					    IsHidden(target) ? target->user->
-					    virthost : target->user->realhost,
-					    target->lastnick);
+					if ((target = targets[i]))
+					{
+						sendnumeric(client, RPL_NOWON, target->name,
+						    target->user->username,
+						    IsHidden(target) ? target->user->
+						    virthost : target->user->realhost,
+						    target->lastnick);
+					}
+					/*
+					 * But actually, only show them offline if its a capital
+					 * 'L' (full list wanted).
+					 */
+					else if (isupper(*s))
+						sendnumeric(client, RPL_NOWOFF,
+						    batch[i]->entry->nick, "*", "*",
+						    batch[i]->entry->lasttime);
 				}
-				/*
-				 * But actually, only show them offline if its a capital
-				 * 'L' (full list wanted).
-				 */
-				else if (isupper(*s))
-					sendnumeric(client, RPL_NOWOFF,
-					    lp->value.wptr->nick, "*", "*",
-					    lp->value.wptr->lasttime);
-				lp = lp->next;
 			}
 
 			sendnumeric(client, RPL_ENDOFWATCHLIST, *s);
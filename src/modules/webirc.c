@@ -25,12 +25,29 @@ typedef enum {
 	WEBIRC_PASS=1, WEBIRC_WEBIRC=2
 } WEBIRCType;
 
+/** A webirc::mask that is a plain IP or CIDR range, pre-parsed into
+ * address bits. Gateway configs are typically nothing but dozens of
+ * such ranges and this path runs for every WEBIRC command, so we
+ * compare binary prefixes instead of calling the generic mask matcher
+ * (which re-parses the mask on every call) per mask per connection.
+ */
+typedef struct WebircPrefix WebircPrefix;
+struct WebircPrefix {
+	WebircPrefix *next;
+	unsigned char key[16];	/**< Address bits (bits past 'prefixlen' are zero) */
+	unsigned int prefixlen;	/**< Number of significant bits in 'key' */
+	int family;		/**< 0=IPv4, 1=IPv6 */
+};
+
 struct ConfigItem_webirc {
 	ConfigItem_webirc *prev, *next;
 	ConfigFlag flag;
 	ConfigItem_mask *mask;
 	WEBIRCType type;
 	AuthConfig *auth;
+	WebircPrefix *prefixes;		/**< Compiled IP/CIDR masks (see webirc_compile_block) */
+	unsigned compiled:1;		/**< Prefixes compiled already? */
+	unsigned all_masks_compiled:1;	/**< 1 if every mask is covered by 'prefixes' */
 };
 
 /* Module header */
@@ -132,6 +149,13 @@ void webirc_free_conf(void)
 
 void delete_webircblock(ConfigItem_webirc *e)
 {
+	WebircPrefix *p, *p_next;
+
+	for (p = e->prefixes; p; p = p_next)
+	{
+		p_next = p->next;
+		safe_free(p);
+	}
 	unreal_delete_masks(e->mask);
 	if (e->auth)
 		Auth_FreeAuthConfig(e->auth);
@@ -303,14 +327,133 @@ void webirc_md_free(ModData *md)
 	md->l = 0;
 }
 
+/** Parse a mask into a binary prefix if it is a plain IP or CIDR range.
+ * Anything else (wildcards, hostnames, user@host) stays on the generic
+ * mask matcher.
+ */
+static int webirc_parse_prefix(const char *mask, unsigned char *key, unsigned int *prefixlen, int *family)
+{
+	char addr[64], *slash;
+	const char *p;
+	unsigned int plen, maxbits, bit;
+
+	for (p = mask; *p; p++)
+		if (strchr("?*!@", *p))
+			return 0;
+	strlcpy(addr, mask, sizeof(addr));
+	slash = strchr(addr, '/');
+	if (slash)
+	{
+		*slash++ = '\0';
+		if (*slash == '\0')
+			return 0;
+		for (p = slash; *p; p++)
+			if (!isdigit(*p))
+				return 0;
+	}
+
+	memset(key, 0, 16);
+	if (inet_pton(AF_INET, addr, key) == 1)
+	{
+		*family = 0;
+		maxbits = 32;
+	} else
+	if (inet_pton(AF_INET6, addr, key) == 1)
+	{
+		*family = 1;
+		maxbits = 128;
+	} else
+	{
+		return 0;
+	}
+	plen = slash ? atoi(slash) : maxbits;
+	if (plen > maxbits)
+		return 0;
+
+	/* Zero the bits past the prefix so matching is a plain compare */
+	for (bit = plen; bit & 7; bit++)
+		key[bit >> 3] &= ~(0x80 >> (bit & 7));
+	if (bit < maxbits)
+		memset(key + (bit >> 3), 0, (maxbits - bit) >> 3);
+
+	*prefixlen = plen;
+	return 1;
+}
+
+/** Compile the IP/CIDR masks of a block into binary prefixes.
+ * Done lazily on the first lookup after a (re)load of the block.
+ */
+static void webirc_compile_block(ConfigItem_webirc *e)
+{
+	ConfigItem_mask *m;
+
+	e->all_masks_compiled = 1;
+	for (m = e->mask; m; m = m->next)
+	{
+		WebircPrefix *p = safe_alloc(sizeof(WebircPrefix));
+
+		if (!m->mask || !webirc_parse_prefix(m->mask, p->key, &p->prefixlen, &p->family))
+		{
+			safe_free(p);
+			e->all_masks_compiled = 0; /* this one needs unreal_mask_match() */
+			continue;
+		}
+		p->next = e->prefixes;
+		e->prefixes = p;
+	}
+	e->compiled = 1;
+}
+
+/** Does any compiled prefix of 'e' cover the (pre-parsed) client address? */
+static int webirc_prefix_match(ConfigItem_webirc *e, unsigned char *addr, int family)
+{
+	WebircPrefix *p;
+
+	for (p = e->prefixes; p; p = p->next)
+	{
+		unsigned int fullbytes = p->prefixlen >> 3;
+		unsigned int restbits = p->prefixlen & 7;
+
+		if (p->family != family)
+			continue;
+		if (fullbytes && memcmp(p->key, addr, fullbytes))
+			continue;
+		if (restbits &&
+		    ((addr[fullbytes] ^ p->key[fullbytes]) >> (8 - restbits)))
+			continue;
+		return 1;
+	}
+	return 0;
+}
+
 ConfigItem_webirc *find_webirc(Client *client, char *password, WEBIRCType type, char **errorstr)
 {
 	ConfigItem_webirc *e;
 	char *error = NULL;
+	unsigned char addr[16];
+	int family = -1;
+	int match;
+
+	/* Parse the connecting address once, instead of once per mask */
+	memset(addr, 0, sizeof(addr));
+	if (client->ip)
+	{
+		if (inet_pton(AF_INET, client->ip, addr) == 1)
+			family = 0;
+		else if (inet_pton(AF_INET6, client->ip, addr) == 1)
+			family = 1;
+	}
 
 	for (e = conf_webirc; e; e = e->next)
 	{
-		if ((e->type == type) && unreal_mask_match(client, e->mask))
+		if (e->type != type)
+			continue;
+		if (!e->compiled)
+			webirc_compile_block(e);
+		match = (family >= 0) && webirc_prefix_match(e, addr, family);
+		if (!match && !e->all_masks_compiled)
+			match = unreal_mask_match(client, e->mask);
+		if (match)
 		{
 			if (type == WEBIRC_WEBIRC)
 			{
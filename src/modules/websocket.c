@@ -7,8 +7,9 @@
    
 #include "unrealircd.h"
 #include <limits.h>
+#include <zlib.h>
 
-#define WEBSOCKET_VERSION "1.1.0"
+#define WEBSOCKET_VERSION "1.2.0"
 
 ModuleHeader MOD_HEADER
   = {
@@ -31,17 +32,38 @@ typedef struct WebSocketUser WebSocketUser;
 struct WebSocketUser {
 	char get; /**< GET initiated */
 	char handshake_completed; /**< Handshake completed, use websocket frames */
+	char compression; /**< permessage-deflate negotiated (RFC7692) */
 	char *handshake_key; /**< Handshake key (used during handshake) */
 	char *lefttoparse; /**< Leftover buffer to parse */
 	int lefttoparselen; /**< Length of lefttoparse buffer */
+	char *framebuf; /**< Lines held back for frame coalescing (flushed each write cycle) */
+	int framebuflen; /**< Bytes currently held in framebuf */
 };
 
 #define WEBSOCKET_TYPE_BINARY	0x1
 #define WEBSOCKET_TYPE_TEXT	0x2
+#define WEBSOCKET_COMPRESSION	0x4 /* flag in websocket_options, not a type */
+#define WEBSOCKET_COALESCING	0x8 /* flag in websocket_options, not a type */
 
 #define WSU(client)	((WebSocketUser *)moddata_client(client, websocket_md).ptr)
 
-#define WEBSOCKET_TYPE(client)	((client->local && client->local->listener) ? client->local->listener->websocket_options : 0)
+#define WEBSOCKET_TYPE(client)	((client->local && client->local->listener) ? (client->local->listener->websocket_options & 0x3) : 0)
+#define WEBSOCKET_COMPRESSION_ALLOWED(client)	(client->local && client->local->listener && (client->local->listener->websocket_options & WEBSOCKET_COMPRESSION))
+#define WEBSOCKET_COALESCING_ACTIVE(client)	(client->local && client->local->listener && (client->local->listener->websocket_options & WEBSOCKET_COALESCING))
+
+/* Shared zlib contexts for permessage-deflate.
+ * We always negotiate server_no_context_takeover and
+ * client_no_context_takeover, so compression state never persists
+ * between messages and one deflate/inflate context pair (reset after
+ * each message) serves all websocket clients: per-client memory cost
+ * of compression is zero.
+ */
+static z_stream ws_deflate_ctx;
+static z_stream ws_inflate_ctx;
+static char ws_zstreams_active = 0;
+
+/** Only compress messages of at least this size: tiny ones grow */
+#define WEBSOCKET_COMPRESS_THRESHOLD 32
 
 #define WEBSOCKET_MAGIC_KEY "258EAFA5-E914-47DA-95CA-C5AB0DC85B11" /* see RFC6455 */
 
@@ -63,8 +85,14 @@ int websocket_handle_handshake(Client *client, char *readbuf, int *length);
 int websocket_complete_handshake(Client *client);
 int websocket_handle_packet_ping(Client *client, char *buf, int len);
 int websocket_handle_packet_pong(Client *client, char *buf, int len);
-int websocket_create_packet(int opcode, char **buf, int *len);
+int websocket_create_packet(int opcode, char **buf, int *len, int compress);
 int websocket_send_pong(Client *client, char *buf, int len);
+static int websocket_zstreams_init(void);
+static int websocket_decompress(Client *client, char **payload, int *len);
+static int websocket_compress(char *in, int inlen, char *out, int outmax);
+static int websocket_buffer_line(Client *to, char **msg, int *length);
+static void websocket_flush_coalesce(Client *client);
+int websocket_pre_send_queued(Client *client);
 
 /* Global variables */
 ModDataInfo *websocket_md;
@@ -84,6 +112,7 @@ MOD_INIT()
 	HookAdd(modinfo->handle, HOOKTYPE_CONFIGRUN_EX, 0, websocket_config_run_ex);
 	HookAdd(modinfo->handle, HOOKTYPE_PACKET, INT_MAX, websocket_packet_out);
 	HookAdd(modinfo->handle, HOOKTYPE_RAWPACKET_IN, INT_MIN, websocket_packet_in);
+	HookAdd(modinfo->handle, HOOKTYPE_PRE_SEND_QUEUED, 0, websocket_pre_send_queued);
 
 	memset(&mreq, 0, sizeof(mreq));
 	mreq.name = "websocket";
@@ -92,6 +121,7 @@ MOD_INIT()
 	mreq.free = websocket_mdata_free;
 	mreq.sync = 0;
 	mreq.type = MODDATATYPE_CLIENT;
+	mreq.hot = 1; /* looked up on every in/out packet */
 	websocket_md = ModDataAdd(modinfo->handle, mreq);
 
 	return MOD_SUCCESS;
@@ -104,9 +134,38 @@ MOD_LOAD()
 
 MOD_UNLOAD()
 {
+	if (ws_zstreams_active)
+	{
+		deflateEnd(&ws_deflate_ctx);
+		inflateEnd(&ws_inflate_ctx);
+		ws_zstreams_active = 0;
+	}
 	return MOD_SUCCESS;
 }
 
+/** Set up the shared compression contexts, if not done already.
+ * Lazy, and called from both the compress and decompress side, since
+ * after a module reload clients with a negotiated extension still
+ * exist while our static state starts out fresh.
+ */
+static int websocket_zstreams_init(void)
+{
+	if (ws_zstreams_active)
+		return 1;
+	memset(&ws_deflate_ctx, 0, sizeof(ws_deflate_ctx));
+	memset(&ws_inflate_ctx, 0, sizeof(ws_inflate_ctx));
+	/* Raw deflate (negative windowBits), as RFC7692 prescribes */
+	if (deflateInit2(&ws_deflate_ctx, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return 0;
+	if (inflateInit2(&ws_inflate_ctx, -MAX_WBITS) != Z_OK)
+	{
+		deflateEnd(&ws_deflate_ctx);
+		return 0;
+	}
+	ws_zstreams_active = 1;
+	return 1;
+}
+
 #ifndef CheckNull
  #define CheckNull(x) if ((!(x)->ce_vardata) || (!(*((x)->ce_vardata)))) { config_error("%s:%i: missing parameter", (x)->ce_fileptr->cf_filename, (x)->ce_varlinenum); errors++; continue; }
 #endif
@@ -116,6 +175,8 @@ int websocket_config_test(ConfigFile *cf, ConfigEntry *ce, int type, int *errs)
 	int errors = 0;
 	ConfigEntry *cep;
 	int has_type = 0;
+	int has_type_text = 0;
+	int has_coalescing = 0;
 	static char errored_once_nick = 0;
 
 	if (type != CONFIG_LISTEN_OPTIONS)
@@ -133,6 +194,7 @@ int websocket_config_test(ConfigFile *cf, ConfigEntry *ce, int type, int *errs)
 			has_type = 1;
 			if (!strcmp(cep->ce_vardata, "text"))
 			{
+				has_type_text = 1;
 				if (non_utf8_nick_chars_in_use && !errored_once_nick)
 				{
 					/* This one is a hard error, since the consequences are grave */
@@ -156,6 +218,16 @@ int websocket_config_test(ConfigFile *cf, ConfigEntry *ce, int type, int *errs)
 				errors++;
 			}
 		} else
+		if (!strcmp(cep->ce_varname, "compression"))
+		{
+			CheckNull(cep);
+		} else
+		if (!strcmp(cep->ce_varname, "frame-coalescing"))
+		{
+			CheckNull(cep);
+			if (config_checkval(cep->ce_vardata, CFG_YESNO))
+				has_coalescing = 1;
+		} else
 		{
 			config_error("%s:%i: unknown directive listen::options::websocket::%s",
 				cep->ce_fileptr->cf_filename, cep->ce_varlinenum, cep->ce_varname);
@@ -171,6 +243,14 @@ int websocket_config_test(ConfigFile *cf, ConfigEntry *ce, int type, int *errs)
 		errors++;
 	}
 
+	if (has_coalescing && has_type_text)
+	{
+		config_error("%s:%i: listen::options::websocket::frame-coalescing requires type 'binary': "
+		             "with type 'text' every IRC message must be its own websocket frame.",
+			ce->ce_fileptr->cf_filename, ce->ce_varlinenum);
+		errors++;
+	}
+
 	*errs = errors;
 	return errors ? -1 : 1;
 }
@@ -179,6 +259,7 @@ int websocket_config_run_ex(ConfigFile *cf, ConfigEntry *ce, int type, void *ptr
 {
 	ConfigEntry *cep, *cepp;
 	ConfigItem_listen *l;
+	int wsoptions = 0;
 	static char warned_once_channel = 0;
 
 	if (type != CONFIG_LISTEN_OPTIONS)
@@ -195,10 +276,10 @@ int websocket_config_run_ex(ConfigFile *cf, ConfigEntry *ce, int type, void *ptr
 		if (!strcmp(cep->ce_varname, "type"))
 		{
 			if (!strcmp(cep->ce_vardata, "binary"))
-				l->websocket_options = WEBSOCKET_TYPE_BINARY;
+				wsoptions |= WEBSOCKET_TYPE_BINARY;
 			else if (!strcmp(cep->ce_vardata, "text"))
 			{
-				l->websocket_options = WEBSOCKET_TYPE_TEXT;
+				wsoptions |= WEBSOCKET_TYPE_TEXT;
 				if ((tempiConf.allowed_channelchars == ALLOWED_CHANNELCHARS_ANY) && !warned_once_channel)
 				{
 					/* This one is a warning, since the consequences are less grave than with nicks */
@@ -211,7 +292,18 @@ int websocket_config_run_ex(ConfigFile *cf, ConfigEntry *ce, int type, void *ptr
 				}
 			}
 		}
+		else if (!strcmp(cep->ce_varname, "compression"))
+		{
+			if (config_checkval(cep->ce_vardata, CFG_YESNO))
+				wsoptions |= WEBSOCKET_COMPRESSION;
+		}
+		else if (!strcmp(cep->ce_varname, "frame-coalescing"))
+		{
+			if (config_checkval(cep->ce_vardata, CFG_YESNO))
+				wsoptions |= WEBSOCKET_COALESCING;
+		}
 	}
+	l->websocket_options = wsoptions;
 	return 1;
 }
 
@@ -223,6 +315,7 @@ void websocket_mdata_free(ModData *m)
 	{
 		safe_free(wsu->handshake_key);
 		safe_free(wsu->lefttoparse);
+		safe_free(wsu->framebuf);
 		safe_free(m->ptr);
 	}
 }
@@ -235,14 +328,25 @@ int websocket_packet_out(Client *from, Client *to, Client *intended_to, char **m
 	if (MyConnect(to) && WSU(to) && WSU(to)->handshake_completed)
 	{
 		if (WEBSOCKET_TYPE(to) == WEBSOCKET_TYPE_BINARY)
-			websocket_create_packet(WSOP_BINARY, msg, length);
+		{
+			if (WEBSOCKET_COALESCING_ACTIVE(to))
+			{
+				if (*length <= WEBSOCKET_SEND_BUFFER_SIZE)
+					return websocket_buffer_line(to, msg, length);
+				/* Oversized batch: flush held lines first so
+				 * ordering is preserved, then frame normally.
+				 */
+				websocket_flush_coalesce(to);
+			}
+			websocket_create_packet(WSOP_BINARY, msg, length, WSU(to)->compression);
+		}
 		else if (WEBSOCKET_TYPE(to) == WEBSOCKET_TYPE_TEXT)
 		{
 			/* Some more conversions are needed */
 			char *safe_msg = unrl_utf8_make_valid(*msg);
 			*msg = safe_msg;
 			*length = *msg ? strlen(safe_msg) : 0;
-			websocket_create_packet(WSOP_TEXT, msg, length);
+			websocket_create_packet(WSOP_TEXT, msg, length, WSU(to)->compression);
 		}
 		return 0;
 	}
@@ -264,14 +368,22 @@ int websocket_handle_websocket(Client *client, char *readbuf2, int length2)
 		return 0;
 	}
 
-	if (length1 > 0)
+	if (length1 == 0)
+	{
+		/* Common case: no leftover from a previous short read, so we
+		 * can parse (and unmask) straight in the receive buffer
+		 * rather than copying it around first.
+		 */
+		ptr = readbuf2;
+	} else
+	{
 		memcpy(readbuf, WSU(client)->lefttoparse, length1);
-	memcpy(readbuf+length1, readbuf2, length2);
+		memcpy(readbuf+length1, readbuf2, length2);
+		ptr = readbuf;
+	}
 
 	safe_free(WSU(client)->lefttoparse);
 	WSU(client)->lefttoparselen = 0;
-
-	ptr = readbuf;
 	do {
 		n = websocket_handle_packet(client, ptr, length);
 		if (n < 0)
@@ -502,6 +614,21 @@ int websocket_handle_handshake(Client *client, char *readbuf, int *length)
 			}
 			safe_strdup(WSU(client)->handshake_key, value);
 		}
+		else if (!strcasecmp(key, "Sec-WebSocket-Extensions"))
+		{
+			/* Accept a permessage-deflate offer (RFC7692), unless
+			 * the client wants to limit OUR sliding window
+			 * (server_max_window_bits): we always deflate with the
+			 * full window, so then we stay uncompressed instead.
+			 */
+			if (WEBSOCKET_COMPRESSION_ALLOWED(client) &&
+			    strstr(value, "permessage-deflate") &&
+			    !strstr(value, "server_max_window_bits") &&
+			    websocket_zstreams_init())
+			{
+				WSU(client)->compression = 1;
+			}
+		}
 	}
 
 	if (end_of_request)
@@ -549,8 +676,11 @@ int websocket_complete_handshake(Client *client)
 	         "Upgrade: websocket\r\n"
 	         "Connection: Upgrade\r\n"
 	         "Sec-WebSocket-Accept: %s\r\n"
+	         "%s"
 	         "\r\n",
-	         hashbuf);
+	         hashbuf,
+	         WSU(client)->compression ?
+	         "Sec-WebSocket-Extensions: permessage-deflate; server_no_context_takeover; client_no_context_takeover\r\n" : "");
 
 	/* Caution: we bypass sendQ flood checking by doing it this way.
 	 * Risk is minimal, though, as we only permit limited text only
@@ -594,6 +724,8 @@ void add_lf_if_needed(char **buf, int *len)
  */
 int websocket_handle_packet(Client *client, char *readbuf, int length)
 {
+	char fin; /**< Final fragment of the message */
+	char rsv1; /**< RSV1: compressed message (RFC7692) */
 	char opcode; /**< Opcode */
 	char masked; /**< Masked */
 	int len; /**< Length of the packet */
@@ -607,13 +739,35 @@ int websocket_handle_packet(Client *client, char *readbuf, int length)
 		return 0;
 	}
 
-	/* fin    = readbuf[0] & 0x80; -- unused */
-	opcode = readbuf[0] & 0x7F;
+	fin    = readbuf[0] & 0x80;
+	rsv1   = readbuf[0] & 0x40;
+	opcode = readbuf[0] & 0x3F;
 	masked = readbuf[1] & 0x80;
 	len    = readbuf[1] & 0x7F;
 	p = &readbuf[2]; /* point to next element */
 
-	/* actually 'fin' is unused.. we don't care. */
+	if (rsv1)
+	{
+		if (!WSU(client)->compression ||
+		    ((opcode != WSOP_TEXT) && (opcode != WSOP_BINARY)))
+		{
+			/* RSV1 without negotiated extension, or on a control
+			 * frame, is a protocol violation (RFC7692 p17).
+			 */
+			dead_socket(client, "WebSocket protocol violation (unexpected RSV1)");
+			return -1;
+		}
+		if (!fin)
+		{
+			/* We process frame-by-frame and never buffer up a
+			 * fragmented message, which is incompatible with
+			 * decompressing one. No known client fragments the
+			 * tiny messages IRC deals in.
+			 */
+			dead_socket(client, "WebSocket: fragmented compressed message not supported");
+			return -1;
+		}
+	}
 
 	if (!masked)
 	{
@@ -664,14 +818,32 @@ int websocket_handle_packet(Client *client, char *readbuf, int length)
 
 	if (len > 0)
 	{
-		/* Unmask this thing (page 33, section 5.3) */
-		int n;
-		char v;
-		for (n = 0; n < len; n++)
+		/* Unmask this thing (page 33, section 5.3).
+		 * Done in 8 byte lanes where possible: the 4 byte mask key
+		 * repeated twice XORed over one 64 bit word at a time.
+		 * The memcpy's are for alignment and are optimized away.
+		 */
+		int n = 0;
+		if (len >= 8)
 		{
-			v = *p;
-			*p++ = v ^ maskkey[n % 4];
+			uint64_t mask64;
+			char maskkey2[8];
+			memcpy(maskkey2, maskkey, 4);
+			memcpy(maskkey2+4, maskkey, 4);
+			memcpy(&mask64, maskkey2, 8);
+			for (; n <= len-8; n += 8)
+			{
+				uint64_t v;
+				memcpy(&v, p+n, 8);
+				v ^= mask64;
+				memcpy(p+n, &v, 8);
+			}
 		}
+		/* The remaining (up to 7) bytes. Note that 'n' advanced in
+		 * multiples of 8 so 'n % 4' is still in phase with the key.
+		 */
+		for (; n < len; n++)
+			p[n] ^= maskkey[n % 4];
 	}
 
 	switch(opcode)
@@ -681,6 +853,8 @@ int websocket_handle_packet(Client *client, char *readbuf, int length)
 		case WSOP_BINARY:
 			if (len > 0)
 			{
+				if (rsv1 && !websocket_decompress(client, &payload, &len))
+					return -1; /* error, client has been killed */
 				add_lf_if_needed(&payload, &len);
 				if (!process_packet(client, payload, len, 1)) /* let UnrealIRCd process this data */
 					return -1; /* fatal error occured (such as flood kill) */
@@ -709,6 +883,193 @@ int websocket_handle_packet(Client *client, char *readbuf, int length)
 	return -1; /* NOTREACHED */
 }
 
+/** Decompress one complete permessage-deflate message (RFC7692).
+ * On success 'payload' and 'len' are replaced by the decompressed data
+ * (valid until the next call). On failure the client has been killed.
+ */
+static int websocket_decompress(Client *client, char **payload, int *len)
+{
+	static char decompressbuf[16384];
+	static char deflate_tail[4] = { 0x00, 0x00, 0xff, 0xff };
+	int r, outlen;
+
+	if (!websocket_zstreams_init())
+	{
+		dead_socket(client, "WebSocket: decompression unavailable");
+		return 0;
+	}
+
+	/* The sender stripped the trailing 0x00 0x00 0xff 0xff of the
+	 * final deflate block, so inflate the payload and then that tail.
+	 */
+	ws_inflate_ctx.next_in = (Bytef *)*payload;
+	ws_inflate_ctx.avail_in = *len;
+	ws_inflate_ctx.next_out = (Bytef *)decompressbuf;
+	ws_inflate_ctx.avail_out = sizeof(decompressbuf);
+	r = inflate(&ws_inflate_ctx, Z_NO_FLUSH);
+	if ((r == Z_OK) || (r == Z_BUF_ERROR))
+	{
+		ws_inflate_ctx.next_in = (Bytef *)deflate_tail;
+		ws_inflate_ctx.avail_in = sizeof(deflate_tail);
+		r = inflate(&ws_inflate_ctx, Z_SYNC_FLUSH);
+	}
+	outlen = sizeof(decompressbuf) - ws_inflate_ctx.avail_out;
+	if ((r != Z_OK) && (r != Z_STREAM_END) && (r != Z_BUF_ERROR))
+	{
+		inflateReset(&ws_inflate_ctx);
+		dead_socket(client, "WebSocket: compressed message corrupt");
+		return 0;
+	}
+	if (ws_inflate_ctx.avail_out == 0)
+	{
+		/* More decompressed data than any sane IRC client sends */
+		inflateReset(&ws_inflate_ctx);
+		dead_socket(client, "WebSocket: decompressed message too large");
+		return 0;
+	}
+	inflateReset(&ws_inflate_ctx); /* no_context_takeover: every message starts fresh */
+
+	*payload = decompressbuf;
+	*len = outlen;
+	return 1;
+}
+
+/** Compress one message payload (RFC7692).
+ * @returns The compressed length, or -1 if compression failed or did
+ *          not make the payload any smaller.
+ */
+static int websocket_compress(char *in, int inlen, char *out, int outmax)
+{
+	int r, outlen;
+
+	if (!websocket_zstreams_init())
+		return -1;
+
+	ws_deflate_ctx.next_in = (Bytef *)in;
+	ws_deflate_ctx.avail_in = inlen;
+	ws_deflate_ctx.next_out = (Bytef *)out;
+	ws_deflate_ctx.avail_out = outmax;
+	r = deflate(&ws_deflate_ctx, Z_SYNC_FLUSH);
+	outlen = outmax - ws_deflate_ctx.avail_out;
+	if ((r != Z_OK) || (ws_deflate_ctx.avail_in > 0) || (outlen < 4))
+	{
+		deflateReset(&ws_deflate_ctx);
+		return -1; /* didn't fit - send uncompressed instead */
+	}
+	deflateReset(&ws_deflate_ctx); /* no_context_takeover: every message starts fresh */
+
+	/* Strip the trailing 0x00 0x00 0xff 0xff of the final block,
+	 * the receiver re-adds it (RFC7692 p19).
+	 */
+	outlen -= 4;
+	if (outlen >= inlen)
+		return -1; /* compression did not help */
+	return outlen;
+}
+
+/** Hold back one outgoing line for frame coalescing (binary mode).
+ * The line - including its CR+LF, so the stream stays self-delimiting -
+ * is appended to the per-client holding buffer, which is turned into
+ * one large frame per write cycle by websocket_pre_send_queued().
+ */
+static int websocket_buffer_line(Client *to, char **msg, int *length)
+{
+	WebSocketUser *wsu = WSU(to);
+
+	if (*length <= 0)
+		return 0;
+
+	if (!wsu->framebuf)
+	{
+		/* Allocated on first use and kept for the lifetime of the
+		 * session: clients are bursty, a buffer that was needed once
+		 * will be needed again.
+		 */
+		wsu->framebuf = safe_alloc(WEBSOCKET_SEND_BUFFER_SIZE);
+	}
+
+	if (wsu->framebuflen + *length > WEBSOCKET_SEND_BUFFER_SIZE)
+	{
+		/* Buffer full: emit what we have as a frame and start over */
+		websocket_flush_coalesce(to);
+		if (IsDeadSocket(to))
+			return 0;
+	}
+
+	memcpy(wsu->framebuf + wsu->framebuflen, *msg, *length);
+	wsu->framebuflen += *length;
+	*msg = NULL; /* swallowed: emitted as a frame at flush time */
+	mark_data_to_send(to);
+	return 0;
+}
+
+/** Turn the held-back lines of 'client' into a single websocket frame
+ * and queue it. Kills the client on sendq overflow.
+ */
+static void websocket_flush_coalesce(Client *client)
+{
+	static char compressbuf[WEBSOCKET_SEND_BUFFER_SIZE];
+	WebSocketUser *wsu = WSU(client);
+	char *payload;
+	int payload_len;
+	char hdr[4];
+	int hdrlen;
+	char rsv1 = 0;
+
+	if (!wsu || !wsu->framebuf || (wsu->framebuflen == 0))
+		return;
+
+	payload = wsu->framebuf;
+	payload_len = wsu->framebuflen;
+	wsu->framebuflen = 0;
+
+	if (DBufLength(&client->local->sendQ) > get_sendq(client))
+	{
+		dead_socket(client, "Max SendQ exceeded");
+		return;
+	}
+
+	/* One deflate over the whole batch compresses far better than
+	 * the same lines compressed message-by-message.
+	 */
+	if (wsu->compression && (payload_len >= WEBSOCKET_COMPRESS_THRESHOLD))
+	{
+		int n = websocket_compress(payload, payload_len, compressbuf, sizeof(compressbuf));
+		if (n > 0)
+		{
+			payload = compressbuf;
+			payload_len = n;
+			rsv1 = 0x40;
+		}
+	}
+
+	hdr[0] = WSOP_BINARY | 0x80 | rsv1; /* opcode & final (& compressed) */
+	if (payload_len < 126)
+	{
+		hdr[1] = (char)payload_len;
+		hdrlen = 2;
+	} else {
+		hdr[1] = 126;
+		hdr[2] = (char)((payload_len >> 8) & 0xFF);
+		hdr[3] = (char)(payload_len & 0xFF);
+		hdrlen = 4;
+	}
+
+	dbuf_put(&client->local->sendQ, hdr, hdrlen);
+	dbuf_put(&client->local->sendQ, payload, payload_len);
+}
+
+/** HOOKTYPE_PRE_SEND_QUEUED hook: called just before queued data is
+ * written out, once per client per flush cycle. All lines held back
+ * since the previous cycle leave as one frame.
+ */
+int websocket_pre_send_queued(Client *client)
+{
+	if (WSU(client) && WSU(client)->handshake_completed)
+		websocket_flush_coalesce(client);
+	return 0;
+}
+
 int websocket_handle_packet_ping(Client *client, char *buf, int len)
 {
 	if (len > 500)
@@ -766,9 +1127,10 @@ int websocket_create_packet_simple(int opcode, char **buf, int *len)
  * The end result is one or more websocket frames,
  * all in a single packet *buf with size *len.
  */
-int websocket_create_packet(int opcode, char **buf, int *len)
+int websocket_create_packet(int opcode, char **buf, int *len, int compress)
 {
 	static char sendbuf[WEBSOCKET_SEND_BUFFER_SIZE];
+	static char compressbuf[WEBSOCKET_SEND_BUFFER_SIZE];
 	char *s = *buf; /* points to start of current line */
 	char *s2; /* used for searching of end of current line */
 	char *lastbyte = *buf + *len - 1; /* points to last byte in *buf that can be safely read */
@@ -783,6 +1145,10 @@ int websocket_create_packet(int opcode, char **buf, int *len)
 		return -1;
 
 	do {
+		char rsv1 = 0;
+		char *payload;
+		int payload_len;
+
 		/* Find next \r or \n */
 		for (s2 = s; *s2 && (s2 <= lastbyte); s2++)
 		{
@@ -795,10 +1161,27 @@ int websocket_create_packet(int opcode, char **buf, int *len)
 		 */
 		bytes_to_copy = s2 - s;
 
-		if (bytes_to_copy < 126)
-			bytes_single_frame = 2 + bytes_to_copy;
+		payload = s;
+		payload_len = bytes_to_copy;
+		if (compress && (bytes_to_copy >= WEBSOCKET_COMPRESS_THRESHOLD))
+		{
+			/* Each line is its own websocket message, so per-message
+			 * deflate applies per line here. Falls back to sending
+			 * uncompressed if compression would not gain anything.
+			 */
+			int n = websocket_compress(s, bytes_to_copy, compressbuf, sizeof(compressbuf));
+			if (n > 0)
+			{
+				payload = compressbuf;
+				payload_len = n;
+				rsv1 = 0x40;
+			}
+		}
+
+		if (payload_len < 126)
+			bytes_single_frame = 2 + payload_len;
 		else
-			bytes_single_frame = 4 + bytes_to_copy;
+			bytes_single_frame = 4 + payload_len;
 
 		if (bytes_in_sendbuf + bytes_single_frame > sizeof(sendbuf))
 		{
@@ -809,19 +1192,19 @@ int websocket_create_packet(int opcode, char **buf, int *len)
 		}
 
 		/* Create the new frame */
-		o[0] = opcode | 0x80; /* opcode & final */
+		o[0] = opcode | 0x80 | rsv1; /* opcode & final (& compressed) */
 
-		if (bytes_to_copy < 126)
+		if (payload_len < 126)
 		{
 			/* Short payload */
-			o[1] = (char)bytes_to_copy;
-			memcpy(&o[2], s, bytes_to_copy);
+			o[1] = (char)payload_len;
+			memcpy(&o[2], payload, payload_len);
 		} else {
 			/* Long payload */
 			o[1] = 126;
-			o[2] = (char)((bytes_to_copy >> 8) & 0xFF);
-			o[3] = (char)(bytes_to_copy & 0xFF);
-			memcpy(&o[4], s, bytes_to_copy);
+			o[2] = (char)((payload_len >> 8) & 0xFF);
+			o[3] = (char)(payload_len & 0xFF);
+			memcpy(&o[4], payload, payload_len);
 		}
 
 		/* Advance destination pointer and counter */
@@ -329,14 +329,11 @@ int i = 1;
 
 					while (*s)
 					{
-					int i;
-						for (i = 0; i <= Usermode_highest; i++)
-							if (*s == Usermode_Table[i].flag)
-							{
-								*umodes |= Usermode_Table[i].mode;
-								break;
-							}
-					s++;
+						Umode *um = find_usermode(*s);
+
+						if (um)
+							*umodes |= um->mode;
+						s++;
 					}
 
 					if (!IsOper(client))
@@ -682,17 +679,21 @@ int oper = IsOper(client);
 	if (strchr(mask, '*') || strchr(mask, '?'))
 	{
 		int i = 0;
-		/* go through all users.. */
+		int slot;
+		/* go through all users.. via the dense mirror of client_list,
+		 * so this full scan is a linear read instead of a pointer chase.
+		 */
 		Client *acptr;
 		who_flags |= WF_WILDCARD;
 
-		list_for_each_entry(acptr, &client_list, client_node)
+		for (slot = 0; slot < client_array.count; slot++)
 		{
 		int cansee;
 		char status[20];
 		char *channel;
 		int flg;
 
+			acptr = client_array.items[slot];
 			if (!IsUser(acptr))
 				continue;
 			if (!oper) {
@@ -35,11 +35,54 @@ ModuleHeader MOD_HEADER
 	"unrealircd-5",
     };
 
+/* WHOIS channel list cache.
+ * The RPL_WHOISCHANNELS segment is by far the most expensive part of a
+ * WHOIS reply: it walks the target's memberships with visibility rules
+ * and access lookups per channel. Services bots WHOIS at high rates, so
+ * the rendered payload is kept on the target client and re-served until
+ * the target's membership fingerprint (see whois_chans_generation)
+ * moves. The output is only viewer independent when no module hooks
+ * into HOOKTYPE_SEE_CHANNEL_IN_WHOIS and all of the target's channels
+ * are public; in all other cases we fall back to a direct render.
+ */
+#define WHOISCHANS_CACHE_VARIANTS 2	/* bit 0 = multi-prefix */
+
+typedef struct WhoisChansCache WhoisChansCache;
+struct WhoisChansCache {
+	unsigned int generation[WHOISCHANS_CACHE_VARIANTS];	/**< membership fingerprint the variant was rendered at (0 = never) */
+	MultiLine *lines[WHOISCHANS_CACHE_VARIANTS];		/**< rendered payloads. NULL with a current generation means the
+								     output was viewer dependent and cannot be served from cache. */
+};
+
+/* Global variables */
+ModDataInfo *whoischans_md = NULL;
+
+/* Macros */
+#define WHOISCHANSCACHE(client)	((WhoisChansCache *)moddata_client(client, whoischans_md).ptr)
+
+/* Forward declarations */
+static int whois_channels_render(Client *client, Client *target, char *name, int multiprefix, MultiLine **cache);
+void whoischans_md_free(ModData *md);
+
 /* This is called on module init, before Server Ready */
 MOD_INIT()
 {
-	CommandAdd(modinfo->handle, MSG_WHOIS, cmd_whois, MAXPARA, CMD_USER);
+	ModDataInfo mreq;
+
 	MARK_AS_OFFICIAL_MODULE(modinfo);
+
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.name = "whoischans";
+	mreq.type = MODDATATYPE_CLIENT;
+	mreq.free = whoischans_md_free;
+	whoischans_md = ModDataAdd(modinfo->handle, mreq);
+	if (!whoischans_md)
+	{
+		config_error("could not register whoischans moddata");
+		return MOD_FAILED;
+	}
+
+	CommandAdd(modinfo->handle, MSG_WHOIS, cmd_whois, MAXPARA, CMD_USER);
 	return MOD_SUCCESS;
 }
 
@@ -56,18 +99,200 @@ MOD_UNLOAD()
 }
 
 
+/** Fingerprint of everything the RPL_WHOISCHANNELS payload can depend
+ * on: the membership set itself (joins and parts bump the user's
+ * acl_generation) and, mixed in per channel, the channel generation
+ * (bumped on mode and member access changes). A quick pointer walk,
+ * no string work or access lookups.
+ */
+static unsigned int whois_chans_generation(Client *target)
+{
+	Membership *lp;
+	unsigned int gen = target->user->acl_generation;
+
+	for (lp = target->user->channel; lp; lp = lp->next)
+		gen = (gen << 5) + gen + lp->channel->acl_generation;
+	return gen;
+}
+
+/* Renders the RPL_WHOISCHANNELS payload(s) for a target.
+ * If 'cache' is NULL the lines are sent to 'client' directly, applying
+ * the viewer dependent visibility rules. Otherwise the lines are
+ * appended to '*cache' with no viewer filters applied; this returns 0
+ * (with '*cache' freed) if such a render is not possible because the
+ * target is in a non-public channel. The caller must ensure no
+ * HOOKTYPE_SEE_CHANNEL_IN_WHOIS hooks exist before rendering to cache.
+ */
+static int whois_channels_render(Client *client, Client *target, char *name, int multiprefix, MultiLine **cache)
+{
+	Membership *lp;
+	Channel *channel;
+	int len, mlen;
+	unsigned char showchannel;
+
+	/* For a cached render the viewer's nick is unknown, reserve the maximum */
+	mlen = strlen(me.name) + (cache ? NICKLEN : strlen(client->name)) + 10 + strlen(name);
+	for (len = 0, *buf = '\0', lp = target->user->channel; lp; lp = lp->next)
+	{
+		Hook *h;
+		int ret = EX_ALLOW;
+		int operoverride = 0;
+
+		channel = lp->channel;
+		showchannel = 0;
+
+		if (cache)
+		{
+			/* Non-public channels are hidden from some viewers
+			 * and shown to others, so the rendering is viewer
+			 * dependent and cannot be cached.
+			 */
+			if (!PubChannel(channel))
+			{
+				safe_free_multiline(*cache);
+				return 0;
+			}
+			showchannel = 1;
+		} else
+		{
+			if (ShowChannel(client, channel))
+				showchannel = 1;
+
+			for (h = Hooks[HOOKTYPE_SEE_CHANNEL_IN_WHOIS]; h; h = h->next)
+			{
+				int n = (*(h->func.intfunc))(client, target, channel);
+				/* Hook return values:
+				 * EX_ALLOW means 'yes is ok, as far as modules are concerned'
+				 * EX_DENY means 'hide this channel, unless oper overriding'
+				 * EX_ALWAYS_DENY means 'hide this channel, always'
+				 * ... with the exception that we always show the channel if you /WHOIS yourself
+				 */
+				if (n == EX_DENY)
+				{
+					ret = EX_DENY;
+				}
+				else if (n == EX_ALWAYS_DENY)
+				{
+					ret = EX_ALWAYS_DENY;
+					break;
+				}
+			}
+
+			if (ret == EX_DENY)
+				showchannel = 0;
+
+			if (!showchannel && (ValidatePermissionsForPath("channel:see:whois",client,NULL,channel,NULL)))
+			{
+				showchannel = 1; /* OperOverride */
+				operoverride = 1;
+			}
+
+			if ((ret == EX_ALWAYS_DENY) && (target != client))
+				continue; /* a module asked us to really not expose this channel, so we don't (except target==ourselves). */
+
+			if (target == client)
+				showchannel = 1;
+		}
+
+		if (showchannel)
+		{
+			long access;
+			if (len + channel->chnamelen > (size_t)BUFSIZE - 4 - mlen)
+			{
+				if (cache)
+				{
+					addmultiline(cache, buf);
+				} else
+				{
+					sendto_one(client, NULL,
+					    ":%s %d %s %s :%s",
+					    me.name,
+					    RPL_WHOISCHANNELS,
+					    client->name, name, buf);
+				}
+				*buf = '\0';
+				len = 0;
+			}
+
+			if (operoverride)
+			{
+				/* '?' and '!' both mean we can see the channel in /WHOIS and normally wouldn't,
+				 * but there's still a slight difference between the two...
+				 */
+				if (!PubChannel(channel))
+				{
+					/* '?' means it's a secret/private channel (too) */
+					*(buf + len++) = '?';
+				}
+				else
+				{
+					/* public channel but hidden in WHOIS (umode +p, service bot, etc) */
+					*(buf + len++) = '!';
+				}
+			}
+
+			access = get_access(target, channel);
+			if (!multiprefix)
+			{
+#ifdef PREFIX_AQ
+				if (access & CHFL_CHANOWNER)
+					*(buf + len++) = '~';
+				else if (access & CHFL_CHANADMIN)
+					*(buf + len++) = '&';
+				else
+#endif
+				if (access & CHFL_CHANOP)
+					*(buf + len++) = '@';
+				else if (access & CHFL_HALFOP)
+					*(buf + len++) = '%';
+				else if (access & CHFL_VOICE)
+					*(buf + len++) = '+';
+			}
+			else
+			{
+#ifdef PREFIX_AQ
+				if (access & CHFL_CHANOWNER)
+					*(buf + len++) = '~';
+				if (access & CHFL_CHANADMIN)
+					*(buf + len++) = '&';
+#endif
+				if (access & CHFL_CHANOP)
+					*(buf + len++) = '@';
+				if (access & CHFL_HALFOP)
+					*(buf + len++) = '%';
+				if (access & CHFL_VOICE)
+					*(buf + len++) = '+';
+			}
+			if (len)
+				*(buf + len) = '\0';
+			strcpy(buf + len, channel->chname);
+			len += channel->chnamelen;
+			strcat(buf + len, " ");
+			len++;
+		}
+	}
+
+	if (buf[0] != '\0')
+	{
+		if (cache)
+			addmultiline(cache, buf);
+		else
+			sendnumeric(client, RPL_WHOISCHANNELS, name, buf);
+	}
+
+	return 1;
+}
+
 /*
 ** cmd_whois
 **	parv[1] = nickname masklist
 */
 CMD_FUNC(cmd_whois)
 {
-	Membership *lp;
 	Client *target;
-	Channel *channel;
 	char *nick, *tmp, *name;
 	char *p = NULL;
-	int  found, len, mlen;
+	int  found, multiprefix, served;
 	char querybuf[BUFSIZE];
 	int ntargets = 0;
 	int maxtargets = max_targets_for_command("WHOIS");
@@ -89,7 +314,7 @@ CMD_FUNC(cmd_whois)
 
 	for (tmp = canonize(parv[1]); (nick = strtoken(&p, tmp, ",")); tmp = NULL)
 	{
-		unsigned char showchannel, wilds, hideoper; /* <- these are all boolean-alike */
+		unsigned char wilds, hideoper; /* <- these are all boolean-alike */
 
 		if (MyUser(client) && (++ntargets > maxtargets))
 		{
@@ -152,128 +377,40 @@ CMD_FUNC(cmd_whois)
 				sendnumeric(client, RPL_WHOISREGNICK, name);
 			
 			found = 1;
-			mlen = strlen(me.name) + strlen(client->name) + 10 + strlen(name);
-			for (len = 0, *buf = '\0', lp = target->user->channel; lp; lp = lp->next)
+			multiprefix = (MyUser(client) && HasCapability(client, "multi-prefix"));
+			served = 0;
+			/* Serve the channel list from the cache on the target
+			 * when the output is viewer independent, rendering it
+			 * if needed (see whois_channels_render).
+			 */
+			if (!Hooks[HOOKTYPE_SEE_CHANNEL_IN_WHOIS])
 			{
-				Hook *h;
-				int ret = EX_ALLOW;
-				int operoverride = 0;
-				
-				channel = lp->channel;
-				showchannel = 0;
+				WhoisChansCache *wc = WHOISCHANSCACHE(target);
+				unsigned int generation = whois_chans_generation(target);
+				int variant = multiprefix ? 1 : 0;
 
-				if (ShowChannel(client, channel))
-					showchannel = 1;
-
-				for (h = Hooks[HOOKTYPE_SEE_CHANNEL_IN_WHOIS]; h; h = h->next)
+				if (!wc)
 				{
-					int n = (*(h->func.intfunc))(client, target, channel);
-					/* Hook return values:
-					 * EX_ALLOW means 'yes is ok, as far as modules are concerned'
-					 * EX_DENY means 'hide this channel, unless oper overriding'
-					 * EX_ALWAYS_DENY means 'hide this channel, always'
-					 * ... with the exception that we always show the channel if you /WHOIS yourself
-					 */
-					if (n == EX_DENY)
-					{
-						ret = EX_DENY;
-					}
-					else if (n == EX_ALWAYS_DENY)
-					{
-						ret = EX_ALWAYS_DENY;
-						break;
-					}
+					wc = safe_alloc(sizeof(WhoisChansCache));
+					moddata_client(target, whoischans_md).ptr = wc;
 				}
-				
-				if (ret == EX_DENY)
-					showchannel = 0;
-				
-				if (!showchannel && (ValidatePermissionsForPath("channel:see:whois",client,NULL,channel,NULL)))
+				if (wc->generation[variant] != generation)
 				{
-					showchannel = 1; /* OperOverride */
-					operoverride = 1;
+					safe_free_multiline(wc->lines[variant]);
+					wc->generation[variant] = generation;
+					whois_channels_render(NULL, target, name, multiprefix, &wc->lines[variant]);
 				}
-				
-				if ((ret == EX_ALWAYS_DENY) && (target != client))
-					continue; /* a module asked us to really not expose this channel, so we don't (except target==ourselves). */
-
-				if (target == client)
-					showchannel = 1;
-
-				if (showchannel)
+				if (wc->lines[variant])
 				{
-					long access;
-					if (len + strlen(channel->chname) > (size_t)BUFSIZE - 4 - mlen)
-					{
-						sendto_one(client, NULL,
-						    ":%s %d %s %s :%s",
-						    me.name,
-						    RPL_WHOISCHANNELS,
-						    client->name, name, buf);
-						*buf = '\0';
-						len = 0;
-					}
-
-					if (operoverride)
-					{
-						/* '?' and '!' both mean we can see the channel in /WHOIS and normally wouldn't,
-						 * but there's still a slight difference between the two...
-						 */
-						if (!PubChannel(channel))
-						{
-							/* '?' means it's a secret/private channel (too) */
-							*(buf + len++) = '?';
-						}
-						else
-						{
-							/* public channel but hidden in WHOIS (umode +p, service bot, etc) */
-							*(buf + len++) = '!';
-						}
-					}
-
-					access = get_access(target, channel);
-					if (!MyUser(client) || !HasCapability(client, "multi-prefix"))
-					{
-#ifdef PREFIX_AQ
-						if (access & CHFL_CHANOWNER)
-							*(buf + len++) = '~';
-						else if (access & CHFL_CHANADMIN)
-							*(buf + len++) = '&';
-						else
-#endif
-						if (access & CHFL_CHANOP)
-							*(buf + len++) = '@';
-						else if (access & CHFL_HALFOP)
-							*(buf + len++) = '%';
-						else if (access & CHFL_VOICE)
-							*(buf + len++) = '+';
-					}
-					else
-					{
-#ifdef PREFIX_AQ
-						if (access & CHFL_CHANOWNER)
-							*(buf + len++) = '~';
-						if (access & CHFL_CHANADMIN)
-							*(buf + len++) = '&';
-#endif
-						if (access & CHFL_CHANOP)
-							*(buf + len++) = '@';
-						if (access & CHFL_HALFOP)
-							*(buf + len++) = '%';
-						if (access & CHFL_VOICE)
-							*(buf + len++) = '+';
-					}
-					if (len)
-						*(buf + len) = '\0';
-					strcpy(buf + len, channel->chname);
-					len += strlen(channel->chname);
-					strcat(buf + len, " ");
-					len++;
+					MultiLine *m;
+					for (m = wc->lines[variant]; m; m = m->next)
+						sendnumeric(client, RPL_WHOISCHANNELS, name, m->line);
+					served = 1;
 				}
+				/* Output is viewer dependent: fall through to a direct render */
 			}
-
-			if (buf[0] != '\0')
-				sendnumeric(client, RPL_WHOISCHANNELS, name, buf); 
+			if (!served)
+				whois_channels_render(client, target, name, multiprefix, NULL);
 
                         if (!(IsULine(target) && !IsOper(client) && HIDE_ULINES))
 				sendnumeric(client, RPL_WHOISSERVER, name, target->user->server,
@@ -353,3 +490,18 @@ CMD_FUNC(cmd_whois)
 	}
 	sendnumeric(client, RPL_ENDOFWHOIS, querybuf);
 }
+
+/** Called when the client is freed: free the cached WHOIS channel list */
+void whoischans_md_free(ModData *md)
+{
+	WhoisChansCache *wc = (WhoisChansCache *)md->ptr;
+	int i;
+
+	if (!wc)
+		return;
+
+	for (i = 0; i < WHOISCHANS_CACHE_VARIANTS; i++)
+		safe_free_multiline(wc->lines[i]);
+
+	safe_free(md->ptr);
+}
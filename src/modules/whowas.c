@@ -55,10 +55,78 @@ MOD_UNLOAD()
 /* externally defined functions */
 extern aWhowas MODVAR WHOWAS[NICKNAMEHISTORYLENGTH];
 extern aWhowas MODVAR *WHOWASHASH[WHOWAS_HASH_TABLE_SIZE];
+extern aWhowas MODVAR *WHOWAS_IP_HASH[WHOWAS_HASH_TABLE_SIZE];
+extern aWhowas MODVAR *WHOWAS_ACCOUNT_HASH[WHOWAS_HASH_TABLE_SIZE];
+
+/** Send the standard WHOWAS reply lines for one history entry */
+static void send_whowas_entry(Client *client, aWhowas *temp)
+{
+	sendnumeric(client, RPL_WHOWASUSER, temp->name,
+	    temp->username,
+	    (IsOper(client) ? temp->hostname :
+	    (*temp->virthost !=
+	    '\0') ? temp->virthost : temp->hostname),
+	    temp->realname);
+	if (!((find_uline(temp->servername)) && !IsOper(client) && HIDE_ULINES))
+		sendnumeric(client, RPL_WHOISSERVER, temp->name, temp->servername,
+		    myctime(temp->logoff));
+}
+
+/** Extended WHOWAS query: list history entries by IP or account.
+ * Syntax: WHOWAS ~i:<ip> and WHOWAS ~a:<account>
+ * IRCOp-only, this is meant for abuse handling and the IP/account
+ * indexes hold information that regular users should not see.
+ */
+static void whowas_extended_query(Client *client, char *query, int max)
+{
+	aWhowas *temp;
+	char *name = query + 3;
+	int cur = 0, found = 0;
+
+	if (!IsOper(client))
+	{
+		sendnumeric(client, ERR_NOPRIVILEGES);
+		return;
+	}
+
+	if (query[1] == 'i')
+	{
+		for (temp = WHOWAS_IP_HASH[hash_whowas_ip(name)]; temp; temp = temp->ip_next)
+		{
+			if (!strcmp(name, temp->ip))
+			{
+				send_whowas_entry(client, temp);
+				cur++;
+				found++;
+			}
+			if (max > 0 && cur >= max)
+				break;
+		}
+	} else {
+		for (temp = WHOWAS_ACCOUNT_HASH[hash_whowas_account(name)]; temp; temp = temp->account_next)
+		{
+			if (!mycmp(name, temp->account))
+			{
+				send_whowas_entry(client, temp);
+				cur++;
+				found++;
+			}
+			if (max > 0 && cur >= max)
+				break;
+		}
+	}
+
+	if (!found)
+		sendnumeric(client, ERR_WASNOSUCHNICK, query);
+
+	sendnumeric(client, RPL_ENDOFWHOWAS, query);
+}
 
 /*
 ** cmd_whowas
-**      parv[1] = nickname queried
+**      parv[1] = nickname queried, or (IRCOps only):
+**                ~i:<ip>      - query history by IP address
+**                ~a:<account> - query history by services account
 */
 CMD_FUNC(cmd_whowas)
 {
@@ -81,6 +149,14 @@ CMD_FUNC(cmd_whowas)
 	if (!MyConnect(client) && (max > 20))
 		max = 20;
 
+	if ((parv[1][0] == '~') &&
+	    ((parv[1][1] == 'i') || (parv[1][1] == 'a')) &&
+	    (parv[1][2] == ':') && parv[1][3])
+	{
+		whowas_extended_query(client, parv[1], max);
+		return;
+	}
+
 	p = strchr(parv[1], ',');
 	if (p)
 		*p = '\0';
@@ -91,15 +167,7 @@ CMD_FUNC(cmd_whowas)
 	{
 		if (!mycmp(nick, temp->name))
 		{
-			sendnumeric(client, RPL_WHOWASUSER, temp->name,
-			    temp->username,
-			    (IsOper(client) ? temp->hostname :
-			    (*temp->virthost !=
-			    '\0') ? temp->virthost : temp->hostname),
-			    temp->realname);
-                	if (!((find_uline(temp->servername)) && !IsOper(client) && HIDE_ULINES))
-				sendnumeric(client, RPL_WHOISSERVER, temp->name, temp->servername,
-				    myctime(temp->logoff));
+			send_whowas_entry(client, temp);
 			cur++;
 			found++;
 		}
@@ -314,13 +314,11 @@ CMD_FUNC(cmd_whox)
 			else
 				umodes = &fmt.noumodes;
 
-			for (i = 0; i <= Usermode_highest; i++)
 			{
-				if (*s == Usermode_Table[i].flag)
-				{
-					*umodes |= Usermode_Table[i].mode;
-					break;
-				}
+				Umode *um = find_usermode(*s);
+
+				if (um)
+					*umodes |= um->mode;
 			}
 			s++;
 		}
@@ -520,6 +518,58 @@ static void who_common_channel(Client *client, Channel *channel,
  *			  and will be left cleared on return
  */
 
+/* who_global_visible
+ * The per-client body of the global listing pass of who_global().
+ * Applies the visibility rules and lists the client if it matches.
+ * Marks the client as processed, so index-assisted lookups that visit
+ * a client through several indexes list it only once.
+ */
+static void who_global_visible(Client *client, Client *acptr, char *mask,
+	int operspy, Client *hunted, int *maxmatches, struct who_format *fmt)
+{
+	if (!IsUser(acptr))
+		return;
+
+	if (IsMarked(acptr))
+		return;
+
+	SetMark(acptr);
+
+	if (IsInvisible(acptr) && !operspy && (client != acptr) && (acptr != hunted))
+		return;
+
+	if (IsMatch(fmt, WMATCH_OPER) && !IsOper(acptr))
+		return;
+
+	if (*maxmatches > 0)
+	{
+		if (do_match(client, acptr, mask, fmt))
+		{
+			do_who(client, acptr, NULL, fmt);
+			--(*maxmatches);
+		}
+	}
+}
+
+/** May the WHO index be used for this query? Only if the mask is an
+ * exact (wildcard-free) term and every selected match category is an
+ * indexed one, so we cannot miss matches the full scan would find.
+ * IP is excluded for masks with CIDR or IPv6 notation: those can match
+ * addresses under a different textual form than the lookup key.
+ */
+static int who_can_use_index(char *mask, struct who_format *fmt)
+{
+	if (!mask || !*mask || strpbrk(mask, "*?"))
+		return 0;
+	if (!fmt->matchsel || (fmt->matchsel & ~(WMATCH_ACCOUNT|WMATCH_IP|WMATCH_HOST|WMATCH_OPER)))
+		return 0;
+	if (!(fmt->matchsel & (WMATCH_ACCOUNT|WMATCH_IP|WMATCH_HOST)))
+		return 0;
+	if ((fmt->matchsel & WMATCH_IP) && strpbrk(mask, "/:"))
+		return 0;
+	return 1;
+}
+
 static void who_global(Client *client, char *mask, int operspy, struct who_format *fmt)
 {
 	Client *hunted = NULL;
@@ -543,29 +593,33 @@ static void who_global(Client *client, char *mask, int operspy, struct who_forma
 			who_common_channel(client, lp->channel, mask, &maxmatches, fmt);
 	}
 
-	/* Second, list all matching visible clients. */
-	list_for_each_entry(acptr, &client_list, client_node)
+	/* Second, list all matching visible clients. For an exact term on
+	 * indexed categories (account, IP, host) we only visit the clients
+	 * filed under that key, instead of scanning every client.
+	 */
+	if (who_can_use_index(mask, fmt))
 	{
-		if (!IsUser(acptr))
-			continue;
-
-		if (IsInvisible(acptr) && !operspy && (client != acptr) && (acptr != hunted))
-			continue;
-
-		if (IsMarked(acptr))
-			continue;
-
-		if (IsMatch(fmt, WMATCH_OPER) && !IsOper(acptr))
-			continue;
-
-		if (maxmatches > 0)
+		WhoIndexEntry *e;
+		int types[4], numtypes = 0, i;
+
+		if (fmt->matchsel & WMATCH_ACCOUNT)
+			types[numtypes++] = WHOINDEX_ACCOUNT;
+		if (fmt->matchsel & WMATCH_IP)
+			types[numtypes++] = WHOINDEX_IP;
+		if (fmt->matchsel & WMATCH_HOST)
 		{
-			if (do_match(client, acptr, mask, fmt))
- 			{
-				do_who(client, acptr, NULL, fmt);
-				--maxmatches;
- 			}
- 		}
+			types[numtypes++] = WHOINDEX_HOST;
+			types[numtypes++] = WHOINDEX_REALHOST;
+		}
+
+		for (i = 0; i < numtypes; i++)
+			for (e = whoindex_fetch(types[i], mask); e; e = e->next)
+				if (!strcasecmp(e->key, mask))
+					who_global_visible(client, e->client, mask, operspy, hunted, &maxmatches, fmt);
+	} else
+	{
+		list_for_each_entry(acptr, &client_list, client_node)
+			who_global_visible(client, acptr, mask, operspy, hunted, &maxmatches, fmt);
 	}
 
 	if (maxmatches <= 0)
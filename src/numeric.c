@@ -244,7 +244,7 @@ static char *replies[] = {
 #endif
 /* 213    RPL_STATSCLINE */ "%c %s * %s %d %d %s",
 /* 214    RPL_STATSOLDNLINE */ "%c %s * %s %d %d %s",
-/* 215    RPL_STATSILINE */ "I %s * %s %d %s %s %d",
+/* 215    RPL_STATSILINE */ "I %s * %s %d %s %s %d %lld",
 /* 216    RPL_STATSKLINE */ "%s %s %s",
 /* 217    RPL_STATSQLINE */ "%c %s %ld %ld %s :%s",
 /* 218    RPL_STATSYLINE */ "Y %s %d %d %d %d %d",
@@ -774,11 +774,11 @@ static char *replies[] = {
 /* 727 */ NULL,
 /* 728 */ NULL,
 /* 729 */ NULL,
-/* 730 */ NULL,
-/* 731 */ NULL,
-/* 732 */ NULL,
-/* 733 */ NULL,
-/* 734 */ NULL,
+/* 730 RPL_MONONLINE */ ":%s",
+/* 731 RPL_MONOFFLINE */ ":%s",
+/* 732 RPL_MONLIST */ ":%s",
+/* 733 RPL_ENDOFMONLIST */ ":End of MONITOR list",
+/* 734 ERR_MONLISTFULL */ "%d %s :Monitor list is full",
 /* 735 */ NULL,
 /* 736 */ NULL,
 /* 737 */ NULL,
@@ -35,6 +35,76 @@ OperClassPathNode *OperClass_findPathNodeForIdentifier(char *identifier, OperCla
 
 OperClassPathNode *rootEvalNode = NULL;
 
+/* == Permission verdict cache ==
+ * ValidatePermissionsForPath() resolves a permission by parsing the
+ * path and walking the operclass ACL tree (including parents), with
+ * string comparisons at every level - and it runs for every privileged
+ * action, including high frequency ones like override checks. However,
+ * for ACL entries without variables the verdict only depends on the
+ * configuration, not on the parameters of the check. So each operclass
+ * keeps a small hash of path -> verdict, filled on first use and valid
+ * for the lifetime of the class (a rehash builds new classes). Checks
+ * that consulted an entry with variables are parameter dependent and
+ * are never cached; permcheck_dynamic tracks that during evaluation.
+ */
+#define OPERPERM_CACHE_BUCKETS 64
+
+typedef struct OperPermCacheEntry OperPermCacheEntry;
+struct OperPermCacheEntry
+{
+	OperPermCacheEntry *prev, *next;
+	char *path;
+	OperPermission perm;
+};
+
+struct OperPermCache
+{
+	OperPermCacheEntry *table[OPERPERM_CACHE_BUCKETS];
+};
+
+static int permcheck_dynamic = 0;
+
+static unsigned int operclass_permcache_hash(const char *path)
+{
+	unsigned int h = 5381;
+
+	while (*path)
+		h = (h << 5) + h + *path++;
+	return h & (OPERPERM_CACHE_BUCKETS - 1);
+}
+
+/** Returns 1 (with *perm set) if a verdict for 'path' is cached on 'oc' */
+static int operclass_permcache_get(OperClass *oc, const char *path, OperPermission *perm)
+{
+	OperPermCacheEntry *e;
+
+	if (!oc->permcache)
+		return 0;
+
+	for (e = oc->permcache->table[operclass_permcache_hash(path)]; e; e = e->next)
+	{
+		if (!strcmp(e->path, path))
+		{
+			*perm = e->perm;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void operclass_permcache_add(OperClass *oc, const char *path, OperPermission perm)
+{
+	OperPermCacheEntry *e;
+
+	if (!oc->permcache)
+		oc->permcache = safe_alloc(sizeof(struct OperPermCache));
+
+	e = safe_alloc(sizeof(OperPermCacheEntry));
+	safe_strdup(e->path, path);
+	e->perm = perm;
+	AddListItem(e, oc->permcache->table[operclass_permcache_hash(path)]);
+}
+
 OperClassValidator *OperClassAddValidator(Module *module, char *pathStr, OperClassEntryEvalCallback callback)
 {
 	OperClassPathNode *node,*nextNode;
@@ -187,6 +257,11 @@ unsigned char OperClass_evaluateACLEntry(OperClassACLEntry *entry, OperClassACLP
 		return 1;
 	}
 
+	/* The verdict will depend on the parameters of this particular
+	 * check, so it must not end up in the permission verdict cache.
+	 */
+	permcheck_dynamic = 1;
+
 	/* Go as deep as possible */
 	while (path->next && node)
 	{
@@ -284,7 +359,10 @@ OperPermission ValidatePermissionsForPath(char *path, Client *client, Client *vi
 	ConfigItem_oper *ce_oper;
 	ConfigItem_operclass *ce_operClass;
 	OperClass *oc = NULL;
+	OperClass *startClass;
 	OperClassACLPath *operPath;
+	OperPermission perm = OPER_DENY;
+	int was_dynamic;
 
 	if (!client)
 		return OPER_DENY;
@@ -301,7 +379,7 @@ OperPermission ValidatePermissionsForPath(char *path, Client *client, Client *vi
 	{
 		return OPER_DENY;
 	}
-	
+
 	ce_operClass = find_operclass(ce_oper->operclass);
 	if (!ce_operClass)
 	{
@@ -309,23 +387,29 @@ OperPermission ValidatePermissionsForPath(char *path, Client *client, Client *vi
 	}
 
 	oc = ce_operClass->classStruct;
+
+	/* Fast path: a previously computed verdict for this path */
+	if (operclass_permcache_get(oc, path, &perm))
+		return perm;
+
+	startClass = oc;
+	was_dynamic = permcheck_dynamic; /* (save: we may be a nested check from an entry callback) */
+	permcheck_dynamic = 0;
+
 	operPath = OperClass_parsePath(path);
 	while (oc && operPath)
 	{
 		OperClassACL *acl = OperClass_FindACL(oc->acls,operPath->identifier);
 		if (acl)
 		{
-			OperPermission perm;
-			OperClassCheckParams *params = safe_alloc(sizeof(OperClassCheckParams));
-			params->client = client;
-			params->victim = victim;
-			params->channel = channel;
-			params->extra = extra;
-			
-			perm = ValidatePermissionsForPathEx(acl, operPath, params);
-			OperClass_freePath(operPath);
-			safe_free(params);
-			return perm;
+			OperClassCheckParams params;
+			params.client = client;
+			params.victim = victim;
+			params.channel = channel;
+			params.extra = extra;
+
+			perm = ValidatePermissionsForPathEx(acl, operPath, &params);
+			break;
 		}
 		if (!oc->ISA)
 		{
@@ -340,5 +424,10 @@ OperPermission ValidatePermissionsForPath(char *path, Client *client, Client *vi
 		}
 	}
 	OperClass_freePath(operPath);
-	return OPER_DENY;
+
+	if (!permcheck_dynamic)
+		operclass_permcache_add(startClass, path, perm);
+	permcheck_dynamic |= was_dynamic;
+
+	return perm;
 }
@@ -26,15 +26,25 @@
 /** Last (or current) command that we processed. Useful for post-mortem. */
 char backupbuf[8192];
 
+MODVAR Tracepoint tp_parse2 = { NULL, "parse2", 0, 0 };
+
 static char *para[MAXPARA + 2];
 
+/** One-entry target cache for routing server-to-server numerics,
+ * see do_numeric(). Invalidated in remove_client_from_list().
+ */
+MODVAR Client *numeric_target_cache = NULL;
+
 /* Forward declarations of functions that are local (static) */
 static int do_numeric(int, Client *, MessageTag *, int, char **);
 static void cancel_clients(Client *, Client *, char *);
 static void remove_unknown(Client *, char *);
 static void parse2(Client *client, Client **fromptr, MessageTag *mtags, char *ch);
-static void parse_addlag(Client *client, int cmdbytes);
+static void parse_addlag(Client *client, int cost, int cmdbytes);
+static int client_lag_immune(Client *client);
 static int client_lagged_up(Client *client);
+static int client_may_parse(Client *client);
+static void dopacket_accounting(Client *client, int bytes, int lines);
 
 /** Put a packet in the client receive queue and process the data (if
  * the 'fake lag' rules permit doing so).
@@ -50,14 +60,97 @@ static int client_lagged_up(Client *client);
  */
 int process_packet(Client *client, char *readbuf, int length, int killsafely)
 {
-	dbuf_put(&client->local->recvQ, readbuf, length);
+	/* Fast path: when no earlier data is pending and we may process
+	 * data right now, parse complete lines directly from the read
+	 * buffer - in place - and only buffer the trailing partial line
+	 * (if any) in the recvQ. This avoids the two extra copies of
+	 * every inbound byte (into and out of the dbuf) for the common
+	 * case of whole lines arriving together.
+	 */
+	if ((DBufLength(&client->local->recvQ) == 0) && client_may_parse(client))
+	{
+		char *ptr = readbuf;
+		char *end = readbuf + length;
+		char *eol, *nextline;
+		int dolen;
+		/* Server links bypass fake lag, so their lines can be parsed
+		 * back to back with a single pass of byte/message accounting
+		 * afterwards, rather than one dopacket() round per line.
+		 * This matters most during netjoin recovery bursts.
+		 */
+		int batch = IsServer(client);
+		int batch_bytes = 0, batch_lines = 0;
 
-	/* parse some of what we have (inducing fakelag, etc) */
-	parse_client_queued(client);
+		while (ptr < end && (batch || !client_lagged_up(client)))
+		{
+			/* Skip empty characters before the line, like dbuf_getmsg() */
+			while (ptr < end && (*ptr == '\r' || *ptr == '\n' || *ptr == ' '))
+				ptr++;
+
+			/* Find the end of the line (first CR or LF). Done with
+			 * two memchr() calls rather than a byte-by-byte loop:
+			 * libc vectorizes memchr() (SSE2/NEON), which matters
+			 * when bursts arrive as many lines per read().
+			 */
+			eol = memchr(ptr, '\n', end - ptr);
+			if (!eol)
+				eol = end;
+			if ((nextline = memchr(ptr, '\r', eol - ptr)))
+				eol = nextline;
+			if (eol == end)
+				break; /* no complete line (left) in this buffer */
+
+			dolen = MIN(eol - ptr, READBUFSIZE - 2);
+			ptr[dolen] = '\0'; /* overwrites the \r / \n (or truncates) */
+			nextline = eol + 1;
+
+			if (batch)
+			{
+				batch_bytes += dolen;
+				batch_lines++;
+				parse(client, ptr, dolen);
+			} else
+				dopacket(client, ptr, dolen);
+			if (IsDead(client))
+			{
+				if (batch_lines)
+					dopacket_accounting(client, batch_bytes, batch_lines);
+				return 0;
+			}
 
-	/* We may be killed now, so check for it.. */
-	if (IsDead(client))
-		return 0;
+			/* If that line activated link compression (COMPRESS)
+			 * then the remainder of this read buffer is compressed
+			 * data: hand it to the inflater instead of the parser.
+			 */
+			if (client->local->zip && zip_in_handoff_pending(client))
+			{
+				if (batch_lines)
+					dopacket_accounting(client, batch_bytes, batch_lines);
+				return zip_in_handoff(client, nextline, end - nextline);
+			}
+
+			ptr = nextline;
+		}
+
+		if (batch_lines)
+			dopacket_accounting(client, batch_bytes, batch_lines);
+
+		/* Carry over what could not be parsed (yet): a partial
+		 * trailing line, or complete lines withheld by fake lag.
+		 */
+		if (ptr < end)
+			dbuf_put(&client->local->recvQ, ptr, end - ptr);
+	} else
+	{
+		dbuf_put(&client->local->recvQ, readbuf, length);
+
+		/* parse some of what we have (inducing fakelag, etc) */
+		parse_client_queued(client);
+
+		/* We may be killed now, so check for it.. */
+		if (IsDead(client))
+			return 0;
+	}
 
 	/* flood from unknown connection */
 	if (IsUnknown(client) && (DBufLength(&client->local->recvQ) > UNKNOWN_FLOOD_AMOUNT*1024))
@@ -97,31 +190,48 @@ void parse_client_queued(Client *client)
 {
 	int dolen = 0;
 	char buf[READBUFSIZE];
+	/* Server links bypass fake lag: parse back to back and do the
+	 * byte/message accounting once afterwards (see process_packet).
+	 */
+	int batch = IsServer(client);
+	int batch_bytes = 0, batch_lines = 0;
 
-	if (IsDNSLookup(client))
-		return; /* we delay processing of data until the host is resolved */
-
-	if (IsIdentLookup(client))
-		return; /* we delay processing of data until identd has replied */
-
-	if (!IsUser(client) && !IsServer(client) && (iConf.handshake_delay > 0) &&
-	    (TStime() - client->local->firsttime < iConf.handshake_delay))
-	{
-		return; /* we delay processing of data until set::handshake-delay is reached */
-	}
+	if (!client_may_parse(client))
+		return;
 
-	while (DBufLength(&client->local->recvQ) && !client_lagged_up(client))
+	while (DBufLength(&client->local->recvQ) && (batch || !client_lagged_up(client)))
 	{
 		dolen = dbuf_getmsg(&client->local->recvQ, buf);
 
 		if (dolen == 0)
-			return;
+			break;
+
+		if (batch)
+		{
+			batch_bytes += dolen;
+			batch_lines++;
+			parse(client, buf, dolen);
+		} else
+			dopacket(client, buf, dolen);
 
-		dopacket(client, buf, dolen);
-		
 		if (IsDead(client))
+			break;
+
+		/* If that line activated link compression (COMPRESS) then
+		 * what remains in the recvQ is compressed data: hand it to
+		 * the inflater instead of the parser.
+		 */
+		if (client->local->zip && zip_in_handoff_pending(client))
+		{
+			if (batch_lines)
+				dopacket_accounting(client, batch_bytes, batch_lines);
+			zip_in_handoff_recvq(client);
 			return;
+		}
 	}
+
+	if (batch_lines)
+		dopacket_accounting(client, batch_bytes, batch_lines);
 }
 
 /*
@@ -140,8 +250,19 @@ void parse_client_queued(Client *client)
 */
 void dopacket(Client *client, char *buffer, int length)
 {
-	me.local->receiveB += length;	/* Update bytes received */
-	client->local->receiveB += length;
+	dopacket_accounting(client, length, 1);
+	parse(client, buffer, length);
+}
+
+/** Update the bytes/messages received statistics of 'client' (and of
+ * &me) for a batch of 'lines' parsed lines totalling 'bytes' bytes.
+ * This is the accounting part of dopacket(), split out so batch mode
+ * can apply it once per burst instead of once per line.
+ */
+static void dopacket_accounting(Client *client, int bytes, int lines)
+{
+	me.local->receiveB += bytes;	/* Update bytes received */
+	client->local->receiveB += bytes;
 	if (client->local->receiveB > 1023)
 	{
 		client->local->receiveK += (client->local->receiveB >> 10);
@@ -153,12 +274,203 @@ void dopacket(Client *client, char *buffer, int length)
 		me.local->receiveB &= 0x03ff;
 	}
 
-	me.local->receiveM += 1;	/* Update messages received */
-	client->local->receiveM += 1;
+	me.local->receiveM += lines;	/* Update messages received */
+	client->local->receiveM += lines;
+}
 
-	parse(client, buffer, length);
+
+/** Make a scratch copy of a command argument for in-place modification.
+ * The parv[] elements handed to command handlers are borrowed from the
+ * shared parse buffer: handlers may read them for the duration of the
+ * command, but chopping them up in place (eg with strtoken) mutates what
+ * later hooks and command overrides see. Handlers that need a modifiable
+ * copy can grab one here without going to the heap.
+ * @param arg  The argument to copy (up to 512 bytes including NUL)
+ * @returns A copy in temporary storage. Up to PARSE_SCRATCH_DEPTH copies
+ *          are live at any time, after that the oldest one is reused, so
+ *          do not hold on to the result across do_cmd() or parse() calls.
+ */
+#define PARSE_SCRATCH_DEPTH 4
+char *parse_scratch_copy(const char *arg)
+{
+	static char scratch[PARSE_SCRATCH_DEPTH][512];
+	static unsigned int idx = 0;
+	char *buf = scratch[idx];
+
+	idx = (idx + 1) % PARSE_SCRATCH_DEPTH;
+	strlcpy(buf, arg, sizeof(scratch[0]));
+	return buf;
+}
+
+/** Per-message bump arena for transient allocations in the command
+ * pipeline. A single inbound command can trigger dozens of short-lived
+ * allocations (scratch buffers, temporary lists, ..) that all die
+ * before parse() returns. Such allocations can be taken from this
+ * arena instead: allocation is a pointer bump, and the whole arena is
+ * reset wholesale after the command has been processed, so there is
+ * nothing to free. If the fixed buffer runs out, allocations silently
+ * overflow to the heap and are still released at the arena reset, so
+ * callers never need a fallback path.
+ * RULE: memory obtained from parse_arena_alloc()/parse_arena_strdup()
+ * MUST NOT be referenced after processing of the current inbound
+ * message ends. Anything with a longer lifetime needs safe_alloc().
+ */
+#define PARSE_ARENA_SIZE 32768
+
+typedef struct ParseArenaOverflow ParseArenaOverflow;
+struct ParseArenaOverflow {
+	ParseArenaOverflow *next;
+};
+
+static char parse_arena[PARSE_ARENA_SIZE];
+static int parse_arena_used = 0;
+static ParseArenaOverflow *parse_arena_overflow = NULL;
+
+/** Allocate 'size' zeroed bytes which are valid until processing of
+ * the current inbound message ends (see the RULE above). Never
+ * returns NULL.
+ */
+void *parse_arena_alloc(size_t size)
+{
+	char *p;
+
+	size = (size + 7) & ~(size_t)7; /* keep everything pointer-aligned */
+	if (parse_arena_used + size > PARSE_ARENA_SIZE)
+	{
+		/* Does not fit: take a heap block and chain it so the
+		 * arena reset can release it. This keeps the API free of
+		 * failure paths at the cost of a malloc for the (rare)
+		 * oversized consumer.
+		 */
+		ParseArenaOverflow *blk = safe_alloc(sizeof(ParseArenaOverflow) + size);
+		blk->next = parse_arena_overflow;
+		parse_arena_overflow = blk;
+		return (char *)blk + sizeof(ParseArenaOverflow);
+	}
+	p = parse_arena + parse_arena_used;
+	parse_arena_used += size;
+	memset(p, 0, size);
+	return p;
+}
+
+/** Duplicate a string into the per-message arena, see parse_arena_alloc(). */
+char *parse_arena_strdup(const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *p = parse_arena_alloc(len);
+
+	memcpy(p, str, len);
+	return p;
+}
+
+/** Throw away everything allocated from the per-message arena.
+ * Called from the parse() epilogue after each inbound message; must
+ * not be called from anywhere else.
+ */
+static void parse_arena_reset(void)
+{
+	ParseArenaOverflow *blk, *blk_next;
+
+	for (blk = parse_arena_overflow; blk; blk = blk_next)
+	{
+		blk_next = blk->next;
+		safe_free(blk);
+	}
+	parse_arena_overflow = NULL;
+	parse_arena_used = 0;
 }
 
+/* == Traffic recorder ==
+ * When set::replay-record-file is configured, every inbound raw line is
+ * appended to that file as "<seconds>.<microseconds> <uid> <line>", where
+ * <uid> is the connection's unique ID (so lines of one connection can be
+ * told apart even when fds are recycled). Such a recording can later be
+ * fed back through the parser at will - against synthetic clients and at
+ * any speed - by the replay module (src/modules/replay.c), which makes
+ * profiles and regression measurements reproducible for the exact
+ * traffic mix of a production box. By default the text of messages is
+ * replaced by 'x' characters of the same length before it hits the disk
+ * (set::replay-record-strip-payload), which keeps the traffic *shape*
+ * intact but no private conversations: recordings taken on production
+ * can then be shared with developers.
+ */
+static FILE *replay_record_file = NULL;
+static char *replay_record_file_name = NULL;
+
+/** Commands whose final parameter is user-written text, for the
+ * payload stripper. NULL-terminated.
+ */
+static const char *replay_payload_cmds[] = {
+	"PRIVMSG", "NOTICE", "TOPIC", "AWAY", "PART", "QUIT", "KICK", "SETNAME", NULL
+};
+
+/** Append one inbound line to the traffic recording */
+static void replay_record_line(Client *cptr, const char *buffer)
+{
+	struct timeval tv;
+	char line[READBUFSIZE];
+
+	/* (Re)open the file when set::replay-record-file changed. When the
+	 * open fails we leave the name in place so the error is logged once,
+	 * not once per inbound line.
+	 */
+	if (!replay_record_file_name || strcmp(replay_record_file_name, REPLAY_RECORD_FILE))
+	{
+		if (replay_record_file)
+			fclose(replay_record_file);
+		safe_strdup(replay_record_file_name, REPLAY_RECORD_FILE);
+		replay_record_file = fopen(REPLAY_RECORD_FILE, "a");
+		if (!replay_record_file)
+			ircd_log(LOG_ERROR, "Could not open set::replay-record-file '%s': %s",
+				REPLAY_RECORD_FILE, STRERROR(ERRNO));
+	}
+	if (!replay_record_file)
+		return;
+
+	strlcpy(line, buffer, sizeof(line));
+
+	if (REPLAY_RECORD_STRIP_PAYLOAD)
+	{
+		char *p = line, *cmd, *text;
+		int i, cmdlen;
+
+		/* Find the command: skip message tags and the source prefix */
+		if (*p == '@')
+		{
+			p = strchr(p, ' ');
+			if (!p)
+				goto nostrip;
+			while (*p == ' ')
+				p++;
+		}
+		if (*p == ':')
+		{
+			p = strchr(p, ' ');
+			if (!p)
+				goto nostrip;
+			while (*p == ' ')
+				p++;
+		}
+		cmd = p;
+		p = strchr(p, ' ');
+		cmdlen = p ? p - cmd : strlen(cmd);
+		for (i = 0; replay_payload_cmds[i]; i++)
+			if ((strlen(replay_payload_cmds[i]) == cmdlen) &&
+			    !strncasecmp(cmd, replay_payload_cmds[i], cmdlen))
+				break;
+		/* Overwrite the trailing ":text" parameter in place, so the
+		 * length (and with it the traffic shape) is preserved.
+		 */
+		if (replay_payload_cmds[i] && p && (text = strstr(p, " :")))
+			for (text += 2; *text; text++)
+				*text = 'x';
+	}
+nostrip:
+
+	gettimeofday(&tv, NULL);
+	fprintf(replay_record_file, "%lld.%06lld %s %s\n",
+		(long long)tv.tv_sec, (long long)tv.tv_usec, cptr->id, line);
+}
 
 /** Parse an incoming line.
  * A line was received previously, buffered via dbuf, now popped from the dbuf stack,
@@ -193,7 +505,12 @@ void parse(Client *cptr, char *buffer, int length)
 	if (IsDeadSocket(cptr))
 		return;
 
-	if ((cptr->local->receiveK >= UNKNOWN_FLOOD_AMOUNT) && IsUnknown(cptr))
+	/* Note the fd check: synthetic replay clients (src/modules/replay.c)
+	 * have no real socket and replayed traffic must never Z-line the IP
+	 * they are parked on.
+	 */
+	if ((cptr->local->receiveK >= UNKNOWN_FLOOD_AMOUNT) && IsUnknown(cptr) &&
+	    (cptr->local->fd >= 0))
 	{
 		sendto_snomask(SNO_FLOOD, "Flood from unknown connection %s detected",
 			cptr->local->sockhost);
@@ -204,6 +521,16 @@ void parse(Client *cptr, char *buffer, int length)
 	/* This stores the last executed command in 'backupbuf', useful for debugging crashes */
 	strlcpy(backupbuf, buffer, sizeof(backupbuf));
 
+	/* ..and in the crash flight recorder, which keeps the last few hundred */
+	flight_record("<- %s: %s", cptr->name, buffer);
+
+	/* Traffic recorder for the replay harness. Connections without a
+	 * real socket are replayed synthetic clients themselves: recording
+	 * those would feed the recorder its own output.
+	 */
+	if (REPLAY_RECORD_FILE && (cptr->local->fd >= 0))
+		replay_record_line(cptr, buffer);
+
 #if defined(DEBUGMODE) && defined(RAWCMDLOGGING)
 	ircd_log(LOG_ERROR, "<- %s: %s", cptr->name, backupbuf);
 #endif
@@ -233,6 +560,17 @@ void parse(Client *cptr, char *buffer, int length)
 		RunHook3(HOOKTYPE_POST_COMMAND, from, mtags, ch);
 
 	free_message_tags(mtags);
+	mtag_arena_reset(); /* arena-carved inbound tags die here */
+	parse_arena_reset(); /* ..and so does all other per-message arena memory */
+#ifdef DEBUGMODE
+	/* Poison the consumed line, so code that held on to a parv[]
+	 * element (which is a borrowed pointer into this buffer, see the
+	 * CMD_FUNC documentation) reads obvious garbage instead of
+	 * silently working with stale data. Same idea as the para[]
+	 * DEADBEEF_ADDR poisoning above, but for the buffer contents.
+	 */
+	memset(buffer, 0xEE, length);
+#endif
 	return;
 }
 
@@ -254,6 +592,8 @@ static void parse2(Client *cptr, Client **fromptr, MessageTag *mtags, char *ch)
 #endif
 	RealCommand *cmptr = NULL;
 	int bytes;
+	struct timeval cmd_start, cmd_end;
+	long long usec;
 
 	*fromptr = cptr; /* The default, unless a source is specified (and permitted) */
 
@@ -352,7 +692,7 @@ static void parse2(Client *cptr, Client **fromptr, MessageTag *mtags, char *ch)
 		numeric = (*ch - '0') * 100 + (*(ch + 1) - '0') * 10 + (*(ch + 2) - '0');
 		paramcount = MAXPARA;
 		ircstats.is_num++;
-		parse_addlag(cptr, bytes);
+		parse_addlag(cptr, 1, bytes);
 	}
 	else
 	{
@@ -378,7 +718,7 @@ static void parse2(Client *cptr, Client **fromptr, MessageTag *mtags, char *ch)
 		if (!cmptr || !(cmptr->flags & CMD_NOLAG))
 		{
 			/* Add fake lag (doing this early in the code, so we don't forget) */
-			parse_addlag(cptr, bytes);
+			parse_addlag(cptr, cmptr ? cmptr->fakelag_cost : 1, bytes);
 		}
 		if (!cmptr)
 		{
@@ -478,6 +818,11 @@ static void parse2(Client *cptr, Client **fromptr, MessageTag *mtags, char *ch)
 			para[++i] = s;
 			if (i >= paramcount)
 				break;
+			/* Find the end of this parameter. This deliberately stays
+			 * a byte-by-byte scan: parameters are typically well under
+			 * 16 bytes, so a vectorized memchr() loses to its own call
+			 * overhead here (measured: ~1.6x slower on typical lines).
+			 */
 			for (; *s != ' ' && *s; s++)
 				;
 		}
@@ -492,7 +837,12 @@ static void parse2(Client *cptr, Client **fromptr, MessageTag *mtags, char *ch)
 	if (IsUser(cptr) && (cmptr->flags & CMD_RESETIDLE))
 		cptr->local->last = TStime();
 
-#ifndef DEBUGMODE
+#ifdef DEBUGMODE
+	then = clock();
+#endif
+	TRACEPOINT(tp_parse2, "%s from %s (%d params)", cmptr->cmd, from->name, i - 1);
+	gettimeofday(&cmd_start, NULL);
+	profiling_current_command = cmptr;
 	if (cmptr->flags & CMD_ALIAS)
 	{
 		(*cmptr->aliasfunc) (from, mtags, i, para, cmptr->cmd);
@@ -502,17 +852,21 @@ static void parse2(Client *cptr, Client **fromptr, MessageTag *mtags, char *ch)
 		else
 			(*cmptr->overriders->func) (cmptr->overriders, from, mtags, i, para);
 	}
-#else
-	then = clock();
-	if (cmptr->flags & CMD_ALIAS)
+	profiling_current_command = NULL;
+	profiling_current_hooktype = -1; /* in case a RunHookReturn* macro returned early */
+	/* Per-command time accounting, shown in STATS R/cputime */
+	gettimeofday(&cmd_end, NULL);
+	usec = (long long)(cmd_end.tv_sec - cmd_start.tv_sec) * 1000000 +
+	       (cmd_end.tv_usec - cmd_start.tv_usec);
+	if (usec >= 0) /* guard against wall clock jumping back */
 	{
-		(*cmptr->aliasfunc) (from, mtags, i, para, cmptr->cmd);
-	} else {
-		if (!cmptr->overriders)
-			(*cmptr->func) (from, mtags, i, para);
-		else
-			(*cmptr->overriders->func) (cmptr->overriders, from, mtags, i, para);
+		cmptr->time_usec += usec;
+		if (usec > cmptr->time_max_usec)
+			cmptr->time_max_usec = usec;
+		if (SLOW_COMMAND_TRACE_TIME && (usec >= SLOW_COMMAND_TRACE_TIME))
+			slowtrace_record(cmptr->cmd, from, i, para, usec);
 	}
+#ifdef DEBUGMODE
 	if (!IsDead(cptr))
 	{
 		ticks = (clock() - then);
@@ -563,18 +917,56 @@ void ban_flooder(Client *client)
  * @param client    The client.
  * @param cmdbytes  Number of bytes in the command.
  */
-void parse_addlag(Client *client, int cmdbytes)
+void parse_addlag(Client *client, int cost, int cmdbytes)
 {
 	if (!IsServer(client) && !IsNoFakeLag(client) &&
 #ifdef FAKELAG_CONFIGURABLE
 	    !(client->local->class && (client->local->class->options & CLASS_OPT_NOFAKELAG)) &&
 #endif
-	    !ValidatePermissionsForPath("immune:lag",client,NULL,NULL,NULL))
+	    !client_lag_immune(client))
 	{
-		client->local->since += (1 + cmdbytes/90);
+		client->local->since += cost + cmdbytes/90;
 	}
 }
 
+/** Returns 1 if the client has the immune:lag operclass permission.
+ * ValidatePermissionsForPath() walks the operclass permission tree,
+ * which is much too expensive to run for every single command (it
+ * used to be called twice per line), so the verdict is cached for
+ * the current second. The only effect of this staleness is that an
+ * oper may be subject to fake lag for up to a second after /OPER.
+ */
+static int client_lag_immune(Client *client)
+{
+	if (client->local->lag_immune_time != TStime())
+	{
+		client->local->lag_immune = ValidatePermissionsForPath("immune:lag",client,NULL,NULL,NULL) ? 1 : 0;
+		client->local->lag_immune_time = TStime();
+	}
+	return client->local->lag_immune;
+}
+
+/** Returns 1 if incoming data from this client may be processed right
+ * now, or 0 if processing must be delayed (and the data buffered).
+ * @param client	The client to check
+ */
+static int client_may_parse(Client *client)
+{
+	if (IsDNSLookup(client))
+		return 0; /* we delay processing of data until the host is resolved */
+
+	if (IsIdentLookup(client))
+		return 0; /* we delay processing of data until identd has replied */
+
+	if (!IsUser(client) && !IsServer(client) && (iConf.handshake_delay > 0) &&
+	    (TStime() - client->local->firsttime < iConf.handshake_delay))
+	{
+		return 0; /* we delay processing of data until set::handshake-delay is reached */
+	}
+
+	return 1;
+}
+
 /** Returns 1 if the client is lagged up and data should NOT be parsed.
  * See also parse_addlag() for more information on "fake lag".
  * @param client	The client to check
@@ -586,10 +978,13 @@ static int client_lagged_up(Client *client)
 		return 0;
 	if (IsServer(client))
 		return 0;
-	if (ValidatePermissionsForPath("immune:lag",client,NULL,NULL,NULL))
-		return 0;
+	/* Check the (cheap) bucket level before the permission lookup,
+	 * so the permission is only consulted when it would matter.
+	 */
 	if (client->local->since - TStime() < 10)
 		return 0;
+	if (client_lag_immune(client))
+		return 0;
 	return 1;
 }
 
@@ -674,7 +1069,27 @@ static int do_numeric(int numeric, Client *client, MessageTag *recv_mtags, int p
 	/* Now actually process the numeric, IOTW: send it on */
 	for (; (nick = strtoken(&p, parv[1], ",")); parv[1] = NULL)
 	{
-		if ((acptr = find_client(nick, NULL)))
+		/* Resolve the target. Almost all numerics address their
+		 * target by UID, and bursts (eg: a remote WHOIS reply)
+		 * consist of many consecutive numerics for the same
+		 * target, hence the one-entry cache. The cache is
+		 * invalidated in remove_client_from_list() so it can
+		 * never point to an exited client. Nicks cannot start
+		 * with a digit, so digit-first targets skip the nick
+		 * hash entirely.
+		 */
+		if (numeric_target_cache && !strcmp(nick, numeric_target_cache->id))
+			acptr = numeric_target_cache;
+		else if (isdigit(*nick))
+		{
+			acptr = hash_find_id(nick, NULL);
+			if (acptr)
+				numeric_target_cache = acptr;
+		}
+		else
+			acptr = find_client(nick, NULL);
+
+		if (acptr)
 		{
 			if (!IsMe(acptr) && IsUser(acptr))
 			{
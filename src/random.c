@@ -498,6 +498,21 @@ uint32_t getrandom32()
 	return arc4random();
 }
 
+/** Fill a buffer with random bytes.
+ * Cheaper than drawing byte-by-byte via getrandom8() for anything
+ * longer than a few bytes, since the keystream is consumed in one pass.
+ * @param buf The buffer
+ * @param len Number of random bytes to write
+ */
+void getrandom_buf(void *buf, size_t len)
+{
+#ifdef HAVE_ARC4RANDOM
+	arc4random_buf(buf, len);
+#else
+	_rs_random_buf(buf, len);
+#endif
+}
+
 /** Generate an alphanumeric string (eg: XzHe5G).
  * @param buf      The buffer
  * @param numbytes The number of random bytes.
@@ -506,15 +521,28 @@ uint32_t getrandom32()
  */
 void gen_random_alnum(char *buf, int numbytes)
 {
-	for (; numbytes > 0; numbytes--)
+	unsigned char rnd[64];
+	int chunk, i;
+
+	while (numbytes > 0)
 	{
-		unsigned char v = getrandom8() % (26+26+10);
-		if (v < 26)
-			*buf++ = 'a'+v;
-		else if (v < 52)
-			*buf++ = 'A'+(v-26);
-		else
-			*buf++ = '0'+(v-52);
+		/* Draw the random bytes in bulk rather than one 32 bit
+		 * draw per character: message ids and batch labels call
+		 * us on every message.
+		 */
+		chunk = (numbytes > sizeof(rnd)) ? sizeof(rnd) : numbytes;
+		getrandom_buf(rnd, chunk);
+		for (i = 0; i < chunk; i++)
+		{
+			unsigned char v = rnd[i] % (26+26+10);
+			if (v < 26)
+				*buf++ = 'a'+v;
+			else if (v < 52)
+				*buf++ = 'A'+(v-26);
+			else
+				*buf++ = '0'+(v-52);
+		}
+		numbytes -= chunk;
 	}
 	*buf = '\0';
 }
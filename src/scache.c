@@ -1,7 +1,7 @@
 /* License: GPLv1 */
 
 /** @file
- * @brief String cache - only used for server names.
+ * @brief Interned (shared, refcounted) strings.
  */
 
 #include "unrealircd.h"
@@ -15,85 +15,179 @@
  * -orabidoo
  */
 /*
- * I could have tucked this code into hash.c I suppose but lets keep it
- * separate for now -Dianora
+ * The same observation holds for usernames, hostnames and realnames on
+ * clone-heavy networks: a large share of the strings hanging off the
+ * Client and whowas structs are exact duplicates. The old fixed-size,
+ * never-freed server name cache is therefore generalized into a proper
+ * interning service: entries are refcounted, the table is siphash
+ * keyed and resizes in both directions, and anyone holding lots of
+ * likely-duplicated strings can be a client of it. Server names keep
+ * their historic semantics (handed out as bare pointers that are never
+ * freed) via find_or_add(), which simply pins its entries.
  */
 
-#define SCACHE_HASH_SIZE 257
-
-typedef struct SCACHE SCACHE;
-struct SCACHE {
-	char name[HOSTLEN + 1];
-	SCACHE *next;
+/** One interned string. The string itself is allocated inline behind
+ * the header, like struct Watch does for nicks; intern pointers handed
+ * out to callers point at 'str' and the header is recovered from them
+ * by subtracting the offset.
+ */
+typedef struct InternedString InternedString;
+struct InternedString {
+	InternedString *next;
+	unsigned int refcount;
+	unsigned int permanent;	/**< Pinned by find_or_add(), never freed */
+	char str[1];
 };
 
-static SCACHE *scache_hash[SCACHE_HASH_SIZE];
+/** Initial and minimum number of buckets (power of two) */
+#define INTERN_HASH_INITIAL_SIZE 256
 
-/*
- * renamed to keep it consistent with the other hash functions -Dianora 
- */
-/*
- * orabidoo had named it init_scache_hash(); 
- */
+static InternedString **intern_hash;
+static unsigned int intern_hash_size;
+static unsigned int intern_count;
+static char siphashkey_intern[SIPHASH_KEY_LENGTH];
 
+/** Initialize the interned string table (at boot, after init_random) */
 void clear_scache_hash_table(void)
 {
-	memset((char *)scache_hash, '\0', sizeof(scache_hash));
+	siphash_generate_key(siphashkey_intern);
+	intern_hash_size = INTERN_HASH_INITIAL_SIZE;
+	intern_count = 0;
+	intern_hash = safe_alloc(intern_hash_size * sizeof(InternedString *));
 }
 
-static int hash(char *string)
+static InternedString *intern_header(char *str)
 {
-	int  hash_value;
-
-	hash_value = 0;
-	while (*string)
-		hash_value += (*string++ & 0xDF);
-
-	return hash_value % SCACHE_HASH_SIZE;
+	return (InternedString *)(str - offsetof(InternedString, str));
 }
 
-/** Add a string to the string cache.
- * this takes a server name, and returns a pointer to the same string
- * (up to case) in the server name token list, adding it to the list if
- * it's not there.  care must be taken not to call this with
- * user-supplied arguments that haven't been verified to be a valid,
- * existing, servername.  use the hash in list.c for those.  -orabidoo
- * @param name	A valid server name
- * @returns Pointer to the server name
+/** Rehash all entries into a table of 'newsize' buckets. Unlike the
+ * big nick/UID tables this one only resizes on aggregate churn in the
+ * order of the table size, so a one-shot rehash is fine here.
  */
-char *find_or_add(char *name)
+static void intern_resize(unsigned int newsize)
 {
-	int  hash_index;
-	SCACHE *ptr, *newptr;
+	InternedString **newhash = safe_alloc(newsize * sizeof(InternedString *));
+	unsigned int i;
 
-	ptr = scache_hash[hash_index = hash(name)];
-	while (ptr)
+	for (i = 0; i < intern_hash_size; i++)
 	{
-		if (!mycmp(ptr->name, name))
+		InternedString *e, *next;
+		for (e = intern_hash[i]; e; e = next)
 		{
-			return (ptr->name);
+			unsigned int b = siphash(e->str, siphashkey_intern) & (newsize - 1);
+			next = e->next;
+			e->next = newhash[b];
+			newhash[b] = e;
 		}
-		else
+	}
+	safe_free(intern_hash);
+	intern_hash = newhash;
+	intern_hash_size = newsize;
+}
+
+/** Get a shared, refcounted copy of 'str' (case sensitive).
+ * Every call must be balanced by an unintern_string() of the returned
+ * pointer. The returned string must never be written to: it is shared
+ * with every other holder of the same text.
+ */
+char *intern_string(const char *str)
+{
+	unsigned int b = siphash(str, siphashkey_intern) & (intern_hash_size - 1);
+	InternedString *e;
+
+	for (e = intern_hash[b]; e; e = e->next)
+	{
+		if (!strcmp(e->str, str))
 		{
-			ptr = ptr->next;
+			e->refcount++;
+			return e->str;
 		}
 	}
 
-	/*
-	 * not found -- add it 
-	 */
-	if ((ptr = scache_hash[hash_index]))
+	if (intern_count >= intern_hash_size * 2)
 	{
-		newptr = scache_hash[hash_index] = safe_alloc(sizeof(SCACHE));
-		strlcpy(newptr->name, name, sizeof(newptr->name));
-		newptr->next = ptr;
-		return (newptr->name);
+		intern_resize(intern_hash_size * 2);
+		b = siphash(str, siphashkey_intern) & (intern_hash_size - 1);
 	}
-	else
+
+	e = safe_alloc(sizeof(InternedString) + strlen(str));
+	strcpy(e->str, str); /* safe, allocated above */
+	e->refcount = 1;
+	e->next = intern_hash[b];
+	intern_hash[b] = e;
+	intern_count++;
+	return e->str;
+}
+
+/** Drop a reference to an interned string, freeing it when it was the
+ * last one. 'str' must be a pointer previously returned by
+ * intern_string() or find_or_add() (or NULL, which is a no-op).
+ */
+void unintern_string(char *str)
+{
+	InternedString *e, **prev;
+	unsigned int b;
+
+	if (!str)
+		return;
+
+	e = intern_header(str);
+	if (e->refcount == 0)
 	{
-		ptr = scache_hash[hash_index] = safe_alloc(sizeof(SCACHE));
-		strlcpy(ptr->name, name, sizeof(newptr->name));
-		ptr->next = (SCACHE *) NULL;
-		return (ptr->name);
+		ircd_log(LOG_ERROR, "[BUG] unintern_string() for '%s' (%p): refcount already zero",
+			str, (void *)e);
+#ifdef DEBUGMODE
+		abort();
+#endif
+		return;
 	}
+	if (--e->refcount || e->permanent)
+		return;
+
+	b = siphash(str, siphashkey_intern) & (intern_hash_size - 1);
+	for (prev = &intern_hash[b]; *prev; prev = &(*prev)->next)
+	{
+		if (*prev == e)
+		{
+			*prev = e->next;
+			safe_free(e);
+			intern_count--;
+			if ((intern_hash_size > INTERN_HASH_INITIAL_SIZE) &&
+			    (intern_count < intern_hash_size / 8))
+				intern_resize(intern_hash_size / 2);
+			return;
+		}
+	}
+
+	ircd_log(LOG_ERROR, "[BUG] unintern_string() for '%s' (%p): not found in table",
+		str, (void *)e);
+#ifdef DEBUGMODE
+	abort();
+#endif
+}
+
+/** Add a string to the string cache.
+ * this takes a server name, and returns a pointer to the same string
+ * in the server name token list, adding it to the list if
+ * it's not there.  care must be taken not to call this with
+ * user-supplied arguments that haven't been verified to be a valid,
+ * existing, servername.  use the hash in list.c for those.  -orabidoo
+ * The returned pointer is shared unrefcounted all over the place
+ * (me_hash, serv->up, user->server, whowas entries), so entries added
+ * through here are pinned and survive even when their last counted
+ * reference goes away.
+ * @param name	A valid server name
+ * @returns Pointer to the server name
+ */
+char *find_or_add(char *name)
+{
+	char *str = intern_string(name);
+	InternedString *e = intern_header(str);
+
+	if (e->permanent)
+		unintern_string(str); /* already pinned, keep one reference */
+	else
+		e->permanent = 1; /* the reference we just took pins it */
+	return str;
 }
@@ -83,8 +83,102 @@ int dead_socket(Client *to, char *notice)
 	return -1;
 }
 
+/** Minimum number of bytes a client may flush per drain cycle,
+ * regardless of how small its class sendq is.
+ */
+#define SENDQ_DRAIN_MIN_QUANTUM	65536
+
+/** How much a single client may flush per drain cycle.
+ * Derived from the class sendq so server links (which typically have
+ * multi-megabyte sendqs and legitimately burst) get a proportionally
+ * larger share than slow user connections.
+ */
+static int sendq_drain_quantum(Client *to)
+{
+	int quantum = get_sendq(to) / 8;
+
+	if (quantum < SENDQ_DRAIN_MIN_QUANTUM)
+		quantum = SENDQ_DRAIN_MIN_QUANTUM;
+
+	return quantum;
+}
+
+static int send_queued_budget(Client *to, int budget);
+
+/** Upper bucket bounds of the per-class flush-time sendq depth histogram,
+ * in percent of the class sendq limit. The last bucket catches the rest.
+ */
+MODVAR const int sendq_hist_pct[SENDQ_HIST_NBUCKETS-1] = { 1, 5, 10, 25, 50, 75, 90 };
+
+/** How long (seconds) a server link must stay above the 50% sendq
+ * watermark before the early warning is sent. Short bursts (a netjoin,
+ * a services sync) routinely spike the queue; a link that cannot drain
+ * below half its sendq for this long is genuinely falling behind.
+ */
+#define SENDQ_ALERT_TIME	10
+
+/** Per-class queue pressure telemetry, called when a sendq is flushed.
+ * Updates the class' depth histogram with the queue depth found at
+ * flush time and tracks how long each link spends above the 50%
+ * watermark, so capacity problems on (hub) links show up in STATS Y
+ * and as an early-warning server notice instead of only as a
+ * "Max SendQ exceeded" kill after the fact.
+ * @param to		The client whose sendq was just flushed
+ * @param qlen_at_flush	Queue depth when the flush started
+ */
+static void sendq_pressure_account(Client *to, unsigned int qlen_at_flush)
+{
+	ConfigItem_class *class = to->local->class;
+	unsigned int qlen = DBufLength(&to->local->sendQ);
+	unsigned int limit = get_sendq(to);
+	int i;
+
+	/* Flushes with an empty queue (frame coalescing hooks) say nothing
+	 * about queue pressure and are not sampled.
+	 */
+	if (class && limit && qlen_at_flush)
+	{
+		int pct = (int)((long long)qlen_at_flush * 100 / limit);
+
+		for (i = 0; i < SENDQ_HIST_NBUCKETS - 1; i++)
+			if (pct < sendq_hist_pct[i])
+				break;
+		class->sendq_hist[i]++;
+	}
+
+	/* The watermark check uses the depth AFTER draining: a queue that
+	 * empties every flush is healthy no matter how it spikes between
+	 * flushes, one that stays above half the limit is not keeping up.
+	 */
+	if (qlen * 2 >= limit)
+	{
+		if (!to->local->sendq_above_since)
+			to->local->sendq_above_since = timeofday;
+		else if (IsServer(to) && !to->local->sendq_alerted &&
+		         (timeofday - to->local->sendq_above_since >= SENDQ_ALERT_TIME))
+		{
+			to->local->sendq_alerted = 1;
+			if (class)
+				class->sendq_alerts++;
+			sendto_snomask(SNO_SNOTICE,
+				"Warning: sendq of server link %s above 50%% of the limit for %lld seconds (%u of %u bytes) - link is not keeping up",
+				get_client_name(to, FALSE),
+				(long long)(timeofday - to->local->sendq_above_since),
+				qlen, limit);
+		}
+	}
+	else if (to->local->sendq_above_since)
+	{
+		if (class)
+			class->sendq_above_time += timeofday - to->local->sendq_above_since;
+		to->local->sendq_above_since = 0;
+		to->local->sendq_alerted = 0;
+	}
+}
+
 /** This is a callback function from the event loop.
- * All it does is call send_queued().
+ * All it does is call send_queued() -- with a drain budget, so one
+ * client with megabytes queued cannot monopolize the cycle.
  */
 void send_queued_cb(int fd, int revents, void *data)
 {
@@ -93,30 +187,80 @@ void send_queued_cb(int fd, int revents, void *data)
 	if (IsDeadSocket(to))
 		return;
 
-	send_queued(to);
+	send_queued_budget(to, sendq_drain_quantum(to));
 }
 
 /** This function is called when queued data might be ready to be
  * sent to the client. It is called from the event loop and also
  * a couple of other places (such as when closing the connection).
+ * This variant has no drain budget: it writes until the sendq is
+ * empty or the socket blocks.
  */
+MODVAR Tracepoint tp_send_queued = { NULL, "send_queued", 0, 0 };
+
 int send_queued(Client *to)
 {
-	int  len, rlen;
+	return send_queued_budget(to, 0);
+}
+
+/** Flush the sendq of 'to'. If 'budget' is non-zero then stop after
+ * roughly that many bytes and leave the remainder for the next main
+ * loop iteration, so flush cycles are shared fairly between clients.
+ */
+static int send_queued_budget(Client *to, int budget)
+{
+	int  len, rlen, iovcnt, sent = 0;
 	dbufbuf *block;
 	int want_read;
+	unsigned int qlen_at_flush;
+	Hook *h;
+	struct iovec iov[IOV_MAX];
 
 	/* We NEVER write to dead sockets. */
 	if (IsDeadSocket(to))
 		return -1;
 
+	qlen_at_flush = DBufLength(&to->local->sendQ);
+
+	TRACEPOINT(tp_send_queued, "%s: %d bytes pending, budget %d",
+		to->name, (int)DBufLength(&to->local->sendQ), budget);
+
+	/* Give protocol translation modules (websocket) a chance to emit
+	 * data they held back for coalescing, now that we are about to
+	 * actually write. A hook may kill the client (sendq overflow).
+	 */
+	for (h = Hooks[HOOKTYPE_PRE_SEND_QUEUED]; h; h = h->next)
+		(*(h->func.intfunc))(to);
+	if (IsDeadSocket(to))
+		return -1;
+
+	/* On a compressed link, data queued since the last write may still
+	 * be held inside the deflater. Push it out now so the peer receives
+	 * complete lines rather than a truncated compressed stream.
+	 */
+	if (to->local->zip && zip_is_out_active(to) && !zip_out_flush(to))
+		return -1;
+
 	while (DBufLength(&to->local->sendQ) > 0)
 	{
-		block = container_of(to->local->sendQ.dbuf_list.next, dbufbuf, dbuf_node);
-		len = block->size;
+		/* Gather the whole block chain (up to IOV_MAX entries)
+		 * so it can be flushed with one writev() syscall instead
+		 * of one write() per ~509 byte block.
+		 */
+		iovcnt = 0;
+		len = 0;
+		list_for_each_entry2(block, dbufbuf, &to->local->sendQ.dbuf_list, dbuf_node)
+		{
+			if (iovcnt == IOV_MAX)
+				break;
+			iov[iovcnt].iov_base = DBufBlockData(block);
+			iov[iovcnt].iov_len = block->size;
+			len += block->size;
+			iovcnt++;
+		}
 
 		/* Deliver it and check for fatal error.. */
-		if ((rlen = deliver_it(to, block->data, len, &want_read)) < 0)
+		if ((rlen = deliver_itv(to, iov, iovcnt, &want_read)) < 0)
 		{
 			char buf[256];
 			snprintf(buf, 256, "Write error: %s", STRERROR(ERRNO));
@@ -146,21 +290,84 @@ int send_queued(Client *to)
 			fd_setselect(to->local->fd, FD_SELECT_WRITE, send_queued_cb, to);
 			break;
 		}
+		sent += rlen;
+		if (budget && (sent >= budget) && (DBufLength(&to->local->sendQ) > 0))
+		{
+			/* This client used up its fair share of the flush cycle.
+			 * Put it back on the pending-write list so draining
+			 * continues next main loop iteration. Note that we do NOT
+			 * rely on write-ready notification here: the socket never
+			 * blocked, so an edge-triggered I/O engine would not
+			 * report it again.
+			 */
+			mark_data_to_send(to);
+			break;
+		}
 	}
 	
+	sendq_pressure_account(to, qlen_at_flush);
+
 	/* Nothing left to write, stop asking for write-ready notification. */
 	if ((DBufLength(&to->local->sendQ) == 0) && (to->local->fd >= 0))
 		fd_setselect(to->local->fd, FD_SELECT_WRITE, NULL, to);
 
+	/* If the connection was corked for burst output and the queue
+	 * has now fully drained, uncork so the final partial segment
+	 * leaves right away.
+	 */
+	if (to->local->corked && (DBufLength(&to->local->sendQ) == 0))
+		sock_set_cork(to, 0);
+
 	return (IsDeadSocket(to)) ? -1 : 0;
 }
 
-/** Mark "to" with "there is data to be send" */
+/** Mark "to" with "there is data to be send".
+ * The client is put on the pending-write list, which is flushed once
+ * per main loop iteration by flush_pending_writes(). This coalesces
+ * the many small lines a client receives in one loop turn into a
+ * single write, instead of arming write interest in the I/O engine
+ * for every individual message.
+ */
 void mark_data_to_send(Client *to)
 {
-	if (!IsDeadSocket(to) && (to->local->fd >= 0) && (DBufLength(&to->local->sendQ) > 0))
+	/* When a HOOKTYPE_PRE_SEND_QUEUED hook exists, outgoing data may
+	 * be held outside the sendq until flush time (frame coalescing),
+	 * so an empty sendq does not mean there is nothing to send.
+	 */
+	if (!IsDeadSocket(to) && (to->local->fd >= 0) &&
+	    ((DBufLength(&to->local->sendQ) > 0) || Hooks[HOOKTYPE_PRE_SEND_QUEUED]))
+	{
+		if (list_empty(&to->pend_write_node))
+			list_add_tail(&to->pend_write_node, &pending_write_list);
+	}
+}
+
+/** Flush all clients that queued outgoing data this main loop
+ * iteration. Called from SocketLoop(), both after I/O processing
+ * (to flush command replies) and before going to sleep in the I/O
+ * engine (to flush data generated by timers and events).
+ */
+void flush_pending_writes(void)
+{
+	Client *client, *next;
+	struct list_head flush_list;
+
+	/* Work on a private copy of the list: a client that exhausts its
+	 * drain budget puts itself back on pending_write_list, which must
+	 * take effect next cycle rather than extend the current one.
+	 */
+	INIT_LIST_HEAD(&flush_list);
+	list_splice_init(&pending_write_list, &flush_list);
+
+	list_for_each_entry_safe(client, next, &flush_list, pend_write_node)
 	{
-		fd_setselect(to->local->fd, FD_SELECT_WRITE, send_queued_cb, to);
+		list_del_init(&client->pend_write_node);
+		if (IsDeadSocket(client) || (client->local->fd < 0))
+			continue;
+		/* If this write is partial then send_queued() arms write
+		 * interest and the I/O engine takes over from there.
+		 */
+		send_queued_budget(client, sendq_drain_quantum(client));
 	}
 }
 
@@ -292,7 +499,7 @@ void sendbufto_one(Client *to, char *msg, unsigned int quick)
 			p[len++] = '\n';
 			p[len] = '\0';
 		}
-		len = strlen(msg); /* (note: we could use pointer jugling to avoid a strlen here) */
+		len += p - msg; /* add length of the message tags (if any), 'len' already covers the rest */
 	} else {
 		len = quick;
 	}
@@ -336,6 +543,8 @@ void sendbufto_one(Client *to, char *msg, unsigned int quick)
 
 	if (DBufLength(&to->local->sendQ) > get_sendq(to))
 	{
+		if (to->local->class)
+			to->local->class->sendq_overflows++;
 		if (IsServer(to))
 			sendto_ops("Max SendQ limit exceeded for %s: %u > %d",
 			    get_client_name(to, FALSE), DBufLength(&to->local->sendQ),
@@ -344,7 +553,20 @@ void sendbufto_one(Client *to, char *msg, unsigned int quick)
 		return;
 	}
 
-	dbuf_put(&to->local->sendQ, msg, len);
+	if (to->local->zip && zip_is_out_active(to))
+	{
+		/* Compressed server link: route through the deflater, which
+		 * appends the compressed form to the sendq itself.
+		 */
+		if (!zip_out_data(to, msg, len))
+			return;
+	}
+	else
+		dbuf_put(&to->local->sendQ, msg, len);
+
+	/* Track the sendq high watermark of the class, for STATS Y */
+	if (to->local->class && (DBufLength(&to->local->sendQ) > to->local->class->sendq_peak))
+		to->local->class->sendq_peak = DBufLength(&to->local->sendQ);
 
 	/*
 	 * Update statistics. The following is slightly incorrect
@@ -362,6 +584,268 @@ void sendbufto_one(Client *to, char *msg, unsigned int quick)
 	mark_data_to_send(to);
 }
 
+/** Queue an already formatted line to a client by reference.
+ * This is the counterpart of sendbufto_one() for channel fanout:
+ * instead of copying the bytes into the sendq of every recipient,
+ * the refcounted shared buffer is linked in and only the reference
+ * count is bumped. The buffer must contain a complete line,
+ * including the trailing CR+LF.
+ * @param to	The client to send to
+ * @param msg	The shared buffer holding the line
+ */
+void sendbufto_one_shared(Client *to, dbufshared *msg)
+{
+	if (to->direction)
+		to = to->direction;
+	if (IsDeadSocket(to))
+		return;
+	if (to->local->fd < 0)
+		return;
+
+	if (DBufLength(&to->local->sendQ) > get_sendq(to))
+	{
+		if (to->local->class)
+			to->local->class->sendq_overflows++;
+		if (IsServer(to))
+			sendto_ops("Max SendQ limit exceeded for %s: %u > %d",
+			    get_client_name(to, FALSE), DBufLength(&to->local->sendQ),
+			    get_sendq(to));
+		dead_socket(to, "Max SendQ exceeded");
+		return;
+	}
+
+	if (to->local->zip && zip_is_out_active(to))
+	{
+		/* Fanout targets are local users so this should not happen,
+		 * but if a compressed server link ever ends up here the bytes
+		 * must go through the deflater rather than in by reference.
+		 */
+		if (!zip_out_data(to, msg->data, (int)msg->size))
+			return;
+	}
+	else
+		dbuf_put_shared(&to->local->sendQ, msg);
+
+	/* Track the sendq high watermark of the class, for STATS Y */
+	if (to->local->class && (DBufLength(&to->local->sendQ) > to->local->class->sendq_peak))
+		to->local->class->sendq_peak = DBufLength(&to->local->sendQ);
+
+	to->local->sendM += 1;
+	me.local->sendM += 1;
+
+	mark_data_to_send(to);
+}
+
+/** Queue a batch of already formatted lines to a client.
+ * This is the counterpart of sendbufto_one() for burst generation
+ * (server sync): the caller renders many complete lines - each with
+ * the trailing CR+LF and within the usual length limits - into one
+ * large buffer and queues the whole thing with a single dbuf_put()
+ * instead of one pass through the send path per line.
+ * @param to	The client to send to
+ * @param msg	The buffer holding the lines
+ * @param len	Length of the buffer in bytes
+ * @param lines	Number of lines in the buffer (for the message counters)
+ */
+void sendbufto_one_batch(Client *to, char *msg, int len, int lines)
+{
+	Hook *h;
+	Client *intended_to = to;
+
+	if (to->direction)
+		to = to->direction;
+	if (IsDeadSocket(to))
+		return;
+	if (to->local->fd < 0)
+		return;
+
+	for (h = Hooks[HOOKTYPE_PACKET]; h; h = h->next)
+	{
+		(*(h->func.intfunc))(&me, to, intended_to, &msg, &len);
+		if (!msg)
+			return;
+	}
+
+	if (DBufLength(&to->local->sendQ) > get_sendq(to))
+	{
+		if (to->local->class)
+			to->local->class->sendq_overflows++;
+		if (IsServer(to))
+			sendto_ops("Max SendQ limit exceeded for %s: %u > %d",
+			    get_client_name(to, FALSE), DBufLength(&to->local->sendQ),
+			    get_sendq(to));
+		dead_socket(to, "Max SendQ exceeded");
+		return;
+	}
+
+	if (to->local->zip && zip_is_out_active(to))
+	{
+		/* Compressed server link (the sync burst compresses
+		 * particularly well): route through the deflater.
+		 */
+		if (!zip_out_data(to, msg, len))
+			return;
+	}
+	else
+		dbuf_put(&to->local->sendQ, msg, len);
+
+	/* Track the sendq high watermark of the class, for STATS Y */
+	if (to->local->class && (DBufLength(&to->local->sendQ) > to->local->class->sendq_peak))
+		to->local->class->sendq_peak = DBufLength(&to->local->sendQ);
+
+	to->local->sendM += lines;
+	me.local->sendM += lines;
+
+	mark_data_to_send(to);
+}
+
+/** Number of distinct capability-variants remembered per fanout.
+ * On real networks only a handful of cap combinations exist among
+ * the members of even very large channels.
+ */
+#define FANOUT_VARIANT_CACHE 8
+
+/** Per-message serialization cache for channel/common-channel fanout.
+ * Each distinct capability bitmask among the recipients gets the
+ * "@tags line" form serialized exactly once; all recipients sharing
+ * that cap set then reuse the same refcounted buffer.
+ */
+typedef struct FanoutCache FanoutCache;
+struct FanoutCache {
+	int cacheable;			/**< Can serializations be reused across clients with equal caps? */
+	int keyed;			/**< Key on caps (1) or is there just one variant for everyone (0)? */
+	int variants;			/**< Number of cached variants */
+	long caps[FANOUT_VARIANT_CACHE];	/**< Capability bitmask per variant */
+	dbufshared *buf[FANOUT_VARIANT_CACHE];	/**< Serialized line per variant */
+};
+
+/** Initialize a fanout cache and decide whether caching is safe.
+ * Serialization output may only be reused across clients with the
+ * same cap set if no tag has a dynamic outgoing filter (can_send),
+ * since such filters can differ between otherwise identical clients.
+ * PACKET hooks may rewrite the buffer per recipient, so those also
+ * force the per-recipient copying path.
+ */
+static void fanout_cache_init(FanoutCache *fc, MessageTag *mtags)
+{
+	MessageTag *m;
+
+	fc->variants = 0;
+	fc->keyed = (mtags != NULL);
+	fc->cacheable = Hooks[HOOKTYPE_PACKET] ? 0 : 1;
+
+	for (m = mtags; m && fc->cacheable; m = m->next)
+	{
+		MessageTagHandler *h = MessageTagHandlerFind(m->name);
+		if (h && h->can_send)
+			fc->cacheable = 0;
+	}
+}
+
+/** Release all shared buffers held by a fanout cache. */
+static void fanout_cache_free(FanoutCache *fc)
+{
+	int i;
+
+	for (i = 0; i < fc->variants; i++)
+		dbuf_shared_release(fc->buf[i]);
+	fc->variants = 0;
+}
+
+/** Deliver an already formatted line to one local recipient,
+ * serializing "@tags line" at most once per capability-variant
+ * (see FanoutCache above and sendbufto_one_shared()).
+ * @param to		The local recipient to deliver to
+ * @param mtags		The message tags for this message (can be NULL)
+ * @param line		The formatted line (including CR+LF)
+ * @param fc		The per-message fanout cache
+ */
+static void sendbufto_one_fanout(Client *to, MessageTag *mtags, char *line, FanoutCache *fc)
+{
+	long caps;
+	char *mtags_str;
+	dbufshared *shared;
+	int i;
+
+	if (!fc->cacheable)
+	{
+		/* Per-recipient serialization and copy, as before */
+		mtags_str = mtags ? mtags_to_string(mtags, to) : NULL;
+		if (BadPtr(mtags_str))
+		{
+			sendbufto_one(to, line, 0);
+		} else {
+			snprintf(sendbuf2, sizeof(sendbuf2), "@%s %s", mtags_str, line);
+			sendbufto_one(to, sendbuf2, 0);
+		}
+		return;
+	}
+
+	caps = fc->keyed ? to->local->caps : 0;
+
+	for (i = 0; i < fc->variants; i++)
+	{
+		if (fc->caps[i] == caps)
+		{
+			sendbufto_one_shared(to, fc->buf[i]);
+			return;
+		}
+	}
+
+	/* New variant: serialize once and remember it */
+	mtags_str = mtags ? mtags_to_string(mtags, to) : NULL;
+	if (BadPtr(mtags_str))
+	{
+		shared = dbuf_shared_create(line, strlen(line));
+	} else {
+		snprintf(sendbuf2, sizeof(sendbuf2), "@%s %s", mtags_str, line);
+		shared = dbuf_shared_create(sendbuf2, strlen(sendbuf2));
+	}
+	sendbufto_one_shared(to, shared);
+	if (fc->variants < FANOUT_VARIANT_CACHE)
+	{
+		fc->caps[fc->variants] = caps;
+		fc->buf[fc->variants++] = shared;
+	} else {
+		dbuf_shared_release(shared);
+	}
+}
+
+/** Stash of the most recent channel fanout. The echo-message copy for
+ * the sender is delivered right after sendto_channel() returns (via
+ * HOOKTYPE_CHANMSG) and its rendered form is identical to the
+ * recipients' copy, so instead of freeing the fanout line and the
+ * capability-variant serializations we keep them here for
+ * sendbufto_one_echo() to reuse. The stash is released again by the
+ * next fanout; the (mtags, serial) pair guards against stale reuse.
+ */
+static char fanout_echo_line[2048];
+static FanoutCache fanout_echo_fc;
+static MessageTag *fanout_echo_mtags = NULL;
+static int fanout_echo_serial = 0;
+static int fanout_echo_valid = 0;
+
+/** Deliver an echo-message copy of the most recent channel fanout to
+ * 'to' (the sender), reusing the rendered line and - when the sender
+ * shares a cap set with some recipient - the serialized buffer too.
+ * @param to	The client to deliver the echo to
+ * @param mtags	The message tags, must be the same list that was
+ *		passed to the sendto_channel() being echoed
+ * @returns 1 if delivered, 0 if there is nothing (valid) to reuse
+ *          and the caller must format its own copy.
+ */
+int sendbufto_one_echo(Client *to, MessageTag *mtags)
+{
+	if (!fanout_echo_valid ||
+	    (fanout_echo_mtags != mtags) ||
+	    (fanout_echo_serial != current_serial))
+	{
+		return 0;
+	}
+	sendbufto_one_fanout(to, mtags, fanout_echo_line, &fanout_echo_fc);
+	return 1;
+}
+
 /** A single function to send data to a channel.
  * Previously there were 6, now there is 1. This means there
  * are likely some parameters that you will pass as NULL or 0
@@ -388,10 +872,17 @@ void sendto_channel(Channel *channel, Client *from, Client *skip,
 {
 	va_list vl;
 	Member *lp;
+	MemberChunk *chunk;
+	int chunkslot;
 	Client *acptr;
+	char fanout_line[2048];
+	int fanout_line_built = 0;
+	FanoutCache fc;
+
+	fanout_cache_init(&fc, mtags);
 
 	++current_serial;
-	for (lp = channel->members; lp; lp = lp->next)
+	for_each_channel_member_chunked(channel, chunk, lp, chunkslot)
 	{
 		acptr = lp->client;
 
@@ -427,12 +918,20 @@ good:
 
 		if (MyUser(acptr))
 		{
-			/* Local client */
+			/* Local client. The formatted line is identical for
+			 * every local member, so we build it only once and
+			 * then share the bytes between recipients.
+			 */
 			if (sendflags & SEND_LOCAL)
 			{
-				va_start(vl, pattern);
-				vsendto_prefix_one(acptr, from, mtags, pattern, vl);
-				va_end(vl);
+				if (!fanout_line_built)
+				{
+					va_start(vl, pattern);
+					vmakebuf_local_withprefix(fanout_line, sizeof(fanout_line), from, pattern, vl);
+					va_end(vl);
+					fanout_line_built = 1;
+				}
+				sendbufto_one_fanout(acptr, mtags, fanout_line, &fc);
 			}
 		}
 		else
@@ -479,6 +978,23 @@ good:
 			}
 		}
 	}
+
+	/* Keep the rendered line and the variant serializations around
+	 * for an immediately following echo-message delivery, releasing
+	 * whatever the previous fanout left behind (see sendbufto_one_echo).
+	 */
+	fanout_cache_free(&fanout_echo_fc);
+	if (fanout_line_built)
+	{
+		strlcpy(fanout_echo_line, fanout_line, sizeof(fanout_echo_line));
+		fanout_echo_fc = fc; /* transfers ownership of the shared buffers */
+		fanout_echo_mtags = mtags;
+		fanout_echo_serial = current_serial;
+		fanout_echo_valid = 1;
+	} else {
+		fanout_cache_free(&fc);
+		fanout_echo_valid = 0;
+	}
 }
 
 /** Send a message to a server, taking into account server options if needed.
@@ -534,7 +1050,23 @@ void sendto_local_common_channels(Client *user, Client *skip, long clicap, Messa
 	va_list vl;
 	Membership *channels;
 	Member *users;
+	MemberChunk *chunk;
+	int chunkslot;
 	Client *acptr;
+	FanoutCache fc;
+
+	/* Nothing to do if no channel of 'user' has any local member.
+	 * This is the common case for events of remote users (away-notify,
+	 * account-notify, ..) during a services mass-identify, so bail out
+	 * before formatting the message or touching the fanout cache.
+	 */
+	if (!user->user)
+		return;
+	for (channels = user->user->channel; channels; channels = channels->next)
+		if (channels->channel->local_members)
+			break;
+	if (!channels)
+		return;
 
 	/* We now create the buffer _before_ we send it to the clients. -- Syzop */
 	*sendbuf = '\0';
@@ -542,13 +1074,23 @@ void sendto_local_common_channels(Client *user, Client *skip, long clicap, Messa
 	vmakebuf_local_withprefix(sendbuf, sizeof sendbuf, user, pattern, vl);
 	va_end(vl);
 
+	fanout_cache_init(&fc, mtags);
+
 	++current_serial;
 
 	if (user->user)
 	{
 		for (channels = user->user->channel; channels; channels = channels->next)
 		{
-			for (users = channels->channel->members; users; users = users->next)
+			/* Nothing to deliver for channels without local members.
+			 * During a netsplit most of the quitting users sit in
+			 * channels full of other remote users, so this single
+			 * counter check replaces the entire member walk there.
+			 */
+			if (!channels->channel->local_members)
+				continue;
+
+			for_each_channel_member_chunked(channels->channel, chunk, users, chunkslot)
 			{
 				acptr = users->client;
 
@@ -568,10 +1110,12 @@ void sendto_local_common_channels(Client *user, Client *skip, long clicap, Messa
 					continue; /* the sending user (quit'ing or nick changing) is 'invisible' -- skip */
 
 				acptr->local->serial = current_serial;
-				sendto_one(acptr, mtags, "%s", sendbuf);
+				sendbufto_one_fanout(acptr, mtags, sendbuf, &fc);
 			}
 		}
 	}
+
+	fanout_cache_free(&fc);
 }
 
 /*
@@ -734,6 +1278,93 @@ void sendto_umode_global(int umodes, FORMAT_STRING(const char *pattern), ...)
 	}
 }
 
+/** Per-snomask subscriber cache. Snotice emission used to walk the
+ * whole oper list testing snomask bits for every single event - at
+ * connect-storm rates that walk (and the formatting of notices that
+ * nobody was subscribed to) became measurable. Instead the subscribers
+ * of each snomask bit are kept in per-bit arrays, rebuilt lazily from
+ * oper_list after any change to oper status or snomasks (the mutation
+ * sites call invalidate_snomask_subscribers()). Emission then visits
+ * exactly the subscribers, and events without any subscriber are
+ * dropped before even formatting the text.
+ * Pointer safety: every path that removes a client from oper_list
+ * invalidates the cache, so the arrays can never hold an exited or
+ * de-opered client.
+ */
+#define SNOMASK_BITS 32
+static Client **snomask_subscribers[SNOMASK_BITS];
+static int snomask_subscriber_count[SNOMASK_BITS];
+static int snomask_subscriber_alloc[SNOMASK_BITS];
+static int snomask_union = 0; /**< OR of all local opers' snomasks */
+static int snomask_cache_built = 0;
+
+/** Throw away the per-snomask subscriber cache. Must be called
+ * whenever a local oper appears, disappears or changes snomasks.
+ */
+void invalidate_snomask_subscribers(void)
+{
+	snomask_cache_built = 0;
+}
+
+/** (Re)build the per-snomask subscriber cache from oper_list. */
+static void build_snomask_subscribers(void)
+{
+	Client *acptr;
+	int b;
+
+	memset(snomask_subscriber_count, 0, sizeof(snomask_subscriber_count));
+	snomask_union = 0;
+
+	list_for_each_entry(acptr, &oper_list, special_node)
+	{
+		snomask_union |= acptr->user->snomask;
+		for (b = 0; b < SNOMASK_BITS; b++)
+		{
+			if (!(acptr->user->snomask & (1 << b)))
+				continue;
+			if (snomask_subscriber_count[b] == snomask_subscriber_alloc[b])
+			{
+				Client **n;
+				snomask_subscriber_alloc[b] = snomask_subscriber_alloc[b] ? snomask_subscriber_alloc[b] * 2 : 8;
+				n = safe_alloc(sizeof(Client *) * snomask_subscriber_alloc[b]);
+				if (snomask_subscriber_count[b])
+					memcpy(n, snomask_subscribers[b], sizeof(Client *) * snomask_subscriber_count[b]);
+				safe_free(snomask_subscribers[b]);
+				snomask_subscribers[b] = n;
+			}
+			snomask_subscribers[b][snomask_subscriber_count[b]++] = acptr;
+		}
+	}
+
+	snomask_cache_built = 1;
+}
+
+/** Deliver 'nbuf' as a server notice to all subscribers of 'snomask'.
+ * The cache must be built. The serial guard prevents double delivery
+ * when 'snomask' is a multi-bit mask and a client subscribes to more
+ * than one of its bits.
+ */
+static void sendto_snomask_subscribers(int snomask, const char *nbuf)
+{
+	Client *acptr;
+	int b, i;
+
+	++current_serial;
+	for (b = 0; b < SNOMASK_BITS; b++)
+	{
+		if (!(snomask & (1 << b)))
+			continue;
+		for (i = 0; i < snomask_subscriber_count[b]; i++)
+		{
+			acptr = snomask_subscribers[b][i];
+			if (acptr->local->serial == current_serial)
+				continue; /* already received via another bit */
+			acptr->local->serial = current_serial;
+			sendnotice(acptr, "%s", nbuf);
+		}
+	}
+}
+
 /** Send to specified snomask - local / operonly.
  * @param snomask Snomask to send to (can be a bitmask [AND])
  * @param pattern printf-style pattern, followed by parameters.
@@ -742,18 +1373,19 @@ void sendto_umode_global(int umodes, FORMAT_STRING(const char *pattern), ...)
 void sendto_snomask(int snomask, FORMAT_STRING(const char *pattern), ...)
 {
 	va_list vl;
-	Client *acptr;
 	char nbuf[2048];
 
+	if (!snomask_cache_built)
+		build_snomask_subscribers();
+
+	if (!(snomask_union & snomask))
+		return; /* no subscribers at all: skip the formatting too */
+
 	va_start(vl, pattern);
 	ircvsnprintf(nbuf, sizeof(nbuf), pattern, vl);
 	va_end(vl);
 
-	list_for_each_entry(acptr, &oper_list, special_node)
-	{
-		if (acptr->user->snomask & snomask)
-			sendnotice(acptr, "%s", nbuf);
-	}
+	sendto_snomask_subscribers(snomask, nbuf);
 }
 
 /** Send to specified snomask - global / operonly.
@@ -764,7 +1396,6 @@ void sendto_snomask(int snomask, FORMAT_STRING(const char *pattern), ...)
 void sendto_snomask_global(int snomask, FORMAT_STRING(const char *pattern), ...)
 {
 	va_list vl;
-	Client *acptr;
 	int  i;
 	char nbuf[2048], snobuf[32], *p;
 
@@ -772,11 +1403,11 @@ void sendto_snomask_global(int snomask, FORMAT_STRING(const char *pattern), ...)
 	ircvsnprintf(nbuf, sizeof(nbuf), pattern, vl);
 	va_end(vl);
 
-	list_for_each_entry(acptr, &oper_list, special_node)
-	{
-		if (acptr->user->snomask & snomask)
-			sendnotice(acptr, "%s", nbuf);
-	}
+	if (!snomask_cache_built)
+		build_snomask_subscribers();
+
+	if (snomask_union & snomask)
+		sendto_snomask_subscribers(snomask, nbuf);
 
 	/* Build snomasks-to-send-to buffer */
 	snobuf[0] = '\0';
@@ -856,6 +1487,55 @@ void sendto_ops_butone(Client *one, Client *from, FORMAT_STRING(const char *patt
 	}
 }
 
+/* Return the length of the cached ":nick!user@host" sender prefix
+ * of 'from', (re)building it first if needed.
+ * Nick, username and host change rarely, so the formatted prefix is
+ * kept on the User and reused for every message the user sends to
+ * local targets. The cache is dropped by userhost_changed() on any
+ * user@host change, and a nick change is detected here since the
+ * nick the prefix was built for is remembered along with it.
+ */
+static int make_sender_prefix(Client *from)
+{
+	ClientUser *user = from->user;
+	char *p;
+
+	if (user->prefix.len && !strcmp(user->prefix.nick, from->name))
+		return user->prefix.len; /* cached and still valid */
+
+	p = user->prefix.buf;
+	*p = ':';
+	strcpy(p+1, from->name);
+
+	if (IsUser(from))
+	{
+		char *username = user->username;
+		char *host = GetHost(from);
+
+		if (*username)
+		{
+			strcat(p, "!");
+			strcat(p, username);
+		}
+		if (*host)
+		{
+			strcat(p, "@");
+			strcat(p, host);
+		}
+	}
+	if (IsUser(from))
+	{
+		strlcpy(user->prefix.nick, from->name, sizeof(user->prefix.nick));
+		user->prefix.len = strlen(p);
+		return user->prefix.len;
+	}
+	/* Not a fully registered user (yet): the prefix may still grow
+	 * the !user@host part, so don't mark the cache as valid.
+	 */
+	user->prefix.len = 0;
+	return strlen(p);
+}
+
 /* Prepare buffer based on format string and 'from' for LOCAL delivery.
  * The prefix (:<something>) will be expanded to :nick!user@host if 'from'
  * is a person, taking into account the rules for hidden/cloaked host.
@@ -874,36 +1554,20 @@ static int vmakebuf_local_withprefix(char *buf, size_t buflen, Client *from, con
 	 */
 	if (from && from->user && !strncmp(pattern, ":%s ", 4))
 	{
-		va_arg(vl, char *); /* eat first parameter */
+		int prefixlen = make_sender_prefix(from);
 
-		*buf = ':';
-		strcpy(buf+1, from->name);
+		va_arg(vl, char *); /* eat first parameter */
 
-		if (IsUser(from))
-		{
-			char *username = from->user->username;
-			char *host = GetHost(from);
+		memcpy(buf, from->user->prefix.buf, prefixlen);
 
-			if (*username)
-			{
-				strcat(buf, "!");
-				strcat(buf, username);
-			}
-			if (*host)
-			{
-				strcat(buf, "@");
-				strcat(buf, host);
-			}
-		}
 		/* Now build the remaining string */
-		ircvsnprintf(buf + strlen(buf), buflen - strlen(buf), &pattern[3], vl);
+		len = prefixlen + ircvsnprintf(buf + prefixlen, buflen - prefixlen, &pattern[3], vl);
 	}
 	else
 	{
-		ircvsnprintf(buf, buflen, pattern, vl);
+		len = ircvsnprintf(buf, buflen, pattern, vl);
 	}
 
-	len = strlen(buf);
 	ADD_CRLF(buf, len);
 	return len;
 }
@@ -984,13 +1648,19 @@ static char buf[2048];
 
 void sendto_connectnotice(Client *newuser, int disconnect, char *comment)
 {
-	Client *acptr;
 	char connect[512], secure[256];
 
 	if (!disconnect)
-	{
 		RunHook(HOOKTYPE_LOCAL_CONNECT, newuser);
 
+	if (!snomask_cache_built)
+		build_snomask_subscribers();
+
+	if (!(snomask_union & SNO_CLIENT))
+		return; /* no subscribers: skip the formatting too */
+
+	if (!disconnect)
+	{
 		*secure = '\0';
 		if (IsSecure(newuser))
 			snprintf(secure, sizeof(secure), " [secure %s]", tls_get_cipher(newuser->local->ssl));
@@ -1007,17 +1677,20 @@ void sendto_connectnotice(Client *newuser, int disconnect, char *comment)
 			newuser->name, newuser->user->username, newuser->user->realhost, newuser->ip, comment);
 	}
 
-	list_for_each_entry(acptr, &oper_list, special_node)
-	{
-		if (acptr->user->snomask & SNO_CLIENT)
-			sendnotice(acptr, "%s", connect);
-	}
+	sendto_snomask_subscribers(SNO_CLIENT, connect);
 }
 
 void sendto_fconnectnotice(Client *newuser, int disconnect, char *comment)
 {
 	Client *acptr;
 	char connect[512], secure[256];
+	int b, i;
+
+	if (!snomask_cache_built)
+		build_snomask_subscribers();
+
+	if (!(snomask_union & SNO_FCLIENT))
+		return; /* no subscribers: skip the formatting too */
 
 	if (!disconnect)
 	{
@@ -1037,10 +1710,19 @@ void sendto_fconnectnotice(Client *newuser, int disconnect, char *comment)
 			newuser->ip ? newuser->ip : "0", comment);
 	}
 
-	list_for_each_entry(acptr, &oper_list, special_node)
+	/* The notice is prefixed with the remote server and addressed to
+	 * each oper by nick, so the line cannot be shared - but at least
+	 * only the actual subscribers are visited.
+	 */
+	for (b = 0; b < SNOMASK_BITS; b++)
 	{
-		if (acptr->user->snomask & SNO_FCLIENT)
+		if (!(SNO_FCLIENT & (1 << b)))
+			continue;
+		for (i = 0; i < snomask_subscriber_count[b]; i++)
+		{
+			acptr = snomask_subscribers[b][i];
 			sendto_one(acptr, NULL, ":%s NOTICE %s :%s", newuser->user->server, acptr->name, connect);
+		}
 	}
 }
 
@@ -49,6 +49,18 @@ MOTDFile smotd;
 MODVAR TKL *tklines[TKLISTLEN];
 /** 2D hash list of TKL entries + IP address */
 MODVAR TKL *tklines_ip_hash[TKLIPHASHLEN1][TKLIPHASHLEN2];
+/** Source of TKL::id values. Lives here (and not in the tkl module)
+ * so ids stay unique across a module reload.
+ */
+MODVAR unsigned int tkl_id_sequence = 0;
+/** Min-heap of TKL entries ordered on TKL::expire_at, so expiry only
+ * needs to look at the earliest deadline. Maintained by the tkl module
+ * (see tkl_expiry_schedule), storage lives here like the lists above
+ * so it survives a module reload.
+ */
+MODVAR TKL **tkl_expiry_heap = NULL;
+MODVAR int tkl_expiry_heap_count = 0;
+MODVAR int tkl_expiry_heap_capacity = 0;
 int MODVAR spamf_ugly_vchanoverride = 0;
 
 void read_motd(const char *filename, MOTDFile *motd);
@@ -204,9 +216,10 @@ void send_proto(Client *client, ConfigItem_link *aconf)
 	 */
 
 	/* First line */
-	sendto_one(client, NULL, "PROTOCTL NOQUIT NICKv2 SJOIN SJOIN2 UMODE2 VL SJ3 TKLEXT TKLEXT2 NICKIP ESVID %s %s",
+	sendto_one(client, NULL, "PROTOCTL NOQUIT NICKv2 SJOIN SJOIN2 UMODE2 VL SJ3 TKLEXT TKLEXT2 TKLDSYNC NICKIP ESVID %s %s %s",
 	           iConf.ban_setter_sync ? "SJSBY" : "",
-	           ClientCapabilityFindReal("message-tags") ? "MTAGS" : "");
+	           ClientCapabilityFindReal("message-tags") ? "MTAGS" : "",
+	           (aconf && (aconf->options & CONNECT_COMPRESSED)) ? "COMPRESSION=zlib" : "");
 
 	/* Second line */
 	sendto_one(client, NULL, "PROTOCTL CHANMODES=%s%s,%s%s,%s%s,%s%s USERMODES=%s BOOTED=%lld PREFIX=%s SID=%s MLOCK TS=%lld EXTSWHOIS",
@@ -220,6 +233,144 @@ void send_proto(Client *client, ConfigItem_link *aconf)
 		allowed_channelchars_valtostr(iConf.allowed_channelchars));
 }
 
+/* Post-EOS sync scheduler.
+ *
+ * Some state is large but not needed for the link to be usable: TKLs
+ * are the prime example (tens of thousands of entries on big networks).
+ * Pushing all of it synchronously from server_sync() stacks it onto the
+ * already-huge user/channel burst and delays the moment the link is
+ * usable. Instead, modules register a sync generator here; after EOS
+ * has been sent to a freshly linked server the scheduler drains the
+ * generators in priority order, a bounded number of lines per main
+ * loop iteration, and backs off while the link's sendq is still busy
+ * with regular traffic. State that changes while this runs is covered
+ * by the normal broadcasts, which the new server already receives.
+ */
+
+/** Lines one generator may send to one server per main loop iteration */
+#define SYNCSCHED_BUDGET 500
+
+/** Don't generate more sync data while the sendq is above this */
+#define SYNCSCHED_SENDQ_BACKOFF 262144
+
+MODVAR SyncSchedGenerator *syncschedgenerators = NULL;
+
+/** Register a post-EOS sync generator.
+ * @param name		Name of the generator (eg "tkl")
+ * @param priority	Lower value runs earlier
+ * @param generate	See the SyncSchedGenerator description in struct.h
+ * @returns 1 on success, 0 if the name is already registered.
+ */
+int syncsched_register(char *name, int priority, int (*generate)(Client *to, int budget))
+{
+	SyncSchedGenerator *gen, *prev = NULL;
+
+	for (gen = syncschedgenerators; gen; gen = gen->next)
+		if (!strcmp(gen->name, name))
+			return 0;
+
+	gen = safe_alloc(sizeof(SyncSchedGenerator));
+	safe_strdup(gen->name, name);
+	gen->priority = priority;
+	gen->generate = generate;
+
+	/* Insert sorted by priority */
+	for (prev = syncschedgenerators; prev && prev->next && (prev->next->priority <= priority); prev = prev->next);
+	if (!syncschedgenerators || (syncschedgenerators->priority > priority))
+	{
+		gen->next = syncschedgenerators;
+		if (syncschedgenerators)
+			syncschedgenerators->prev = gen;
+		syncschedgenerators = gen;
+	} else
+	{
+		gen->next = prev->next;
+		gen->prev = prev;
+		if (prev->next)
+			prev->next->prev = gen;
+		prev->next = gen;
+	}
+	return 1;
+}
+
+/** Unregister a post-EOS sync generator (module unload).
+ * Servers it was currently feeding move on to the next generator.
+ */
+void syncsched_unregister(char *name)
+{
+	SyncSchedGenerator *gen;
+	Client *acptr;
+
+	for (gen = syncschedgenerators; gen; gen = gen->next)
+		if (!strcmp(gen->name, name))
+			break;
+	if (!gen)
+		return;
+
+	list_for_each_entry(acptr, &server_list, special_node)
+	{
+		if (acptr->serv->syncsched.gen == gen)
+		{
+			acptr->serv->syncsched.gen = gen->next;
+			acptr->serv->syncsched.cursor[0] = acptr->serv->syncsched.cursor[1] = 0;
+		}
+	}
+
+	DelListItem(gen, syncschedgenerators);
+	safe_free(gen->name);
+	safe_free(gen);
+}
+
+/** Begin the deferred sync to a freshly linked (local) server.
+ * Called from server_sync() right after EOS went out.
+ */
+void syncsched_start(Client *client)
+{
+	client->serv->syncsched.gen = syncschedgenerators;
+	client->serv->syncsched.cursor[0] = client->serv->syncsched.cursor[1] = 0;
+}
+
+/** Is any server still waiting for deferred sync data?
+ * Used by the main loop to shorten its I/O sleep while a sync is in
+ * progress, so the drain rate is not capped by SOCKETLOOP_MAX_DELAY.
+ */
+int syncsched_pending(void)
+{
+	Client *acptr;
+
+	list_for_each_entry(acptr, &server_list, special_node)
+		if (acptr->serv->syncsched.gen)
+			return 1;
+	return 0;
+}
+
+/** Drain a slice of deferred sync data to every server that still has
+ * some pending. Called once per main loop iteration.
+ */
+void syncsched_run(void)
+{
+	Client *acptr;
+
+	list_for_each_entry(acptr, &server_list, special_node)
+	{
+		if (!acptr->serv->syncsched.gen || IsDeadSocket(acptr))
+			continue;
+
+		/* Let regular traffic drain first: the whole point is that
+		 * the deferred state does not compete with it.
+		 */
+		if (DBufLength(&acptr->local->sendQ) > SYNCSCHED_SENDQ_BACKOFF)
+			continue;
+
+		if (!acptr->serv->syncsched.gen->generate(acptr, SYNCSCHED_BUDGET))
+		{
+			/* This generator is done for this server: move on */
+			acptr->serv->syncsched.gen = acptr->serv->syncsched.gen->next;
+			acptr->serv->syncsched.cursor[0] = acptr->serv->syncsched.cursor[1] = 0;
+		}
+	}
+}
+
 #ifndef IRCDTOTALVERSION
 #define IRCDTOTALVERSION BASE_VERSION "-" PATCH1 PATCH2 PATCH3 PATCH4 PATCH5 PATCH6 PATCH7 PATCH8 PATCH9
 #endif
@@ -793,13 +944,14 @@ void short_motd(Client *client)
                sendnumeric(client, RPL_MOTD, "");
        }
 
-       motdline = NULL;
-       if (themotd)
-	       motdline = themotd->lines;
-       while (motdline)
+       if (!send_motd_cache(client, themotd, RPL_MOTD))
        {
-               sendnumeric(client, RPL_MOTD, motdline->line);
-               motdline = motdline->next;
+               motdline = themotd->lines;
+               while (motdline)
+               {
+                       sendnumeric(client, RPL_MOTD, motdline->line);
+                       motdline = motdline->next;
+               }
        }
        sendnumeric(client, RPL_ENDOFMOTD);
 }
@@ -975,6 +1127,150 @@ void do_read_motd(const char *filename, MOTDFile *themotd)
 	return;
 }
 
+/** Free a pre-rendered motd cache (see send_motd_cache). */
+void motd_cache_free(MOTDCache *cache)
+{
+	int i;
+
+	if (!cache)
+		return;
+
+	for (i = 0; i < cache->numsegs; i++)
+		safe_free(cache->seg[i]);
+	safe_free(cache->seg);
+	safe_free(cache->seglen);
+	safe_free(cache);
+}
+
+/** Pre-render the reply body of a MOTD-like file: each line becomes
+ * ":me.name <numeric> " + <nick splice point> + " <formatted line>\r\n",
+ * serialized once. Delivery then only splices in the recipient's nick
+ * (see send_motd_cache below).
+ */
+static MOTDCache *motd_cache_render(MOTDFile *themotd, int numeric)
+{
+	MOTDCache *cache;
+	MOTDLine *motdline;
+	char prefix[HOSTLEN + 16];
+	char body[1024];
+	int numlines = 0, prefixlen, len, i;
+
+	for (motdline = themotd->lines; motdline; motdline = motdline->next)
+		numlines++;
+	if (!numlines)
+		return NULL;
+
+	cache = safe_alloc(sizeof(MOTDCache));
+	strlcpy(cache->servername, me.name, sizeof(cache->servername));
+	cache->numeric = numeric;
+	cache->numlines = numlines;
+	cache->numsegs = numlines * 3;
+	cache->seg = safe_alloc(sizeof(char *) * cache->numsegs);
+	cache->seglen = safe_alloc(sizeof(int) * cache->numsegs);
+
+	prefixlen = ircsnprintf(prefix, sizeof(prefix), ":%s %.3d ", me.name, numeric);
+
+	i = 0;
+	for (motdline = themotd->lines; motdline; motdline = motdline->next)
+	{
+		len = ircsnprintf(body, sizeof(body)-2, rpl_str(numeric), motdline->line);
+		body[len++] = '\r';
+		body[len++] = '\n';
+		body[len] = '\0';
+
+		safe_strdup(cache->seg[i], prefix);
+		cache->seglen[i] = prefixlen;
+		i++;
+		cache->seg[i] = NULL; /* nick splice point */
+		cache->seglen[i] = 0;
+		i++;
+		safe_strdup(cache->seg[i], body);
+		cache->seglen[i] = len;
+		i++;
+	}
+
+	return cache;
+}
+
+/** Deliver a MOTD-like file from its pre-rendered cache, splicing in
+ * the recipient's nick and queueing the entire reply body into the
+ * sendq as one buffer.
+ * The cache is (re)built on first use and after every (re)load since
+ * free_motd() drops it; a changed me.name is also detected here.
+ * @param client	The client to send to
+ * @param themotd	The MOTD-like file (motd, rules, ...)
+ * @param numeric	The per-line numeric (eg RPL_MOTD)
+ * @returns 1 on success, 0 if the cached path cannot be used and the
+ * caller should fall back to per-line sendnumeric() delivery (remote
+ * clients, or when PACKET hooks are loaded which must see each line).
+ */
+int send_motd_cache(Client *client, MOTDFile *themotd, int numeric)
+{
+	static char *assembly = NULL;
+	static int assembly_size = 0;
+	MOTDCache *cache;
+	char *nick, *p;
+	int nicklen, len, i;
+
+	if (!MyConnect(client) || Hooks[HOOKTYPE_PACKET])
+		return 0;
+
+	if (!themotd->cache ||
+	    (themotd->cache->numeric != numeric) ||
+	    strcmp(themotd->cache->servername, me.name))
+	{
+		motd_cache_free(themotd->cache);
+		themotd->cache = motd_cache_render(themotd, numeric);
+		if (!themotd->cache)
+			return 0;
+	}
+	cache = themotd->cache;
+
+	if (IsDeadSocket(client) || (client->local->fd < 0))
+		return 1; /* swallow, as sendbufto_one() would */
+
+	nick = *client->name ? client->name : "*";
+	nicklen = strlen(nick);
+
+	/* Compute the total size and (re)size the assembly buffer */
+	len = 0;
+	for (i = 0; i < cache->numsegs; i++)
+		len += cache->seg[i] ? cache->seglen[i] : nicklen;
+	if (len + 1 > assembly_size)
+	{
+		safe_free(assembly);
+		assembly_size = len + 1;
+		assembly = safe_alloc(assembly_size);
+	}
+
+	p = assembly;
+	for (i = 0; i < cache->numsegs; i++)
+	{
+		if (cache->seg[i])
+		{
+			memcpy(p, cache->seg[i], cache->seglen[i]);
+			p += cache->seglen[i];
+		} else {
+			memcpy(p, nick, nicklen);
+			p += nicklen;
+		}
+	}
+
+	if (DBufLength(&client->local->sendQ) > get_sendq(client))
+	{
+		dead_socket(client, "Max SendQ exceeded");
+		return 1;
+	}
+
+	dbuf_put(&client->local->sendQ, assembly, len);
+
+	client->local->sendM += cache->numlines;
+	me.local->sendM += cache->numlines;
+
+	mark_data_to_send(client);
+	return 1;
+}
+
 /** Free the contents of a MOTDFile structure.
  * The MOTDFile structure itself should be statically
  * allocated and deallocated. If the caller wants, it must
@@ -997,6 +1293,9 @@ void free_motd(MOTDFile *themotd)
 	themotd->lines = NULL;
 	memset(&themotd->last_modified, '\0', sizeof(struct tm));
 
+	motd_cache_free(themotd->cache);
+	themotd->cache = NULL;
+
 #ifdef USE_LIBCURL
 	/* see struct.h for more information about motd_download */
 	themotd->motd_download = NULL;
@@ -1306,4 +1605,5 @@ void lost_server_link(Client *serv, FORMAT_STRING(const char *fmt), ...)
 
 	/* Always log! */
 	ircd_log(LOG_ERROR, "%s", buf);
+	flight_record("%s", buf);
 }
@@ -170,6 +170,183 @@ void report_baderror(char *text, Client *client)
 	return;
 }
 
+/* Pre-handshake connection flood sketch.
+ *
+ * The regular connect-flood throttle (throttle_can_connect) and the TLS
+ * anti-DoS module only run after we have allocated a Client and - for TLS
+ * listeners - an SSL object, so a determined flood source still costs us
+ * an allocation+teardown per connection attempt. This is a count-min
+ * sketch over the same set::anti-flood::connect-flood window, consulted
+ * straight after accept() while all we have is the fd: rejecting a flood
+ * source costs a getpeername() and two hashes, not a handshake.
+ *
+ * Since the sketch is probabilistic and is consulted before we can match
+ * except throttle { } blocks, it only kicks in at ten times the
+ * configured connect-flood limit: legitimate bursts are left entirely to
+ * the precise per-IP throttle.
+ */
+#define CONNSKETCH_ROWS 2
+#define CONNSKETCH_COLS 1024	/* must be a power of two */
+
+static unsigned short connsketch[CONNSKETCH_ROWS][CONNSKETCH_COLS];
+static time_t connsketch_since = 0;
+static char connsketch_key[CONNSKETCH_ROWS][16];
+static int connsketch_key_set = 0;
+
+/** Count a connection attempt in the sketch and check it against the limit.
+ * @param fd	The (just accepted) file descriptor
+ * @param ipv6	Was this an IPv6 listener?
+ * @retval 1 The source is flooding, reject before allocating anything.
+ * @retval 0 Proceed as normal.
+ */
+static int connection_flood_sketch(int fd, int ipv6)
+{
+	const char *addr_bytes;
+	size_t addr_len;
+	int limit, r;
+	unsigned short lowest = 0xFFFF;
+	struct sockaddr_in6 addr6;
+	struct sockaddr_in addr4;
+
+	if (!THROTTLING_PERIOD || !THROTTLING_COUNT)
+		return 0; /* connect-flood protection is disabled */
+
+	if (!connsketch_key_set)
+	{
+		for (r = 0; r < CONNSKETCH_ROWS; r++)
+			siphash_generate_key(connsketch_key[r]);
+		connsketch_key_set = 1;
+	}
+
+	/* Lazily reset the counters each throttle window */
+	if (TStime() - connsketch_since >= THROTTLING_PERIOD)
+	{
+		memset(connsketch, 0, sizeof(connsketch));
+		connsketch_since = TStime();
+	}
+
+	if (ipv6)
+	{
+		int len = sizeof(addr6);
+		if (getpeername(fd, (struct sockaddr *)&addr6, &len) < 0)
+			return 0; /* add_connection() will deal with it */
+		addr_bytes = (const char *)&addr6.sin6_addr.s6_addr;
+		addr_len = 16;
+	} else
+	{
+		int len = sizeof(addr4);
+		if (getpeername(fd, (struct sockaddr *)&addr4, &len) < 0)
+			return 0;
+		addr_bytes = (const char *)&addr4.sin_addr.s_addr;
+		addr_len = 4;
+	}
+
+	limit = THROTTLING_COUNT * 10;
+	if (limit < 30)
+		limit = 30;
+
+	for (r = 0; r < CONNSKETCH_ROWS; r++)
+	{
+		int i = siphash_raw(addr_bytes, addr_len, connsketch_key[r]) & (CONNSKETCH_COLS-1);
+		if (connsketch[r][i] < 0xFFFF)
+			connsketch[r][i]++;
+		if (connsketch[r][i] < lowest)
+			lowest = connsketch[r][i];
+	}
+
+	return (lowest > limit) ? 1 : 0;
+}
+
+/* Survival mode: early-drop under accept pressure.
+ *
+ * When the accept rate explodes or the fd table nears exhaustion we are
+ * usually not dealing with users but with a flood or a reconnect storm,
+ * and every connection we fully process (Client allocation, DNS, ident,
+ * possibly a TLS handshake) digs the hole deeper. While armed, a
+ * connection from an IP without an established reputation gets one
+ * static refusal line and a close straight after accept() - the same
+ * idea as the 'All connections in use' path, but selective: IPs with a
+ * reputation record (kept by src/modules/reputation.c in the shared
+ * ipstate table) still get the full handshake, so regulars can get on
+ * during an attack.
+ */
+#define SURVIVAL_ACCEPT_RATE 100	/* accepts per second that arm survival mode */
+#define SURVIVAL_HOLD_TIME 30		/* seconds armed after the last trigger */
+
+static time_t survival_until = 0;
+static time_t survival_second = 0;
+static int survival_accepts = 0;
+static int survival_reputation_slot = -1;
+
+/** Count an accept() towards the pressure gauge and report the mode.
+ * @retval 1 Armed: apply the cheap denial path to unknown IPs.
+ * @retval 0 Normal operation.
+ */
+static int survival_mode_active(void)
+{
+	if (TStime() != survival_second)
+	{
+		survival_second = TStime();
+		survival_accepts = 0;
+	}
+	survival_accepts++;
+
+	if ((survival_accepts == SURVIVAL_ACCEPT_RATE) ||
+	    (OpenFiles >= maxclients - (maxclients / 10)))
+	{
+		if (!survival_until)
+			sendto_ops_and_log("High accept pressure: survival mode armed, "
+				"connections from IPs without reputation are refused early");
+		survival_until = TStime() + SURVIVAL_HOLD_TIME;
+	} else
+	if (survival_until && (TStime() > survival_until))
+	{
+		sendto_ops_and_log("Accept pressure back to normal: survival mode disarmed");
+		survival_until = 0;
+	}
+
+	return survival_until ? 1 : 0;
+}
+
+/** The cheap denial path: refuse 'fd' if its IP has no reputation.
+ * Uses the same getpeername()+inetntop() route as getpeerip() so the
+ * string matches what the reputation module stored for earlier clients.
+ * @param fd	The (just accepted) file descriptor
+ * @param ipv6	Was this an IPv6 listener?
+ * @retval 1 Refused: a static refusal was written, caller must close.
+ * @retval 0 The IP is known (or undeterminable), proceed as normal.
+ */
+static int survival_mode_refuse(int fd, int ipv6)
+{
+	char ipbuf[HOSTLEN+1];
+	char *ip;
+	struct sockaddr_in6 addr6;
+	struct sockaddr_in addr4;
+
+	if (survival_reputation_slot == -1)
+		survival_reputation_slot = ipstate_slot_request("reputation", NULL);
+
+	if (ipv6)
+	{
+		int len = sizeof(addr6);
+		if (getpeername(fd, (struct sockaddr *)&addr6, &len) < 0)
+			return 0; /* add_connection() will deal with it */
+		ip = inetntop(AF_INET6, &addr6.sin6_addr.s6_addr, ipbuf, sizeof(ipbuf));
+	} else
+	{
+		int len = sizeof(addr4);
+		if (getpeername(fd, (struct sockaddr *)&addr4, &len) < 0)
+			return 0;
+		ip = inetntop(AF_INET, &addr4.sin_addr.s_addr, ipbuf, sizeof(ipbuf));
+	}
+
+	if (!ip || ipstate_get(ip, survival_reputation_slot))
+		return 0; /* this IP has been here before: let it through */
+
+	(void)send(fd, "ERROR :Server is under heavy load, please try again later\r\n", 59, 0);
+	return 1;
+}
+
 /** Accept an incoming connection.
  * @param listener_fd	The file descriptor of a listen() socket.
  * @param data		The listen { } block configuration data.
@@ -179,47 +356,395 @@ static void listener_accept(int listener_fd, int revents, void *data)
 	ConfigItem_listen *listener = data;
 	int cli_fd;
 
-	if ((cli_fd = fd_accept(listener->fd)) < 0)
+	/* Accept everything that is pending, not just one connection:
+	 * this handles connect bursts in a single event and is required
+	 * for correctness with an edge-triggered I/O engine, which will
+	 * not notify us again for connections we left in the backlog.
+	 */
+	while (1)
 	{
-		if ((ERRNO != P_EWOULDBLOCK) && (ERRNO != P_ECONNABORTED))
+		if ((cli_fd = fd_accept(listener_fd)) < 0)
+		{
+			if ((ERRNO != P_EWOULDBLOCK) && (ERRNO != P_ECONNABORTED))
+			{
+				/* Trouble! accept() returns a strange error.
+				 * Previously in such a case we would just log/broadcast the error and return,
+				 * causing this message to be triggered at a rate of XYZ per second (100% CPU).
+				 * Now we close & re-start the listener.
+				 * Of course the underlying cause of this issue should be investigated, as this
+				 * is very much a workaround.
+				 */
+				report_baderror("Cannot accept connections %s:%s", NULL);
+				sendto_realops("[BUG] Restarting listener on %s:%d due to fatal errors (see previous message)", listener->ip, listener->port);
+				close_listener(listener);
+				start_listeners();
+			}
+			return;
+		}
+
+		ircstats.is_ac++;
+
+		set_sock_opts(cli_fd, NULL, listener->ipv6);
+
+		if (connection_flood_sketch(cli_fd, listener->ipv6))
 		{
-			/* Trouble! accept() returns a strange error.
-			 * Previously in such a case we would just log/broadcast the error and return,
-			 * causing this message to be triggered at a rate of XYZ per second (100% CPU).
-			 * Now we close & re-start the listener.
-			 * Of course the underlying cause of this issue should be investigated, as this
-			 * is very much a workaround.
+			/* Flood source: reject before we allocate a Client or
+			 * start a TLS handshake. No ERROR reply either, the
+			 * whole point is to make these attempts as cheap as
+			 * possible for us.
 			 */
-			report_baderror("Cannot accept connections %s:%s", NULL);
-			sendto_realops("[BUG] Restarting listener on %s:%d due to fatal errors (see previous message)", listener->ip, listener->port);
-			close_listener(listener);
-			start_listeners();
+			ircstats.is_ref++;
+			fd_close(cli_fd);
+			continue;
+		}
+
+		if (survival_mode_active() && survival_mode_refuse(cli_fd, listener->ipv6))
+		{
+			ircstats.is_ref++;
+			fd_close(cli_fd);
+			continue;
 		}
+
+		if ((++OpenFiles >= maxclients) || (cli_fd >= maxclients))
+		{
+			ircstats.is_ref++;
+			if (last_allinuse < TStime() - 15)
+			{
+				sendto_ops_and_log("All connections in use. ([@%s/%u])", listener->ip, listener->port);
+				last_allinuse = TStime();
+			}
+
+			(void)send(cli_fd, "ERROR :All connections in use\r\n", 31, 0);
+
+			fd_close(cli_fd);
+			--OpenFiles;
+			return;
+		}
+
+		/* add_connection() may fail. we just don't care. */
+		add_connection(listener, cli_fd);
+	}
+}
+
+/* Listener handover across /RESTART.
+ *
+ * When the daemon restarts itself (server_reboot) it normally closes
+ * every file descriptor and exec()'s the new binary, which leaves a
+ * window in which nothing is listening and - worse - the new instance
+ * can lose a bind() race against lingering sockets. To avoid that we
+ * keep the bound listening sockets open across the exec(): the old
+ * instance describes them in an environment variable and the new
+ * instance adopts any socket that still matches a listen { } block
+ * instead of binding anew. The kernel keeps queueing connections on
+ * the inherited sockets throughout the restart, so connecting clients
+ * never see a refused or timed out connect.
+ *
+ * Existing client connections are still closed: handing those over
+ * would also require migrating per-client state (registration, dbuf
+ * queues, TLS sessions) which does not fit this tree.
+ */
+#ifndef _WIN32
+
+#define LISTENER_HANDOVER_ENVVAR "UNREALIRCD_LISTENER_FDS"
+
+/** A listening socket inherited from the previous instance */
+typedef struct InheritedListener InheritedListener;
+struct InheritedListener {
+	InheritedListener *prev, *next;
+	char *ip;	/**< IP the socket is bound on (already normalized) */
+	int port;	/**< Port the socket is bound on */
+	int ipv6;	/**< IPv6 (1) or IPv4 (0) */
+	int fd;		/**< The inherited socket, bound and listening */
+};
+
+static InheritedListener *inherited_listeners = NULL;
+
+/** The fds we are deliberately passing on to the exec()'d binary,
+ * so server_reboot() knows to not close them.
+ */
+static int *handover_fds = NULL;
+static int handover_fd_count = 0;
+
+/** Record one listening socket in the handover set.
+ * The record format is "fd,port,ipv6,ip" - the IP comes last because
+ * IPv6 addresses contain ':' and we keep ',' out of the other fields.
+ */
+static void listener_handover_add(int fd, ConfigItem_listen *listener, char *ip, char *buf, int bufsize)
+{
+	char entry[128];
+
+	(void)fcntl(fd, F_SETFD, 0); /* clear FD_CLOEXEC so it survives the exec() */
+	ircsnprintf(entry, sizeof(entry), "%s%d,%d,%d,%s",
+		*buf ? " " : "", fd, listener->port, listener->ipv6, ip);
+	strlcat(buf, entry, bufsize);
+	handover_fds[handover_fd_count++] = fd;
+}
+
+/** Describe all bound listening sockets in the environment so the
+ * binary we are about to exec() can adopt them. Called from
+ * server_reboot() just before the big close() loop.
+ */
+void prepare_listener_handover(void)
+{
+	ConfigItem_listen *listener;
+	char *buf;
+	char *ip;
+	int count = 0;
+	int bufsize;
+	int i;
+
+	for (listener = conf_listen; listener; listener = listener->next)
+		if (listener->fd >= 0)
+			count += 1 + listener->shards;
+	if (!count)
+		return;
+
+	safe_free(handover_fds);
+	handover_fds = safe_alloc(sizeof(int) * count);
+	handover_fd_count = 0;
+
+	/* Each record is at most ~64 bytes (fd, port, ipv6 flag, an IPv6
+	 * address and separators); size the buffer from the fd count so a
+	 * config with many listeners or reuse-port shards never truncates
+	 * the description - a truncated record would leave a still-bound
+	 * socket that the new instance neither adopts nor closes.
+	 */
+	bufsize = count * 128 + 1;
+	buf = safe_alloc(bufsize);
+	*buf = '\0';
+	for (listener = conf_listen; listener; listener = listener->next)
+	{
+		if (listener->fd < 0)
+			continue;
+		/* Normalize the IP the same way unreal_listen() does,
+		 * since that is what the new instance will match against.
+		 */
+		ip = listener->ip;
+		if (BadPtr(ip) || (*ip == '*'))
+			ip = listener->ipv6 ? "::" : "0.0.0.0";
+		listener_handover_add(listener->fd, listener, ip, buf, bufsize);
+		for (i = 0; i < listener->shards; i++)
+			listener_handover_add(listener->shard_fd[i], listener, ip, buf, bufsize);
+	}
+
+	setenv(LISTENER_HANDOVER_ENVVAR, buf, 1); /* setenv() copies the string */
+	safe_free(buf);
+}
+
+/** Is this an fd we are handing over to the exec()'d binary? */
+int is_handover_listener_fd(int fd)
+{
+	int i;
+
+	for (i = 0; i < handover_fd_count; i++)
+		if (handover_fds[i] == fd)
+			return 1;
+	return 0;
+}
+
+/** Pick up any listening sockets the previous instance handed us.
+ * Called at boot before the listen { } blocks are activated.
+ */
+void listener_handover_read(void)
+{
+	char *buf = NULL;
+	char *record, *p = NULL;
+	char *env = getenv(LISTENER_HANDOVER_ENVVAR);
+	int count = 0;
+
+	if (!env)
 		return;
+
+	safe_strdup(buf, env); /* strtoken() below modifies the string */
+	/* Don't hand stale fd numbers down to yet another restart */
+	unsetenv(LISTENER_HANDOVER_ENVVAR);
+
+	for (record = strtoken(&p, buf, " "); record; record = strtoken(&p, NULL, " "))
+	{
+		InheritedListener *e;
+		char *portstr, *ipv6str, *ip;
+		int fd, port;
+
+		if (!(portstr = strchr(record, ',')))
+			continue;
+		*portstr++ = '\0';
+		if (!(ipv6str = strchr(portstr, ',')))
+			continue;
+		*ipv6str++ = '\0';
+		if (!(ip = strchr(ipv6str, ',')))
+			continue;
+		*ip++ = '\0';
+
+		fd = atoi(record);
+		port = atoi(portstr);
+		if ((fd < 3) || (fd >= MAXCONNECTIONS) || (port < 1) || (port > 65535) || BadPtr(ip))
+			continue;
+		if (fcntl(fd, F_GETFD) == -1)
+			continue; /* fd is not actually open - stale entry */
+
+		e = safe_alloc(sizeof(InheritedListener));
+		safe_strdup(e->ip, ip);
+		e->port = port;
+		e->ipv6 = atoi(ipv6str) ? 1 : 0;
+		e->fd = fd;
+		AddListItem(e, inherited_listeners);
+		count++;
+	}
+
+	safe_free(buf);
+
+	if (count)
+		ircd_log(LOG_ERROR, "Inherited %d listening socket(s) from the previous instance", count);
+}
+
+/** Take a matching inherited socket out of the handover set, if any.
+ * @returns The (bound and listening) fd, or -1 if we have none for
+ * this ip+port.
+ */
+static int adopt_inherited_listener(char *ip, int port, int ipv6)
+{
+	InheritedListener *e;
+	int fd;
+
+	for (e = inherited_listeners; e; e = e->next)
+		if ((e->port == port) && (e->ipv6 == ipv6) && !strcmp(e->ip, ip))
+			break;
+	if (!e)
+		return -1;
+
+	fd = e->fd;
+	DelListItem(e, inherited_listeners);
+	safe_free(e->ip);
+	safe_free(e);
+
+	return fd_open(fd, "Listener socket (inherited)");
+}
+
+/** Close any inherited sockets that no listen { } block claimed,
+ * eg. because the configuration changed between the restarts.
+ * Called at boot right after the listen { } blocks are activated.
+ */
+void listener_handover_finish(void)
+{
+	InheritedListener *e, *e_next;
+
+	for (e = inherited_listeners; e; e = e_next)
+	{
+		e_next = e->next;
+		ircd_log(LOG_ERROR, "Closing inherited listening socket for %s:%d (%s): no longer in the configuration",
+			e->ip, e->port, e->ipv6 ? "IPv6" : "IPv4");
+		close(e->fd);
+		safe_free(e->ip);
+		safe_free(e);
 	}
+	inherited_listeners = NULL;
+}
 
-	ircstats.is_ac++;
+#endif /* !_WIN32 */
 
-	set_sock_opts(cli_fd, NULL, listener->ipv6);
+/** Open a single listening socket for a listen { } block.
+ * Split out of unreal_listen() so a listen block with
+ * listen::reuse-port can open several of these on the same ip+port.
+ * @param listener	The listen { } block configuration
+ * @param ip		IP address to bind on (already normalized)
+ * @param port		Port to bind on
+ * @param ipv6		IPv6 (1) or IPv4 (0)
+ * @returns The file descriptor on success, -1 on error.
+ */
+static int unreal_listen_fd(ConfigItem_listen *listener, char *ip, int port, int ipv6)
+{
+	int fd;
 
-	if ((++OpenFiles >= maxclients) || (cli_fd >= maxclients))
+#ifndef _WIN32
+	/* A previous instance of ourselves may have handed us this
+	 * socket across the restart exec(). If so, adopt it instead of
+	 * binding anew: it is already bound and listening and the kernel
+	 * kept accepting connections on it throughout the restart.
+	 */
+	fd = adopt_inherited_listener(ip, port, ipv6);
+	if (fd >= 0)
+	{
+		if (++OpenFiles >= maxclients)
+		{
+			sendto_ops_and_log("No more connections allowed (%s)", listener->ip);
+			fd_close(fd);
+			--OpenFiles;
+			return -1;
+		}
+		set_sock_opts(fd, NULL, ipv6);
+	}
+	else
+#endif
 	{
-		ircstats.is_ref++;
-		if (last_allinuse < TStime() - 15)
+		fd = fd_socket(ipv6 ? AF_INET6 : AF_INET, SOCK_STREAM, 0, "Listener socket");
+		if (fd < 0)
+		{
+			report_baderror("Cannot open stream socket() %s:%s", NULL);
+			return -1;
+		}
+
+		if (++OpenFiles >= maxclients)
 		{
-			sendto_ops_and_log("All connections in use. ([@%s/%u])", listener->ip, listener->port);
-			last_allinuse = TStime();
+			sendto_ops_and_log("No more connections allowed (%s)", listener->ip);
+			fd_close(fd);
+			--OpenFiles;
+			return -1;
 		}
 
-		(void)send(cli_fd, "ERROR :All connections in use\r\n", 31, 0);
+		set_sock_opts(fd, NULL, ipv6);
 
-		fd_close(cli_fd);
-		--OpenFiles;
-		return;
+#ifdef SO_REUSEPORT
+		if (listener->reuseport > 1)
+		{
+			int opt = 1;
+
+			(void)setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void *)&opt, sizeof(opt));
+		}
+#endif
+
+		if (!unreal_bind(fd, ip, port, ipv6))
+		{
+			char buf[512];
+			ircsnprintf(buf, sizeof(buf), "Error binding stream socket to IP %s port %d", ip, port);
+			strlcat(buf, " - %s:%s", sizeof(buf));
+			report_baderror(buf, NULL);
+			fd_close(fd);
+			--OpenFiles;
+			return -1;
+		}
+
+		if (listen(fd, LISTEN_SIZE) < 0)
+		{
+			report_error("listen failed for %s:%s", NULL);
+			fd_close(fd);
+			--OpenFiles;
+			return -1;
+		}
+	}
+
+#ifdef TCP_DEFER_ACCEPT
+	if (listener->options & LISTENER_DEFER_ACCEPT)
+	{
+		int yes = 1;
+
+		(void)setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &yes, sizeof(int));
+	}
+#endif
+
+#ifdef SO_ACCEPTFILTER
+	if (listener->options & LISTENER_DEFER_ACCEPT)
+	{
+		struct accept_filter_arg afa;
+
+		memset(&afa, '\0', sizeof afa);
+		strlcpy(afa.af_name, "dataready", sizeof afa.af_name);
+		(void)setsockopt(fd, SOL_SOCKET, SO_ACCEPTFILTER, &afa, sizeof afa);
 	}
+#endif
+
+	fd_setselect(fd, FD_SELECT_READ, listener_accept, listener);
 
-	/* add_connection() may fail. we just don't care. */
-	add_connection(listener, cli_fd);
+	return fd;
 }
 
 /** Create a listener port.
@@ -233,7 +758,7 @@ int unreal_listen(ConfigItem_listen *listener, char *ip, int port, int ipv6)
 {
 	if (BadPtr(ip))
 		ip = "*";
-	
+
 	if (*ip == '*')
 	{
 		if (ipv6)
@@ -245,71 +770,45 @@ int unreal_listen(ConfigItem_listen *listener, char *ip, int port, int ipv6)
 	/* At first, open a new socket */
 	if (listener->fd >= 0)
 		abort(); /* Socket already exists but we are asked to create and listen on one. Bad! */
-	
+
 	if (port == 0)
 		abort(); /* Impossible as well, right? */
 
-	listener->fd = fd_socket(ipv6 ? AF_INET6 : AF_INET, SOCK_STREAM, 0, "Listener socket");
+	listener->fd = unreal_listen_fd(listener, ip, port, ipv6);
 	if (listener->fd < 0)
 	{
-		report_baderror("Cannot open stream socket() %s:%s", NULL);
-		return -1;
-	}
-
-	if (++OpenFiles >= maxclients)
-	{
-		sendto_ops_and_log("No more connections allowed (%s)", listener->ip);
-		fd_close(listener->fd);
-		listener->fd = -1;
-		--OpenFiles;
-		return -1;
-	}
-
-	set_sock_opts(listener->fd, NULL, ipv6);
-
-	if (!unreal_bind(listener->fd, ip, port, ipv6))
-	{
-		char buf[512];
-		ircsnprintf(buf, sizeof(buf), "Error binding stream socket to IP %s port %d", ip, port);
-		strlcat(buf, " - %s:%s", sizeof(buf));
-		report_baderror(buf, NULL);
-		fd_close(listener->fd);
-		listener->fd = -1;
-		--OpenFiles;
-		return -1;
-	}
-
-	if (listen(listener->fd, LISTEN_SIZE) < 0)
-	{
-		report_error("listen failed for %s:%s", NULL);
-		fd_close(listener->fd);
 		listener->fd = -1;
-		--OpenFiles;
 		return -1;
 	}
 
-#ifdef TCP_DEFER_ACCEPT
-	if (listener->options & LISTENER_DEFER_ACCEPT)
-	{
-		int yes = 1;
-
-		(void)setsockopt(listener->fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &yes, sizeof(int));
-	}
-#endif
-
-#ifdef SO_ACCEPTFILTER
-	if (listener->options & LISTENER_DEFER_ACCEPT)
+#ifdef SO_REUSEPORT
+	/* With listen::reuse-port we open extra sockets on the same
+	 * ip+port, so the kernel spreads incoming connections over
+	 * multiple accept queues instead of serializing a connect flood
+	 * on a single one. They all funnel into listener_accept() with
+	 * the same listen block.
+	 */
+	if (listener->reuseport > 1)
 	{
-		struct accept_filter_arg afa;
+		int i, fd;
 
-		memset(&afa, '\0', sizeof afa);
-		strlcpy(afa.af_name, "dataready", sizeof afa.af_name);
-		(void)setsockopt(listener->fd, SOL_SOCKET, SO_ACCEPTFILTER, &afa, sizeof afa);
+		listener->shards = 0;
+		safe_free(listener->shard_fd);
+		listener->shard_fd = safe_alloc(sizeof(int) * (listener->reuseport - 1));
+		for (i = 0; i < listener->reuseport - 1; i++)
+		{
+			fd = unreal_listen_fd(listener, ip, port, ipv6);
+			if (fd < 0)
+			{
+				sendto_ops_and_log("Could only open %d of %d reuse-port sockets for %s:%d",
+					listener->shards + 1, listener->reuseport, listener->ip, listener->port);
+				break;
+			}
+			listener->shard_fd[listener->shards++] = fd;
+		}
 	}
 #endif
 
-	fd_setselect(listener->fd, FD_SELECT_READ, listener_accept, listener);
-
 	return 0;
 }
 
@@ -352,6 +851,20 @@ void close_listener(ConfigItem_listen *listener)
 		--OpenFiles;
 	}
 
+	/* Also close any extra reuse-port sockets */
+	if (listener->shard_fd)
+	{
+		int i;
+
+		for (i = 0; i < listener->shards; i++)
+		{
+			fd_close(listener->shard_fd[i]);
+			--OpenFiles;
+		}
+		listener->shards = 0;
+		safe_free(listener->shard_fd);
+	}
+
 	listener->options &= ~LISTENER_BOUND;
 	listener->fd = -1;
 	/* We can already free the SSL/TLS context, since it is only
@@ -617,6 +1130,19 @@ void completed_connection(int fd, int revents, void *data)
 void close_connection(Client *client)
 {
 	RunHook(HOOKTYPE_CLOSE_CONNECTION, client);
+
+	/* Close out a running above-watermark episode, so the sendq
+	 * pressure time of the class (STATS Y) also covers links that
+	 * died while backlogged - usually the most interesting ones.
+	 */
+	if (client->local->sendq_above_since)
+	{
+		if (client->local->class)
+			client->local->class->sendq_above_time += timeofday - client->local->sendq_above_since;
+		client->local->sendq_above_since = 0;
+		client->local->sendq_alerted = 0;
+	}
+
 	/* This function must make MyConnect(client) == FALSE,
 	 * and set client->direction == NULL.
 	 */
@@ -690,6 +1216,8 @@ void close_connection(Client *client)
 
 	}
 
+	zip_free_link(client);
+
 	client->direction = NULL;
 }
 
@@ -765,6 +1293,31 @@ void set_sock_opts(int fd, Client *client, int ipv6)
 #endif
 }
 
+/** Cork or uncork the TCP connection of a client.
+ * While corked (TCP_CORK on Linux, TCP_NOPUSH on *BSD) the kernel
+ * combines our many short lines into full-sized segments instead of
+ * sending a packet per write. Used around server burst output, see
+ * server_sync(). The cork is dropped automatically by send_queued()
+ * once the send queue fully drains, so the tail of the burst is not
+ * held back. A no-op on platforms without such a socket option.
+ */
+void sock_set_cork(Client *client, int enable)
+{
+#if defined(TCP_CORK) || defined(TCP_NOPUSH)
+	int opt = enable ? 1 : 0;
+
+	if ((client->local->fd < 0) || (client->local->corked == opt))
+		return;
+#if defined(TCP_CORK)
+	if (setsockopt(client->local->fd, IPPROTO_TCP, TCP_CORK, (void *)&opt, sizeof(opt)) == 0)
+		client->local->corked = opt;
+#else
+	if (setsockopt(client->local->fd, IPPROTO_TCP, TCP_NOPUSH, (void *)&opt, sizeof(opt)) == 0)
+		client->local->corked = opt;
+#endif
+#endif
+}
+
 /** Returns 1 if using a loopback IP (127.0.0.1) or
  * using a local IP number on the same machine (effectively the same;
  * no network traffic travels outside this machine).
@@ -920,6 +1473,12 @@ refuse_client:
 	client->status = CLIENT_STATUS_UNKNOWN;
 
 	list_add(&client->lclient_node, &unknown_list);
+	client_check_start(client);
+
+	handshake_phase_mark(&client->local->handshake.accepted);
+	client->local->handshake.dns_ms = client->local->handshake.ident_ms =
+	    client->local->handshake.dnsbl_ms = client->local->handshake.tls_ms =
+	    client->local->handshake.total_ms = -1;
 
 	if ((listener->options & LISTENER_TLS) && ctx_server)
 	{
@@ -937,6 +1496,7 @@ refuse_client:
 			SSL_set_fd(client->local->ssl, fd);
 			SSL_set_nonblocking(client->local->ssl);
 			SSL_set_ex_data(client->local->ssl, ssl_client_index, client);
+			handshake_phase_mark(&client->local->handshake.tls_start);
 			if (!ircd_SSL_accept(client, fd))
 			{
 				Debug((DEBUG_DEBUG, "Failed TLS accept handshake in instance 1: %s", client->local->sockhost));
@@ -954,6 +1514,54 @@ refuse_client:
 
 static int dns_special_flag = 0; /* This is for an "interesting" race condition  very ugly. */
 
+/* Handshake phase instrumentation. Each phase records its start on the
+ * LocalClient (handshake_phase_mark) and on completion stores the
+ * duration there plus a sample in the server-wide histogram below,
+ * which /STATS handshake reports.
+ */
+MODVAR HandshakePhaseStats handshake_phase_stats[HANDSHAKE_NPHASES];
+
+/** Histogram bucket upper bounds in milliseconds (last bucket = everything above) */
+MODVAR const int handshake_bucket_ms[HANDSHAKE_NBUCKETS-1] = { 10, 50, 100, 250, 500, 1000, 2500 };
+
+/** Record the start of a handshake phase */
+void handshake_phase_mark(struct timeval *tv)
+{
+	gettimeofday(tv, NULL);
+}
+
+/** Record the completion of a handshake phase.
+ * @param phase    One of HANDSHAKE_PHASE_*
+ * @param started  The timestamp set earlier by handshake_phase_mark()
+ * @returns The phase duration in milliseconds (to store on the client),
+ *          or -1 if the phase never started.
+ */
+int handshake_phase_done(int phase, struct timeval *started)
+{
+	struct timeval now;
+	HandshakePhaseStats *st = &handshake_phase_stats[phase];
+	long long ms;
+	int i;
+
+	if (!started->tv_sec)
+		return -1; /* phase never ran */
+
+	gettimeofday(&now, NULL);
+	ms = ((long long)(now.tv_sec - started->tv_sec)) * 1000 +
+	     (now.tv_usec - started->tv_usec) / 1000;
+	if (ms < 0)
+		ms = 0; /* clock jumped */
+
+	st->samples++;
+	st->total_ms += ms;
+	for (i = 0; i < HANDSHAKE_NBUCKETS-1; i++)
+		if (ms < handshake_bucket_ms[i])
+			break;
+	st->buckets[i]++;
+
+	return (ms > 2000000000) ? 2000000000 : (int)ms;
+}
+
 /** Start of normal client handshake - DNS and ident lookups, etc.
  * @param client	The client
  * @note This is called directly after accept() -> add_connection() for plaintext.
@@ -969,10 +1577,13 @@ void start_of_normal_client_handshake(Client *client)
 
 	if (!DONT_RESOLVE)
 	{
+		int negcache = 0;
+
 		if (should_show_connect_info(client))
 			sendto_one(client, NULL, ":%s %s", me.name, REPORT_DO_DNS);
+		handshake_phase_mark(&client->local->handshake.dns_start);
 		dns_special_flag = 1;
-		he = unrealdns_doclient(client);
+		he = unrealdns_doclient(client, &negcache);
 		dns_special_flag = 0;
 
 		if (client->local->hostp)
@@ -980,8 +1591,18 @@ void start_of_normal_client_handshake(Client *client)
 
 		if (!he)
 		{
-			/* Resolving in progress */
-			SetDNSLookup(client);
+			if (negcache)
+			{
+				/* This IP recently failed to resolve: don't fire
+				 * another lookup for every reconnect, just proceed
+				 * without a hostname right away.
+				 */
+				if (should_show_connect_info(client))
+					sendto_one(client, NULL, ":%s %s", me.name, REPORT_FAIL_DNS);
+			} else {
+				/* Resolving in progress */
+				SetDNSLookup(client);
+			}
 		} else {
 			/* Host was in our cache */
 			client->local->hostp = he;
@@ -991,6 +1612,15 @@ void start_of_normal_client_handshake(Client *client)
 	}
 
 doauth:
+	if (!IsDNSLookup(client))
+	{
+		/* DNS either did not run or was answered synchronously
+		 * (cache hit / negative cache / race); the async case is
+		 * recorded in proceed_normal_client_handshake().
+		 */
+		client->local->handshake.dns_ms =
+			handshake_phase_done(HANDSHAKE_PHASE_DNS, &client->local->handshake.dns_start);
+	}
 	consider_ident_lookup(client);
 	fd_setselect(client->local->fd, FD_SELECT_READ, read_packet, client);
 }
@@ -1001,6 +1631,8 @@ doauth:
  */
 void proceed_normal_client_handshake(Client *client, struct hostent *he)
 {
+	client->local->handshake.dns_ms =
+		handshake_phase_done(HANDSHAKE_PHASE_DNS, &client->local->handshake.dns_start);
 	ClearDNSLookup(client);
 	client->local->hostp = he;
 	if (should_show_connect_info(client))
@@ -1109,8 +1741,20 @@ void read_packet(int fd, int revents, void *data)
 				return;
 		}
 
-		if (processdata && !process_packet(client, readbuf, length, 0))
-			return;
+		if (processdata)
+		{
+			if (client->local->zip && zip_is_in_active(client))
+			{
+				/* Compressed server link: inflate first, the
+				 * decompressed lines then take the normal
+				 * process_packet() route.
+				 */
+				if (!zip_in_data(client, readbuf, length))
+					return;
+			}
+			else if (!process_packet(client, readbuf, length, 0))
+				return;
+		}
 
 		/* bail on short read! */
 		if (length < sizeof(readbuf))
@@ -1280,6 +1924,12 @@ int connect_server(ConfigItem_link *aconf, Client *by, struct hostent *hp)
 	SetOutgoing(client);
 	irccounts.unknown++;
 	list_add(&client->lclient_node, &unknown_list);
+	client_check_start(client);
+
+	handshake_phase_mark(&client->local->handshake.accepted);
+	client->local->handshake.dns_ms = client->local->handshake.ident_ms =
+	    client->local->handshake.dnsbl_ms = client->local->handshake.tls_ms =
+	    client->local->handshake.total_ms = -1;
 	set_sockhost(client, aconf->outgoing.hostname);
 	add_client_to_list(client);
 
@@ -1470,6 +2120,138 @@ int deliver_it(Client *client, char *str, int len, int *want_read)
 	return (retval);
 }
 
+/** Attempt to deliver multiple buffers of data to a client in one go.
+ * This is the scatter/gather variant of deliver_it(), used by
+ * send_queued() to flush many small sendq blocks at once:
+ * plaintext connections are flushed with a single writev() syscall
+ * instead of one write() per block, and for SSL/TLS connections the
+ * blocks are coalesced into one buffer so they go out in as few
+ * TLS records as possible.
+ * Return value and 'want_read' semantics are identical to deliver_it().
+ */
+int deliver_itv(Client *client, struct iovec *iov, int iovcnt, int *want_read)
+{
+	int  retval;
+
+	*want_read = 0;
+
+	if (IsDeadSocket(client) || (!IsServer(client) && !IsUser(client)
+	    && !IsHandshake(client)
+	    && !IsTLSHandshake(client)
+
+	    && !IsUnknown(client)))
+	{
+		sendto_ops
+		    ("* * * DEBUG ERROR * * * !!! Calling deliver_itv() for %s, status %d %s",
+		    client->name, client->status, IsDeadSocket(client) ? "DEAD" : "");
+		return -1;
+	}
+
+	if (IsTLS(client) && client->local->ssl != NULL)
+	{
+		/* Coalesce the blocks into one buffer, so a burst of small
+		 * lines becomes a single TLS record instead of one record
+		 * (with its padding and MAC overhead) per block.
+		 */
+		static char tlsbuf[16384]; /* maximum TLS record size */
+		int len = 0, i, amount;
+
+		if (iovcnt == 1)
+		{
+			/* Single block: nothing to coalesce, write it directly */
+			retval = SSL_write(client->local->ssl, iov[0].iov_base, iov[0].iov_len);
+		} else
+		{
+			for (i = 0; i < iovcnt && len < sizeof(tlsbuf); i++)
+			{
+				amount = iov[i].iov_len;
+				if (amount > sizeof(tlsbuf) - len)
+					amount = sizeof(tlsbuf) - len;
+				memcpy(tlsbuf + len, iov[i].iov_base, amount);
+				len += amount;
+			}
+
+			retval = SSL_write(client->local->ssl, tlsbuf, len);
+		}
+
+		if (retval < 0)
+		{
+			switch (SSL_get_error(client->local->ssl, retval))
+			{
+			case SSL_ERROR_WANT_READ:
+				SET_ERRNO(P_EWOULDBLOCK);
+				*want_read = 1;
+				return 0;
+			case SSL_ERROR_WANT_WRITE:
+				SET_ERRNO(P_EWOULDBLOCK);
+				break;
+			case SSL_ERROR_SYSCALL:
+				break;
+			case SSL_ERROR_SSL:
+				if (ERRNO == P_EAGAIN)
+					break;
+				/* FALLTHROUGH */
+			default:
+				return -1;
+			}
+		}
+	}
+	else
+	{
+#ifndef _WIN32
+		retval = writev(client->local->fd, iov, iovcnt);
+#else
+		/* No writev() on Windows: send buffer by buffer and stop
+		 * at the first partial or blocked write.
+		 */
+		int i, r, sent = 0;
+
+		retval = 0;
+		for (i = 0; i < iovcnt; i++)
+		{
+			r = send(client->local->fd, iov[i].iov_base, iov[i].iov_len, 0);
+			if (r < 0)
+			{
+				retval = sent ? sent : r;
+				break;
+			}
+			sent += r;
+			retval = sent;
+			if (r < (int)iov[i].iov_len)
+				break;
+		}
+#endif
+	}
+
+	/* See deliver_it() for the WOULDBLOCK -> "0 bytes moved" rationale */
+# ifndef _WIN32
+	if (retval < 0 && (errno == EWOULDBLOCK || errno == EAGAIN ||
+	    errno == ENOBUFS))
+# else
+		if (retval < 0 && (WSAGetLastError() == WSAEWOULDBLOCK ||
+		    WSAGetLastError() == WSAENOBUFS))
+# endif
+			retval = 0;
+
+	if (retval > 0)
+	{
+		client->local->sendB += retval;
+		me.local->sendB += retval;
+		if (client->local->sendB > 1023)
+		{
+			client->local->sendK += (client->local->sendB >> 10);
+			client->local->sendB &= 0x03ff;	/* 2^10 = 1024, 3ff = 1023 */
+		}
+		if (me.local->sendB > 1023)
+		{
+			me.local->sendK += (me.local->sendB >> 10);
+			me.local->sendB &= 0x03ff;
+		}
+	}
+
+	return (retval);
+}
+
 /** Initiate an outgoing connection, the actual connect() call. */
 int unreal_connect(int fd, char *ip, int port, int ipv6)
 {
@@ -1270,6 +1270,49 @@ char *pcre2_version(void)
 }
 
 
+/** Number of fresh (uncached) monotonic clock reads, for auditing.
+ * Code that only needs loop-iteration granularity should use the cached
+ * MonoTime() / TStime() / timeofday_tv instead of reading the clock.
+ */
+MODVAR long long mono_clock_reads = 0;
+
+/** Read the monotonic clock: microseconds since some arbitrary point.
+ * Unaffected by clock_settime()/NTP steps, so use this (or the cached
+ * MonoTime()) for measuring durations, never TStime() arithmetic.
+ */
+long long mono_time_usec(void)
+{
+	mono_clock_reads++;
+#ifdef CLOCK_MONOTONIC
+	{
+		struct timespec ts;
+		if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+			return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	}
+#endif
+	{
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+	}
+}
+
+/** Like mono_time_usec() but in milliseconds and using the kernel's
+ * coarse (tick resolution) clock source where available: ideal for the
+ * once-per-main-loop-iteration refresh of the cached MonoTime().
+ */
+long long mono_time_coarse_ms(void)
+{
+#ifdef CLOCK_MONOTONIC_COARSE
+	struct timespec ts;
+
+	mono_clock_reads++;
+	if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) == 0)
+		return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+	return mono_time_usec() / 1000;
+}
+
 #ifdef _WIN32
 /** POSIX gettimeofday function for Windows (ignoring timezones) */
 int gettimeofday(struct timeval *tp, void *tzp)
@@ -310,6 +310,162 @@ void disable_ssl_protocols(SSL_CTX *ctx, TLSOptions *tlsoptions)
  * @param server	Set to 1 if we are initializing a server, 0 for client.
  * @returns The SSL/TLS context (SSL_CTX) or NULL in case of error.
  */
+/* TLS session ticket keys (RFC 5077 stateless session resumption).
+ *
+ * With 'options { session-tickets; };' in a tls-options block, clients
+ * get an encrypted, self-contained session ticket and can resume with
+ * an abbreviated handshake on reconnect. The keys that protect the
+ * tickets are OURS, not OpenSSL's per-SSL_CTX random ones: they are
+ * shared by all contexts, survive a rehash (which builds fresh
+ * contexts) and are persisted to TLSTICKETKEYFILE the same way the
+ * tunefile is, so resumption even works across a restart - exactly
+ * when the reconnect thundering herd hits. The encryption key rotates
+ * every 6 hours; the previous key is kept so tickets issued just
+ * before a rotation remain valid (such clients get a fresh ticket).
+ */
+#define TLS_TICKET_KEY_LIFETIME (6*3600)
+
+/** One generation of session ticket protection keys */
+typedef struct TLSTicketKey TLSTicketKey;
+struct TLSTicketKey {
+	unsigned char name[16];		/**< Key identifier, carried in the ticket */
+	unsigned char hmac_key[32];	/**< Key for the integrity HMAC (SHA256) */
+	unsigned char aes_key[32];	/**< Key for ticket encryption (AES-256-CBC) */
+	long long birth;		/**< When this key was generated */
+};
+
+static TLSTicketKey ticket_key_current, ticket_key_previous;
+static int ticket_keys_ready = 0;
+
+/** Generate a fresh ticket key. Returns 1 on success, 0 on RNG failure. */
+static int tls_ticket_key_generate(TLSTicketKey *k)
+{
+	if ((RAND_bytes(k->name, sizeof(k->name)) <= 0) ||
+	    (RAND_bytes(k->hmac_key, sizeof(k->hmac_key)) <= 0) ||
+	    (RAND_bytes(k->aes_key, sizeof(k->aes_key)) <= 0))
+		return 0;
+	k->birth = TStime();
+	return 1;
+}
+
+/** Write both ticket keys to TLSTICKETKEYFILE (mode 0600) */
+static void tls_ticket_keys_save(void)
+{
+	FILE *f = fopen(TLSTICKETKEYFILE, "wb");
+
+	if (!f)
+	{
+		ircd_log(LOG_ERROR, "Unable to write TLS ticket key file %s: %s",
+			TLSTICKETKEYFILE, strerror(errno));
+		return;
+	}
+	fprintf(f, "UTKF1\n");
+	if ((fwrite(&ticket_key_current, sizeof(TLSTicketKey), 1, f) != 1) ||
+	    (fwrite(&ticket_key_previous, sizeof(TLSTicketKey), 1, f) != 1))
+	{
+		ircd_log(LOG_ERROR, "Error writing TLS ticket key file %s: %s",
+			TLSTICKETKEYFILE, strerror(errno));
+	}
+	fclose(f);
+#ifndef _WIN32
+	chmod(TLSTICKETKEYFILE, S_IRUSR|S_IWUSR); /* key material, keep it to ourselves */
+#endif
+}
+
+/** Load ticket keys from TLSTICKETKEYFILE. Returns 1 if both keys were read. */
+static int tls_ticket_keys_load(void)
+{
+	FILE *f = fopen(TLSTICKETKEYFILE, "rb");
+	char hdr[8];
+
+	if (!f)
+		return 0;
+	if (!fgets(hdr, sizeof(hdr), f) || strcmp(hdr, "UTKF1\n") ||
+	    (fread(&ticket_key_current, sizeof(TLSTicketKey), 1, f) != 1) ||
+	    (fread(&ticket_key_previous, sizeof(TLSTicketKey), 1, f) != 1))
+	{
+		ircd_log(LOG_ERROR, "TLS ticket key file %s is corrupt or from "
+			"an incompatible version, generating fresh keys", TLSTICKETKEYFILE);
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+	return 1;
+}
+
+/** Rotate the ticket keys when the current one has reached end of life */
+static void tls_ticket_keys_rotate_if_due(void)
+{
+	if (TStime() - ticket_key_current.birth < TLS_TICKET_KEY_LIFETIME)
+		return;
+	ticket_key_previous = ticket_key_current;
+	if (!tls_ticket_key_generate(&ticket_key_current))
+		return; /* RNG failure: keep using the old key rather than a weak one */
+	tls_ticket_keys_save();
+}
+
+EVENT(tls_ticket_key_rotate)
+{
+	tls_ticket_keys_rotate_if_due();
+}
+
+/** Load-or-create the ticket keys and start the rotation timer. */
+static int tls_ticket_keys_init(void)
+{
+	if (ticket_keys_ready)
+		return 1;
+	if (!tls_ticket_keys_load())
+	{
+		if (!tls_ticket_key_generate(&ticket_key_current) ||
+		    !tls_ticket_key_generate(&ticket_key_previous))
+			return 0;
+		tls_ticket_keys_save();
+	}
+	tls_ticket_keys_rotate_if_due(); /* the file may predate a long downtime */
+	EventAdd(NULL, "tls_ticket_key_rotate", tls_ticket_key_rotate, NULL, 3600*1000, 0);
+	ticket_keys_ready = 1;
+	return 1;
+}
+
+#if defined(SSL_CTX_set_tlsext_ticket_key_cb)
+/** OpenSSL callback that protects/unprotects session tickets with our keys.
+ * enc=1: new ticket being issued, use the current key.
+ * enc=0: ticket being redeemed, accept the current and the previous key;
+ *        returning 2 for the previous one makes OpenSSL hand out a
+ *        re-encrypted ticket under the current key.
+ */
+static int tls_ticket_key_cb(SSL *s, unsigned char key_name[16],
+                             unsigned char *iv, EVP_CIPHER_CTX *ectx,
+                             HMAC_CTX *hctx, int enc)
+{
+	TLSTicketKey *k;
+
+	if (enc)
+	{
+		if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) <= 0)
+			return -1;
+		memcpy(key_name, ticket_key_current.name, sizeof(ticket_key_current.name));
+		if (!EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, ticket_key_current.aes_key, iv) ||
+		    !HMAC_Init_ex(hctx, ticket_key_current.hmac_key, sizeof(ticket_key_current.hmac_key), EVP_sha256(), NULL))
+			return -1;
+		return 1;
+	}
+
+	if (!memcmp(key_name, ticket_key_current.name, sizeof(ticket_key_current.name)))
+		k = &ticket_key_current;
+	else if (!memcmp(key_name, ticket_key_previous.name, sizeof(ticket_key_previous.name)))
+		k = &ticket_key_previous;
+	else
+		return 0; /* unknown (rotated-out) key: full handshake */
+
+	if (!HMAC_Init_ex(hctx, k->hmac_key, sizeof(k->hmac_key), EVP_sha256(), NULL) ||
+	    !EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, k->aes_key, iv))
+		return -1;
+
+	return (k == &ticket_key_current) ? 1 : 2;
+}
+#endif
+
 SSL_CTX *init_ctx(TLSOptions *tlsoptions, int server)
 {
 	SSL_CTX *ctx;
@@ -329,6 +485,27 @@ SSL_CTX *init_ctx(TLSOptions *tlsoptions, int server)
 	disable_ssl_protocols(ctx, tlsoptions);
 	SSL_CTX_set_default_passwd_cb(ctx, ssl_pem_passwd_cb);
 
+	/* Needed for the batched write path in deliver_itv(): after a
+	 * WANT_READ/WANT_WRITE the retried SSL_write() may be called with
+	 * a differently sized (re-gathered) buffer, and partial writes
+	 * must be accounted rather than treated as "nothing written".
+	 */
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE|SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+#ifdef SSL_OP_ENABLE_KTLS
+	/* Kernel TLS: after the handshake OpenSSL installs the session keys
+	 * into the socket (setsockopt SOL_TLS) and record encryption/decryption
+	 * happens in the kernel; SSL_read()/SSL_write() then bypass the
+	 * userland record layer entirely. OpenSSL falls back to the normal
+	 * code path by itself whenever the kernel, NIC or negotiated cipher
+	 * cannot do kTLS, so this is safe to have on by default. Opt out per
+	 * tls-options block with 'options { no-ktls; };' if a middlebox or
+	 * kernel bug ever makes that necessary.
+	 */
+	if (!(tlsoptions->options & TLSFLAG_NOKTLS))
+		SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
 	if (server && !(tlsoptions->options & TLSFLAG_DISABLECLIENTCERT))
 	{
 		/* We tell OpenSSL/LibreSSL to verify the certificate and set our callback.
@@ -344,7 +521,14 @@ SSL_CTX *init_ctx(TLSOptions *tlsoptions, int server)
 #ifndef SSL_OP_NO_TICKET
  #error "Your system has an outdated OpenSSL version. Please upgrade OpenSSL."
 #endif
+#if defined(SSL_CTX_set_tlsext_ticket_key_cb)
+	if (server && (tlsoptions->options & TLSFLAG_TICKETS) && tls_ticket_keys_init())
+		SSL_CTX_set_tlsext_ticket_key_cb(ctx, tls_ticket_key_cb);
+	else
+		SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+#else
 	SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+#endif
 
 	if (!tlsoptions->certificate_file)
 	{
@@ -708,6 +892,108 @@ void ircd_SSL_client_handshake(int fd, int revents, void *data)
 }
 
 /** Called by I/O engine to (re)try accepting an SSL/TLS connection */
+/* Budgeted TLS handshake processing.
+ *
+ * SSL_accept() runs asymmetric crypto inline on the event loop, so a
+ * burst of (hostile or accidental) TLS connections used to freeze the
+ * whole server for as long as it took to run every handshake. We now
+ * run at most TLS_HANDSHAKES_PER_LOOP handshake steps per main loop
+ * iteration; connections over that budget are parked in a FIFO with
+ * their I/O callbacks disabled and resumed - in arrival order - on
+ * following iterations. Existing users thus see a bounded hiccup per
+ * iteration no matter how many handshakes are pending, while the
+ * attack (or reconnect wave) only delays TLS connection setup itself.
+ * Parked clients are still covered by the regular handshake timeout.
+ */
+#define TLS_HANDSHAKES_PER_LOOP 10
+
+/** One parked TLS connection, waiting for handshake budget */
+typedef struct PendingHandshake PendingHandshake;
+struct PendingHandshake {
+	PendingHandshake *next;
+	Client *client;
+};
+
+static PendingHandshake *pending_handshakes = NULL, *pending_handshakes_tail = NULL;
+static int tls_handshakes_this_loop = 0;
+
+/** Are any TLS handshakes parked, waiting for budget? */
+int pending_handshakes_queued(void)
+{
+	return pending_handshakes ? 1 : 0;
+}
+
+/** Park 'client' at the tail of the pending handshake queue */
+static void tls_handshake_park(Client *client, int fd)
+{
+	PendingHandshake *ph;
+
+	if (IsTLSQueued(client))
+		return;
+
+	/* No I/O callbacks while parked: we resume by budget, not by fd */
+	fd_setselect(fd, FD_SELECT_READ, NULL, client);
+	fd_setselect(fd, FD_SELECT_WRITE, NULL, client);
+
+	ph = safe_alloc(sizeof(PendingHandshake));
+	ph->client = client;
+	if (pending_handshakes_tail)
+		pending_handshakes_tail->next = ph;
+	else
+		pending_handshakes = ph;
+	pending_handshakes_tail = ph;
+	SetTLSQueued(client);
+}
+
+/** Remove 'client' from the pending handshake queue, if it is on it.
+ * Called from exit_client() so the queue never holds an exited client.
+ */
+void tls_handshake_dequeue(Client *client)
+{
+	PendingHandshake *ph, *prev = NULL;
+
+	if (!IsTLSQueued(client))
+		return;
+
+	for (ph = pending_handshakes; ph; prev = ph, ph = ph->next)
+	{
+		if (ph->client != client)
+			continue;
+		if (prev)
+			prev->next = ph->next;
+		else
+			pending_handshakes = ph->next;
+		if (pending_handshakes_tail == ph)
+			pending_handshakes_tail = prev;
+		safe_free(ph);
+		break;
+	}
+	ClearTLSQueued(client);
+}
+
+/** Resume parked TLS handshakes, up to the per-iteration budget.
+ * Called once per main loop iteration; also resets the budget for
+ * the handshakes that arrive via I/O callbacks in the next iteration.
+ */
+void process_pending_handshakes(void)
+{
+	tls_handshakes_this_loop = 0;
+
+	while (pending_handshakes && (tls_handshakes_this_loop < TLS_HANDSHAKES_PER_LOOP))
+	{
+		PendingHandshake *ph = pending_handshakes;
+		Client *client = ph->client;
+
+		pending_handshakes = ph->next;
+		if (!pending_handshakes)
+			pending_handshakes_tail = NULL;
+		safe_free(ph);
+
+		ClearTLSQueued(client);
+		ircd_SSL_accept(client, client->local->fd);
+	}
+}
+
 static void ircd_SSL_accept_retry(int fd, int revents, void *data)
 {
 	Client *client = data;
@@ -719,6 +1005,16 @@ int ircd_SSL_accept(Client *client, int fd)
 {
 	int ssl_err;
 
+	if (tls_handshakes_this_loop >= TLS_HANDSHAKES_PER_LOOP)
+	{
+		/* Handshake budget for this main loop iteration is used up:
+		 * park this connection and resume it in a later iteration.
+		 */
+		tls_handshake_park(client, fd);
+		return 1;
+	}
+	tls_handshakes_this_loop++;
+
 #ifdef MSG_PEEK
 	if (!IsNextCall(client))
 	{
@@ -780,6 +1076,8 @@ int ircd_SSL_accept(Client *client, int fd)
 		return -1;
 	}
 
+	client->local->handshake.tls_ms =
+		handshake_phase_done(HANDSHAKE_PHASE_TLS, &client->local->handshake.tls_start);
 	start_of_normal_client_handshake(client);
 
 	return 1;
@@ -1230,6 +1528,28 @@ int certificate_quality_check(SSL_CTX *ctx, char **errstr)
 
 char *spki_fingerprint_ex(X509 *x509_cert);
 
+/* Cache of recently seen certificates and their SPKI fingerprint.
+ *
+ * The SPKI fingerprint is re-derived on every authentication check and
+ * that means serializing the public key, hashing it and base64 encoding
+ * the result each time. A gateway host reconnecting hundreds of bouncer
+ * clients presents the exact same certificate over and over again, so we
+ * keep a small direct-mapped cache keyed on the certificate digest
+ * (which OpenSSL computes from the DER copy it already has).
+ * The mapping from certificate to SPKI fingerprint is deterministic,
+ * hence entries never go stale and no invalidation is needed.
+ */
+#define SPKIFP_CACHE_SIZE 64	/* must be a power of two */
+
+typedef struct SpkiFpCacheEntry SpkiFpCacheEntry;
+struct SpkiFpCacheEntry {
+	char valid; /**< Slot in use? */
+	unsigned char cert_digest[SHA256_DIGEST_LENGTH]; /**< SHA256 over the full certificate */
+	char spkifp[256]; /**< The base64 SPKI fingerprint */
+};
+
+static SpkiFpCacheEntry spkifp_cache[SPKIFP_CACHE_SIZE];
+
 /** Return the SPKI Fingerprint for a client.
  *
  * This is basically the same output as
@@ -1241,6 +1561,9 @@ char *spki_fingerprint(Client *cptr)
 {
 	X509 *x509_cert = NULL;
 	char *ret;
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int n;
+	SpkiFpCacheEntry *e;
 
 	if (!MyConnect(cptr) || !cptr->local->ssl)
 		return NULL;
@@ -1248,6 +1571,27 @@ char *spki_fingerprint(Client *cptr)
 	x509_cert = SSL_get_peer_certificate(cptr->local->ssl);
 	if (!x509_cert)
 		return NULL;
+
+	if (X509_digest(x509_cert, EVP_sha256(), md, &n) && (n == SHA256_DIGEST_LENGTH))
+	{
+		e = &spkifp_cache[md[0] & (SPKIFP_CACHE_SIZE-1)];
+		if (e->valid && !memcmp(e->cert_digest, md, SHA256_DIGEST_LENGTH))
+		{
+			/* Seen this certificate before, skip re-deriving the fingerprint */
+			X509_free(x509_cert);
+			return e->spkifp;
+		}
+		ret = spki_fingerprint_ex(x509_cert);
+		if (ret)
+		{
+			memcpy(e->cert_digest, md, SHA256_DIGEST_LENGTH);
+			strlcpy(e->spkifp, ret, sizeof(e->spkifp));
+			e->valid = 1;
+		}
+		X509_free(x509_cert);
+		return ret;
+	}
+
 	ret = spki_fingerprint_ex(x509_cert);
 	X509_free(x509_cert);
 	return ret;
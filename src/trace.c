@@ -0,0 +1,99 @@
+/************************************************************************
+ * UnrealIRCd - Unreal Internet Relay Chat Daemon - src/trace.c
+ * (c) 2021- Bram Matthys and The UnrealIRCd team
+ *
+ * See file AUTHORS in IRC package for additional names of
+ * the programmers.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 1, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** @file
+ * @brief Tracepoint framework.
+ * Hot functions declare a named Tracepoint next to their code and wrap
+ * interesting spots in TRACEPOINT(tp, fmt, ...). Unlike the Debug()
+ * macros - which are either compiled out entirely or globally verbose -
+ * tracepoints are always compiled in and toggled individually at
+ * runtime (/TRACEPOINT ON <name>), so instrumenting a hot path costs
+ * one byte test and a predicted jump until someone actually needs it.
+ * Enabled tracepoints render their payload into a fixed ring of text
+ * lines which an oper inspects with /TRACEPOINT DUMP; nothing is ever
+ * written to disk and recording never blocks.
+ */
+
+#include "unrealircd.h"
+
+MODVAR char trace_ring[TRACE_RING_ENTRIES][TRACE_RING_LINELEN];
+MODVAR unsigned int trace_ring_pos = 0; /**< Events ever recorded (write cursor = pos % entries) */
+MODVAR Tracepoint *tracepoints = NULL; /**< All registered tracepoints, for by-name toggling */
+
+/** Register a tracepoint so it can be toggled by name.
+ * Core tracepoints are registered by tracepoints_init(); modules call
+ * this from MOD_INIT for their own (there is no unregister - pass a
+ * permanently allocated struct, not module memory, or mark the module
+ * MOD_OPT_PERM).
+ */
+void tracepoint_register(Tracepoint *tp)
+{
+	if (tracepoint_find(tp->name))
+	{
+		ircd_log(LOG_ERROR, "tracepoint_register(): duplicate tracepoint '%s'", tp->name);
+		return;
+	}
+	tp->next = tracepoints;
+	tracepoints = tp;
+}
+
+/** Find a tracepoint by name, or NULL if no such tracepoint exists */
+Tracepoint *tracepoint_find(const char *name)
+{
+	Tracepoint *tp;
+
+	for (tp = tracepoints; tp; tp = tp->next)
+		if (!strcasecmp(tp->name, name))
+			return tp;
+	return NULL;
+}
+
+/** Render one trace event into the ring. Never called directly - the
+ * TRACEPOINT() macro guards this behind the enable byte, so all
+ * formatting cost is only paid while someone is actually tracing.
+ * The clock is read per event (not the per-loop timeofday_tv) since
+ * the whole point is seeing ordering and spacing within one iteration.
+ */
+void tracepoint_emit(Tracepoint *tp, const char *format, ...)
+{
+	char *slot = trace_ring[trace_ring_pos % TRACE_RING_ENTRIES];
+	struct timeval tv;
+	va_list vl;
+	int n;
+
+	gettimeofday(&tv, NULL);
+	n = ircsnprintf(slot, TRACE_RING_LINELEN, "[%lld.%06lld] %s: ",
+		(long long)tv.tv_sec, (long long)tv.tv_usec, tp->name);
+	va_start(vl, format);
+	ircvsnprintf(slot + n, TRACE_RING_LINELEN - n, format, vl);
+	va_end(vl);
+	trace_ring_pos++;
+	tp->hits++;
+}
+
+/** Called from the init code to register the core tracepoints */
+void tracepoints_init(void)
+{
+	tracepoint_register(&tp_send_queued);
+	tracepoint_register(&tp_parse2);
+	tracepoint_register(&tp_hash_find_client);
+}
@@ -1575,15 +1575,18 @@ void build_include_list_ex(char *fname, ConfigFile **cf_list)
 	for (ce = cf->cf_entries; ce; ce = ce->ce_next)
 		if (!strcmp(ce->ce_varname, "include"))
 		{
-			if ((ce->ce_vardata[0] != '/') && (ce->ce_vardata[0] != '\\') && strcmp(ce->ce_vardata, CPATH))
+			char *path = ce->ce_vardata;
+			char *str = NULL;
+
+			if ((path[0] != '/') && (path[0] != '\\') && strcmp(path, CPATH))
 			{
-				char *str = safe_alloc(strlen(ce->ce_vardata) + strlen(CONFDIR) + 4);
-				sprintf(str, "%s/%s", CONFDIR, ce->ce_vardata);
-				safe_free(ce->ce_vardata);
-				ce->ce_vardata = str;
+				str = safe_alloc(strlen(path) + strlen(CONFDIR) + 4);
+				sprintf(str, "%s/%s", CONFDIR, path);
+				path = str;
 			}
-			if (!already_included(ce->ce_vardata, *cf_list))
-				build_include_list_ex(ce->ce_vardata, cf_list);
+			if (!already_included(path, *cf_list))
+				build_include_list_ex(path, cf_list);
+			safe_free(str);
 		}
 	
 	config_free(cf);
@@ -166,33 +166,16 @@ static size_t do_download(void *ptr, size_t size, size_t nmemb, void *stream)
  * message. The returned filename is malloc'ed and must be freed by
  * the caller.
  */
-char *download_file(const char *url, char **error)
+/** Creates an easy handle for a synchronous config download with the
+ * usual options set. Used by download_file() and download_files_prefetch().
+ */
+static CURL *download_begin(const char *url, FILE *fd, char *errorbuf)
 {
-	static char errorbuf[CURL_ERROR_SIZE];
 	CURL *curl = curl_easy_init();
-	CURLcode res;
-	char *file = url_getfilename(url);
-	char *filename = unreal_getfilename(file);
-	char *tmp = unreal_mktemp(TMPDIR, filename ? filename : "download.conf");
-	FILE *fd;
-
 
 	if (!curl)
-	{
-		safe_free(file);
-		strlcpy(errorbuf, "curl_easy_init() failed", sizeof(errorbuf));
-		*error = errorbuf;
 		return NULL;
-	}
 
-	fd = fopen(tmp, "wb");
-	if (!fd)
-	{
-		snprintf(errorbuf, CURL_ERROR_SIZE, "Cannot write to %s: %s", tmp, strerror(errno));
-		safe_free(file);
-		*error = errorbuf;
-		return NULL;
-	}
 	curl_easy_setopt(curl, CURLOPT_URL, url);
 	curl_easy_setopt(curl, CURLOPT_WRITEDATA, fd);
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, do_download);
@@ -219,6 +202,186 @@ char *download_file(const char *url, char **error)
 	set_curl_tls_options(curl);
 	memset(errorbuf, 0, CURL_ERROR_SIZE);
 	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorbuf);
+
+	return curl;
+}
+
+/* == Parallel synchronous downloads ==
+ * At boot - and for includes first seen during a rehash - remote
+ * includes go through the synchronous download_file(), which adds up
+ * the full network latency of every fetch. load_conf() therefore first
+ * hands all remote includes of the file being parsed to
+ * download_files_prefetch(): the fetches are driven concurrently over
+ * one (local) curl multi handle so their latency overlaps, and the
+ * results are parked below for the download_file() calls that follow
+ * to pick up. Known includes on rehash are already concurrent through
+ * download_file_async() and the global multihandle.
+ */
+typedef struct DownloadPrefetch DownloadPrefetch;
+struct DownloadPrefetch {
+	DownloadPrefetch *prev, *next;
+	char *url;
+	char *file;	/**< Temp file with the contents, NULL on failure */
+	char errorbuf[CURL_ERROR_SIZE];
+	FILE *fd;
+	CURL *curl;
+};
+
+static DownloadPrefetch *download_prefetches = NULL;
+
+static void download_prefetch_free(DownloadPrefetch *p)
+{
+	DelListItem(p, download_prefetches);
+	safe_free(p->url);
+	safe_free(p->file);
+	safe_free(p);
+}
+
+/** Fetches all 'urls' concurrently, parking the results for download_file() */
+void download_files_prefetch(char **urls, int count)
+{
+	CURLM *multi;
+	CURLMsg *msg;
+	DownloadPrefetch *p;
+	int i, running, msgs_left;
+
+	/* Results from an earlier, aborted config read are stale by now */
+	while (download_prefetches)
+	{
+		if (download_prefetches->file)
+			remove(download_prefetches->file);
+		download_prefetch_free(download_prefetches);
+	}
+
+	if (count < 2)
+		return; /* no latency to overlap */
+
+	multi = curl_multi_init();
+	if (!multi)
+		return; /* download_file() will try again and report */
+
+	for (i = 0; i < count; i++)
+	{
+		char *file = url_getfilename(urls[i]);
+		char *filename = unreal_getfilename(file);
+		char *tmp = unreal_mktemp(TMPDIR, filename ? filename : "download.conf");
+		FILE *fd = fopen(tmp, "wb");
+
+		safe_free(file);
+		if (!fd)
+			continue; /* download_file() will run into the same error and report it */
+
+		p = safe_alloc(sizeof(DownloadPrefetch));
+		safe_strdup(p->url, urls[i]);
+		safe_strdup(p->file, tmp);
+		p->fd = fd;
+		p->curl = download_begin(urls[i], fd, p->errorbuf);
+		if (!p->curl)
+		{
+			fclose(fd);
+			remove(tmp);
+			safe_free(p->url);
+			safe_free(p->file);
+			safe_free(p);
+			continue;
+		}
+		curl_easy_setopt(p->curl, CURLOPT_PRIVATE, (char *)p);
+		curl_multi_add_handle(multi, p->curl);
+		AddListItem(p, download_prefetches);
+	}
+
+	do
+	{
+		if (curl_multi_perform(multi, &running) != CURLM_OK)
+			break;
+		if (running)
+			curl_multi_wait(multi, NULL, 0, 1000, NULL);
+	} while (running);
+
+	while ((msg = curl_multi_info_read(multi, &msgs_left)) != NULL)
+	{
+		char *ptr;
+
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &ptr);
+		p = (DownloadPrefetch *)ptr;
+		fclose(p->fd);
+		p->fd = NULL;
+		if (msg->data.result == CURLE_OK)
+		{
+			long last_mod;
+
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_FILETIME, &last_mod);
+			if (last_mod != -1)
+				unreal_setfilemodtime(p->file, last_mod);
+		} else
+		{
+			if (!*p->errorbuf)
+				strlcpy(p->errorbuf, curl_easy_strerror(msg->data.result), sizeof(p->errorbuf));
+			remove(p->file);
+			safe_free(p->file);
+		}
+		curl_multi_remove_handle(multi, msg->easy_handle);
+		curl_easy_cleanup(msg->easy_handle);
+		p->curl = NULL;
+	}
+	curl_multi_cleanup(multi);
+}
+
+char *download_file(const char *url, char **error)
+{
+	static char errorbuf[CURL_ERROR_SIZE];
+	CURL *curl;
+	CURLcode res;
+	char *file;
+	char *filename;
+	char *tmp;
+	FILE *fd;
+	DownloadPrefetch *p;
+
+	/* Prefetched by download_files_prefetch()? Then it is done already */
+	for (p = download_prefetches; p; p = p->next)
+	{
+		if (!strcmp(p->url, url))
+		{
+			char *ret = NULL;
+
+			if (p->file)
+			{
+				ret = raw_strdup(p->file);
+			} else
+			{
+				strlcpy(errorbuf, p->errorbuf, sizeof(errorbuf));
+				*error = errorbuf;
+			}
+			download_prefetch_free(p);
+			return ret;
+		}
+	}
+
+	file = url_getfilename(url);
+	filename = unreal_getfilename(file);
+	tmp = unreal_mktemp(TMPDIR, filename ? filename : "download.conf");
+
+	fd = fopen(tmp, "wb");
+	if (!fd)
+	{
+		snprintf(errorbuf, CURL_ERROR_SIZE, "Cannot write to %s: %s", tmp, strerror(errno));
+		safe_free(file);
+		*error = errorbuf;
+		return NULL;
+	}
+	curl = download_begin(url, fd, errorbuf);
+	if (!curl)
+	{
+		fclose(fd);
+		safe_free(file);
+		strlcpy(errorbuf, "curl_easy_init() failed", sizeof(errorbuf));
+		*error = errorbuf;
+		return NULL;
+	}
 	res = curl_easy_perform(curl);
 	fclose(fd);
 	safe_free(file);
@@ -331,7 +494,7 @@ static int url_socket_cb(CURL *e, curl_socket_t s, int what, void *cbp, void *so
 	}
 	else
 	{
-		FDEntry *fde = &fd_table[s];
+		FDEntry *fde = fd_entry(s);
 		int flags = 0;
 		
 		if (!fde->is_open)
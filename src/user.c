@@ -85,7 +85,6 @@ long set_usermode(char *umode)
 	int  newumode;
 	int  what;
 	char *m;
-	int i;
 
 	newumode = 0;
 	what = MODE_ADD;
@@ -104,18 +103,17 @@ long set_usermode(char *umode)
 		  case '\t':
 			  break;
 		  default:
-		 	 for (i = 0; i <= Usermode_highest; i++)
-		 	 {
-		 	 	if (!Usermode_Table[i].flag)
-		 	 		continue;
-		 	 	if (*m == Usermode_Table[i].flag)
-		 	 	{
-		 	 		if (what == MODE_ADD)
-			 	 		newumode |= Usermode_Table[i].mode;
-			 	 	else
-			 	 		newumode &= ~Usermode_Table[i].mode;
-		 	 	}
-		 	 } 	  
+		  {
+			  Umode *um = find_usermode(*m);
+
+			  if (um)
+			  {
+				  if (what == MODE_ADD)
+					  newumode |= um->mode;
+				  else
+					  newumode &= ~um->mode;
+			  }
+		  }
 		}
 
 	return (newumode);
@@ -326,9 +324,10 @@ void set_snomask(Client *client, char *snomask)
 	int i;
 	if (snomask == NULL) {
 		client->user->snomask = 0;
+		invalidate_snomask_subscribers();
 		return;
 	}
-	
+
 	for (p = snomask; p && *p; p++) {
 		switch (*p) {
 			case '+':
@@ -351,9 +350,10 @@ void set_snomask(Client *client, char *snomask)
 			 	 	else
 			 	 		client->user->snomask &= ~Snomask_Table[i].mode;
 		 	 	}
-		 	 }				
+		 	 }
 		}
 	}
+	invalidate_snomask_subscribers();
 }
 
 /** Build the MODE line with (modified) user modes for this user.
@@ -698,6 +698,9 @@ void make_cloakedhost(Client *client, char *curr, char *buf, size_t buflen)
 /** Called after a user is logged in (or out) of a services account */
 void user_account_login(MessageTag *recv_mtags, Client *client)
 {
+	if (client->user)
+		client->user->acl_generation++; /* ban masks match on account (~a) */
+	whoindex_update(client);
 	RunHook2(HOOKTYPE_ACCOUNT_LOGIN, client, recv_mtags);
 }
 
@@ -34,6 +34,25 @@ static const char *fast_validate(const char *str)
 
 	for (p = str; *p; p++)
 	{
+		/* Skip over runs of plain ASCII a word at a time: a word that
+		 * contains neither a NUL byte nor a byte >= 128 needs no
+		 * validation at all. The classic carry trick below may flag a
+		 * word that merely contains a 0x01 byte, in which case we
+		 * simply fall through to the bytewise code - never the other
+		 * way around.
+		 */
+		if (((uintptr_t)p & (sizeof(unsigned long)-1)) == 0)
+		{
+			const unsigned long *w = (const unsigned long *)p;
+			const unsigned long ones = (unsigned long)0x0101010101010101ULL;
+			const unsigned long highs = (unsigned long)0x8080808080808080ULL;
+
+			while (!((*w | (*w - ones)) & highs))
+				w++;
+			p = (const char *)w;
+			if (!*p)
+				break;
+		}
 		if (*p >= 128)
 		{
 			const char *last;
@@ -122,6 +141,80 @@ int unrl_utf8_validate(const char *str, const char **end)
 		return 1;
 }
 
+/** Returns length of an (UTF8) character. May return <1 for error conditions.
+ * Made by i <info@servx.org>
+ * @param str  Pointer to the current character.
+ */
+int unrl_utf8_charlen(const char *str)
+{
+	struct { char mask; char val; } t[4] =
+	{ { 0x80, 0x00 }, { 0xE0, 0xC0 }, { 0xF0, 0xE0 }, { 0xF8, 0xF0 } };
+	unsigned k, j;
+
+	for (k = 0; k < 4; k++)
+	{
+		if ((*str & t[k].mask) == t[k].val)
+		{
+			for (j = 0; j < k; j++)
+			{
+				if ((*(++str) & 0xC0) != 0x80)
+					return -1;
+			}
+			return k + 1;
+		}
+	}
+	return 1;
+}
+
+/** Detect which script the current character is,
+ * such as latin script or cyrillic script.
+ * @param t  Pointer to the current character. As long as *t is never \0
+ *           then at worst the character after this will be \0 and since
+ *           we only look at 2 characters (at most) at a time this is safe.
+ * @retval See UTF8_SCRIPT_*
+ */
+int unrl_utf8_script(const char *t)
+{
+	/* Currently we only detect cyrillic and call all the
+	 * rest latin (which is not true). This can always
+	 * be enhanced later.
+	 */
+
+	if ((t[0] == 0xd0) && (t[1] >= 0x80) && (t[1] <= 0xbf))
+		return UTF8_SCRIPT_CYRILLIC;
+	else if ((t[0] == 0xd1) && (t[1] >= 0x80) && (t[1] <= 0xbf))
+		return UTF8_SCRIPT_CYRILLIC;
+	else if ((t[0] == 0xd2) && (t[1] >= 0x80) && (t[1] <= 0xbf))
+		return UTF8_SCRIPT_CYRILLIC;
+	else if ((t[0] == 0xd3) && (t[1] >= 0x80) && (t[1] <= 0xbf))
+		return UTF8_SCRIPT_CYRILLIC;
+
+	if ((t[0] == 0xe4) && (t[1] >= 0xb8) && (t[1] <= 0xbf))
+		return UTF8_SCRIPT_CJK;
+	else if ((t[0] >= 0xe5) && (t[0] <= 0xe9) && (t[1] >= 0x80) && (t[1] <= 0xbf))
+		return UTF8_SCRIPT_CJK;
+
+	if ((t[0] == 0xea) && (t[1] >= 0xb0) && (t[1] <= 0xbf))
+		return UTF8_SCRIPT_HANGUL;
+	else if ((t[0] >= 0xeb) && (t[0] <= 0xec) && (t[1] >= 0x80) && (t[1] <= 0xbf))
+		return UTF8_SCRIPT_HANGUL;
+	else if ((t[0] == 0xed) && (t[1] >= 0x80) && (t[1] <= 0x9f))
+		return UTF8_SCRIPT_HANGUL;
+
+	if ((t[0] == 0xe1) && (t[1] >= 0x90) && (t[1] <= 0x99))
+		return UTF8_SCRIPT_CANADIAN;
+
+	if ((t[0] == 0xe0) && (t[1] >= 0xb0) && (t[1] <= 0xb1))
+		return UTF8_SCRIPT_TELUGU;
+
+	if ((t[0] >= 'a') && (t[0] <= 'z'))
+		return UTF8_SCRIPT_LATIN;
+	if ((t[0] >= 'A') && (t[0] <= 'Z'))
+		return UTF8_SCRIPT_LATIN;
+
+	return UTF8_SCRIPT_UNDEFINED;
+}
+
 /** Go backwards in a string until we are at the end of an UTF8 sequence.
  * Or more accurately: skip sequences that are part of an UTF8 sequence.
  * @param begin   The string to check
@@ -28,9 +28,15 @@ static void add_whowas_to_clist(aWhowas **, aWhowas *);
 static void del_whowas_from_clist(aWhowas **, aWhowas *);
 static void add_whowas_to_list(aWhowas **, aWhowas *);
 static void del_whowas_from_list(aWhowas **, aWhowas *);
+static void add_whowas_to_ip_list(aWhowas **, aWhowas *);
+static void del_whowas_from_ip_list(aWhowas **, aWhowas *);
+static void add_whowas_to_account_list(aWhowas **, aWhowas *);
+static void del_whowas_from_account_list(aWhowas **, aWhowas *);
 
 aWhowas MODVAR WHOWAS[NICKNAMEHISTORYLENGTH];
 aWhowas MODVAR *WHOWASHASH[WHOWAS_HASH_TABLE_SIZE];
+aWhowas MODVAR *WHOWAS_IP_HASH[WHOWAS_HASH_TABLE_SIZE];
+aWhowas MODVAR *WHOWAS_ACCOUNT_HASH[WHOWAS_HASH_TABLE_SIZE];
 
 MODVAR int whowas_next = 0;
 
@@ -43,28 +49,43 @@ void add_history(Client *client, int online)
 	if (new->hashv != -1)
 	{
 		safe_free(new->name);
-		safe_free(new->hostname);
-		safe_free(new->virthost);
-		safe_free(new->realname);
-		safe_free(new->username);
+		unintern_string(new->hostname);
+		unintern_string(new->virthost);
+		unintern_string(new->realname);
+		unintern_string(new->username);
 		new->servername = NULL;
 
 		if (new->online)
 			del_whowas_from_clist(&(new->online->user->whowas), new);
 		del_whowas_from_list(&WHOWASHASH[new->hashv], new);
+		if (new->ip_hashv != -1)
+		{
+			del_whowas_from_ip_list(&WHOWAS_IP_HASH[new->ip_hashv], new);
+			unintern_string(new->ip);
+			new->ip = NULL;
+			new->ip_hashv = -1;
+		}
+		if (new->account_hashv != -1)
+		{
+			del_whowas_from_account_list(&WHOWAS_ACCOUNT_HASH[new->account_hashv], new);
+			unintern_string(new->account);
+			new->account = NULL;
+			new->account_hashv = -1;
+		}
 	}
 	new->hashv = hash_whowas_name(client->name);
 	new->logoff = TStime();
 	new->umodes = client->umodes;
 	safe_strdup(new->name, client->name);
-	safe_strdup(new->username, client->user->username);
-	safe_strdup(new->hostname, client->user->realhost);
-	if (client->user->virthost)
-		safe_strdup(new->virthost, client->user->virthost);
-	else
-		safe_strdup(new->virthost, "");
+	/* usernames, hostnames and realnames are heavily duplicated
+	 * across the history on clone-heavy networks, so share them
+	 * through the interned string table instead of strdup'ing.
+	 */
+	new->username = intern_string(client->user->username);
+	new->hostname = intern_string(client->user->realhost);
+	new->virthost = intern_string(client->user->virthost ? client->user->virthost : "");
 	new->servername = client->user->server;
-	safe_strdup(new->realname, client->info);
+	new->realname = intern_string(client->info);
 
 	/* Its not string copied, a pointer to the scache hash is copied
 	   -Dianora
@@ -80,6 +101,21 @@ void add_history(Client *client, int online)
 	else
 		new->online = NULL;
 	add_whowas_to_list(&WHOWASHASH[new->hashv], new);
+	/* Index by IP and services account as well, so the abuse desk can
+	 * query history by those (see the extended WHOWAS syntax).
+	 */
+	if (client->ip)
+	{
+		new->ip = intern_string(client->ip);
+		new->ip_hashv = hash_whowas_ip(new->ip);
+		add_whowas_to_ip_list(&WHOWAS_IP_HASH[new->ip_hashv], new);
+	}
+	if (IsLoggedIn(client))
+	{
+		new->account = intern_string(client->user->svid);
+		new->account_hashv = hash_whowas_account(new->account);
+		add_whowas_to_account_list(&WHOWAS_ACCOUNT_HASH[new->account_hashv], new);
+	}
 	whowas_next++;
 	if (whowas_next == NICKNAMEHISTORYLENGTH)
 		whowas_next = 0;
@@ -144,9 +180,15 @@ void initwhowas()
 	{
 		memset(&WHOWAS[i], 0, sizeof(aWhowas));
 		WHOWAS[i].hashv = -1;
+		WHOWAS[i].ip_hashv = -1;
+		WHOWAS[i].account_hashv = -1;
 	}
 	for (i = 0; i < WHOWAS_HASH_TABLE_SIZE; i++)
+	{
 		WHOWASHASH[i] = NULL;
+		WHOWAS_IP_HASH[i] = NULL;
+		WHOWAS_ACCOUNT_HASH[i] = NULL;
+	}
 }
 
 static void add_whowas_to_clist(aWhowas ** bucket, aWhowas * whowas)
@@ -184,3 +226,39 @@ static void del_whowas_from_list(aWhowas ** bucket, aWhowas * whowas)
 	if (whowas->next)
 		whowas->next->prev = whowas->prev;
 }
+
+static void add_whowas_to_ip_list(aWhowas ** bucket, aWhowas * whowas)
+{
+	whowas->ip_prev = NULL;
+	if ((whowas->ip_next = *bucket) != NULL)
+		whowas->ip_next->ip_prev = whowas;
+	*bucket = whowas;
+}
+
+static void del_whowas_from_ip_list(aWhowas ** bucket, aWhowas * whowas)
+{
+	if (whowas->ip_prev)
+		whowas->ip_prev->ip_next = whowas->ip_next;
+	else
+		*bucket = whowas->ip_next;
+	if (whowas->ip_next)
+		whowas->ip_next->ip_prev = whowas->ip_prev;
+}
+
+static void add_whowas_to_account_list(aWhowas ** bucket, aWhowas * whowas)
+{
+	whowas->account_prev = NULL;
+	if ((whowas->account_next = *bucket) != NULL)
+		whowas->account_next->account_prev = whowas;
+	*bucket = whowas;
+}
+
+static void del_whowas_from_account_list(aWhowas ** bucket, aWhowas * whowas)
+{
+	if (whowas->account_prev)
+		whowas->account_prev->account_next = whowas->account_next;
+	else
+		*bucket = whowas->account_next;
+	if (whowas->account_next)
+		whowas->account_next->account_prev = whowas->account_prev;
+}
@@ -0,0 +1,284 @@
+/*
+ *   Unreal Internet Relay Chat Daemon, src/workers.c
+ *   (C) 2021 The UnrealIRCd Team
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 1, or (at your option)
+ *   any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** @file
+ * @brief Worker threads for blocking or CPU-heavy jobs.
+ *
+ * The daemon itself is single-threaded: all client handling, channel
+ * state and module code runs on the main loop and none of it is safe
+ * to touch from another thread. What we CAN push to other cores is
+ * self-contained work that only operates on its own data - writing a
+ * database snapshot to disk, for example.
+ *
+ * A job consists of a 'work' function, which runs on a worker thread
+ * and must only access the data handed to it, and an optional
+ * 'completion' function, which runs on the main loop afterwards and
+ * may do anything (send notices, free the data, submit more jobs..).
+ * When a worker finishes a job it writes a byte to a wakeup pipe that
+ * is registered with the I/O engine, so a main loop sleeping in
+ * fd_select() picks the completion up immediately.
+ *
+ * On Windows, or if thread support is unavailable, workers_available()
+ * returns 0 and callers fall back to doing the work on the main loop.
+ */
+
+#include "unrealircd.h"
+
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+
+#include <pthread.h>
+
+/** How many worker threads to start */
+#define WORKER_THREADS 2
+
+/** A queued job - internal to this file */
+typedef struct WorkerJob WorkerJob;
+struct WorkerJob {
+	WorkerJob *next;
+	void (*work)(void *data); /**< Runs on a worker thread */
+	void (*completion)(void *data); /**< Runs on the main loop, may be NULL */
+	void *data; /**< Caller payload, handed to both functions */
+};
+
+/* The pending and completed queues are FIFO (per-caller ordering is
+ * easy to reason about that way) and both are guarded by worker_lock.
+ */
+static WorkerJob *pending_head = NULL, *pending_tail = NULL;
+static WorkerJob *completed_head = NULL, *completed_tail = NULL;
+static pthread_mutex_t worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t worker_idle = PTHREAD_COND_INITIALIZER;
+static int worker_count = 0; /**< Threads running (set once, at pool start) */
+static int worker_busy = 0; /**< Jobs currently being executed */
+static int worker_pipe[2] = { -1, -1 }; /**< Self-pipe to wake the main loop */
+
+static void *worker_thread_main(void *arg)
+{
+	WorkerJob *job;
+	int n;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&worker_lock);
+		while (!pending_head)
+			pthread_cond_wait(&worker_wakeup, &worker_lock);
+		job = pending_head;
+		pending_head = job->next;
+		if (!pending_head)
+			pending_tail = NULL;
+		worker_busy++;
+		pthread_mutex_unlock(&worker_lock);
+
+		job->work(job->data);
+
+		pthread_mutex_lock(&worker_lock);
+		job->next = NULL;
+		if (completed_tail)
+			completed_tail->next = job;
+		else
+			completed_head = job;
+		completed_tail = job;
+		worker_busy--;
+		if (!worker_busy && !pending_head)
+			pthread_cond_broadcast(&worker_idle);
+		pthread_mutex_unlock(&worker_lock);
+
+		/* Wake up a main loop sleeping in fd_select(). Any error
+		 * other than EINTR means the pipe is full, in which case a
+		 * wakeup is already pending - fine too.
+		 */
+		do
+		{
+			n = write(worker_pipe[1], "x", 1);
+		} while ((n < 0) && (errno == EINTR));
+	}
+	return NULL;
+}
+
+/** Read callback for the wakeup pipe: drain it and deliver results */
+static void worker_pipe_read(int fd, int revents, void *data)
+{
+	char buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	workers_run();
+}
+
+static void worker_set_nonblocking(int fd)
+{
+	int opt = fcntl(fd, F_GETFL, 0);
+
+	if (opt != -1)
+		(void)fcntl(fd, F_SETFL, opt | O_NONBLOCK);
+}
+
+/** Do we have worker threads? Starts the pool on first use.
+ * @returns 1 if jobs can be submitted, 0 if the caller must do the
+ *          work itself (on the main loop).
+ */
+int workers_available(void)
+{
+	static int failed = 0;
+	pthread_t tid;
+	int i;
+
+	if (worker_count)
+		return 1;
+	if (failed)
+		return 0;
+
+	if (pipe(worker_pipe) < 0)
+	{
+		failed = 1;
+		return 0;
+	}
+	worker_set_nonblocking(worker_pipe[0]);
+	worker_set_nonblocking(worker_pipe[1]);
+	if (fd_open(worker_pipe[0], "Worker wakeup pipe") < 0)
+	{
+		close(worker_pipe[0]);
+		close(worker_pipe[1]);
+		worker_pipe[0] = worker_pipe[1] = -1;
+		failed = 1;
+		return 0;
+	}
+	fd_setselect(worker_pipe[0], FD_SELECT_READ, worker_pipe_read, NULL);
+
+	for (i = 0; i < WORKER_THREADS; i++)
+	{
+		if (pthread_create(&tid, NULL, worker_thread_main, NULL) != 0)
+			break;
+		pthread_detach(tid);
+		worker_count++;
+	}
+	if (!worker_count)
+	{
+		fd_close(worker_pipe[0]);
+		close(worker_pipe[1]);
+		worker_pipe[0] = worker_pipe[1] = -1;
+		failed = 1;
+		return 0;
+	}
+	return 1;
+}
+
+/** Submit a job to the worker pool.
+ * @param work        Runs on a worker thread. It must only touch 'data'
+ *                    (and thread-safe library calls) - no daemon state!
+ * @param completion  Runs on the main loop once 'work' is done. May be
+ *                    NULL. This is the place to report results and to
+ *                    free 'data'.
+ * @param data        Caller payload, handed to both functions.
+ * @returns 1 if the job was queued, 0 if no workers are available (the
+ *          caller should then do the work itself).
+ */
+int worker_submit(void (*work)(void *data), void (*completion)(void *data), void *data)
+{
+	WorkerJob *job;
+
+	if (!workers_available())
+		return 0;
+
+	job = safe_alloc(sizeof(WorkerJob));
+	job->work = work;
+	job->completion = completion;
+	job->data = data;
+
+	pthread_mutex_lock(&worker_lock);
+	if (pending_tail)
+		pending_tail->next = job;
+	else
+		pending_head = job;
+	pending_tail = job;
+	pthread_cond_signal(&worker_wakeup);
+	pthread_mutex_unlock(&worker_lock);
+	return 1;
+}
+
+/** Deliver the results of finished jobs: run their completion
+ * functions on the main loop. Called from the wakeup pipe callback
+ * and from the main loop.
+ */
+void workers_run(void)
+{
+	WorkerJob *job;
+
+	if (!worker_count)
+		return;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&worker_lock);
+		job = completed_head;
+		if (job)
+		{
+			completed_head = job->next;
+			if (!completed_head)
+				completed_tail = NULL;
+		}
+		pthread_mutex_unlock(&worker_lock);
+		if (!job)
+			break;
+		if (job->completion)
+			job->completion(job->data);
+		safe_free(job);
+	}
+}
+
+/** Wait for all submitted jobs to finish and deliver their results.
+ * Called on shutdown / restart, when the main loop can no longer be
+ * relied upon to pick completions up.
+ */
+void workers_flush(void)
+{
+	if (!worker_count)
+		return;
+
+	pthread_mutex_lock(&worker_lock);
+	while (pending_head || worker_busy)
+		pthread_cond_wait(&worker_idle, &worker_lock);
+	pthread_mutex_unlock(&worker_lock);
+
+	workers_run();
+}
+
+#else
+
+/* No thread support: callers fall back to doing the work themselves */
+
+int workers_available(void)
+{
+	return 0;
+}
+
+int worker_submit(void (*work)(void *data), void (*completion)(void *data), void *data)
+{
+	return 0;
+}
+
+void workers_run(void)
+{
+}
+
+void workers_flush(void)
+{
+}
+
+#endif /* HAVE_PTHREAD && !_WIN32 */
@@ -0,0 +1,327 @@
+/*
+ *   Unreal Internet Relay Chat Daemon, src/zip.c
+ *   (C) 2021 The UnrealIRCd Team
+ *
+ *   zlib stream compression for server links.
+ *
+ *   Server-to-server traffic is highly repetitive IRC text and
+ *   compresses 3-5x with a streaming compressor, which directly cuts
+ *   the bandwidth bill of long-haul hub links. Compression used to be
+ *   provided by OpenSSL but was dropped there, so this brings it back
+ *   at the dbuf boundary: outgoing lines are deflated as they are
+ *   queued (sendbufto_one and friends), incoming reads are inflated
+ *   in read_packet() before they reach the parser.
+ *
+ *   The feature is negotiated: both sides must have
+ *   link::options::compressed set, announce it with
+ *   PROTOCTL COMPRESSION=zlib during the handshake, and each side
+ *   starts its outgoing compressed stream directly after sending a
+ *   plaintext COMPRESS line (see server_sync() and cmd_compress() in
+ *   src/modules/server.c), so the switchover point is unambiguous in
+ *   both directions.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 1, or (at your option)
+ *   any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "unrealircd.h"
+#include <zlib.h>
+
+/** Size of the working buffer for one (in/de)flate round.
+ * Output larger than this simply takes several rounds.
+ */
+#define ZIP_BUFFER_SIZE 8192
+
+/** Per-link compression state, hanging off client->local->zip */
+struct ZipLink {
+	z_stream out;			/**< Outgoing deflate stream */
+	z_stream in;			/**< Incoming inflate stream */
+	unsigned out_active:1;		/**< Outgoing stream started? */
+	unsigned in_active:1;		/**< Incoming stream started? */
+	unsigned out_dirty:1;		/**< Deflated data queued since the last flush? */
+	unsigned in_handoff:1;		/**< Raw bytes buffered before activation still need inflating */
+	unsigned long long raw_out;	/**< Outgoing bytes before compression */
+	unsigned long long comp_out;	/**< Outgoing bytes after compression */
+	unsigned long long raw_in;	/**< Incoming bytes after decompression */
+	unsigned long long comp_in;	/**< Incoming bytes before decompression */
+	unsigned long long out_usec;	/**< Microseconds spent deflating */
+	unsigned long long in_usec;	/**< Microseconds spent inflating */
+};
+
+/** Microseconds elapsed since 'from' (for the CPU counters) */
+static unsigned long long zip_elapsed_usec(struct timeval *from)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (unsigned long long)(now.tv_sec - from->tv_sec) * 1000000 +
+	       (now.tv_usec - from->tv_usec);
+}
+
+static ZipLink *zip_alloc_if_needed(Client *client)
+{
+	if (!client->local->zip)
+		client->local->zip = safe_alloc(sizeof(ZipLink));
+	return client->local->zip;
+}
+
+/** Start the outgoing compressed stream for 'client'.
+ * Everything queued via the sendbufto_one() family after this call is
+ * deflated; anything already in the sendq stays plaintext, which is
+ * exactly the boundary the peer expects (see the COMPRESS line).
+ * @retval 1 Success.
+ * @retval 0 zlib initialization failed, the link is unusable as-is.
+ */
+int zip_start_out(Client *client)
+{
+	ZipLink *zip = zip_alloc_if_needed(client);
+
+	memset(&zip->out, 0, sizeof(zip->out));
+	if (deflateInit(&zip->out, Z_DEFAULT_COMPRESSION) != Z_OK)
+		return 0;
+	zip->out_active = 1;
+	return 1;
+}
+
+/** Start the incoming compressed stream for 'client'.
+ * Called when the peer's COMPRESS line is processed. Bytes that were
+ * already buffered behind that line belong to the compressed stream;
+ * the parser detects this via zip_in_handoff_pending() and routes them
+ * through zip_in_data().
+ */
+int zip_start_in(Client *client)
+{
+	ZipLink *zip = zip_alloc_if_needed(client);
+
+	memset(&zip->in, 0, sizeof(zip->in));
+	if (inflateInit(&zip->in) != Z_OK)
+		return 0;
+	zip->in_active = 1;
+	zip->in_handoff = 1;
+	return 1;
+}
+
+int zip_is_out_active(Client *client)
+{
+	return client->local->zip ? client->local->zip->out_active : 0;
+}
+
+int zip_is_in_active(Client *client)
+{
+	return client->local->zip ? client->local->zip->in_active : 0;
+}
+
+/** Do raw bytes buffered from before activation still need inflating? */
+int zip_in_handoff_pending(Client *client)
+{
+	return (client->local->zip && client->local->zip->in_handoff);
+}
+
+/** Release all compression state of 'client' (if any) */
+void zip_free_link(Client *client)
+{
+	ZipLink *zip = client->local->zip;
+
+	if (!zip)
+		return;
+	if (zip->out_active)
+		deflateEnd(&zip->out);
+	if (zip->in_active)
+		inflateEnd(&zip->in);
+	safe_free(client->local->zip);
+	client->local->zip = NULL;
+}
+
+/** Run 'len' bytes through the deflater, appending any produced
+ * compressed output to the sendq.
+ */
+static int zip_deflate(Client *client, char *data, int len, int flush)
+{
+	ZipLink *zip = client->local->zip;
+	char outbuf[ZIP_BUFFER_SIZE];
+	struct timeval start;
+	int r, n;
+
+	gettimeofday(&start, NULL);
+
+	zip->out.next_in = (unsigned char *)data;
+	zip->out.avail_in = len;
+	do
+	{
+		zip->out.next_out = (unsigned char *)outbuf;
+		zip->out.avail_out = sizeof(outbuf);
+		r = deflate(&zip->out, flush);
+		/* Z_BUF_ERROR just means no progress was possible: when the
+		 * previous round filled the output buffer exactly, the loop
+		 * makes one more call that has nothing left to produce.
+		 * Benign - terminate the loop, like zip_in_data() does for
+		 * inflate().
+		 */
+		if (r == Z_BUF_ERROR)
+			break;
+		if (r != Z_OK)
+		{
+			dead_socket(client, "Compression error");
+			return 0;
+		}
+		n = sizeof(outbuf) - zip->out.avail_out;
+		if (n > 0)
+		{
+			dbuf_put(&client->local->sendQ, outbuf, n);
+			zip->comp_out += n;
+		}
+	} while ((zip->out.avail_in > 0) || (zip->out.avail_out == 0));
+
+	zip->raw_out += len;
+	zip->out_usec += zip_elapsed_usec(&start);
+	return 1;
+}
+
+/** Queue 'len' outgoing bytes (one or more complete lines) through the
+ * compressed stream. Output may stay inside the deflater until the
+ * next zip_out_flush(), which send_queued() issues before writing.
+ * @retval 1 Success.
+ * @retval 0 Stream error; the socket has been marked dead.
+ */
+int zip_out_data(Client *client, char *data, int len)
+{
+	if (!zip_deflate(client, data, len, Z_NO_FLUSH))
+		return 0;
+	client->local->zip->out_dirty = 1;
+	return 1;
+}
+
+/** Push everything still inside the deflater out to the sendq, so the
+ * peer receives complete data. Called right before the sendq is
+ * written to the socket; a no-op when nothing was queued since the
+ * previous flush.
+ */
+int zip_out_flush(Client *client)
+{
+	ZipLink *zip = client->local->zip;
+
+	if (!zip->out_dirty)
+		return 1;
+	zip->out_dirty = 0;
+	return zip_deflate(client, NULL, 0, Z_PARTIAL_FLUSH);
+}
+
+/** Inflate 'len' incoming bytes and run the result through the normal
+ * packet processing, in chunks.
+ * @retval 1 Keep reading.
+ * @retval 0 The client died (or the stream broke), stop processing.
+ */
+int zip_in_data(Client *client, char *data, int len)
+{
+	ZipLink *zip = client->local->zip;
+	char inbuf[ZIP_BUFFER_SIZE];
+	struct timeval start;
+	int r, n;
+
+	gettimeofday(&start, NULL);
+	zip->comp_in += len;
+
+	zip->in.next_in = (unsigned char *)data;
+	zip->in.avail_in = len;
+	do
+	{
+		zip->in.next_out = (unsigned char *)inbuf;
+		zip->in.avail_out = sizeof(inbuf);
+		r = inflate(&zip->in, Z_SYNC_FLUSH);
+		if ((r != Z_OK) && (r != Z_BUF_ERROR))
+		{
+			dead_socket(client, "Decompression error");
+			return 0;
+		}
+		n = sizeof(inbuf) - zip->in.avail_out;
+		if (n > 0)
+		{
+			zip->raw_in += n;
+			zip->in_usec += zip_elapsed_usec(&start);
+			if (!process_packet(client, inbuf, n, 0))
+				return 0;
+			/* process_packet may have exited the client or torn
+			 * down the compression state: re-check before the
+			 * next inflate round.
+			 */
+			if (IsDeadSocket(client) || (client->local->zip != zip) || !zip->in_active)
+				return 0;
+			gettimeofday(&start, NULL);
+		}
+	} while ((zip->in.avail_in > 0) || (zip->in.avail_out == 0));
+
+	zip->in_usec += zip_elapsed_usec(&start);
+	return 1;
+}
+
+/** Route raw bytes that were buffered behind the COMPRESS line into the
+ * inflater: the tail of the current read buffer (fast parse path).
+ */
+int zip_in_handoff(Client *client, char *rest, int restlen)
+{
+	client->local->zip->in_handoff = 0;
+	if (restlen <= 0)
+		return 1;
+	return zip_in_data(client, rest, restlen);
+}
+
+/** Same, for bytes that already sit in the recvQ (slow parse path) */
+int zip_in_handoff_recvq(Client *client)
+{
+	dbuf *q = &client->local->recvQ;
+	dbufbuf *block;
+	char *tmp;
+	int len = DBufLength(q);
+	int ofs = 0, ret;
+
+	client->local->zip->in_handoff = 0;
+	if (!len)
+		return 1;
+
+	/* Copy the raw bytes out first: inflating them will put fresh
+	 * plaintext back into this very recvQ.
+	 */
+	tmp = safe_alloc(len);
+	list_for_each_entry2(block, dbufbuf, &q->dbuf_list, dbuf_node)
+	{
+		memcpy(tmp + ofs, DBufBlockData(block), block->size);
+		ofs += block->size;
+	}
+	DBufClear(q);
+
+	ret = zip_in_data(client, tmp, len);
+	safe_free(tmp);
+	return ret;
+}
+
+/** Dump per-link compression statistics, for /STATS T */
+void zip_stats(Client *to)
+{
+	Client *acptr;
+	ZipLink *zip;
+
+	list_for_each_entry(acptr, &server_list, special_node)
+	{
+		zip = acptr->local->zip;
+		if (!zip || !zip->out_active)
+			continue;
+		sendnumericfmt(to, RPL_STATSDEBUG, "zlib link %s: out %lluK->%lluK (%.2fx), in %lluK->%lluK (%.2fx), cpu %llu+%llu msec",
+			acptr->name,
+			zip->raw_out / 1024, zip->comp_out / 1024,
+			zip->comp_out ? (double)zip->raw_out / zip->comp_out : 0.0,
+			zip->comp_in / 1024, zip->raw_in / 1024,
+			zip->comp_in ? (double)zip->raw_in / zip->comp_in : 0.0,
+			zip->out_usec / 1000, zip->in_usec / 1000);
+	}
+}